@@ -252,6 +252,9 @@ int main(int argc, char **argv)
 	patch(1, "allow_kernel_signal", true, false,
 	      COMPAT_HAVE_ALLOW_KERNEL_SIGNAL, "present");
 
+	patch(1, "tls_handshake", true, false,
+	      COMPAT_HAVE_TLS_HANDSHAKE, "present");
+
 /* #define BLKDEV_ISSUE_ZEROOUT_EXPORTED */
 /* #define BLKDEV_ZERO_NOUNMAP */
 
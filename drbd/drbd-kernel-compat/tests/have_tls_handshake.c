@@ -0,0 +1,7 @@
+/* {"version": "6.5", "comment": "The handshake upcall lets tlshd do the TLS handshake on a kernel socket"} */
+#include <net/handshake.h>
+
+int foo(struct tls_handshake_args *args)
+{
+	return tls_client_hello_x509(args, GFP_KERNEL);
+}
@@ -16,15 +16,19 @@
 #include <linux/drbd.h>
 #include <linux/drbd_limits.h>
 #include <linux/dynamic_debug.h>
+#include <linux/hash.h>
+#include <linux/random.h>
 #include "drbd_int.h"
 #include "drbd_wrappers.h"
 #include "drbd_meta_data.h"
 #include "drbd_dax_pmem.h"
+#include "drbd_trace.h"
 
 struct update_peers_work {
        struct drbd_work w;
        struct drbd_peer_device *peer_device;
        unsigned int enr;
+       bool co_target;	/* a sync target of several sources in parallel */
 };
 
 void *drbd_md_get_buffer(struct drbd_device *device, const char *intent)
@@ -75,6 +79,51 @@ void wait_until_done_or_force_detached(struct drbd_device *device, struct drbd_b
 	}
 }
 
+/* With md_poll, every this many writes still wait for the interrupt, to
+ * keep the latency that polling saves measured. */
+#define DRBD_MD_POLL_REFERENCE 64
+
+static bool md_write_may_poll(struct drbd_device *device, struct block_device *bdev, int op_flags)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+
+	if (!READ_ONCE(drbd_md_poll) || !test_bit(QUEUE_FLAG_POLL, &q->queue_flags))
+		return false;
+	/* The flush of a write cache goes through the flush machinery, leave
+	 * those alone. The block layer drops the flags without a cache. */
+	if ((op_flags & REQ_PREFLUSH) && test_bit(QUEUE_FLAG_WC, &q->queue_flags))
+		return false;
+	return (device->md_io.writes[0] + device->md_io.writes[1]) % DRBD_MD_POLL_REFERENCE != 0;
+}
+
+/* Like wait_until_done_or_force_detached(), but reaps the completion
+ * ourselves; a polled bio does not raise an interrupt. */
+static void poll_until_done_or_force_detached(struct drbd_device *device, struct drbd_backing_dev *bdev,
+					      blk_qc_t cookie)
+{
+	struct request_queue *q = bdev_get_queue(bdev->md_bdev);
+	unsigned long timeout;
+	long dt;
+
+	rcu_read_lock();
+	dt = rcu_dereference(bdev->disk_conf)->disk_timeout;
+	rcu_read_unlock();
+	dt = dt * HZ / 10;
+	timeout = jiffies + (dt ?: MAX_JIFFY_OFFSET);
+
+	while (!READ_ONCE(device->md_io.done)) {
+		if (test_bit(FORCE_DETACH, &device->flags))
+			return;
+		if (dt && time_after(jiffies, timeout)) {
+			drbd_err(device, "meta-data IO operation timed out\n");
+			drbd_chk_io_error(device, 1, DRBD_FORCE_DETACH);
+			return;
+		}
+		if (!blk_poll(q, cookie, true))
+			cond_resched();
+	}
+}
+
 static int _drbd_md_sync_page_io(struct drbd_device *device,
 				 struct drbd_backing_dev *bdev,
 				 sector_t sector, int op)
@@ -83,10 +132,17 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 	/* we do all our meta data IO in aligned 4k blocks. */
 	const int size = 4096;
 	int err, op_flags = 0;
+	bool poll = false;
+	blk_qc_t cookie = BLK_QC_T_NONE;
+	ktime_t start_kt;
 
 	if ((op == REQ_OP_WRITE) && !test_bit(MD_NO_FUA, &device->flags))
 		op_flags |= REQ_FUA | REQ_PREFLUSH;
 	op_flags |= REQ_META | REQ_SYNC;
+	if (op == REQ_OP_WRITE && md_write_may_poll(device, bdev->md_bdev, op_flags)) {
+		op_flags |= REQ_HIPRI;
+		poll = true;
+	}
 
 	device->md_io.done = 0;
 	device->md_io.error = -ENODEV;
@@ -115,14 +171,23 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 	bio_get(bio); /* one bio_put() is in the completion handler */
 	atomic_inc(&device->md_io.in_use); /* drbd_md_put_buffer() is in the completion handler */
 	device->md_io.submit_jif = jiffies;
+	start_kt = ktime_get();
 	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
 		bio->bi_status = BLK_STS_IOERR;
 		bio_endio(bio);
+		poll = false;
 	} else {
-		submit_bio(bio);
+		cookie = submit_bio(bio);
 	}
-	wait_until_done_or_force_detached(device, bdev, &device->md_io.done);
+	if (poll)
+		poll_until_done_or_force_detached(device, bdev, cookie);
+	else
+		wait_until_done_or_force_detached(device, bdev, &device->md_io.done);
 	err = device->md_io.error;
+	if (op == REQ_OP_WRITE && device->md_io.done) {
+		device->md_io.writes[poll]++;
+		device->md_io.write_ns[poll] += ktime_to_ns(ktime_sub(ktime_get(), start_kt));
+	}
  out:
 	bio_put(bio);
 	return err;
@@ -177,6 +242,10 @@ find_active_resync_extent(struct get_activity_log_ref_ctx *al_ctx)
 	struct drbd_peer_device *peer_device;
 	struct lc_element *tmp;
 
+	/* Resync waits for application writes by sector instead */
+	if (READ_ONCE(drbd_resync_interval_lock))
+		return NULL;
+
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, al_ctx->device) {
 		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
@@ -207,6 +276,9 @@ set_bme_priority(struct get_activity_log_ref_ctx *al_ctx)
 	struct drbd_peer_device *peer_device;
 	struct lc_element *tmp;
 
+	if (READ_ONCE(drbd_resync_interval_lock))
+		return;
+
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, al_ctx->device) {
 		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
@@ -220,14 +292,17 @@ set_bme_priority(struct get_activity_log_ref_ctx *al_ctx)
 	rcu_read_unlock();
 }
 
+static void al_heat_activated(struct drbd_device *device, unsigned int enr);
+
 static
 struct lc_element *__al_get(struct get_activity_log_ref_ctx *al_ctx)
 {
 	struct drbd_device *device = al_ctx->device;
 	struct lc_element *al_ext = NULL;
 	struct bm_extent *bm_ext;
+	bool activated = false;
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	bm_ext = find_active_resync_extent(al_ctx);
 	if (bm_ext) {
 		set_bme_priority(al_ctx);
@@ -237,8 +312,11 @@ struct lc_element *__al_get(struct get_activity_log_ref_ctx *al_ctx)
 		al_ext = lc_try_get(device->act_log, al_ctx->enr);
 	else
 		al_ext = lc_get(device->act_log, al_ctx->enr);
+	activated = al_ext && al_ext->lc_number != al_ext->lc_new_number;
  out:
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
+	if (activated)
+		al_heat_activated(device, al_ctx->enr);
 	if (al_ctx->wake_up)
 		wake_up(&device->al_wait);
 	return al_ext;
@@ -276,20 +354,20 @@ drbd_dax_begin_io_fp(struct drbd_device *device, unsigned int first, unsigned in
 			goto abort;
 
 		if (al_ext->lc_number != enr) {
-			spin_lock_irqsave(&device->al_lock, flags);
+			drbd_lock_irqsave(&device->al_lock, &device->al_lock_stat, flags);
 			drbd_dax_al_update(device, al_ext);
 			lc_committed(device->act_log);
-			spin_unlock_irqrestore(&device->al_lock, flags);
+			drbd_unlock_irqrestore(&device->al_lock, &device->al_lock_stat, flags);
 		}
 	}
 	return true;
 abort:
 	abort_enr = enr;
 	for (enr = first; enr < abort_enr; enr++) {
-		spin_lock_irqsave(&device->al_lock, flags);
+		drbd_lock_irqsave(&device->al_lock, &device->al_lock_stat, flags);
 		al_ext = lc_find(device->act_log, enr);
 		wake |= lc_put(device->act_log, al_ext) == 0;
-		spin_unlock_irqrestore(&device->al_lock, flags);
+		drbd_unlock_irqrestore(&device->al_lock, &device->al_lock_stat, flags);
 	}
 	if (wake)
 		wake_up(&device->al_wait);
@@ -303,6 +381,76 @@ drbd_dax_begin_io_fp(struct drbd_device *device, unsigned int first, unsigned in
 }
 #endif
 
+static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned int last);
+
+/* Does resync block (or is about to block) application writes anywhere? */
+static bool al_resync_locked(struct drbd_device *device)
+{
+	struct drbd_peer_device *peer_device;
+	bool locked = false;
+
+	if (READ_ONCE(drbd_resync_interval_lock))
+		return false;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		if (READ_ONCE(peer_device->resync_locked)) {
+			locked = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return locked;
+}
+
+/*
+ * Lock free activity log hit: the extent is hot, and in use by other requests
+ * already.  Bail out to the al_lock protected path whenever resync has
+ * extents locked, find_active_resync_extent() needs to look then.
+ */
+static bool al_get_fast(struct drbd_device *device, unsigned int enr)
+{
+	struct lc_element *extent;
+	unsigned long flags;
+	bool wake;
+
+	if (al_resync_locked(device))
+		return false;
+
+	extent = lc_try_get_fast(device->act_log, enr);
+	if (!extent)
+		return false;
+	/* Pairs with the smp_mb() in drbd_try_rs_begin_io():
+	 * either we see resync_locked, or it sees our reference. */
+	if (extent->lc_number == enr && !al_resync_locked(device))
+		return true;
+
+	drbd_lock_irqsave(&device->al_lock, &device->al_lock_stat, flags);
+	wake = lc_put(device->act_log, extent) == 0;
+	drbd_unlock_irqrestore(&device->al_lock, &device->al_lock_stat, flags);
+	if (wake)
+		wake_up(&device->al_wait);
+	return false;
+}
+
+/*
+ * An extent a pipelined transaction still in flight made hot is in core,
+ * but not yet on disk.  Caller holds a reference on the extent.  Its
+ * pipe_seq was set under al_lock before lc_committed() made it visible with
+ * its new number, which is how the caller got its reference.
+ */
+static bool al_extent_on_disk(struct drbd_device *device, unsigned int enr)
+{
+	struct lc_element *e = lc_find_fast(device->act_log, enr);
+	unsigned int seq;
+
+	if (!e)
+		return false;
+	smp_rmb();
+	seq = READ_ONCE(lc_entry(e, struct al_extent, lce)->pipe_seq);
+	return !seq || (int)(READ_ONCE(device->al_pipe.retired) - seq) >= 0;
+}
+
 bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i)
 {
 	/* for bios crossing activity log extent boundaries,
@@ -320,7 +468,15 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 	if (first != last)
 		return false;
 
-	return _al_get_nonblock(device, first) != NULL;
+	if (!al_get_fast(device, first) && _al_get_nonblock(device, first) == NULL)
+		return false;
+
+	if (!al_extent_on_disk(device, first)) {
+		if (put_actlog(device, first, first))
+			wake_up(&device->al_wait);
+		return false;
+	}
+	return true;
 }
 
 #if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT)
@@ -355,7 +511,67 @@ static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
 	return device->ldev->md.md_offset + device->ldev->md.al_offset + t;
 }
 
-static int __al_write_transaction(struct drbd_device *device, struct al_transaction_on_disk *buffer)
+static void drbd_al_write_endio(struct bio *bio)
+{
+	struct drbd_al_pipeline_slot *slot = bio->bi_private;
+	struct drbd_device *device = slot->device;
+
+	slot->error = blk_status_to_errno(bio->bi_status);
+	mempool_free(bio->bi_io_vec[0].bv_page, &drbd_md_io_page_pool);
+	bio_put(bio);
+
+	smp_store_release(&slot->done, true);
+	atomic_dec(&device->al_pipe.in_flight);
+	wake_up(&device->al_wait);
+	/* do_submit() submits the requests waiting for this transaction */
+	queue_work(device->submit.wq, &device->submit.worker);
+	put_ldev(device);
+}
+
+/* Write a copy of the transaction in buffer, without waiting for it */
+static void al_submit_transaction(struct drbd_device *device, void *buffer, sector_t sector,
+				  struct drbd_al_pipeline_slot *slot)
+{
+	int op_flags = REQ_META | REQ_SYNC;
+	struct page *page;
+	struct bio *bio;
+	void *p;
+
+	if (!test_bit(MD_NO_FUA, &device->flags))
+		op_flags |= REQ_FUA | REQ_PREFLUSH;
+
+	page = mempool_alloc(&drbd_md_io_page_pool, GFP_NOIO | __GFP_HIGHMEM);
+	p = kmap_atomic(page);
+	memcpy(p, buffer, 4096);
+	kunmap_atomic(p);
+
+	slot->device = device;
+	slot->tr_number = device->al_tr_number;
+	slot->error = 0;
+	slot->done = false;
+
+	bio = bio_alloc_drbd(GFP_NOIO);
+	bio_set_dev(bio, device->ldev->md_bdev);
+	bio->bi_iter.bi_sector = sector;
+	bio_add_page(bio, page, 4096, 0);
+	bio->bi_private = slot;
+	bio->bi_end_io = drbd_al_write_endio;
+	bio->bi_opf = REQ_OP_WRITE | op_flags;
+
+	/* Caller holds a reference, put_ldev() in drbd_al_write_endio() */
+	get_ldev_if_state(device, D_ATTACHING);
+	atomic_inc(&device->al_pipe.in_flight);
+	if (drbd_insert_fault(device, DRBD_FAULT_MD_WR)) {
+		bio->bi_status = BLK_STS_IOERR;
+		bio_endio(bio);
+	} else {
+		submit_bio(bio);
+	}
+}
+
+/* With a slot, the transaction is submitted asynchronously: returns 1 then */
+static int __al_write_transaction(struct drbd_device *device, struct al_transaction_on_disk *buffer,
+				  struct drbd_al_pipeline_slot *slot)
 {
 	struct lc_element *e;
 	sector_t sector;
@@ -377,7 +593,7 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 	 * once we set the LC_LOCKED -- from drbd_al_begin_io(),
 	 * lc_try_lock_for_transaction() --, someone may still
 	 * be in the process of changing it. */
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	list_for_each_entry(e, &device->act_log->to_be_changed, list) {
 		if (i == AL_UPDATES_PER_TRANSACTION) {
 			i++;
@@ -385,6 +601,8 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		}
 		buffer->update_slot_nr[i] = cpu_to_be16(e->lc_index);
 		buffer->update_extent_nr[i] = cpu_to_be32(e->lc_new_number);
+		if (slot)
+			lc_entry(e, struct al_extent, lce)->pipe_seq = slot->seq + 1;
 		if (e->lc_number != LC_FREE) {
 			unsigned long start, end;
 
@@ -394,7 +612,7 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		}
 		i++;
 	}
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 	BUG_ON(i > AL_UPDATES_PER_TRANSACTION);
 
 	buffer->n_updates = cpu_to_be16(i);
@@ -435,10 +653,14 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		rcu_read_unlock();
 		if (write_al_updates) {
 			ktime_aggregate_delta(device, start_kt, al_mid_kt);
-			if (drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE)) {
+			if (slot) {
+				al_submit_transaction(device, buffer, sector, slot);
+				err = 1;
+			} else if (drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE)) {
 				err = -EIO;
 				drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
-			} else {
+			}
+			if (err >= 0) {
 				device->al_tr_number++;
 				device->al_writ_cnt++;
 				device->al_histogram[min_t(unsigned int,
@@ -452,7 +674,7 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 	return err;
 }
 
-static int al_write_transaction(struct drbd_device *device)
+static int al_write_transaction(struct drbd_device *device, struct drbd_al_pipeline_slot *slot)
 {
 	struct al_transaction_on_disk *buffer;
 	int err;
@@ -480,7 +702,7 @@ static int al_write_transaction(struct drbd_device *device)
 		return -ENODEV;
 	}
 
-	err = __al_write_transaction(device, buffer);
+	err = __al_write_transaction(device, buffer, slot);
 
 	drbd_md_put_buffer(device);
 	put_ldev(device);
@@ -494,9 +716,9 @@ bool drbd_al_try_lock(struct drbd_device *device)
 {
 	bool locked;
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	locked = lc_try_lock(device->act_log);
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 
 	return locked;
 }
@@ -505,21 +727,66 @@ bool drbd_al_try_lock_for_transaction(struct drbd_device *device)
 {
 	bool locked;
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	locked = lc_try_lock_for_transaction(device->act_log);
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 
 	return locked;
 }
 
-void drbd_al_begin_io_commit(struct drbd_device *device)
+/* Reconsider the number of active extents every that many transactions */
+#define AL_AUTO_SIZE_INTERVAL 64
+
+/*
+ * With drbd_al_extents_auto_min set, adjust the soft limit of the activity
+ * log from its miss rate: grow by an eighth while more than one in 32 extent
+ * references has to pull in a new extent, shrink by a sixteenth while less
+ * than one in 256 does.  Surplus extents are then retired as part of the
+ * transaction about to be written, so shrinking costs no extra meta data IO.
+ * Caller holds al_lock, and the act_log locked for a transaction.
+ */
+static void al_auto_size(struct drbd_device *device)
 {
-	bool locked = false;
+	struct lru_cache *al = device->act_log;
+	unsigned int min = READ_ONCE(drbd_al_extents_auto_min);
+	unsigned long hits, pulled, refs;
+	unsigned int target;
+
+	if (!min) {
+		lc_set_max_active(al, al->nr_elements);
+		return;
+	}
 
+	if (device->al_writ_cnt - device->al_auto.writ_cnt >= AL_AUTO_SIZE_INTERVAL) {
+		/* all earlier retirements are committed, so this never goes back */
+		hits = al->hits - device->al_auto.hits;
+		pulled = al->changed - al->retired - device->al_auto.pulled;
+		refs = hits + pulled;
+
+		target = al->max_active;
+		if (pulled * 32 > refs && lc_nr_active(al) >= al->max_active)
+			target += max_t(unsigned int, target / 8, AL_UPDATES_PER_TRANSACTION);
+		else if (pulled * 256 < refs)
+			target -= target / 16;
+		lc_set_max_active(al, clamp(target, min_t(unsigned int, min, al->nr_elements),
+					    al->nr_elements));
+
+		device->al_auto.writ_cnt = device->al_writ_cnt;
+		device->al_auto.hits = al->hits;
+		device->al_auto.pulled = al->changed - al->retired;
+	}
+
+	lc_retire_unused(al);
+}
+
+static bool __drbd_al_begin_io_commit(struct drbd_device *device, struct drbd_al_pipeline_slot *slot)
+{
+	bool locked = false;
+	bool submitted = false;
 
 	if (drbd_md_dax_active(device->ldev)) {
 		drbd_dax_al_begin_io_commit(device);
-		return;
+		return false;
 	}
 
 	wait_event(device->al_wait,
@@ -536,19 +803,57 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 			write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
 			rcu_read_unlock();
 
-			if (write_al_updates)
-				al_write_transaction(device);
-			spin_lock_irq(&device->al_lock);
+			if (write_al_updates) {
+				unsigned int updates = device->act_log->pending_changes;
+				ktime_t start_kt;
+				u64 ns;
+
+				drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
+				al_auto_size(device);
+				drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
+
+				start_kt = ktime_get();
+				submitted = al_write_transaction(device, slot) > 0;
+				ns = ktime_to_ns(ktime_sub(ktime_get(), start_kt));
+				device->al_gc.commits++;
+				device->al_gc.commit_ns += ns;
+				if (ns > device->al_gc.max_commit_ns)
+					device->al_gc.max_commit_ns = ns;
+				trace_drbd_al_commit(device, updates, ns, slot != NULL);
+			}
+			drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 			/* FIXME
 			if (err)
 				we need an "lc_cancel" here;
 			*/
 			lc_committed(device->act_log);
-			spin_unlock_irq(&device->al_lock);
+			drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 		}
 		lc_unlock(device->act_log);
 		wake_up(&device->al_wait);
 	}
+	return submitted;
+}
+
+void drbd_al_begin_io_commit(struct drbd_device *device)
+{
+	__drbd_al_begin_io_commit(device, NULL);
+}
+
+/**
+ * drbd_al_begin_io_commit_pipelined() - Commit pending changes, without waiting for the write
+ * @device:	DRBD device.
+ * @slot:	unused pipeline slot for the transaction
+ *
+ * The changes are committed in core right away.  Returns true if a
+ * transaction was submitted, it is on disk once @slot->done is set.  Until
+ * the slot is retired, requests to the extents it changed stay off the fast
+ * path, see al_extent_on_disk().
+ */
+bool drbd_al_begin_io_commit_pipelined(struct drbd_device *device,
+				       struct drbd_al_pipeline_slot *slot)
+{
+	return __drbd_al_begin_io_commit(device, slot);
 }
 
 static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned int last)
@@ -559,17 +864,24 @@ static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned
 	bool wake = false;
 
 	D_ASSERT(device, first <= last);
-	spin_lock_irqsave(&device->al_lock, flags);
+	/* Not the last reference: no need for the lock, see al_get_fast() */
+	if (first == last) {
+		extent = lc_find_fast(device->act_log, first);
+		if (extent && lc_put_fast(extent))
+			return false;
+	}
+
+	drbd_lock_irqsave(&device->al_lock, &device->al_lock_stat, flags);
 	for (enr = first; enr <= last; enr++) {
 		extent = lc_find(device->act_log, enr);
-		if (!extent || extent->refcnt == 0) {
+		if (!extent || atomic_read(&extent->refcnt) == 0) {
 			drbd_err(device, "al_complete_io() called on inactive extent %u\n", enr);
 			continue;
 		}
 		if (lc_put(device->act_log, extent) == 0)
 			wake = true;
 	}
-	spin_unlock_irqrestore(&device->al_lock, flags);
+	drbd_unlock_irqrestore(&device->al_lock, &device->al_lock_stat, flags);
 	if (wake)
 		wake_up(&device->al_wait);
 	return wake;
@@ -633,6 +945,8 @@ int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_
 
 	if (need_transaction)
 		drbd_al_begin_io_commit(device);
+	/* Extents may be hot in core only, by transactions still in flight */
+	wait_event(device->al_wait, !atomic_read(&device->al_pipe.in_flight));
 	return 0;
 
 }
@@ -693,6 +1007,8 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 		al_ext = lc_get_cumulative(device->act_log, enr);
 		if (!al_ext)
 			drbd_err(device, "LOGIC BUG for enr=%u\n", enr);
+		else if (al_ext->lc_number != al_ext->lc_new_number)
+			al_heat_activated(device, enr);
 	}
 	return 0;
 }
@@ -713,11 +1029,11 @@ static int _try_lc_del(struct drbd_device *device, struct lc_element *al_ext)
 {
 	int rv;
 
-	spin_lock_irq(&device->al_lock);
-	rv = (al_ext->refcnt == 0);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
+	rv = (atomic_read(&al_ext->refcnt) == 0);
 	if (likely(rv))
 		lc_del(device->act_log, al_ext);
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 
 	return rv;
 }
@@ -776,7 +1092,8 @@ static bool extent_in_sync(struct drbd_peer_device *peer_device, unsigned int rs
 }
 
 static void
-consider_sending_peers_in_sync(struct drbd_peer_device *peer_device, unsigned int rs_enr)
+consider_sending_peers_in_sync(struct drbd_peer_device *peer_device, unsigned int rs_enr,
+			       bool co_target)
 {
 	struct drbd_device *device = peer_device->device;
 	u64 mask = NODE_MASK(peer_device->node_id), im;
@@ -790,6 +1107,14 @@ consider_sending_peers_in_sync(struct drbd_peer_device *peer_device, unsigned in
 			mask |= NODE_MASK(p->node_id);
 	}
 
+	/* As the sync target of several sources in parallel, we got parts of
+	 * this extent from the other sources, and this one cleared nothing for
+	 * those parts in its bitmap. Tell each source that it is in sync with
+	 * us, too.
+	 * See rs_set_in_sync_co_sources(). */
+	if (co_target && bm_e_weight(peer_device, rs_enr) == 0)
+		mask |= NODE_MASK(device->resource->res_opts.node_id);
+
 	size_sect = min(BM_SECT_PER_EXT,
 			drbd_get_capacity(device->this_bdev) - BM_EXT_TO_SECT(rs_enr));
 
@@ -809,17 +1134,17 @@ int drbd_al_initialize(struct drbd_device *device, void *buffer)
 	if (drbd_md_dax_active(device->ldev))
 		return drbd_dax_al_initialize(device);
 
-	__al_write_transaction(device, al);
+	__al_write_transaction(device, al, NULL);
 	/* There may or may not have been a pending transaction. */
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	lc_committed(device->act_log);
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 
 	/* The rest of the transactions will have an empty "updates" list, and
 	 * are written out only to provide the context, and to initialize the
 	 * on-disk ring buffer. */
 	for (i = 1; i < al_size_4k; i++) {
-		int err = __al_write_transaction(device, al);
+		int err = __al_write_transaction(device, al, NULL);
 		if (err)
 			return err;
 	}
@@ -833,7 +1158,7 @@ static int w_update_peers(struct drbd_work *w, int unused)
        struct drbd_device *device = peer_device->device;
        struct drbd_connection *connection = peer_device->connection;
 
-       consider_sending_peers_in_sync(peer_device, upw->enr);
+       consider_sending_peers_in_sync(peer_device, upw->enr, upw->co_target);
 
        kfree(upw);
 
@@ -975,6 +1300,8 @@ static bool update_rs_extent(struct drbd_peer_device *peer_device,
 			upw = kmalloc(sizeof(*upw), GFP_ATOMIC | __GFP_NOWARN);
 			if (upw) {
 				upw->enr = ext->lce.lc_number;
+				upw->co_target = peer_device->repl_state[NOW] == L_SYNC_TARGET &&
+					drbd_rs_co_source_mask(peer_device);
 				upw->w.cb = w_update_peers;
 
 				kref_get(&peer_device->device->kref);
@@ -1079,9 +1406,9 @@ static int update_sync_bits(struct drbd_peer_device *peer_device,
 			c = drbd_bm_set_bits(device, bmi, sbnr, tbnr);
 
 		if (c) {
-			spin_lock_irqsave(&device->al_lock, flags);
+			drbd_lock_irqsave(&device->al_lock, &device->al_lock_stat, flags);
 			cleared += update_rs_extent(peer_device, BM_BIT_TO_EXT(sbnr), c, mode);
-			spin_unlock_irqrestore(&device->al_lock, flags);
+			drbd_unlock_irqrestore(&device->al_lock, &device->al_lock_stat, flags);
 			count += c;
 		}
 		sbnr = tbnr + 1;
@@ -1119,7 +1446,7 @@ static bool plausible_request_size(int size)
  * called by worker on L_SYNC_TARGET and receiver on SyncSource.
  *
  */
-int __drbd_change_sync(struct drbd_peer_device *peer_device, sector_t sector, int size,
+static int change_sync(struct drbd_peer_device *peer_device, sector_t sector, int size,
 		enum update_sync_bits_mode mode)
 {
 	/* Is called from worker and receiver context _only_ */
@@ -1178,6 +1505,71 @@ out:
 	return count;
 }
 
+/* Each completed resync write sets its range in sync: bm_lock, mapping the
+ * bitmap page, al_lock for the resync extent, for every few KiB.  The ack
+ * sender completes them in batches (drbd_finish_peer_reqs()), and mostly in
+ * ascending order.  There they are only merged into a pending range, which is
+ * applied as a whole once the next range does not merge, or at the end of the
+ * batch.
+ *
+ * Any other bitmap update for this peer applies the pending range first, and
+ * the range is applied with in_sync_batch_lock held, so bitmap changes keep
+ * the order in which they were requested.  So do the lazy bitmap writeout and
+ * drbd_send_peers_in_sync(), both triggered from within update_sync_bits(). */
+static void __flush_in_sync_batch(struct drbd_peer_device *peer_device)
+{
+	if (peer_device->in_sync_batch_size) {
+		change_sync(peer_device, peer_device->in_sync_batch_sector,
+			    peer_device->in_sync_batch_size, SET_IN_SYNC);
+		peer_device->in_sync_batch_size = 0;
+	}
+}
+
+void drbd_flush_in_sync_batch(struct drbd_peer_device *peer_device)
+{
+	unsigned long flags;
+
+	if (!READ_ONCE(peer_device->in_sync_batch_size))
+		return;
+
+	spin_lock_irqsave(&peer_device->in_sync_batch_lock, flags);
+	__flush_in_sync_batch(peer_device);
+	spin_unlock_irqrestore(&peer_device->in_sync_batch_lock, flags);
+}
+
+void drbd_set_in_sync_batched(struct drbd_peer_device *peer_device, sector_t sector, int size)
+{
+	sector_t end = sector + (size >> 9);
+	sector_t b_start, b_end;
+	unsigned long flags;
+
+	if (!plausible_request_size(size)) {
+		__drbd_change_sync(peer_device, sector, size, SET_IN_SYNC);
+		return;
+	}
+
+	spin_lock_irqsave(&peer_device->in_sync_batch_lock, flags);
+	b_start = peer_device->in_sync_batch_sector;
+	b_end = b_start + (peer_device->in_sync_batch_size >> 9);
+	if (peer_device->in_sync_batch_size && sector <= b_end && b_start <= end &&
+	    max(end, b_end) - min(sector, b_start) <= DRBD_MAX_BATCH_BIO_SIZE >> 9) {
+		sector = min(sector, b_start);
+		end = max(end, b_end);
+	} else {
+		__flush_in_sync_batch(peer_device);
+	}
+	peer_device->in_sync_batch_sector = sector;
+	WRITE_ONCE(peer_device->in_sync_batch_size, (end - sector) << 9);
+	spin_unlock_irqrestore(&peer_device->in_sync_batch_lock, flags);
+}
+
+int __drbd_change_sync(struct drbd_peer_device *peer_device, sector_t sector, int size,
+		enum update_sync_bits_mode mode)
+{
+	drbd_flush_in_sync_batch(peer_device);
+	return change_sync(peer_device, sector, size, mode);
+}
+
 bool drbd_set_all_out_of_sync(struct drbd_device *device, sector_t sector, int size)
 {
 	return drbd_set_sync(device, sector, size, -1, -1);
@@ -1242,6 +1634,7 @@ bool drbd_set_sync(struct drbd_device *device, sector_t sector, int size,
 		if (!test_and_clear_bit(bitmap_index, &mask))
 			continue;
 
+		drbd_flush_in_sync_batch(peer_device);
 		if (test_bit(bitmap_index, &bits))
 			update_sync_bits(peer_device, set_start, set_end, SET_OUT_OF_SYNC);
 
@@ -1274,6 +1667,11 @@ out:
  * Gets an extent in the resync LRU cache, sets it to BME_NO_WRITES, then
  * tries to set it to BME_LOCKED. Returns 0 upon success, and -EAGAIN
  * if there is still application IO going on in this area.
+ *
+ * With resync_interval_lock, the extent is only held for the resync
+ * bookkeeping: it is locked right away, and BME_NO_WRITES does not hold off
+ * application writes.  Resync IO takes its exact range in the write
+ * interval trees instead, see drbd_rs_try_lock_interval().
  */
 int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector, bool throttle)
 {
@@ -1284,8 +1682,11 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 	struct bm_extent *bm_ext;
 	int i;
 
-	if (throttle)
+	if (throttle) {
 		throttle = drbd_rs_should_slow_down(peer_device, sector, true);
+		if (throttle)
+			drbd_rs_tl_add(peer_device, DRBD_RS_TL_THROTTLED, 1);
+	}
 
 	/* If we need to throttle, a half-locked (only marked BME_NO_WRITES,
 	 * not yet BME_LOCKED) extent needs to be kicked out explicitly if we
@@ -1295,7 +1696,7 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 	if (throttle && peer_device->resync_wenr != enr)
 		return -EAGAIN;
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	if (peer_device->resync_wenr != LC_FREE && peer_device->resync_wenr != enr) {
 		/* in case you have very heavy scattered io, it may
 		 * stall the syncer undefined if we give up the ref count
@@ -1340,8 +1741,8 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 			 * but then could not set BME_LOCKED,
 			 * so we tried again.
 			 * drop the extra reference. */
-			bm_ext->lce.refcnt--;
-			D_ASSERT(device, bm_ext->lce.refcnt > 0);
+			atomic_dec(&bm_ext->lce.refcnt);
+			D_ASSERT(device, atomic_read(&bm_ext->lce.refcnt) > 0);
 		}
 		goto check_al;
 	} else {
@@ -1367,25 +1768,31 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 			D_ASSERT(device, test_bit(BME_LOCKED, &bm_ext->flags) == 0);
 		}
 		set_bit(BME_NO_WRITES, &bm_ext->flags);
-		D_ASSERT(device, bm_ext->lce.refcnt == 1);
+		D_ASSERT(device, atomic_read(&bm_ext->lce.refcnt) == 1);
 		peer_device->resync_locked++;
 		goto check_al;
 	}
 check_al:
+	if (READ_ONCE(drbd_resync_interval_lock))
+		goto locked;
+	/* resync_locked is up, before we look at the AL refcounts.
+	 * Pairs with the lock free AL fast path, see al_get_fast(). */
+	smp_mb();
 	for (i = 0; i < AL_EXT_PER_BM_SECT; i++) {
 		if (lc_is_used(device->act_log, al_enr+i))
 			goto try_again;
 	}
+locked:
 	set_bit(BME_LOCKED, &bm_ext->flags);
 proceed:
 	peer_device->resync_wenr = LC_FREE;
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 	return 0;
 
 try_again:
 	if (bm_ext) {
 		if (throttle ||
-		    (test_bit(BME_PRIORITY, &bm_ext->flags) && bm_ext->lce.refcnt == 1)) {
+		    (test_bit(BME_PRIORITY, &bm_ext->flags) && atomic_read(&bm_ext->lce.refcnt) == 1)) {
 			D_ASSERT(peer_device, !test_bit(BME_LOCKED, &bm_ext->flags));
 			D_ASSERT(peer_device, test_bit(BME_NO_WRITES, &bm_ext->flags));
 			clear_bit(BME_NO_WRITES, &bm_ext->flags);
@@ -1399,7 +1806,7 @@ try_again:
 		} else
 			peer_device->resync_wenr = enr;
 	}
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 	return -EAGAIN;
 }
 
@@ -1411,18 +1818,18 @@ void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
 	struct bm_extent *bm_ext;
 	unsigned long flags;
 
-	spin_lock_irqsave(&device->al_lock, flags);
+	drbd_lock_irqsave(&device->al_lock, &device->al_lock_stat, flags);
 	e = lc_find(peer_device->resync_lru, enr);
 	bm_ext = e ? lc_entry(e, struct bm_extent, lce) : NULL;
 	if (!bm_ext) {
-		spin_unlock_irqrestore(&device->al_lock, flags);
+		drbd_unlock_irqrestore(&device->al_lock, &device->al_lock_stat, flags);
 		if (drbd_ratelimit())
 			drbd_err(device, "drbd_rs_complete_io() called, but extent not found\n");
 		return;
 	}
 
-	if (bm_ext->lce.refcnt == 0) {
-		spin_unlock_irqrestore(&device->al_lock, flags);
+	if (atomic_read(&bm_ext->lce.refcnt) == 0) {
+		drbd_unlock_irqrestore(&device->al_lock, &device->al_lock_stat, flags);
 		drbd_err(device, "drbd_rs_complete_io(,%llu [=%u]) called, "
 		    "but refcnt is 0!?\n",
 		    (unsigned long long)sector, enr);
@@ -1435,7 +1842,7 @@ void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
 		wake_up(&device->al_wait);
 	}
 
-	spin_unlock_irqrestore(&device->al_lock, flags);
+	drbd_unlock_irqrestore(&device->al_lock, &device->al_lock_stat, flags);
 }
 
 /**
@@ -1444,7 +1851,7 @@ void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
 void drbd_rs_cancel_all(struct drbd_peer_device *peer_device)
 {
 	struct drbd_device *device = peer_device->device;
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 
 	if (get_ldev_if_state(device, D_DETACHING)) { /* Makes sure ->resync is there. */
 		lc_reset(peer_device->resync_lru);
@@ -1452,7 +1859,7 @@ void drbd_rs_cancel_all(struct drbd_peer_device *peer_device)
 	}
 	peer_device->resync_locked = 0;
 	peer_device->resync_wenr = LC_FREE;
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 	wake_up(&device->al_wait);
 }
 
@@ -1469,7 +1876,7 @@ int drbd_rs_del_all(struct drbd_peer_device *peer_device)
 	struct bm_extent *bm_ext;
 	int i;
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 
 	if (get_ldev_if_state(device, D_DETACHING)) {
 		/* ok, ->resync is there. */
@@ -1488,11 +1895,11 @@ int drbd_rs_del_all(struct drbd_peer_device *peer_device)
 				peer_device->resync_wenr = LC_FREE;
 				lc_put(peer_device->resync_lru, &bm_ext->lce);
 			}
-			if (bm_ext->lce.refcnt != 0) {
+			if (atomic_read(&bm_ext->lce.refcnt) != 0) {
 				drbd_info(peer_device, "Retrying drbd_rs_del_all() later. "
-				     "refcnt=%d\n", bm_ext->lce.refcnt);
+				     "refcnt=%d\n", atomic_read(&bm_ext->lce.refcnt));
 				put_ldev(device);
-				spin_unlock_irq(&device->al_lock);
+				drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 				return -EAGAIN;
 			}
 			D_ASSERT(peer_device, !test_bit(BME_LOCKED, &bm_ext->flags));
@@ -1502,7 +1909,7 @@ int drbd_rs_del_all(struct drbd_peer_device *peer_device)
 		D_ASSERT(peer_device, peer_device->resync_lru->used == 0);
 		put_ldev(device);
 	}
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 	wake_up(&device->al_wait);
 
 	return 0;
@@ -1514,12 +1921,249 @@ bool drbd_sector_has_priority(struct drbd_peer_device *peer_device, sector_t sec
 	struct lc_element *tmp;
 	bool has_priority = false;
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	tmp = lc_find(peer_device->resync_lru, BM_SECT_TO_EXT(sector));
 	if (tmp) {
 		struct bm_extent *bm_ext = lc_entry(tmp, struct bm_extent, lce);
 		has_priority = test_bit(BME_PRIORITY, &bm_ext->flags);
 	}
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 	return has_priority;
 }
+
+/* Chunks of the backing device that user space reported as unallocated
+ * (thin_ls, lvs --segments, FIEMAP of a loop file), see drbd_unallocated_covers().
+ * drbd_unallocated_begin() has to be called before user space takes its
+ * snapshot of the allocation: chunks written after that are never marked.
+ * The maps are sized to at most 1 MiB each, with chunks of at least 64 KiB. */
+#define DRBD_UNALLOC_MIN_SHIFT	7	/* in sectors */
+#define DRBD_UNALLOC_MAX_CHUNKS	(8UL << 20)
+
+int drbd_unallocated_begin(struct drbd_device *device) __must_hold(local)
+{
+	struct drbd_backing_dev *ldev = device->ldev;
+	struct drbd_unallocated *ua = ldev->unallocated;
+	sector_t capacity = drbd_get_capacity(ldev->backing_bdev);
+	unsigned int shift = DRBD_UNALLOC_MIN_SHIFT;
+	unsigned long nr_chunks, i;
+
+	if (ua) {
+		for (i = 0; i < BITS_TO_LONGS(ua->nr_chunks); i++) {
+			xchg(&ua->bits[i], 0);
+			xchg(&ua->written[i], 0);
+		}
+		return 0;
+	}
+
+	while ((capacity >> shift) >= DRBD_UNALLOC_MAX_CHUNKS)
+		shift++;
+	nr_chunks = (capacity + (1UL << shift) - 1) >> shift;
+	ua = kvzalloc(sizeof(*ua) + 2 * BITS_TO_LONGS(nr_chunks) * sizeof(long), GFP_KERNEL);
+	if (!ua)
+		return -ENOMEM;
+	ua->chunk_shift = shift;
+	ua->nr_chunks = nr_chunks;
+	ua->bits = ua->map;
+	ua->written = ua->map + BITS_TO_LONGS(nr_chunks);
+	if (cmpxchg(&ldev->unallocated, NULL, ua) != NULL)
+		kvfree(ua);
+	return 0;
+}
+
+/* Marks the chunks completely inside [sector, sector + nr_sectors) that were
+ * not written since drbd_unallocated_begin() */
+int drbd_unallocated_mark(struct drbd_device *device, sector_t sector, sector_t nr_sectors) __must_hold(local)
+{
+	struct drbd_unallocated *ua = device->ldev->unallocated;
+	unsigned long first, last;
+
+	if (!ua)
+		return -EINVAL;
+	first = (sector + (1UL << ua->chunk_shift) - 1) >> ua->chunk_shift;
+	last = min_t(sector_t, (sector + nr_sectors) >> ua->chunk_shift, ua->nr_chunks);
+	for (; first < last; first++) {
+		/* pairs with drbd_unallocated_clear() */
+		set_bit(first, ua->bits);
+		smp_mb__after_atomic();
+		if (test_bit(first, ua->written))
+			clear_bit(first, ua->bits);
+		if (!(first & 0xffff))
+			cond_resched();
+	}
+	return 0;
+}
+
+/* Before any write reaches the backing device */
+void drbd_unallocated_clear(struct drbd_device *device, sector_t sector, unsigned int size) __must_hold(local)
+{
+	struct drbd_unallocated *ua = device->ldev->unallocated;
+	unsigned long first, last;
+
+	if (!ua || !size)
+		return;
+	first = sector >> ua->chunk_shift;
+	last = min_t(sector_t, (sector + (size >> 9) - 1) >> ua->chunk_shift, ua->nr_chunks - 1);
+	for (; first <= last; first++) {
+		set_bit(first, ua->written);
+		smp_mb__after_atomic();
+		clear_bit(first, ua->bits);
+	}
+}
+
+/* A P_RS_THIN_REQ completely in unallocated chunks reads back zeroes, it is
+ * answered with P_RS_DEALLOCATED without reading it. The caller holds the
+ * resync extent, so no write to the range is in flight. */
+bool drbd_unallocated_covers(struct drbd_device *device, sector_t sector, unsigned int size) __must_hold(local)
+{
+	struct drbd_unallocated *ua = device->ldev->unallocated;
+	unsigned long first, last;
+
+	if (!ua || !size)
+		return false;
+	first = sector >> ua->chunk_shift;
+	last = (sector + (size >> 9) - 1) >> ua->chunk_shift;
+	if (last >= ua->nr_chunks)
+		return false;
+	for (; first <= last; first++)
+		if (!test_bit(first, ua->bits))
+			return false;
+	return true;
+}
+
+unsigned long drbd_unallocated_weight(struct drbd_device *device, unsigned int *chunk_shift) __must_hold(local)
+{
+	struct drbd_unallocated *ua = device->ldev->unallocated;
+
+	if (!ua)
+		return 0;
+	*chunk_shift = ua->chunk_shift;
+	return bitmap_weight(ua->bits, ua->nr_chunks);
+}
+
+static unsigned int al_heat_cell(unsigned int row, unsigned int enr)
+{
+	return hash_32(enr + row * 0x9e3779b9, DRBD_AL_HEAT_WIDTH_SHIFT);
+}
+
+static u32 al_heat_estimate(struct drbd_al_heat *heat, unsigned int enr)
+{
+	u32 est = U32_MAX;
+	unsigned int row;
+
+	for (row = 0; row < DRBD_AL_HEAT_DEPTH; row++)
+		est = min(est, heat->cell[row][al_heat_cell(row, enr)]);
+	return est;
+}
+
+/* log2(x) in 1/256, with a linear mantissa; good enough for linear counting */
+static unsigned int al_heat_log2_fp8(unsigned int x)
+{
+	unsigned int l = ilog2(x);
+
+	return (l << 8) + (((x << 8) >> l) & 0xff);
+}
+
+/* Linear counting: n = m * ln(m / zero bits) */
+static unsigned int al_heat_ws_estimate(struct drbd_al_heat *heat)
+{
+	const unsigned int m = DRBD_AL_HEAT_WS_BITS;
+	unsigned int zero = m - bitmap_weight(heat->ws, m);
+	u64 d;
+
+	d = al_heat_log2_fp8(m) - al_heat_log2_fp8(max(zero, 1U));
+	/* 177/256 ~ ln(2) */
+	return (m * d * 177) >> 16;
+}
+
+unsigned int drbd_al_heat_working_set(struct drbd_al_heat *heat)
+{
+	unsigned long flags;
+	unsigned int n;
+
+	spin_lock_irqsave(&heat->lock, flags);
+	n = al_heat_ws_estimate(heat);
+	spin_unlock_irqrestore(&heat->lock, flags);
+	return n;
+}
+
+static void al_heat_age(struct drbd_al_heat *heat)
+{
+	unsigned int row, i;
+
+	for (row = 0; row < DRBD_AL_HEAT_DEPTH; row++)
+		for (i = 0; i < 1 << DRBD_AL_HEAT_WIDTH_SHIFT; i++)
+			heat->cell[row][i] >>= 1;
+	for (i = 0; i < DRBD_AL_HEAT_TOP; i++)
+		heat->top[i].count >>= 1;
+	heat->ws_last = al_heat_ws_estimate(heat);
+	bitmap_zero(heat->ws, DRBD_AL_HEAT_WS_BITS);
+	heat->window_start = jiffies;
+}
+
+static void al_heat_add(struct drbd_al_heat *heat, unsigned int enr)
+{
+	unsigned int row, i, victim = 0;
+	u32 est = U32_MAX;
+
+	for (row = 0; row < DRBD_AL_HEAT_DEPTH; row++) {
+		u32 *c = &heat->cell[row][al_heat_cell(row, enr)];
+
+		if (*c != U32_MAX)
+			(*c)++;
+		est = min(est, *c);
+	}
+	__set_bit(hash_32(enr, ilog2(DRBD_AL_HEAT_WS_BITS)), heat->ws);
+
+	for (i = 0; i < DRBD_AL_HEAT_TOP; i++) {
+		if (heat->top[i].count && heat->top[i].enr == enr) {
+			heat->top[i].count = est;
+			return;
+		}
+		if (heat->top[i].count < heat->top[victim].count)
+			victim = i;
+	}
+	if (est > heat->top[victim].count) {
+		heat->top[victim].enr = enr;
+		heat->top[victim].count = est;
+	}
+}
+
+/* Called for every application write once it holds its activity log
+ * extents; only one in 2^DRBD_AL_HEAT_SAMPLE_SHIFT is accounted. */
+void drbd_al_heat_sample(struct drbd_device *device, struct drbd_interval *i)
+{
+	struct drbd_al_heat *heat = device->al_heat;
+	unsigned int first, last, enr;
+	unsigned long flags;
+
+	if (!heat || (prandom_u32() & ((1U << DRBD_AL_HEAT_SAMPLE_SHIFT) - 1)))
+		return;
+
+	first = i->sector >> (AL_EXTENT_SHIFT-9);
+	last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+
+	spin_lock_irqsave(&heat->lock, flags);
+	if (time_after(jiffies, heat->window_start + DRBD_AL_HEAT_WINDOW))
+		al_heat_age(heat);
+	heat->samples++;
+	for (enr = first; enr <= last; enr++)
+		al_heat_add(heat, enr);
+	spin_unlock_irqrestore(&heat->lock, flags);
+}
+
+/* An extent became active in the activity log. If it was sampled as hot
+ * recently, it had been evicted while still in use: the AL thrashes. */
+static void al_heat_activated(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_al_heat *heat = device->al_heat;
+	unsigned long flags;
+
+	if (!heat)
+		return;
+
+	spin_lock_irqsave(&heat->lock, flags);
+	heat->activations++;
+	if (al_heat_estimate(heat, enr))
+		heat->reactivations++;
+	spin_unlock_irqrestore(&heat->lock, flags);
+}
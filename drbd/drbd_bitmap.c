@@ -19,6 +19,8 @@
 #include <linux/slab.h>
 #include <linux/dynamic_debug.h>
 #include <linux/libnvdimm.h>
+#include <linux/blkdev.h>
+#include <linux/xxhash.h>
 #include <asm/kmap_types.h>
 
 #include "drbd_int.h"
@@ -184,6 +186,8 @@ void drbd_bm_slot_lock(struct drbd_peer_device *peer_device, char *why, enum bm_
 	_drbd_bm_lock(peer_device->device, peer_device, why, flags);
 }
 
+static void bm_sparse_compact(struct drbd_bitmap *b);
+
 void drbd_bm_unlock(struct drbd_device *device)
 {
 	struct drbd_bitmap *b = device->bitmap;
@@ -192,6 +196,10 @@ void drbd_bm_unlock(struct drbd_device *device)
 		return;
 	}
 
+	/* Nobody accesses the pages lockless right now, see bm_sparse_compact() */
+	if (b->bm_flags & BM_SPARSE)
+		bm_sparse_compact(b);
+
 	if (!(device->bitmap->bm_flags & BM_LOCK_ALL))
 		drbd_err(device, "FIXME bitmap not locked in bm_unlock\n");
 
@@ -248,39 +256,39 @@ static unsigned long bm_page_to_idx(struct page *page)
 	return page_private(page) & BM_PAGE_IDX_MASK;
 }
 
+/* Flags of on-disk bitmap page page_nr */
+static unsigned long *bm_page_flags(struct drbd_bitmap *b, unsigned int page_nr)
+{
+	if (b->bm_flags & BM_CONTIGUOUS)
+		return &b->bm_disk_flags[page_nr];
+	return &page_private(b->bm_pages[page_nr]);
+}
+
 /* As is very unlikely that the same page is under IO from more than one
  * context, we can get away with a bit per page and one wait queue per bitmap.
  */
 static void bm_page_lock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = bm_page_flags(b, page_nr);
 	wait_event(b->bm_io_wait, !test_and_set_bit(BM_PAGE_IO_LOCK, addr));
 }
 
 static void bm_page_unlock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = bm_page_flags(b, page_nr);
 	clear_bit_unlock(BM_PAGE_IO_LOCK, addr);
 	wake_up(&device->bitmap->bm_io_wait);
 }
 
 /* set _before_ submit_io, so it may be reset due to being changed
  * while this page is in flight... will get submitted later again */
-static void bm_set_page_unchanged(struct page *page)
+static void bm_set_page_unchanged(struct drbd_bitmap *b, unsigned int page_nr)
 {
 	/* use cmpxchg? */
-	clear_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
-	clear_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
-}
-
-static void bm_set_page_need_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
-{
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
-		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
-	}
+	clear_bit(BM_PAGE_NEED_WRITEOUT, bm_page_flags(b, page_nr));
+	clear_bit(BM_PAGE_LAZY_WRITEOUT, bm_page_flags(b, page_nr));
 }
 
 void drbd_bm_reset_al_hints(struct drbd_device *device)
@@ -288,33 +296,25 @@ void drbd_bm_reset_al_hints(struct drbd_device *device)
 	device->bitmap->n_bitmap_hints = 0;
 }
 
-static int bm_test_page_unchanged(struct page *page)
+static int bm_test_page_unchanged(struct drbd_bitmap *b, unsigned int page_nr)
 {
-	volatile const unsigned long *addr = &page_private(page);
+	volatile const unsigned long *addr = bm_page_flags(b, page_nr);
 	return (*addr & ((1UL<<BM_PAGE_NEED_WRITEOUT)|(1UL<<BM_PAGE_LAZY_WRITEOUT))) == 0;
 }
 
-static void bm_set_page_io_err(struct page *page)
+static void bm_set_page_io_err(struct drbd_bitmap *b, unsigned int page_nr)
 {
-	set_bit(BM_PAGE_IO_ERROR, &page_private(page));
+	set_bit(BM_PAGE_IO_ERROR, bm_page_flags(b, page_nr));
 }
 
-static void bm_clear_page_io_err(struct page *page)
+static void bm_clear_page_io_err(struct drbd_bitmap *b, unsigned int page_nr)
 {
-	clear_bit(BM_PAGE_IO_ERROR, &page_private(page));
+	clear_bit(BM_PAGE_IO_ERROR, bm_page_flags(b, page_nr));
 }
 
-static void bm_set_page_lazy_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
+static int bm_test_page_lazy_writeout(struct drbd_bitmap *b, unsigned int page_nr)
 {
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
-		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
-	}
-}
-
-static int bm_test_page_lazy_writeout(struct page *page)
-{
-	return test_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
+	return test_bit(BM_PAGE_LAZY_WRITEOUT, bm_page_flags(b, page_nr));
 }
 
 /*
@@ -324,19 +324,33 @@ static int bm_test_page_lazy_writeout(struct page *page)
  */
 
 
-static void bm_free_pages(struct page **pages, unsigned long number)
+/* Once there is a bm_sparse_pool, freed pages refill its reserve first */
+static void bm_free_page(struct drbd_bitmap *b, struct page *page)
+{
+	if (mempool_initialized(&b->bm_sparse_pool))
+		mempool_free(page, &b->bm_sparse_pool);
+	else
+		__free_page(page);
+}
+
+static void bm_free_pages(struct drbd_bitmap *b, struct page **pages, unsigned long number)
 {
 	unsigned long i;
 	if (!pages)
 		return;
 
 	for (i = 0; i < number; i++) {
+		/* BM_SPARSE: all clear, or all set, nothing allocated */
+		if (b->bm_full_page && (!pages[i] || pages[i] == b->bm_full_page)) {
+			pages[i] = NULL;
+			continue;
+		}
 		if (!pages[i]) {
 			pr_alert("bm_free_pages tried to free a NULL pointer; i=%lu n=%lu\n",
 				 i, number);
 			continue;
 		}
-		__free_page(pages[i]);
+		bm_free_page(b, pages[i]);
 		pages[i] = NULL;
 	}
 }
@@ -378,7 +392,7 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 		for (; i < want; i++) {
 			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
 			if (!page) {
-				bm_free_pages(new_pages + have, i - have);
+				bm_free_pages(b, new_pages + have, i - have);
 				kvfree(new_pages);
 				return NULL;
 			}
@@ -391,12 +405,100 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 		for (i = 0; i < want; i++)
 			new_pages[i] = old_pages[i];
 		/* NOT HERE, we are outside the spinlock!
-		bm_free_pages(old_pages + want, have - want);
+		bm_free_pages(b, old_pages + want, have - want);
 		*/
 	}
 	return new_pages;
 }
 
+/* Undo bm_realloc_pages_contiguous(), only frees the newly added pages */
+static void bm_free_pages_contiguous(struct drbd_bitmap *b, struct page **pages, unsigned long ppi)
+{
+	unsigned long oppi = b->bm_pages_per_index;
+	unsigned int bitmap_index;
+	unsigned long i;
+
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		for (i = oppi; i < ppi; i++) {
+			struct page *page = pages[bitmap_index * ppi + i];
+
+			if (page && page != b->bm_full_page)
+				bm_free_page(b, page);
+		}
+	}
+	kvfree(pages);
+}
+
+/*
+ * BM_CONTIGUOUS: bm_pages holds bm_pages_per_index pages per bitmap index.
+ * Keep the existing pages of each index region, add or drop at its end;
+ * dropped pages are freed by the caller, once the new array is in place.
+ */
+static struct page **bm_realloc_pages_contiguous(struct drbd_bitmap *b, unsigned long ppi)
+{
+	unsigned long oppi = b->bm_pages_per_index;
+	unsigned int bitmap_index, bytes;
+	struct page **new_pages;
+	unsigned long i;
+
+	bytes = sizeof(struct page *) * ppi * b->bm_max_peers;
+	new_pages = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!new_pages) {
+		new_pages = __vmalloc(bytes,
+				GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO,
+				PAGE_KERNEL);
+		if (!new_pages)
+			return NULL;
+	}
+
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		for (i = 0; i < ppi; i++) {
+			struct page *page;
+
+			if (i < oppi) {
+				new_pages[bitmap_index * ppi + i] = b->bm_pages[bitmap_index * oppi + i];
+				continue;
+			}
+			/* BM_SPARSE: left NULL, all clear */
+			if (b->bm_flags & BM_SPARSE)
+				continue;
+			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+			if (!page) {
+				bm_free_pages_contiguous(b, new_pages, ppi);
+				return NULL;
+			}
+			new_pages[bitmap_index * ppi + i] = page;
+		}
+	}
+	return new_pages;
+}
+
+/* Same allocation strategy as bm_realloc_pages(), returns all bits set */
+static unsigned long *bm_alloc_summary(unsigned long bits)
+{
+	unsigned int bytes = BITS_TO_LONGS(bits) * sizeof(long);
+	unsigned long *summary;
+
+	summary = kmalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!summary)
+		summary = __vmalloc(bytes, GFP_NOIO | __GFP_HIGHMEM, PAGE_KERNEL);
+	if (summary)
+		bitmap_fill(summary, bits);
+	return summary;
+}
+
+/* BM_CONTIGUOUS: page flags, one long per on-disk bitmap page */
+static unsigned long *bm_alloc_disk_flags(unsigned long pages)
+{
+	unsigned int bytes = pages * sizeof(long);
+	unsigned long *flags;
+
+	flags = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!flags)
+		flags = __vmalloc(bytes, GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO, PAGE_KERNEL);
+	return flags;
+}
+
 struct drbd_bitmap *drbd_bm_alloc(void)
 {
 	struct drbd_bitmap *b;
@@ -423,11 +525,19 @@ sector_t drbd_bm_capacity(struct drbd_device *device)
 
 void drbd_bm_free(struct drbd_bitmap *bitmap)
 {
-	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
+	if (bitmap->bm_flags & BM_ON_DAX_PMEM) {
+		kvfree(bitmap->bm_summary);
+		bitmap->bm_summary = NULL;
 		return;
+	}
 
-	bm_free_pages(bitmap->bm_pages, bitmap->bm_number_of_pages);
+	bm_free_pages(bitmap, bitmap->bm_pages, bm_mem_pages(bitmap));
 	kvfree(bitmap->bm_pages);
+	kvfree(bitmap->bm_summary);
+	kvfree(bitmap->bm_disk_flags);
+	if (bitmap->bm_full_page)
+		__free_page(bitmap->bm_full_page);
+	mempool_exit(&bitmap->bm_sparse_pool);
 	kfree(bitmap);
 }
 
@@ -438,6 +548,30 @@ static inline unsigned long interleaved_word32(struct drbd_bitmap *bitmap,
 	return (bit >> 5) * bitmap->bm_max_peers + bitmap_index;
 }
 
+/* Distance between consecutive 32bit words of one bitmap index in core */
+static inline unsigned int bm_word32_stride(struct drbd_bitmap *bitmap)
+{
+	return (bitmap->bm_flags & BM_CONTIGUOUS) ? 1 : bitmap->bm_max_peers;
+}
+
+/* The 32bit word holding bit of bitmap_index in core */
+static inline unsigned long bm_word32(struct drbd_bitmap *bitmap,
+				      unsigned int bitmap_index,
+				      unsigned long bit)
+{
+	if (bitmap->bm_flags & BM_CONTIGUOUS)
+		return ((bitmap_index * bitmap->bm_pages_per_index) << (PAGE_SHIFT - 2)) +
+			(bit >> 5);
+	return interleaved_word32(bitmap, bitmap_index, bit);
+}
+
+static inline unsigned long bm_mem_pages(struct drbd_bitmap *bitmap)
+{
+	if (bitmap->bm_flags & BM_CONTIGUOUS)
+		return bitmap->bm_pages_per_index * bitmap->bm_max_peers;
+	return bitmap->bm_number_of_pages;
+}
+
 static inline unsigned long word32_to_page(unsigned long word)
 {
 	return word >> (PAGE_SHIFT - 2);
@@ -452,9 +586,9 @@ static inline unsigned long last_bit_on_page(struct drbd_bitmap *bitmap,
 					     unsigned int bitmap_index,
 					     unsigned long bit)
 {
-	unsigned long word = interleaved_word32(bitmap, bitmap_index, bit);
+	unsigned long word = bm_word32(bitmap, bitmap_index, bit);
 
-	return (bit | 31) + ((word32_in_page(-(word + 1)) / bitmap->bm_max_peers) << 5);
+	return (bit | 31) + ((word32_in_page(-(word + 1)) / bm_word32_stride(bitmap)) << 5);
 }
 
 static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
@@ -464,10 +598,128 @@ static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
 	return word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
 }
 
+/* Bits first to last of bitmap_index, all on in core page, have changed.
+ * Flag the on-disk pages holding them. */
+/* On pmem, write back the cache lines holding bits first..last of
+ * bitmap_index right away, instead of writing out the page later */
+static void bm_dax_flush(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+			 unsigned long first, unsigned long last)
+{
+	unsigned long first_word = bm_word32(bitmap, bitmap_index, first);
+	unsigned long last_word = bm_word32(bitmap, bitmap_index, last);
+	__le32 *p = (__le32 *)bitmap->bm_on_pmem + first_word;
+
+	arch_wb_cache_pmem(p, (last_word - first_word + 1) * sizeof(*p));
+}
+
+/* To be called after the words have been modified */
+static void bm_mark_for_writeout(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+				 unsigned int page, unsigned long first, unsigned long last,
+				 int flag)
+{
+	unsigned long page_nr, last_page;
+
+	if (bitmap->bm_flags & BM_ON_DAX_PMEM) {
+		bm_dax_flush(bitmap, bitmap_index, first, last);
+		return;
+	}
+
+	if (!(bitmap->bm_flags & BM_CONTIGUOUS)) {
+		set_bit(flag, bm_page_flags(bitmap, page));
+		return;
+	}
+
+	page_nr = bit_to_page_interleaved(bitmap, bitmap_index, first);
+	last_page = bit_to_page_interleaved(bitmap, bitmap_index, last);
+	for (; page_nr <= last_page; page_nr++)
+		set_bit(flag, &bitmap->bm_disk_flags[page_nr]);
+}
+
+/* The summary bits of one bitmap index are adjacent, so that they can be
+ * cleared at once.  A BM_CONTIGUOUS page holds bits of one index only, it
+ * needs a single summary bit. */
+static inline unsigned long bm_summary_bit(struct drbd_bitmap *bitmap,
+					   unsigned int page, unsigned int bitmap_index)
+{
+	if (bitmap->bm_flags & BM_CONTIGUOUS)
+		return page;
+	return (unsigned long)bitmap_index * bitmap->bm_number_of_pages + page;
+}
+
+/* Summary bits needed for a bitmap of @pages pages in memory */
+static inline unsigned long bm_summary_bits(struct drbd_bitmap *bitmap, unsigned long pages)
+{
+	if (bitmap->bm_flags & BM_CONTIGUOUS)
+		return pages;
+	return pages * bitmap->bm_max_peers;
+}
+
+/* Conservative: without a summary, every page may have bits set */
+static inline bool bm_summary_test(struct drbd_bitmap *bitmap,
+				   unsigned int page, unsigned int bitmap_index)
+{
+	unsigned long nr = bm_summary_bit(bitmap, page, bitmap_index);
+
+	if (!bitmap->bm_summary || nr >= bitmap->bm_summary_bits)
+		return true;
+	return test_bit(nr, bitmap->bm_summary);
+}
+
+static inline void bm_summary_set(struct drbd_bitmap *bitmap,
+				  unsigned int page, unsigned int bitmap_index)
+{
+	unsigned long nr = bm_summary_bit(bitmap, page, bitmap_index);
+
+	if (bitmap->bm_summary && nr < bitmap->bm_summary_bits)
+		__set_bit(nr, bitmap->bm_summary);
+}
+
+static inline void bm_summary_clear(struct drbd_bitmap *bitmap,
+				    unsigned int page, unsigned int bitmap_index)
+{
+	unsigned long nr = bm_summary_bit(bitmap, page, bitmap_index);
+
+	/* atomic, as bm_count_bits() may count several chunks in parallel */
+	if (bitmap->bm_summary && nr < bitmap->bm_summary_bits)
+		clear_bit(nr, bitmap->bm_summary);
+}
+
+/* All bits of that bitmap index are known to be clear.  Called under the
+ * irq disabled bm_lock; clears whole words, a few thousand at most. */
+static void bm_summary_clear_index(struct drbd_bitmap *bitmap, unsigned int bitmap_index)
+{
+	unsigned long first, nr;
+
+	if (!bitmap->bm_summary)
+		return;
+	if (bitmap->bm_flags & BM_CONTIGUOUS) {
+		nr = bitmap->bm_pages_per_index;
+		first = bitmap_index * nr;
+	} else {
+		nr = bitmap->bm_number_of_pages;
+		first = bm_summary_bit(bitmap, 0, bitmap_index);
+	}
+	if (first + nr <= bitmap->bm_summary_bits)
+		bitmap_clear(bitmap->bm_summary, first, nr);
+}
+
+/* BM_SPARSE: a page with all bits clear maps to the zero page, read only */
+static struct page *bm_mem_page(struct drbd_bitmap *bitmap, unsigned long page)
+{
+	return bitmap->bm_pages[page] ?: ZERO_PAGE(0);
+}
+
+static bool bm_page_allocated(struct drbd_bitmap *bitmap, unsigned long page)
+{
+	struct page *p = bitmap->bm_pages[page];
+
+	return p && p != bitmap->bm_full_page;
+}
+
 static void *bm_map(struct drbd_bitmap *bitmap, unsigned int page)
 {
 	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
-		return kmap_atomic(bitmap->bm_pages[page]);
+		return kmap_atomic(bm_mem_page(bitmap, page));
 
 	return ((unsigned char *)bitmap->bm_on_pmem) + (unsigned long)page * PAGE_SIZE;
 }
@@ -478,12 +730,181 @@ static void bm_unmap(struct drbd_bitmap *bitmap, void *addr)
 		kunmap_atomic(addr);
 }
 
+/* Number of bits set in n consecutive 32bit words, using long words where
+ * possible. The bit order within the words does not matter for this. */
+static unsigned long bm_weight32(const __le32 *p, unsigned int n)
+{
+	unsigned long weight = 0;
+	unsigned int longs;
+
+	if (n && !IS_ALIGNED((unsigned long)p, sizeof(long))) {
+		weight += hweight32(le32_to_cpu(*p++));
+		n--;
+	}
+
+	longs = n / (sizeof(long) / sizeof(*p));
+	weight += bitmap_weight((const unsigned long *)p, longs * BITS_PER_LONG);
+	p += longs * (sizeof(long) / sizeof(*p));
+	n -= longs * (sizeof(long) / sizeof(*p));
+
+	while (n--)
+		weight += hweight32(le32_to_cpu(*p++));
+	return weight;
+}
+
+/* BM_SPARSE: new becomes the page of its own of page, with the same
+ * contents.  Called with bm_lock held. */
+static void bm_sparse_install_page(struct drbd_bitmap *bitmap, unsigned int page, struct page *new)
+{
+	struct page *old = bitmap->bm_pages[page];
+
+	if (old)
+		copy_highpage(new, old);
+	else
+		clear_highpage(new);
+	bitmap->bm_pages[page] = new;
+}
+
+/* Same, in atomic context, from the reserve if need be */
+static bool bm_sparse_alloc_page(struct drbd_bitmap *bitmap, unsigned int page)
+{
+	struct page *new = mempool_alloc(&bitmap->bm_sparse_pool, GFP_ATOMIC | __GFP_NOWARN);
+
+	if (!new)
+		return false;
+	bm_sparse_install_page(bitmap, page, new);
+	return true;
+}
+
+/*
+ * BM_SPARSE: modify bits start..last of bitmap_index, all on page, which has
+ * no page of its own yet.  Returns false if the caller should go on with the
+ * page allocated here.  Otherwise the op is complete, and *changed is the
+ * number of bits it changed.
+ *
+ * An all clear page turns into an all set one, or the other way round,
+ * without allocating anything.  If no page can be had in atomic context, a
+ * set operation sets all bits of that page instead, as md does with its
+ * "hijacked" bitmap pages: that only causes more resync, never less.  A
+ * clear operation then clears nothing, the bits get resynced again later.
+ */
+static noinline bool bm_sparse_op(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+				  unsigned int page, unsigned long start, unsigned long last,
+				  bool whole_page, enum bitmap_operations op, __le32 **buffer,
+				  unsigned long *changed)
+{
+	bool full = bitmap->bm_pages[page] == bitmap->bm_full_page;
+	unsigned int words = DIV_ROUND_UP(last - start + 1, 32);
+	unsigned long first, page_last;
+
+	*changed = 0;
+	if ((op == BM_OP_CLEAR ? !full : full) ||
+	    (op == BM_OP_MERGE && !memchr_inv(*buffer, 0, words * sizeof(__le32)))) {
+		/* nothing to clear, already set, or nothing to merge */
+		if (op == BM_OP_MERGE)
+			*buffer += words;
+		return true;
+	}
+
+	if (whole_page && op != BM_OP_MERGE) {
+		bitmap->bm_pages[page] = full ? NULL : bitmap->bm_full_page;
+		first = start;
+		page_last = last;
+	} else if (bm_sparse_alloc_page(bitmap, page)) {
+		return false;
+	} else if (op == BM_OP_CLEAR) {
+		return true;
+	} else {
+		first = (unsigned long)(page - bitmap_index * bitmap->bm_pages_per_index) *
+			BITS_PER_PAGE;
+		page_last = min(last_bit_on_page(bitmap, bitmap_index, start), bitmap->bm_bits - 1);
+		bitmap->bm_pages[page] = bitmap->bm_full_page;
+		if (op == BM_OP_MERGE)
+			*buffer += words;
+	}
+
+	*changed = page_last - first + 1;
+	if (op == BM_OP_CLEAR) {
+		bm_mark_for_writeout(bitmap, bitmap_index, page, first, page_last,
+				     BM_PAGE_LAZY_WRITEOUT);
+		bm_summary_clear(bitmap, page, bitmap_index);
+	} else {
+		bm_mark_for_writeout(bitmap, bitmap_index, page, first, page_last,
+				     BM_PAGE_NEED_WRITEOUT);
+		bm_summary_set(bitmap, page, bitmap_index);
+	}
+	return true;
+}
+
+/*
+ * BM_SPARSE: give back pages that are all clear, or all set.  Pages are only
+ * ever freed here, with bm_change held, as the lockless users of the bitmap
+ * (bitmap exchange, bm_count_bits(), reading it in) all hold that as well.
+ */
+static void bm_sparse_compact(struct drbd_bitmap *b)
+{
+	unsigned long page_nr;
+
+	spin_lock_irq(&b->bm_lock);
+	for (page_nr = 0; page_nr < bm_mem_pages(b); page_nr++) {
+		struct page *page = b->bm_pages[page_nr], *to = page;
+		void *addr;
+
+		if (!bm_page_allocated(b, page_nr))
+			continue;
+
+		addr = kmap_atomic(page);
+		if (!memchr_inv(addr, 0, PAGE_SIZE))
+			to = NULL;
+		else if (!memchr_inv(addr, 0xff, PAGE_SIZE))
+			to = b->bm_full_page;
+		kunmap_atomic(addr);
+
+		if (to != page) {
+			b->bm_pages[page_nr] = to;
+			mempool_free(page, &b->bm_sparse_pool);
+		}
+		if (need_resched()) {
+			spin_unlock_irq(&b->bm_lock);
+			cond_resched();
+			spin_lock_irq(&b->bm_lock);
+		}
+	}
+	spin_unlock_irq(&b->bm_lock);
+}
+
+/* BM_SPARSE: before reading the bitmap in, every page needs its own */
+static int bm_sparse_populate(struct drbd_bitmap *b)
+{
+	unsigned long page_nr;
+
+	for (page_nr = 0; page_nr < bm_mem_pages(b); page_nr++) {
+		struct page *page;
+
+		if (bm_page_allocated(b, page_nr))
+			continue;
+		page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (!page)
+			return -ENOMEM;
+		spin_lock_irq(&b->bm_lock);
+		if (!bm_page_allocated(b, page_nr)) {
+			bm_sparse_install_page(b, page_nr, page);
+			page = NULL;
+		}
+		spin_unlock_irq(&b->bm_lock);
+		if (page)
+			__free_page(page);
+		cond_resched();
+	}
+	return 0;
+}
+
 static __always_inline unsigned long
 ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
 	 enum bitmap_operations op, __le32 *buffer)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned int word32_skip = 32 * bitmap->bm_max_peers;
+	unsigned int word32_skip = 32 * bm_word32_stride(bitmap);
 	unsigned long total = 0;
 	unsigned long word;
 	unsigned int page, bit_in_page;
@@ -491,14 +912,50 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
 
-	word = interleaved_word32(bitmap, bitmap_index, start);
+	word = bm_word32(bitmap, bitmap_index, start);
 	page = word32_to_page(word);
 	bit_in_page = (word32_in_page(word) << 5) | (start & 31);
 
 	for (; start <= end; page++) {
+		unsigned long page_first = start;
+		unsigned long page_total = total;
 		unsigned int count = 0;
+		bool whole_page = false;
 		void *addr;
 
+		if ((op == BM_OP_COUNT || op == BM_OP_FIND_BIT) &&
+		    !bm_summary_test(bitmap, page, bitmap_index)) {
+			start = last_bit_on_page(bitmap, bitmap_index, start) + 1;
+			bit_in_page = word32_in_page(bm_word32(bitmap, bitmap_index, start)) << 5;
+			continue;
+		}
+
+		/* Only ever clear summary bits while holding bm_lock, or
+		 * exclusively (bm_count_bits), thus not for lockless FIND. */
+		if (op == BM_OP_COUNT || op == BM_OP_CLEAR) {
+			/* Does this cover all bits of bitmap_index on this page? */
+			whole_page = !(start & 31) && (bit_in_page >> 5) < bm_word32_stride(bitmap) &&
+				end >= min(last_bit_on_page(bitmap, bitmap_index, start),
+					   bitmap->bm_bits - 1);
+		}
+
+		if ((op == BM_OP_CLEAR || op == BM_OP_SET || op == BM_OP_MERGE) &&
+		    (bitmap->bm_flags & BM_SPARSE) && !bm_page_allocated(bitmap, page)) {
+			unsigned long last = min(last_bit_on_page(bitmap, bitmap_index, start), end);
+			unsigned long changed;
+
+			if (bm_sparse_op(bitmap, bitmap_index, page, start, last,
+					 bit_in_page == 0 &&
+					 last == min(last_bit_on_page(bitmap, bitmap_index, start),
+						     bitmap->bm_bits - 1),
+					 op, &buffer, &changed)) {
+				total += changed;
+				start = last + 1;
+				bit_in_page = 0;
+				continue;
+			}
+		}
+
 		addr = bm_map(bitmap, page);
 		if (((start & 31) && (start | 31) <= end) || op == BM_OP_TEST) {
 			unsigned int last = bit_in_page | 31;
@@ -552,6 +1009,37 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 				goto next_page;
 		}
 
+		/* Without interleaving, the words of this bitmap index are
+		 * contiguous, handle them all at once. */
+		if (bm_word32_stride(bitmap) == 1 &&
+		    (op == BM_OP_COUNT || op == BM_OP_SET || op == BM_OP_CLEAR) &&
+		    start + 31 <= end) {
+			__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
+			unsigned int n = min_t(unsigned long, (BITS_PER_PAGE - bit_in_page) >> 5,
+					       (end - start + 1) >> 5);
+			unsigned long weight = bm_weight32(p, n);
+
+			switch(op) {
+			case BM_OP_COUNT:
+				total += weight;
+				break;
+			case BM_OP_SET:
+				count += n * 32 - weight;
+				memset(p, 0xff, n * sizeof(*p));
+				break;
+			case BM_OP_CLEAR:
+				count += weight;
+				memset(p, 0, n * sizeof(*p));
+				break;
+			default:
+				break;
+			}
+			start += n * 32;
+			bit_in_page += n * 32;
+			if (bit_in_page >= BITS_PER_PAGE)
+				goto next_page;
+		}
+
 		while (start + 31 <= end) {
 			__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
 
@@ -668,17 +1156,26 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		switch(op) {
 		case BM_OP_CLEAR:
 			if (count) {
-				bm_set_page_lazy_writeout(bitmap, page);
+				bm_mark_for_writeout(bitmap, bitmap_index, page, page_first, start - 1,
+						     BM_PAGE_LAZY_WRITEOUT);
 				total += count;
 			}
+			if (whole_page)
+				bm_summary_clear(bitmap, page, bitmap_index);
 			break;
 		case BM_OP_SET:
 		case BM_OP_MERGE:
 			if (count) {
-				bm_set_page_need_writeout(bitmap, page);
+				bm_mark_for_writeout(bitmap, bitmap_index, page, page_first, start - 1,
+						     BM_PAGE_NEED_WRITEOUT);
+				bm_summary_set(bitmap, page, bitmap_index);
 				total += count;
 			}
 			break;
+		case BM_OP_COUNT:
+			if (whole_page && total == page_total)
+				bm_summary_clear(bitmap, page, bitmap_index);
+			break;
 		default:
 			break;
 		}
@@ -690,8 +1187,11 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	}
 	switch(op) {
 	case BM_OP_CLEAR:
-		if (total)
+		if (total) {
 			bitmap->bm_set[bitmap_index] -= total;
+			if (!bitmap->bm_set[bitmap_index])
+				bm_summary_clear_index(bitmap, bitmap_index);
+		}
 		break;
 	case BM_OP_SET:
 	case BM_OP_MERGE:
@@ -794,11 +1294,150 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 
 /* you better not modify the bitmap while this is running,
  * or its results will be stale */
-static void bm_count_bits(struct drbd_device *device)
+/*
+ * Parallel bitmap IO and counting: the on-disk page range is split into
+ * chunks of whole on-disk pages.  A chunk covers the same range of bits
+ * for each bitmap index, regardless of the in core layout.
+ */
+#define BM_IO_CHUNK_MIN_PAGES	256
+#define BM_IO_MAX_CHUNKS	64
+/* Upper limit of pages merged into one bitmap bio */
+#define BM_IO_MAX_BIO_PAGES	64
+
+struct bm_io_chunk {
+	struct work_struct submit_work;
+	struct work_struct count_work;
+	struct drbd_device *device;
+	struct drbd_bm_aio_ctx *ctx; /* NULL if only counting */
+	unsigned int start_page, end_page;
+	atomic_t in_flight; /* bitmap pages of this chunk under IO, +1 while submitting */
+	unsigned int submitted;
+	unsigned long *bits_set; /* [bm_max_peers] */
+};
+
+static unsigned int bm_io_nr_chunks(struct drbd_bitmap *b)
 {
+	unsigned int nr = drbd_bitmap_io_workers ?: num_online_cpus();
+
+	nr = min3(nr, (unsigned int)BM_IO_MAX_CHUNKS,
+		  (unsigned int)(b->bm_number_of_pages / BM_IO_CHUNK_MIN_PAGES));
+	if (!(b->bm_flags & BM_ON_DAX_PMEM) && nr > 1)
+		return nr;
+	return 1;
+}
+
+/* Chunks [nr] and their bits_set counters [nr][bm_max_peers] in one allocation */
+static struct bm_io_chunk *bm_alloc_chunks(struct drbd_device *device, unsigned int nr,
+					   unsigned int *chunk_pages)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned long *bits_set;
+	struct bm_io_chunk *chunks;
+	unsigned int i, bytes;
+
+	bytes = nr * (sizeof(*chunks) + b->bm_max_peers * sizeof(long));
+	chunks = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!chunks)
+		return NULL;
+
+	*chunk_pages = DIV_ROUND_UP(b->bm_number_of_pages, nr);
+	bits_set = (unsigned long *)(chunks + nr);
+	for (i = 0; i < nr; i++) {
+		struct bm_io_chunk *chunk = &chunks[i];
+
+		chunk->device = device;
+		chunk->start_page = i * *chunk_pages;
+		chunk->end_page = min_t(unsigned long, (i + 1) * *chunk_pages, b->bm_number_of_pages) - 1;
+		chunk->bits_set = bits_set + i * b->bm_max_peers;
+		atomic_set(&chunk->in_flight, 1);
+	}
+	return chunks;
+}
+
+/* First bit of bitmap_index stored in, or after, on-disk page page_nr */
+static unsigned long bm_first_bit_on_disk_page(struct drbd_bitmap *b,
+		unsigned int bitmap_index, unsigned long page_nr)
+{
+	unsigned long word32 = page_nr << (PAGE_SHIFT - 2);
+
+	if (word32 <= bitmap_index)
+		return 0;
+	return DIV_ROUND_UP(word32 - bitmap_index, b->bm_max_peers) << 5;
+}
+
+static void bm_count_chunk(struct bm_io_chunk *chunk)
+{
+	struct drbd_device *device = chunk->device;
 	struct drbd_bitmap *bitmap = device->bitmap;
 	unsigned int bitmap_index;
 
+	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
+		unsigned long bit, end, bits_set = 0;
+
+		bit = bm_first_bit_on_disk_page(bitmap, bitmap_index, chunk->start_page);
+		end = min(bm_first_bit_on_disk_page(bitmap, bitmap_index, chunk->end_page + 1),
+			  bitmap->bm_bits);
+		while (bit < end) {
+			unsigned long last_bit = min(last_bit_on_page(bitmap, bitmap_index, bit), end - 1);
+
+			bits_set += ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL);
+			bit = last_bit + 1;
+			cond_resched();
+		}
+		chunk->bits_set[bitmap_index] = bits_set;
+	}
+}
+
+static void bm_sum_chunks(struct drbd_bitmap *bitmap, struct bm_io_chunk *chunks, unsigned int nr)
+{
+	unsigned int bitmap_index, i;
+
+	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
+		unsigned long bits_set = 0;
+
+		for (i = 0; i < nr; i++)
+			bits_set += chunks[i].bits_set[bitmap_index];
+		bitmap->bm_set[bitmap_index] = bits_set;
+	}
+}
+
+static void bm_aio_ctx_put_in_flight(struct drbd_bm_aio_ctx *ctx);
+
+static void bm_count_chunk_work(struct work_struct *ws)
+{
+	struct bm_io_chunk *chunk = container_of(ws, struct bm_io_chunk, count_work);
+
+	bm_count_chunk(chunk);
+	if (chunk->ctx)
+		bm_aio_ctx_put_in_flight(chunk->ctx);
+}
+
+static void bm_count_bits(struct drbd_device *device)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned int bitmap_index, nr, chunk_pages, i;
+	struct bm_io_chunk *chunks = NULL;
+
+	/* The page contents may have changed behind our back, start over.
+	 * The BM_OP_COUNT below clears the summary bits of empty pages again. */
+	if (bitmap->bm_summary)
+		bitmap_fill(bitmap->bm_summary, bitmap->bm_summary_bits);
+
+	nr = bm_io_nr_chunks(bitmap);
+	if (nr > 1)
+		chunks = bm_alloc_chunks(device, nr, &chunk_pages);
+	if (chunks) {
+		for (i = 0; i < nr; i++) {
+			INIT_WORK(&chunks[i].count_work, bm_count_chunk_work);
+			queue_work(drbd_bitmap_io_wq, &chunks[i].count_work);
+		}
+		for (i = 0; i < nr; i++)
+			flush_work(&chunks[i].count_work);
+		bm_sum_chunks(bitmap, chunks, nr);
+		kfree(chunks);
+		return;
+	}
+
 	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
 		unsigned long bit = 0, bits_set = 0;
 
@@ -830,6 +1469,59 @@ static u64 drbd_md_on_disk_bits(struct drbd_device *device)
 	return word64_on_disk << 6; /* x * 64 */;
 }
 
+/* Bits per bm_lock hold when initializing the grown part of the bitmap,
+ * 128 KiB worth of one bitmap index */
+#define BM_GROW_CHUNK_BITS	(1UL << 20)
+
+/*
+ * Set (or clear) bits obits to the end of every bitmap index after growing.
+ * On a large grow that is hundreds of MiB, so do it in pieces and drop
+ * bm_lock in between, instead of spinning with interrupts disabled for all
+ * of it.  Caller holds BM_LOCK_ALL, and application IO is suspended.
+ *
+ * That only bounds the irq off sections.  IO stays frozen until every new
+ * bit is initialized, as before: the new bits are visible from the moment
+ * bm_bits grows, so nothing may use them earlier.  A grow by terabytes
+ * still stalls IO for the time it takes to write that much memory.
+ */
+static void bm_init_grown_range(struct drbd_device *device, unsigned long obits, bool set)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int bitmap_index;
+	unsigned long start;
+
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		for (start = obits; start < b->bm_bits; start += BM_GROW_CHUNK_BITS) {
+			spin_lock_irq(&b->bm_lock);
+			___bm_op(device, bitmap_index, start, start + BM_GROW_CHUNK_BITS - 1,
+				 set ? BM_OP_SET : BM_OP_CLEAR, NULL);
+			spin_unlock_irq(&b->bm_lock);
+			cond_resched();
+		}
+	}
+}
+
+/* Pages kept in reserve for BM_SPARSE, to set bits in atomic context */
+#define BM_SPARSE_RESERVE_PAGES	16
+
+static int bm_sparse_init(struct drbd_bitmap *b)
+{
+	void *addr;
+
+	if (!mempool_initialized(&b->bm_sparse_pool) &&
+	    mempool_init_page_pool(&b->bm_sparse_pool, BM_SPARSE_RESERVE_PAGES, 0))
+		return -ENOMEM;
+	if (!b->bm_full_page) {
+		b->bm_full_page = alloc_page(GFP_NOIO);
+		if (!b->bm_full_page)
+			return -ENOMEM;
+		addr = kmap_atomic(b->bm_full_page);
+		memset(addr, 0xff, PAGE_SIZE);
+		kunmap_atomic(addr);
+	}
+	return 0;
+}
+
 /*
  * make sure the bitmap has enough room for the attached storage,
  * if necessary, resize.
@@ -844,6 +1536,9 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	unsigned long bits, words, obits;
 	unsigned long want, have, onpages; /* number of pages */
 	struct page **npages = NULL, **opages = NULL;
+	unsigned long *nsummary, *osummary;
+	unsigned long *ndisk_flags = NULL, *odisk_flags = NULL;
+	unsigned long ppi = 0, oppi, mem_pages; /* pages per index, BM_CONTIGUOUS */
 	void *bm_on_pmem = NULL;
 	int err = 0;
 	bool growing;
@@ -864,9 +1559,16 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 		spin_lock_irq(&b->bm_lock);
 		opages = b->bm_pages;
-		onpages = b->bm_number_of_pages;
+		onpages = bm_mem_pages(b);
+		osummary = b->bm_summary;
+		odisk_flags = b->bm_disk_flags;
 		b->bm_pages = NULL;
 		b->bm_number_of_pages = 0;
+		b->bm_summary = NULL;
+		b->bm_summary_bits = 0;
+		b->bm_disk_flags = NULL;
+		b->bm_pages_per_index = 0;
+		b->bm_flags &= ~(BM_CONTIGUOUS | BM_SPARSE);
 		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
 			b->bm_set[bitmap_index] = 0;
 		b->bm_bits = 0;
@@ -874,9 +1576,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		b->bm_dev_capacity = 0;
 		spin_unlock_irq(&b->bm_lock);
 		if (!(b->bm_flags & BM_ON_DAX_PMEM)) {
-			bm_free_pages(opages, onpages);
+			bm_free_pages(b, opages, onpages);
 			kvfree(opages);
 		}
+		kvfree(osummary);
+		kvfree(odisk_flags);
 		goto out;
 	}
 	bits  = BM_SECT_TO_BIT(ALIGN(capacity, BM_SECT_PER_BIT));
@@ -895,8 +1599,41 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 	want = ALIGN(words*sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
 	have = b->bm_number_of_pages;
+	/* The in core layout is chosen when the bitmap gets its first pages.
+	 * On DAX, the bitmap is used in place on pmem, with on-disk layout. */
+	if (have == 0) {
+		if (drbd_bitmap_contiguous && b->bm_max_peers > 1 &&
+		    !drbd_md_dax_active(device->ldev))
+			b->bm_flags |= BM_CONTIGUOUS;
+		else
+			b->bm_flags &= ~BM_CONTIGUOUS;
+		if ((b->bm_flags & BM_CONTIGUOUS) && drbd_bitmap_sparse &&
+		    bm_sparse_init(b) == 0)
+			b->bm_flags |= BM_SPARSE;
+		else
+			b->bm_flags &= ~BM_SPARSE;
+	}
 	if (drbd_md_dax_active(device->ldev)) {
 		bm_on_pmem = drbd_dax_bitmap(device, want);
+	} else if (b->bm_flags & BM_CONTIGUOUS) {
+		ppi = DIV_ROUND_UP(ALIGN(bits, 64), BITS_PER_PAGE);
+		if (ppi == b->bm_pages_per_index) {
+			D_ASSERT(device, b->bm_pages != NULL);
+			npages = b->bm_pages;
+		} else if (!drbd_insert_fault(device, DRBD_FAULT_BM_ALLOC)) {
+			npages = bm_realloc_pages_contiguous(b, ppi);
+		}
+		if (npages && want != have) {
+			ndisk_flags = bm_alloc_disk_flags(want);
+			if (ndisk_flags && have)
+				memcpy(ndisk_flags, b->bm_disk_flags, min(want, have) * sizeof(long));
+		}
+		if (!npages || (want != have && !ndisk_flags)) {
+			if (npages && npages != b->bm_pages)
+				bm_free_pages_contiguous(b, npages, ppi);
+			err = -ENOMEM;
+			goto out;
+		}
 	} else {
 		if (want == have) {
 			D_ASSERT(device, b->bm_pages != NULL);
@@ -914,7 +1651,15 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		}
 	}
 
+	/* Not fatal if this fails, we just do not skip empty pages then.
+	 * All set, the bm_count_bits() or later scans clear what is empty. */
+	mem_pages = ppi ? ppi * b->bm_max_peers : want;
+	nsummary = bm_alloc_summary(bm_summary_bits(b, mem_pages));
+
 	spin_lock_irq(&b->bm_lock);
+	osummary = b->bm_summary;
+	b->bm_summary = nsummary;
+	b->bm_summary_bits = nsummary ? bm_summary_bits(b, mem_pages) : 0;
 	obits  = b->bm_bits;
 
 	growing = bits > obits;
@@ -931,39 +1676,47 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		opages = b->bm_pages;
 		b->bm_pages = npages;
 	}
+	oppi = b->bm_pages_per_index;
+	b->bm_pages_per_index = ppi;
+	if (ndisk_flags) {
+		odisk_flags = b->bm_disk_flags;
+		b->bm_disk_flags = ndisk_flags;
+	}
 	b->bm_number_of_pages = want;
 	b->bm_bits  = bits;
 	b->bm_words = words;
 	b->bm_dev_capacity = capacity;
 
-	if (growing) {
-		unsigned int bitmap_index;
-
-		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
-			unsigned long bm_set = b->bm_set[bitmap_index];
+	/* The grown part is initialized below, by bm_init_grown_range().
+	 * Without a summary, nothing of it is skipped meanwhile. */
+	if (growing && b->bm_summary)
+		bitmap_fill(b->bm_summary, b->bm_summary_bits);
 
-			if (set_new_bits) {
-				___bm_op(device, bitmap_index, obits, -1UL, BM_OP_SET, NULL);
-				bm_set += bits - obits;
-			}
-			else
-				___bm_op(device, bitmap_index, obits, -1UL, BM_OP_CLEAR, NULL);
+	if (b->bm_flags & BM_CONTIGUOUS) {
+		unsigned int bitmap_index;
 
-			b->bm_set[bitmap_index] = bm_set;
+		/* pages beyond the new end of each index region */
+		if (ppi < oppi) {
+			for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+				bm_free_pages(b, opages + bitmap_index * oppi + ppi, oppi - ppi);
 		}
-	}
-
-	if (want < have && !(b->bm_flags & BM_ON_DAX_PMEM)) {
+	} else if (want < have && !(b->bm_flags & BM_ON_DAX_PMEM)) {
 		/* implicit: (opages != NULL) && (opages != npages) */
-		bm_free_pages(opages + want, have - want);
+		bm_free_pages(b, opages + want, have - want);
 	}
 
 	spin_unlock_irq(&b->bm_lock);
 	if (opages != npages)
 		kvfree(opages);
-	if (!growing)
+	kvfree(osummary);
+	kvfree(odisk_flags);
+	if (growing)
+		bm_init_grown_range(device, obits, set_new_bits);
+	else
 		bm_count_bits(device);
-	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu\n", bits, words, want);
+	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu%s%s\n", bits, words, want,
+		  (b->bm_flags & BM_CONTIGUOUS) ? " contiguous" : "",
+		  (b->bm_flags & BM_SPARSE) ? " sparse" : "");
 
  out:
 	drbd_bm_unlock(device);
@@ -1059,6 +1812,36 @@ void drbd_bm_get_lel(struct drbd_peer_device *peer_device, size_t offset, size_t
 	bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_EXTRACT, (__le32 *)buffer);
 }
 
+/* xxh64 of the bitmap of a peer, over the little endian words that
+ * P_BITMAP packets would carry, and the number of bits. */
+int drbd_bm_digest(struct drbd_peer_device *peer_device, u64 *digest)
+{
+	struct drbd_device *device = peer_device->device;
+	const size_t words = drbd_bm_words(device);
+	const size_t chunk = PAGE_SIZE / sizeof(unsigned long);
+	unsigned long *buffer;
+	struct xxh64_state state;
+	__le64 bits;
+	size_t offset, n;
+
+	buffer = (unsigned long *)__get_free_page(GFP_NOIO);
+	if (!buffer)
+		return -ENOMEM;
+
+	xxh64_reset(&state, 0);
+	bits = cpu_to_le64(drbd_bm_bits(device));
+	xxh64_update(&state, &bits, sizeof(bits));
+	for (offset = 0; offset < words; offset += n) {
+		n = min(chunk, words - offset);
+		drbd_bm_get_lel(peer_device, offset, n, buffer);
+		xxh64_update(&state, buffer, n * sizeof(*buffer));
+		cond_resched();
+	}
+	*digest = xxh64_digest(&state);
+
+	free_page((unsigned long)buffer);
+	return 0;
+}
 
 static void drbd_bm_aio_ctx_destroy(struct kref *kref)
 {
@@ -1069,89 +1852,203 @@ static void drbd_bm_aio_ctx_destroy(struct kref *kref)
 	list_del(&ctx->list);
 	spin_unlock_irqrestore(&ctx->device->pending_bmio_lock, flags);
 	put_ldev(ctx->device);
+	kfree(ctx->chunks);
 	kfree(ctx);
 }
 
+static void bm_aio_ctx_put_in_flight(struct drbd_bm_aio_ctx *ctx)
+{
+	if (atomic_dec_and_test(&ctx->in_flight)) {
+		ctx->done = 1;
+		wake_up(&ctx->device->misc_wait);
+		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
+	}
+}
+
+/* After a read, count the bits of a chunk as soon as all its pages are in */
+static void bm_chunk_put_in_flight(struct drbd_bm_aio_ctx *ctx, struct bm_io_chunk *chunk)
+{
+	if (!atomic_dec_and_test(&chunk->in_flight))
+		return;
+	if ((ctx->flags & BM_AIO_READ) && !ctx->error) {
+		/* ctx->in_flight is still held by the caller, not yet done */
+		atomic_inc(&ctx->in_flight);
+		queue_work(drbd_bitmap_io_wq, &chunk->count_work);
+	}
+}
+
 /* bv_page may be a copy, or may be the original */
+/* With BM_CONTIGUOUS, the on-disk (interleaved) page page_nr is assembled
+ * from, or spread out to, the per bitmap index regions in core. */
+static void bm_xfer_disk_page(struct drbd_bitmap *b, unsigned int page_nr,
+			      struct page *disk_page, bool to_disk)
+{
+	unsigned long words32_total = b->bm_words * sizeof(long) / sizeof(u32);
+	unsigned long first = (unsigned long)page_nr << (PAGE_SHIFT - 2);
+	unsigned long mem_page = -1UL;
+	__le32 *disk, *mem = NULL;
+	unsigned int i;
+
+	disk = kmap_atomic(disk_page);
+	for (i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+		unsigned long d = first + i;
+		unsigned long m;
+
+		if (d >= words32_total) {
+			if (to_disk)
+				disk[i] = 0;
+			continue;
+		}
+
+		m = bm_word32(b, d % b->bm_max_peers, (d / b->bm_max_peers) << 5);
+		if (word32_to_page(m) != mem_page) {
+			if (mem)
+				kunmap_atomic(mem);
+			mem_page = word32_to_page(m);
+			mem = kmap_atomic(bm_mem_page(b, mem_page));
+		}
+		if (to_disk)
+			disk[i] = mem[word32_in_page(m)];
+		else
+			mem[word32_in_page(m)] = disk[i];
+	}
+	if (mem)
+		kunmap_atomic(mem);
+	kunmap_atomic(disk);
+}
+
 static void drbd_bm_endio(struct bio *bio)
 {
 	struct drbd_bm_aio_ctx *ctx = bio->bi_private;
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
-	unsigned int idx = bm_page_to_idx(bio->bi_io_vec[0].bv_page);
-
 	blk_status_t status = bio->bi_status;
+	bool copy = (ctx->flags & BM_AIO_COPY_PAGES) || (b->bm_flags & BM_CONTIGUOUS);
+	unsigned short i;
+
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		struct page *page = bio->bi_io_vec[i].bv_page;
+		unsigned int idx = bm_page_to_idx(page);
+
+		if (!copy && !bm_test_page_unchanged(b, idx))
+			drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
+
+		if (status) {
+			/* ctx error will hold the completed-last non-zero error code,
+			 * in case error codes differ. */
+			ctx->error = blk_status_to_errno(status);
+			bm_set_page_io_err(b, idx);
+			/* Not identical to on disk version of it.
+			 * Is BM_PAGE_IO_ERROR enough? */
+			if (drbd_ratelimit())
+				drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
+					 status, idx);
+		} else {
+			bm_clear_page_io_err(b, idx);
+			if ((b->bm_flags & BM_CONTIGUOUS) && (ctx->flags & BM_AIO_READ))
+				bm_xfer_disk_page(b, idx, page, false);
+			dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
+		}
 
-	if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
-	    !bm_test_page_unchanged(b->bm_pages[idx]))
-		drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
-
-	if (status) {
-		/* ctx error will hold the completed-last non-zero error code,
-		 * in case error codes differ. */
-		ctx->error = blk_status_to_errno(status);
-		bm_set_page_io_err(b->bm_pages[idx]);
-		/* Not identical to on disk version of it.
-		 * Is BM_PAGE_IO_ERROR enough? */
-		if (drbd_ratelimit())
-			drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
-				 status, idx);
-	} else {
-		bm_clear_page_io_err(b->bm_pages[idx]);
-		dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
-	}
+		bm_page_unlock_io(device, idx);
 
-	bm_page_unlock_io(device, idx);
+		if (copy)
+			mempool_free(page, &drbd_md_io_page_pool);
 
-	if (ctx->flags & BM_AIO_COPY_PAGES)
-		mempool_free(bio->bi_io_vec[0].bv_page, &drbd_md_io_page_pool);
+		if (ctx->chunks)
+			bm_chunk_put_in_flight(ctx, &ctx->chunks[idx / ctx->chunk_pages]);
+	}
 
 	bio_put(bio);
-
-	if (atomic_dec_and_test(&ctx->in_flight)) {
-		ctx->done = 1;
-		wake_up(&device->misc_wait);
-		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
-	}
+	bm_aio_ctx_put_in_flight(ctx);
 }
 
-static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_hold(local)
+/* Prepare bitmap page page_nr for IO, returns the page to add to the bio,
+ * or NULL if no bounce page was available without waiting */
+static struct page *bm_prepare_page_io(struct drbd_bm_aio_ctx *ctx, unsigned int page_nr,
+				       gfp_t gfp_mask)
 {
-	struct bio *bio = bio_alloc_drbd(GFP_NOIO);
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page;
-	unsigned int len;
-	unsigned int op = (ctx->flags & BM_AIO_READ) ? REQ_OP_READ : REQ_OP_WRITE;
+	bool copy = (ctx->flags & BM_AIO_COPY_PAGES) || (b->bm_flags & BM_CONTIGUOUS);
+	struct page *page = NULL;
 
-	sector_t on_disk_sector =
-		device->ldev->md.md_offset + device->ldev->md.bm_offset;
-	on_disk_sector += ((sector_t)page_nr) << (PAGE_SHIFT-9);
-
-	/* this might happen with very small
-	 * flexible external meta data device,
-	 * or with PAGE_SIZE > 4k */
-	len = min_t(unsigned int, PAGE_SIZE,
-		(drbd_md_last_sector(device->ldev) - on_disk_sector + 1)<<9);
+	if (copy) {
+		page = mempool_alloc(&drbd_md_io_page_pool, gfp_mask | __GFP_HIGHMEM);
+		if (!page)
+			return NULL;
+	}
 
 	/* serialize IO on this page */
 	bm_page_lock_io(device, page_nr);
 	/* before memcpy and submit,
 	 * so it can be redirtied any time */
-	bm_set_page_unchanged(b->bm_pages[page_nr]);
-
-	if (ctx->flags & BM_AIO_COPY_PAGES) {
-		page = mempool_alloc(&drbd_md_io_page_pool,
-				GFP_NOIO | __GFP_HIGHMEM);
+	bm_set_page_unchanged(b, page_nr);
+
+	if (b->bm_flags & BM_SPARSE) {
+		/* pages may come and go under bm_lock */
+		if (!(ctx->flags & BM_AIO_READ)) {
+			spin_lock_irq(&b->bm_lock);
+			bm_xfer_disk_page(b, page_nr, page, true);
+			spin_unlock_irq(&b->bm_lock);
+		}
+		bm_store_page_idx(page, page_nr);
+	} else if (b->bm_flags & BM_CONTIGUOUS) {
+		/* assemble the on-disk page, or read into a bounce page */
+		if (!(ctx->flags & BM_AIO_READ))
+			bm_xfer_disk_page(b, page_nr, page, true);
+		bm_store_page_idx(page, page_nr);
+	} else if (copy) {
 		copy_highpage(page, b->bm_pages[page_nr]);
 		bm_store_page_idx(page, page_nr);
 	} else
 		page = b->bm_pages[page_nr];
+	return page;
+}
+
+/* Submit one bio for up to nr consecutive bitmap pages, starting at page_nr.
+ * Returns the number of pages it covers, at least one. */
+static unsigned int bm_page_io_async(struct drbd_bm_aio_ctx *ctx, unsigned int page_nr,
+				     unsigned int nr) __must_hold(local)
+{
+	struct bio *bio = bio_alloc_bioset(GFP_NOIO, nr, &drbd_md_io_bio_set);
+	struct drbd_device *device = ctx->device;
+	unsigned int op = (ctx->flags & BM_AIO_READ) ? REQ_OP_READ : REQ_OP_WRITE;
+	unsigned int i, len, size = 0;
+	sector_t on_disk_sector =
+		device->ldev->md.md_offset + device->ldev->md.bm_offset;
+
+	on_disk_sector += ((sector_t)page_nr) << (PAGE_SHIFT-9);
+
+	for (i = 0; i < nr; i++) {
+		sector_t sector = on_disk_sector + (i << (PAGE_SHIFT-9));
+		struct page *page;
+
+		/* this might happen with very small
+		 * flexible external meta data device,
+		 * or with PAGE_SIZE > 4k */
+		len = min_t(unsigned int, PAGE_SIZE,
+			(drbd_md_last_sector(device->ldev) - sector + 1)<<9);
+
+		/* Only wait for the first bounce page, the others must not
+		 * block on the pool while we hold the IO lock of earlier pages */
+		page = bm_prepare_page_io(ctx, page_nr + i, i ? GFP_NOWAIT : GFP_NOIO);
+		if (!page)
+			break;
+		/* The bio was allocated for nr pages, this cannot fail */
+		bio_add_page(bio, page, len, 0);
+		if (ctx->chunks)
+			atomic_inc(&ctx->chunks[(page_nr + i) / ctx->chunk_pages].in_flight);
+		size += len;
+		if (len < PAGE_SIZE) {
+			i++;
+			break;
+		}
+	}
+
+	atomic_inc(&ctx->in_flight);
 	bio_set_dev(bio, device->ldev->md_bdev);
 	bio->bi_iter.bi_sector = on_disk_sector;
-	/* bio_add_page of a single page to an empty bio will always succeed,
-	 * according to api.  Do we want to assert that? */
-	bio_add_page(bio, page, len, 0);
 	bio->bi_private = ctx;
 	bio->bi_end_io = drbd_bm_endio;
 	bio->bi_opf = op;
@@ -1163,8 +2060,9 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 		submit_bio(bio);
 		/* this should not count as user activity and cause the
 		 * resync to throttle -- see drbd_rs_should_slow_down(). */
-		atomic_add(len >> 9, &device->rs_sect_ev);
+		atomic_add(size >> 9, &device->rs_sect_ev);
 	}
+	return i;
 }
 
 /**
@@ -1183,6 +2081,76 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
  * In case this becomes an issue on systems with larger PAGE_SIZE,
  * we may want to change this again to do 4k aligned 4k pieces.
  */
+static bool bm_page_needs_io(struct drbd_bm_aio_ctx *ctx, unsigned int page_nr)
+{
+	struct drbd_bitmap *b = ctx->device->bitmap;
+
+	if (ctx->flags & BM_AIO_READ)
+		return true;
+	/* ignore completely unchanged pages,
+	 * unless specifically requested to write ALL pages */
+	if (!(ctx->flags & BM_AIO_WRITE_ALL_PAGES) &&
+	    bm_test_page_unchanged(b, page_nr))
+		return false;
+	/* during lazy writeout,
+	 * ignore those pages not marked for lazy writeout. */
+	if ((ctx->flags & BM_AIO_WRITE_LAZY) &&
+	    !bm_test_page_lazy_writeout(b, page_nr))
+		return false;
+	return true;
+}
+
+/* Pages per bitmap bio, see drbd_bitmap_io_max_kb */
+static unsigned int bm_io_max_bio_pages(void)
+{
+	unsigned int nr = (drbd_bitmap_io_max_kb << 10) >> PAGE_SHIFT;
+
+	return clamp(nr, 1U, (unsigned int)BM_IO_MAX_BIO_PAGES);
+}
+
+/* Submit the bitmap pages start_page to end_page that need IO, returns their number.
+ * Runs of consecutive pages that need IO go out as one bio. */
+static unsigned int bm_submit_pages(struct drbd_bm_aio_ctx *ctx,
+		unsigned int start_page, unsigned int end_page) __must_hold(local)
+{
+	struct drbd_device *device = ctx->device;
+	unsigned int max_pages = bm_io_max_bio_pages();
+	unsigned int i = start_page, nr, count = 0;
+
+	while (i <= end_page) {
+		if (!bm_page_needs_io(ctx, i)) {
+			dynamic_drbd_dbg(device, "skipped bm %swrite for idx %u\n",
+					 (ctx->flags & BM_AIO_WRITE_LAZY) ? "lazy " : "", i);
+			i++;
+			continue;
+		}
+		for (nr = 1; nr < max_pages && i + nr <= end_page; nr++) {
+			if (!bm_page_needs_io(ctx, i + nr))
+				break;
+		}
+		nr = bm_page_io_async(ctx, i, nr);
+		i += nr;
+		count += nr;
+		cond_resched();
+	}
+	return count;
+}
+
+static void bm_submit_chunk_work(struct work_struct *ws)
+{
+	struct bm_io_chunk *chunk = container_of(ws, struct bm_io_chunk, submit_work);
+	struct drbd_bm_aio_ctx *ctx = chunk->ctx;
+	struct blk_plug plug;
+
+	/* keep the metadata device queue deep, let the layers below merge */
+	blk_start_plug(&plug);
+	chunk->submitted = bm_submit_pages(ctx, chunk->start_page, chunk->end_page);
+	blk_finish_plug(&plug);
+
+	bm_chunk_put_in_flight(ctx, chunk);
+	bm_aio_ctx_put_in_flight(ctx);
+}
+
 static int bm_rw_range(struct drbd_device *device,
 	unsigned int start_page, unsigned int end_page,
 	unsigned flags) __must_hold(local)
@@ -1194,8 +2162,13 @@ static int bm_rw_range(struct drbd_device *device,
 	int err = 0;
 
 	if (b->bm_flags & BM_ON_DAX_PMEM) {
-		if (flags & (BM_AIO_WRITE_HINTED | BM_AIO_WRITE_ALL_PAGES | BM_AIO_WRITE_LAZY))
+		/* Changed words are written back as they change, see
+		 * bm_mark_for_writeout(); only order them before whatever the
+		 * caller persists next, an AL slot or the meta data. */
+		if (flags & BM_AIO_WRITE_ALL_PAGES)
 			arch_wb_cache_pmem(b->bm_on_pmem, b->bm_words * sizeof(long));
+		if (!(flags & BM_AIO_READ))
+			wmb();
 		return 0;
 	}
 	/*
@@ -1211,6 +2184,13 @@ static int bm_rw_range(struct drbd_device *device,
 	if (!expect(device, b->bm_number_of_pages))
 		return -ENODEV;
 
+	/* Given back in drbd_bm_unlock(), once counted */
+	if ((flags & BM_AIO_READ) && (b->bm_flags & BM_SPARSE)) {
+		err = bm_sparse_populate(b);
+		if (err)
+			return err;
+	}
+
 	ctx = kmalloc(sizeof(struct drbd_bm_aio_ctx), GFP_NOIO);
 	if (!ctx)
 		return -ENOMEM;
@@ -1241,6 +2221,17 @@ static int bm_rw_range(struct drbd_device *device,
 	if (end_page >= b->bm_number_of_pages)
 		end_page = b->bm_number_of_pages -1;
 
+	/* Whole bitmap read or write, at attach or resize: split it up */
+	if (start_page == 0 && end_page == b->bm_number_of_pages - 1 &&
+	    !(flags & BM_AIO_WRITE_HINTED)) {
+		unsigned int nr = bm_io_nr_chunks(b);
+
+		if (nr > 1)
+			ctx->chunks = bm_alloc_chunks(device, nr, &ctx->chunk_pages);
+		if (ctx->chunks)
+			ctx->nr_chunks = nr;
+	}
+
 	spin_lock_irq(&device->pending_bmio_lock);
 	list_add_tail(&ctx->list, &device->pending_bitmap_io);
 	spin_unlock_irq(&device->pending_bmio_lock);
@@ -1249,12 +2240,18 @@ static int bm_rw_range(struct drbd_device *device,
 
 	/* let the layers below us try to merge these bios... */
 
-	if (flags & BM_AIO_READ) {
-		for (i = start_page; i <= end_page; i++) {
+	if (ctx->chunks) {
+		/* Counted as the chunks complete, see bm_chunk_put_in_flight() */
+		if ((flags & BM_AIO_READ) && b->bm_summary)
+			bitmap_fill(b->bm_summary, b->bm_summary_bits);
+		for (i = 0; i < ctx->nr_chunks; i++) {
+			struct bm_io_chunk *chunk = &ctx->chunks[i];
+
+			chunk->ctx = ctx;
+			INIT_WORK(&chunk->submit_work, bm_submit_chunk_work);
+			INIT_WORK(&chunk->count_work, bm_count_chunk_work);
 			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
-			++count;
-			cond_resched();
+			queue_work(drbd_bitmap_io_wq, &chunk->submit_work);
 		}
 	} else if (flags & BM_AIO_WRITE_HINTED) {
 		/* ASSERT: BM_AIO_WRITE_ALL_PAGES is not set. */
@@ -1264,37 +2261,16 @@ static int bm_rw_range(struct drbd_device *device,
 			if (i > end_page)
 				continue;
 			/* Several AL-extents may point to the same page. */
-			if (!test_and_clear_bit(BM_PAGE_HINT_WRITEOUT,
-			    &page_private(b->bm_pages[i])))
+			if (!test_and_clear_bit(BM_PAGE_HINT_WRITEOUT, bm_page_flags(b, i)))
 				continue;
 			/* Has it even changed? */
-			if (bm_test_page_unchanged(b->bm_pages[i]))
+			if (bm_test_page_unchanged(b, i))
 				continue;
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
+			bm_page_io_async(ctx, i, 1);
 			++count;
 		}
 	} else {
-		for (i = start_page; i <= end_page; i++) {
-			/* ignore completely unchanged pages,
-			 * unless specifically requested to write ALL pages */
-			if (!(flags & BM_AIO_WRITE_ALL_PAGES) &&
-			    bm_test_page_unchanged(b->bm_pages[i])) {
-				dynamic_drbd_dbg(device, "skipped bm write for idx %u\n", i);
-				continue;
-			}
-			/* during lazy writeout,
-			 * ignore those pages not marked for lazy writeout. */
-			if ((flags & BM_AIO_WRITE_LAZY) &&
-			    !bm_test_page_lazy_writeout(b->bm_pages[i])) {
-				dynamic_drbd_dbg(device, "skipped bm lazy write for idx %u\n", i);
-				continue;
-			}
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
-			++count;
-			cond_resched();
-		}
+		count = bm_submit_pages(ctx, start_page, end_page);
 	}
 
 	/*
@@ -1310,8 +2286,11 @@ static int bm_rw_range(struct drbd_device *device,
 	} else
 		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
 
-	/* summary for global bitmap IO */
-	if (flags == 0 && count) {
+	for (i = 0; i < ctx->nr_chunks; i++)
+		count += ctx->chunks[i].submitted;
+
+	/* summary for global bitmap IO, the attach time read included */
+	if ((flags & ~BM_AIO_READ) == 0 && count) {
 		unsigned int ms = jiffies_to_msecs(jiffies - now);
 		if (ms > 5) {
 			drbd_info(device, "bitmap %s of %u pages took %u ms\n",
@@ -1331,7 +2310,10 @@ static int bm_rw_range(struct drbd_device *device,
 
 	if (flags & BM_AIO_READ) {
 		now = jiffies;
-		bm_count_bits(device);
+		if (ctx->chunks && !err)
+			bm_sum_chunks(b, ctx->chunks, ctx->nr_chunks);
+		else
+			bm_count_bits(device);
 		drbd_info(device, "recounting of set bits took additional %ums\n",
 		     jiffies_to_msecs(jiffies - now));
 	}
@@ -1358,9 +2340,8 @@ int drbd_bm_read(struct drbd_device *device,
 static void push_al_bitmap_hint(struct drbd_device *device, unsigned int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page = b->bm_pages[page_nr];
 	BUG_ON(b->n_bitmap_hints >= ARRAY_SIZE(b->al_bitmap_hints));
-	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, &page_private(page)))
+	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, bm_page_flags(b, page_nr)))
 		b->al_bitmap_hints[b->n_bitmap_hints++] = page_nr;
 }
 
@@ -1480,15 +2461,14 @@ unsigned int drbd_bm_set_bits(struct drbd_device *device, unsigned int bitmap_in
 	return bm_op(device, bitmap_index, start, end, BM_OP_SET, NULL);
 }
 
+/* with bm_lock held, which it drops between pages if need be */
 static __always_inline void
-__bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
-		  enum bitmap_operations op)
+____bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
+		    enum bitmap_operations op)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
 	unsigned long bit = start;
 
-	spin_lock_irq(&bitmap->bm_lock);
-
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
 
@@ -1506,6 +2486,16 @@ __bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigne
 			spin_lock_irq(&bitmap->bm_lock);
 		}
 	}
+}
+
+static __always_inline void
+__bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
+		  enum bitmap_operations op)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+
+	spin_lock_irq(&bitmap->bm_lock);
+	____bm_many_bits_op(device, bitmap_index, start, end, op);
 	spin_unlock_irq(&bitmap->bm_lock);
 }
 
@@ -1516,6 +2506,23 @@ void drbd_bm_set_many_bits(struct drbd_peer_device *peer_device, unsigned long s
 	__bm_many_bits_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_SET);
 }
 
+/* Sets the runs collected while decoding a compressed bitmap packet, all
+ * with one bm_lock round trip */
+void drbd_bm_set_runs(struct drbd_peer_device *peer_device, struct drbd_bm_runs *runs)
+{
+	struct drbd_device *device = peer_device->device;
+	unsigned int i;
+
+	if (peer_device->bitmap_index != -1 && runs->n) {
+		spin_lock_irq(&device->bitmap->bm_lock);
+		for (i = 0; i < runs->n; i++)
+			____bm_many_bits_op(device, peer_device->bitmap_index,
+					    runs->start[i], runs->end[i], BM_OP_SET);
+		spin_unlock_irq(&device->bitmap->bm_lock);
+	}
+	runs->n = 0;
+}
+
 void drbd_bm_clear_many_bits(struct drbd_peer_device *peer_device, unsigned long start, unsigned long end)
 {
 	if (peer_device->bitmap_index == -1)
@@ -1555,6 +2562,18 @@ void drbd_bm_clear_all(struct drbd_device *device)
 		__bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_CLEAR);
 }
 
+/* BM_SPARSE: give back the pages that became all clear, or all set, unless
+ * someone holds the bitmap lock; then drbd_bm_unlock() does it */
+void drbd_bm_compact(struct drbd_device *device)
+{
+	struct drbd_bitmap *b = device->bitmap;
+
+	if (!b || !(b->bm_flags & BM_SPARSE) || !mutex_trylock(&b->bm_change))
+		return;
+	bm_sparse_compact(b);
+	mutex_unlock(&b->bm_change);
+}
+
 unsigned int drbd_bm_clear_bits(struct drbd_device *device, unsigned int bitmap_index,
 				unsigned long start, unsigned long end)
 {
@@ -1593,20 +2612,22 @@ int drbd_bm_count_bits(struct drbd_device *device, unsigned int bitmap_index, un
 void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned long word_nr, from_word_nr, to_word_nr, words32_total;
+	unsigned long word_nr, from_word_nr, to_word_nr, words32_per_index;
 	unsigned int from_page_nr, to_page_nr, current_page_nr;
 	u32 data_word, *addr;
+	bool changed;
 
-	words32_total = bitmap->bm_words * sizeof(unsigned long) / sizeof(u32);
+	words32_per_index = bitmap->bm_words * sizeof(unsigned long) / sizeof(u32) /
+		bitmap->bm_max_peers;
 	spin_lock_irq(&bitmap->bm_lock);
 
 	bitmap->bm_set[to_index] = 0;
 	current_page_nr = 0;
 	addr = bm_map(bitmap, current_page_nr);
-	for (word_nr = 0; word_nr < words32_total; word_nr += bitmap->bm_max_peers) {
-		from_word_nr = word_nr + from_index;
+	for (word_nr = 0; word_nr < words32_per_index; word_nr++) {
+		from_word_nr = bm_word32(bitmap, from_index, word_nr << 5);
 		from_page_nr = word32_to_page(from_word_nr);
-		to_word_nr = word_nr + to_index;
+		to_word_nr = bm_word32(bitmap, to_index, word_nr << 5);
 		to_page_nr = word32_to_page(to_word_nr);
 
 		if (current_page_nr != from_page_nr) {
@@ -1621,10 +2642,9 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 		}
 		data_word = addr[word32_in_page(from_word_nr)];
 
-		if (word_nr == words32_total - bitmap->bm_max_peers) {
-			unsigned long lw = word_nr / bitmap->bm_max_peers;
-			if (bitmap->bm_bits < (lw + 1) * 32)
-			    data_word &= cpu_to_le32((1 << (bitmap->bm_bits - lw * 32)) - 1);
+		if (word_nr == words32_per_index - 1) {
+			if (bitmap->bm_bits < (word_nr + 1) * 32)
+			    data_word &= cpu_to_le32((1 << (bitmap->bm_bits - word_nr * 32)) - 1);
 		}
 
 		if (current_page_nr != to_page_nr) {
@@ -1633,9 +2653,27 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 			addr = bm_map(bitmap, current_page_nr);
 		}
 
-		if (addr[word32_in_page(to_word_nr)] != data_word)
-			bm_set_page_need_writeout(bitmap, current_page_nr);
+		changed = addr[word32_in_page(to_word_nr)] != data_word;
+		if (changed && (bitmap->bm_flags & BM_SPARSE) &&
+		    !bm_page_allocated(bitmap, current_page_nr)) {
+			struct page *page;
+
+			bm_unmap(bitmap, addr);
+			spin_unlock_irq(&bitmap->bm_lock);
+			page = mempool_alloc(&bitmap->bm_sparse_pool, GFP_NOIO);
+			spin_lock_irq(&bitmap->bm_lock);
+			if (bm_page_allocated(bitmap, current_page_nr))
+				mempool_free(page, &bitmap->bm_sparse_pool);
+			else
+				bm_sparse_install_page(bitmap, current_page_nr, page);
+			addr = bm_map(bitmap, current_page_nr);
+		}
 		addr[word32_in_page(to_word_nr)] = data_word;
+		if (changed)
+			bm_mark_for_writeout(bitmap, to_index, current_page_nr,
+					     word_nr << 5, word_nr << 5, BM_PAGE_NEED_WRITEOUT);
+		if (data_word)
+			bm_summary_set(bitmap, current_page_nr, to_index);
 		bitmap->bm_set[to_index] += hweight32(data_word);
 	}
 	bm_unmap(bitmap, addr);
@@ -126,14 +126,14 @@ void drbd_dax_al_begin_io_commit(struct drbd_device *device)
 {
 	struct lc_element *e;
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 
 	list_for_each_entry(e, &device->act_log->to_be_changed, list)
 		drbd_dax_al_update(device, e);
 
 	lc_committed(device->act_log);
 
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 }
 
 int drbd_dax_al_initialize(struct drbd_device *device)
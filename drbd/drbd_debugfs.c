@@ -24,6 +24,9 @@ static struct dentry *drbd_debugfs_refcounts;
 static struct dentry *drbd_debugfs_resources;
 static struct dentry *drbd_debugfs_minors;
 static struct dentry *drbd_debugfs_compat;
+static struct dentry *drbd_debugfs_magazines;
+static struct dentry *drbd_debugfs_page_pool;
+static struct dentry *drbd_debugfs_resync_scheduler;
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 static void seq_print_age_or_dash(struct seq_file *m, bool valid, ktime_t dt)
@@ -88,6 +91,7 @@ static void seq_print_request_state(struct seq_file *m, struct drbd_request *req
 		seq_print_rq_state_bit(m, s & RQ_NET_DONE, &sep, "done");
 		seq_print_rq_state_bit(m, s & RQ_NET_SIS, &sep, "sis");
 		seq_print_rq_state_bit(m, s & RQ_NET_OK, &sep, "ok");
+		seq_print_rq_state_bit(m, s & RQ_NET_BUFFERED, &sep, "buffered");
 		if (sep == ' ')
 			seq_puts(m, " -");
 
@@ -485,6 +489,121 @@ static int resource_in_flight_summary_show(struct seq_file *m, void *pos)
 	return 0;
 }
 
+/* Age of the oldest request on @head, without taking pending_completion_lock.
+ * Requests are freed only after an RCU grace period, so like the cached
+ * pointers of the connection, a request just taken off the list is still
+ * fine to look at. -1 if the list is empty. Caller holds rcu_read_lock(). */
+static int oldest_pending_ms(struct list_head *head, size_t offset, unsigned long jif)
+{
+	struct list_head *first = READ_ONCE(head->next);
+	struct drbd_request *req;
+
+	if (first == head)
+		return -1;
+	req = (struct drbd_request *)((char *)first - offset);
+	return jiffies_to_msecs(jif - READ_ONCE(req->start_jif));
+}
+
+static int oldest_cached_ms(struct drbd_request **ptr, unsigned long jif)
+{
+	struct drbd_request *req = READ_ONCE(*ptr);
+
+	return req ? jiffies_to_msecs(jif - READ_ONCE(req->start_jif)) : -1;
+}
+
+/* The counters the request state machine keeps anyway, and the ages of the
+ * oldest requests it points to. Meant to be polled often: unlike
+ * in_flight_summary it takes no lock but the RCU read lock and walks no
+ * list. Counts and ages may be off by the requests changing state while it
+ * is generated; ages are in ms, -1 for none. */
+static int resource_in_flight_counters_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+	struct drbd_connection *connection;
+	struct drbd_peer_device *peer_device;
+	struct drbd_device *device;
+	unsigned long jif = jiffies;
+	int vnr;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_puts(m, "minor\tvnr\tbios_r\tbios_w\tal_wait\tlocal_r\tlocal_w"
+		 "\toldest_r\toldest_w\toldest_local_r\toldest_local_w\n");
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		seq_printf(m, "%u\t%u\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
+			   device->minor, device->vnr,
+			   atomic_read(&device->ap_bio_cnt[READ]),
+			   atomic_read(&device->ap_bio_cnt[WRITE]),
+			   atomic_read(&device->ap_actlog_cnt),
+			   atomic_read(&device->rq_local_pending[READ]),
+			   atomic_read(&device->rq_local_pending[WRITE]),
+			   oldest_pending_ms(&device->pending_master_completion[READ],
+				offsetof(struct drbd_request, req_pending_master_completion), jif),
+			   oldest_pending_ms(&device->pending_master_completion[WRITE],
+				offsetof(struct drbd_request, req_pending_master_completion), jif),
+			   oldest_pending_ms(&device->pending_completion[READ],
+				offsetof(struct drbd_request, req_pending_local), jif),
+			   oldest_pending_ms(&device->pending_completion[WRITE],
+				offsetof(struct drbd_request, req_pending_local), jif));
+	}
+	seq_putc(m, '\n');
+
+	seq_puts(m, "peer\tin_flight_kb\toldest_unsent\toldest_unacked\toldest_not_done"
+		 "\tactive_ee\tdone_ee\n");
+	for_each_connection_rcu(connection, resource) {
+		seq_printf(m, "%s\t%d\t%d\t%d\t%d\t%d\t%d\n",
+			   rcu_dereference(connection->transport.net_conf)->name,
+			   atomic_read(&connection->ap_in_flight) / 2,
+			   oldest_cached_ms(&connection->todo.req_next, jif),
+			   oldest_cached_ms(&connection->req_ack_pending, jif),
+			   oldest_cached_ms(&connection->req_not_net_done, jif),
+			   atomic_read(&connection->active_ee_cnt),
+			   atomic_read(&connection->done_ee_cnt));
+	}
+	seq_putc(m, '\n');
+
+	seq_puts(m, "peer\tvnr\tqueued\tpending_ack\tnot_done\tunacked\trs_pending\n");
+	for_each_connection_rcu(connection, resource) {
+		idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
+			seq_printf(m, "%s\t%u\t%d\t%d\t%d\t%d\t%d\n",
+				   rcu_dereference(connection->transport.net_conf)->name,
+				   peer_device->device->vnr,
+				   atomic_read(&peer_device->rq_queued),
+				   atomic_read(&peer_device->ap_pending_cnt),
+				   atomic_read(&peer_device->rq_not_net_done),
+				   atomic_read(&peer_device->unacked_cnt),
+				   atomic_read(&peer_device->rs_pending_cnt));
+		}
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/* One line of upper bucket bounds in us, then one line of counts per stage;
+ * the last bucket is open ended. */
+static void seq_print_lat_bounds(struct seq_file *m)
+{
+	int i;
+
+	seq_puts(m, "us:");
+	for (i = 0; i < DRBD_LAT_BUCKETS - 1; i++)
+		seq_printf(m, " %lu", 1UL << i);
+	seq_puts(m, " inf\n");
+}
+
+static void seq_print_lat_hist(struct seq_file *m, const char *name,
+			       const struct drbd_lat_hist *hist)
+{
+	int i;
+
+	seq_printf(m, "%s:", name);
+	for (i = 0; i < DRBD_LAT_BUCKETS; i++)
+		seq_printf(m, " %llu", (unsigned long long)hist->bucket[i]);
+	seq_putc(m, '\n');
+}
+
 static int resource_state_twopc_show(struct seq_file *m, void *pos)
 {
 	struct drbd_resource *resource = m->private;
@@ -590,6 +709,37 @@ static int resource_state_twopc_show(struct seq_file *m, void *pos)
 	return 0;
 }
 
+/* History of the cluster wide state changes, with latency histograms: the
+ * ones this node initiated, and per peer its replies to our prepares. */
+static int resource_twopc_stats_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+	struct drbd_twopc_stats *s = &resource->twopc_stats;
+	struct drbd_connection *connection;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "initiated: committed:%llu aborted:%llu retries:%llu timeouts:%llu concurrent:%llu\n",
+		   s->committed, s->aborted, s->retries, s->timeouts, s->concurrent);
+	seq_print_lat_bounds(m);
+	seq_print_lat_hist(m, "prepare", &s->prepare);
+	seq_print_lat_hist(m, "total", &s->total);
+
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		struct drbd_twopc_peer_stats *ps = &connection->twopc_stats;
+		char *name = rcu_dereference(connection->transport.net_conf)->name;
+
+		seq_printf(m, "\npeer %s: yes:%llu no:%llu retry:%llu rejected:%llu yielded:%llu\n",
+			   name, ps->yes, ps->no, ps->retry, ps->rejected, ps->yielded);
+		seq_print_lat_hist(m, "reply", &ps->reply);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
 /* make sure at *open* time that the respective object won't go away. */
 static int drbd_single_open(struct file *file, int (*show)(struct seq_file *, void *),
 		                void *data, struct kref *kref,
@@ -620,6 +770,62 @@ out:
 	return ret;
 }
 
+/* Read without the lock; on 32bit, a counter may be torn */
+static void seq_print_lock_stat(struct seq_file *m, const char *name, struct drbd_lock_stat *st)
+{
+	u64 sampled = READ_ONCE(st->sampled);
+	u64 sum_ns = READ_ONCE(st->sum_hold_ns);
+
+	seq_printf(m, "%s: acquired=%llu contended=%llu sampled=%llu avg_hold_ns=%llu max_hold_ns=%llu\n",
+		   name,
+		   (unsigned long long)READ_ONCE(st->acquired),
+		   (unsigned long long)READ_ONCE(st->contended),
+		   (unsigned long long)sampled,
+		   (unsigned long long)(sampled ? div64_u64(sum_ns, sampled) : 0),
+		   (unsigned long long)READ_ONCE(st->max_hold_ns));
+}
+
+static int resource_lock_stats_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_resource *resource = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "enabled: %d\n", READ_ONCE(drbd_lock_stats));
+	seq_print_lock_stat(m, "tl_update_lock", &resource->tl_update_lock_stat);
+	return 0;
+}
+
+static int resource_placement_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_resource *resource = m->private;
+	struct drbd_device *device;
+	int vnr;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "numa_placement: %d\n", READ_ONCE(drbd_numa_placement));
+	seq_printf(m, "cpu-mask option: %s\n",
+		   resource->res_opts.cpu_mask[0] ? resource->res_opts.cpu_mask : "-");
+	seq_printf(m, "node: %d\n", resource->cpu_node);
+	seq_printf(m, "cpus: %*pbl\n", cpumask_pr_args(resource->cpu_mask));
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		int node = NUMA_NO_NODE;
+
+		if (get_ldev_if_state(device, D_NEGOTIATING)) {
+			node = dev_to_node(disk_to_dev(device->ldev->backing_bdev->bd_disk));
+			put_ldev(device);
+		}
+		seq_printf(m, "volume %d backing device node: %d\n", vnr, node);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
 static int resource_attr_release(struct inode *inode, struct file *file)
 {
 	struct drbd_resource *resource = inode->i_private;
@@ -643,7 +849,11 @@ static const struct file_operations resource_ ## name ## _fops = {	\
 };
 
 drbd_debugfs_resource_attr(in_flight_summary)
+drbd_debugfs_resource_attr(in_flight_counters)
 drbd_debugfs_resource_attr(state_twopc)
+drbd_debugfs_resource_attr(twopc_stats)
+drbd_debugfs_resource_attr(lock_stats)
+drbd_debugfs_resource_attr(placement)
 
 #define drbd_dcf(top, obj, attr, perm) do {			\
 	dentry = debugfs_create_file(#attr, perm,		\
@@ -678,7 +888,11 @@ void drbd_debugfs_resource_add(struct drbd_resource *resource)
 
 	/* debugfs create file */
 	res_dcf(in_flight_summary);
+	res_dcf(in_flight_counters);
 	res_dcf(state_twopc);
+	res_dcf(twopc_stats);
+	res_dcf(lock_stats);
+	res_dcf(placement);
 }
 
 static void drbd_debugfs_remove(struct dentry **dp)
@@ -697,8 +911,12 @@ void drbd_debugfs_resource_cleanup(struct drbd_resource *resource)
 	 * and call debugfs_remove on all of them separately.
 	 */
 	/* it is ok to call debugfs_remove(NULL) */
+	drbd_debugfs_remove(&resource->debugfs_res_placement);
+	drbd_debugfs_remove(&resource->debugfs_res_lock_stats);
+	drbd_debugfs_remove(&resource->debugfs_res_twopc_stats);
 	drbd_debugfs_remove(&resource->debugfs_res_state_twopc);
 	drbd_debugfs_remove(&resource->debugfs_res_in_flight_summary);
+	drbd_debugfs_remove(&resource->debugfs_res_in_flight_counters);
 	drbd_debugfs_remove(&resource->debugfs_res_connections);
 	drbd_debugfs_remove(&resource->debugfs_res_volumes);
 	drbd_debugfs_remove(&resource->debugfs_res);
@@ -791,13 +1009,25 @@ static int connection_transport_show(struct seq_file *m, void *ignored)
 	struct drbd_transport_ops *tr_ops = transport->ops;
 	enum drbd_stream i;
 
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 2);
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
+		u64 corked_ns = sbuf->corked_ns;
+		bool corked = test_bit(CORKED + i, &connection->flags);
+
+		if (corked)
+			corked_ns += ktime_to_ns(ktime_sub(ktime_get(), sbuf->corked_kt));
 		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
-		seq_printf(m, "  corked: %d\n", test_bit(CORKED + i, &connection->flags));
-		seq_printf(m, "  unsent: %ld bytes\n", (long)(sbuf->pos - sbuf->unsent));
+		seq_printf(m, "  corked: %d\n", corked);
+		seq_printf(m, "  corked time: %llu us\n",
+			   (unsigned long long)div_u64(corked_ns, NSEC_PER_USEC));
+		seq_printf(m, "  packets sent: %llu\n", (unsigned long long)sbuf->packets);
+		seq_printf(m, "  packets received: %llu\n",
+			   (unsigned long long)connection->packets_received[i]);
+		seq_printf(m, "  unsent: %ld bytes\n",
+			   (long)(sbuf->pos - sbuf->unsent) + sbuf->queued_size);
+		seq_printf(m, "  queued pages: %u\n", sbuf->nr_queued);
 		seq_printf(m, "  allocated: %d bytes\n", sbuf->allocated_size);
 	}
 
@@ -808,6 +1038,81 @@ static int connection_transport_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static void seq_print_compress_ratio(struct seq_file *m, const char *dir, u64 plain, u64 wire)
+{
+	seq_printf(m, "%s: plain %llu wire %llu bytes", dir, plain, wire);
+	if (plain)
+		seq_printf(m, ", %llu%%", div64_u64(wire * 100, plain));
+	seq_putc(m, '\n');
+}
+
+static int connection_compression_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	struct drbd_compress *cmp = &connection->compress;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "algorithm: %s%s\n", cmp->alg ? drbd_compress_alg_name(cmp->alg) : "none",
+		   cmp->alg && !drbd_compress_agreed(connection) ? " (not agreed with peer)" : "");
+	seq_print_compress_ratio(m, "send", cmp->tx_plain, cmp->tx_wire);
+	seq_printf(m, "send uncompressed: %llu bytes (backoff %u)\n",
+		   cmp->tx_bypassed, cmp->backoff);
+	seq_print_compress_ratio(m, "receive", cmp->rx_plain, cmp->rx_wire);
+
+	return 0;
+}
+
+static int connection_send_buffer_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	struct drbd_async_sbuf *sbuf = &connection->sbuf;
+	u64 used = READ_ONCE(sbuf->tail) - smp_load_acquire(&sbuf->head);
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "size: %llu KiB\n", (unsigned long long)sbuf->nr_pages << (PAGE_SHIFT - 10));
+	seq_printf(m, "used: %llu KiB\n", (unsigned long long)used << (PAGE_SHIFT - 10));
+	seq_printf(m, "buffered: %llu requests %llu bytes\n",
+		   (unsigned long long)READ_ONCE(sbuf->reqs),
+		   (unsigned long long)READ_ONCE(sbuf->bytes));
+	seq_printf(m, "full: %llu\n", (unsigned long long)READ_ONCE(sbuf->full));
+
+	return 0;
+}
+
+static int connection_latency_probe_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	struct drbd_latency_probe *probe = &connection->latency_probe;
+	u64 last, avg, min, max, probes, lost;
+	bool in_flight;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	spin_lock(&probe->lock);
+	last = probe->last_ns;
+	avg = probe->avg_ns;
+	min = probe->min_ns;
+	max = probe->max_ns;
+	probes = probe->probes;
+	lost = probe->lost;
+	in_flight = probe->block_id != 0;
+	spin_unlock(&probe->lock);
+
+	seq_printf(m, "interval: %u ms\n", READ_ONCE(drbd_latency_probe_ms));
+	seq_printf(m, "probes: %llu lost: %llu in flight: %d\n",
+		   (unsigned long long)probes, (unsigned long long)lost, in_flight);
+	seq_printf(m, "round trip ns: last %llu avg %llu min %llu max %llu\n",
+		   (unsigned long long)last, (unsigned long long)avg,
+		   (unsigned long long)min, (unsigned long long)max);
+
+	return 0;
+}
+
 static int connection_debug_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_connection *connection = m->private;
@@ -863,6 +1168,11 @@ static int connection_debug_show(struct seq_file *m, void *ignored)
 	in_flight = atomic_read(&connection->rs_in_flight);
 	seq_printf(m, "            rs_in_flight: %d KiB (%d sectors)\n", in_flight / 2, in_flight);
 
+	seq_printf(m, "           cong_throttled: %d writes, %lld ms, %d timeouts\n",
+		   atomic_read(&connection->cong_throttled),
+		   (long long)div_s64(atomic64_read(&connection->cong_throttle_ns), NSEC_PER_MSEC),
+		   atomic_read(&connection->cong_throttle_timeouts));
+
 	seq_printf(m, "             done_ee_cnt: %d\n"
 	              "           active_ee_cnt: %d\n",
 		atomic_read(&connection->done_ee_cnt),
@@ -898,6 +1208,9 @@ drbd_debugfs_connection_attr(oldest_requests)
 drbd_debugfs_connection_attr(callback_history)
 drbd_debugfs_connection_attr(transport)
 drbd_debugfs_connection_attr(debug)
+drbd_debugfs_connection_attr(compression)
+drbd_debugfs_connection_attr(send_buffer)
+drbd_debugfs_connection_attr(latency_probe)
 
 void drbd_debugfs_connection_add(struct drbd_connection *connection)
 {
@@ -919,6 +1232,9 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 	conn_dcf(oldest_requests);
 	conn_dcf(transport);
 	conn_dcf(debug);
+	conn_dcf(compression);
+	conn_dcf(send_buffer);
+	conn_dcf(latency_probe);
 
 	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
 		if (!peer_device->debugfs_peer_dev)
@@ -928,6 +1244,9 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 
 void drbd_debugfs_connection_cleanup(struct drbd_connection *connection)
 {
+	drbd_debugfs_remove(&connection->debugfs_conn_latency_probe);
+	drbd_debugfs_remove(&connection->debugfs_conn_send_buffer);
+	drbd_debugfs_remove(&connection->debugfs_conn_compression);
 	drbd_debugfs_remove(&connection->debugfs_conn_debug);
 	drbd_debugfs_remove(&connection->debugfs_conn_transport);
 	drbd_debugfs_remove(&connection->debugfs_conn_callback_history);
@@ -968,10 +1287,23 @@ static int device_act_log_histogram_show(struct seq_file *m, void *ignored)
 	struct drbd_device *device = m->private;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
 
 	if (get_ldev_if_state(device, D_FAILED)) {
+		u64 windows = device->al_gc.windows;
+		u64 commits = device->al_gc.commits;
+
 		seq_printf_nice_histogram(m, device->al_histogram, AL_UPDATES_PER_TRANSACTION);
+
+		seq_puts(m, "\ngroup commit\n");
+		seq_printf(m, "windows: %llu\n", windows);
+		seq_printf(m, "updates gathered: %llu\n", device->al_gc.updates);
+		seq_printf(m, "avg wait (us): %llu\n",
+			   windows ? div64_u64(device->al_gc.wait_ns, windows * NSEC_PER_USEC) : 0);
+		seq_printf(m, "commits: %llu\n", commits);
+		seq_printf(m, "avg commit (us): %llu\n",
+			   commits ? div64_u64(device->al_gc.commit_ns, commits * NSEC_PER_USEC) : 0);
+		seq_printf(m, "max commit (us): %llu\n", div_u64(device->al_gc.max_commit_ns, NSEC_PER_USEC));
 		put_ldev(device);
 	}
 	return 0;
@@ -982,7 +1314,7 @@ static int device_act_log_extents_show(struct seq_file *m, void *ignored)
 	struct drbd_device *device = m->private;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 2);
 
 	if (get_ldev_if_state(device, D_FAILED)) {
 		lc_seq_printf_stats(m, device->act_log);
@@ -1044,7 +1376,78 @@ static int device_md_io_show(struct seq_file *m, void *ignored)
 		seq_puts(m, drbd_md_dax_active(device->ldev) ? "dax-pmem\n" : "blk-bio\n");
 		put_ldev(device);
 	}
+	spin_lock_irq(&device->md_sync.lock);
+	seq_printf(m, "md_sync requested: %llu done: %llu coalesced: %lu%s\n",
+		   device->md_sync.requested, device->md_sync.done, device->md_sync.coalesced,
+		   device->md_sync.writing ? " writing" : "");
+	spin_unlock_irq(&device->md_sync.lock);
+	{
+		u64 n0 = READ_ONCE(device->md_io.writes[0]), n1 = READ_ONCE(device->md_io.writes[1]);
+		u64 avg0 = n0 ? div64_u64(READ_ONCE(device->md_io.write_ns[0]), n0) : 0;
+		u64 avg1 = n1 ? div64_u64(READ_ONCE(device->md_io.write_ns[1]), n1) : 0;
+
+		seq_printf(m, "sync writes: %llu avg %llu ns, polled: %llu avg %llu ns",
+			   n0, avg0, n1, avg1);
+		if (n0 && n1 && avg0 > avg1)
+			seq_printf(m, " saved: %llu us", div_u64((avg0 - avg1) * n1, NSEC_PER_USEC));
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int device_readahead_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_readahead *ra = READ_ONCE(device->readahead);
+	int i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "limit_kb: %u\n", READ_ONCE(drbd_remote_readahead_kb));
+	if (!ra)
+		return 0;
+
+	spin_lock_irq(&ra->lock);
+	seq_printf(m, "window_kb: %u next_sector: %llu ahead_to: %llu\n",
+		   ra->window >> 10, (unsigned long long)ra->next_sector,
+		   (unsigned long long)ra->ra_end);
+	seq_printf(m, "hits: %llu misses: %llu issued_kb: %llu hit_kb: %llu dropped_kb: %llu\n",
+		   ra->hits, ra->misses, ra->bytes_issued >> 10, ra->bytes_hit >> 10,
+		   ra->dropped >> 10);
+	for (i = 0; i < DRBD_RA_ENTRIES; i++) {
+		struct drbd_ra_entry *e = &ra->e[i];
+
+		if (!e->size)
+			continue;
+		seq_printf(m, "%llu+%u%s%s%s\n", (unsigned long long)e->sector, e->size >> 9,
+			   e->done ? "" : " reading", e->valid ? "" : " invalid",
+			   e->consumed ? " consumed" : "");
+	}
+	spin_unlock_irq(&ra->lock);
+	return 0;
+}
+
+static int device_submit_workers_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	unsigned int workers = min_t(unsigned int, READ_ONCE(drbd_submit_workers),
+				     DRBD_SUBMIT_WORKERS_MAX);
+	int i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "workers: %u fanout: %u\n", workers, READ_ONCE(drbd_submit_fanout));
+	seq_puts(m, "worker       chunks       writes      busy_ms\n");
+	for (i = 0; i < DRBD_SUBMIT_WORKERS_MAX; i++) {
+		struct drbd_submit_dispatcher *d = &device->submit.dispatch[i];
+		unsigned long chunks = READ_ONCE(d->chunks);
 
+		if (i >= workers && !chunks)
+			continue;
+		seq_printf(m, "%6d %12lu %12lu %12llu\n", i, chunks, READ_ONCE(d->writes),
+			   (unsigned long long)div_u64(READ_ONCE(d->busy_ns), NSEC_PER_MSEC));
+	}
 	return 0;
 }
 
@@ -1106,6 +1509,240 @@ static int device_ed_gen_id_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int device_unallocated_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	unsigned int chunk_shift = 0;
+	unsigned long chunks;
+
+	if (!get_ldev_if_state(device, D_FAILED))
+		return -ENODEV;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	chunks = drbd_unallocated_weight(device, &chunk_shift);
+	seq_printf(m, "chunk: %u KiB\n", (1U << chunk_shift) >> 1);
+	seq_printf(m, "unallocated: %llu KiB\n",
+		   (unsigned long long)chunks << chunk_shift >> 1);
+	put_ldev(device);
+
+	return 0;
+}
+
+static int device_lock_stats_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "enabled: %d\n", READ_ONCE(drbd_lock_stats));
+	seq_print_lock_stat(m, "al_lock", &device->al_lock_stat);
+	seq_print_lock_stat(m, "interval_lock", &device->interval_lock_stat);
+	return 0;
+}
+
+static int device_al_heat_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_al_heat *heat = device->al_heat;
+	unsigned int ws_last, ws_now, i;
+	u64 samples, activations, reactivations;
+	typeof(heat->top) top;
+
+	if (!heat)
+		return -ENOMEM;
+
+	ws_now = drbd_al_heat_working_set(heat);
+	spin_lock_irq(&heat->lock);
+	memcpy(top, heat->top, sizeof(top));
+	ws_last = heat->ws_last;
+	samples = heat->samples;
+	activations = heat->activations;
+	reactivations = heat->reactivations;
+	spin_unlock_irq(&heat->lock);
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "extent size: %u KiB\n", 1U << (AL_EXTENT_SHIFT - 10));
+	seq_printf(m, "sampled writes: %llu (1 in %u)\n",
+		   (unsigned long long)samples, 1U << DRBD_AL_HEAT_SAMPLE_SHIFT);
+	seq_printf(m, "window: %u s\n", DRBD_AL_HEAT_WINDOW / HZ);
+	seq_printf(m, "working set: %u extents (previous window: %u)\n", ws_now, ws_last);
+	seq_printf(m, "activations: %llu reactivations of hot extents: %llu\n",
+		   (unsigned long long)activations, (unsigned long long)reactivations);
+	seq_puts(m, "\nextent sampled_writes\n");
+	for (i = 0; i < DRBD_AL_HEAT_TOP; i++)
+		if (top[i].count)
+			seq_printf(m, "%u %u\n", top[i].enr, top[i].count);
+	return 0;
+}
+
+static int device_latency_show(struct seq_file *m, void *ignored)
+{
+	static const char * const names[DRBD_LAT_DEVICE_STAGES] = {
+		[DRBD_LAT_AL_WAIT] = "al_wait",
+		[DRBD_LAT_LOCAL_READ] = "local_read",
+		[DRBD_LAT_LOCAL_WRITE] = "local_write",
+		[DRBD_LAT_READ] = "read",
+		[DRBD_LAT_WRITE] = "write",
+	};
+	struct drbd_device *device = m->private;
+	struct drbd_lat_hist sum;
+	int stage, cpu, i;
+
+	if (!device->lat_hist)
+		return -ENOMEM;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_print_lat_bounds(m);
+	for (stage = 0; stage < DRBD_LAT_DEVICE_STAGES; stage++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			struct drbd_lat_hist *h = per_cpu_ptr(device->lat_hist, cpu) + stage;
+
+			for (i = 0; i < DRBD_LAT_BUCKETS; i++)
+				sum.bucket[i] += READ_ONCE(h->bucket[i]);
+		}
+		seq_print_lat_hist(m, names[stage], &sum);
+	}
+	return 0;
+}
+
+/* "begin" before taking the allocation snapshot of the backing device,
+ * then one "<start sector> <sectors>" line per unallocated range */
+static ssize_t device_unallocated_write(struct file *file, const char __user *ubuf,
+					size_t cnt, loff_t *ppos)
+{
+	struct drbd_device *device = file_inode(file)->i_private;
+	char *buf, *line, *next;
+	ssize_t done = 0;
+	int err = 0;
+
+	buf = memdup_user_nul(ubuf, min_t(size_t, cnt, PAGE_SIZE - 1));
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	if (!get_ldev(device)) {
+		kfree(buf);
+		return -ENODEV;
+	}
+
+	for (line = buf; !err && (next = strchr(line, '\n')); line = next + 1) {
+		unsigned long long sector, nr_sectors;
+
+		*next = 0;
+		if (sysfs_streq(line, "begin"))
+			err = drbd_unallocated_begin(device);
+		else if (sscanf(line, "%llu %llu", &sector, &nr_sectors) == 2)
+			err = drbd_unallocated_mark(device, sector, nr_sectors);
+		else if (*line)
+			err = -EINVAL;
+		if (!err)
+			done = next + 1 - buf;
+	}
+	/* a partial last line remains for the next write() */
+	if (!err && !done)
+		err = -EINVAL;
+	put_ldev(device);
+	kfree(buf);
+
+	if (err)
+		return err;
+	*ppos += done;
+	return done;
+}
+
+static void seq_print_admit(struct seq_file *m, const char *name, struct drbd_admit *admit)
+{
+	seq_printf(m, "%-12s latency %8llu us window %5u\n", name,
+		   (unsigned long long)div_u64(READ_ONCE(admit->lat_ewma_ns), NSEC_PER_USEC),
+		   READ_ONCE(admit->window));
+}
+
+static int device_admission_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_peer_device *peer_device;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "target %u us, admitted writes in flight %d of %u\n",
+		   READ_ONCE(drbd_admit_latency_us), atomic_read(&device->ap_bio_cnt[WRITE]),
+		   drbd_admit_window(device) ?: device->resource->res_opts.nr_requests);
+	seq_printf(m, "waited: %d writes, %lld ms\n\n", atomic_read(&device->ap_bio_waits),
+		   (long long)div_s64(atomic64_read(&device->ap_bio_wait_ns), NSEC_PER_MSEC));
+
+	seq_print_admit(m, "local", &device->admit);
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		char name[12];
+
+		snprintf(name, sizeof(name), "peer %d", peer_device->node_id);
+		seq_print_admit(m, name, &peer_device->admit);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static int device_qos_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "weight %u\n", READ_ONCE(device->qos.weight));
+	seq_printf(m, "latency_target_us %u\n", READ_ONCE(device->qos.latency_target_us));
+	seq_printf(m, "\nack latency: %llu us\n",
+		   (unsigned long long)div_u64(READ_ONCE(device->qos.ack_lat_ewma_ns), NSEC_PER_USEC));
+	seq_printf(m, "yielding to latency target: %u us\n", drbd_qos_yield_us(device));
+	seq_printf(m, "throttled: %d writes, %lld ms\n", atomic_read(&device->qos.throttled),
+		   (long long)div_s64(atomic64_read(&device->qos.throttle_ns), NSEC_PER_MSEC));
+	return 0;
+}
+
+/* "weight <n>" and "latency_target_us <n>" lines, as shown by reading */
+static ssize_t device_qos_write(struct file *file, const char __user *ubuf,
+				size_t cnt, loff_t *ppos)
+{
+	struct drbd_device *device = file_inode(file)->i_private;
+	char *buf, *line, *next;
+	ssize_t done = 0;
+	int err = 0;
+
+	buf = memdup_user_nul(ubuf, min_t(size_t, cnt, PAGE_SIZE - 1));
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	for (line = buf; !err && (next = strchr(line, '\n')); line = next + 1) {
+		unsigned int val;
+
+		*next = 0;
+		if (sscanf(line, "weight %u", &val) == 1 && val > 0)
+			WRITE_ONCE(device->qos.weight, val);
+		else if (sscanf(line, "latency_target_us %u", &val) == 1)
+			WRITE_ONCE(device->qos.latency_target_us, val);
+		else if (*line)
+			err = -EINVAL;
+		if (!err)
+			done = next + 1 - buf;
+	}
+	if (!err && !done)
+		err = -EINVAL;
+	kfree(buf);
+
+	if (err)
+		return err;
+	drbd_qos_update(device->resource);
+	*ppos += done;
+	return done;
+}
+
 #define show_per_peer(M)						\
 	seq_printf(m, "%-16s", #M ":");					\
 	for_each_peer_device(peer_device, device)			\
@@ -1224,6 +1861,14 @@ drbd_debugfs_device_attr(io_frozen)
 drbd_debugfs_device_attr(ed_gen_id)
 drbd_debugfs_device_attr(openers)
 drbd_debugfs_device_attr(md_io)
+drbd_debugfs_device_attr(submit_workers)
+drbd_debugfs_device_attr(latency)
+drbd_debugfs_device_attr(al_heat)
+drbd_debugfs_device_attr(lock_stats)
+drbd_debugfs_device_attr(readahead)
+drbd_debugfs_device_attr(admission)
+__drbd_debugfs_device_attr(unallocated, device_unallocated_write)
+__drbd_debugfs_device_attr(qos, device_qos_write)
 #ifdef CONFIG_DRBD_TIMING_STATS
 __drbd_debugfs_device_attr(req_timing, device_req_timing_write)
 #endif
@@ -1263,6 +1908,14 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(ed_gen_id);
 	vol_dcf(openers);
 	vol_dcf(md_io);
+	vol_dcf(submit_workers);
+	vol_dcf(latency);
+	vol_dcf(al_heat);
+	vol_dcf(lock_stats);
+	vol_dcf(readahead);
+	vol_dcf(admission);
+	drbd_dcf(device->debugfs_vol, device, unallocated, 0600);
+	drbd_dcf(device->debugfs_vol, device, qos, 0600);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_dcf(device->debugfs_vol, device, req_timing, 0600);
 #endif
@@ -1291,6 +1944,14 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_openers);
 	drbd_debugfs_remove(&device->debugfs_vol_md_io);
+	drbd_debugfs_remove(&device->debugfs_vol_submit_workers);
+	drbd_debugfs_remove(&device->debugfs_vol_latency);
+	drbd_debugfs_remove(&device->debugfs_vol_al_heat);
+	drbd_debugfs_remove(&device->debugfs_vol_lock_stats);
+	drbd_debugfs_remove(&device->debugfs_vol_readahead);
+	drbd_debugfs_remove(&device->debugfs_vol_admission);
+	drbd_debugfs_remove(&device->debugfs_vol_unallocated);
+	drbd_debugfs_remove(&device->debugfs_vol_qos);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_debugfs_remove(&device->debugfs_vol_req_timing);
 #endif
@@ -1354,7 +2015,7 @@ static int peer_device_resync_extents_show(struct seq_file *m, void *ignored)
 	struct drbd_device *device = peer_device->device;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
 
 	if (get_ldev_if_state(device, D_FAILED)) {
 		lc_seq_printf_stats(m, peer_device->resync_lru);
@@ -1541,6 +2202,9 @@ static void drbd_syncer_progress(struct drbd_peer_device *pd, struct seq_file *s
 			(unsigned long long)bm_bits * BM_SECT_PER_BIT);
 		if (stop_sector != 0 && stop_sector != ULLONG_MAX)
 			seq_printf(seq, " stop sector: %llu", stop_sector);
+		if (repl_state == L_VERIFY_S && pd->ov_sample_pct)
+			seq_printf(seq, " sample run %u: %u%%, %lu bits skipped",
+				   pd->ov_sample_run, pd->ov_sample_pct, pd->ov_sample_skipped);
 		seq_putc(seq, '\n');
 	}
 }
@@ -1591,8 +2255,8 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 		   test_bit(AL_SUSPENDED, &device->flags) ? 's' : '-',
 		   peer_device->send_cnt/2,
 		   peer_device->recv_cnt/2,
-		   device->writ_cnt/2,
-		   device->read_cnt/2,
+		   drbd_writ_cnt(device)/2,
+		   drbd_read_cnt(device)/2,
 		   device->al_writ_cnt,
 		   device->bm_writ_cnt,
 		   atomic_read(&device->local_cnt),
@@ -1631,6 +2295,80 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int peer_device_resync_controller_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+	struct drbd_rs_bbr *bbr = &peer_device->rs_bbr;
+	bool is_bbr = READ_ONCE(drbd_resync_controller) == DRBD_RS_CONTROLLER_BBR;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "controller: %s\n", is_bbr ? "bbr" : "plan-ahead");
+	seq_printf(m, "c_sync_rate: %d KiB/s\n", peer_device->c_sync_rate);
+	seq_printf(m, "in_flight: %d KiB\n", peer_device->rs_in_flight / 2);
+	spin_lock(&peer_device->rs_pool.lock);
+	seq_printf(m, "pool: %u free, %u out, peak %u, hits %llu misses %llu\n",
+		   peer_device->rs_pool.nr, peer_device->rs_pool.out, peer_device->rs_pool.peak,
+		   peer_device->rs_pool.hits, peer_device->rs_pool.misses);
+	spin_unlock(&peer_device->rs_pool.lock);
+	if (!is_bbr)
+		return 0;
+
+	seq_printf(m, "mode: %s\n", drbd_rs_bbr_mode_name(bbr->mode));
+	seq_printf(m, "btl_bw: %llu KiB/s\n", (unsigned long long)bbr->btl_bw / 2);
+	seq_printf(m, "min_rtt: %llu us (%u ms ago)\n",
+		   (unsigned long long)div_u64(bbr->min_rtt_ns, NSEC_PER_USEC),
+		   jiffies_to_msecs(jiffies - bbr->min_rtt_stamp));
+	seq_printf(m, "last_rtt: %llu us\n",
+		   (unsigned long long)div_u64(bbr->last_rtt_ns, NSEC_PER_USEC));
+	seq_printf(m, "cwnd: %llu KiB\n", (unsigned long long)bbr->cwnd / 2);
+	seq_printf(m, "pacing_gain: %u/8\n", bbr->gain);
+	seq_printf(m, "yielding: %d\n", bbr->app_limited);
+	return 0;
+}
+
+/* Oldest sample first; "age" is in ms relative to now, counters as in
+ * enum drbd_rs_tl_counter. Lockless, a sample may be torn while the
+ * sender fills it. */
+static int peer_device_rs_timeline_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+	struct drbd_rs_timeline *tl = &peer_device->rs_tl;
+	unsigned int nr = READ_ONCE(tl->nr);
+	unsigned int head = READ_ONCE(tl->head);
+	unsigned long now = jiffies;
+	unsigned int i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_puts(m, "age_ms length_ms requested received written throttled\n");
+	for (i = 0; i < nr; i++) {
+		struct drbd_rs_tl_sample *s =
+			&tl->sample[(head + DRBD_RS_TL_SAMPLES - nr + i) % DRBD_RS_TL_SAMPLES];
+
+		seq_printf(m, "%u %u %u %u %u %u\n",
+			   jiffies_to_msecs(now - s->jif), s->ms,
+			   s->v[DRBD_RS_TL_REQUESTED], s->v[DRBD_RS_TL_RECEIVED],
+			   s->v[DRBD_RS_TL_WRITTEN], s->v[DRBD_RS_TL_THROTTLED]);
+	}
+	return 0;
+}
+
+static int peer_device_latency_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_print_lat_bounds(m);
+	seq_print_lat_hist(m, "send", &peer_device->lat_hist[DRBD_LAT_SEND]);
+	seq_print_lat_hist(m, "ack", &peer_device->lat_hist[DRBD_LAT_ACK]);
+	return 0;
+}
+
 #define drbd_debugfs_peer_device_attr(name)					\
 static int peer_device_ ## name ## _open(struct inode *inode, struct file *file)\
 {										\
@@ -1656,6 +2394,9 @@ static const struct file_operations peer_device_ ## name ## _fops = {		\
 
 drbd_debugfs_peer_device_attr(resync_extents)
 drbd_debugfs_peer_device_attr(proc_drbd)
+drbd_debugfs_peer_device_attr(resync_controller)
+drbd_debugfs_peer_device_attr(latency)
+drbd_debugfs_peer_device_attr(rs_timeline)
 
 void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 {
@@ -1670,10 +2411,16 @@ void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 	/* debugfs create file */
 	peer_dev_dcf(resync_extents);
 	peer_dev_dcf(proc_drbd);
+	peer_dev_dcf(resync_controller);
+	peer_dev_dcf(latency);
+	peer_dev_dcf(rs_timeline);
 }
 
 void drbd_debugfs_peer_device_cleanup(struct drbd_peer_device *peer_device)
 {
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_rs_timeline);
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_latency);
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_controller);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_proc_drbd);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_extents);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev);
@@ -1723,6 +2470,148 @@ static const struct file_operations drbd_refcounts_fops = {
 	.release = single_release,
 };
 
+static void seq_print_magazines(struct seq_file *m, struct drbd_mempool_cache *cache)
+{
+	unsigned long hits = 0, misses = 0, frees = 0, spills = 0;
+	unsigned int cached = 0;
+	int cpu;
+
+	if (!cache->mag)
+		return;
+	/* racy snapshot, good enough for statistics */
+	for_each_possible_cpu(cpu) {
+		struct drbd_magazine *mag = per_cpu_ptr(cache->mag, cpu);
+
+		cached += READ_ONCE(mag->nr);
+		hits += READ_ONCE(mag->hits);
+		misses += READ_ONCE(mag->misses);
+		frees += READ_ONCE(mag->frees);
+		spills += READ_ONCE(mag->spills);
+	}
+	seq_printf(m, "%s: cached:%u hits:%lu misses:%lu frees:%lu spills:%lu\n",
+		   cache->name, cached, hits, misses, frees, spills);
+}
+
+static int drbd_magazines_show(struct seq_file *m, void *ignored)
+{
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "magazine_size: %u\n", drbd_magazine_size);
+	seq_print_magazines(m, &drbd_request_mag);
+	seq_print_magazines(m, &drbd_ee_mag);
+	return 0;
+}
+
+static int drbd_magazines_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, drbd_magazines_show, NULL);
+}
+
+static const struct file_operations drbd_magazines_fops = {
+	.owner = THIS_MODULE,
+	.open = drbd_magazines_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.release = single_release,
+};
+
+static int drbd_page_pool_show(struct seq_file *m, void *ignored)
+{
+	unsigned long hits = 0, refills = 0, fallbacks = 0, spills = 0;
+	unsigned int cached = 0;
+	int cpu;
+
+	seq_printf(m, "v: %u\n\n", 0);
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_pp_cpu *pc = per_cpu_ptr(&drbd_pp_cpu, cpu);
+
+		cached += READ_ONCE(pc->nr);
+		hits += READ_ONCE(pc->hits);
+		refills += READ_ONCE(pc->refills);
+		fallbacks += READ_ONCE(pc->fallbacks);
+		spills += READ_ONCE(pc->spills);
+	}
+	seq_printf(m, "vacant: %d\n", READ_ONCE(drbd_pp_vacant));
+	seq_printf(m, "per_cpu: cached:%u hits:%lu refills:%lu fallbacks:%lu spills:%lu\n",
+		   cached, hits, refills, fallbacks, spills);
+	return 0;
+}
+
+static int drbd_page_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, drbd_page_pool_show, NULL);
+}
+
+static const struct file_operations drbd_page_pool_fops = {
+	.owner = THIS_MODULE,
+	.open = drbd_page_pool_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.release = single_release,
+};
+
+static int drbd_resync_scheduler_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_rs_budget *b = &drbd_rs_budget;
+	struct drbd_device *device;
+	int minor;
+
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "max_concurrent: %u\n", READ_ONCE(drbd_resync_max_concurrent));
+	spin_lock(&b->lock);
+	seq_printf(m, "rate_total: %u KiB/s granted: %lu KiB throttled: %lu sharing: %u\n",
+		   READ_ONCE(drbd_resync_rate_total_kb), b->granted * (BM_BLOCK_SIZE / 1024),
+		   b->throttled, b->prev_takers);
+	spin_unlock(&b->lock);
+	seq_putc(m, '\n');
+
+	seq_puts(m, "minor peer repl_state left_KiB rate_KiB/s waits_for\n");
+	rcu_read_lock();
+	idr_for_each_entry(&drbd_devices, device, minor) {
+		struct drbd_peer_device *peer_device;
+
+		for_each_peer_device_rcu(peer_device, device) {
+			enum drbd_repl_state repl_state = peer_device->repl_state[NOW];
+			const char *waits = "-";
+
+			if (repl_state < L_SYNC_SOURCE || repl_state > L_PAUSED_SYNC_T ||
+			    repl_state == L_VERIFY_S || repl_state == L_VERIFY_T)
+				continue;
+
+			if (peer_device->resync_susp_user[NOW])
+				waits = "user";
+			else if (peer_device->resync_susp_peer[NOW])
+				waits = "peer";
+			else if (peer_device->resync_susp_other_c[NOW])
+				waits = "other-connection";
+			else if (peer_device->resync_susp_dependency[NOW])
+				waits = peer_device->rs_sched_wait ? "slot" : "resync-after";
+
+			seq_printf(m, "%u %d %s %lu %u %s\n", device->minor, peer_device->node_id,
+				   drbd_repl_str(repl_state),
+				   drbd_bm_total_weight(peer_device) * (BM_BLOCK_SIZE / 1024),
+				   peer_device->c_sync_rate, waits);
+		}
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static int drbd_resync_scheduler_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, drbd_resync_scheduler_show, NULL);
+}
+
+static const struct file_operations drbd_resync_scheduler_fops = {
+	.owner = THIS_MODULE,
+	.open = drbd_resync_scheduler_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.release = single_release,
+};
+
 static int drbd_compat_show(struct seq_file *m, void *ignored)
 {
 	return 0;
@@ -1746,6 +2635,9 @@ static const struct file_operations drbd_compat_fops = {
 void drbd_debugfs_cleanup(void)
 {
 	drbd_debugfs_remove(&drbd_debugfs_compat);
+	drbd_debugfs_remove(&drbd_debugfs_magazines);
+	drbd_debugfs_remove(&drbd_debugfs_page_pool);
+	drbd_debugfs_remove(&drbd_debugfs_resync_scheduler);
 	drbd_debugfs_remove(&drbd_debugfs_resources);
 	drbd_debugfs_remove(&drbd_debugfs_minors);
 	drbd_debugfs_remove(&drbd_debugfs_version);
@@ -1774,4 +2666,13 @@ void __init drbd_debugfs_init(void)
 
 	dentry = debugfs_create_file("compat", 0444, drbd_debugfs_root, NULL, &drbd_compat_fops);
 	drbd_debugfs_compat = dentry;
+
+	dentry = debugfs_create_file("magazines", 0444, drbd_debugfs_root, NULL, &drbd_magazines_fops);
+	drbd_debugfs_magazines = dentry;
+
+	dentry = debugfs_create_file("page_pool", 0444, drbd_debugfs_root, NULL, &drbd_page_pool_fops);
+	drbd_debugfs_page_pool = dentry;
+
+	dentry = debugfs_create_file("resync_scheduler", 0444, drbd_debugfs_root, NULL, &drbd_resync_scheduler_fops);
+	drbd_debugfs_resync_scheduler = dentry;
 }
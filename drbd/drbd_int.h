@@ -30,6 +30,7 @@
 #include <linux/backing-dev.h>
 #include <linux/genhd.h>
 #include <linux/idr.h>
+#include <linux/ioprio.h>
 #include <linux/lru_cache.h>
 #include <linux/prefetch.h>
 #include <linux/drbd_genl_api.h>
@@ -41,6 +42,7 @@
 #include "compat.h"
 #include "drbd_state.h"
 #include "drbd_protocol.h"
+#include "drbd_protocol_ext.h"
 #include "drbd_kref_debug.h"
 #include "drbd_transport.h"
 #include "drbd_polymorph_printk.h"
@@ -60,6 +62,86 @@
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
+extern bool drbd_offload_peer_submit;
+extern bool drbd_read_balancing_latency;
+extern unsigned int drbd_read_peer_balancing;
+extern bool drbd_bitmap_contiguous;
+extern bool drbd_bitmap_sparse;
+extern unsigned int drbd_bitmap_io_workers;
+extern unsigned int drbd_bitmap_io_max_kb;
+extern unsigned int drbd_al_group_commit_usec;
+extern unsigned int drbd_al_queue_depth;
+extern unsigned int drbd_al_policy;
+extern unsigned int drbd_al_extents_auto_min;
+extern unsigned int drbd_magazine_size;
+extern unsigned int drbd_submit_fanout;
+extern unsigned int drbd_submit_workers;
+extern bool drbd_peer_write_merge;
+extern unsigned int drbd_discard_inflight;
+extern unsigned int drbd_flush_pipeline;
+extern bool drbd_flush_coalesce;
+extern unsigned int drbd_sender_batch;
+extern unsigned int drbd_ack_coalesce;
+extern unsigned int drbd_resync_controller;
+extern bool drbd_resync_refill;
+extern bool drbd_hybrid_protocol;
+extern bool drbd_resync_stream;
+extern bool drbd_csum_offload;
+extern bool drbd_integrity_offload;
+extern bool drbd_integrity_recheck;
+extern bool drbd_shared_payload;
+extern bool drbd_replicate_ioprio;
+extern bool drbd_resync_idle;
+extern bool drbd_resync_multi_source;
+extern bool drbd_resync_hot_first;
+extern bool drbd_resync_interval_lock;
+extern unsigned int drbd_resync_read_cache_kb;
+extern unsigned int drbd_resync_pool;
+extern unsigned int drbd_remote_readahead_kb;
+extern unsigned int drbd_repl_max_kb;
+extern unsigned int drbd_page_order;
+extern unsigned int drbd_resync_max_concurrent;
+extern unsigned int drbd_resync_rate_total_kb;
+extern unsigned int drbd_async_buffer_mb;
+
+#define DRBD_QOS_WEIGHT_DEFAULT 100
+extern bool drbd_verify_tree;
+extern bool drbd_verify_resume;
+extern unsigned int drbd_verify_sample_pct;
+extern unsigned int drbd_bitmap_codec;
+extern bool drbd_bitmap_digest;
+extern char *drbd_data_compress;
+extern bool drbd_resync_dedupe;
+extern bool drbd_lock_stats;
+extern unsigned int drbd_latency_probe_ms;
+extern unsigned int drbd_latency_probe_cong_us;
+extern unsigned int drbd_cong_throttle_ms;
+extern unsigned int drbd_admit_latency_us;
+extern bool drbd_shared_ack_sender;
+extern bool drbd_inline_acks;
+extern bool drbd_numa_placement;
+extern unsigned int drbd_zero_elide_kb;
+extern bool drbd_csums_adaptive;
+extern bool drbd_md_poll;
+
+/* How reads are spread over several UpToDate peers, drbd_read_peer_balancing */
+enum drbd_read_peer_balancing {
+	DRBD_READ_PEERS_ROUND_ROBIN,
+	DRBD_READ_PEERS_STRIPE,		/* by LBA, in 1MiB stripes */
+	DRBD_READ_PEERS_LATENCY,	/* lowest recent read latency */
+};
+
+/* How the SyncTarget paces its resync requests, drbd_resync_controller */
+enum drbd_resync_controller {
+	DRBD_RS_CONTROLLER_PLAN_AHEAD,	/* c_plan_ahead, c_fill_target, c_delay_target */
+	DRBD_RS_CONTROLLER_BBR,		/* measured bottleneck bandwidth and min RTT */
+};
+
+/* How runlengths are coded in P_COMPRESSED_BITMAP packets we send, drbd_bitmap_codec */
+enum drbd_bitmap_codec {
+	DRBD_BM_CODEC_VLI,	/* RLE_VLI_Bits, fixed prefix code */
+	DRBD_BM_CODEC_RANGE,	/* DRBD_BM_CODE_RLE_RC, adaptive range coder */
+};
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -87,6 +169,8 @@ enum {
 
 #define ID_IN_SYNC      (4711ULL)
 #define ID_OUT_OF_SYNC  (4712ULL)
+#define ID_OV_DESCEND   (4713ULL) /* digests differ, sub-ranges follow */
+#define ID_SYNCER_DEDUPE (4714ULL) /* acks a DP_RS_DEDUPE reply */
 #define ID_SYNCER (-1ULL)
 
 #define UUID_NEW_BM_OFFSET ((u64)0x0001000000000000ULL)
@@ -127,6 +211,21 @@ drbd_insert_fault(struct drbd_device *device, unsigned int type) {
 #endif
 }
 
+/* throughput limit of one direction of a backing device, fault_*_kbps */
+struct drbd_fault_shaper {
+	spinlock_t lock;
+	u64 next_ns;	/* when the queued bios are through */
+};
+
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+extern bool drbd_fault_delay_bio(struct drbd_device *device, struct bio *bio);
+#else
+static inline bool drbd_fault_delay_bio(struct drbd_device *device, struct bio *bio)
+{
+	return false;
+}
+#endif
+
 /*
  * our structs
  *************************/
@@ -154,10 +253,12 @@ struct bm_xfer_ctx {
 	/* during xfer, current position within the bitmap */
 	unsigned long bit_offset;
 	unsigned long word_offset;
+	/* sender: encoding a chunk, not the last one, see send_bitmap_chunks() */
+	unsigned long min_plain_words;
 
-	/* statistics; index: (h->command == P_BITMAP) */
-	unsigned packets[2];
-	unsigned bytes[2];
+	/* statistics; index: 0 RLE_VLI_Bits, 1 P_BITMAP, 2 DRBD_BM_CODE_RLE_RC */
+	unsigned packets[3];
+	unsigned bytes[3];
 };
 
 extern void INFO_bm_xfer_stats(struct drbd_peer_device *, const char *, struct bm_xfer_ctx *);
@@ -203,6 +304,18 @@ struct drbd_thread {
 	const char *name;
 };
 
+/* Tests eight words per step, and branches once for them */
+static inline bool drbd_mem_is_zero(const void *addr, unsigned int len)
+{
+	const unsigned long *p = addr;
+
+	for (; len >= 8 * sizeof(long); p += 8, len -= 8 * sizeof(long)) {
+		if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+			return false;
+	}
+	return !memchr_inv(p, 0, len);
+}
+
 static inline enum drbd_thread_state get_t_state(struct drbd_thread *thi)
 {
 	/* THINK testing the t_state seems to be uncritical in all cases
@@ -252,15 +365,50 @@ extern u64 directly_connected_nodes(struct drbd_resource *, enum which_state);
 	 typecheck(u64, b) && \
 	((s64)(a) - (s64)(b) > 0))
 
+/* The copy of a protocol A write in the send buffer of one connection */
+struct drbd_sbuf_ref {
+	struct drbd_connection *connection;	/* NULL: not buffered */
+	struct bio *bio;	/* over the ring pages, once ready */
+	u64 end;		/* ring position after the data */
+	bool ready;
+};
+
+/* Data integrity digest and stable copy of a write that goes to several
+ * peers, made once by the first sender, see drbd_req_payload() */
+struct drbd_req_payload {
+	struct shash_alg *digest_alg;	/* NULL: no digest */
+	u8 digest[HASH_MAX_DIGESTSIZE];
+	struct bio *bio;		/* over pages; NULL: no copy */
+	unsigned int nr_pages;
+	struct page *pages[];
+};
+
 /* An application I/O request.
  *
  * Fields marked as "immutable" may only be modified when the request is
  * exclusively owned, e.g. when the request is created or is being retried.
  */
 struct drbd_request {
+	/* Touched by every state transition, in __req_mod() and mod_rq_state(),
+	 * and on completion.  Keep these together at the start, the slab cache
+	 * aligns the objects to cache lines. */
+
+	/* lock to protect state flags */
+	spinlock_t rq_lock;
+	unsigned int local_rq_state;
+	u16 net_rq_state[DRBD_NODE_ID_MAX];
+
+	/* once it hits 0, we may complete the master_bio */
+	atomic_t completion_ref;
+	/* once it hits 0, we may destroy this drbd_request object */
+	struct kref kref;
+
 	/* "immutable" */
 	struct drbd_device *device;
 
+	/* master bio pointer; "immutable" */
+	struct bio *master_bio;
+
 	/* if local IO is not allowed, will be NULL.
 	 * if local IO _is_ allowed, holds the locally submitted bio clone,
 	 * or, after local IO completion, the ERR_PTR(error).
@@ -271,9 +419,11 @@ struct drbd_request {
 	struct bio *private_bio;
 
 	/* Fields sector and size are "immutable". Otherwise protected by
-	 * interval_lock. */
+	 * interval_lock for reads, drbd_write_lock() for writes. */
 	struct drbd_interval i;
 
+	/* Used on submission, completion and for the peer acks. */
+
 	/* epoch: used to check on "completion" whether this req was in
 	 * the current epoch, and we therefore have to close it,
 	 * causing a p_barrier packet to be send, starting a new epoch.
@@ -298,6 +448,15 @@ struct drbd_request {
 	 */
 	u64 dagtag_sector;
 
+	/* Creates a dependency chain between writes so that we know that a
+	 * peer ack can be sent when kref reaches zero.
+	 *
+	 * If not NULL, destruction of this drbd_request will
+	 * cause kref_put() on ->destroy_next.
+	 *
+	 * "immutable" */
+	struct drbd_request *destroy_next;
+
 	/* list entry in transfer log (protected by RCU) */
 	struct list_head tl_requests;
 
@@ -305,13 +464,18 @@ struct drbd_request {
 	 * protected by the locks for those lists */
 	struct list_head list;
 
-	/* master bio pointer; "immutable" */
-	struct bio *master_bio;
-
 	/* see struct drbd_device */
 	struct list_head req_pending_master_completion;
 	struct list_head req_pending_local;
 
+	/* Rarely used: protocol A send buffer, timeouts and statistics. */
+
+	/* see drbd_sbuf_reserve() */
+	struct drbd_sbuf_ref sbuf;
+
+	/* see drbd_req_payload() */
+	struct drbd_req_payload *payload;
+
 	/* for generic IO accounting; "immutable" */
 	unsigned long start_jif;
 
@@ -319,6 +483,13 @@ struct drbd_request {
 	unsigned long pre_submit_jif;
 	unsigned long pre_send_jif[DRBD_PEERS_MAX];
 
+	/* for latency based read balancing, zero if not tracked */
+	ktime_t rb_start_kt;
+
+	/* for the latency histograms, see drbd_lat_record() */
+	ktime_t lat_start_kt;
+	ktime_t lat_submit_kt;
+
 #ifdef CONFIG_DRBD_TIMING_STATS
 	/* for DRBD internal statistics */
 	ktime_t start_kt;
@@ -365,26 +536,6 @@ struct drbd_request {
 	 *      how long did it take the lower level device to complete this request
 	 */
 
-
-	/* once it hits 0, we may complete the master_bio */
-	atomic_t completion_ref;
-	/* once it hits 0, we may destroy this drbd_request object */
-	struct kref kref;
-
-	/* Creates a dependency chain between writes so that we know that a
-	 * peer ack can be sent when kref reaches zero.
-	 *
-	 * If not NULL, destruction of this drbd_request will
-	 * cause kref_put() on ->destroy_next.
-	 *
-	 * "immutable" */
-	struct drbd_request *destroy_next;
-
-	/* lock to protect state flags */
-	spinlock_t rq_lock;
-	unsigned int local_rq_state;
-	u16 net_rq_state[DRBD_NODE_ID_MAX];
-
 	/* for reclaim from transfer log */
 	struct rcu_head rcu;
 };
@@ -398,11 +549,21 @@ struct drbd_peer_ack {
 	u64 dagtag_sector;
 };
 
+/* Per CPU part of the peer ack accumulation: completed writes are merged into
+ * the request of the CPU they complete on, until a flush, see
+ * __drbd_flush_peer_acks() */
+struct drbd_peer_ack_cpu {
+	spinlock_t lock;
+	struct drbd_request *req;  /* newest request not yet PEER_ACK'ed */
+	u64 first_dagtag;  /* dagtag of the first write req stands for */
+};
+
 /* Tracks received writes grouped in epochs. Protected by epoch_lock. */
 struct drbd_epoch {
 	struct drbd_connection *connection;
 	struct drbd_peer_request *oldest_unconfirmed_peer_req;
 	struct list_head list;
+	struct list_head flush_list; /* see drbd_flush_epoch_async() */
 	unsigned int barrier_nr;
 	atomic_t epoch_size; /* increased on every request added. */
 	atomic_t active;     /* increased on every req. added, and dec on every finished. */
@@ -425,18 +586,26 @@ struct digest_info {
 };
 
 struct drbd_peer_request {
+	/* used on receive, submit, completion and ack; keep them together */
 	struct drbd_work w;
 	struct drbd_peer_device *peer_device;
+	unsigned long flags;	/* see comments on ee flag bits below */
+	struct drbd_interval i;
+	unsigned int opf; /* to be used as bi_opf */
+	unsigned short ioprio; /* to be used as bi_ioprio */
+	atomic_t pending_bios;
+	struct drbd_page_chain_head page_chain;
+
 	struct list_head recv_order; /* writes only */
 	/* writes only, blocked on activity log;
 	 * FIXME merge with rcv_order or w.list? */
 	struct list_head wait_for_actlog;
+	/* next peer write submitted in the same bio, see drbd_submit_peer_requests() */
+	struct drbd_peer_request *merged_next;
+	/* digest of a resync or verify read, hashed ahead by drbd_csum_wq;
+	 * of a peer write, as received, see drbd_verify_peer_write_digest() */
+	struct drbd_csum_job *csum_job;
 
-	struct drbd_page_chain_head page_chain;
-	unsigned int opf; /* to be used as bi_opf */
-	atomic_t pending_bios;
-	struct drbd_interval i;
-	unsigned long flags;	/* see comments on ee flag bits below */
 	union {
 		struct { /* regular peer_request */
 			struct drbd_epoch *epoch; /* for writes */
@@ -456,6 +625,275 @@ struct drbd_peer_request {
 	};
 };
 
+#define DRBD_CSUM_JOB_DIGEST_MAX 64
+
+struct drbd_csum_job {
+	struct list_head list;		/* in drbd_csum_batch */
+	struct drbd_peer_request *peer_req;
+	struct crypto_shash *tfm;	/* digest was computed with */
+	struct drbd_integrity_tfm *integrity;	/* holds tfm of a deferred digest check */
+	u8 digest[DRBD_CSUM_JOB_DIGEST_MAX];
+};
+
+/* The peer's data-integrity-alg.  Deferred digest checks of peer writes hold a
+ * reference, as a P_PROTOCOL_UPDATE may replace it while they are pending. */
+struct drbd_integrity_tfm {
+	struct kref kref;
+	struct crypto_shash *tfm;
+};
+
+#define DRBD_CSUM_BATCH_MAX 64
+
+/* Reads completing while the previous batch of a connection did not start
+ * hashing yet join it; one work item hashes them all */
+struct drbd_csum_batch {
+	struct work_struct work;
+	struct drbd_connection *connection;
+	struct list_head jobs;
+	unsigned int nr_jobs;
+};
+
+/* Contention counters of the hot spinlocks, with drbd_lock_stats enabled.
+ * Only written with the lock held; every DRBD_LOCK_STAT_SAMPLE_MASK+1th
+ * acquisition also measures the hold time. See drbd_lock_irq() and friends. */
+#define DRBD_LOCK_STAT_SAMPLE_MASK 63
+
+struct drbd_lock_stat {
+	u64 acquired;
+	u64 contended;		/* the spin_trylock() failed */
+	u64 sampled;
+	u64 sum_hold_ns;	/* of the sampled ones */
+	u64 max_hold_ns;
+	ktime_t hold_kt;	/* of the current holder, if sampled */
+};
+
+/* Latency histograms of application requests, in debugfs "latency" files.
+ * Bucket 0 counts latencies below 1 us, bucket i those in [2^(i-1), 2^i) us,
+ * the last one also everything above. */
+#define DRBD_LAT_BUCKETS 24
+
+struct drbd_lat_hist {
+	u64 bucket[DRBD_LAT_BUCKETS];
+};
+
+/* Cluster wide state changes this node initiated, in the debugfs
+ * "twopc_stats" file. Only updated by the initiator, which holds the
+ * state_sem. */
+struct drbd_twopc_stats {
+	struct drbd_lat_hist prepare;	/* prepare sent .. all replies in, per attempt */
+	struct drbd_lat_hist total;	/* first prepare .. commit or abort */
+	u64 committed;
+	u64 aborted;
+	u64 retries;
+	u64 timeouts;			/* attempts without all replies in time */
+	u64 concurrent;			/* attempts a peer answered with "retry" */
+};
+
+/* Per connection, for the twopcs we sent to that peer; updated by the ack
+ * receiver, except for the ones noted. */
+struct drbd_twopc_peer_stats {
+	struct drbd_lat_hist reply;	/* prepare sent .. reply received */
+	ktime_t sent_kt;
+	u64 yes;
+	u64 no;
+	u64 retry;
+	u64 rejected;	/* receiver: its twopcs we answered "retry", see check_concurrent_transactions() */
+	u64 yielded;	/* receiver: our own twopcs we aborted for one of its */
+};
+
+/* Sectors read and written by the backing device, on behalf of us or of
+ * peers.  Updated on every completion, so kept per cpu; summed up only
+ * for the statistics, see drbd_read_cnt() and drbd_writ_cnt(). */
+struct drbd_io_cnt {
+	unsigned int read;
+	unsigned int writ;
+};
+
+enum drbd_lat_stage {
+	DRBD_LAT_AL_WAIT,	/* write arrived .. in the activity log */
+	DRBD_LAT_LOCAL_READ,	/* submitted to the backing device .. completed */
+	DRBD_LAT_LOCAL_WRITE,
+	DRBD_LAT_READ,		/* arrived .. completed upwards */
+	DRBD_LAT_WRITE,
+	DRBD_LAT_DEVICE_STAGES
+};
+
+enum drbd_lat_peer_stage {
+	DRBD_LAT_SEND,		/* sending a write to the peer */
+	DRBD_LAT_ACK,		/* write arrived .. acked by the peer */
+	DRBD_LAT_PEER_STAGES
+};
+
+/* Sampled write heat per activity log extent, see drbd_al_heat_sample().
+ * A count-min sketch, aged by halving once per window, plus the heaviest
+ * extents seen and a linear counting bitmap for the working set size. */
+#define DRBD_AL_HEAT_SAMPLE_SHIFT 4	/* sample one in 16 writes */
+#define DRBD_AL_HEAT_DEPTH 4
+#define DRBD_AL_HEAT_WIDTH_SHIFT 10
+#define DRBD_AL_HEAT_TOP 16
+#define DRBD_AL_HEAT_WS_BITS 4096
+#define DRBD_AL_HEAT_WINDOW (60 * HZ)
+
+struct drbd_al_heat {
+	spinlock_t lock;
+	unsigned long window_start;	/* jiffies */
+	u32 cell[DRBD_AL_HEAT_DEPTH][1 << DRBD_AL_HEAT_WIDTH_SHIFT];
+	struct {
+		unsigned int enr;
+		u32 count;		/* 0: unused */
+	} top[DRBD_AL_HEAT_TOP];
+	DECLARE_BITMAP(ws, DRBD_AL_HEAT_WS_BITS);
+	unsigned int ws_last;		/* estimate for the previous window */
+	u64 samples;
+	u64 activations;		/* extents that became active in the AL */
+	u64 reactivations;		/* ... and were sampled hot not long before */
+};
+
+/* Per connection state of the P_DATA compression, see drbd_protocol_ext.h */
+struct drbd_compress {
+	enum drbd_compress_alg alg;
+	struct crypto_comp *tx_tfm;	/* sender thread */
+	struct crypto_comp *rx_tfm;	/* receiver thread */
+	void *tx_src, *tx_dst;		/* DRBD_MAX_BIO_SIZE each */
+	void *rx_src, *rx_dst;
+	/* requests to send uncompressed before trying again */
+	unsigned int skip, backoff;
+	u64 tx_plain, tx_wire, tx_bypassed;
+	u64 rx_plain, rx_wire;
+};
+
+#define DRBD_RS_DEDUPE_SLOTS_SHIFT 10
+
+/* SyncSource: where the last resync block with a certain digest went */
+struct drbd_rs_dedupe_slot {
+	u64 tag;	/* leading bytes of the digest */
+	sector_t sector;
+	unsigned int size;
+};
+
+struct drbd_rs_dedupe {
+	struct drbd_rs_dedupe_slot slot[1 << DRBD_RS_DEDUPE_SLOTS_SHIFT];
+	u64 refs_sent, bytes_saved;
+};
+
+/* SyncSource to several peers: a resync block read for one of them, kept
+ * for a short while in case the others ask for it too, see
+ * drbd_rs_cache_lookup(). An entry is in use while size is set; its data
+ * stays NULL until the read completed. */
+#define DRBD_RS_CACHE_ENTRIES	32
+#define DRBD_RS_CACHE_WINDOW	(2 * HZ)
+
+struct drbd_rs_cache_entry {
+	sector_t sector;
+	unsigned int size;
+	unsigned int users;	/* copying from data */
+	unsigned long start;	/* jiffies */
+	u64 wanted;		/* node ids of the SyncTargets yet to ask */
+	bool valid;		/* no write to the range since the read */
+	void *data;
+};
+
+struct drbd_rs_cache {
+	spinlock_t lock;
+	unsigned int used;	/* entries */
+	size_t bytes;		/* of all entries, in flight or not */
+	u64 hits, bytes_saved;
+	struct drbd_rs_cache_entry e[DRBD_RS_CACHE_ENTRIES];
+};
+
+/* Diskless Primary, application reading sequentially: data read ahead from
+ * a peer, see drbd_ra_read(). An entry is in use while size is set; done
+ * once its bio completed. Writes to the range, and changes of the roles,
+ * make it invalid, even while its read is in flight. */
+#define DRBD_RA_ENTRIES		8
+#define DRBD_RA_MIN_WINDOW	(128 << 10)
+#define DRBD_RA_EXPIRE		(5 * HZ)
+
+struct drbd_ra_entry {
+	sector_t sector;
+	unsigned int size;
+	unsigned int users;	/* copying from bio */
+	unsigned long start;	/* jiffies */
+	bool done;
+	bool valid;
+	bool consumed;		/* a read reached its end */
+	struct bio *bio;	/* owns the pages */
+};
+
+struct drbd_readahead {
+	spinlock_t lock;
+	sector_t next_sector;	/* where the last read ended */
+	sector_t ra_end;	/* read ahead issued up to here */
+	unsigned int seq;	/* reads in a row, each where the last ended */
+	unsigned int window;	/* bytes, 0 while not reading ahead */
+	u64 hits, misses, bytes_issued, bytes_hit, dropped;
+	struct drbd_ra_entry e[DRBD_RA_ENTRIES];
+};
+
+/* Admission control of application writes, one per path: the local disk and
+ * each peer. The window of writes in flight shrinks while the latency of the
+ * path exceeds admit_latency_us, and grows while it is below and the window is
+ * in use. See drbd_admit_sample(). */
+#define DRBD_ADMIT_MIN_WINDOW	4
+
+struct drbd_admit {
+	u64 lat_ewma_ns;	/* write arrived .. completed on this path */
+	unsigned int window;	/* 0 until the first adjustment */
+	unsigned long next_jif;	/* adjust at most once per latency */
+};
+
+/* Round trip of a sampled protocol C write to the peer's receiver and back,
+ * leaving out the peer's disk, see drbd_latency_probe_start(). In ns. */
+struct drbd_latency_probe {
+	spinlock_t lock;
+	u64 block_id;		/* of the write in flight, 0 if none */
+	ktime_t sent_kt;
+	unsigned long last_sent; /* jiffies */
+	u64 last_ns, avg_ns, min_ns, max_ns;
+	u64 probes, lost;
+};
+
+/* Once per second samples of resync and online verify progress, see
+ * drbd_rs_tl_tick(). Counters are in sectors, except for THROTTLED,
+ * which counts the times drbd_rs_should_slow_down() said so. */
+enum drbd_rs_tl_counter {
+	DRBD_RS_TL_REQUESTED,	/* resync/verify requests sent */
+	DRBD_RS_TL_RECEIVED,	/* their replies came in */
+	DRBD_RS_TL_WRITTEN,	/* resync data written locally */
+	DRBD_RS_TL_THROTTLED,
+	DRBD_RS_TL_COUNTERS
+};
+
+#define DRBD_RS_TL_SAMPLES 128
+
+struct drbd_rs_tl_sample {
+	unsigned long jif;	/* end of the sample */
+	unsigned int ms;	/* its length */
+	u32 v[DRBD_RS_TL_COUNTERS];
+};
+
+struct drbd_rs_timeline {
+	atomic64_t total[DRBD_RS_TL_COUNTERS];
+	/* below: sender only */
+	u64 last[DRBD_RS_TL_COUNTERS];	/* totals at the last sample */
+	unsigned long last_jif;
+	unsigned int head;		/* next slot to fill */
+	unsigned int nr;		/* valid samples */
+	struct drbd_rs_tl_sample sample[DRBD_RS_TL_SAMPLES];
+};
+
+/* Resync peer requests done with, kept with their pages for the next ones,
+ * see drbd_rs_alloc_peer_req(). Process context only. While here, the
+ * pages do not count in pp_in_use. */
+struct drbd_rs_pool {
+	spinlock_t lock;
+	struct list_head free;	/* via w.list */
+	unsigned int nr;	/* on free */
+	unsigned int out;	/* taken, not back yet */
+	unsigned int peak;	/* of out, since the pool was last drained */
+	u64 hits, misses;
+};
+
 /* Equivalent to bio_op and req_op. */
 #define peer_req_op(peer_req) \
 	((peer_req)->opf & REQ_OP_MASK)
@@ -525,8 +963,24 @@ enum {
 	/* If it contains only 0 bytes, send back P_RS_DEALLOCATED */
 	__EE_RS_THIN_REQ,
 
+	/* Resync write of a local copy, for a DP_RS_DEDUPE reply */
+	__EE_RS_DEDUPE,
+
+	/* P_RS_THIN_REQ of an unallocated range, not read */
+	__EE_RS_UNALLOCATED,
+
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* Resync IO holding its range in the write interval trees,
+	 * with resync_interval_lock */
+	__EE_RS_INTERVAL,
+
+	/* Resync read with a drbd_rs_cache entry waiting for its data */
+	__EE_RS_CACHE,
+
+	/* From peer_device->rs_pool, goes back there when freed */
+	__EE_RS_POOL,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_SET_OUT_OF_SYNC     (1<<__EE_SET_OUT_OF_SYNC)
@@ -544,7 +998,12 @@ enum {
 #define EE_WRITE_SAME		(1<<__EE_WRITE_SAME)
 #define EE_APPLICATION		(1<<__EE_APPLICATION)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
+#define EE_RS_DEDUPE		(1<<__EE_RS_DEDUPE)
+#define EE_RS_UNALLOCATED	(1<<__EE_RS_UNALLOCATED)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_RS_INTERVAL		(1<<__EE_RS_INTERVAL)
+#define EE_RS_CACHE		(1<<__EE_RS_CACHE)
+#define EE_RS_POOL		(1<<__EE_RS_POOL)
 
 /* flag bits per device */
 enum device_flag {
@@ -606,6 +1065,10 @@ enum peer_device_flag {
 	SYNC_TARGET_TO_BEHIND,  /* SyncTarget, wait for Behind */
 	HANDLING_CONGESTION,    /* Set while testing for congestion and handling it */
 	HANDLE_CONGESTION,      /* tell worker to change state due to congestion */
+	VERIFY_INTERRUPTED,	/* Online verify as VerifyS lost the connection, resume it */
+	VERIFY_RESUME,		/* tell worker to resume an interrupted online verify */
+	BITMAP_DIGEST_SENT,	/* WFBitMapS: offered our bitmap digest instead of the bitmap */
+	BITMAP_SENT_FIRST,	/* WFBitMapT: digests differed, sent our bitmap before the peer's */
 };
 
 /* We could make these currently hardcoded constants configurable
@@ -647,6 +1110,8 @@ enum bm_flag {
 
 	BM_LOCK_SINGLE_SLOT = 0x10,
 	BM_ON_DAX_PMEM = 0x10000,
+	BM_CONTIGUOUS = 0x20000, /* in core, each bitmap index is contiguous */
+	BM_SPARSE = 0x40000, /* BM_CONTIGUOUS, all clear/all set pages not allocated */
 };
 
 struct drbd_bitmap {
@@ -668,6 +1133,24 @@ struct drbd_bitmap {
 	enum bm_flag bm_flags;
 	unsigned int bm_max_peers;
 
+	/* One bit per bitmap page and bitmap index: clear if that page is
+	 * known to have no bits set for that peer. Lets find_next and count
+	 * skip empty pages. May be NULL, then nothing is skipped. */
+	unsigned long *bm_summary;
+	unsigned long bm_summary_bits;
+
+	/* With BM_CONTIGUOUS, bm_pages holds bm_pages_per_index pages for
+	 * each bitmap index, and is not in on-disk order. The per page
+	 * flags of the bm_number_of_pages on-disk pages live in bm_disk_flags. */
+	unsigned long bm_pages_per_index;
+	unsigned long *bm_disk_flags;
+
+	/* With BM_SPARSE, a NULL bm_pages[] entry stands for a page with all
+	 * bits clear, bm_full_page for one with all bits set.  Pages needed
+	 * in atomic context come from bm_sparse_pool. */
+	struct page *bm_full_page;
+	mempool_t bm_sparse_pool;
+
 	/* exclusively to be used by __al_write_transaction(),
 	 * and drbd_bm_write_hinted() -> bm_rw() called from there.
 	 * One activity log extent represents 4MB of storage, which are 1024
@@ -725,12 +1208,22 @@ struct drbd_md {
 	u32 al_size_4k; /* cached product of the above */
 };
 
+/* See drbd_unallocated_covers() */
+struct drbd_unallocated {
+	unsigned int chunk_shift;	/* in sectors */
+	unsigned long nr_chunks;
+	unsigned long *bits;		/* unallocated */
+	unsigned long *written;		/* since drbd_unallocated_begin() */
+	unsigned long map[];
+};
+
 struct drbd_backing_dev {
 	struct block_device *backing_bdev;
 	struct block_device *md_bdev;
 	struct drbd_md md;
 	struct disk_conf *disk_conf; /* RCU, for updates: resource->conf_update */
 	sector_t known_size; /* last known size of that backing device */
+	struct drbd_unallocated *unallocated;
 #if IS_ENABLED(CONFIG_DEV_DAX_PMEM) && !defined(DAX_PMEM_IS_INCOMPLETE)
 	struct dax_device *dax_dev;
 	struct meta_data_on_disk_9 *md_on_pmem; /* address of md_offset */
@@ -746,6 +1239,31 @@ struct drbd_md_io {
 	atomic_t in_use;
 	unsigned int done;
 	int error;
+
+	/* synchronous writes, [0] waited for, [1] polled for, see md_poll */
+	u64 writes[2];
+	u64 write_ns[2];
+};
+
+/* Pipelined activity log writes, see drbd_al_begin_io_commit_pipelined() */
+#define AL_PIPELINE_MAX 8
+
+struct drbd_al_pipeline_slot {
+	struct drbd_device *device;
+	unsigned int seq;	/* al_pipe.issued when it was used */
+	unsigned int tr_number;
+	int error;
+	bool done;	/* on disk, set from the bio completion */
+	/* submitted once this and all earlier transactions are on disk */
+	struct list_head requests;	/* struct drbd_request, ->list */
+	struct list_head peer_requests;	/* struct drbd_peer_request, ->wait_for_actlog */
+};
+
+struct drbd_al_pipeline {
+	struct drbd_al_pipeline_slot slot[AL_PIPELINE_MAX];
+	unsigned int issued;	/* slot[issued % AL_PIPELINE_MAX] is the next to use */
+	unsigned int retired;	/* slots done, and their requests submitted; see al_extent */
+	atomic_t in_flight;	/* transactions not yet on disk */
 };
 
 struct bm_io_work {
@@ -770,6 +1288,42 @@ struct fifo_buffer {
 };
 extern struct fifo_buffer *fifo_alloc(int fifo_size);
 
+enum drbd_rs_bbr_mode {
+	RS_BBR_STARTUP,		/* double the rate each turn, until it stops growing */
+	RS_BBR_DRAIN,		/* drain the queue built up during startup */
+	RS_BBR_PROBE_BW,	/* cruise at the estimated rate, probing for more */
+	RS_BBR_PROBE_RTT,	/* keep little in flight, to measure the min RTT again */
+};
+
+#define RS_BBR_BW_WIN 10 /* turns of the resync controller */
+
+/* State of the BBR style resync controller, see drbd_rs_bbr_controller().
+ * Only the sender touches it, apart from the RTT probe: that is armed by the
+ * sender and completed by rs_sectors_came_in() in the receiver. */
+struct drbd_rs_bbr {
+	enum drbd_rs_bbr_mode mode;
+	u64 bw[RS_BBR_BW_WIN];	/* delivery rate of the last turns, sectors/s */
+	unsigned int bw_idx;
+	u64 btl_bw;		/* max of bw[]: bottleneck bandwidth estimate */
+	u64 full_bw;		/* STARTUP: last rate that grew by 25% */
+	unsigned int full_bw_cnt;
+	u64 min_rtt_ns;
+	unsigned long min_rtt_stamp;	/* jiffies */
+	u64 probe_rtt_min_ns;	/* min RTT seen during PROBE_RTT */
+	unsigned long probe_rtt_done;	/* jiffies */
+	u64 last_rtt_ns;
+	unsigned int cycle_idx;	/* PROBE_BW gain cycle */
+	unsigned int gain;	/* pacing gain of this turn, in 1/8 */
+	u64 cwnd;		/* sectors we allow in flight */
+	bool app_limited;	/* yielding to application IO this turn */
+
+	atomic_t sect_received;	/* sectors of resync replies, wraps */
+	atomic_t probe_armed;
+	int probe_mark;		/* sect_received at which the probe is answered */
+	ktime_t probe_kt;
+	atomic64_t rtt_sample_ns;
+};
+
 /* flag bits per connection */
 enum connection_flag {
 	SEND_PING,
@@ -853,12 +1407,48 @@ struct drbd_thread_timing_details
 };
 #define DRBD_THREAD_DETAILS_HIST	16
 
+#define DRBD_SEND_BUFFER_PAGES 4
+
 struct drbd_send_buffer {
 	struct page *page;  /* current buffer page for sending data */
 	char *unsent;  /* start of unsent area != pos if corked... */
 	char *pos; /* position within that page */
 	int allocated_size; /* currently allocated space */
 	int additional_size;  /* additional space to be added to next packet's size */
+
+	/* Filled pages with unsent data are queued in this ring instead of
+	   being sent one by one, flush_send_buffer() pushes them out in order. */
+	struct page *ring[DRBD_SEND_BUFFER_PAGES]; /* ring[cur] == page */
+	unsigned int cur;
+	unsigned int nr_queued; /* number of queued pages before cur */
+	struct {
+		unsigned int offset;
+		unsigned int size;
+	} queued[DRBD_SEND_BUFFER_PAGES]; /* indexed like ring */
+	int queued_size; /* sum of queued[].size */
+
+	u64 packets; /* sent via __send_command() */
+	u64 corked_ns; /* sum of time spent corked */
+	ktime_t corked_kt; /* while CORKED is set */
+
+	/* The P_BLOCK_ACKS packet that ends at pos, if any. Preparing another
+	   packet or flushing closes it, see drbd_send_block_ack(). */
+	char *block_acks;
+	int block_acks_vnr;
+	enum drbd_packet block_acks_cmd;
+	unsigned int block_acks_count;
+};
+
+/* Protocol A send buffer of a connection, see drbd_sbuf_reserve(). Positions
+ * count pages and only ever grow; the ring holds pages [head, tail). */
+struct drbd_async_sbuf {
+	struct page **pages;
+	unsigned int nr_pages;
+	u64 tail;		/* reserved, under tl_update_lock */
+	u64 head;		/* released by the sender */
+	wait_queue_head_t wait;	/* for drbd_sbuf_ref.ready */
+	u64 reqs, bytes;	/* buffered so far */
+	u64 full;		/* not buffered for lack of space */
 };
 
 
@@ -869,7 +1459,11 @@ struct drbd_resource {
 	struct dentry *debugfs_res_volumes;
 	struct dentry *debugfs_res_connections;
 	struct dentry *debugfs_res_in_flight_summary;
+	struct dentry *debugfs_res_in_flight_counters;
 	struct dentry *debugfs_res_state_twopc;
+	struct dentry *debugfs_res_twopc_stats;
+	struct dentry *debugfs_res_lock_stats;
+	struct dentry *debugfs_res_placement;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -895,15 +1489,18 @@ struct drbd_resource {
 
 	/* Protects updates to the transfer log and related counters. */
 	spinlock_t tl_update_lock;
+	struct drbd_lock_stat tl_update_lock_stat;
 	struct list_head transfer_log;	/* all requests not yet fully processed */
 	struct drbd_request *tl_previous_write;
+	atomic_t tl_completion_susp;	/* requests in there with RQ_COMPLETION_SUSP */
 
 	spinlock_t peer_ack_lock;
 	struct list_head peer_ack_req_list;  /* requests to send peer acks for */
 	struct list_head peer_ack_list;  /* peer acks to send */
 	struct drbd_work peer_ack_work;
 	u64 last_peer_acked_dagtag;  /* dagtag of last PEER_ACK'ed request */
-	struct drbd_request *peer_ack_req;  /* last request not yet PEER_ACK'ed */
+	struct drbd_peer_ack_cpu __percpu *peer_ack_cpu;
+	u64 peer_ack_ok_nodes;  /* RQ_NET_OK nodes of all requests in peer_ack_cpu */
 
 	struct semaphore state_sem;
 	wait_queue_head_t state_wait;  /* upon each state change. */
@@ -915,9 +1512,13 @@ struct drbd_resource {
 	struct list_head twopc_parents;  /* prepared on behalf of peer */
 	u64 twopc_parent_nodes;
 	struct twopc_reply twopc_reply;
+	struct drbd_twopc_stats twopc_stats;
 	struct timer_list twopc_timer;
 	struct drbd_work twopc_work;
 	wait_queue_head_t twopc_wait;
+	/* writes held back by drbd_qos_throttle(), woken on acks */
+	wait_queue_head_t qos_wait;
+	bool qos_active;	/* some volume has a QoS latency target */
 	struct twopc_resize {
 		int dds_flags;            /* from prepare phase */
 		sector_t user_size;       /* from prepare phase */
@@ -945,6 +1546,7 @@ struct drbd_resource {
 	unsigned cached_min_aggreed_protocol_version;
 
 	cpumask_var_t cpu_mask;
+	int cpu_node;		/* NUMA node cpu_mask was chosen for, or NUMA_NO_NODE */
 
 	struct drbd_work_queue work;
 	struct drbd_thread worker;
@@ -970,6 +1572,9 @@ struct drbd_connection {
 	struct dentry *debugfs_conn_oldest_requests;
 	struct dentry *debugfs_conn_transport;
 	struct dentry *debugfs_conn_debug;
+	struct dentry *debugfs_conn_compression;
+	struct dentry *debugfs_conn_send_buffer;
+	struct dentry *debugfs_conn_latency_probe;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -997,15 +1602,22 @@ struct drbd_connection {
 	int agreed_pro_version;		/* actually used protocol version */
 	u32 agreed_features;
 	unsigned long last_received;	/* in jiffies, either socket */
+	u64 packets_received[2];	/* per stream */
 	atomic_t ap_in_flight; /* App sectors in flight (waiting for ack) */
 	atomic_t rs_in_flight; /* Resync sectors in flight */
+	wait_queue_head_t cong_wait;	/* ap_in_flight went down */
+	atomic_t cong_throttled;	/* writes delayed by drbd_congestion_throttle() */
+	atomic_t cong_throttle_timeouts; /* ... still congested after cong_throttle_ms */
+	atomic64_t cong_throttle_ns;
 
 	struct drbd_work connect_timer_work;
 	struct timer_list connect_timer;
+	struct timer_list request_timer;	/* see connection_request_timer_fn() */
 
 	struct crypto_shash *cram_hmac_tfm;
 	struct crypto_shash *integrity_tfm;  /* checksums we compute, updates protected by connection->mutex[DATA_STREAM] */
 	struct crypto_shash *peer_integrity_tfm;  /* checksums we verify, only accessed from receiver thread  */
+	struct drbd_integrity_tfm *peer_integrity;  /* owns peer_integrity_tfm */
 	struct crypto_shash *csums_tfm;
 	struct crypto_shash *verify_tfm;
 
@@ -1016,6 +1628,8 @@ struct drbd_connection {
 	struct drbd_epoch *current_epoch;
 	spinlock_t epoch_lock;
 	unsigned int epochs;
+	atomic_t epoch_flushes;	/* in flight, see drbd_flush_epoch_async() */
+	struct list_head flush_coalesced; /* epochs for the next flush, under epoch_lock */
 
 	unsigned long last_reconnect_jif;
 	/* empty member on older kernels without blk_start_plug() */
@@ -1037,8 +1651,18 @@ struct drbd_connection {
 	struct list_head done_ee;   /* need to send P_WRITE_ACK */
 	atomic_t done_ee_cnt;
 	struct work_struct send_acks_work;
+	struct mutex send_acks_mutex; /* send_acks_work, or an inline ack sender */
 	wait_queue_head_t ee_wait;
 
+	spinlock_t csum_batch_lock;
+	struct drbd_csum_batch *csum_batch; /* still open for more jobs */
+
+	struct drbd_compress compress;
+	struct drbd_async_sbuf sbuf;
+	struct crypto_shash *rs_dedupe_tfm;		/* sha256, DP_RS_DEDUPE */
+	struct drbd_rs_dedupe_ref rs_dedupe_rx;	/* receiver */
+	struct drbd_latency_probe latency_probe;
+
 	atomic_t pp_in_use;		/* allocated from page pool */
 	atomic_t pp_in_use_by_net;	/* sendpage()d, still referenced by transport */
 	/* sender side */
@@ -1120,10 +1744,21 @@ struct drbd_connection {
 
 		/* position in change stream */
 		u64 current_dagtag_sector;
+
+		/* Ahead mode: range not yet announced with P_OUT_OF_SYNC,
+		 * see queue_out_of_sync() */
+		struct drbd_peer_device *oos_peer_device;
+		sector_t oos_sector;
+		unsigned int oos_size;
+
+		/* P_UNPLUG_REMOTE asked for by a request of the current
+		 * batch, see flush_unplug_remote() */
+		bool unplug_pending;
 	} send;
 
 	unsigned int peer_node_id;
 	struct list_head twopc_parent_list;
+	struct drbd_twopc_peer_stats twopc_stats;
 	struct rcu_head rcu;
 
 	struct drbd_transport transport; /* The transport needs to be the last member. The acutal
@@ -1137,6 +1772,11 @@ enum drbd_neighbor {
 	NEXT_HIGHER
 };
 
+/* Priority resync of what application reads need, in chunks of this many
+ * bits, aligned.  At most DRBD_RS_HOT_CHUNKS of them queued. */
+#define DRBD_RS_HOT_BITS	(DRBD_MAX_BIO_SIZE >> BM_BLOCK_SHIFT)
+#define DRBD_RS_HOT_CHUNKS	16
+
 struct drbd_peer_device {
 	struct list_head peer_devices;
 	struct drbd_device *device;
@@ -1148,11 +1788,16 @@ struct drbd_peer_device {
 	bool resync_susp_peer[2];
 	bool resync_susp_dependency[2];
 	bool resync_susp_other_c[2];
+	bool rs_sched_wait;	/* resync paused for a free slot, see resync_max_concurrent */
 	enum drbd_repl_state negotiation_result; /* To find disk state after attach */
 	unsigned int send_cnt;
 	unsigned int recv_cnt;
 	atomic_t packet_seq;
 	unsigned int peer_seq;
+	/* P_DATA sequence numbers peer_data_run ... peer_data_seq came in
+	 * back to back, see wait_for_and_update_peer_seq() */
+	unsigned int peer_data_seq;
+	unsigned int peer_data_run;
 	spinlock_t peer_seq_lock;
 	unsigned int max_bio_size;
 	uint64_t d_size;  /* size of disk */
@@ -1167,6 +1812,7 @@ struct drbd_peer_device {
 	enum drbd_repl_state start_resync_side;
 	enum drbd_repl_state last_repl_state; /* What we received from the peer */
 	struct timer_list start_resync_timer;
+	struct timer_list verify_resume_timer;
 	struct drbd_work resync_work;
 	struct timer_list resync_timer;
 	struct drbd_work propagate_uuids_work;
@@ -1180,10 +1826,33 @@ struct drbd_peer_device {
 	enum drbd_disk_state resync_finished_pdsk; /* Finished while starting resync */
 	int resync_again; /* decided to resync again while resync running */
 	unsigned long resync_next_bit; /* bitmap bit to search from for next resync request */
+	bool resync_skipped; /* left bits to parallel sources in this pass */
+	/* Chunks application reads went remote for, resynced first; see
+	 * drbd_rs_hot_chunk().  The ring is protected by rs_hot_lock, the
+	 * rest by resync_next_bit_mutex. */
+	spinlock_t rs_hot_lock;
+	unsigned int rs_hot_head, rs_hot_tail;
+	unsigned long rs_hot_ring[DRBD_RS_HOT_CHUNKS];
+	bool rs_hot;			/* currently resyncing a hot chunk ... */
+	unsigned long rs_hot_end;	/* ... up to this bit, */
+	unsigned long rs_hot_resume;	/* then continue from here */
 	struct mutex resync_next_bit_mutex;
 
-	atomic_t ap_pending_cnt; /* AP data packets on the wire, ack expected */
-	atomic_t unacked_cnt;	 /* Need to send replies for */
+	/* Completed resync writes not yet set in sync in the bitmap, merged
+	 * into one range; see drbd_set_in_sync_batched(). */
+	spinlock_t in_sync_batch_lock;
+	sector_t in_sync_batch_sector;
+	unsigned int in_sync_batch_size;
+
+	/* ap_pending_cnt changes with every write sent and every ack received,
+	 * unacked_cnt and rs_pending_cnt mostly on the receiver side.  Give
+	 * them cache lines of their own. */
+	atomic_t ap_pending_cnt ____cacheline_aligned_in_smp; /* AP data packets on the wire, ack expected */
+	atomic_t rq_queued;	 /* Requests queued for the sender, RQ_NET_QUEUED */
+	atomic_t rq_not_net_done; /* Sent, not RQ_NET_DONE yet */
+	u64 read_lat_ewma_ns;	 /* completion latency of reads from this peer */
+	struct drbd_admit admit;
+	atomic_t unacked_cnt ____cacheline_aligned_in_smp; /* Need to send replies for */
 	atomic_t rs_pending_cnt; /* RS request/data packets on the wire */
 
 	/* use checksums for *this* resync */
@@ -1198,6 +1867,16 @@ struct drbd_peer_device {
 	unsigned long rs_paused;
 	/* skipped because csum was equal [unit BM_BLOCK_SIZE] */
 	unsigned long rs_same_csum;
+	/* csums_adaptive, SyncTarget: bits requested by digest and found
+	 * equal since the match rate was last updated */
+	atomic_t rs_csum_win_sent;
+	atomic_t rs_csum_win_same;
+	unsigned int rs_csum_match; /* recent match rate [unit 1/256] */
+	unsigned long rs_csum_enr; /* extent of the last choice */
+	unsigned int rs_csum_nr; /* extents chosen for in this run */
+	bool rs_csum_enr_digest; /* that choice */
+	/* requested without digest by csums_adaptive [unit BM_BLOCK_SIZE] */
+	unsigned long rs_csum_direct;
 #define DRBD_SYNC_MARKS 8
 #define DRBD_SYNC_MARK_STEP (3*HZ)
 	/* block not up-to-date at mark [unit BM_BLOCK_SIZE] */
@@ -1229,8 +1908,23 @@ struct drbd_peer_device {
 			      * on the lower level device when we last looked. */
 	int rs_in_flight; /* resync sectors in flight (to proxy, in proxy and from proxy) */
 	ktime_t rs_last_mk_req_kt;
+	struct {		/* resync_refill, sender only */
+		ktime_t start_kt;	/* of the controller turn */
+		int budget;		/* requests the controller planned for it */
+		int sent;		/* of those */
+		unsigned int sect_in;	/* came in since, for the controller */
+	} rs_turn;
+	struct drbd_rs_bbr rs_bbr;
+	struct drbd_rs_dedupe *rs_dedupe; /* SyncSource, sender only */
+	struct drbd_rs_timeline rs_tl;
+	struct drbd_rs_pool rs_pool;
+	/* updated by the sender and the ack receiver */
+	struct drbd_lat_hist lat_hist[DRBD_LAT_PEER_STAGES];
 	unsigned long ov_left; /* in bits */
 	unsigned long ov_skipped; /* in bits */
+	unsigned int ov_sample_pct; /* of the current verify run, 0: all */
+	unsigned int ov_sample_run; /* rotates the sampled extents */
+	unsigned long ov_sample_skipped; /* in bits, not sampled in this run */
 	u64 rs_source_uuid;
 
 	u64 current_uuid;
@@ -1249,6 +1943,9 @@ struct drbd_peer_device {
 	struct dentry *debugfs_peer_dev;
 	struct dentry *debugfs_peer_dev_resync_extents;
 	struct dentry *debugfs_peer_dev_proc_drbd;
+	struct dentry *debugfs_peer_dev_resync_controller;
+	struct dentry *debugfs_peer_dev_latency;
+	struct dentry *debugfs_peer_dev_rs_timeline;
 #endif
 	ktime_t pre_send_kt;
 	ktime_t acked_kt;
@@ -1259,15 +1956,63 @@ struct drbd_peer_device {
 	} todo;
 };
 
+/* Per CPU part of the submitter: writes that miss the activity log are queued
+ * on the CPU that issued them */
+struct drbd_submit_cpu {
+	spinlock_t lock;
+	struct list_head writes;
+};
+
+#define DRBD_SUBMIT_WORKERS_MAX 16
+
+/* One of the submit workers of a device.  Large batches of writes whose
+ * activity log transaction is on disk are sent and submitted by these in
+ * parallel rather than by do_submit() alone, see drbd_submit_workers. */
+struct drbd_submit_dispatcher {
+	spinlock_t lock;
+	struct list_head requests;
+	struct work_struct work;
+	struct drbd_device *device;
+
+	/* only updated by the work itself, for debugfs */
+	unsigned long chunks;
+	unsigned long writes;
+	u64 busy_ns;
+};
+
 struct submit_worker {
 	struct workqueue_struct *wq;
 	struct work_struct worker;
 
+	struct drbd_submit_cpu __percpu *cpu;
+	struct drbd_submit_dispatcher dispatch[DRBD_SUBMIT_WORKERS_MAX];
+	unsigned int next_dispatch;	/* used by do_submit() only */
+
 	spinlock_t lock;
-	struct list_head writes;
 	struct list_head peer_writes;
+
+	/* peer writes already in the activity log, submitted on
+	 * drbd_peer_submit_wq instead of from the receiver thread,
+	 * see drbd_queue_peer_submit() */
+	struct work_struct peer_submit_work;
+	struct list_head peer_submits;
 };
 
+/*
+ * Conflict detection for writes is split by region so that writes to
+ * different parts of a device do not serialize on one lock.  An interval
+ * that lies within one region of DRBD_WRITE_SHARD_SHIFT sectors lives in
+ * the tree of the shard that region maps to; an interval crossing a region
+ * boundary lives in device->write_span.  See drbd_write_lock().
+ */
+#define DRBD_WRITE_SHARDS	16
+#define DRBD_WRITE_SHARD_SHIFT	18	/* 128 MiB per region */
+
+struct drbd_write_shard {
+	spinlock_t lock;
+	struct rb_root root;
+} ____cacheline_aligned_in_smp;
+
 struct opener {
 	struct list_head list;
 	char comm[TASK_COMM_LEN];
@@ -1301,6 +2046,14 @@ struct drbd_device {
 	struct dentry *debugfs_vol_ed_gen_id;
 	struct dentry *debugfs_vol_openers;
 	struct dentry *debugfs_vol_md_io;
+	struct dentry *debugfs_vol_submit_workers;
+	struct dentry *debugfs_vol_unallocated;
+	struct dentry *debugfs_vol_qos;
+	struct dentry *debugfs_vol_latency;
+	struct dentry *debugfs_vol_al_heat;
+	struct dentry *debugfs_vol_lock_stats;
+	struct dentry *debugfs_vol_readahead;
+	struct dentry *debugfs_vol_admission;
 #ifdef CONFIG_DRBD_TIMING_STATS
 	struct dentry *debugfs_vol_req_timing;
 #endif
@@ -1324,6 +2077,26 @@ struct drbd_device {
 
 	unsigned long last_reattach_jif;
 	struct timer_list md_sync_timer;
+	/* Concurrent drbd_md_sync() calls share one write, see __drbd_md_sync() */
+	struct {
+		spinlock_t lock;
+		u64 requested;	/* sync requests issued */
+		u64 done;	/* requests covered by a completed write */
+		bool writing;
+		int err;	/* of the last completed write */
+		unsigned long coalesced;
+	} md_sync;
+	/* Priority among the volumes of the resource, on their shared
+	 * connections: while a volume with writes in flight misses its latency
+	 * target, writes and resync of volumes with a lower weight yield to it.
+	 * Set through the "qos" debugfs file, see drbd_qos_throttle() */
+	struct {
+		unsigned int weight;
+		unsigned int latency_target_us;	/* 0: none */
+		u64 ack_lat_ewma_ns;		/* write arrived .. acked by a peer */
+		atomic_t throttled;		/* writes held back */
+		atomic64_t throttle_ns;
+	} qos;
 	struct timer_list request_timer;
 #ifdef DRBD_DEBUG_MD_SYNC
 	struct {
@@ -1334,13 +2107,23 @@ struct drbd_device {
 
 	enum drbd_disk_state disk_state[2];
 	wait_queue_head_t misc_wait;
-	unsigned int read_cnt;
-	unsigned int writ_cnt;
+	struct drbd_io_cnt __percpu *io_cnt;
 	unsigned int al_writ_cnt;
 	unsigned int bm_writ_cnt;
-	atomic_t ap_bio_cnt[2];	 /* Requests we need to complete. [READ] and [WRITE] */
+
+	/* These gate waits and teardown, so they need exact values and stay
+	 * atomic.  They are modified on every request by the submitting and
+	 * the completing cpus, keep them away from the read mostly members. */
+	atomic_t ap_bio_cnt[2] ____cacheline_aligned_in_smp; /* Requests we need to complete. [READ] and [WRITE] */
 	atomic_t local_cnt;	 /* Waiting for local completion */
-	atomic_t ap_actlog_cnt;  /* Requests waiting for activity log */
+	atomic_t rq_local_pending[2]; /* Requests submitted locally, RQ_LOCAL_PENDING */
+	u64 read_lat_ewma_ns;	 /* completion latency of local reads */
+	struct drbd_admit admit;
+	unsigned int admit_limit; /* smallest window of the paths, 0: none */
+	atomic_t ap_bio_waits;	 /* writes that waited in inc_ap_bio() */
+	atomic64_t ap_bio_wait_ns;
+	atomic_t read_balance_seq; /* every 32nd read explores, see remote_due_to_read_latency() */
+	atomic_t ap_actlog_cnt ____cacheline_aligned_in_smp; /* Requests waiting for activity log */
 	atomic_t wait_for_actlog; /* Peer requests waiting for activity log */
 	/* worst case extent count needed to satisfy both requests and peer requests
 	 * currently waiting for the activity log */
@@ -1348,10 +2131,15 @@ struct drbd_device {
 
 	atomic_t suspend_cnt;	/* recursive suspend counter, if non-zero, IO will be blocked. */
 
-	/* Interval trees of pending local requests */
+	/* Interval tree of pending local read requests */
 	spinlock_t interval_lock;
+	struct drbd_lock_stat interval_lock_stat;
 	struct rb_root read_requests;
-	struct rb_root write_requests;
+
+	/* Interval trees of pending local write requests and peer requests */
+	rwlock_t write_span_lock;
+	struct rb_root write_span;
+	struct drbd_write_shard write_shards[DRBD_WRITE_SHARDS];
 
 	/* for statistics and timeouts */
 	/* [0] read, [1] write */
@@ -1368,15 +2156,37 @@ struct drbd_device {
 	int next_barrier_nr;
 	struct drbd_md_io md_io;
 	spinlock_t al_lock;
+	struct drbd_lock_stat al_lock_stat;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
 	unsigned al_histogram[AL_UPDATES_PER_TRANSACTION+1];
+	struct drbd_lat_hist __percpu *lat_hist; /* [DRBD_LAT_DEVICE_STAGES], may be NULL */
+	struct drbd_al_heat *al_heat; /* may be NULL */
+	struct drbd_al_pipeline al_pipe; /* used by do_submit() only */
+	struct {
+		/* group commit windows, and AL updates gathered by them */
+		u64 windows;
+		u64 updates;
+		u64 wait_ns;
+		/* activity log transaction commits, including bitmap hints */
+		u64 commits;
+		u64 commit_ns;
+		u64 max_commit_ns;
+	} al_gc;
+	struct {
+		/* act_log counters when the size was last reconsidered */
+		unsigned int writ_cnt;
+		unsigned long hits;
+		unsigned long pulled;
+	} al_auto;
 	unsigned int al_tr_number;
 	int al_tr_cycle;
 	wait_queue_head_t seq_wait;
 	u64 exposed_data_uuid; /* UUID of the exposed data */
 	u64 next_exposed_data_uuid;
 	atomic_t rs_sect_ev; /* for submitted resync data rate, both */
+	struct drbd_rs_cache *rs_cache; /* allocated on first use */
+	struct drbd_readahead *readahead; /* allocated on first use */
 	struct pending_bitmap_work_s {
 		atomic_t n;		/* inc when queued here, */
 		spinlock_t q_lock;	/* dec only once finished. */
@@ -1390,8 +2200,12 @@ struct drbd_device {
 	u64 read_nodes; /* used for balancing read requests among peers */
 	bool have_quorum[2];	/* no quorum -> suspend IO or error IO */
 	bool cached_state_unstable; /* updates with each state change */
+	bool state_touched; /* part of the state change being validated, see mark_touched_devices() */
 	bool cached_err_io; /* complete all IOs with error */
 
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	struct drbd_fault_shaper fault_shaper[2]; /* [0] reads, [1] writes */
+#endif
 #ifdef CONFIG_DRBD_TIMING_STATS
 	spinlock_t timing_lock;
 	unsigned long reqs;
@@ -1424,6 +2238,9 @@ struct drbd_bm_aio_ctx {
 #define BM_AIO_WRITE_LAZY      16
 	int error;
 	struct kref kref;
+	struct bm_io_chunk *chunks; /* parallel bitmap IO, see bm_rw_range() */
+	unsigned int nr_chunks;
+	unsigned int chunk_pages;
 };
 
 struct drbd_config_context {
@@ -1544,13 +2361,24 @@ extern int drbd_send_sync_param(struct drbd_peer_device *);
 extern int drbd_send_out_of_sync(struct drbd_peer_device *, struct drbd_interval *);
 extern int drbd_send_block(struct drbd_peer_device *, enum drbd_packet,
 			   struct drbd_peer_request *);
+extern int drbd_send_rs_dedupe(struct drbd_peer_device *, struct drbd_peer_request *,
+			       sector_t ref_sector, const u8 *digest);
 extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req);
+extern void drbd_req_payload_free(struct drbd_req_payload *pl);
 extern int drbd_send_drequest(struct drbd_peer_device *, int cmd,
 			      sector_t sector, int size, u64 block_id);
 extern void *drbd_prepare_drequest_csum(struct drbd_peer_request *peer_req, int digest_size);
 extern int drbd_send_ov_request(struct drbd_peer_device *, sector_t sector, int size);
 
 extern int drbd_send_bitmap(struct drbd_device *, struct drbd_peer_device *);
+extern int drbd_send_bitmap_digest(struct drbd_peer_device *);
+extern const char *drbd_compress_alg_name(enum drbd_compress_alg alg);
+extern bool drbd_compress_agreed(struct drbd_connection *connection);
+extern u32 drbd_local_features(void);
+extern void drbd_compress_setup(struct drbd_connection *connection);
+extern void drbd_rs_dedupe_setup(struct drbd_connection *connection);
+extern void drbd_sbuf_setup(struct drbd_connection *connection);
+extern bool drbd_latency_probe_ack(struct drbd_connection *connection, u64 block_id);
 extern int drbd_send_dagtag(struct drbd_connection *connection, u64 dagtag);
 extern int drbd_send_rs_deallocated(struct drbd_peer_device *, struct drbd_peer_request *);
 extern void drbd_send_twopc_reply(struct drbd_connection *connection,
@@ -1613,6 +2441,7 @@ extern int drbd_bmio_set_n_write(struct drbd_device *device, struct drbd_peer_de
 extern int drbd_bmio_clear_all_n_write(struct drbd_device *device, struct drbd_peer_device *) __must_hold(local);
 extern int drbd_bmio_set_all_n_write(struct drbd_device *device, struct drbd_peer_device *) __must_hold(local);
 extern bool drbd_device_stable(struct drbd_device *device, u64 *authoritative);
+extern void __drbd_flush_peer_acks(struct drbd_resource *resource);
 extern void drbd_flush_peer_acks(struct drbd_resource *resource);
 extern void drbd_cork(struct drbd_connection *connection, enum drbd_stream stream);
 extern void drbd_uncork(struct drbd_connection *connection, enum drbd_stream stream);
@@ -1674,9 +2503,28 @@ extern sector_t drbd_get_max_capacity(
 #define RS_MAKE_REQS_INTV    (HZ/10)
 #define RS_MAKE_REQS_INTV_NS (NSEC_PER_SEC/10)
 
+/* Node wide budget of all resync and verify requests, resync_rate_total_kb */
+struct drbd_rs_budget {
+	spinlock_t lock;
+	ktime_t last;		/* last refill */
+	ktime_t window;		/* start of the current RS_MAKE_REQS_INTV */
+	u64 credit;		/* in BM_BLOCK_SIZE blocks * NSEC_PER_SEC */
+	unsigned int takers;	/* calls in the current window */
+	unsigned int prev_takers; /* and in the one before, ~ resyncs running */
+	unsigned long granted;	/* blocks */
+	unsigned long throttled; /* calls that got less than they asked for */
+};
+extern struct drbd_rs_budget drbd_rs_budget;
+
 /* We do bitmap IO in units of 4k blocks.
- * We also still have a hardcoded 4k per bit relation. */
+ * The bytes per bit relation is a build time choice, 4k by default; see
+ * CONFIG_DRBD_BM_BLOCK_SHIFT.  It is recorded in the meta data as
+ * bm_bytes_per_bit, drbdmeta has to create the meta data accordingly. */
+#ifdef CONFIG_DRBD_BM_BLOCK_SHIFT
+#define BM_BLOCK_SHIFT	CONFIG_DRBD_BM_BLOCK_SHIFT
+#else
 #define BM_BLOCK_SHIFT	12			 /* 4k per bit */
+#endif
 #define BM_BLOCK_SIZE	 (1<<BM_BLOCK_SHIFT)
 /* mostly arbitrarily set the represented size of one bitmap extent,
  * aka resync extent, to 128 MiB (which is also 4096 Byte worth of bitmap
@@ -1684,8 +2532,10 @@ extern sector_t drbd_get_max_capacity(
 #define BM_EXT_SHIFT	 27	/* 128 MiB per resync extent */
 #define BM_EXT_SIZE	 (1<<BM_EXT_SHIFT)
 
-#if (BM_BLOCK_SHIFT != 12)
-#error "HAVE YOU FIXED drbdmeta AS WELL??"
+/* At most one activity log extent per bit, and one bit has to fit into a
+ * single resync request. */
+#if (BM_BLOCK_SHIFT < 12) || (BM_BLOCK_SHIFT > 20)
+#error "BM_BLOCK_SHIFT out of range, 12 (4k) to 20 (1M) per bit are supported"
 #endif
 
 /* thus many _storage_ sectors are described by one bit */
@@ -1746,6 +2596,19 @@ extern sector_t drbd_get_max_capacity(
 #error Architecture not supported: DRBD_MAX_BIO_SIZE > (BIO_MAX_PAGES << PAGE_SHIFT)
 #endif
 
+/* Application requests, and so P_DATA and P_DATA_REQUEST, of up to
+ * repl_max_kb, if both nodes have that set: each announces what it takes in
+ * P_SIZES, and runs larger peer requests through several bios. Resync and
+ * verify requests stay within DRBD_MAX_BIO_SIZE. */
+#define DRBD_MAX_REPL_SIZE	(16U << 20)
+
+static inline unsigned int drbd_max_repl_size(void)
+{
+	unsigned int kb = min(drbd_repl_max_kb, DRBD_MAX_REPL_SIZE >> 10);
+
+	return max(kb << 10, (unsigned int)DRBD_MAX_BIO_SIZE);
+}
+
 #define DRBD_MAX_SIZE_H80_PACKET (1U << 15) /* Header 80 only allows packets up to 32KiB data */
 #define DRBD_MAX_BIO_SIZE_P95    (1U << 17) /* Protocol 95 to 99 allows bios up to 128KiB */
 
@@ -1776,6 +2639,13 @@ extern int drbd_bm_count_bits(struct drbd_device *, unsigned int, unsigned long,
  * may process the whole bitmap in one go */
 extern void drbd_bm_set_many_bits(struct drbd_peer_device *, unsigned long, unsigned long);
 extern void drbd_bm_clear_many_bits(struct drbd_peer_device *, unsigned long, unsigned long);
+#define DRBD_BM_RUNS 16
+struct drbd_bm_runs {
+	unsigned int n;
+	unsigned long start[DRBD_BM_RUNS];
+	unsigned long end[DRBD_BM_RUNS];
+};
+extern void drbd_bm_set_runs(struct drbd_peer_device *, struct drbd_bm_runs *);
 extern void _drbd_bm_clear_many_bits(struct drbd_device *, int, unsigned long, unsigned long);
 extern void _drbd_bm_set_many_bits(struct drbd_device *, int, unsigned long, unsigned long);
 extern int drbd_bm_test_bit(struct drbd_peer_device *, unsigned long);
@@ -1798,6 +2668,7 @@ extern unsigned long _drbd_bm_find_next(struct drbd_peer_device *, unsigned long
 extern unsigned long _drbd_bm_find_next_zero(struct drbd_peer_device *, unsigned long);
 extern unsigned long _drbd_bm_total_weight(struct drbd_device *, int);
 extern unsigned long drbd_bm_total_weight(struct drbd_peer_device *);
+extern int drbd_bm_digest(struct drbd_peer_device *, u64 *digest);
 /* for receive_bitmap */
 extern void drbd_bm_merge_lel(struct drbd_peer_device *peer_device, size_t offset,
 		size_t number, unsigned long *buffer);
@@ -1810,6 +2681,7 @@ extern void drbd_bm_unlock(struct drbd_device *device);
 extern void drbd_bm_slot_lock(struct drbd_peer_device *peer_device, char *why, enum bm_flag flags);
 extern void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device);
 extern void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index);
+extern void drbd_bm_compact(struct drbd_device *device);
 /* drbd_main.c */
 
 extern struct kmem_cache *drbd_request_cache;
@@ -1819,6 +2691,29 @@ extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 extern mempool_t drbd_request_mempool;
 extern mempool_t drbd_ee_mempool;
 
+/* A bounded per-CPU stash of free objects in front of a mempool, so that the
+ * hot allocation paths do not all contend on the pool lock and slab cache */
+#define DRBD_MAGAZINE_MAX 64
+struct drbd_magazine {
+	unsigned int nr;
+	void *obj[DRBD_MAGAZINE_MAX];
+	unsigned long hits;	/* allocations served from here */
+	unsigned long misses;	/* allocations that went to the mempool */
+	unsigned long frees;	/* frees kept here */
+	unsigned long spills;	/* frees that went to the mempool */
+};
+
+struct drbd_mempool_cache {
+	const char *name;
+	mempool_t *pool;
+	struct drbd_magazine __percpu *mag;
+};
+
+extern struct drbd_mempool_cache drbd_request_mag;
+extern struct drbd_mempool_cache drbd_ee_mag;
+extern void *drbd_mempool_cache_alloc(struct drbd_mempool_cache *cache, gfp_t gfp_mask);
+extern void drbd_mempool_cache_free(struct drbd_mempool_cache *cache, void *obj);
+
 /* drbd's page pool, used to buffer data received from the peer,
  * or data requested by the peer.
  *
@@ -1837,6 +2732,25 @@ extern spinlock_t   drbd_pp_lock;
 extern int	    drbd_pp_vacant;
 extern wait_queue_head_t drbd_pp_wait;
 
+/* In front of that, each CPU keeps a few node local pages at hand, refilled
+ * from the global pool DRBD_PP_CPU_BATCH pages at a time. */
+#define DRBD_PP_CPU_BATCH	32
+#define DRBD_PP_CPU_PAGES	(2 * DRBD_PP_CPU_BATCH)
+struct drbd_pp_cpu {
+	struct page *pages;
+	unsigned int nr;
+	unsigned long hits;	 /* allocations served from here */
+	unsigned long refills;	 /* batches taken from drbd_pp_pool */
+	unsigned long fallbacks; /* allocations from the system */
+	unsigned long spills;	 /* frees that went past this CPU */
+};
+DECLARE_PER_CPU(struct drbd_pp_cpu, drbd_pp_cpu);
+
+/* Upper bound for the page_order module parameter */
+#define DRBD_PP_MAX_ORDER	4
+extern unsigned int drbd_alloc_page_runs(int nid, gfp_t gfp_mask, unsigned int number,
+					 struct page **chain);
+
 /* We also need a standard (emergency-reserve backed) page pool
  * for meta data IO (activity log, bitmap).
  * We can keep it global, as long as it is used as "N pages at a time".
@@ -1872,19 +2786,37 @@ extern void drbd_destroy_resource(struct kref *kref);
 extern void drbd_destroy_device(struct kref *kref);
 
 extern int set_resource_options(struct drbd_resource *resource, struct res_opts *res_opts);
+extern void drbd_resource_numa_placement(struct drbd_resource *resource);
 extern struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 						      struct drbd_transport_class *tc);
 extern void drbd_transport_shutdown(struct drbd_connection *connection, enum drbd_tr_free_op op);
 extern void drbd_destroy_connection(struct kref *kref);
 extern void conn_free_crypto(struct drbd_connection *connection);
 
+extern struct workqueue_struct *drbd_peer_submit_wq;
+extern struct workqueue_struct *drbd_bitmap_io_wq;
+extern struct workqueue_struct *drbd_submit_dispatch_wq;
+extern struct workqueue_struct *drbd_csum_wq;
+extern struct workqueue_struct *drbd_ack_sender_wq;
+
 /* drbd_req */
 extern void drbd_wake_all_senders(struct drbd_resource *resource);
 extern void do_submit(struct work_struct *ws);
+extern void drbd_do_submit_dispatch(struct work_struct *ws);
+extern void drbd_flush_submit(struct drbd_device *device);
+extern unsigned int drbd_qos_yield_us(struct drbd_device *device);
+extern void drbd_qos_update(struct drbd_resource *resource);
+extern unsigned int drbd_admit_window(struct drbd_device *device);
+extern void drbd_admit_update_limit(struct drbd_device *device, enum which_state which);
+extern void drbd_admit_reset(struct drbd_admit *admit);
+extern bool drbd_admit_congested(struct drbd_device *device);
 #ifndef CONFIG_DRBD_TIMING_STATS
 #define __drbd_make_request(d,b,k,j) __drbd_make_request(d,b,j)
 #endif
 extern void __drbd_make_request(struct drbd_device *, struct bio *, ktime_t, unsigned long);
+extern void drbd_ra_invalidate(struct drbd_device *, sector_t, unsigned int);
+extern void drbd_ra_drop(struct drbd_device *device);
+extern void drbd_ra_free(struct drbd_device *device);
 extern blk_qc_t drbd_make_request(struct request_queue *q, struct bio *bio);
 
 /* drbd_nl.c */
@@ -1933,6 +2865,9 @@ extern void drbd_start_resync(struct drbd_peer_device *, enum drbd_repl_state);
 extern void resume_next_sg(struct drbd_device *device);
 extern void suspend_other_sg(struct drbd_device *device);
 extern int drbd_resync_finished(struct drbd_peer_device *, enum drbd_disk_state);
+extern unsigned long drbd_rs_co_source_mask(struct drbd_peer_device *);
+extern void drbd_rs_hot_chunk(struct drbd_peer_device *, sector_t);
+extern unsigned long verify_left_sub(struct drbd_peer_device *peer_device, unsigned long bits);
 extern void verify_progress(struct drbd_peer_device *peer_device,
 		const sector_t sector, const unsigned int size);
 /* maybe rather drbd_main.c ? */
@@ -1944,6 +2879,7 @@ extern void drbd_ov_out_of_sync_found(struct drbd_peer_device *, sector_t, int);
 extern void wait_until_done_or_force_detached(struct drbd_device *device,
 		struct drbd_backing_dev *bdev, unsigned int *done);
 extern void drbd_rs_controller_reset(struct drbd_peer_device *);
+extern const char *drbd_rs_bbr_mode_name(enum drbd_rs_bbr_mode mode);
 extern void drbd_check_peers_new_current_uuid(struct drbd_device *);
 extern void drbd_ping_peer(struct drbd_connection *connection);
 extern struct drbd_peer_device *peer_device_by_node_id(struct drbd_device *, int);
@@ -1987,12 +2923,19 @@ extern int w_send_uuids(struct drbd_work *, int);
 
 extern void resync_timer_fn(struct timer_list *t);
 extern void start_resync_timer_fn(struct timer_list *t);
+extern void verify_resume_timer_fn(struct timer_list *t);
 
 extern void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req);
+extern void drbd_read_sec_skipped(struct drbd_peer_request *peer_req);
+extern bool drbd_rs_cache_lookup(struct drbd_peer_request *peer_req);
+extern void drbd_rs_cache_invalidate(struct drbd_device *, sector_t, unsigned int);
+extern void drbd_rs_cache_expire(struct drbd_device *device, bool all);
+extern void drbd_rs_cache_free(struct drbd_device *device);
 
 /* bi_end_io handlers */
 extern void drbd_md_endio(struct bio *bio);
 extern void drbd_peer_request_endio(struct bio *bio);
+extern void drbd_peer_request_merged_endio(struct bio *bio);
 extern void drbd_request_endio(struct bio *bio);
 
 void __update_timing_details(
@@ -2033,6 +2976,10 @@ struct drbd_peer_request_details {
 	uint32_t bi_size;	/* resulting bio size */
 	/* for non-discards: bi_size = length - digest_size */
 	uint32_t digest_size;
+	uint32_t compress_alg;	/* DP_COMPRESSED: bi_size from drbd_compress_hdr */
+	struct drbd_rs_dedupe_ref *dedupe; /* DP_RS_DEDUPE: bi_size from there */
+	bool dedupe_refetch;	/* no data yet, it is read locally or requested again */
+	bool resync;		/* P_RS_DATA_REPLY, from the resync pool */
 };
 
 struct queued_twopc {
@@ -2054,15 +3001,21 @@ extern int drbd_receiver(struct drbd_thread *thi);
 extern int drbd_ack_receiver(struct drbd_thread *thi);
 extern void drbd_send_ping_wf(struct work_struct *ws);
 extern void drbd_send_acks_wf(struct work_struct *ws);
+extern void drbd_send_acks_inline(struct drbd_connection *connection);
 extern void drbd_send_peer_ack_wf(struct work_struct *ws);
 extern bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *);
 extern bool drbd_rs_should_slow_down(struct drbd_peer_device *, sector_t,
 				     bool throttle_if_app_is_waiting);
 extern int drbd_submit_peer_request(struct drbd_peer_request *);
+extern void drbd_put_integrity_tfm(struct drbd_integrity_tfm *);
+extern void drbd_submit_peer_requests(struct list_head *);
+extern void drbd_do_peer_submit(struct work_struct *ws);
 extern void drbd_cleanup_after_failed_submit_peer_request(struct drbd_peer_request *peer_req);
 extern void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head *cleanup);
 extern int drbd_free_peer_reqs(struct drbd_connection *, struct list_head *, bool is_net_ee);
 extern struct drbd_peer_request *drbd_alloc_peer_req(struct drbd_peer_device *, gfp_t) __must_hold(local);
+extern struct drbd_peer_request *drbd_rs_alloc_peer_req(struct drbd_peer_device *, unsigned int, gfp_t) __must_hold(local);
+extern void drbd_rs_pool_drain(struct drbd_peer_device *);
 extern void __drbd_free_peer_req(struct drbd_peer_request *, int);
 #define drbd_free_peer_req(pr) __drbd_free_peer_req(pr, 0)
 #define drbd_free_net_peer_req(pr) __drbd_free_peer_req(pr, 1)
@@ -2103,7 +3056,7 @@ static inline void drbd_generic_make_request(struct drbd_device *device,
 	if (drbd_insert_fault(device, fault_type)) {
 		bio->bi_status = BLK_STS_IOERR;
 		bio_endio(bio);
-	} else {
+	} else if (!drbd_fault_delay_bio(device, bio)) {
 		generic_make_request(bio);
 	}
 }
@@ -2123,6 +3076,8 @@ extern bool drbd_al_try_lock(struct drbd_device *device);
 extern bool drbd_al_try_lock_for_transaction(struct drbd_device *device);
 extern int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *i);
 extern void drbd_al_begin_io_commit(struct drbd_device *device);
+extern bool drbd_al_begin_io_commit_pipelined(struct drbd_device *device,
+					      struct drbd_al_pipeline_slot *slot);
 extern bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i);
 extern int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_interval *i);
 extern bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i);
@@ -2132,6 +3087,13 @@ extern int drbd_try_rs_begin_io(struct drbd_peer_device *, sector_t, bool);
 extern void drbd_rs_cancel_all(struct drbd_peer_device *);
 extern int drbd_rs_del_all(struct drbd_peer_device *);
 extern void drbd_rs_failed_io(struct drbd_peer_device *, sector_t, int);
+extern int drbd_unallocated_begin(struct drbd_device *);
+extern int drbd_unallocated_mark(struct drbd_device *, sector_t, sector_t);
+extern void drbd_unallocated_clear(struct drbd_device *, sector_t, unsigned int);
+extern bool drbd_unallocated_covers(struct drbd_device *, sector_t, unsigned int);
+extern unsigned long drbd_unallocated_weight(struct drbd_device *, unsigned int *chunk_shift);
+extern void drbd_al_heat_sample(struct drbd_device *, struct drbd_interval *);
+extern unsigned int drbd_al_heat_working_set(struct drbd_al_heat *);
 extern void drbd_advance_rs_marks(struct drbd_peer_device *, unsigned long);
 extern bool drbd_set_all_out_of_sync(struct drbd_device *, sector_t, int);
 extern bool drbd_set_sync(struct drbd_device *, sector_t, int, unsigned long, unsigned long);
@@ -2144,6 +3106,8 @@ extern int __drbd_change_sync(struct drbd_peer_device *peer_device, sector_t sec
 	__drbd_change_sync(peer_device, sector, size, SET_OUT_OF_SYNC)
 #define drbd_rs_failed_io(peer_device, sector, size) \
 	__drbd_change_sync(peer_device, sector, size, RECORD_RS_FAILED)
+extern void drbd_set_in_sync_batched(struct drbd_peer_device *, sector_t, int);
+extern void drbd_flush_in_sync_batch(struct drbd_peer_device *);
 extern void drbd_al_shrink(struct drbd_device *device);
 extern bool drbd_sector_has_priority(struct drbd_peer_device *, sector_t);
 extern int drbd_al_initialize(struct drbd_device *, void *);
@@ -2153,26 +3117,31 @@ extern int drbd_al_initialize(struct drbd_device *, void *);
 extern struct mutex notification_mutex;
 extern atomic_t drbd_genl_seq;
 
-extern void notify_resource_state(struct sk_buff *,
-				  unsigned int,
-				  struct drbd_resource *,
-				  struct resource_info *,
-				  enum drbd_notification_type);
-extern void notify_device_state(struct sk_buff *,
-				unsigned int,
-				struct drbd_device *,
-				struct device_info *,
-				enum drbd_notification_type);
-extern void notify_connection_state(struct sk_buff *,
+extern int notify_resource_state(struct sk_buff *,
+				 unsigned int,
+				 struct drbd_resource *,
+				 struct resource_info *,
+				 enum drbd_notification_type);
+extern int notify_device_state(struct sk_buff *,
+			       unsigned int,
+			       struct drbd_device *,
+			       struct device_info *,
+			       enum drbd_notification_type);
+extern int notify_connection_state(struct sk_buff *,
+				   unsigned int,
+				   struct drbd_connection *,
+				   struct connection_info *,
+				   enum drbd_notification_type);
+extern int notify_peer_device_state(struct sk_buff *,
 				    unsigned int,
-				    struct drbd_connection *,
-				    struct connection_info *,
+				    struct drbd_peer_device *,
+				    struct peer_device_info *,
 				    enum drbd_notification_type);
-extern void notify_peer_device_state(struct sk_buff *,
-				     unsigned int,
-				     struct drbd_peer_device *,
-				     struct peer_device_info *,
-				     enum drbd_notification_type);
+typedef int (*drbd_notify_fn)(struct sk_buff *, unsigned int, void *,
+			      enum drbd_notification_type);
+extern void notify_batch_add(struct sk_buff **, drbd_notify_fn, void *,
+			     enum drbd_notification_type);
+extern void notify_batch_flush(struct sk_buff **);
 extern void notify_helper(enum drbd_notification_type, struct drbd_device *,
 			  struct drbd_connection *, const char *, int);
 extern void notify_path(struct drbd_connection *, struct drbd_path *,
@@ -2434,6 +3403,7 @@ extern int drbd_send_command(struct drbd_peer_device *, enum drbd_packet, enum d
 
 extern int drbd_send_ping(struct drbd_connection *connection);
 extern int drbd_send_ping_ack(struct drbd_connection *connection);
+extern int drbd_send_block_ack(struct drbd_peer_device *, enum drbd_packet, struct p_block_ack *);
 extern int conn_send_state_req(struct drbd_connection *, int vnr, enum drbd_packet, union drbd_state, union drbd_state);
 extern int conn_send_twopc_request(struct drbd_connection *, int vnr, enum drbd_packet, struct p_twopc_request *);
 extern int drbd_send_peer_ack(struct drbd_connection *, struct drbd_peer_ack *);
@@ -2502,6 +3472,12 @@ static inline void inc_rs_pending(struct drbd_peer_device *peer_device)
 	atomic_inc(&peer_device->rs_pending_cnt);
 }
 
+static inline void drbd_rs_tl_add(struct drbd_peer_device *peer_device,
+				  enum drbd_rs_tl_counter counter, unsigned int n)
+{
+	atomic64_add(n, &peer_device->rs_tl.total[counter]);
+}
+
 #define dec_rs_pending(peer_device) \
 	((void)expect((peer_device), __dec_rs_pending(peer_device) >= 0))
 static inline int __dec_rs_pending(struct drbd_peer_device *peer_device)
@@ -2553,6 +3529,33 @@ static inline bool is_sync_source_state(struct drbd_peer_device *peer_device,
 	return repl_state == L_SYNC_SOURCE || repl_state == L_PAUSED_SYNC_S;
 }
 
+/* May we resync from other in parallel to resyncing from peer_device? Only
+ * if both have the same, current, data; what we get from one of them is
+ * then in sync with regard to the other one as well. */
+static inline bool drbd_rs_co_source(struct drbd_peer_device *peer_device,
+				     struct drbd_peer_device *other,
+				     enum which_state which)
+{
+	return READ_ONCE(drbd_resync_multi_source) &&
+		other != peer_device &&
+		peer_device->bitmap_index != -1 && other->bitmap_index != -1 &&
+		peer_device->disk_state[which] == D_UP_TO_DATE &&
+		other->disk_state[which] == D_UP_TO_DATE &&
+		(peer_device->current_uuid & ~UUID_PRIMARY) ==
+		(other->current_uuid & ~UUID_PRIMARY);
+}
+
+/* Bits got set again behind the resync position, make sure that
+ * make_resync_request() comes back for them.  Caller holds
+ * resync_next_bit_mutex. */
+static inline void drbd_rs_rewind(struct drbd_peer_device *peer_device, unsigned long bit)
+{
+	if (peer_device->rs_hot)
+		peer_device->rs_hot_resume = min(peer_device->rs_hot_resume, bit);
+	else
+		peer_device->resync_next_bit = min(peer_device->resync_next_bit, bit);
+}
+
 static inline bool is_sync_state(struct drbd_peer_device *peer_device,
 				 enum which_state which)
 {
@@ -2652,6 +3655,9 @@ static inline void dec_ap_bio(struct drbd_device *device, int rw)
 
 	if (ap_bio == 0 || ap_bio == nr_requests-1)
 		wake_up(&device->misc_wait);
+	else if (rw == WRITE && ap_bio < READ_ONCE(device->admit_limit) &&
+		 wq_has_sleeper(&device->misc_wait))
+		wake_up(&device->misc_wait); /* below the admission window */
 }
 
 static inline bool drbd_suspended(struct drbd_device *device)
@@ -2732,6 +3738,14 @@ struct bm_extent {
 	struct lc_element lce;
 };
 
+/* activity log extent */
+struct al_extent {
+	/* al_pipe.issued after the last pipelined transaction that changed it
+	 * in core, 0 for none; on disk once al_pipe.retired caught up */
+	unsigned int pipe_seq;
+	struct lc_element lce;
+};
+
 #define BME_NO_WRITES  0  /* bm_extent.flags: no more requests on this one! */
 #define BME_LOCKED     1  /* bm_extent.flags: syncer active on this one. */
 #define BME_PRIORITY   2  /* finish resync IO on this extent ASAP! App IO waiting! */
@@ -2742,6 +3756,133 @@ static inline struct drbd_connection *first_connection(struct drbd_resource *res
 				struct drbd_connection, connections);
 }
 
+static inline void __drbd_lock_stat_acquire(spinlock_t *lock, struct drbd_lock_stat *st)
+{
+	bool contended = !spin_trylock(lock);
+
+	if (contended) {
+		spin_lock(lock);
+		st->contended++;
+	}
+	if (!(++st->acquired & DRBD_LOCK_STAT_SAMPLE_MASK))
+		st->hold_kt = ktime_get();
+}
+
+static inline void __drbd_lock_stat_release(struct drbd_lock_stat *st)
+{
+	u64 ns;
+
+	if (likely(!st->hold_kt))
+		return;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), st->hold_kt));
+	st->hold_kt = 0;
+	st->sampled++;
+	st->sum_hold_ns += ns;
+	if (ns > st->max_hold_ns)
+		st->max_hold_ns = ns;
+}
+
+/* spin_lock() and friends, counting into @st while drbd_lock_stats is set.
+ * All users of an instrumented lock need to go through these. */
+static inline void drbd_lock(spinlock_t *lock, struct drbd_lock_stat *st)
+{
+	if (likely(!READ_ONCE(drbd_lock_stats)))
+		spin_lock(lock);
+	else
+		__drbd_lock_stat_acquire(lock, st);
+}
+
+static inline void drbd_unlock(spinlock_t *lock, struct drbd_lock_stat *st)
+{
+	__drbd_lock_stat_release(st);
+	spin_unlock(lock);
+}
+
+static inline void drbd_lock_irq(spinlock_t *lock, struct drbd_lock_stat *st)
+{
+	if (likely(!READ_ONCE(drbd_lock_stats))) {
+		spin_lock_irq(lock);
+	} else {
+		local_irq_disable();
+		__drbd_lock_stat_acquire(lock, st);
+	}
+}
+
+static inline void drbd_unlock_irq(spinlock_t *lock, struct drbd_lock_stat *st)
+{
+	__drbd_lock_stat_release(st);
+	spin_unlock_irq(lock);
+}
+
+#define drbd_lock_irqsave(lock, st, flags)			\
+	do {							\
+		if (likely(!READ_ONCE(drbd_lock_stats))) {	\
+			spin_lock_irqsave(lock, flags);		\
+		} else {					\
+			local_irq_save(flags);			\
+			__drbd_lock_stat_acquire(lock, st);	\
+		}						\
+	} while (0)
+
+static inline void drbd_unlock_irqrestore(spinlock_t *lock, struct drbd_lock_stat *st,
+					  unsigned long flags)
+{
+	__drbd_lock_stat_release(st);
+	spin_unlock_irqrestore(lock, flags);
+}
+
+static inline unsigned int drbd_lat_bucket(ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+
+	return us <= 0 ? 0 : min_t(unsigned int, ilog2(us) + 1, DRBD_LAT_BUCKETS - 1);
+}
+
+static inline void drbd_lat_record(struct drbd_device *device, enum drbd_lat_stage stage,
+				   ktime_t start)
+{
+	if (device->lat_hist)
+		this_cpu_inc((device->lat_hist + stage)->bucket[drbd_lat_bucket(start)]);
+}
+
+static inline void drbd_lat_record_peer(struct drbd_peer_device *peer_device,
+					enum drbd_lat_peer_stage stage, ktime_t start)
+{
+	peer_device->lat_hist[stage].bucket[drbd_lat_bucket(start)]++;
+}
+
+static inline unsigned int drbd_read_cnt(struct drbd_device *device)
+{
+	unsigned int sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(device->io_cnt, cpu)->read;
+	return sum;
+}
+
+static inline unsigned int drbd_writ_cnt(struct drbd_device *device)
+{
+	unsigned int sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(device->io_cnt, cpu)->writ;
+	return sum;
+}
+
+static inline void drbd_reset_io_cnt(struct drbd_device *device)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_io_cnt *c = per_cpu_ptr(device->io_cnt, cpu);
+
+		c->read = 0;
+		c->writ = 0;
+	}
+}
+
 #define NODE_MASK(id) ((u64)1 << (id))
 
 #ifdef CONFIG_DRBD_TIMING_STATS
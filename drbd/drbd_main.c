@@ -53,6 +53,9 @@
 #include "drbd_meta_data.h"
 #include "drbd_dax_pmem.h"
 
+#define CREATE_TRACE_POINTS
+#include "drbd_trace.h"
+
 static int drbd_open(struct block_device *bdev, fmode_t mode);
 static void drbd_release(struct gendisk *gd, fmode_t mode);
 static void md_sync_timer_fn(struct timer_list *t);
@@ -86,6 +89,14 @@ module_param_named(fault_rate, drbd_fault_rate, int, 0664);
 module_param_named(fault_count, drbd_fault_count, int, 0664);
 /* bitmap of devices to insert faults on */
 module_param_named(fault_devs, drbd_fault_devs, int, 0644);
+/* added latency and throughput limit of the backing devices in fault_devs,
+ * [0] for reads, [1] for writes; 0 disables */
+static unsigned int drbd_fault_delay_us[2];
+static unsigned int drbd_fault_kbps[2];
+module_param_named(fault_read_delay_us, drbd_fault_delay_us[0], uint, 0644);
+module_param_named(fault_write_delay_us, drbd_fault_delay_us[1], uint, 0644);
+module_param_named(fault_read_kbps, drbd_fault_kbps[0], uint, 0644);
+module_param_named(fault_write_kbps, drbd_fault_kbps[1], uint, 0644);
 #endif
 
 /* module parameters we can keep static */
@@ -129,6 +140,393 @@ const struct kernel_param_ops param_ops_drbd_protocol_version = {
 unsigned int drbd_protocol_version_min = PRO_VERSION_MIN;
 module_param_named(protocol_version_min, drbd_protocol_version_min, drbd_protocol_version, 0644);
 
+/* Submit mirrored writes from per-volume work items (running on any CPU)
+ * instead of the single receiver thread of a connection */
+bool drbd_offload_peer_submit;
+MODULE_PARM_DESC(offload_peer_submit, "Submit peer writes in parallel per volume");
+module_param_named(offload_peer_submit, drbd_offload_peer_submit, bool, 0644);
+
+/* With read-balancing least-pending, pick the path with the lower average
+ * read latency instead of the one with fewer pending requests */
+bool drbd_read_balancing_latency;
+MODULE_PARM_DESC(read_balancing_latency, "Latency aware least-pending read balancing");
+module_param_named(read_balancing_latency, drbd_read_balancing_latency, bool, 0644);
+
+unsigned int drbd_read_peer_balancing = DRBD_READ_PEERS_ROUND_ROBIN;
+MODULE_PARM_DESC(read_peer_balancing,
+		 "Spread remote reads over peers: 0 round robin, 1 striped by LBA, 2 by latency");
+module_param_named(read_peer_balancing, drbd_read_peer_balancing, uint, 0644);
+
+/* In core bitmap layout chosen on attach: each peer's bitmap contiguous,
+ * instead of interleaved as on disk */
+bool drbd_bitmap_contiguous;
+MODULE_PARM_DESC(bitmap_contiguous, "Keep each peer's in core bitmap contiguous");
+module_param_named(bitmap_contiguous, drbd_bitmap_contiguous, bool, 0644);
+
+/* With bitmap_contiguous: do not allocate in core bitmap pages that have all
+ * bits clear, or all bits set; chosen on attach, like the layout */
+bool drbd_bitmap_sparse;
+MODULE_PARM_DESC(bitmap_sparse, "Do not keep all clear or all set bitmap pages in core");
+module_param_named(bitmap_sparse, drbd_bitmap_sparse, bool, 0644);
+
+/* Bitmap read/write of the whole bitmap (attach, resize) is split into that
+ * many chunks, submitted and counted in parallel; 0: one per online CPU */
+unsigned int drbd_bitmap_io_workers;
+MODULE_PARM_DESC(bitmap_io_workers, "Parallel bitmap IO chunks (0: per CPU, 1: serial)");
+module_param_named(bitmap_io_workers, drbd_bitmap_io_workers, uint, 0644);
+
+/* Consecutive bitmap pages that need IO are merged into bios of up to that
+ * size; at most one page: one bio per page */
+unsigned int drbd_bitmap_io_max_kb = 128;
+MODULE_PARM_DESC(bitmap_io_max_kb, "Max size of a bitmap IO request (KiB)");
+module_param_named(bitmap_io_max_kb, drbd_bitmap_io_max_kb, uint, 0644);
+
+/* Activity log group commit: before writing a transaction with room left,
+ * wait up to that long for more requests to join it; 0: do not wait */
+unsigned int drbd_al_group_commit_usec;
+MODULE_PARM_DESC(al_group_commit_usec, "Activity log group commit window (usec)");
+module_param_named(al_group_commit_usec, drbd_al_group_commit_usec, uint, 0644);
+
+/* Activity log transactions in flight at once, written to consecutive slots
+ * of the on-disk ring, thus spread over the al-stripes; 1: one at a time */
+unsigned int drbd_al_queue_depth = 1;
+MODULE_PARM_DESC(al_queue_depth, "Activity log transactions in flight (1-" __stringify(AL_PIPELINE_MAX) ")");
+module_param_named(al_queue_depth, drbd_al_queue_depth, uint, 0644);
+
+/* Activity log replacement policy, see lc_set_policy(); 0: LRU, 1: 2Q, which
+ * keeps a sequential pass from pushing out the hot extents.  Takes effect
+ * when the activity log is (re)created, that is on attach or al-extents change */
+unsigned int drbd_al_policy;
+MODULE_PARM_DESC(al_policy, "Activity log replacement policy (0: lru, 1: 2q)");
+module_param_named(al_policy, drbd_al_policy, uint, 0644);
+
+/* Automatic activity log sizing: with a non-zero lower bound, the number of
+ * active extents follows the observed miss rate, between that and the
+ * configured al-extents, which bounds the resync after a primary crash */
+unsigned int drbd_al_extents_auto_min;
+MODULE_PARM_DESC(al_extents_auto_min, "Lower bound for automatic activity log sizing (0: off)");
+module_param_named(al_extents_auto_min, drbd_al_extents_auto_min, uint, 0644);
+
+/* Free requests and peer requests kept per CPU, see drbd_mempool_cache_alloc() */
+unsigned int drbd_magazine_size = 16;
+MODULE_PARM_DESC(magazine_size, "Requests cached per CPU (0-" __stringify(DRBD_MAGAZINE_MAX) ")");
+module_param_named(magazine_size, drbd_magazine_size, uint, 0644);
+
+/* Writes that had to wait for an activity log transaction are sent and
+ * submitted in chunks of submit_fanout by up to submit_workers workers per
+ * device, in parallel, instead of one after the other by the single submitter
+ * of the device.  The transactions themselves are still batched by that one.
+ * Off unless both are set, e.g. to submit_fanout=32 submit_workers=4. */
+unsigned int drbd_submit_fanout;
+MODULE_PARM_DESC(submit_fanout, "Writes per parallel submit chunk after an activity log update (0: off)");
+module_param_named(submit_fanout, drbd_submit_fanout, uint, 0644);
+
+unsigned int drbd_submit_workers;
+MODULE_PARM_DESC(submit_workers, "Parallel submit workers per device (0-" __stringify(DRBD_SUBMIT_WORKERS_MAX) ", 0: off)");
+module_param_named(submit_workers, drbd_submit_workers, uint, 0644);
+
+/* Peer writes submitted together that continue each other on disk, as from a
+ * stream of small sequential writes on the primary, go to the backing device
+ * as one bio, see drbd_submit_peer_requests() */
+bool drbd_peer_write_merge = true;
+MODULE_PARM_DESC(peer_write_merge, "Merge adjacent peer writes into one bio");
+module_param_named(peer_write_merge, drbd_peer_write_merge, bool, 0644);
+
+/* drbd_issue_discard_or_zero_out() splits large discards into chunks of
+ * max_discard_sectors; that many of them are in flight at once. Adjacent
+ * peer discards submitted together are issued as one range. */
+unsigned int drbd_discard_inflight = 8;
+MODULE_PARM_DESC(discard_inflight, "Discard chunks of max_discard_sectors in flight at once (1-64)");
+module_param_named(discard_inflight, drbd_discard_inflight, uint, 0644);
+
+/* Epochs whose flushes may be in flight at once, while the receiver already
+ * goes on with the next epoch; 0 or 1: wait for each flush in receive_Barrier() */
+unsigned int drbd_flush_pipeline = 4;
+MODULE_PARM_DESC(flush_pipeline, "Epoch flushes in flight per connection (0: wait for each)");
+module_param_named(flush_pipeline, drbd_flush_pipeline, uint, 0644);
+
+/* With flush_pipeline flushes in flight, epochs that drain meanwhile do not
+ * wait for one of them to finish, but share the next flush. */
+bool drbd_flush_coalesce = true;
+MODULE_PARM_DESC(flush_coalesce, "Epochs that drain while flushes are in flight share one flush");
+module_param_named(flush_coalesce, drbd_flush_coalesce, bool, 0644);
+
+/* Requests the sender hands to the data stream under one cork, when more than
+ * one is ready at a time, see process_request_batch() */
+unsigned int drbd_sender_batch = 16;
+MODULE_PARM_DESC(sender_batch, "Requests sent per cork/uncork of the data stream (0 or 1: no batching)");
+module_param_named(sender_batch, drbd_sender_batch, uint, 0644);
+
+/* With at least that many peer requests to acknowledge in one pass of the
+ * ack sender, the control stream gets corked for that pass, even without
+ * tcp_cork in net_conf; the acks leave in few segments, see drbd_send_acks_wf().
+ * Towards peers that agreed to DRBD_FF_BLOCK_ACKS, they also share packets. */
+unsigned int drbd_ack_coalesce = 4;
+MODULE_PARM_DESC(ack_coalesce, "Acks pending to cork the control stream for a pass of the ack sender (0: only with tcp_cork)");
+module_param_named(ack_coalesce, drbd_ack_coalesce, uint, 0644);
+
+/* The resync controller estimates bottleneck bandwidth and min RTT from the
+ * resync replies, instead of following c_fill_target/c_delay_target */
+unsigned int drbd_resync_controller = DRBD_RS_CONTROLLER_PLAN_AHEAD;
+MODULE_PARM_DESC(resync_controller,
+		 "Resync request pacing: 0 plan ahead (c-* settings), 1 measured bandwidth and RTT");
+module_param_named(resync_controller, drbd_resync_controller, uint, 0644);
+
+/* Resync requests as large as the protocol allows, not only as large as the
+ * queue limits of all nodes, see rs_max_request_size() */
+bool drbd_resync_stream = true;
+MODULE_PARM_DESC(resync_stream, "Resync in requests of up to DRBD_MAX_BIO_SIZE, independent of queue limits");
+module_param_named(resync_stream, drbd_resync_stream, bool, 0644);
+
+/* The resync controller still plans once per RS_MAKE_REQS_INTV, but its
+ * requests go out spread over the turn, as replies make room, instead of
+ * all at the start of it, see rs_turn_requests() */
+bool drbd_resync_refill;
+MODULE_PARM_DESC(resync_refill, "Send the resync requests of a turn as replies come in, not in one burst");
+module_param_named(resync_refill, drbd_resync_refill, bool, 0644);
+
+/* On protocol B and C connections, plain writes (no FUA, flush or sync
+ * hint) complete once sent, as with protocol A, see hybrid_async_write() */
+bool drbd_hybrid_protocol;
+MODULE_PARM_DESC(hybrid_protocol, "Only FUA, flush and sync writes wait for the peer's ack, others complete once sent");
+module_param_named(hybrid_protocol, drbd_hybrid_protocol, bool, 0644);
+
+/* Digests for checksum based resync and online verify are computed on
+ * drbd_csum_wq, on all CPUs, instead of in the sender of the connection */
+bool drbd_csum_offload = true;
+MODULE_PARM_DESC(csum_offload, "Hash resync and verify reads in parallel workers");
+module_param_named(csum_offload, drbd_csum_offload, bool, 0644);
+
+/* The data-integrity-alg digest of a peer write is verified right before it
+ * is submitted, not in the receiver while reading it in; with
+ * offload_peer_submit that is on the submit workers, in parallel per volume.
+ * Not for writes the peer wants a receive ack for, see read_in_block() */
+bool drbd_integrity_offload = true;
+MODULE_PARM_DESC(integrity_offload, "Verify integrity digests of peer writes where they are submitted");
+module_param_named(integrity_offload, drbd_integrity_offload, bool, 0644);
+
+/* Hash a write a second time after sending it with a data-integrity-alg
+ * digest, to tell buffers modified in flight apart from corruption on the
+ * wire in case the peer reports a mismatch */
+bool drbd_integrity_recheck = true;
+MODULE_PARM_DESC(integrity_recheck, "Hash sent writes again, to detect buffers modified in flight");
+module_param_named(integrity_recheck, drbd_integrity_recheck, bool, 0644);
+
+/* A write that goes to several peers gets its data integrity digest, and
+ * the copy of its data where one is needed, made once for all of them, see
+ * drbd_req_payload(). */
+bool drbd_shared_payload = true;
+MODULE_PARM_DESC(shared_payload, "Digest and copy writes once for all peers");
+module_param_named(shared_payload, drbd_shared_payload, bool, 0644);
+
+/* Send the I/O priority and REQ_IDLE of writes along, so that the peer
+ * submits them the same way. Only to peers that agreed to DRBD_FF_IO_HINTS. */
+bool drbd_replicate_ioprio = true;
+MODULE_PARM_DESC(replicate_ioprio, "Replicate the I/O priority of writes to peers");
+module_param_named(replicate_ioprio, drbd_replicate_ioprio, bool, 0644);
+
+/* Submit resync reads (as SyncSource) and resync writes (as SyncTarget) in
+ * the idle I/O class. With an I/O scheduler that honors it, resync then only
+ * gets the disk when the application leaves it alone, which may be never;
+ * c-min-rate does not help against that. Off by default. */
+bool drbd_resync_idle;
+MODULE_PARM_DESC(resync_idle, "Submit resync I/O in the idle I/O priority class");
+module_param_named(resync_idle, drbd_resync_idle, bool, 0644);
+
+/* Resync from all UpToDate peers with the same data at once, instead of
+ * from one after the other. Each of them serves its share of the resync
+ * extents, see drbd_rs_co_source(). */
+bool drbd_resync_multi_source;
+MODULE_PARM_DESC(resync_multi_source, "Resync from several UpToDate peers in parallel");
+module_param_named(resync_multi_source, drbd_resync_multi_source, bool, 0644);
+
+/* On a sync target, resync what application reads had to fetch from a peer
+ * before continuing in bitmap order, see drbd_rs_hot_chunk(). */
+bool drbd_resync_hot_first = true;
+MODULE_PARM_DESC(resync_hot_first, "Resync regions the application reads first");
+module_param_named(resync_hot_first, drbd_resync_hot_first, bool, 0644);
+
+/* Resync IO and application writes exclude each other by the sectors they
+ * touch, in the write interval trees, instead of by whole resync extents,
+ * see drbd_rs_try_lock_interval(). */
+bool drbd_resync_interval_lock;
+MODULE_PARM_DESC(resync_interval_lock, "Resync locks the sectors it touches, not whole extents");
+module_param_named(resync_interval_lock, drbd_resync_interval_lock, bool, 0644);
+
+/* As SyncSource to several peers, keep resync blocks read for one of them a
+ * short while, up to this much in total, and send them to the others that
+ * ask for them without reading them again, see drbd_rs_cache_lookup(). */
+unsigned int drbd_resync_read_cache_kb;
+MODULE_PARM_DESC(resync_read_cache_kb, "Resync data read once for several SyncTargets, in KiB (0: off)");
+module_param_named(resync_read_cache_kb, drbd_resync_read_cache_kb, uint, 0644);
+
+/* Resync peer requests, and the pages of resync reads, kept per peer device
+ * for the next resync requests instead of being freed, up to as many as
+ * were in flight at once, and at most this many, see drbd_rs_alloc_peer_req(). */
+unsigned int drbd_resync_pool = 1024;
+MODULE_PARM_DESC(resync_pool, "Resync peer requests kept for reuse per peer device (0: off)");
+module_param_named(resync_pool, drbd_resync_pool, uint, 0644);
+
+/* As diskless Primary, when the application reads sequentially, read ahead
+ * from the peer in a window growing up to this much, and answer the reads
+ * that follow from there, see drbd_ra_read(). */
+unsigned int drbd_remote_readahead_kb;
+MODULE_PARM_DESC(remote_readahead_kb, "Largest read ahead window of a diskless Primary, in KiB (0: off)");
+module_param_named(remote_readahead_kb, drbd_remote_readahead_kb, uint, 0644);
+
+/* Largest application request to replicate in one piece, see
+ * drbd_max_repl_size(). Only takes effect with peers that have it set as
+ * well. Fixed at load time, the peers were told about it. */
+unsigned int drbd_repl_max_kb = DRBD_MAX_BIO_SIZE >> 10;
+MODULE_PARM_DESC(repl_max_kb, "Largest replicated request in KiB, 1024 up to 16384");
+module_param_named(repl_max_kb, drbd_repl_max_kb, uint, 0444);
+
+/* Pages for peer requests and the page pool come in physically contiguous
+ * runs of up to 2^page_order pages where that is cheap to get, so that the
+ * bios built from them get few, large bvecs, see drbd_alloc_page_runs(). */
+unsigned int drbd_page_order = PAGE_ALLOC_COSTLY_ORDER;
+MODULE_PARM_DESC(page_order, "Allocate payload pages in runs of 2^page_order, 0 up to 4");
+module_param_named(page_order, drbd_page_order, uint, 0644);
+
+/* Node wide resync scheduling, on top of resync-after: at most this many
+ * resyncs run at a time, the others wait paused, the one with the least
+ * left to do goes next. 0: no limit. See __drbd_may_sync_now(). */
+unsigned int drbd_resync_max_concurrent;
+MODULE_PARM_DESC(resync_max_concurrent, "Resyncs running at the same time on this node (0 = no limit)");
+module_param_named(resync_max_concurrent, drbd_resync_max_concurrent, uint, 0644);
+
+/* ... and all of them together, plus online verify, request no more than
+ * this many KiB per second. 0: no limit. See drbd_rs_budget_take(). */
+unsigned int drbd_resync_rate_total_kb;
+MODULE_PARM_DESC(resync_rate_total_kb, "Resync rate of all resyncs on this node together, in KiB/s (0 = no limit)");
+module_param_named(resync_rate_total_kb, drbd_resync_rate_total_kb, uint, 0644);
+
+/* Send buffer per protocol A connection, see drbd_sbuf_reserve(). Allocated
+ * when such a connection is first established, and kept until it is deleted. */
+unsigned int drbd_async_buffer_mb;
+MODULE_PARM_DESC(async_buffer_mb, "Protocol A send buffer per connection, in MiB (0: off)");
+module_param_named(async_buffer_mb, drbd_async_buffer_mb, uint, 0644);
+
+/* Online verify compares digests of ranges of up to DRBD_MAX_BIO_SIZE and
+ * only descends into the sub-ranges of those that differ. Only towards peers
+ * that agreed to DRBD_FF_OV_TREE, with others it compares single blocks. */
+bool drbd_verify_tree;
+MODULE_PARM_DESC(verify_tree, "Online verify compares large ranges first, then the differing sub-ranges");
+module_param_named(verify_tree, drbd_verify_tree, bool, 0644);
+
+/* An online verify that was interrupted by a connection loss continues from
+ * where it stopped once the connection is established again */
+bool drbd_verify_resume = true;
+MODULE_PARM_DESC(verify_resume, "Resume an interrupted online verify on reconnect");
+module_param_named(verify_resume, drbd_verify_resume, bool, 0644);
+
+/* An online verify of the whole device checks only this percentage of the
+ * resync extents, another set on every run, so that each extent had its
+ * turn after 100/verify_sample_pct runs. 0 verifies everything. */
+unsigned int drbd_verify_sample_pct;
+MODULE_PARM_DESC(verify_sample_pct, "Online verify checks this percentage of the extents per run (0: all)");
+module_param_named(verify_sample_pct, drbd_verify_sample_pct, uint, 0644);
+
+/* Code bitmap runlengths with an adaptive range coder. Only with peers that
+ * agreed to DRBD_FF_BM_CODEC, the others get RLE_VLI_Bits. */
+unsigned int drbd_bitmap_codec = DRBD_BM_CODEC_VLI;
+MODULE_PARM_DESC(bitmap_codec, "Bitmap exchange runlength code: 0 VLI, 1 adaptive range coder");
+module_param_named(bitmap_codec, drbd_bitmap_codec, uint, 0644);
+
+/* The SyncSource offers a digest of its bitmap first, the bitmaps are only
+ * exchanged if they differ. Only with peers that agreed to DRBD_FF_BM_DIGEST. */
+bool drbd_bitmap_digest;
+MODULE_PARM_DESC(bitmap_digest, "Skip the bitmap exchange if the bitmap digests of both nodes match");
+module_param_named(bitmap_digest, drbd_bitmap_digest, bool, 0644);
+
+/* Payload compression for P_DATA. Used only with a peer that has the same
+ * algorithm set, the receiver decompresses only what it compresses itself. */
+char *drbd_data_compress = "";
+MODULE_PARM_DESC(data_compress, "Compress replicated writes: \"\" (off), \"lz4\" or \"zstd\"");
+module_param_named(data_compress, drbd_data_compress, charp, 0444);
+
+/* As SyncSource, send resync blocks the peer already wrote elsewhere during
+ * this resync as a reference to that place, DP_RS_DEDUPE. Costs a sha256 of
+ * every resync block. Only for peers that agreed to DRBD_FF_RS_DEDUPE. */
+bool drbd_resync_dedupe;
+MODULE_PARM_DESC(resync_dedupe, "Send duplicate resync blocks as references to blocks the peer has");
+module_param_named(resync_dedupe, drbd_resync_dedupe, bool, 0644);
+
+/* Count acquisitions, contention and sampled hold times of tl_update_lock,
+ * al_lock and interval_lock, shown in the "lock_stats" debugfs files. */
+bool drbd_lock_stats;
+MODULE_PARM_DESC(lock_stats, "Keep contention counters of the hot spinlocks");
+module_param_named(lock_stats, drbd_lock_stats, bool, 0644);
+
+/* At most every that many ms, ask the peer for an additional P_RECV_ACK on a
+ * protocol C write, and time it. See the "latency_probe" debugfs file. */
+unsigned int drbd_latency_probe_ms;
+MODULE_PARM_DESC(latency_probe_ms, "Interval of the replication latency probe, 0 is off");
+module_param_named(latency_probe_ms, drbd_latency_probe_ms, uint, 0644);
+
+/* With on-congestion configured, a probe average above that counts as
+ * congestion, like cong-fill and cong-extents. */
+unsigned int drbd_latency_probe_cong_us;
+MODULE_PARM_DESC(latency_probe_cong_us, "Congested when the average probe latency exceeds that many us, 0 is off");
+module_param_named(latency_probe_cong_us, drbd_latency_probe_cong_us, uint, 0644);
+
+/* With on-congestion configured, first delay new writes by up to that many ms
+ * while cong-fill or cong-extents is exceeded. Only if that does not relieve
+ * the congestion, go Ahead (or disconnect). */
+unsigned int drbd_cong_throttle_ms;
+MODULE_PARM_DESC(cong_throttle_ms, "Delay writes by up to that many ms before acting on congestion, 0 is off");
+module_param_named(cong_throttle_ms, drbd_cong_throttle_ms, uint, 0644);
+
+/* Admission control: keep the write latency of the local disk and of each
+ * peer around that many us, by adapting how many application writes a volume
+ * admits in flight. Unlike the congestion thresholds this does not wait for a
+ * limit to be hit, the backpressure builds up with the latency. 0 is off, then
+ * only nr-requests limits. */
+unsigned int drbd_admit_latency_us;
+MODULE_PARM_DESC(admit_latency_us, "Target write latency of admission control, in us, 0 is off");
+module_param_named(admit_latency_us, drbd_admit_latency_us, uint, 0644);
+
+/* Send the acks of all connections from one module wide workqueue, instead of
+ * an ordered workqueue (which comes with its rescuer thread) per connection. */
+bool drbd_shared_ack_sender;
+MODULE_PARM_DESC(shared_ack_sender, "One ack sender workqueue for all connections");
+module_param_named(shared_ack_sender, drbd_shared_ack_sender, bool, 0444);
+
+/* A peer write completed in task context, as with dm-crypt, md or loop
+ * backing devices, sends its ack right there instead of via the ack sender,
+ * unless another context is sending acks or the control stream is busy.
+ * Needs a kernel with CONFIG_PREEMPT_COUNT, does nothing otherwise. */
+bool drbd_inline_acks;
+MODULE_PARM_DESC(inline_acks, "Send acks from the completion of a peer write, if it runs in task context");
+module_param_named(inline_acks, drbd_inline_acks, bool, 0644);
+
+/* Without a cpu-mask option, place the threads of a resource on a CPU of the
+ * NUMA node of its backing devices, see drbd_resource_numa_node() */
+bool drbd_numa_placement;
+MODULE_PARM_DESC(numa_placement, "Run resource threads on the NUMA node of the backing device");
+module_param_named(numa_placement, drbd_numa_placement, bool, 0644);
+
+/* Application writes of at least this many KiB that turn out to be all zeroes
+ * go to peers that know P_ZEROES as such, without the payload. The peer zeroes
+ * out synchronously, so this pays off for large writes only. 0: off */
+unsigned int drbd_zero_elide_kb;
+MODULE_PARM_DESC(zero_elide_kb, "Send all-zero writes of at least this many KiB as P_ZEROES (0: off)");
+module_param_named(zero_elide_kb, drbd_zero_elide_kb, uint, 0644);
+
+/* A checksum based resync asks for the data of an extent directly, without
+ * comparing digests first, when the recent digests rarely matched. The
+ * threshold is lower for extents that are dirty as a whole. */
+bool drbd_csums_adaptive;
+MODULE_PARM_DESC(csums_adaptive, "Checksum based resync requests data directly for extents unlikely to match");
+module_param_named(csums_adaptive, drbd_csums_adaptive, bool, 0644);
+
+/* Synchronous meta data writes (activity log transactions, superblock) on
+ * queues with poll support are polled for instead of waiting for the
+ * completion interrupt. */
+bool drbd_md_poll;
+MODULE_PARM_DESC(md_poll, "Poll for synchronous meta data writes on queues that support it");
+module_param_named(md_poll, drbd_md_poll, bool, 0644);
+
 
 /* in 2.6.x, our device mapping and config info contains our virtual gendisks
  * as member "struct gendisk *vdisk;"
@@ -142,9 +540,16 @@ struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 mempool_t drbd_request_mempool;
 mempool_t drbd_ee_mempool;
+struct drbd_mempool_cache drbd_request_mag = { .name = "drbd_req", .pool = &drbd_request_mempool };
+struct drbd_mempool_cache drbd_ee_mag = { .name = "drbd_ee", .pool = &drbd_ee_mempool };
 mempool_t drbd_md_io_page_pool;
 struct bio_set drbd_md_io_bio_set;
 struct bio_set drbd_io_bio_set;
+struct workqueue_struct *drbd_peer_submit_wq;
+struct workqueue_struct *drbd_bitmap_io_wq;
+struct workqueue_struct *drbd_submit_dispatch_wq;
+struct workqueue_struct *drbd_csum_wq;
+struct workqueue_struct *drbd_ack_sender_wq;
 
 /* I do not use a standard mempool, because:
    1) I want to hand out the pre-allocated objects first.
@@ -156,6 +561,7 @@ struct page *drbd_pp_pool;
 spinlock_t   drbd_pp_lock;
 int          drbd_pp_vacant;
 wait_queue_head_t drbd_pp_wait;
+DEFINE_PER_CPU(struct drbd_pp_cpu, drbd_pp_cpu);
 
 static const struct block_device_operations drbd_ops = {
 	.owner =   THIS_MODULE,
@@ -342,7 +748,7 @@ void tl_release(struct drbd_connection *connection,
 		unsigned int set_size)
 {
 	struct drbd_resource *resource = connection->resource;
-	struct drbd_request *r;
+	struct drbd_request *r, *start;
 	struct drbd_request *req = NULL;
 	struct drbd_request *req_y = NULL;
 	int expect_epoch = 0;
@@ -350,9 +756,23 @@ void tl_release(struct drbd_connection *connection,
 	bool found_epoch = false;
 
 	rcu_read_lock();
+	/* Requests are sent in transfer log order, so the oldest not yet
+	 * barrier-acked write usually is at, or shortly after, the oldest
+	 * request sent but not yet done for this connection.  Start there,
+	 * rather than walking all the requests other (slower) peers still
+	 * keep in the transfer log.  Should that cached pointer be stale,
+	 * we retry from the very beginning before complaining. */
+	start = READ_ONCE(connection->req_not_net_done);
+retry:
+	req = NULL;
+	req_y = NULL;
+	expect_epoch = 0;
+	expect_size = 0;
+	r = start ?: list_entry_rcu(resource->transfer_log.next, struct drbd_request, tl_requests);
 	/* find oldest not yet barrier-acked write request,
 	 * count writes in its epoch. */
-	list_for_each_entry_rcu(r, &resource->transfer_log, tl_requests) {
+	for (; &r->tl_requests != &resource->transfer_log;
+	     r = list_entry_rcu(r->tl_requests.next, struct drbd_request, tl_requests)) {
 		struct drbd_peer_device *peer_device =
 			conn_peer_device(connection, r->device->vnr);
 		const int idx = peer_device->node_id;
@@ -399,6 +819,15 @@ void tl_release(struct drbd_connection *connection,
 		}
 	}
 
+	/* Nothing found from the cached start, or not what the peer expects */
+	if (start &&
+	    (!req || expect_size != set_size ||
+	     (o_block_id ? (struct drbd_request *)(unsigned long)o_block_id != req || !req_y
+			 : expect_epoch != barrier_nr))) {
+		start = NULL;
+		goto retry;
+	}
+
 	/* first some paranoia code */
 	if (o_block_id) {
 		if ((struct drbd_request*)(unsigned long)o_block_id != req) {
@@ -448,23 +877,30 @@ void tl_release(struct drbd_connection *connection,
 		goto bail;
 	}
 
-	/* Clean up list of requests processed during current epoch. */
-	/* Walking the list from the start is paranoia,
-	 * to catch requests being barrier-acked "unexpectedly".
-	 * It usually should find the same req again, or some READ preceding it. */
-	list_for_each_entry_rcu(req, &resource->transfer_log, tl_requests) {
-		if (!found_epoch && req->epoch == expect_epoch)
-			found_epoch = true;
+	/* Clean up list of requests processed during current epoch.
+	 * Before req, there can only be READs, or writes not on the wire for
+	 * this connection; for those, BARRIER_ACKED only clears
+	 * RQ_COMPLETION_SUSP.  Unless some request has that set, start at req.
+	 * Otherwise walk the list from the start, which also is paranoia,
+	 * to catch requests being barrier-acked "unexpectedly". */
+	if (atomic_read(&resource->tl_completion_susp))
+		r = list_entry_rcu(resource->transfer_log.next, struct drbd_request, tl_requests);
+	else
+		r = req;
+	for (; &r->tl_requests != &resource->transfer_log;
+	     r = list_entry_rcu(r->tl_requests.next, struct drbd_request, tl_requests)) {
+		struct drbd_peer_device *peer_device;
 
-		if (found_epoch) {
-			struct drbd_peer_device *peer_device;
-			if (req->epoch != expect_epoch)
-				break;
-			peer_device = conn_peer_device(connection, req->device->vnr);
-			req_mod(req, BARRIER_ACKED, peer_device);
-			if (req == req_y)
-				break;
-		}
+		if (!found_epoch && r->epoch == expect_epoch)
+			found_epoch = true;
+		if (!found_epoch)
+			continue;
+		if (r->epoch != expect_epoch)
+			break;
+		peer_device = conn_peer_device(connection, r->device->vnr);
+		req_mod(r, BARRIER_ACKED, peer_device);
+		if (r == req_y)
+			break;
 	}
 	rcu_read_unlock();
 
@@ -732,11 +1168,12 @@ void _drbd_thread_stop(struct drbd_thread *thi, int restart, int wait)
 #ifdef CONFIG_SMP
 /**
  * drbd_calc_cpu_mask() - Generate CPU masks, spread over all CPUs
+ * @node:	prefer CPUs of this NUMA node, or NUMA_NO_NODE
  *
  * Forces all threads of a resource onto the same CPU. This is beneficial for
  * DRBD's performance. May be overwritten by user's configuration.
  */
-static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask)
+static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask, int node)
 {
 	unsigned int *resources_per_cpu, min_index = ~0;
 
@@ -752,12 +1189,19 @@ static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask)
 		}
 		rcu_read_unlock();
 		for_each_online_cpu(cpu) {
+			if (node != NUMA_NO_NODE && cpu_to_node(cpu) != node)
+				continue;
 			if (resources_per_cpu[cpu] < min) {
 				min = resources_per_cpu[cpu];
 				min_index = cpu;
 			}
 		}
 		kfree(resources_per_cpu);
+		if (min_index == ~0 && node != NUMA_NO_NODE) {
+			/* no online CPU on that node */
+			drbd_calc_cpu_mask(cpu_mask, NUMA_NO_NODE);
+			return;
+		}
 	}
 	if (min_index == ~0) {
 		cpumask_setall(*cpu_mask);
@@ -785,9 +1229,73 @@ void drbd_thread_current_set_cpu(struct drbd_thread *thi)
 	set_cpus_allowed_ptr(p, resource->cpu_mask);
 }
 #else
-#define drbd_calc_cpu_mask(A) ({})
+#define drbd_calc_cpu_mask(A, B) ({})
 #endif
 
+/* NUMA node of the first backing device that has one */
+static int drbd_resource_numa_node(struct drbd_resource *resource)
+{
+	struct drbd_device *device;
+	int vnr, node = NUMA_NO_NODE;
+
+	if (!drbd_numa_placement)
+		return NUMA_NO_NODE;
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (!get_ldev_if_state(device, D_NEGOTIATING))
+			continue;
+		node = dev_to_node(disk_to_dev(device->ldev->backing_bdev->bd_disk));
+		put_ldev(device);
+		if (node != NUMA_NO_NODE)
+			break;
+	}
+	rcu_read_unlock();
+
+	return node;
+}
+
+static void resource_set_cpu_mask(struct drbd_resource *resource, cpumask_var_t new_cpu_mask)
+{
+	struct drbd_connection *connection;
+
+	if (cpumask_equal(resource->cpu_mask, new_cpu_mask))
+		return;
+
+	cpumask_copy(resource->cpu_mask, new_cpu_mask);
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		connection->receiver.reset_cpu_mask = 1;
+		connection->ack_receiver.reset_cpu_mask = 1;
+		connection->sender.reset_cpu_mask = 1;
+	}
+	rcu_read_unlock();
+	resource->worker.reset_cpu_mask = 1;
+}
+
+/* After attach: follow the backing device, unless there is a cpu-mask */
+void drbd_resource_numa_placement(struct drbd_resource *resource)
+{
+	cpumask_var_t new_cpu_mask;
+	int node;
+
+	if (nr_cpu_ids <= 1 || resource->res_opts.cpu_mask[0] != 0)
+		return;
+	node = drbd_resource_numa_node(resource);
+	if (node == resource->cpu_node)
+		return;
+	if (!zalloc_cpumask_var(&new_cpu_mask, GFP_KERNEL))
+		return;
+
+	drbd_calc_cpu_mask(&new_cpu_mask, node);
+	resource->cpu_node = node;
+	resource_set_cpu_mask(resource, new_cpu_mask);
+	if (node != NUMA_NO_NODE)
+		drbd_info(resource, "Placing threads on NUMA node %d, CPUs %*pbl\n",
+			  node, cpumask_pr_args(resource->cpu_mask));
+	free_cpumask_var(new_cpu_mask);
+}
+
 static bool drbd_all_neighbor_secondary(struct drbd_device *device, u64 *authoritative_ptr)
 {
 	struct drbd_peer_device *peer_device;
@@ -898,6 +1406,7 @@ static void new_or_recycle_send_buffer_page(struct drbd_send_buffer *sbuf)
 		if (page) {
 			put_page(sbuf->page);
 			sbuf->page = page;
+			sbuf->ring[sbuf->cur] = page;
 			goto have_page;
 		}
 
@@ -908,14 +1417,46 @@ have_page:
 	sbuf->pos = page_address(sbuf->page);
 }
 
+/* Park the unsent data of the current page in the ring and move on to the
+ * next page, instead of sending it right away. Returns false if there is
+ * nothing to park, or no room in the ring. */
+static bool queue_send_buffer_page(struct drbd_send_buffer *sbuf)
+{
+	unsigned int next = (sbuf->cur + 1) % DRBD_SEND_BUFFER_PAGES;
+	int size = sbuf->pos - sbuf->unsent;
+
+	if (size == 0 || sbuf->allocated_size ||
+	    sbuf->nr_queued >= DRBD_SEND_BUFFER_PAGES - 1)
+		return false;
+
+	if (!sbuf->ring[next]) {
+		struct page *page = alloc_page(GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
+
+		if (!page)
+			return false;
+		sbuf->ring[next] = page;
+	}
+
+	sbuf->queued[sbuf->cur].offset = sbuf->unsent - (char *)page_address(sbuf->page);
+	sbuf->queued[sbuf->cur].size = size;
+	sbuf->queued_size += size;
+	sbuf->nr_queued++;
+
+	sbuf->cur = next;
+	sbuf->page = sbuf->ring[next];
+	return true;
+}
+
 static char *alloc_send_buffer(struct drbd_connection *connection, int size,
 			       enum drbd_stream drbd_stream)
 {
 	struct drbd_send_buffer *sbuf = &connection->send_buffer[drbd_stream];
 	char *page_start = page_address(sbuf->page);
 
+	sbuf->block_acks = NULL;
 	if (sbuf->pos - page_start + size > PAGE_SIZE) {
-		flush_send_buffer(connection, drbd_stream);
+		if (!queue_send_buffer_page(sbuf))
+			flush_send_buffer(connection, drbd_stream);
 		new_or_recycle_send_buffer_page(sbuf);
 	}
 
@@ -997,6 +1538,32 @@ void *drbd_prepare_command(struct drbd_peer_device *peer_device, int size, enum
 	return conn_prepare_command(peer_device->connection, size, drbd_stream);
 }
 
+static int flush_queued_send_buffer_pages(struct drbd_connection *connection,
+					  enum drbd_stream drbd_stream, bool more)
+{
+	struct drbd_send_buffer *sbuf = &connection->send_buffer[drbd_stream];
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_transport_ops *tr_ops = transport->ops;
+
+	while (sbuf->nr_queued) {
+		unsigned int slot = (sbuf->cur + DRBD_SEND_BUFFER_PAGES - sbuf->nr_queued) %
+			DRBD_SEND_BUFFER_PAGES;
+		int msg_flags = (sbuf->nr_queued > 1 || more) ? MSG_MORE : 0;
+		int err;
+
+		err = tr_ops->send_page(transport, drbd_stream, sbuf->ring[slot],
+					sbuf->queued[slot].offset, sbuf->queued[slot].size,
+					msg_flags);
+		if (err)
+			return err;
+
+		sbuf->queued_size -= sbuf->queued[slot].size;
+		sbuf->nr_queued--;
+	}
+
+	return 0;
+}
+
 static int flush_send_buffer(struct drbd_connection *connection, enum drbd_stream drbd_stream)
 {
 	struct drbd_send_buffer *sbuf = &connection->send_buffer[drbd_stream];
@@ -1004,8 +1571,9 @@ static int flush_send_buffer(struct drbd_connection *connection, enum drbd_strea
 	struct drbd_transport_ops *tr_ops = transport->ops;
 	int msg_flags, err, offset, size;
 
+	sbuf->block_acks = NULL;
 	size = sbuf->pos - sbuf->unsent + sbuf->allocated_size;
-	if (size == 0)
+	if (size == 0 && sbuf->nr_queued == 0)
 		return 0;
 
 	if (connection->cstate[NOW] < C_CONNECTING) {
@@ -1014,6 +1582,8 @@ static int flush_send_buffer(struct drbd_connection *connection, enum drbd_strea
 		sbuf->pos = page_address(sbuf->page);
 		sbuf->allocated_size = 0;
 		sbuf->additional_size = 0;
+		sbuf->nr_queued = 0;
+		sbuf->queued_size = 0;
 		return -EIO;
 	}
 
@@ -1023,6 +1593,13 @@ static int flush_send_buffer(struct drbd_connection *connection, enum drbd_strea
 		rcu_read_unlock();
 	}
 
+	err = flush_queued_send_buffer_pages(connection, drbd_stream,
+					     size || sbuf->additional_size);
+	if (err || size == 0) {
+		sbuf->allocated_size = 0;
+		return err;
+	}
+
 	msg_flags = sbuf->additional_size ? MSG_MORE : 0;
 	offset = sbuf->unsent - (char *)page_address(sbuf->page);
 	err = tr_ops->send_page(transport, drbd_stream, sbuf->page, offset, size, msg_flags);
@@ -1057,6 +1634,7 @@ int __send_command(struct drbd_connection *connection, int vnr,
 		return -EIO;
 	prepare_header(connection, vnr, sbuf->pos, cmd,
 		       sbuf->allocated_size + sbuf->additional_size);
+	sbuf->packets++;
 
 	if (corked && !flush) {
 		sbuf->pos += sbuf->allocated_size;
@@ -1081,7 +1659,8 @@ void drbd_cork(struct drbd_connection *connection, enum drbd_stream stream)
 	struct drbd_transport_ops *tr_ops = transport->ops;
 
 	mutex_lock(&connection->mutex[stream]);
-	set_bit(CORKED + stream, &connection->flags);
+	if (!test_and_set_bit(CORKED + stream, &connection->flags))
+		connection->send_buffer[stream].corked_kt = ktime_get();
 	/* only call into transport, if we expect it to work */
 	if (connection->cstate[NOW] >= C_CONNECTING)
 		tr_ops->hint(transport, stream, CORK);
@@ -1097,7 +1676,11 @@ void drbd_uncork(struct drbd_connection *connection, enum drbd_stream stream)
 	mutex_lock(&connection->mutex[stream]);
 	flush_send_buffer(connection, stream);
 
-	clear_bit(CORKED + stream, &connection->flags);
+	if (test_and_clear_bit(CORKED + stream, &connection->flags)) {
+		struct drbd_send_buffer *sbuf = &connection->send_buffer[stream];
+
+		sbuf->corked_ns += ktime_to_ns(ktime_sub(ktime_get(), sbuf->corked_kt));
+	}
 	/* only call into transport, if we expect it to work */
 	if (connection->cstate[NOW] >= C_CONNECTING)
 		tr_ops->hint(transport, stream, UNCORK);
@@ -1135,6 +1718,69 @@ int drbd_send_ping_ack(struct drbd_connection *connection)
 	return send_command(connection, -1, P_PING_ACK, CONTROL_STREAM);
 }
 
+/**
+ * drbd_send_block_ack() - Send a P_WRITE_ACK or P_RECV_ACK, batched if possible
+ * @peer_device:	DRBD peer device, of a peer that agreed to DRBD_FF_BLOCK_ACKS
+ * @cmd:		P_WRITE_ACK or P_RECV_ACK
+ * @ack:		the ack, seq_num gets filled in
+ *
+ * While the control stream is corked, the ack goes into a P_BLOCK_ACKS
+ * packet. As long as that is the last packet in the send buffer, further acks
+ * of the same kind and volume are appended to it, so they stay in order with
+ * everything else on the stream. The peer's ack receiver then handles up to
+ * DRBD_BLOCK_ACKS_MAX acks per packet.
+ */
+int drbd_send_block_ack(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
+			struct p_block_ack *ack)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_send_buffer *sbuf = &connection->send_buffer[CONTROL_STREAM];
+	int vnr = peer_device->device->vnr;
+	struct p_block_acks *p;
+	bool corked;
+	int size, err;
+
+	mutex_lock(&connection->mutex[CONTROL_STREAM]);
+	if (sbuf->block_acks && connection->cstate[NOW] >= C_CONNECTING &&
+	    sbuf->block_acks_vnr == vnr && sbuf->block_acks_cmd == cmd &&
+	    sbuf->block_acks_count < DRBD_BLOCK_ACKS_MAX &&
+	    sbuf->pos - (char *)page_address(sbuf->page) + sizeof(*ack) <= PAGE_SIZE) {
+		ack->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->packet_seq));
+		memcpy(sbuf->pos, ack, sizeof(*ack));
+		sbuf->pos += sizeof(*ack);
+		sbuf->block_acks_count++;
+		prepare_header(connection, vnr, sbuf->block_acks, P_BLOCK_ACKS,
+			       sbuf->pos - sbuf->block_acks);
+		mutex_unlock(&connection->mutex[CONTROL_STREAM]);
+		return 0;
+	}
+
+	corked = test_bit(CORKED + CONTROL_STREAM, &connection->flags);
+	size = corked ? sizeof(*p) + sizeof(*ack) : sizeof(*ack);
+	p = __conn_prepare_command(connection, size, CONTROL_STREAM);
+	if (!p) {
+		mutex_unlock(&connection->mutex[CONTROL_STREAM]);
+		return -EIO;
+	}
+	ack->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->packet_seq));
+	if (!corked) {
+		memcpy(p, ack, sizeof(*ack));
+		return send_command(connection, vnr, cmd, CONTROL_STREAM);
+	}
+
+	p->cmd = cpu_to_be32(cmd);
+	memcpy(p->acks, ack, sizeof(*ack));
+	err = __send_command(connection, vnr, P_BLOCK_ACKS, CONTROL_STREAM);
+	if (!err) {
+		sbuf->block_acks = sbuf->pos - drbd_header_size(connection) - size;
+		sbuf->block_acks_vnr = vnr;
+		sbuf->block_acks_cmd = cmd;
+		sbuf->block_acks_count = 1;
+	}
+	mutex_unlock(&connection->mutex[CONTROL_STREAM]);
+	return err;
+}
+
 int drbd_send_peer_ack(struct drbd_connection *connection,
 		struct drbd_peer_ack *peer_ack)
 {
@@ -1474,13 +2120,16 @@ int drbd_send_sizes(struct drbd_peer_device *peer_device,
 		q_order_type = drbd_queue_order_type(device);
 		max_bio_size = queue_max_hw_sectors(q) << 9;
 		max_bio_size = min(max_bio_size, DRBD_MAX_BIO_SIZE);
+		/* the rest goes to the backing device in several bios */
+		if (drbd_max_repl_size() > DRBD_MAX_BIO_SIZE)
+			max_bio_size = drbd_max_repl_size();
 		assign_p_sizes_qlim(device, p, q);
 		put_ldev(device);
 	} else {
 		d_size = 0;
 		u_size = u_size_diskless;
 		q_order_type = QUEUE_ORDERED_NONE;
-		max_bio_size = DRBD_MAX_BIO_SIZE; /* ... multiple BIOs per peer_request */
+		max_bio_size = drbd_max_repl_size(); /* ... multiple BIOs per peer_request */
 		assign_p_sizes_qlim(device, p, NULL);
 	}
 
@@ -1619,6 +2268,11 @@ static void dcbp_set_code(struct p_compressed_bm *p, enum drbd_bitmap_code code)
 	p->encoding = (p->encoding & ~0xf) | code;
 }
 
+static enum drbd_bitmap_code dcbp_get_code(struct p_compressed_bm *p)
+{
+	return (enum drbd_bitmap_code)(p->encoding & 0x0f);
+}
+
 static void dcbp_set_start(struct p_compressed_bm *p, int set)
 {
 	p->encoding = (p->encoding & ~0x80) | (set ? 0x80 : 0);
@@ -1630,6 +2284,14 @@ static void dcbp_set_pad_bits(struct p_compressed_bm *p, int n)
 	p->encoding = (p->encoding & (~0x7 << 4)) | (n << 4);
 }
 
+/* The peer takes a P_BITMAP that is not full for the last one. Encoding in
+ * chunks, as send_bitmap_chunks() does, a chunk that is not the last one is
+ * coded up to its end instead, even where that does not compress. */
+static bool bm_xfer_must_code(struct bm_xfer_ctx *c, unsigned long bit_offset)
+{
+	return c->bm_words - bit_offset / BITS_PER_LONG < c->min_plain_words;
+}
+
 static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 				struct p_compressed_bm *p,
 				unsigned int size,
@@ -1669,7 +2331,8 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 	do {
 		tmp = (toggle == 0) ? _drbd_bm_find_next_zero(peer_device, c->bit_offset)
 				    : _drbd_bm_find_next(peer_device, c->bit_offset);
-		if (tmp == -1UL)
+		/* c->bm_bits may be the end of a chunk, see send_bitmap_chunks() */
+		if (tmp > c->bm_bits)
 			tmp = c->bm_bits;
 		rl = tmp - c->bit_offset;
 
@@ -1708,7 +2371,7 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 
 	len = bs.cur.b - p->code + !!bs.cur.bit;
 
-	if (plain_bits < (len << 3)) {
+	if (plain_bits < (len << 3) && !bm_xfer_must_code(c, c->bit_offset - plain_bits)) {
 		/* incompressible with this method.
 		 * we need to rewind both word and bit position. */
 		c->bit_offset -= plain_bits;
@@ -1727,6 +2390,146 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 	return len;
 }
 
+/* Same as fill_bitmap_rle_bits(), with the runlengths range coded */
+static int fill_bitmap_rc_bits(struct drbd_peer_device *peer_device,
+			       struct p_compressed_bm *p,
+			       unsigned int size,
+			       struct bm_xfer_ctx *c)
+{
+	struct drbd_bm_rc_model *model;
+	struct rc_encoder rc;
+	unsigned long plain_bits;
+	unsigned long tmp;
+	unsigned long rl;
+	unsigned int len;
+	unsigned int runs;
+	unsigned toggle;
+	int use_rle;
+
+	rcu_read_lock();
+	use_rle = rcu_dereference(peer_device->connection->transport.net_conf)->use_rle;
+	rcu_read_unlock();
+	if (!use_rle)
+		return 0;
+
+	if (c->bit_offset >= c->bm_bits)
+		return 0; /* nothing to do. */
+
+	if (size <= sizeof(__be32))
+		return 0;
+
+	model = kmalloc(sizeof(*model), GFP_NOIO);
+	if (!model)
+		return fill_bitmap_rle_bits(peer_device, p, size, c);
+	rc_model_init(model);
+
+	rc_enc_init(&rc, p->code + sizeof(__be32), size - sizeof(__be32));
+	plain_bits = 0;
+	runs = 0;
+	toggle = 2;
+
+	do {
+		tmp = (toggle == 0) ? _drbd_bm_find_next_zero(peer_device, c->bit_offset)
+				    : _drbd_bm_find_next(peer_device, c->bit_offset);
+		/* c->bm_bits may be the end of a chunk, see send_bitmap_chunks() */
+		if (tmp > c->bm_bits)
+			tmp = c->bm_bits;
+		rl = tmp - c->bit_offset;
+
+		if (toggle == 2) { /* first iteration */
+			if (rl == 0) {
+				dcbp_set_start(p, 1);
+				toggle = !toggle;
+				continue;
+			}
+			dcbp_set_start(p, 0);
+		}
+
+		if (rl == 0) {
+			drbd_err(peer_device, "unexpected zero runlength while encoding bitmap "
+			    "t:%u bo:%lu\n", toggle, c->bit_offset);
+			kfree(model);
+			return -1;
+		}
+
+		if (!rc_enc_room(&rc))
+			break;
+		rc_encode_runlength(&rc, model, toggle, rl);
+
+		runs++;
+		toggle = !toggle;
+		plain_bits += rl;
+		c->bit_offset = tmp;
+	} while (c->bit_offset < c->bm_bits);
+	kfree(model);
+
+	*(__be32 *)p->code = cpu_to_be32(runs);
+	len = sizeof(__be32) + rc_enc_flush(&rc);
+
+	if (plain_bits < (len << 3) && !bm_xfer_must_code(c, c->bit_offset - plain_bits)) {
+		c->bit_offset -= plain_bits;
+		bm_xfer_ctx_bit_to_word_offset(c);
+		c->bit_offset = c->word_offset * BITS_PER_LONG;
+		return 0;
+	}
+
+	bm_xfer_ctx_bit_to_word_offset(c);
+	dcbp_set_pad_bits(p, 0);
+	dcbp_set_code(p, DRBD_BM_CODE_RLE_RC);
+
+	return len;
+}
+
+/* Encodes the next P_COMPRESSED_BITMAP or P_BITMAP of @c into @buf, which
+ * has room for @size bytes behind the header. Returns the payload size and
+ * sets *@cmd, or a negative error code. */
+static int encode_bitmap_packet(struct drbd_peer_device *peer_device, void *buf,
+				unsigned int size, struct bm_xfer_ctx *c, enum drbd_packet *cmd)
+{
+	unsigned int header_size = drbd_header_size(peer_device->connection);
+	struct p_compressed_bm *pc = buf;
+	unsigned long *pu = buf;
+	unsigned long num_words;
+	int len;
+
+	/* fill_bitmap_rc_bits() sets its code, unless it falls back to VLI */
+	pc->encoding = RLE_VLI_Bits;
+	if (drbd_bitmap_codec == DRBD_BM_CODEC_RANGE &&
+	    peer_device->connection->agreed_features & DRBD_FF_BM_CODEC)
+		len = fill_bitmap_rc_bits(peer_device, pc, size - sizeof(*pc), c);
+	else
+		len = fill_bitmap_rle_bits(peer_device, pc, size - sizeof(*pc), c);
+	if (len < 0)
+		return -EIO;
+
+	if (len) {
+		int i = dcbp_get_code(pc) == DRBD_BM_CODE_RLE_RC ? 2 : 0;
+
+		c->packets[i]++;
+		c->bytes[i] += header_size + sizeof(*pc) + len;
+		*cmd = P_COMPRESSED_BITMAP;
+		return sizeof(*pc) + len;
+	}
+
+	/* was not compressible.
+	 * send a buffer full of plain text bits instead. */
+	num_words = min_t(size_t, size / sizeof(*pu), c->bm_words - c->word_offset);
+	len = num_words * sizeof(*pu);
+	if (len)
+		drbd_bm_get_lel(peer_device, c->word_offset, num_words, pu);
+
+	c->word_offset += num_words;
+	c->bit_offset = c->word_offset * BITS_PER_LONG;
+
+	c->packets[1]++;
+	c->bytes[1] += header_size + len;
+
+	if (c->bit_offset > c->bm_bits)
+		c->bit_offset = c->bm_bits;
+	*cmd = P_BITMAP;
+	return len;
+}
+
 /**
  * send_bitmap_rle_or_plain
  *
@@ -1738,102 +2541,292 @@ send_bitmap_rle_or_plain(struct drbd_peer_device *peer_device, struct bm_xfer_ct
 {
 	struct drbd_device *device = peer_device->device;
 	unsigned int header_size = drbd_header_size(peer_device->connection);
-	struct p_compressed_bm *pc;
+	enum drbd_packet cmd;
+	void *p;
 	int len, err;
 
-	pc = (struct p_compressed_bm *)
-		(alloc_send_buffer(peer_device->connection, DRBD_SOCKET_BUFFER_SIZE, DATA_STREAM) + header_size);
-
-	len = fill_bitmap_rle_bits(peer_device, pc,
-			DRBD_SOCKET_BUFFER_SIZE - header_size - sizeof(*pc), c);
+	p = alloc_send_buffer(peer_device->connection, DRBD_SOCKET_BUFFER_SIZE, DATA_STREAM) + header_size;
+	len = encode_bitmap_packet(peer_device, p, DRBD_SOCKET_BUFFER_SIZE - header_size, c, &cmd);
 	if (len < 0)
-		return -EIO;
-
-	if (len) {
-		dcbp_set_code(pc, RLE_VLI_Bits);
-		resize_prepared_command(peer_device->connection, DATA_STREAM, sizeof(*pc) + len);
-		err = __send_command(peer_device->connection, device->vnr,
-				     P_COMPRESSED_BITMAP, DATA_STREAM);
-		c->packets[0]++;
-		c->bytes[0] += header_size + sizeof(*pc) + len;
-
-		if (c->bit_offset >= c->bm_bits)
-			len = 0; /* DONE */
-	} else {
-		/* was not compressible.
-		 * send a buffer full of plain text bits instead. */
-		unsigned int data_size;
-		unsigned long num_words;
-		unsigned long *pu = (unsigned long *)pc;
-
-		data_size = DRBD_SOCKET_BUFFER_SIZE - header_size;
-		num_words = min_t(size_t, data_size / sizeof(*pu),
-				  c->bm_words - c->word_offset);
-		len = num_words * sizeof(*pu);
-		if (len)
-			drbd_bm_get_lel(peer_device, c->word_offset, num_words, pu);
-
-		resize_prepared_command(peer_device->connection, DATA_STREAM, len);
-		err = __send_command(peer_device->connection, device->vnr, P_BITMAP, DATA_STREAM);
-
-		c->word_offset += num_words;
-		c->bit_offset = c->word_offset * BITS_PER_LONG;
+		return len;
 
-		c->packets[1]++;
-		c->bytes[1] += header_size + len;
+	resize_prepared_command(peer_device->connection, DATA_STREAM, len);
+	err = __send_command(peer_device->connection, device->vnr, cmd, DATA_STREAM);
+	if (err)
+		return -EIO;
 
-		if (c->bit_offset > c->bm_bits)
-			c->bit_offset = c->bm_bits;
-	}
-	if (!err) {
-		if (len == 0) {
-			INFO_bm_xfer_stats(peer_device, "send", c);
-			return 0;
-		} else
-			return 1;
+	/* A P_BITMAP without any words marks the end, after plain text
+	 * packets. After a compressed one, reaching bm_bits is enough. */
+	if (cmd == P_COMPRESSED_BITMAP ? c->bit_offset >= c->bm_bits : len == 0) {
+		INFO_bm_xfer_stats(peer_device, "send", c);
+		return 0;
 	}
-	return -EIO;
+	return 1;
 }
 
-/* See the comment at receive_bitmap() */
-static int _drbd_send_bitmap(struct drbd_device *device,
-			     struct drbd_peer_device *peer_device)
-{
+/*
+ * On large bitmaps, encoding dominates sending: finding the runs, and coding
+ * them.  The bitmap is cut into chunks of DRBD_BM_SEND_CHUNK_BITS, encoded in
+ * parallel on drbd_bitmap_io_wq, up to DRBD_BM_SEND_WINDOW chunks ahead of the
+ * one being sent.  Each chunk is encoded on its own, with a bm_xfer_ctx that
+ * ends where the chunk ends, so its packets stop there exactly.  The packets
+ * still go out in order on the data stream: for the peer, this is the same
+ * sequence of self-contained packets, only cut at other places.  Except for
+ * the last one, P_BITMAP packets are full, as the peer expects.
+ */
+#define DRBD_BM_SEND_CHUNK_BITS	(1UL << 22)	/* 512 KiB plain, 16 GiB of storage */
+#define DRBD_BM_SEND_WINDOW	8
+
+struct bm_send_packet {
+	struct list_head list;
+	enum drbd_packet cmd;
+	unsigned int len;
+	char data[];
+};
+
+struct bm_send_chunk {
+	struct work_struct work;
+	struct drbd_peer_device *peer_device;
 	struct bm_xfer_ctx c;
+	struct list_head packets;
 	int err;
+};
 
-	if (!expect(device, device->bitmap))
-		return false;
+static void bm_free_send_packets(struct bm_send_chunk *chunk)
+{
+	struct bm_send_packet *pkt, *tmp;
 
-	if (get_ldev(device)) {
-		if (drbd_md_test_peer_flag(peer_device, MDF_PEER_FULL_SYNC)) {
-			drbd_info(device, "Writing the whole bitmap, MDF_FullSync was set.\n");
-			drbd_bm_set_many_bits(peer_device, 0, -1UL);
-			if (drbd_bm_write(device, NULL)) {
-				/* write_bm did fail! Leave full sync flag set in Meta P_DATA
-				 * but otherwise process as per normal - need to tell other
-				 * side that a full resync is required! */
-				drbd_err(device, "Failed to write bitmap to disk!\n");
-			} else {
-				drbd_md_clear_peer_flag(peer_device, MDF_PEER_FULL_SYNC);
-				drbd_md_sync(device);
-			}
+	list_for_each_entry_safe(pkt, tmp, &chunk->packets, list)
+		kfree(pkt);
+	INIT_LIST_HEAD(&chunk->packets);
+}
+
+static void bm_encode_chunk_work(struct work_struct *ws)
+{
+	struct bm_send_chunk *chunk = container_of(ws, struct bm_send_chunk, work);
+	struct drbd_peer_device *peer_device = chunk->peer_device;
+	unsigned int size = DRBD_SOCKET_BUFFER_SIZE - drbd_header_size(peer_device->connection);
+	struct bm_send_packet *pkt;
+	int len;
+
+	while (chunk->c.bit_offset < chunk->c.bm_bits) {
+		pkt = kmalloc(sizeof(*pkt) + size, GFP_NOIO);
+		if (!pkt) {
+			chunk->err = -ENOMEM;
+			return;
 		}
-		put_ldev(device);
+		len = encode_bitmap_packet(peer_device, pkt->data, size, &chunk->c, &pkt->cmd);
+		if (len < 0) {
+			kfree(pkt);
+			chunk->err = len;
+			return;
+		}
+		pkt->len = len;
+		list_add_tail(&pkt->list, &chunk->packets);
 	}
+}
 
-	c = (struct bm_xfer_ctx) {
-		.bm_bits = drbd_bm_bits(device),
-		.bm_words = drbd_bm_words(device),
+static void bm_start_send_chunk(struct bm_send_chunk *chunk, struct bm_xfer_ctx *c,
+				unsigned long nr)
+{
+	unsigned long start = nr * DRBD_BM_SEND_CHUNK_BITS;
+	unsigned long end = min(start + DRBD_BM_SEND_CHUNK_BITS, c->bm_bits);
+	unsigned int size = DRBD_SOCKET_BUFFER_SIZE - drbd_header_size(chunk->peer_device->connection);
+
+	chunk->c = (struct bm_xfer_ctx) {
+		.bm_bits = end,
+		.bm_words = end == c->bm_bits ? c->bm_words : end / BITS_PER_LONG,
+		.bit_offset = start,
+		.word_offset = start / BITS_PER_LONG,
+		.min_plain_words = end == c->bm_bits ? 0 : size / sizeof(unsigned long),
 	};
+	chunk->err = 0;
+	INIT_LIST_HEAD(&chunk->packets);
+	queue_work(drbd_bitmap_io_wq, &chunk->work);
+}
 
-	do {
+static int bm_send_chunk_packets(struct drbd_peer_device *peer_device,
+				 struct bm_send_chunk *chunk, enum drbd_packet *last_cmd)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int header_size = drbd_header_size(connection);
+	struct bm_send_packet *pkt;
+	int err = 0;
+
+	list_for_each_entry(pkt, &chunk->packets, list) {
+		void *p = alloc_send_buffer(connection, header_size + pkt->len, DATA_STREAM);
+
+		memcpy(p + header_size, pkt->data, pkt->len);
+		err = __send_command(connection, peer_device->device->vnr, pkt->cmd, DATA_STREAM);
+		if (err)
+			break;
+		*last_cmd = pkt->cmd;
+	}
+	bm_free_send_packets(chunk);
+	return err;
+}
+
+/* Returns 0 when done, a negative error code upon failure, and 1 if it did
+ * not even start, as the bitmap is too small for it or out of memory. */
+static int send_bitmap_chunks(struct drbd_peer_device *peer_device, struct bm_xfer_ctx *c)
+{
+	unsigned long nr = DIV_ROUND_UP(c->bm_bits, DRBD_BM_SEND_CHUNK_BITS);
+	unsigned long window = min_t(unsigned long, nr, DRBD_BM_SEND_WINDOW);
+	enum drbd_packet last_cmd = P_COMPRESSED_BITMAP;
+	struct bm_send_chunk *chunks;
+	unsigned long i, started;
+	bool use_rle;
+	int err = 0;
+
+	/* without RLE, there is nothing to encode */
+	rcu_read_lock();
+	use_rle = rcu_dereference(peer_device->connection->transport.net_conf)->use_rle;
+	rcu_read_unlock();
+	if (!use_rle || nr < 4)
+		return 1;
+	chunks = kcalloc(window, sizeof(*chunks), GFP_NOIO | __GFP_NOWARN);
+	if (!chunks)
+		return 1;
+
+	for (started = 0; started < window; started++) {
+		chunks[started].peer_device = peer_device;
+		INIT_WORK(&chunks[started].work, bm_encode_chunk_work);
+		bm_start_send_chunk(&chunks[started], c, started);
+	}
+
+	for (i = 0; i < started; i++) {
+		struct bm_send_chunk *chunk = &chunks[i % window];
+		int j;
+
+		flush_work(&chunk->work);
+		if (!err)
+			err = chunk->err;
+		if (!err)
+			err = bm_send_chunk_packets(peer_device, chunk, &last_cmd);
+		bm_free_send_packets(chunk);
+		for (j = 0; j < ARRAY_SIZE(c->packets); j++) {
+			c->packets[j] += chunk->c.packets[j];
+			c->bytes[j] += chunk->c.bytes[j];
+		}
+		if (!err && started < nr)
+			bm_start_send_chunk(chunk, c, started++);
+	}
+	kfree(chunks);
+
+	/* the end marker, as send_bitmap_rle_or_plain() sends it */
+	if (!err && last_cmd == P_BITMAP) {
+		alloc_send_buffer(peer_device->connection, drbd_header_size(peer_device->connection),
+				  DATA_STREAM);
+		err = __send_command(peer_device->connection, peer_device->device->vnr,
+				     P_BITMAP, DATA_STREAM);
+		c->packets[1]++;
+		c->bytes[1] += drbd_header_size(peer_device->connection);
+	}
+	if (err)
+		return -EIO;
+
+	c->bit_offset = c->bm_bits;
+	INFO_bm_xfer_stats(peer_device, "send", c);
+	return 0;
+}
+
+/* See the comment at receive_bitmap() */
+static int _drbd_send_bitmap(struct drbd_device *device,
+			     struct drbd_peer_device *peer_device)
+{
+	struct bm_xfer_ctx c;
+	int err;
+
+	if (!expect(device, device->bitmap))
+		return false;
+
+	if (get_ldev(device)) {
+		if (drbd_md_test_peer_flag(peer_device, MDF_PEER_FULL_SYNC)) {
+			drbd_info(device, "Writing the whole bitmap, MDF_FullSync was set.\n");
+			drbd_bm_set_many_bits(peer_device, 0, -1UL);
+			if (drbd_bm_write(device, NULL)) {
+				/* write_bm did fail! Leave full sync flag set in Meta P_DATA
+				 * but otherwise process as per normal - need to tell other
+				 * side that a full resync is required! */
+				drbd_err(device, "Failed to write bitmap to disk!\n");
+			} else {
+				drbd_md_clear_peer_flag(peer_device, MDF_PEER_FULL_SYNC);
+				drbd_md_sync(device);
+			}
+		}
+		put_ldev(device);
+	}
+
+	c = (struct bm_xfer_ctx) {
+		.bm_bits = drbd_bm_bits(device),
+		.bm_words = drbd_bm_words(device),
+	};
+
+	err = send_bitmap_chunks(peer_device, &c);
+	while (err > 0)
 		err = send_bitmap_rle_or_plain(peer_device, &c);
-	} while (err > 0);
 
 	return err == 0;
 }
 
+static int _drbd_send_bitmap_digest(struct drbd_peer_device *peer_device)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int header_size = drbd_header_size(connection);
+	struct p_compressed_bm *pc;
+	__be64 *d;
+	u64 digest;
+	int err;
+
+	err = drbd_bm_digest(peer_device, &digest);
+	if (err)
+		return err;
+
+	pc = (struct p_compressed_bm *)
+		(alloc_send_buffer(connection, DRBD_SOCKET_BUFFER_SIZE, DATA_STREAM) + header_size);
+	pc->encoding = 0;
+	dcbp_set_code(pc, DRBD_BM_CODE_DIGEST);
+	d = (__be64 *)pc->code;
+	d[0] = cpu_to_be64(digest);
+	d[1] = cpu_to_be64(drbd_bm_total_weight(peer_device));
+	resize_prepared_command(connection, DATA_STREAM, sizeof(*pc) + 2 * sizeof(*d));
+
+	return __send_command(connection, peer_device->device->vnr,
+			      P_COMPRESSED_BITMAP, DATA_STREAM);
+}
+
+int drbd_send_bitmap_digest(struct drbd_peer_device *peer_device)
+{
+	struct drbd_transport *peer_transport = &peer_device->connection->transport;
+	int err = -1;
+
+	mutex_lock(&peer_device->connection->mutex[DATA_STREAM]);
+	if (peer_transport->ops->stream_ok(peer_transport, DATA_STREAM))
+		err = _drbd_send_bitmap_digest(peer_device);
+	mutex_unlock(&peer_device->connection->mutex[DATA_STREAM]);
+
+	return err;
+}
+
+/* As WFBitMapS, offer our bitmap digest instead of the bitmap. The peer
+ * answers with its digest if they match, with its bitmap otherwise; then
+ * we send ours, see receive_bitmap(). */
+static bool bitmap_digest_first(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	bool full_sync = true;
+
+	if (!drbd_bitmap_digest || peer_device->repl_state[NOW] != L_WF_BITMAP_S ||
+	    !(peer_device->connection->agreed_features & DRBD_FF_BM_DIGEST))
+		return false;
+
+	if (get_ldev(device)) {
+		full_sync = drbd_md_test_peer_flag(peer_device, MDF_PEER_FULL_SYNC);
+		put_ldev(device);
+	}
+	return !full_sync && !test_and_set_bit(BITMAP_DIGEST_SENT, &peer_device->flags);
+}
+
 int drbd_send_bitmap(struct drbd_device *device, struct drbd_peer_device *peer_device)
 {
 	struct drbd_transport *peer_transport = &peer_device->connection->transport;
@@ -1845,8 +2838,12 @@ int drbd_send_bitmap(struct drbd_device *device, struct drbd_peer_device *peer_d
 	}
 
 	mutex_lock(&peer_device->connection->mutex[DATA_STREAM]);
-	if (peer_transport->ops->stream_ok(peer_transport, DATA_STREAM))
-		err = !_drbd_send_bitmap(device, peer_device);
+	if (peer_transport->ops->stream_ok(peer_transport, DATA_STREAM)) {
+		if (bitmap_digest_first(peer_device))
+			err = _drbd_send_bitmap_digest(peer_device);
+		else
+			err = !_drbd_send_bitmap(device, peer_device);
+	}
 	mutex_unlock(&peer_device->connection->mutex[DATA_STREAM]);
 
 	return err;
@@ -1946,29 +2943,57 @@ static int _drbd_send_page(struct drbd_peer_device *peer_device, struct page *pa
 	return err;
 }
 
+/* Hands a payload copied into the send buffer over to the data stream */
+static int commit_copied_payload(struct drbd_connection *connection, unsigned msg_flags)
+{
+	struct drbd_send_buffer *sbuf = &connection->send_buffer[DATA_STREAM];
+
+	/* While corked, let the payload pile up behind its header, and
+	 * behind those of the requests sent before it */
+	if (msg_flags & MSG_MORE || test_bit(CORKED + DATA_STREAM, &connection->flags)) {
+		sbuf->pos += sbuf->allocated_size;
+		sbuf->allocated_size = 0;
+		return 0;
+	}
+	return flush_send_buffer(connection, DATA_STREAM);
+}
+
 static int _drbd_no_send_page(struct drbd_peer_device *peer_device, struct page *page,
 			      int offset, size_t size, unsigned msg_flags)
 {
 	struct drbd_connection *connection = peer_device->connection;
-	struct drbd_send_buffer *sbuf = &connection->send_buffer[DATA_STREAM];
 	char *from_base;
 	void *buffer2;
-	int err;
 
 	buffer2 = alloc_send_buffer(connection, size, DATA_STREAM);
 	from_base = kmap_atomic(page);
 	memcpy(buffer2, from_base + offset, size);
 	kunmap_atomic(from_base);
 
-	if (msg_flags & MSG_MORE) {
-		sbuf->pos += sbuf->allocated_size;
-		sbuf->allocated_size = 0;
-		err = 0;
-	} else {
-		err = flush_send_buffer(connection, DATA_STREAM);
-	}
+	return commit_copied_payload(connection, msg_flags);
+}
 
-	return err;
+/* Sends the compressed payload in compress.tx_dst */
+static int _drbd_send_compressed(struct drbd_peer_device *peer_device, unsigned int len)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	const char *from = connection->compress.tx_dst;
+
+	alloc_send_buffer(connection, PAGE_SIZE, DATA_STREAM);
+	connection->send_buffer[DATA_STREAM].allocated_size = 0;
+
+	while (len) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
+		int err;
+
+		memcpy(alloc_send_buffer(connection, l, DATA_STREAM), from, l);
+		err = commit_copied_payload(connection, len > l ? MSG_MORE : 0);
+		if (err)
+			return err;
+		from += l;
+		len -= l;
+	}
+	return 0;
 }
 
 static int _drbd_send_bio(struct drbd_peer_device *peer_device, struct bio *bio)
@@ -1994,95 +3019,550 @@ static int _drbd_send_bio(struct drbd_peer_device *peer_device, struct bio *bio)
 		if (bio_op(bio) == REQ_OP_WRITE_SAME)
 			break;
 
-		peer_device->send_cnt += bvec.bv_len >> 9;
+		peer_device->send_cnt += bvec.bv_len >> 9;
+	}
+	return 0;
+}
+
+static int _drbd_send_zc_bio(struct drbd_peer_device *peer_device, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	bool no_zc = drbd_disable_sendpage;
+
+	/* e.g. XFS meta- & log-data is in slab pages, which have a
+	 * page_count of 0 and/or have PageSlab() set.
+	 * we cannot use send_page for those, as that does get_page();
+	 * put_page(); and would cause either a VM_BUG directly, or
+	 * __page_cache_release a page that would actually still be referenced
+	 * by someone, leading to some obscure delayed Oops somewhere else. */
+	if (!no_zc)
+		bio_for_each_segment(bvec, bio, iter) {
+			struct page *page = bvec.bv_page;
+
+			if (page_count(page) < 1 || PageSlab(page)) {
+				no_zc = true;
+				break;
+			}
+		}
+
+	if (no_zc) {
+		return _drbd_send_bio(peer_device, bio);
+	} else {
+		struct drbd_connection *connection = peer_device->connection;
+		struct drbd_transport *transport = &connection->transport;
+		struct drbd_transport_ops *tr_ops = transport->ops;
+		int err;
+
+		flush_send_buffer(connection, DATA_STREAM);
+
+		err = tr_ops->send_zc_bio(transport, bio);
+		if (!err)
+			peer_device->send_cnt += bio->bi_iter.bi_size >> 9;
+
+		return err;
+	}
+}
+
+static int _drbd_send_zc_ee(struct drbd_peer_device *peer_device,
+			    struct drbd_peer_request *peer_req)
+{
+	struct page *page = peer_req->page_chain.head;
+	unsigned len = peer_req->i.size;
+	int err;
+
+	flush_send_buffer(peer_device->connection, DATA_STREAM);
+	/* hint all but last page with MSG_MORE */
+	page_chain_for_each(page) {
+		unsigned l = min_t(unsigned, len, PAGE_SIZE);
+		if (page_chain_offset(page) != 0 ||
+		    page_chain_size(page) != l) {
+			drbd_err(peer_device, "FIXME page %p offset %u len %u\n",
+				page, page_chain_offset(page), page_chain_size(page));
+		}
+
+		err = _drbd_send_page(peer_device, page, 0, l,
+				      page_chain_next(page) ? MSG_MORE : 0);
+		if (err)
+			return err;
+		len -= l;
+	}
+	return 0;
+}
+
+static const char * const drbd_compress_alg_names[] = {
+	[DRBD_COMPRESS_NONE] = "",
+	[DRBD_COMPRESS_LZ4] = "lz4",
+	[DRBD_COMPRESS_ZSTD] = "zstd",
+};
+
+static const u32 drbd_compress_alg_features[] = {
+	[DRBD_COMPRESS_LZ4] = DRBD_FF_COMPRESS_LZ4,
+	[DRBD_COMPRESS_ZSTD] = DRBD_FF_COMPRESS_ZSTD,
+};
+
+const char *drbd_compress_alg_name(enum drbd_compress_alg alg)
+{
+	return alg < ARRAY_SIZE(drbd_compress_alg_names) ? drbd_compress_alg_names[alg] : "?";
+}
+
+static enum drbd_compress_alg drbd_compress_param_alg(void)
+{
+	enum drbd_compress_alg alg;
+
+	for (alg = DRBD_COMPRESS_LZ4; alg < ARRAY_SIZE(drbd_compress_alg_names); alg++)
+		if (!strcmp(drbd_data_compress, drbd_compress_alg_names[alg]))
+			return alg;
+	return DRBD_COMPRESS_NONE;
+}
+
+/* True if both nodes announced the algorithm we have set up */
+bool drbd_compress_agreed(struct drbd_connection *connection)
+{
+	enum drbd_compress_alg alg = connection->compress.alg;
+
+	return alg != DRBD_COMPRESS_NONE &&
+		connection->agreed_features & drbd_compress_alg_features[alg];
+}
+
+/* The extensions of drbd_protocol_ext.h this node offers in
+ * P_CONNECTION_FEATURES, on top of PRO_FEATURES. */
+u32 drbd_local_features(void)
+{
+	enum drbd_compress_alg alg = drbd_compress_param_alg();
+	u32 features = DRBD_FF_BM_CODEC | DRBD_FF_BM_DIGEST |
+		DRBD_FF_RS_DEDUPE | DRBD_FF_IO_HINTS | DRBD_FF_OV_TREE |
+		DRBD_FF_BLOCK_ACKS;
+
+	if (alg != DRBD_COMPRESS_NONE && crypto_has_comp(drbd_compress_alg_names[alg], 0, 0))
+		features |= drbd_compress_alg_features[alg];
+	return features;
+}
+
+static void drbd_compress_free(struct drbd_compress *cmp)
+{
+	if (cmp->tx_tfm)
+		crypto_free_comp(cmp->tx_tfm);
+	if (cmp->rx_tfm)
+		crypto_free_comp(cmp->rx_tfm);
+	kvfree(cmp->tx_src);
+	kvfree(cmp->tx_dst);
+	kvfree(cmp->rx_src);
+	kvfree(cmp->rx_dst);
+	memset(cmp, 0, sizeof(*cmp));
+}
+
+/* Called by the receiver once the connection is established. The state is
+ * kept across reconnects, and freed with the connection. Nothing is set up
+ * for a peer that did not agree to the algorithm. */
+void drbd_compress_setup(struct drbd_connection *connection)
+{
+	struct drbd_compress *cmp = &connection->compress;
+	enum drbd_compress_alg alg = drbd_compress_param_alg();
+
+	if (alg == DRBD_COMPRESS_NONE) {
+		if (drbd_data_compress[0])
+			drbd_warn(connection, "unknown data_compress \"%s\"\n", drbd_data_compress);
+		return;
+	}
+	if (cmp->alg == alg || !(connection->agreed_features & drbd_compress_alg_features[alg]))
+		return;
+
+	drbd_compress_free(cmp);
+	cmp->tx_tfm = crypto_alloc_comp(drbd_compress_alg_names[alg], 0, 0);
+	cmp->rx_tfm = crypto_alloc_comp(drbd_compress_alg_names[alg], 0, 0);
+	if (IS_ERR(cmp->tx_tfm) || IS_ERR(cmp->rx_tfm)) {
+		if (!IS_ERR(cmp->tx_tfm))
+			crypto_free_comp(cmp->tx_tfm);
+		if (!IS_ERR(cmp->rx_tfm))
+			crypto_free_comp(cmp->rx_tfm);
+		cmp->tx_tfm = cmp->rx_tfm = NULL;
+		goto fail;
+	}
+	cmp->tx_src = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	cmp->tx_dst = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	cmp->rx_src = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	cmp->rx_dst = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	if (!cmp->tx_src || !cmp->tx_dst || !cmp->rx_src || !cmp->rx_dst)
+		goto fail;
+	cmp->alg = alg;
+	return;
+
+fail:
+	drbd_compress_free(cmp);
+	drbd_warn(connection, "data_compress %s not available\n", drbd_compress_alg_names[alg]);
+}
+
+/* Called by the receiver once the connection is established. The digest is
+ * needed as SyncTarget even with resync_dedupe off. References into what an
+ * earlier connection synced are forgotten. */
+void drbd_rs_dedupe_setup(struct drbd_connection *connection)
+{
+	struct drbd_peer_device *peer_device;
+	int vnr;
+
+	if (!connection->rs_dedupe_tfm) {
+		struct crypto_shash *tfm = crypto_alloc_shash("sha256", 0, 0);
+
+		if (IS_ERR(tfm))
+			drbd_warn(connection, "sha256 not available, no resync deduplication\n");
+		else
+			connection->rs_dedupe_tfm = tfm;
+	}
+
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
+		struct drbd_rs_dedupe *dd = peer_device->rs_dedupe;
+
+		if (dd)
+			memset(dd->slot, 0, sizeof(dd->slot));
+	}
+	rcu_read_unlock();
+}
+
+static void drbd_sbuf_free(struct drbd_async_sbuf *sbuf)
+{
+	unsigned int i;
+
+	if (!sbuf->pages)
+		return;
+	for (i = 0; i < sbuf->nr_pages; i++)
+		if (sbuf->pages[i])
+			__free_page(sbuf->pages[i]);
+	kvfree(sbuf->pages);
+	sbuf->pages = NULL;
+	sbuf->nr_pages = 0;
+}
+
+/* Called by the receiver once the connection is established, before
+ * anything is queued for it. Writes buffered for an earlier connection that
+ * were never sent still occupy their pages; the first write sent on the new
+ * one releases them, see drbd_send_dblock(). */
+void drbd_sbuf_setup(struct drbd_connection *connection)
+{
+	struct drbd_async_sbuf *sbuf = &connection->sbuf;
+	unsigned int nr_pages = min(READ_ONCE(drbd_async_buffer_mb), 65536U) << (20 - PAGE_SHIFT);
+	struct page **pages;
+	struct net_conf *nc;
+	bool protocol_a;
+	unsigned int i;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->transport.net_conf);
+	protocol_a = nc->wire_protocol == DRBD_PROT_A;
+	rcu_read_unlock();
+
+	/* The size is fixed once allocated */
+	if (sbuf->pages || !protocol_a || nr_pages < DRBD_MAX_BIO_SIZE >> PAGE_SHIFT)
+		return;
+
+	pages = kvzalloc(nr_pages * sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		goto fail;
+	sbuf->pages = pages;
+	sbuf->nr_pages = nr_pages;
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_NOWARN);
+		if (!pages[i])
+			goto fail;
+	}
+	drbd_info(connection, "async send buffer: %u MiB\n", nr_pages >> (20 - PAGE_SHIFT));
+	return;
+
+fail:
+	drbd_sbuf_free(sbuf);
+	drbd_warn(connection, "async send buffer of %u MiB not available\n",
+		  nr_pages >> (20 - PAGE_SHIFT));
+}
+
+/* Below that, compression does not save a packet */
+#define DRBD_COMPRESS_MIN	4096
+#define DRBD_COMPRESS_MAX_BACKOFF 64
+
+/* Compresses the payload of a P_DATA into compress.tx_dst. Returns the
+ * compressed size, or 0 to send it as is. When the data does not compress,
+ * the following requests bypass compression, exponentially more of them. */
+static unsigned int drbd_compress_bio(struct drbd_connection *connection, struct bio *bio)
+{
+	struct drbd_compress *cmp = &connection->compress;
+	unsigned int size = bio->bi_iter.bi_size;
+	unsigned int limit = size - size / 8;
+	unsigned int dlen = limit;
+	unsigned int pos = 0;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	/* the buffers take up to DRBD_MAX_BIO_SIZE, see repl_max_kb */
+	if (!drbd_compress_agreed(connection) || size < DRBD_COMPRESS_MIN || size > DRBD_MAX_BIO_SIZE)
+		return 0;
+	if (cmp->skip) {
+		cmp->skip--;
+		cmp->tx_bypassed += size;
+		return 0;
+	}
+
+	bio_for_each_segment(bvec, bio, iter) {
+		void *src = kmap_atomic(bvec.bv_page);
+
+		memcpy(cmp->tx_src + pos, src + bvec.bv_offset, bvec.bv_len);
+		kunmap_atomic(src);
+		pos += bvec.bv_len;
+	}
+
+	/* worth it only if it saves at least an eighth */
+	if (crypto_comp_compress(cmp->tx_tfm, cmp->tx_src, size, cmp->tx_dst, &dlen) ||
+	    dlen >= limit) {
+		cmp->backoff = min(cmp->backoff * 2 + 1, DRBD_COMPRESS_MAX_BACKOFF);
+		cmp->skip = cmp->backoff;
+		cmp->tx_bypassed += size;
+		return 0;
+	}
+	cmp->backoff = 0;
+	cmp->tx_plain += size;
+	cmp->tx_wire += dlen;
+	return dlen;
+}
+
+/* see also wire_flags_to_bio() */
+static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio)
+{
+	u32 dp_flags = 0;
+
+	if (READ_ONCE(drbd_replicate_ioprio) && connection->agreed_features & DRBD_FF_IO_HINTS)
+		dp_flags = (bio->bi_opf & REQ_IDLE ? DP_IDLE : 0) |
+			ioprio_to_wire(bio->bi_ioprio);
+
+	return  dp_flags |
+		(bio->bi_opf & REQ_SYNC ? DP_RW_SYNC : 0) |
+		(bio->bi_opf & REQ_FUA ? DP_FUA : 0) |
+		(bio->bi_opf & REQ_PREFLUSH ? DP_FLUSH : 0) |
+		(bio_op(bio) == REQ_OP_WRITE_SAME ? DP_WSAME : 0) |
+		(bio_op(bio) == REQ_OP_DISCARD ? DP_DISCARD : 0) |
+		(bio_op(bio) == REQ_OP_WRITE_ZEROES ?
+		 ((connection->agreed_features & DRBD_FF_WZEROES) ?
+		  (DP_ZEROES |(!(bio->bi_opf & REQ_NOUNMAP) ? DP_DISCARD : 0))
+		  : DP_DISCARD)
+		 : 0);
+}
+
+static bool bio_all_zero(struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		void *addr = kmap_atomic(bvec.bv_page);
+		bool zero = drbd_mem_is_zero(addr + bvec.bv_offset, bvec.bv_len);
+
+		kunmap_atomic(addr);
+		if (!zero)
+			return false;
+	}
+	return true;
+}
+
+/* See zero_elide_kb. The peer's zero-out does not do FUA or flushes. */
+static bool write_is_zeroes(struct drbd_connection *connection, struct bio *bio)
+{
+	unsigned int min_kb = READ_ONCE(drbd_zero_elide_kb);
+
+	if (!min_kb || bio->bi_iter.bi_size < min_kb << 10)
+		return false;
+	if (!(connection->agreed_features & DRBD_FF_WZEROES))
+		return false;
+	if (bio->bi_opf & (REQ_FUA | REQ_PREFLUSH))
+		return false;
+	return bio_all_zero(bio);
+}
+
+/* Used to send write or TRIM aka REQ_OP_DISCARD requests
+ * R_PRIMARY -> Peer	(P_DATA, P_TRIM, P_ZEROES)
+ */
+/* A probe still without its P_RECV_ACK after that long is counted as lost */
+#define DRBD_LATENCY_PROBE_LOST (10 * HZ)
+
+/*
+ * The receiver of the peer sends P_RECV_ACK right after it received the data
+ * of a P_DATA with DP_SEND_RECEIVE_ACK, before it even submits the write. On
+ * a protocol C write, which only waits for P_WRITE_ACK, that is an answer
+ * nobody else waits for: its round trip is the cost of replication, without
+ * the disk of the peer. Only one probe is in flight per connection.
+ */
+static bool drbd_latency_probe_start(struct drbd_connection *connection,
+				     struct drbd_request *req, unsigned int s)
+{
+	struct drbd_latency_probe *probe = &connection->latency_probe;
+	unsigned int interval_ms = READ_ONCE(drbd_latency_probe_ms);
+	bool start = false;
+
+	if (!interval_ms || (s & RQ_EXP_RECEIVE_ACK) || !(s & RQ_EXP_WRITE_ACK))
+		return false;
+	if (time_before(jiffies, probe->last_sent + msecs_to_jiffies(interval_ms)))
+		return false;
+
+	spin_lock(&probe->lock);
+	if (probe->block_id &&
+	    time_after(jiffies, probe->last_sent + DRBD_LATENCY_PROBE_LOST)) {
+		probe->block_id = 0;
+		probe->lost++;
+	}
+	if (!probe->block_id) {
+		probe->block_id = (unsigned long)req;
+		probe->sent_kt = ktime_get();
+		probe->last_sent = jiffies;
+		start = true;
+	}
+	spin_unlock(&probe->lock);
+
+	return start;
+}
+
+/* ack receiver: is this P_RECV_ACK the answer to a probe? */
+bool drbd_latency_probe_ack(struct drbd_connection *connection, u64 block_id)
+{
+	struct drbd_latency_probe *probe = &connection->latency_probe;
+	u64 ns;
+
+	spin_lock(&probe->lock);
+	if (!probe->block_id || probe->block_id != block_id) {
+		spin_unlock(&probe->lock);
+		return false;
 	}
-	return 0;
+	probe->block_id = 0;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), probe->sent_kt));
+	probe->last_ns = ns;
+	probe->avg_ns = probe->probes ? probe->avg_ns - probe->avg_ns / 8 + ns / 8 : ns;
+	if (!probe->probes || ns < probe->min_ns)
+		probe->min_ns = ns;
+	if (ns > probe->max_ns)
+		probe->max_ns = ns;
+	probe->probes++;
+	spin_unlock(&probe->lock);
+
+	return true;
 }
 
-static int _drbd_send_zc_bio(struct drbd_peer_device *peer_device, struct bio *bio)
+void drbd_req_payload_free(struct drbd_req_payload *pl)
+{
+	unsigned int i;
+
+	if (pl->bio)
+		bio_put(pl->bio);
+	/* the transports hold their own references while they send */
+	for (i = 0; i < pl->nr_pages; i++)
+		put_page(pl->pages[i]);
+	kfree(pl);
+}
+
+/* Copies the data of @bio into pages of our own, and a bio over them */
+static bool drbd_req_payload_copy(struct drbd_req_payload *pl, struct drbd_request *req,
+				  struct bio *bio, unsigned int nr)
 {
+	unsigned int off = 0;
 	struct bio_vec bvec;
 	struct bvec_iter iter;
-	bool no_zc = drbd_disable_sendpage;
 
-	/* e.g. XFS meta- & log-data is in slab pages, which have a
-	 * page_count of 0 and/or have PageSlab() set.
-	 * we cannot use send_page for those, as that does get_page();
-	 * put_page(); and would cause either a VM_BUG directly, or
-	 * __page_cache_release a page that would actually still be referenced
-	 * by someone, leading to some obscure delayed Oops somewhere else. */
-	if (!no_zc)
-		bio_for_each_segment(bvec, bio, iter) {
-			struct page *page = bvec.bv_page;
+	for (pl->nr_pages = 0; pl->nr_pages < nr; pl->nr_pages++) {
+		pl->pages[pl->nr_pages] = alloc_page(GFP_NOIO | __GFP_NOWARN);
+		if (!pl->pages[pl->nr_pages])
+			return false;
+	}
 
-			if (page_count(page) < 1 || PageSlab(page)) {
-				no_zc = true;
-				break;
-			}
+	bio_for_each_segment(bvec, bio, iter) {
+		void *src = kmap_atomic(bvec.bv_page);
+		unsigned int done = 0;
+
+		while (done < bvec.bv_len) {
+			unsigned int poff = off & ~PAGE_MASK;
+			unsigned int len = min(bvec.bv_len - done, (unsigned int)PAGE_SIZE - poff);
+			void *dst = kmap_atomic(pl->pages[off >> PAGE_SHIFT]);
+
+			memcpy(dst + poff, src + bvec.bv_offset + done, len);
+			kunmap_atomic(dst);
+			done += len;
+			off += len;
 		}
+		kunmap_atomic(src);
+	}
 
-	if (no_zc) {
-		return _drbd_send_bio(peer_device, bio);
-	} else {
-		struct drbd_connection *connection = peer_device->connection;
-		struct drbd_transport *transport = &connection->transport;
-		struct drbd_transport_ops *tr_ops = transport->ops;
-		int err;
+	pl->bio = bio_alloc(GFP_NOIO, nr);
+	pl->bio->bi_iter.bi_sector = req->i.sector;
+	pl->bio->bi_opf = bio->bi_opf;
+	for (off = 0; off < req->i.size; off += PAGE_SIZE)
+		bio_add_page(pl->bio, pl->pages[off >> PAGE_SHIFT],
+			     min(req->i.size - off, (unsigned int)PAGE_SIZE), 0);
+	return true;
+}
 
-		flush_send_buffer(connection, DATA_STREAM);
+/**
+ * drbd_req_payload() - Digest and copy of a write, shared by all its peers
+ * @peer_device:	peer device sending @req
+ * @req:		the write
+ * @bio:		its data
+ * @copy:		this peer needs a stable copy of the data
+ *
+ * Each connection has its own sender, and without sharing each of them would
+ * hash the write for data-integrity-alg, and copy it into its send buffer,
+ * for protocol A or data-integrity-alg. If the write still goes to other
+ * peers, the first sender does that once, and the others find it here:
+ * the digest, if they use the same algorithm, and a copy in pages of our
+ * own, which they all send zero copy.
+ */
+static struct drbd_req_payload *drbd_req_payload(struct drbd_peer_device *peer_device,
+		struct drbd_request *req, struct bio *bio, bool copy)
+{
+	struct crypto_shash *tfm = peer_device->connection->integrity_tfm;
+	unsigned int nr = copy ? DIV_ROUND_UP(req->i.size, PAGE_SIZE) : 0;
+	struct drbd_req_payload *pl, *old;
+	int node_id;
 
-		err = tr_ops->send_zc_bio(transport, bio);
-		if (!err)
-			peer_device->send_cnt += bio->bi_iter.bi_size >> 9;
+	pl = smp_load_acquire(&req->payload);
+	if (pl || !READ_ONCE(drbd_shared_payload) || (!tfm && !copy))
+		return pl;
 
-		return err;
+	/* nobody else to share with, when the others already sent it */
+	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
+		if (node_id != peer_device->node_id &&
+		    READ_ONCE(req->net_rq_state[node_id]) & RQ_NET_QUEUED)
+			break;
 	}
-}
-
-static int _drbd_send_zc_ee(struct drbd_peer_device *peer_device,
-			    struct drbd_peer_request *peer_req)
-{
-	struct page *page = peer_req->page_chain.head;
-	unsigned len = peer_req->i.size;
-	int err;
+	if (node_id == DRBD_NODE_ID_MAX)
+		return NULL;
 
-	flush_send_buffer(peer_device->connection, DATA_STREAM);
-	/* hint all but last page with MSG_MORE */
-	page_chain_for_each(page) {
-		unsigned l = min_t(unsigned, len, PAGE_SIZE);
-		if (page_chain_offset(page) != 0 ||
-		    page_chain_size(page) != l) {
-			drbd_err(peer_device, "FIXME page %p offset %u len %u\n",
-				page, page_chain_offset(page), page_chain_size(page));
-		}
+	pl = kzalloc(struct_size(pl, pages, nr), GFP_NOIO | __GFP_NOWARN);
+	if (!pl)
+		return NULL;
+	if (nr && !drbd_req_payload_copy(pl, req, bio, nr)) {
+		drbd_req_payload_free(pl);
+		return NULL;
+	}
+	if (tfm) {
+		pl->digest_alg = crypto_shash_alg(tfm);
+		drbd_csum_bio(tfm, pl->bio ?: bio, pl->digest);
+	}
 
-		err = _drbd_send_page(peer_device, page, 0, l,
-				      page_chain_next(page) ? MSG_MORE : 0);
-		if (err)
-			return err;
-		len -= l;
+	old = cmpxchg(&req->payload, NULL, pl);
+	if (old) {
+		drbd_req_payload_free(pl);
+		pl = old;
 	}
-	return 0;
+	return pl;
 }
 
-/* see also wire_flags_to_bio() */
-static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio)
+/* Sends our own copy of the data, see drbd_req_payload() */
+static int _drbd_send_payload(struct drbd_peer_device *peer_device, struct bio *bio)
 {
-	return  (bio->bi_opf & REQ_SYNC ? DP_RW_SYNC : 0) |
-		(bio->bi_opf & REQ_FUA ? DP_FUA : 0) |
-		(bio->bi_opf & REQ_PREFLUSH ? DP_FLUSH : 0) |
-		(bio_op(bio) == REQ_OP_WRITE_SAME ? DP_WSAME : 0) |
-		(bio_op(bio) == REQ_OP_DISCARD ? DP_DISCARD : 0) |
-		(bio_op(bio) == REQ_OP_WRITE_ZEROES ?
-		 ((connection->agreed_features & DRBD_FF_WZEROES) ?
-		  (DP_ZEROES |(!(bio->bi_opf & REQ_NOUNMAP) ? DP_DISCARD : 0))
-		  : DP_DISCARD)
-		 : 0);
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_transport *transport = &connection->transport;
+	int err;
+
+	flush_send_buffer(connection, DATA_STREAM);
+	err = transport->ops->send_zc_bio(transport, bio);
+	if (!err)
+		peer_device->send_cnt += bio->bi_iter.bi_size >> 9;
+	return err;
 }
 
-/* Used to send write or TRIM aka REQ_OP_DISCARD requests
- * R_PRIMARY -> Peer	(P_DATA, P_TRIM)
- */
 int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
 {
 	struct drbd_device *device = peer_device->device;
@@ -2091,14 +3571,29 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	struct p_trim *trim = NULL;
 	struct p_data *p;
 	struct p_wsame *wsame = NULL;
+	struct drbd_compress_hdr *hdr = NULL;
+	struct drbd_req_payload *payload = NULL;
+	struct bio *shared_bio = NULL;
 	void *digest_out = NULL;
 	unsigned int dp_flags = 0;
+	unsigned int compressed = 0;
 	int digest_size = 0;
+	bool zeroes = false;
 	int err;
 	const unsigned s = req->net_rq_state[peer_device->node_id];
-	const int op = bio_op(req->master_bio);
+	struct bio *bio = req->master_bio;
+	int op;
+
+	/* the master bio may be completed already, see drbd_sbuf_reserve() */
+	if (s & RQ_NET_BUFFERED) {
+		wait_event(peer_device->connection->sbuf.wait, smp_load_acquire(&req->sbuf.ready));
+		bio = req->sbuf.bio;
+	}
+	op = bio_op(bio);
+	if (op == REQ_OP_WRITE)
+		zeroes = write_is_zeroes(peer_device->connection, bio);
 
-	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES) {
+	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES || zeroes) {
 		trim = drbd_prepare_command(peer_device, sizeof(*trim), DATA_STREAM);
 		if (!trim)
 			return -EIO;
@@ -2116,24 +3611,41 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 			wsame->size = cpu_to_be32(req->i.size);
 			digest_out = wsame + 1;
 		} else {
-			p = drbd_prepare_command(peer_device, sizeof(*p) + digest_size, DATA_STREAM);
+			/* only the sender thread uses compress.tx_* */
+			compressed = drbd_compress_bio(peer_device->connection, bio);
+			p = drbd_prepare_command(peer_device, sizeof(*p) +
+						 (compressed ? sizeof(*hdr) : 0) + digest_size,
+						 DATA_STREAM);
 			if (!p)
 				return -EIO;
 			digest_out = p + 1;
+			if (compressed) {
+				hdr = digest_out;
+				hdr->size = cpu_to_be32(req->i.size);
+				hdr->alg = peer_device->connection->compress.alg;
+				memset(hdr->pad, 0, sizeof(hdr->pad));
+				digest_out = hdr + 1;
+			}
 		}
 	}
 
 	p->sector = cpu_to_be64(req->i.sector);
 	p->block_id = (unsigned long)req;
 	p->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->packet_seq));
-	dp_flags = bio_flags_to_wire(peer_device->connection, req->master_bio);
+	dp_flags = bio_flags_to_wire(peer_device->connection, bio);
 	if (peer_device->repl_state[NOW] >= L_SYNC_SOURCE && peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T)
 		dp_flags |= DP_MAY_SET_IN_SYNC;
-	if (s & RQ_EXP_RECEIVE_ACK)
+	if (s & RQ_EXP_RECEIVE_ACK ||
+	    drbd_latency_probe_start(peer_device->connection, req, s))
 		dp_flags |= DP_SEND_RECEIVE_ACK;
 	if (s & RQ_EXP_WRITE_ACK || dp_flags & DP_MAY_SET_IN_SYNC)
 		dp_flags |= DP_SEND_WRITE_ACK;
+	if (compressed)
+		dp_flags |= DP_COMPRESSED;
+	if (zeroes)
+		dp_flags |= DP_ZEROES;
 	p->dp_flags = cpu_to_be32(dp_flags);
+	trace_drbd_send_dblock(peer_device, req->i.sector, req->i.size, dp_flags);
 
 	if (trim) {
 		err = __send_command(peer_device->connection, device->vnr,
@@ -2141,21 +3653,41 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		goto out;
 	}
 
+	/* For protocol A, or data-integrity, the payload is copied, see below */
+	if (!wsame && !compressed && !(s & RQ_NET_BUFFERED)) {
+		bool copy = !(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size;
+
+		payload = drbd_req_payload(peer_device, req, bio, copy);
+		if (payload && copy)
+			shared_bio = payload->bio;
+	}
+
 	if (digest_size && digest_out) {
+		struct crypto_shash *tfm = peer_device->connection->integrity_tfm;
+
 		BUG_ON(digest_size > sizeof(peer_device->connection->scratch_buffer.d.before));
-		drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, before);
+		if (payload && payload->digest_alg == crypto_shash_alg(tfm))
+			memcpy(before, payload->digest, digest_size);
+		else
+			drbd_csum_bio(tfm, shared_bio ?: bio, before);
 		memcpy(digest_out, before, digest_size);
 	}
 
 	if (wsame) {
 		additional_size_command(peer_device->connection, DATA_STREAM,
-					bio_iovec(req->master_bio).bv_len);
+					bio_iovec(bio).bv_len);
 		err = __send_command(peer_device->connection, device->vnr, P_WSAME, DATA_STREAM);
 	} else {
-		additional_size_command(peer_device->connection, DATA_STREAM, req->i.size);
+		additional_size_command(peer_device->connection, DATA_STREAM,
+					compressed ?: req->i.size);
 		err = __send_command(peer_device->connection, device->vnr, P_DATA, DATA_STREAM);
 	}
-	if (!err) {
+	if (!err && compressed) {
+		/* a copy of the bio already, just like _drbd_send_bio() */
+		err = _drbd_send_compressed(peer_device, compressed);
+		if (!err)
+			peer_device->send_cnt += req->i.size >> 9;
+	} else if (!err) {
 		/* For protocol A, we have to memcpy the payload into
 		 * socket buffers, as we may complete right away
 		 * as soon as we handed it over to tcp, at which point the data
@@ -2167,14 +3699,18 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		 * out ok after sending on this side, but does not fit on the
 		 * receiving side, we sure have detected corruption elsewhere.
 		 */
-		if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
-			err = _drbd_send_bio(peer_device, req->master_bio);
+		if (shared_bio)
+			err = _drbd_send_payload(peer_device, shared_bio);
+		else if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
+			err = _drbd_send_bio(peer_device, bio);
 		else
-			err = _drbd_send_zc_bio(peer_device, req->master_bio);
+			err = _drbd_send_zc_bio(peer_device, bio);
 
-		/* double check digest, sometimes buffers have been modified in flight. */
-		if (digest_size > 0) {
-			drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, after);
+		/* double check digest, sometimes buffers have been modified in flight.
+		 * Not the send buffer or the shared copy, those are ours. */
+		if (digest_size > 0 && READ_ONCE(drbd_integrity_recheck) &&
+		    !(s & RQ_NET_BUFFERED) && !shared_bio) {
+			drbd_csum_bio(peer_device->connection->integrity_tfm, bio, after);
 			if (memcmp(before, after, digest_size)) {
 				drbd_warn(device,
 					"Digest mismatch, buffer modified by upper layers during write: %llus +%u\n",
@@ -2185,6 +3721,12 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 out:
 	mutex_unlock(&peer_device->connection->mutex[DATA_STREAM]);
 
+	/* Copied to the socket, or failed; either way it does not need the
+	 * pages any more. Also releases those of earlier writes that were
+	 * buffered, but then not sent because the connection was lost. */
+	if (s & RQ_NET_BUFFERED)
+		smp_store_release(&peer_device->connection->sbuf.head, req->sbuf.end);
+
 	return err;
 }
 
@@ -2222,6 +3764,35 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 	return err;
 }
 
+/* A P_RS_DATA_REPLY without the data, but with where the peer already has it.
+ * The integrity digest still covers the data. */
+int drbd_send_rs_dedupe(struct drbd_peer_device *peer_device,
+			struct drbd_peer_request *peer_req, sector_t ref_sector, const u8 *digest)
+{
+	struct drbd_rs_dedupe_ref *ref;
+	struct p_data *p;
+	int digest_size;
+
+	digest_size = peer_device->connection->integrity_tfm ?
+		      crypto_shash_digestsize(peer_device->connection->integrity_tfm) : 0;
+
+	p = drbd_prepare_command(peer_device, sizeof(*p) + sizeof(*ref) + digest_size, DATA_STREAM);
+	if (!p)
+		return -EIO;
+	p->sector = cpu_to_be64(peer_req->i.sector);
+	p->block_id = peer_req->block_id;
+	p->seq_num = 0;  /* unused */
+	p->dp_flags = cpu_to_be32(DP_RS_DEDUPE);
+	ref = (struct drbd_rs_dedupe_ref *)(p + 1);
+	ref->sector = cpu_to_be64(ref_sector);
+	ref->size = cpu_to_be32(peer_req->i.size);
+	ref->pad = 0;
+	memcpy(ref->digest, digest, sizeof(ref->digest));
+	if (digest_size)
+		drbd_csum_pages(peer_device->connection->integrity_tfm, peer_req->page_chain.head, ref + 1);
+	return drbd_send_command(peer_device, P_RS_DATA_REPLY, DATA_STREAM);
+}
+
 int drbd_send_out_of_sync(struct drbd_peer_device *peer_device, struct drbd_interval *i)
 {
 	struct p_block_desc *p;
@@ -2576,8 +4147,7 @@ void drbd_cleanup_device(struct drbd_device *device)
 {
 	device->al_writ_cnt = 0;
 	device->bm_writ_cnt = 0;
-	device->read_cnt = 0;
-	device->writ_cnt = 0;
+	drbd_reset_io_cnt(device);
 
 	if (device->bitmap) {
 		/* maybe never allocated. */
@@ -2591,9 +4161,104 @@ void drbd_cleanup_device(struct drbd_device *device)
 }
 
 
+/**
+ * drbd_mempool_cache_alloc() - Allocate from a mempool, trying this CPU's magazine first
+ * @cache:	The magazines in front of the mempool
+ * @gfp_mask:	As for mempool_alloc()
+ *
+ * Callable from any context, as long as @gfp_mask allows that.
+ */
+void *drbd_mempool_cache_alloc(struct drbd_mempool_cache *cache, gfp_t gfp_mask)
+{
+	struct drbd_magazine *mag;
+	unsigned long flags;
+	void *obj = NULL;
+
+	local_irq_save(flags);
+	mag = this_cpu_ptr(cache->mag);
+	if (mag->nr) {
+		obj = mag->obj[--mag->nr];
+		mag->hits++;
+	} else {
+		mag->misses++;
+	}
+	local_irq_restore(flags);
+
+	if (!obj)
+		obj = mempool_alloc(cache->pool, gfp_mask);
+	return obj;
+}
+
+/**
+ * drbd_mempool_cache_free() - Give back an object from drbd_mempool_cache_alloc()
+ * @cache:	The magazines in front of the mempool
+ * @obj:	The object, may also come from a plain mempool_alloc()
+ *
+ * While the reserve of the mempool is not full, the object refills that
+ * instead, so that objects parked on other CPUs can not starve anyone.
+ */
+void drbd_mempool_cache_free(struct drbd_mempool_cache *cache, void *obj)
+{
+	unsigned int size = min_t(unsigned int, READ_ONCE(drbd_magazine_size), DRBD_MAGAZINE_MAX);
+	struct drbd_magazine *mag;
+	unsigned long flags;
+	bool kept = false;
+
+	if (!obj)
+		return;
+
+	local_irq_save(flags);
+	mag = this_cpu_ptr(cache->mag);
+	if (mag->nr < size && READ_ONCE(cache->pool->curr_nr) >= cache->pool->min_nr) {
+		mag->obj[mag->nr++] = obj;
+		mag->frees++;
+		kept = true;
+	} else {
+		mag->spills++;
+	}
+	local_irq_restore(flags);
+
+	if (!kept)
+		mempool_free(obj, cache->pool);
+}
+
+static int drbd_mempool_cache_init(struct drbd_mempool_cache *cache)
+{
+	cache->mag = alloc_percpu(struct drbd_magazine);
+	return cache->mag ? 0 : -ENOMEM;
+}
+
+static void drbd_mempool_cache_exit(struct drbd_mempool_cache *cache)
+{
+	int cpu;
+
+	if (!cache->mag)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct drbd_magazine *mag = per_cpu_ptr(cache->mag, cpu);
+
+		while (mag->nr)
+			mempool_free(mag->obj[--mag->nr], cache->pool);
+	}
+	free_percpu(cache->mag);
+	cache->mag = NULL;
+}
+
 static void drbd_destroy_mempools(void)
 {
 	struct page *page;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_pp_cpu *pc = per_cpu_ptr(&drbd_pp_cpu, cpu);
+
+		while (pc->pages) {
+			page = pc->pages;
+			pc->pages = page_chain_next(page);
+			__free_page(page);
+			pc->nr--;
+		}
+	}
 
 	while (drbd_pp_pool) {
 		page = drbd_pp_pool;
@@ -2607,6 +4272,8 @@ static void drbd_destroy_mempools(void)
 	bioset_exit(&drbd_io_bio_set);
 	bioset_exit(&drbd_md_io_bio_set);
 	mempool_exit(&drbd_md_io_page_pool);
+	drbd_mempool_cache_exit(&drbd_ee_mag);
+	drbd_mempool_cache_exit(&drbd_request_mag);
 	mempool_exit(&drbd_ee_mempool);
 	mempool_exit(&drbd_request_mempool);
 	if (drbd_ee_cache)
@@ -2628,18 +4295,17 @@ static void drbd_destroy_mempools(void)
 
 static int drbd_create_mempools(void)
 {
-	struct page *page;
 	const int number = (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count;
 	int i, ret;
 
 	/* caches */
 	drbd_request_cache = kmem_cache_create(
-		"drbd_req", sizeof(struct drbd_request), 0, 0, NULL);
+		"drbd_req", sizeof(struct drbd_request), 0, SLAB_HWCACHE_ALIGN, NULL);
 	if (drbd_request_cache == NULL)
 		goto Enomem;
 
 	drbd_ee_cache = kmem_cache_create(
-		"drbd_ee", sizeof(struct drbd_peer_request), 0, 0, NULL);
+		"drbd_ee", sizeof(struct drbd_peer_request), 0, SLAB_HWCACHE_ALIGN, NULL);
 	if (drbd_ee_cache == NULL)
 		goto Enomem;
 
@@ -2649,7 +4315,7 @@ static int drbd_create_mempools(void)
 		goto Enomem;
 
 	drbd_al_ext_cache = kmem_cache_create(
-		"drbd_al", sizeof(struct lc_element), 0, 0, NULL);
+		"drbd_al", sizeof(struct al_extent), 0, 0, NULL);
 	if (drbd_al_ext_cache == NULL)
 		goto Enomem;
 
@@ -2676,17 +4342,17 @@ static int drbd_create_mempools(void)
 	if (ret)
 		goto Enomem;
 
+	if (drbd_mempool_cache_init(&drbd_request_mag) ||
+	    drbd_mempool_cache_init(&drbd_ee_mag))
+		goto Enomem;
+
 	/* drbd's page pool */
 	spin_lock_init(&drbd_pp_lock);
 
-	for (i = 0; i < number; i++) {
-		page = alloc_page(GFP_HIGHUSER);
-		if (!page)
-			goto Enomem;
-		set_page_chain_next_offset_size(page, drbd_pp_pool, 0, 0);
-		drbd_pp_pool = page;
-	}
-	drbd_pp_vacant = number;
+	i = drbd_alloc_page_runs(NUMA_NO_NODE, GFP_HIGHUSER, number, &drbd_pp_pool);
+	drbd_pp_vacant = i;
+	if (i < number)
+		goto Enomem;
 
 	return 0;
 
@@ -2698,7 +4364,9 @@ Enomem:
 static void free_peer_device(struct drbd_peer_device *peer_device)
 {
 	lc_destroy(peer_device->resync_lru);
+	drbd_rs_pool_drain(peer_device);
 	kfree(peer_device->rs_plan_s);
+	kfree(peer_device->rs_dedupe);
 	kfree(peer_device->conf);
 	kfree(peer_device);
 }
@@ -2719,6 +4387,10 @@ static void drbd_device_finalize_work_fn(struct work_struct *work)
 	put_disk(device->vdisk);
 	blk_cleanup_queue(device->rq_queue);
 
+	free_percpu(device->lat_hist);
+	free_percpu(device->io_cnt);
+	kfree(device->al_heat);
+	drbd_ra_free(device);
 	kfree(device);
 
 	kref_debug_put(&resource->kref_debug, 4);
@@ -2767,6 +4439,7 @@ void drbd_reclaim_resource(struct rcu_head *rp)
 	struct drbd_resource *resource = container_of(rp, struct drbd_resource, rcu);
 	struct queued_twopc *q, *q1;
 	struct drbd_connection *connection, *tmp;
+	int cpu;
 
 	spin_lock_irq(&resource->queued_twopc_lock);
 	list_for_each_entry_safe(q, q1, &resource->queued_twopc, w.list) {
@@ -2782,7 +4455,10 @@ void drbd_reclaim_resource(struct rcu_head *rp)
 		kref_debug_put(&connection->kref_debug, 9);
 		kref_put(&connection->kref, drbd_destroy_connection);
 	}
-	mempool_free(resource->peer_ack_req, &drbd_request_mempool);
+	for_each_possible_cpu(cpu)
+		drbd_mempool_cache_free(&drbd_request_mag,
+					per_cpu_ptr(resource->peer_ack_cpu, cpu)->req);
+	free_percpu(resource->peer_ack_cpu);
 	kref_debug_put(&resource->kref_debug, 8);
 	kref_put(&resource->kref, drbd_destroy_resource);
 }
@@ -2896,6 +4572,21 @@ static void drbd_cleanup(void)
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
 
+	if (drbd_peer_submit_wq)
+		destroy_workqueue(drbd_peer_submit_wq);
+
+	if (drbd_bitmap_io_wq)
+		destroy_workqueue(drbd_bitmap_io_wq);
+
+	if (drbd_submit_dispatch_wq)
+		destroy_workqueue(drbd_submit_dispatch_wq);
+
+	if (drbd_csum_wq)
+		destroy_workqueue(drbd_csum_wq);
+
+	if (drbd_ack_sender_wq)
+		destroy_workqueue(drbd_ack_sender_wq);
+
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
 
@@ -2947,6 +4638,12 @@ static int drbd_congested(void *congested_data, int bdi_bits)
 		put_ldev(device);
 	}
 
+	/* Recent kernels hardly ever set the bdi congestion bits */
+	if (drbd_admit_congested(device) ||
+	    (drbd_admit_window(device) &&
+	     atomic_read(&device->ap_bio_cnt[WRITE]) >= drbd_admit_window(device)))
+		r |= bdi_bits & (1 << WB_async_congested);
+
 	if (bdi_bits & (1 << WB_async_congested)) {
 		struct drbd_peer_device *peer_device;
 
@@ -3030,10 +4727,16 @@ static void drbd_put_send_buffers(struct drbd_connection *connection)
 	unsigned int i;
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
-		if (connection->send_buffer[i].page) {
-			put_page(connection->send_buffer[i].page);
-			connection->send_buffer[i].page = NULL;
+		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
+		unsigned int j;
+
+		for (j = 0; j < DRBD_SEND_BUFFER_PAGES; j++) {
+			if (sbuf->ring[j]) {
+				put_page(sbuf->ring[j]);
+				sbuf->ring[j] = NULL;
+			}
 		}
+		sbuf->page = NULL;
 	}
 }
 
@@ -3050,6 +4753,8 @@ static int drbd_alloc_send_buffers(struct drbd_connection *connection)
 			return -ENOMEM;
 		}
 		connection->send_buffer[i].page = page;
+		connection->send_buffer[i].ring[0] = page;
+		connection->send_buffer[i].cur = 0;
 		connection->send_buffer[i].unsent =
 		connection->send_buffer[i].pos = page_address(page);
 	}
@@ -3060,11 +4765,7 @@ static int drbd_alloc_send_buffers(struct drbd_connection *connection)
 void drbd_flush_peer_acks(struct drbd_resource *resource)
 {
 	spin_lock_irq(&resource->peer_ack_lock);
-	if (resource->peer_ack_req) {
-		resource->last_peer_acked_dagtag = resource->peer_ack_req->dagtag_sector;
-		drbd_queue_peer_ack(resource, resource->peer_ack_req);
-		resource->peer_ack_req = NULL;
-	}
+	__drbd_flush_peer_acks(resource);
 	spin_unlock_irq(&resource->peer_ack_lock);
 }
 
@@ -3081,7 +4782,7 @@ void conn_free_crypto(struct drbd_connection *connection)
 	crypto_free_shash(connection->verify_tfm);
 	crypto_free_shash(connection->cram_hmac_tfm);
 	crypto_free_shash(connection->integrity_tfm);
-	crypto_free_shash(connection->peer_integrity_tfm);
+	drbd_put_integrity_tfm(connection->peer_integrity);
 	kfree(connection->int_dig_in);
 	kfree(connection->int_dig_vv);
 
@@ -3089,6 +4790,7 @@ void conn_free_crypto(struct drbd_connection *connection)
 	connection->verify_tfm = NULL;
 	connection->cram_hmac_tfm = NULL;
 	connection->integrity_tfm = NULL;
+	connection->peer_integrity = NULL;
 	connection->peer_integrity_tfm = NULL;
 	connection->int_dig_in = NULL;
 	connection->int_dig_vv = NULL;
@@ -3160,18 +4862,12 @@ int set_resource_options(struct drbd_resource *resource, struct res_opts *res_op
 		wake_device_misc = true;
 
 	resource->res_opts = *res_opts;
-	if (cpumask_empty(new_cpu_mask))
-		drbd_calc_cpu_mask(&new_cpu_mask);
-	if (!cpumask_equal(resource->cpu_mask, new_cpu_mask)) {
-		cpumask_copy(resource->cpu_mask, new_cpu_mask);
-		rcu_read_lock();
-		for_each_connection_rcu(connection, resource) {
-			connection->receiver.reset_cpu_mask = 1;
-			connection->ack_receiver.reset_cpu_mask = 1;
-			connection->sender.reset_cpu_mask = 1;
-		}
-		rcu_read_unlock();
+	resource->cpu_node = NUMA_NO_NODE;
+	if (cpumask_empty(new_cpu_mask)) {
+		resource->cpu_node = drbd_resource_numa_node(resource);
+		drbd_calc_cpu_mask(&new_cpu_mask, resource->cpu_node);
 	}
+	resource_set_cpu_mask(resource, new_cpu_mask);
 	err = 0;
 
 	if (force_state_recalc) {
@@ -3192,6 +4888,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 					   struct res_opts *res_opts)
 {
 	struct drbd_resource *resource;
+	int cpu;
 
 	resource = kzalloc(sizeof(struct drbd_resource), GFP_KERNEL);
 	if (!resource)
@@ -3201,6 +4898,12 @@ struct drbd_resource *drbd_create_resource(const char *name,
 		goto fail_free_resource;
 	if (!zalloc_cpumask_var(&resource->cpu_mask, GFP_KERNEL))
 		goto fail_free_name;
+	resource->cpu_node = NUMA_NO_NODE;
+	resource->peer_ack_cpu = alloc_percpu(struct drbd_peer_ack_cpu);
+	if (!resource->peer_ack_cpu)
+		goto fail_free_cpu_mask;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(resource->peer_ack_cpu, cpu)->lock);
 	kref_init(&resource->kref);
 	kref_debug_init(&resource->kref_debug, &resource->kref, &kref_class_resource);
 	idr_init(&resource->devices);
@@ -3217,7 +4920,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	sema_init(&resource->state_sem, 1);
 	resource->role[NOW] = R_SECONDARY;
 	if (set_resource_options(resource, res_opts))
-		goto fail_free_name;
+		goto fail_free_peer_ack_cpu;
 	resource->max_node_id = res_opts->node_id;
 	resource->twopc_reply.initiator_node_id = -1;
 	mutex_init(&resource->conf_update);
@@ -3228,6 +4931,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	spin_lock_init(&resource->listeners_lock);
 	init_waitqueue_head(&resource->state_wait);
 	init_waitqueue_head(&resource->twopc_wait);
+	init_waitqueue_head(&resource->qos_wait);
 	init_waitqueue_head(&resource->barrier_wait);
 	INIT_LIST_HEAD(&resource->twopc_parents);
 	timer_setup(&resource->twopc_timer, twopc_timer_fn, 0);
@@ -3246,6 +4950,10 @@ struct drbd_resource *drbd_create_resource(const char *name,
 
 	return resource;
 
+fail_free_peer_ack_cpu:
+	free_percpu(resource->peer_ack_cpu);
+fail_free_cpu_mask:
+	free_cpumask_var(resource->cpu_mask);
 fail_free_name:
 	kfree(resource->name);
 fail_free_resource:
@@ -3274,6 +4982,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 		goto fail;
 
 	INIT_LIST_HEAD(&connection->current_epoch->list);
+	INIT_LIST_HEAD(&connection->flush_coalesced);
 	connection->epochs = 1;
 	spin_lock_init(&connection->epoch_lock);
 
@@ -3297,6 +5006,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 
 	INIT_LIST_HEAD(&connection->connect_timer_work.list);
 	timer_setup(&connection->connect_timer, connect_timer_fn, 0);
+	timer_setup(&connection->request_timer, connection_request_timer_fn, 0);
 
 	drbd_thread_init(resource, &connection->receiver, drbd_receiver, "receiver");
 	connection->receiver.connection = connection;
@@ -3313,12 +5023,17 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	INIT_LIST_HEAD(&connection->net_ee);
 	INIT_LIST_HEAD(&connection->done_ee);
 	init_waitqueue_head(&connection->ee_wait);
+	init_waitqueue_head(&connection->cong_wait);
+	spin_lock_init(&connection->csum_batch_lock);
+	spin_lock_init(&connection->latency_probe.lock);
+	init_waitqueue_head(&connection->sbuf.wait);
 
 	kref_init(&connection->kref);
 	kref_debug_init(&connection->kref_debug, &connection->kref, &kref_class_connection);
 
 	INIT_WORK(&connection->peer_ack_work, drbd_send_peer_ack_wf);
 	INIT_WORK(&connection->send_acks_work, drbd_send_acks_wf);
+	mutex_init(&connection->send_acks_mutex);
 
 	kref_get(&resource->kref);
 	kref_debug_get(&resource->kref_debug, 3);
@@ -3382,6 +5097,10 @@ void drbd_destroy_connection(struct kref *kref)
 	idr_destroy(&connection->peer_devices);
 
 	kfree(connection->transport.net_conf);
+	drbd_compress_free(&connection->compress);
+	drbd_sbuf_free(&connection->sbuf);
+	if (connection->rs_dedupe_tfm)
+		crypto_free_shash(connection->rs_dedupe_tfm);
 	kref_debug_destroy(&connection->kref_debug);
 	kfree(connection);
 	kref_debug_put(&resource->kref_debug, 3);
@@ -3402,6 +5121,8 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	peer_device->disk_state[NOW] = D_UNKNOWN;
 	peer_device->repl_state[NOW] = L_OFF;
 	spin_lock_init(&peer_device->peer_seq_lock);
+	spin_lock_init(&peer_device->rs_pool.lock);
+	INIT_LIST_HEAD(&peer_device->rs_pool.free);
 
 	err = drbd_create_peer_device_default_config(peer_device);
 	if (err) {
@@ -3410,6 +5131,7 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	}
 
 	timer_setup(&peer_device->start_resync_timer, start_resync_timer_fn, 0);
+	timer_setup(&peer_device->verify_resume_timer, verify_resume_timer_fn, 0);
 
 	INIT_LIST_HEAD(&peer_device->resync_work.list);
 	peer_device->resync_work.cb  = w_resync_timer;
@@ -3419,6 +5141,8 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	peer_device->propagate_uuids_work.cb = w_send_uuids;
 
 	mutex_init(&peer_device->resync_next_bit_mutex);
+	spin_lock_init(&peer_device->rs_hot_lock);
+	spin_lock_init(&peer_device->in_sync_batch_lock);
 
 	atomic_set(&peer_device->ap_pending_cnt, 0);
 	atomic_set(&peer_device->unacked_cnt, 0);
@@ -3434,16 +5158,45 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 
 static int init_submitter(struct drbd_device *device)
 {
+	int i, cpu;
+
+	device->submit.cpu = alloc_percpu(struct drbd_submit_cpu);
+	if (!device->submit.cpu)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct drbd_submit_cpu *q = per_cpu_ptr(device->submit.cpu, cpu);
+
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->writes);
+	}
+	for (i = 0; i < DRBD_SUBMIT_WORKERS_MAX; i++) {
+		struct drbd_submit_dispatcher *d = &device->submit.dispatch[i];
+
+		spin_lock_init(&d->lock);
+		INIT_LIST_HEAD(&d->requests);
+		INIT_WORK(&d->work, drbd_do_submit_dispatch);
+		d->device = device;
+	}
+
 	/* opencoded create_singlethread_workqueue(),
 	 * to be able to use format string arguments */
 	device->submit.wq =
 		alloc_ordered_workqueue("drbd%u_submit", WQ_MEM_RECLAIM, device->minor);
-	if (!device->submit.wq)
+	if (!device->submit.wq) {
+		free_percpu(device->submit.cpu);
+		device->submit.cpu = NULL;
 		return -ENOMEM;
+	}
 	INIT_WORK(&device->submit.worker, do_submit);
-	INIT_LIST_HEAD(&device->submit.writes);
 	INIT_LIST_HEAD(&device->submit.peer_writes);
+	INIT_WORK(&device->submit.peer_submit_work, drbd_do_peer_submit);
+	INIT_LIST_HEAD(&device->submit.peer_submits);
 	spin_lock_init(&device->submit.lock);
+	for (i = 0; i < AL_PIPELINE_MAX; i++) {
+		INIT_LIST_HEAD(&device->al_pipe.slot[i].requests);
+		INIT_LIST_HEAD(&device->al_pipe.slot[i].peer_requests);
+	}
+	atomic_set(&device->al_pipe.in_flight, 0);
 	return 0;
 }
 
@@ -3458,7 +5211,7 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	struct request_queue *q;
 	LIST_HEAD(peer_devices);
 	LIST_HEAD(tmp);
-	int id;
+	int id, i;
 	int vnr = adm_ctx->volume;
 	enum drbd_ret_code err = ERR_NOMEM;
 	bool locked = false;
@@ -3489,6 +5242,16 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 
 	drbd_set_defaults(device);
 
+	/* without, there are no latency histograms */
+	device->lat_hist = __alloc_percpu(sizeof(struct drbd_lat_hist) * DRBD_LAT_DEVICE_STAGES,
+					  __alignof__(struct drbd_lat_hist));
+	/* nor write heat */
+	device->al_heat = kzalloc(sizeof(*device->al_heat), GFP_KERNEL);
+	if (device->al_heat) {
+		spin_lock_init(&device->al_heat->lock);
+		device->al_heat->window_start = jiffies;
+	}
+
 	atomic_set(&device->ap_bio_cnt[READ], 0);
 	atomic_set(&device->ap_bio_cnt[WRITE], 0);
 	atomic_set(&device->ap_actlog_cnt, 0);
@@ -3500,6 +5263,10 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 	spin_lock_init(&device->timing_lock);
+#endif
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	spin_lock_init(&device->fault_shaper[0].lock);
+	spin_lock_init(&device->fault_shaper[1].lock);
 #endif
 	spin_lock_init(&device->al_lock);
 
@@ -3515,12 +5282,18 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	INIT_LIST_HEAD(&device->pending_bitmap_work.q);
 
 	timer_setup(&device->md_sync_timer, md_sync_timer_fn, 0);
+	spin_lock_init(&device->md_sync.lock);
+	device->qos.weight = DRBD_QOS_WEIGHT_DEFAULT;
 	timer_setup(&device->request_timer, request_timer_fn, 0);
 
 	init_waitqueue_head(&device->misc_wait);
 	init_waitqueue_head(&device->al_wait);
 	init_waitqueue_head(&device->seq_wait);
 
+	device->io_cnt = alloc_percpu(struct drbd_io_cnt);
+	if (!device->io_cnt)
+		goto out_no_q;
+
 	q = blk_alloc_queue(GFP_KERNEL);
 	if (!q)
 		goto out_no_q;
@@ -3557,7 +5330,12 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 		goto out_no_bitmap;
 	spin_lock_init(&device->interval_lock);
 	device->read_requests = RB_ROOT;
-	device->write_requests = RB_ROOT;
+	rwlock_init(&device->write_span_lock);
+	device->write_span = RB_ROOT;
+	for (i = 0; i < DRBD_WRITE_SHARDS; i++) {
+		spin_lock_init(&device->write_shards[i].lock);
+		device->write_shards[i].root = RB_ROOT;
+	}
 
 	BUG_ON(!mutex_is_locked(&resource->conf_update));
 	for_each_connection(connection, resource) {
@@ -3682,6 +5460,9 @@ out_no_q:
 		/* kref debugging wants an extra put, see has_refs() */
 	kref_debug_put(&device->kref_debug, 4);
 	kref_debug_destroy(&device->kref_debug);
+	free_percpu(device->lat_hist);
+	free_percpu(device->io_cnt);
+	kfree(device->al_heat);
 	kfree(device);
 	return err;
 }
@@ -3712,8 +5493,12 @@ void drbd_unregister_device(struct drbd_device *device)
 	drbd_debugfs_device_cleanup(device);
 	del_gendisk(device->vdisk);
 
+	flush_work(&device->submit.peer_submit_work);
+	drbd_flush_submit(device);
 	destroy_workqueue(device->submit.wq);
 	device->submit.wq = NULL;
+	free_percpu(device->submit.cpu);
+	device->submit.cpu = NULL;
 	del_timer_sync(&device->request_timer);
 }
 
@@ -3762,6 +5547,7 @@ void drbd_unregister_connection(struct drbd_connection *connection)
 	drbd_debugfs_connection_cleanup(connection);
 
 	del_connect_timer(connection);
+	del_timer_sync(&connection->request_timer);
 
 	rr = drbd_free_peer_reqs(connection, &connection->done_ee, false);
 	if (rr)
@@ -3889,6 +5675,40 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	drbd_peer_submit_wq = alloc_workqueue("drbd-peer-submit", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_peer_submit_wq) {
+		pr_err("unable to create peer submit workqueue\n");
+		goto fail;
+	}
+
+	drbd_bitmap_io_wq = alloc_workqueue("drbd-bitmap-io", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_bitmap_io_wq) {
+		pr_err("unable to create bitmap io workqueue\n");
+		goto fail;
+	}
+
+	drbd_submit_dispatch_wq = alloc_workqueue("drbd-submit-dispatch",
+						  WQ_UNBOUND | WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!drbd_submit_dispatch_wq) {
+		pr_err("unable to create submit dispatch workqueue\n");
+		goto fail;
+	}
+
+	drbd_csum_wq = alloc_workqueue("drbd-csum", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_csum_wq) {
+		pr_err("unable to create csum workqueue\n");
+		goto fail;
+	}
+
+	if (drbd_shared_ack_sender) {
+		drbd_ack_sender_wq = alloc_workqueue("drbd-ack-sender",
+						     WQ_UNBOUND | WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+		if (!drbd_ack_sender_wq) {
+			pr_err("unable to create ack sender workqueue\n");
+			goto fail;
+		}
+	}
+
 	drbd_debugfs_init();
 
 	pr_info("initialized. "
@@ -3973,14 +5793,37 @@ int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer
 	return err;
 }
 
+/* Either a write that started after request ticket completed, or nobody
+ * writes right now and we may start one ourselves */
+static bool md_sync_ticket_done(struct drbd_device *device, u64 ticket, bool *done, int *err)
+{
+	bool rv;
+
+	spin_lock_irq(&device->md_sync.lock);
+	*done = device->md_sync.done >= ticket;
+	*err = device->md_sync.err;
+	rv = *done || !device->md_sync.writing;
+	if (rv && !*done)
+		device->md_sync.writing = true;
+	spin_unlock_irq(&device->md_sync.lock);
+	return rv;
+}
+
 /**
  * __drbd_md_sync() - Writes the meta data super block (conditionally) if the MD_DIRTY flag bit is set
  * @device:	DRBD device.
  * @maybe:	meta data may in fact be "clean", the actual write may be skipped.
+ *
+ * Callers that come in while a super block write is in flight wait for it,
+ * then a single one of them writes for all of them: the super block is
+ * encoded from the in core meta data only once that writer got its turn,
+ * so it contains the changes of everybody that queued up behind.
  */
 static int __drbd_md_sync(struct drbd_device *device, bool maybe)
 {
 	struct meta_data_on_disk_9 *buffer;
+	u64 ticket, target;
+	bool done;
 	int err = -EIO;
 
 	/* Don't accidentally change the DRBD meta data layout. */
@@ -3998,13 +5841,34 @@ static int __drbd_md_sync(struct drbd_device *device, bool maybe)
 	if (!get_ldev_if_state(device, D_DETACHING))
 		return -EIO;
 
-	buffer = drbd_md_get_buffer(device, __func__);
-	if (!buffer)
+	spin_lock_irq(&device->md_sync.lock);
+	ticket = ++device->md_sync.requested;
+	spin_unlock_irq(&device->md_sync.lock);
+
+	wait_event(device->misc_wait, md_sync_ticket_done(device, ticket, &done, &err));
+	if (done) {
+		device->md_sync.coalesced++;
 		goto out;
+	}
 
-	err = drbd_md_write(device, buffer);
+	/* We are the writer now, for all requests issued so far */
+	spin_lock_irq(&device->md_sync.lock);
+	target = device->md_sync.requested;
+	spin_unlock_irq(&device->md_sync.lock);
 
-	drbd_md_put_buffer(device);
+	err = -EIO;
+	buffer = drbd_md_get_buffer(device, __func__);
+	if (buffer) {
+		err = drbd_md_write(device, buffer);
+		drbd_md_put_buffer(device);
+	}
+
+	spin_lock_irq(&device->md_sync.lock);
+	device->md_sync.done = target;
+	device->md_sync.err = err;
+	device->md_sync.writing = false;
+	spin_unlock_irq(&device->md_sync.lock);
+	wake_up_all(&device->misc_wait);
 out:
 	put_ldev(device);
 
@@ -4189,7 +6053,7 @@ int drbd_md_decode(struct drbd_device *device,
 	}
 
 	if (be32_to_cpu(buffer->bm_bytes_per_bit) != BM_BLOCK_SIZE) {
-		drbd_err(device, "unexpected bm_bytes_per_bit: %u (expected %u)\n",
+		drbd_err(device, "unexpected bm_bytes_per_bit: %u (this module is built for %u)\n",
 		    be32_to_cpu(buffer->bm_bytes_per_bit), BM_BLOCK_SIZE);
 		goto err;
 	}
@@ -5531,6 +7395,72 @@ _drbd_insert_fault(struct drbd_device *device, unsigned int type)
 
 	return ret;
 }
+
+/* A bio held back to emulate a slow backing device. The hrtimer is precise
+ * enough for sub-millisecond latencies, the submission happens in a work
+ * item since it may block. */
+struct fault_delayed_bio {
+	struct hrtimer timer;
+	struct work_struct work;
+	struct bio *bio;
+};
+
+static void fault_delayed_bio_work(struct work_struct *ws)
+{
+	struct fault_delayed_bio *d = container_of(ws, struct fault_delayed_bio, work);
+
+	generic_make_request(d->bio);
+	kfree(d);
+}
+
+static enum hrtimer_restart fault_delayed_bio_timer(struct hrtimer *timer)
+{
+	struct fault_delayed_bio *d = container_of(timer, struct fault_delayed_bio, timer);
+
+	queue_work(system_unbound_wq, &d->work);
+	return HRTIMER_NORESTART;
+}
+
+/* Returns true if the bio will be submitted later, as fault_*_delay_us and
+ * fault_*_kbps ask for. The throughput limit queues the bios of a device
+ * and direction one after the other, the latency adds to each of them. */
+bool drbd_fault_delay_bio(struct drbd_device *device, struct bio *bio)
+{
+	const int rw = op_is_write(bio_op(bio));
+	const unsigned int delay_us = READ_ONCE(drbd_fault_delay_us[rw]);
+	const unsigned int kbps = READ_ONCE(drbd_fault_kbps[rw]);
+	struct drbd_fault_shaper *shaper = &device->fault_shaper[rw];
+	struct fault_delayed_bio *d;
+	u64 now, due;
+
+	if (!delay_us && !kbps)
+		return false;
+	if (drbd_fault_devs != 0 && ((1 << device_to_minor(device)) & drbd_fault_devs) == 0)
+		return false;
+
+	now = ktime_get_ns();
+	due = now;
+	if (kbps && bio_has_data(bio)) {
+		spin_lock(&shaper->lock);
+		due = max(now, shaper->next_ns) +
+			div_u64((u64)bio->bi_iter.bi_size * NSEC_PER_SEC, kbps * 1024ULL);
+		shaper->next_ns = due;
+		spin_unlock(&shaper->lock);
+	}
+	due += (u64)delay_us * NSEC_PER_USEC;
+	if (due <= now)
+		return false;
+
+	d = kmalloc(sizeof(*d), GFP_NOIO);
+	if (!d)
+		return false;
+	d->bio = bio;
+	INIT_WORK(&d->work, fault_delayed_bio_work);
+	hrtimer_init(&d->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	d->timer.function = fault_delayed_bio_timer;
+	hrtimer_start(&d->timer, ns_to_ktime(due), HRTIMER_MODE_ABS);
+	return true;
+}
 #endif
 
 module_init(drbd_init)
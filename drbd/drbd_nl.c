@@ -1011,7 +1011,7 @@ retry:
 		down(&resource->state_sem);
 		idr_for_each_entry(&resource->devices, device, vnr) {
 			fsync_bdev(device->this_bdev);
-			flush_workqueue(device->submit.wq);
+			drbd_flush_submit(device);
 		}
 
 		if (start_new_tl_epoch(resource)) {
@@ -1865,33 +1865,40 @@ static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
 	in_use = 0;
 	t = device->act_log;
 	n = lc_create("act_log", drbd_al_ext_cache, AL_UPDATES_PER_TRANSACTION,
-		dc->al_extents, sizeof(struct lc_element), 0);
+		dc->al_extents, sizeof(struct al_extent),
+		offsetof(struct al_extent, lce));
 
 	if (n == NULL) {
 		drbd_err(device, "Cannot allocate act_log lru!\n");
 		return -ENOMEM;
 	}
-	spin_lock_irq(&device->al_lock);
+	if (drbd_al_policy == LC_POLICY_2Q && lc_set_policy(n, LC_POLICY_2Q))
+		drbd_warn(device, "Cannot allocate act_log 2q filter, using lru\n");
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	if (t) {
 		for (i = 0; i < t->nr_elements; i++) {
 			e = lc_element_by_index(t, i);
-			if (e->refcnt)
+			if (atomic_read(&e->refcnt))
 				drbd_err(device, "refcnt(%d)==%d\n",
-				    e->lc_number, e->refcnt);
-			in_use += e->refcnt;
+				    e->lc_number, atomic_read(&e->refcnt));
+			in_use += atomic_read(&e->refcnt);
 		}
 	}
 	if (!in_use)
 		device->act_log = n;
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 	if (in_use) {
 		drbd_err(device, "Activity log still in use!\n");
 		lc_destroy(n);
 		return -EBUSY;
 	} else {
+		/* drbd_al_begin_io_fastpath() may still walk it */
+		synchronize_rcu();
 		lc_destroy(t);
 		device->al_writ_cnt = 0;
 		memset(device->al_histogram, 0, sizeof(device->al_histogram));
+		memset(&device->al_gc, 0, sizeof(device->al_gc));
+		memset(&device->al_auto, 0, sizeof(device->al_auto));
 	}
 	drbd_md_mark_dirty(device); /* we changed device->act_log->nr_elemens */
 	return 0;
@@ -2106,6 +2113,11 @@ void drbd_reconsider_queue_parameters(struct drbd_device *device, struct drbd_ba
 	unsigned int max_bio_size = device->device_conf.max_bio_size;
 	struct drbd_peer_device *peer_device;
 
+	/* The configuration goes up to DRBD_MAX_BIO_SIZE; left at that,
+	 * repl_max_kb may raise it */
+	if (max_bio_size == DRBD_MAX_BIO_SIZE)
+		max_bio_size = drbd_max_repl_size();
+
 	if (bdev) {
 		max_bio_size = min(max_bio_size,
 			queue_max_hw_sectors(bdev->backing_bdev->bd_disk->queue) << 9);
@@ -2644,6 +2656,7 @@ void drbd_backing_dev_free(struct drbd_device *device, struct drbd_backing_dev *
 	close_backing_dev(device, ldev->backing_bdev, true);
 
 	kfree(ldev->disk_conf);
+	kvfree(ldev->unallocated);
 	kfree(ldev);
 }
 
@@ -3003,8 +3016,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	    !device->have_quorum[NOW])
 		set_bit(PRIMARY_LOST_QUORUM, &device->flags);
 
-	device->read_cnt = 0;
-	device->writ_cnt = 0;
+	drbd_reset_io_cnt(device);
 
 	drbd_reconsider_queue_parameters(device, device->ldev, NULL);
 
@@ -3097,6 +3109,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 
 	drbd_kobject_uevent(device);
 	put_ldev(device);
+	drbd_resource_numa_placement(resource);
 	mutex_unlock(&resource->adm_mutex);
 	drbd_adm_finish(&adm_ctx, info, retcode);
 	return 0;
@@ -3366,6 +3379,7 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	int ovr; /* online verify running */
 	int rsr; /* re-sync running */
 	struct crypto crypto = { };
+	struct crypto_shash *old_csums_tfm = NULL, *old_verify_tfm = NULL;
 
 	retcode = drbd_adm_prepare(&adm_ctx, skb, info, DRBD_ADM_NEED_CONNECTION);
 	if (!adm_ctx.reply_skb)
@@ -3429,15 +3443,21 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	connection->fencing_policy = new_net_conf->fencing_policy;
 
 	if (!rsr) {
-		crypto_free_shash(connection->csums_tfm);
-		connection->csums_tfm = crypto.csums_tfm;
+		old_csums_tfm = connection->csums_tfm;
+		WRITE_ONCE(connection->csums_tfm, crypto.csums_tfm);
 		crypto.csums_tfm = NULL;
 	}
 	if (!ovr) {
-		crypto_free_shash(connection->verify_tfm);
-		connection->verify_tfm = crypto.verify_tfm;
+		old_verify_tfm = connection->verify_tfm;
+		WRITE_ONCE(connection->verify_tfm, crypto.verify_tfm);
 		crypto.verify_tfm = NULL;
 	}
+	/* new csum jobs see the new ones now; once drbd_csum_wq is flushed,
+	 * no job hashes with the old ones anymore */
+	if (!rsr || !ovr)
+		flush_workqueue(drbd_csum_wq);
+	crypto_free_shash(old_csums_tfm);
+	crypto_free_shash(old_verify_tfm);
 
 	crypto_free_shash(connection->integrity_tfm);
 	connection->integrity_tfm = crypto.integrity_tfm;
@@ -3451,6 +3471,10 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	mutex_unlock(&connection->mutex[DATA_STREAM]);
 	mutex_unlock(&connection->resource->conf_update);
 	synchronize_rcu();
+	/* Let receivers throttled by the old max-buffers see the new one now;
+	 * the transport picks up new socket buffer sizes on its own. */
+	if (new_net_conf->max_buffers > old_net_conf->max_buffers)
+		wake_up(&drbd_pp_wait);
 	kfree(old_net_conf);
 
 	if (connection->cstate[NOW] >= C_CONNECTED) {
@@ -5030,8 +5054,8 @@ static void device_to_statistics(struct device_statistics *s,
 		put_ldev(device);
 	}
 	s->dev_size = drbd_get_capacity(device->this_bdev);
-	s->dev_read = device->read_cnt;
-	s->dev_write = device->writ_cnt;
+	s->dev_read = drbd_read_cnt(device);
+	s->dev_write = drbd_writ_cnt(device);
 	s->dev_al_writes = device->al_writ_cnt;
 	s->dev_bm_writes = device->bm_writ_cnt;
 	s->dev_upper_pending = atomic_read(&device->ap_bio_cnt[READ]) +
@@ -6049,11 +6073,11 @@ static int nla_put_notification_header(struct sk_buff *msg,
 	return drbd_notification_header_to_skb(msg, &nh, true);
 }
 
-void notify_resource_state(struct sk_buff *skb,
-			   unsigned int seq,
-			   struct drbd_resource *resource,
-			   struct resource_info *resource_info,
-			   enum drbd_notification_type type)
+int notify_resource_state(struct sk_buff *skb,
+			  unsigned int seq,
+			  struct drbd_resource *resource,
+			  struct resource_info *resource_info,
+			  enum drbd_notification_type type)
 {
 	struct resource_statistics resource_statistics;
 	struct drbd_genlmsghdr *dh;
@@ -6091,20 +6115,27 @@ void notify_resource_state(struct sk_buff *skb,
 		if (err && err != -ESRCH)
 			goto failed;
 	}
-	return;
+	return 0;
 
 nla_put_failure:
+	if (!multicast) {
+		/* the caller's skb is full, it may retry with another one */
+		if (dh)
+			genlmsg_cancel(skb, dh);
+		return err;
+	}
 	nlmsg_free(skb);
 failed:
 	drbd_err(resource, "Error %d while broadcasting event. Event seq:%u\n",
 			err, seq);
+	return err;
 }
 
-void notify_device_state(struct sk_buff *skb,
-			 unsigned int seq,
-			 struct drbd_device *device,
-			 struct device_info *device_info,
-			 enum drbd_notification_type type)
+int notify_device_state(struct sk_buff *skb,
+			unsigned int seq,
+			struct drbd_device *device,
+			struct device_info *device_info,
+			enum drbd_notification_type type)
 {
 	struct device_statistics device_statistics;
 	struct drbd_genlmsghdr *dh;
@@ -6132,7 +6163,8 @@ void notify_device_state(struct sk_buff *skb,
 	     device_info_to_skb(skb, device_info, true)))
 		goto nla_put_failure;
 	device_to_statistics(&device_statistics, device);
-	device_statistics_to_skb(skb, &device_statistics, !capable(CAP_SYS_ADMIN));
+	if (device_statistics_to_skb(skb, &device_statistics, !capable(CAP_SYS_ADMIN)))
+		goto nla_put_failure;
 	genlmsg_end(skb, dh);
 	if (multicast) {
 		err = drbd_genl_multicast_events(skb, GFP_NOWAIT);
@@ -6140,21 +6172,28 @@ void notify_device_state(struct sk_buff *skb,
 		if (err && err != -ESRCH)
 			goto failed;
 	}
-	return;
+	return 0;
 
 nla_put_failure:
+	if (!multicast) {
+		/* the caller's skb is full, it may retry with another one */
+		if (dh)
+			genlmsg_cancel(skb, dh);
+		return err;
+	}
 	nlmsg_free(skb);
 failed:
 	drbd_err(device, "Error %d while broadcasting event. Event seq:%u\n",
 		 err, seq);
+	return err;
 }
 
 /* open coded path_parms_to_skb() iterating of the list */
-void notify_connection_state(struct sk_buff *skb,
-			     unsigned int seq,
-			     struct drbd_connection *connection,
-			     struct connection_info *connection_info,
-			     enum drbd_notification_type type)
+int notify_connection_state(struct sk_buff *skb,
+			    unsigned int seq,
+			    struct drbd_connection *connection,
+			    struct connection_info *connection_info,
+			    enum drbd_notification_type type)
 {
 	struct connection_statistics connection_statistics;
 	struct drbd_genlmsghdr *dh;
@@ -6181,9 +6220,11 @@ void notify_connection_state(struct sk_buff *skb,
 	    ((type & ~NOTIFY_FLAGS) != NOTIFY_DESTROY &&
 	     connection_info_to_skb(skb, connection_info, true)))
 		goto nla_put_failure;
-	connection_paths_to_skb(skb, connection);
+	if (connection_paths_to_skb(skb, connection))
+		goto nla_put_failure;
 	connection_to_statistics(&connection_statistics, connection);
-	connection_statistics_to_skb(skb, &connection_statistics, !capable(CAP_SYS_ADMIN));
+	if (connection_statistics_to_skb(skb, &connection_statistics, !capable(CAP_SYS_ADMIN)))
+		goto nla_put_failure;
 	genlmsg_end(skb, dh);
 	if (multicast) {
 		err = drbd_genl_multicast_events(skb, GFP_NOWAIT);
@@ -6191,20 +6232,27 @@ void notify_connection_state(struct sk_buff *skb,
 		if (err && err != -ESRCH)
 			goto failed;
 	}
-	return;
+	return 0;
 
 nla_put_failure:
+	if (!multicast) {
+		/* the caller's skb is full, it may retry with another one */
+		if (dh)
+			genlmsg_cancel(skb, dh);
+		return err;
+	}
 	nlmsg_free(skb);
 failed:
 	drbd_err(connection, "Error %d while broadcasting event. Event seq:%u\n",
 		 err, seq);
+	return err;
 }
 
-void notify_peer_device_state(struct sk_buff *skb,
-			      unsigned int seq,
-			      struct drbd_peer_device *peer_device,
-			      struct peer_device_info *peer_device_info,
-			      enum drbd_notification_type type)
+int notify_peer_device_state(struct sk_buff *skb,
+			     unsigned int seq,
+			     struct drbd_peer_device *peer_device,
+			     struct peer_device_info *peer_device_info,
+			     enum drbd_notification_type type)
 {
 	struct peer_device_statistics peer_device_statistics;
 	struct drbd_resource *resource = peer_device->device->resource;
@@ -6233,7 +6281,8 @@ void notify_peer_device_state(struct sk_buff *skb,
 	     peer_device_info_to_skb(skb, peer_device_info, true)))
 		goto nla_put_failure;
 	peer_device_to_statistics(&peer_device_statistics, peer_device);
-	peer_device_statistics_to_skb(skb, &peer_device_statistics, !capable(CAP_SYS_ADMIN));
+	if (peer_device_statistics_to_skb(skb, &peer_device_statistics, !capable(CAP_SYS_ADMIN)))
+		goto nla_put_failure;
 	genlmsg_end(skb, dh);
 	if (multicast) {
 		err = drbd_genl_multicast_events(skb, GFP_NOWAIT);
@@ -6241,13 +6290,60 @@ void notify_peer_device_state(struct sk_buff *skb,
 		if (err && err != -ESRCH)
 			goto failed;
 	}
-	return;
+	return 0;
 
 nla_put_failure:
+	if (!multicast) {
+		/* the caller's skb is full, it may retry with another one */
+		if (dh)
+			genlmsg_cancel(skb, dh);
+		return err;
+	}
 	nlmsg_free(skb);
 failed:
 	drbd_err(peer_device, "Error %d while broadcasting event. Event seq:%u\n",
 		 err, seq);
+	return err;
+}
+
+/*
+ * Collect several events in one skb instead of multicasting one skb per
+ * event; with hundreds of objects changing at once, the per skb overhead is
+ * what overruns the receive buffers of listeners. Netlink allows many
+ * messages per skb, listeners parse them one after the other anyways.
+ * Call with notification_mutex held, and end with notify_batch_flush().
+ */
+void notify_batch_add(struct sk_buff **skb, drbd_notify_fn notify, void *arg,
+		      enum drbd_notification_type type)
+{
+	unsigned int seq = atomic_inc_return(&drbd_genl_seq);
+
+	if (*skb && !notify(*skb, seq, arg, type))
+		return;
+	notify_batch_flush(skb);
+
+	*skb = genlmsg_new(NLMSG_GOODSIZE, GFP_NOIO);
+	if (*skb && !notify(*skb, seq, arg, type))
+		return;
+	/* does not fit on its own: let it fail and complain the usual way */
+	notify(NULL, 0, arg, type);
+}
+
+void notify_batch_flush(struct sk_buff **skb)
+{
+	int err;
+
+	if (!*skb)
+		return;
+	if (!(*skb)->len) {
+		nlmsg_free(*skb);
+	} else {
+		err = drbd_genl_multicast_events(*skb, GFP_NOWAIT);
+		/* skb has been consumed or freed in netlink_broadcast() */
+		if (err && err != -ESRCH)
+			pr_err("Error %d while broadcasting events\n", err);
+	}
+	*skb = NULL;
 }
 
 void drbd_broadcast_sync_progress(struct drbd_peer_device *peer_device)
@@ -6355,25 +6451,21 @@ fail:
 		 err, seq);
 }
 
-static void notify_initial_state_done(struct sk_buff *skb, unsigned int seq)
+static int notify_initial_state_done(struct sk_buff *skb, unsigned int seq)
 {
 	struct drbd_genlmsghdr *dh;
-	int err;
 
-	err = -EMSGSIZE;
 	dh = genlmsg_put(skb, 0, seq, &drbd_genl_family, 0, DRBD_INITIAL_STATE_DONE);
 	if (!dh)
-		goto nla_put_failure;
+		return -EMSGSIZE;
 	dh->minor = -1U;
 	dh->ret_code = NO_ERROR;
-	if (nla_put_notification_header(skb, NOTIFY_EXISTS))
-		goto nla_put_failure;
+	if (nla_put_notification_header(skb, NOTIFY_EXISTS)) {
+		genlmsg_cancel(skb, dh);
+		return -EMSGSIZE;
+	}
 	genlmsg_end(skb, dh);
-	return;
-
-nla_put_failure:
-	nlmsg_free(skb);
-	pr_err("Error %d sending event. Event seq:%u\n", err, seq);
+	return 0;
 }
 
 static void free_state_changes(struct list_head *list)
@@ -6394,60 +6486,65 @@ static unsigned int notifications_for_state_change(struct drbd_state_change *sta
 	       state_change->n_devices * state_change->n_connections;
 }
 
+/* The n-th event of state_change, see notifications_for_state_change() */
+static int notify_initial_state(struct sk_buff *skb, unsigned int seq,
+				struct drbd_state_change *state_change, unsigned int n,
+				enum drbd_notification_type flags)
+{
+	if (n < 1)
+		return notify_resource_state_change(skb, seq, state_change, flags);
+	n--;
+	if (n < state_change->n_connections)
+		return notify_connection_state_change(skb, seq, &state_change->connections[n],
+						      flags);
+	n -= state_change->n_connections;
+	if (n < state_change->n_devices)
+		return notify_device_state_change(skb, seq, &state_change->devices[n], flags);
+	n -= state_change->n_devices;
+	return notify_peer_device_state_change(skb, seq, &state_change->peer_devices[n], flags);
+}
+
 static int get_initial_state(struct sk_buff *skb, struct netlink_callback *cb)
 {
-	struct drbd_state_change *state_change = (struct drbd_state_change *)cb->args[0];
 	unsigned int seq = cb->args[2];
-	unsigned int n;
-	enum drbd_notification_type flags = 0;
 
 	/* There is no need for taking notification_mutex here: it doesn't
 	   matter if the initial state events mix with later state change
 	   events; we can always tell the events apart by the NOTIFY_EXISTS
 	   flag. */
 
-	cb->args[5]--;
-	if (cb->args[5] == 1) {
-		notify_initial_state_done(skb, seq);
-		goto out;
-	}
-	n = cb->args[4]++;
-	if (cb->args[4] < cb->args[3])
-		flags |= NOTIFY_CONTINUES;
-	if (n < 1) {
-		notify_resource_state_change(skb, seq, state_change,
-					     NOTIFY_EXISTS | flags);
-		goto next;
-	}
-	n--;
-	if (n < state_change->n_connections) {
-		notify_connection_state_change(skb, seq, &state_change->connections[n],
-					       NOTIFY_EXISTS | flags);
-		goto next;
-	}
-	n -= state_change->n_connections;
-	if (n < state_change->n_devices) {
-		notify_device_state_change(skb, seq, &state_change->devices[n],
-					   NOTIFY_EXISTS | flags);
-		goto next;
-	}
-	n -= state_change->n_devices;
-	if (n < state_change->n_devices * state_change->n_connections) {
-		notify_peer_device_state_change(skb, seq, &state_change->peer_devices[n],
-						NOTIFY_EXISTS | flags);
-		goto next;
-	}
+	/* As many events per skb as fit: with thousands of objects, one skb
+	   per event means thousands of round trips through the dump. */
+	while (cb->args[5] > 1) {
+		struct drbd_state_change *state_change =
+			(struct drbd_state_change *)cb->args[0];
+		enum drbd_notification_type flags = NOTIFY_EXISTS;
+		unsigned int n = cb->args[4];
+
+		if (cb->args[5] == 2) {
+			if (!notify_initial_state_done(skb, seq))
+				cb->args[5]--;
+			break;
+		}
+
+		if (n + 1 < cb->args[3])
+			flags |= NOTIFY_CONTINUES;
+		if (notify_initial_state(skb, seq, state_change, n, flags)) {
+			if (skb->len)
+				break; /* continue with this one in the next skb */
+			pr_err("Event too large for an skb, skipped. Event seq:%u\n", seq);
+		}
 
-next:
-	if (cb->args[4] == cb->args[3]) {
-		struct drbd_state_change *next_state_change =
-			list_entry(state_change->list.next,
-				   struct drbd_state_change, list);
-		cb->args[0] = (long)next_state_change;
-		cb->args[3] = notifications_for_state_change(next_state_change);
-		cb->args[4] = 0;
+		cb->args[5]--;
+		if (++cb->args[4] == cb->args[3]) {
+			struct drbd_state_change *next_state_change =
+				list_entry(state_change->list.next,
+					   struct drbd_state_change, list);
+			cb->args[0] = (long)next_state_change;
+			cb->args[3] = notifications_for_state_change(next_state_change);
+			cb->args[4] = 0;
+		}
 	}
-out:
 	return skb->len;
 }
 
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef __DRBD_PROTOCOL_EXT_H
+#define __DRBD_PROTOCOL_EXT_H
+
+/*
+ * Extensions of the wire protocol in drbd_protocol.h. Each of them is used
+ * only towards a peer that announced it in P_CONNECTION_FEATURES, see
+ * drbd_local_features() and connection->agreed_features.
+ *
+ * The feature flags are allocated from the top, to stay clear of the ones
+ * in drbd_protocol.h.
+ *
+ * These bits and numbers belong to the extensions here, drbd_protocol.h must
+ * not take them:
+ * - the feature flags 1U << 24 to 1U << 31, DRBD_FF_EXT_MASK;
+ * - the P_DATA flags DP_IDLE (1U << 22), DP_IOPRIO_* (1U << 23 to 1U << 27),
+ *   DP_RS_DEDUPE (1U << 30) and DP_COMPRESSED (1U << 31), DP_EXT_MASK;
+ * - the packet numbers from 0xff down, below P_MAY_IGNORE.
+ */
+#define DRBD_FF_EXT_MASK	(0xffU << 24)
+#define DP_EXT_MASK		(0x3fU << 22 | 3U << 30)
+
+#define DRBD_FF_BM_CODEC	(1U << 31)	/* DRBD_BM_CODE_RLE_RC */
+#define DRBD_FF_BM_DIGEST	(1U << 30)	/* DRBD_BM_CODE_DIGEST */
+#define DRBD_FF_COMPRESS_LZ4	(1U << 29)
+#define DRBD_FF_COMPRESS_ZSTD	(1U << 28)
+#define DRBD_FF_RS_DEDUPE	(1U << 27)
+#define DRBD_FF_IO_HINTS	(1U << 26)	/* DP_IDLE, DP_IOPRIO_* */
+#define DRBD_FF_OV_TREE		(1U << 25)	/* ID_OV_DESCEND */
+#define DRBD_FF_BLOCK_ACKS	(1U << 24)	/* P_BLOCK_ACKS */
+
+/* Packets, allocated from the top of the range below P_MAY_IGNORE. */
+#define P_BLOCK_ACKS		((enum drbd_packet)0xff)
+
+/* Compression of P_DATA payloads, see drbd_compress_bio() and read_in_block().
+ * A compressed payload starts with struct drbd_compress_hdr, before the
+ * integrity digest, which still covers the uncompressed data. */
+#define DP_COMPRESSED	(1U << 31)
+
+enum drbd_compress_alg {
+	DRBD_COMPRESS_NONE,
+	DRBD_COMPRESS_LZ4,
+	DRBD_COMPRESS_ZSTD,
+};
+
+struct drbd_compress_hdr {
+	__be32 size;	/* uncompressed, bi_size */
+	u8 alg;		/* enum drbd_compress_alg */
+	u8 pad[3];
+} __packed;
+
+/* Resync deduplication, see rs_dedupe_lookup() and recv_resync_dedupe().
+ * Instead of the data, a P_RS_DATA_REPLY with DP_RS_DEDUPE carries the
+ * location of an earlier resync block with the same content, which the
+ * SyncTarget already wrote. It reads that block locally, checks the digest,
+ * and requests the data again if it does not match (any more). Such a
+ * resync write is acked with ID_SYNCER_DEDUPE. */
+#define DP_RS_DEDUPE	(1U << 30)
+#define DRBD_RS_DEDUPE_DIGEST_SIZE 32	/* sha256 */
+
+struct drbd_rs_dedupe_ref {
+	__be64 sector;
+	__be32 size;	/* bi_size */
+	__be32 pad;
+	u8 digest[DRBD_RS_DEDUPE_DIGEST_SIZE];
+} __packed;
+
+/* Several P_WRITE_ACK or P_RECV_ACK of one volume in one packet on the
+ * control stream, see drbd_send_block_ack() and got_BlockAcks(). The number
+ * of acks follows from the packet size. */
+#define DRBD_BLOCK_ACKS_MAX	32
+
+struct p_block_acks {
+	__be32 cmd;	/* P_WRITE_ACK or P_RECV_ACK */
+	struct p_block_ack acks[];
+} __packed;
+
+/* REQ_IDLE and the I/O priority of a write, see bio_flags_to_wire(). A class
+ * of IOPRIO_CLASS_NONE means "not set". */
+#define DP_IDLE			(1U << 22)
+#define DP_IOPRIO_LEVEL_SHIFT	23	/* 3 bits */
+#define DP_IOPRIO_CLASS_SHIFT	26	/* 2 bits */
+
+static inline u32 ioprio_to_wire(unsigned short ioprio)
+{
+	unsigned int class = IOPRIO_PRIO_CLASS(ioprio);
+
+	if (class == IOPRIO_CLASS_NONE || class > IOPRIO_CLASS_IDLE)
+		return 0;
+	return class << DP_IOPRIO_CLASS_SHIFT |
+		(IOPRIO_PRIO_DATA(ioprio) & 7) << DP_IOPRIO_LEVEL_SHIFT;
+}
+
+static inline unsigned short wire_to_ioprio(u32 dpf)
+{
+	return IOPRIO_PRIO_VALUE((dpf >> DP_IOPRIO_CLASS_SHIFT) & 3,
+				 (dpf >> DP_IOPRIO_LEVEL_SHIFT) & 7);
+}
+
+#endif
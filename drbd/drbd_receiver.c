@@ -30,11 +30,14 @@
 #include <linux/unistd.h>
 #include <linux/vmalloc.h>
 #include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
 #include <net/ipv6.h>
 #include "drbd_int.h"
 #include "drbd_protocol.h"
 #include "drbd_req.h"
 #include "drbd_vli.h"
+#include "drbd_trace.h"
 #include <linux/scatterlist.h>
 
 #define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME|DRBD_FF_WZEROES)
@@ -175,6 +178,8 @@ static void drbd_resync(struct drbd_peer_device *, enum resync_reason) __must_ho
 static void drbd_unplug_all_devices(struct drbd_connection *connection);
 static int decode_header(struct drbd_connection *, void *, struct packet_info *);
 static void check_resync_source(struct drbd_device *device, u64 weak_nodes);
+static void drbd_rs_unlock_interval(struct drbd_peer_request *peer_req);
+static int drbd_rs_lock_interval(struct drbd_peer_request *peer_req);
 
 static const struct sync_descriptor strategy_descriptor(enum sync_strategy strategy)
 {
@@ -283,12 +288,126 @@ static void page_chain_add(struct page **head,
 	*head = chain_first;
 }
 
+/* Take number pages from this CPU's cache, if necessary refilling it from
+ * drbd_pp_pool first, with one batch under drbd_pp_lock. */
+static struct page *drbd_pp_cpu_get(unsigned int number)
+{
+	struct drbd_pp_cpu *pc = get_cpu_ptr(&drbd_pp_cpu);
+	struct page *page = NULL;
+
+	/* Racy test of drbd_pp_vacant again, rechecked under the lock */
+	if (pc->nr < number && drbd_pp_vacant >= (int)(number - pc->nr)) {
+		unsigned int want = min_t(unsigned int, number - pc->nr + DRBD_PP_CPU_BATCH,
+					  DRBD_PP_CPU_PAGES - pc->nr);
+		struct page *chain = NULL;
+
+		spin_lock(&drbd_pp_lock);
+		if (drbd_pp_vacant < (int)want)
+			want = max(drbd_pp_vacant, 0);
+		if (want >= number - pc->nr)
+			chain = page_chain_del(&drbd_pp_pool, want);
+		if (chain)
+			drbd_pp_vacant -= want;
+		spin_unlock(&drbd_pp_lock);
+
+		if (chain) {
+			page_chain_add(&pc->pages, chain, page_chain_tail(chain, NULL));
+			pc->nr += want;
+			pc->refills++;
+		}
+	}
+
+	if (pc->nr >= number) {
+		page = page_chain_del(&pc->pages, number);
+		pc->nr -= number;
+		pc->hits++;
+	}
+	put_cpu_ptr(&drbd_pp_cpu);
+
+	return page;
+}
+
+/* Keep a freed chain of n pages on this CPU, if they are node local and fit */
+static bool drbd_pp_cpu_put(struct page *page, struct page *tail, int n)
+{
+	struct drbd_pp_cpu *pc = get_cpu_ptr(&drbd_pp_cpu);
+	bool kept = false;
+
+	if (page_to_nid(page) == numa_mem_id() && pc->nr + n <= DRBD_PP_CPU_PAGES) {
+		page_chain_add(&pc->pages, page, tail);
+		pc->nr += n;
+		kept = true;
+	} else {
+		pc->spills++;
+	}
+	put_cpu_ptr(&drbd_pp_cpu);
+
+	return kept;
+}
+
+/**
+ * drbd_alloc_page_runs() - Allocate pages from the system onto a page chain
+ * @nid:	NUMA node to allocate on
+ * @gfp_mask:	allocation flags
+ * @number:	number of pages wanted
+ * @chain:	page chain to prepend the pages to
+ *
+ * The chain still consists of order 0 pages, but they come in physically
+ * contiguous runs of up to 2^drbd_page_order pages each, chained in
+ * ascending order. bio_add_page() merges such neighbours into a single
+ * bvec. Higher orders are only tried opportunistically; once that fails,
+ * the rest is allocated page by page.
+ *
+ * Returns the number of pages added to @chain, which is less than @number
+ * if the system did not have enough.
+ */
+unsigned int drbd_alloc_page_runs(int nid, gfp_t gfp_mask, unsigned int number,
+				  struct page **chain)
+{
+	unsigned int order = min_t(unsigned int, READ_ONCE(drbd_page_order), DRBD_PP_MAX_ORDER);
+	unsigned int done = 0;
+
+	while (done < number) {
+		struct page *page = NULL;
+		int i;
+
+		while (order && (1U << order) > number - done)
+			order--;
+		if (order) {
+			page = alloc_pages_node(nid, gfp_mask | __GFP_NORETRY | __GFP_NOWARN, order);
+			if (page)
+				split_page(page, order);
+			else
+				order = 0;
+		}
+		if (!page) {
+			page = alloc_pages_node(nid, gfp_mask, 0);
+			if (!page)
+				break;
+		}
+
+		for (i = (1 << order) - 1; i >= 0; i--) {
+			set_page_chain_next_offset_size(page + i, *chain, 0, 0);
+			*chain = page + i;
+		}
+		done += 1U << order;
+	}
+
+	return done;
+}
+
 static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 {
 	struct page *page = NULL;
 	struct page *tmp = NULL;
 	unsigned int i = 0;
 
+	if (number <= DRBD_PP_CPU_PAGES) {
+		page = drbd_pp_cpu_get(number);
+		if (page)
+			return page;
+	}
+
 	/* Yes, testing drbd_pp_vacant outside the lock is racy.
 	 * So what. It saves a spin_lock. */
 	if (drbd_pp_vacant >= number) {
@@ -301,16 +420,12 @@ static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 			return page;
 	}
 
-	for (i = 0; i < number; i++) {
-		tmp = alloc_page(gfp_mask);
-		if (!tmp)
-			break;
-		set_page_chain_next_offset_size(tmp, page, 0, 0);
-		page = tmp;
-	}
-
-	if (i == number)
+	/* Allocate on the node of the CPU that is going to fill the pages */
+	i = drbd_alloc_page_runs(numa_mem_id(), gfp_mask, number, &page);
+	if (i == number) {
+		this_cpu_inc(drbd_pp_cpu.fallbacks);
 		return page;
+	}
 
 	/* Not enough pages immediately available this time.
 	 * No need to jump around here, drbd_alloc_pages will retry this
@@ -327,10 +442,26 @@ static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 
 static void rs_sectors_came_in(struct drbd_peer_device *peer_device, int size)
 {
+	struct drbd_rs_bbr *bbr = &peer_device->rs_bbr;
 	int rs_sect_in = atomic_add_return(size >> 9, &peer_device->rs_sect_in);
+	int received = atomic_add_return(size >> 9, &bbr->sect_received);
+
+	drbd_rs_tl_add(peer_device, DRBD_RS_TL_RECEIVED, size >> 9);
 
-	/* In case resync runs faster than anticipated, run the resync_work early */
-	if (rs_sect_in >= peer_device->rs_in_flight)
+	/* The reply to the first request of the turn that armed the probe:
+	 * one RTT sample for the resync controller */
+	if (atomic_read(&bbr->probe_armed)) {
+		smp_rmb(); /* probe_mark and probe_kt, see rs_bbr_arm_probe() */
+		if (received - bbr->probe_mark >= 0 &&
+		    atomic_cmpxchg(&bbr->probe_armed, 1, 0) == 1)
+			atomic64_set(&bbr->rtt_sample_ns,
+				     max_t(s64, ktime_to_ns(ktime_sub(ktime_get(), bbr->probe_kt)), 1));
+	}
+
+	/* In case resync runs faster than anticipated, run the resync_work early;
+	 * with resync_refill, as soon as a quarter of the requests came back */
+	if (rs_sect_in >= (READ_ONCE(drbd_resync_refill) ?
+			   peer_device->rs_in_flight / 4 : peer_device->rs_in_flight))
 		drbd_queue_work_if_unqueued(
 			&peer_device->connection->sender_work,
 			&peer_device->resync_work);
@@ -386,6 +517,17 @@ static void drbd_reclaim_net_peer_reqs(struct drbd_connection *connection)
  *
  * Returns a page chain linked via (struct drbd_page_chain*)&page->lru.
  */
+static unsigned int max_buffers(struct drbd_transport *transport)
+{
+	unsigned int mxb;
+
+	rcu_read_lock();
+	mxb = rcu_dereference(transport->net_conf)->max_buffers;
+	rcu_read_unlock();
+
+	return mxb;
+}
+
 struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int number,
 			      gfp_t gfp_mask)
 {
@@ -393,11 +535,7 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 		container_of(transport, struct drbd_connection, transport);
 	struct page *page = NULL;
 	DEFINE_WAIT(wait);
-	unsigned int mxb;
-
-	rcu_read_lock();
-	mxb = rcu_dereference(transport->net_conf)->max_buffers;
-	rcu_read_unlock();
+	unsigned int mxb = max_buffers(transport);
 
 	if (atomic_read(&connection->pp_in_use) < mxb)
 		page = __drbd_alloc_pages(number, gfp_mask & ~__GFP_RECLAIM);
@@ -426,8 +564,11 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 			break;
 		}
 
+		/* woken up: pages came back, or max-buffers was changed */
 		if (schedule_timeout(HZ/10) == 0)
 			mxb = UINT_MAX;
+		else
+			mxb = max_buffers(transport);
 	}
 	finish_wait(&drbd_pp_wait, &wait);
 
@@ -437,28 +578,39 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 }
 
 /* Must not be used from irq, as that may deadlock: see drbd_alloc_pages.
- * Either links the page chain back to the global pool,
+ * Either keeps the page chain on this CPU, links it back to the global pool,
  * or returns all pages to the system. */
+/* Give the n pages of a chain from page to tail back to the page pool of this
+ * CPU, to the global one, or to the system, in that order of preference */
+static void drbd_pp_put(struct page *page, struct page *tail, int n)
+{
+	if (drbd_pp_cpu_put(page, tail, n))
+		return;
+
+	if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count) {
+		page_chain_free(page);
+		return;
+	}
+
+	spin_lock(&drbd_pp_lock);
+	page_chain_add(&drbd_pp_pool, page, tail);
+	drbd_pp_vacant += n;
+	spin_unlock(&drbd_pp_lock);
+}
+
 void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is_net)
 {
 	struct drbd_connection *connection =
 		container_of(transport, struct drbd_connection, transport);
 	atomic_t *a = is_net ? &connection->pp_in_use_by_net : &connection->pp_in_use;
+	struct page *tmp;
 	int i;
 
 	if (page == NULL)
 		return;
 
-	if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count)
-		i = page_chain_free(page);
-	else {
-		struct page *tmp;
-		tmp = page_chain_tail(page, &i);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
-	}
+	tmp = page_chain_tail(page, &i);
+	drbd_pp_put(page, tmp, i);
 	i = atomic_sub_return(i, a);
 	if (i < 0)
 		drbd_warn(connection, "ASSERTION FAILED: %s: %d < 0\n",
@@ -466,6 +618,17 @@ void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is
 	wake_up(&drbd_pp_wait);
 }
 
+static void init_peer_req(struct drbd_peer_request *peer_req, struct drbd_peer_device *peer_device)
+{
+	memset(peer_req, 0, sizeof(*peer_req));
+	INIT_LIST_HEAD(&peer_req->w.list);
+	drbd_clear_interval(&peer_req->i);
+	INIT_LIST_HEAD(&peer_req->recv_order);
+	INIT_LIST_HEAD(&peer_req->wait_for_actlog);
+	peer_req->submit_jif = jiffies;
+	peer_req->peer_device = peer_device;
+}
+
 /* normal: payload_size == request size (bi_size)
  * w_same: payload_size == logical_block_size
  * trim: payload_size == 0 */
@@ -478,35 +641,206 @@ drbd_alloc_peer_req(struct drbd_peer_device *peer_device, gfp_t gfp_mask) __must
 	if (drbd_insert_fault(device, DRBD_FAULT_AL_EE))
 		return NULL;
 
-	peer_req = mempool_alloc(&drbd_ee_mempool, gfp_mask & ~__GFP_HIGHMEM);
+	peer_req = drbd_mempool_cache_alloc(&drbd_ee_mag, gfp_mask & ~__GFP_HIGHMEM);
 	if (!peer_req) {
 		if (!(gfp_mask & __GFP_NOWARN))
 			drbd_err(device, "%s: allocation failed\n", __func__);
 		return NULL;
 	}
 
-	memset(peer_req, 0, sizeof(*peer_req));
-	INIT_LIST_HEAD(&peer_req->w.list);
-	drbd_clear_interval(&peer_req->i);
-	INIT_LIST_HEAD(&peer_req->recv_order);
-	INIT_LIST_HEAD(&peer_req->wait_for_actlog);
-	peer_req->submit_jif = jiffies;
-	peer_req->peer_device = peer_device;
+	init_peer_req(peer_req, peer_device);
 
 	return peer_req;
 }
 
-void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
+/* Moves the pages of @chain to the front of *@pages, to be given back to the
+ * pool together with the pages of other peer requests, see
+ * drbd_finish_peer_reqs() */
+static void page_chain_collect(struct page **pages, struct drbd_page_chain_head *chain)
+{
+	if (chain->head) {
+		set_page_chain_next(page_chain_tail(chain->head, NULL), *pages);
+		*pages = chain->head;
+	}
+	chain->head = NULL;
+	chain->nr_pages = 0;
+}
+
+/**
+ * drbd_rs_alloc_peer_req() - Peer request for resync, reusing one from the pool
+ * @peer_device:	DRBD peer device.
+ * @size:		Payload to allocate pages for, 0 if the transport brings them.
+ * @gfp_mask:		As for drbd_alloc_peer_req().
+ *
+ * Resync moves lots of requests that mostly have the same size. Take the
+ * most recently freed one of this peer device, and its pages if there are
+ * just as many as needed, instead of going through the mempools and the
+ * page pool for each of them. The pool keeps as many as were out at once
+ * since it was last drained, which follows what the resync controller has
+ * in flight; memory that max-buffers let us have before, so taking it from
+ * here does not need to ask again.
+ */
+struct drbd_peer_request *
+drbd_rs_alloc_peer_req(struct drbd_peer_device *peer_device, unsigned int size, gfp_t gfp_mask) __must_hold(local)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_rs_pool *pool = &peer_device->rs_pool;
+	unsigned int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	struct drbd_peer_request *peer_req = NULL;
+	struct drbd_page_chain_head chain = {};
+
+	if (!READ_ONCE(drbd_resync_pool)) {
+		peer_req = drbd_alloc_peer_req(peer_device, gfp_mask);
+		goto pages;
+	}
+
+	spin_lock(&pool->lock);
+	peer_req = list_first_entry_or_null(&pool->free, struct drbd_peer_request, w.list);
+	if (peer_req) {
+		list_del(&peer_req->w.list);
+		pool->nr--;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	pool->out++;
+	pool->peak = max(pool->peak, pool->out);
+	spin_unlock(&pool->lock);
+
+	if (peer_req) {
+		chain = peer_req->page_chain;
+		if (chain.head && chain.nr_pages != nr_pages) {
+			page_chain_free(chain.head);
+			chain.head = NULL;
+			chain.nr_pages = 0;
+		}
+		if (chain.head)
+			atomic_add(nr_pages, &connection->pp_in_use);
+		init_peer_req(peer_req, peer_device);
+		peer_req->page_chain = chain;
+	} else {
+		peer_req = drbd_alloc_peer_req(peer_device, gfp_mask);
+	}
+	if (peer_req) {
+		peer_req->flags |= EE_RS_POOL;
+	} else {
+		spin_lock(&pool->lock);
+		pool->out--;
+		spin_unlock(&pool->lock);
+	}
+
+pages:
+	if (peer_req && nr_pages && !peer_req->page_chain.head) {
+		drbd_alloc_page_chain(&connection->transport, &peer_req->page_chain, nr_pages, gfp_mask);
+		if (!peer_req->page_chain.head) {
+			drbd_free_peer_req(peer_req);
+			return NULL;
+		}
+	}
+	return peer_req;
+}
+
+/* Called by free_peer_req() once @peer_req let go of everything but its
+ * pages. A resync write's pages came from the transport for one packet; they
+ * go back to the page pool, or onto @pages. Returns false if the caller has
+ * to free it. */
+static bool rs_pool_put(struct drbd_peer_request *peer_req, int is_net, struct page **pages)
+{
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_rs_pool *pool = &peer_device->rs_pool;
+	unsigned int keep = min(READ_ONCE(drbd_resync_pool), pool->peak);
+	bool kept = false;
+
+	if (is_net && drbd_peer_req_has_active_page(peer_req))
+		keep = 0;
+
+	spin_lock(&pool->lock);
+	pool->out--;
+	if (pool->nr < keep) {
+		if (peer_req->flags & EE_WRITE && pages)
+			page_chain_collect(pages, &peer_req->page_chain);
+		else if (peer_req->flags & EE_WRITE)
+			drbd_free_page_chain(&connection->transport, &peer_req->page_chain, is_net);
+		else if (peer_req->page_chain.head)
+			atomic_sub(peer_req->page_chain.nr_pages,
+				   is_net ? &connection->pp_in_use_by_net : &connection->pp_in_use);
+		list_add(&peer_req->w.list, &pool->free);
+		pool->nr++;
+		kept = true;
+	}
+	spin_unlock(&pool->lock);
+
+	return kept;
+}
+
+/* Frees what the pool holds. Resync ended, or the peer device goes away. */
+void drbd_rs_pool_drain(struct drbd_peer_device *peer_device)
+{
+	struct drbd_rs_pool *pool = &peer_device->rs_pool;
+	struct drbd_peer_request *peer_req, *t;
+	LIST_HEAD(list);
+
+	spin_lock(&pool->lock);
+	list_splice_init(&pool->free, &list);
+	pool->nr = 0;
+	pool->peak = 0;
+	spin_unlock(&pool->lock);
+
+	list_for_each_entry_safe(peer_req, t, &list, w.list) {
+		page_chain_free(peer_req->page_chain.head);
+		drbd_mempool_cache_free(&drbd_ee_mag, peer_req);
+	}
+}
+
+static void drbd_free_integrity_tfm(struct kref *kref)
+{
+	struct drbd_integrity_tfm *integrity =
+		container_of(kref, struct drbd_integrity_tfm, kref);
+
+	crypto_free_shash(integrity->tfm);
+	kfree(integrity);
+}
+
+void drbd_put_integrity_tfm(struct drbd_integrity_tfm *integrity)
+{
+	if (integrity)
+		kref_put(&integrity->kref, drbd_free_integrity_tfm);
+}
+
+static void drbd_free_csum_job(struct drbd_csum_job *job)
+{
+	if (!job)
+		return;
+	drbd_put_integrity_tfm(job->integrity);
+	kfree(job);
+}
+
+/* With @pages, the page chain is collected there instead of freed */
+static void free_peer_req(struct drbd_peer_request *peer_req, int is_net, struct page **pages)
 {
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
 
 	might_sleep();
 	if (peer_req->flags & EE_HAS_DIGEST)
 		kfree(peer_req->digest);
+	drbd_free_csum_job(peer_req->csum_job);
 	D_ASSERT(peer_device, atomic_read(&peer_req->pending_bios) == 0);
+	/* resync reads are only done with their range once the reply is out */
+	drbd_rs_unlock_interval(peer_req);
 	D_ASSERT(peer_device, drbd_interval_empty(&peer_req->i));
-	drbd_free_page_chain(&peer_device->connection->transport, &peer_req->page_chain, is_net);
-	mempool_free(peer_req, &drbd_ee_mempool);
+	if ((peer_req->flags & EE_RS_POOL) && rs_pool_put(peer_req, is_net, pages))
+		return;
+	if (pages)
+		page_chain_collect(pages, &peer_req->page_chain);
+	else
+		drbd_free_page_chain(&peer_device->connection->transport, &peer_req->page_chain, is_net);
+	drbd_mempool_cache_free(&drbd_ee_mag, peer_req);
+}
+
+void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
+{
+	free_peer_req(peer_req, is_net, NULL);
 }
 
 int drbd_free_peer_reqs(struct drbd_connection *connection, struct list_head *list, bool is_net_ee)
@@ -534,16 +868,23 @@ static int drbd_finish_peer_reqs(struct drbd_connection *connection)
 	LIST_HEAD(work_list);
 	LIST_HEAD(reclaimed);
 	struct drbd_peer_request *peer_req, *t;
+	struct drbd_peer_device *peer_device;
+	struct page *net_pages = NULL, *pages = NULL;
 	int err = 0;
 	int n = 0;
+	int vnr;
 
 	spin_lock_irq(&connection->peer_reqs_lock);
 	reclaim_finished_net_peer_reqs(connection, &reclaimed);
 	list_splice_init(&connection->done_ee, &work_list);
 	spin_unlock_irq(&connection->peer_reqs_lock);
 
+	/* The pages of the whole batch go back to the pool at the end, with
+	 * one drbd_free_pages() each for pp_in_use_by_net and pp_in_use,
+	 * instead of a pool update and wake_up() per peer request. */
 	list_for_each_entry_safe(peer_req, t, &reclaimed, w.list)
-		drbd_free_net_peer_req(peer_req);
+		free_peer_req(peer_req, 1, &net_pages);
+	drbd_free_pages(&connection->transport, net_pages, 1);
 
 	/* possible callbacks here:
 	 * e_end_block, and e_end_resync_block, e_send_discard_write.
@@ -558,10 +899,18 @@ static int drbd_finish_peer_reqs(struct drbd_connection *connection)
 		if (!err)
 			err = err2;
 		if (!list_empty(&peer_req->recv_order)) {
-			drbd_free_page_chain(&connection->transport, &peer_req->page_chain, 0);
+			page_chain_collect(&pages, &peer_req->page_chain);
 		} else
-			drbd_free_peer_req(peer_req);
+			free_peer_req(peer_req, 0, &pages);
 	}
+	drbd_free_pages(&connection->transport, pages, 0);
+
+	/* the bitmap updates batched by e_end_resync_block() and e_end_block() */
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, peer_device, vnr)
+		drbd_flush_in_sync_batch(peer_device);
+	rcu_read_unlock();
+
 	if (atomic_sub_and_test(n, &connection->done_ee_cnt))
 		wake_up(&connection->ee_wait);
 
@@ -651,6 +1000,8 @@ int drbd_connected(struct drbd_peer_device *peer_device)
 
 	atomic_set(&peer_device->packet_seq, 0);
 	peer_device->peer_seq = 0;
+	peer_device->peer_data_seq = 0;
+	peer_device->peer_data_run = 0;
 
 	if (device->resource->role[NOW] == R_PRIMARY)
 		weak_nodes = drbd_weak_nodes_device(device);
@@ -838,6 +1189,10 @@ start:
 		}
 	}
 
+	drbd_compress_setup(connection);
+	drbd_rs_dedupe_setup(connection);
+	drbd_sbuf_setup(connection);
+
 	transport->ops->set_rcvtimeo(transport, DATA_STREAM, MAX_SCHEDULE_TIMEOUT);
 
 	discard_my_data = test_bit(CONN_DISCARD_MY_DATA, &connection->flags);
@@ -861,7 +1216,10 @@ start:
 	have_mutex = false;
 
 	drbd_thread_start(&connection->ack_receiver);
-	connection->ack_sender =
+	/* send_acks_work and peer_ack_work both take the control stream mutex,
+	 * and a work item never runs concurrently with itself on one workqueue:
+	 * they do not need an ordered workqueue of their own */
+	connection->ack_sender = drbd_ack_sender_wq ?:
 		alloc_ordered_workqueue("drbd_as_%s", WQ_MEM_RECLAIM, connection->resource->name);
 	if (!connection->ack_sender) {
 		drbd_err(connection, "Failed to create workqueue ack_sender\n");
@@ -953,6 +1311,7 @@ static int drbd_recv_header(struct drbd_connection *connection, struct packet_in
 
 	err = decode_header(connection, buffer, pi);
 	connection->last_received = jiffies;
+	connection->packets_received[DATA_STREAM]++;
 
 	return err;
 }
@@ -994,6 +1353,7 @@ static int drbd_recv_header_maybe_unplug(struct drbd_connection *connection, str
 
 	err = decode_header(connection, buffer, pi);
 	connection->last_received = jiffies;
+	connection->packets_received[DATA_STREAM]++;
 
 	return err;
 }
@@ -1006,6 +1366,9 @@ struct issue_flush_context {
 	atomic_t pending;
 	int error;
 	struct completion done;
+	/* if set, queued instead of completing done */
+	struct drbd_work *done_work;
+	struct drbd_work_queue *done_q;
 };
 struct one_flush_context {
 	struct drbd_device *device;
@@ -1032,8 +1395,12 @@ static void one_flush_endio(struct bio *bio)
 	kref_debug_put(&device->kref_debug, 7);
 	kref_put(&device->kref, drbd_destroy_device);
 
-	if (atomic_dec_and_test(&ctx->pending))
-		complete(&ctx->done);
+	if (atomic_dec_and_test(&ctx->pending)) {
+		if (ctx->done_work)
+			drbd_queue_work(ctx->done_q, ctx->done_work);
+		else
+			complete(&ctx->done);
+	}
 }
 
 static void submit_one_flush(struct drbd_device *device, struct issue_flush_context *ctx)
@@ -1069,32 +1436,39 @@ static void submit_one_flush(struct drbd_device *device, struct issue_flush_cont
 	submit_bio(bio);
 }
 
+static void submit_flushes(struct drbd_resource *resource, struct issue_flush_context *ctx)
+{
+	struct drbd_device *device;
+	int vnr;
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (!get_ldev(device))
+			continue;
+		kref_get(&device->kref);
+		kref_debug_get(&device->kref_debug, 7);
+		rcu_read_unlock();
+
+		submit_one_flush(device, ctx);
+
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+}
+
 static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connection, struct drbd_epoch *epoch)
 {
 	struct drbd_resource *resource = connection->resource;
 
 	if (resource->write_ordering >= WO_BDEV_FLUSH) {
-		struct drbd_device *device;
 		struct issue_flush_context ctx;
-		int vnr;
 
 		atomic_set(&ctx.pending, 1);
 		ctx.error = 0;
 		init_completion(&ctx.done);
+		ctx.done_work = NULL;
 
-		rcu_read_lock();
-		idr_for_each_entry(&resource->devices, device, vnr) {
-			if (!get_ldev(device))
-				continue;
-			kref_get(&device->kref);
-			kref_debug_get(&device->kref_debug, 7);
-			rcu_read_unlock();
-
-			submit_one_flush(device, &ctx);
-
-			rcu_read_lock();
-		}
-		rcu_read_unlock();
+		submit_flushes(resource, &ctx);
 
 		/* Do we want to add a timeout,
 		 * if disk-timeout is set? */
@@ -1117,6 +1491,112 @@ static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connecti
 	return drbd_may_finish_epoch(connection, epoch, EV_BARRIER_DONE);
 }
 
+struct epoch_flush {
+	struct drbd_work w;
+	struct issue_flush_context ctx;
+	struct drbd_connection *connection;
+	struct list_head epochs;	/* linked by ->flush_list, oldest first */
+};
+
+static void submit_epoch_flush(struct epoch_flush *ef)
+{
+	atomic_set(&ef->ctx.pending, 1);
+	ef->ctx.error = 0;
+	submit_flushes(ef->connection->resource, &ef->ctx);
+	if (atomic_dec_and_test(&ef->ctx.pending))
+		drbd_queue_work(ef->ctx.done_q, &ef->w);
+}
+
+static int w_epoch_flush_done(struct drbd_work *w, int cancel)
+{
+	struct epoch_flush *ef = container_of(w, struct epoch_flush, w);
+	struct drbd_connection *connection = ef->connection;
+	struct drbd_epoch *epoch, *tmp;
+	int error = ef->ctx.error;
+
+	if (error)
+		drbd_bump_write_ordering(connection->resource, NULL, WO_DRAIN_IO);
+
+	/* The active reference keeps the younger ones from finishing before
+	 * we get to them here. */
+	list_for_each_entry_safe(epoch, tmp, &ef->epochs, flush_list) {
+		list_del_init(&epoch->flush_list);
+		drbd_may_finish_epoch(connection, epoch, EV_BARRIER_DONE);
+		drbd_may_finish_epoch(connection, epoch, EV_PUT |
+				      (connection->cstate[NOW] < C_CONNECTED ? EV_CLEANUP : 0));
+	}
+
+	spin_lock(&connection->epoch_lock);
+	list_splice_init(&connection->flush_coalesced, &ef->epochs);
+	if (!list_empty(&ef->epochs)) {
+		spin_unlock(&connection->epoch_lock);
+		/* still counted in epoch_flushes */
+		submit_epoch_flush(ef);
+		return 0;
+	}
+	atomic_dec(&connection->epoch_flushes);
+	spin_unlock(&connection->epoch_lock);
+
+	kfree(ef);
+	wake_up(&connection->ee_wait);
+	return 0;
+}
+
+/*
+ * drbd_flush_epoch_async()  -  flush after an epoch without waiting for it
+ *
+ * All writes of @epoch have completed.  Issue the flushes and let the receiver
+ * go on with the next epoch; the next epoch's writes are thus still submitted
+ * only after this one's completed, as with WO_DRAIN_IO.  The barrier ack is
+ * sent once the flushes are done, and, by drbd_may_finish_epoch(), only after
+ * those of all older epochs.  An active reference keeps the epoch around until
+ * then, connection->epoch_flushes the connection.
+ *
+ * With flush_coalesce, an epoch that drains while flush_pipeline flushes are
+ * in flight joins connection->flush_coalesced instead of waiting.  The next
+ * of those flushes to complete issues one more for all of them: its writes
+ * completed before that flush was issued, so it covers them all.  Under
+ * fsync heavy load, with many small epochs, that is one flush per round trip
+ * to the backing devices, instead of one per epoch.
+ */
+static bool drbd_flush_epoch_async(struct drbd_connection *connection, struct drbd_epoch *epoch)
+{
+	unsigned int depth = READ_ONCE(drbd_flush_pipeline);
+	struct epoch_flush *ef;
+
+	if (depth <= 1 || connection->resource->write_ordering < WO_BDEV_FLUSH)
+		return false;
+
+	if (READ_ONCE(drbd_flush_coalesce)) {
+		spin_lock(&connection->epoch_lock);
+		if (atomic_read(&connection->epoch_flushes) >= depth) {
+			atomic_inc(&epoch->active);
+			list_add_tail(&epoch->flush_list, &connection->flush_coalesced);
+			spin_unlock(&connection->epoch_lock);
+			return true;
+		}
+		spin_unlock(&connection->epoch_lock);
+	}
+
+	ef = kmalloc(sizeof(*ef), GFP_NOIO);
+	if (!ef)
+		return false;
+
+	wait_event(connection->ee_wait, atomic_read(&connection->epoch_flushes) < depth);
+
+	ef->w.cb = w_epoch_flush_done;
+	ef->connection = connection;
+	INIT_LIST_HEAD(&ef->epochs);
+	list_add(&epoch->flush_list, &ef->epochs);
+	ef->ctx.done_work = &ef->w;
+	ef->ctx.done_q = &connection->resource->work;
+
+	atomic_inc(&epoch->active);
+	atomic_inc(&connection->epoch_flushes);
+	submit_epoch_flush(ef);
+	return true;
+}
+
 static int w_flush(struct drbd_work *w, int cancel)
 {
 	struct flush_work *fw = container_of(w, struct flush_work, w);
@@ -1393,13 +1873,27 @@ void drbd_bump_write_ordering(struct drbd_resource *resource, struct drbd_backin
  * At least for LVM/DM thin, with skip_block_zeroing=false,
  * the result is effectively "discard_zeroes_data=1".
  */
+static int submit_discard_chain(struct bio **chain)
+{
+	int err = 0;
+
+	if (*chain) {
+		err = submit_bio_wait(*chain);
+		bio_put(*chain);
+		*chain = NULL;
+	}
+	return err;
+}
+
 /* flags: EE_TRIM|EE_ZEROOUT */
 int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, unsigned int nr_sectors, int flags)
 {
 	struct block_device *bdev = device->ldev->backing_bdev;
 	struct request_queue *q = bdev_get_queue(bdev);
+	unsigned int inflight = clamp(READ_ONCE(drbd_discard_inflight), 1U, 64U);
+	unsigned int max_discard_sectors, granularity, chunks = 0;
+	struct bio *chain = NULL;
 	sector_t tmp, nr;
-	unsigned int max_discard_sectors, granularity;
 	int alignment;
 	int err = 0;
 
@@ -1433,10 +1927,14 @@ int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, u
 		nr_sectors -= nr;
 		start = tmp;
 	}
+	/* Chain the discards of up to @inflight chunks, and wait for them
+	 * together, instead of for each one in turn. */
 	while (nr_sectors >= max_discard_sectors) {
-		err |= blkdev_issue_discard(bdev, start, max_discard_sectors, GFP_NOIO, 0);
+		err |= __blkdev_issue_discard(bdev, start, max_discard_sectors, GFP_NOIO, 0, &chain);
 		nr_sectors -= max_discard_sectors;
 		start += max_discard_sectors;
+		if (++chunks % inflight == 0)
+			err |= submit_discard_chain(&chain);
 	}
 	if (nr_sectors) {
 		/* max_discard_sectors is unsigned int (and a multiple of
@@ -1446,11 +1944,12 @@ int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, u
 		nr = nr_sectors;
 		nr -= (unsigned int)nr % granularity;
 		if (nr) {
-			err |= blkdev_issue_discard(bdev, start, nr, GFP_NOIO, 0);
+			err |= __blkdev_issue_discard(bdev, start, nr, GFP_NOIO, 0, &chain);
 			nr_sectors -= nr;
 			start += nr;
 		}
 	}
+	err |= submit_discard_chain(&chain);
  zero_out:
 	if (nr_sectors) {
 		err |= blkdev_issue_zeroout(bdev, start, nr_sectors, GFP_NOIO,
@@ -1534,8 +2033,81 @@ static int peer_request_fault_type(struct drbd_peer_request *peer_req)
 	}
 }
 
+/* Remember the digest a peer write came with, it gets verified by
+ * drbd_verify_peer_write_digest() before it is submitted.  The job keeps the
+ * peer's integrity tfm alive until then. */
+static bool drbd_defer_digest_check(struct drbd_peer_request *peer_req,
+				    struct drbd_integrity_tfm *integrity,
+				    void *digest, unsigned int digest_size)
+{
+	struct drbd_csum_job *job;
+
+	if (digest_size > sizeof(job->digest))
+		return false;
+	job = kmalloc(sizeof(*job), GFP_NOIO);
+	if (!job)
+		return false;
+	kref_get(&integrity->kref);
+	job->peer_req = peer_req;
+	job->tfm = integrity->tfm;
+	job->integrity = integrity;
+	memcpy(job->digest, digest, digest_size);
+	peer_req->csum_job = job;
+	return true;
+}
+
+/* Returns -EINVAL if the data of a peer write does not match its digest */
+static int drbd_verify_peer_write_digest(struct drbd_peer_request *peer_req)
+{
+	struct drbd_csum_job *job = peer_req->csum_job;
+	u8 digest[DRBD_CSUM_JOB_DIGEST_MAX];
+
+	if (!job || !(peer_req->flags & EE_WRITE))
+		return 0;
+	if (!job->tfm) /* failed already */
+		return -EINVAL;
+
+	drbd_csum_pages(job->tfm, peer_req->page_chain.head, digest);
+	if (memcmp(digest, job->digest, crypto_shash_digestsize(job->tfm))) {
+		drbd_err(peer_req->peer_device, "Digest integrity check FAILED: %llus +%u\n",
+			 (unsigned long long)peer_req->i.sector, peer_req->i.size);
+		job->tfm = NULL;
+		return -EINVAL;
+	}
+
+	peer_req->csum_job = NULL;
+	drbd_free_csum_job(job);
+	return 0;
+}
+
+/* Does everything a peer request needs before it is submitted, except for
+ * building its bio, for __drbd_submit_peer_request() and for the merged
+ * submits of drbd_submit_peer_requests() alike.  Returns -EINVAL, having
+ * done nothing, if the data of a peer write does not match its digest. */
+static int drbd_peer_req_prepare_submit(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+	int err;
+
+	err = drbd_verify_peer_write_digest(peer_req);
+	if (err)
+		return err;
+
+	trace_drbd_submit_peer_request(peer_req);
+
+	if (peer_req->flags & EE_SET_OUT_OF_SYNC)
+		drbd_set_out_of_sync(peer_req->peer_device,
+				peer_req->i.sector, peer_req->i.size);
+
+	if (peer_req_op(peer_req) != REQ_OP_READ) {
+		drbd_unallocated_clear(device, peer_req->i.sector, peer_req->i.size);
+		drbd_rs_cache_invalidate(device, peer_req->i.sector, peer_req->i.size);
+	}
+	return 0;
+}
+
 /**
- * drbd_submit_peer_request()
+ * __drbd_submit_peer_request()
  * @peer_req:	peer request
  *
  * May spread the pages to multiple bios,
@@ -1550,9 +2122,10 @@ static int peer_request_fault_type(struct drbd_peer_request *peer_req)
  *
  *  When this function returns 0, it "consumes" an ldev reference; the
  *  reference is released when the request completes.
+ *  drbd_peer_req_prepare_submit() must have been called before.
  */
 /* TODO allocate from our own bio_set. */
-int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
+static int __drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 {
 	struct drbd_device *device = peer_req->peer_device->device;
 	struct bio *bios = NULL;
@@ -1564,10 +2137,6 @@ int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 	unsigned nr_pages = peer_req->page_chain.nr_pages;
 	int err = -ENOMEM;
 
-	if (peer_req->flags & EE_SET_OUT_OF_SYNC)
-		drbd_set_out_of_sync(peer_req->peer_device,
-				peer_req->i.sector, peer_req->i.size);
-
 	/* TRIM/DISCARD: for now, always use the helper function
 	 * blkdev_issue_zeroout(..., discard=true).
 	 * It's synchronous, but it does the right thing wrt. bio splitting.
@@ -1606,7 +2175,8 @@ next_bio:
 		goto fail;
 	}
 
-	bio = bio_alloc(GFP_NOIO, nr_pages);
+	/* more than BIO_MAX_PAGES with repl_max_kb */
+	bio = bio_alloc(GFP_NOIO, min_t(unsigned int, nr_pages, BIO_MAX_PAGES));
 	if (!bio) {
 		drbd_err(device, "submit_ee: Allocation of a bio failed (nr_pages=%u)\n", nr_pages);
 		goto fail;
@@ -1617,6 +2187,7 @@ next_bio:
 	/* we special case some flags in the multi-bio case, see below
 	 * (REQ_PREFLUSH, or BIO_RW_BARRIER in older kernels) */
 	bio->bi_opf = peer_req->opf;
+	bio->bi_ioprio = peer_req->ioprio;
 	bio->bi_private = peer_req;
 	bio->bi_end_io = drbd_peer_request_endio;
 
@@ -1691,12 +2262,198 @@ fail:
 	return err;
 }
 
+/* drbd_peer_req_prepare_submit() and __drbd_submit_peer_request() in one.
+ * Returns -EINVAL, having submitted nothing, if the digest check fails. */
+int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
+{
+	int err;
+
+	err = drbd_peer_req_prepare_submit(peer_req);
+	if (err)
+		return err;
+	return __drbd_submit_peer_request(peer_req);
+}
+
+static bool peer_writes_mergeable(struct drbd_peer_request *prev,
+				   struct drbd_peer_request *next)
+{
+	const unsigned long no_merge = EE_TRIM | EE_WRITE_SAME | EE_ZEROOUT;
+
+	return peer_req_op(prev) == REQ_OP_WRITE && prev->opf == next->opf &&
+		prev->ioprio == next->ioprio &&
+		!(prev->opf & (REQ_PREFLUSH | REQ_FUA)) &&
+		!((prev->flags | next->flags) & no_merge) &&
+		prev->peer_device->device == next->peer_device->device &&
+		prev->i.sector + (prev->i.size >> 9) == next->i.sector;
+}
+
+/* Submit the peer writes from @head along ->merged_next as one bio.  Returns
+ * false, having submitted nothing, if that bio cannot be built. */
+static bool submit_merged_peer_writes(struct drbd_peer_request *head, unsigned int nr_pages)
+{
+	struct drbd_device *device = head->peer_device->device;
+	struct drbd_peer_request *peer_req;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, nr_pages);
+	if (!bio)
+		return false;
+	bio->bi_iter.bi_sector = head->i.sector;
+	bio_set_dev(bio, device->ldev->backing_bdev);
+	bio->bi_opf = head->opf;
+	bio->bi_ioprio = head->ioprio;
+	bio->bi_private = head;
+	bio->bi_end_io = drbd_peer_request_merged_endio;
+
+	for (peer_req = head; peer_req; peer_req = peer_req->merged_next) {
+		struct page *page = peer_req->page_chain.head;
+		unsigned data_size = peer_req->i.size;
+
+		page_chain_for_each(page) {
+			unsigned off = page_chain_offset(page);
+			unsigned len = page_chain_size(page);
+
+			if (off > PAGE_SIZE || len > PAGE_SIZE - off || len > data_size || len == 0 ||
+			    bio_add_page(bio, page, len, off) != len)
+				goto fail;
+			data_size -= len;
+		}
+		if (data_size)
+			goto fail;
+	}
+
+	/* Once submitted, completion may free the peer requests */
+	for (peer_req = head; peer_req; peer_req = peer_req->merged_next) {
+		atomic_set(&peer_req->pending_bios, 1);
+		peer_req->submit_jif = jiffies;
+		peer_req->flags |= EE_SUBMITTED;
+	}
+	drbd_generic_make_request(device, peer_request_fault_type(head), bio);
+	return true;
+
+fail:
+	bio_put(bio);
+	return false;
+}
+
+static bool peer_discards_mergeable(struct drbd_peer_request *prev,
+				    struct drbd_peer_request *next)
+{
+	const unsigned long kind = EE_TRIM | EE_ZEROOUT;
+
+	return (prev->flags & kind) && (prev->flags & kind) == (next->flags & kind) &&
+		!((prev->flags | next->flags) & EE_WRITE_SAME) &&
+		prev->peer_device->device == next->peer_device->device &&
+		prev->i.sector + (prev->i.size >> 9) == next->i.sector;
+}
+
+/* Discard, or zero out, the range of the peer requests from @head along
+ * ->merged_next at once, then complete them one by one. */
+static void submit_merged_peer_discards(struct drbd_peer_request *head, unsigned int nr_sectors)
+{
+	struct drbd_device *device = head->peer_device->device;
+	struct drbd_peer_request *peer_req, *next;
+	bool zero_out = !can_do_reliable_discards(device);
+	int err;
+
+	for (peer_req = head; peer_req; peer_req = peer_req->merged_next) {
+		if (zero_out)
+			peer_req->flags |= EE_ZEROOUT;
+		peer_req->submit_jif = jiffies;
+		peer_req->flags |= EE_SUBMITTED;
+	}
+
+	err = drbd_issue_discard_or_zero_out(device, head->i.sector, nr_sectors,
+					     head->flags & (EE_ZEROOUT|EE_TRIM));
+
+	for (peer_req = head; peer_req; peer_req = next) {
+		next = peer_req->merged_next;
+		peer_req->merged_next = NULL;
+		if (err)
+			peer_req->flags |= EE_WAS_ERROR;
+		drbd_endio_write_sec_final(peer_req);
+	}
+}
+
+/**
+ * drbd_submit_peer_requests()  -  submit a list of peer requests
+ * @peer_reqs:	peer requests, linked by ->wait_for_actlog; emptied
+ *
+ * Runs of peer writes that continue each other on disk go to the backing
+ * device as one bio, runs of discards as one range.  They are still
+ * completed, and acked, one by one.  Everything else goes through
+ * __drbd_submit_peer_request().  Each peer request goes through
+ * drbd_peer_req_prepare_submit() once, before it is merged.
+ * A peer request that fails that, or its submit, is cleaned up with
+ * drbd_cleanup_after_failed_submit_peer_request().
+ */
+void drbd_submit_peer_requests(struct list_head *peer_reqs)
+{
+	bool merge = READ_ONCE(drbd_peer_write_merge);
+
+	while (!list_empty(peer_reqs)) {
+		struct drbd_peer_request *head, *last, *next, *peer_req;
+		unsigned int nr_pages;
+
+		head = list_first_entry(peer_reqs, struct drbd_peer_request, wait_for_actlog);
+		list_del_init(&head->wait_for_actlog);
+		if (drbd_peer_req_prepare_submit(head)) {
+			drbd_cleanup_after_failed_submit_peer_request(head);
+			continue;
+		}
+		if (merge && peer_discards_mergeable(head, head)) {
+			unsigned int nr_sectors = head->i.size >> 9;
+
+			for (last = head; !list_empty(peer_reqs); last = next) {
+				next = list_first_entry(peer_reqs, struct drbd_peer_request, wait_for_actlog);
+				if (!peer_discards_mergeable(last, next) ||
+				    nr_sectors > UINT_MAX - (next->i.size >> 9))
+					break;
+				list_del_init(&next->wait_for_actlog);
+				if (drbd_peer_req_prepare_submit(next)) {
+					drbd_cleanup_after_failed_submit_peer_request(next);
+					break;
+				}
+				nr_sectors += next->i.size >> 9;
+				last->merged_next = next;
+			}
+			submit_merged_peer_discards(head, nr_sectors);
+			continue;
+		}
+
+		nr_pages = head->page_chain.nr_pages;
+		for (last = head; merge && !list_empty(peer_reqs); last = next) {
+			next = list_first_entry(peer_reqs, struct drbd_peer_request, wait_for_actlog);
+			if (!peer_writes_mergeable(last, next) ||
+			    nr_pages + next->page_chain.nr_pages > BIO_MAX_PAGES)
+				break;
+			list_del_init(&next->wait_for_actlog);
+			if (drbd_peer_req_prepare_submit(next)) {
+				drbd_cleanup_after_failed_submit_peer_request(next);
+				break;
+			}
+			nr_pages += next->page_chain.nr_pages;
+			last->merged_next = next;
+		}
+
+		if (head != last && submit_merged_peer_writes(head, nr_pages))
+			continue;
+
+		for (peer_req = head; peer_req; peer_req = next) {
+			next = peer_req->merged_next;
+			peer_req->merged_next = NULL;
+			if (__drbd_submit_peer_request(peer_req))
+				drbd_cleanup_after_failed_submit_peer_request(peer_req);
+		}
+	}
+}
+
 static void drbd_remove_peer_req_interval(struct drbd_device *device,
 					  struct drbd_peer_request *peer_req)
 {
 	struct drbd_interval *i = &peer_req->i;
 
-	drbd_remove_interval(&device->write_requests, i);
+	drbd_remove_write_interval(device, i);
 	drbd_clear_interval(i);
 	peer_req->flags &= ~EE_IN_INTERVAL_TREE;
 
@@ -1705,6 +2462,19 @@ static void drbd_remove_peer_req_interval(struct drbd_device *device,
 		wake_up(&device->misc_wait);
 }
 
+/* Counterpart of drbd_rs_lock_interval() and drbd_rs_try_lock_interval() */
+static void drbd_rs_unlock_interval(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+
+	if (!(peer_req->flags & EE_RS_INTERVAL))
+		return;
+	drbd_write_lock_irq(device, peer_req->i.sector, peer_req->i.size);
+	drbd_remove_peer_req_interval(device, peer_req);
+	drbd_write_unlock_irq(device, peer_req->i.sector, peer_req->i.size);
+	peer_req->flags &= ~EE_RS_INTERVAL;
+}
+
 /**
  * w_e_reissue() - Worker callback; Resubmit a bio
  * @device:	DRBD device.
@@ -1756,9 +2526,9 @@ int w_e_reissue(struct drbd_work *w, int cancel) __releases(local)
 		spin_lock_irq(&connection->peer_reqs_lock);
 		list_del(&peer_req->w.list);
 		spin_unlock(&connection->peer_reqs_lock);
-		spin_lock(&device->interval_lock);
+		drbd_write_lock(device, peer_req->i.sector, peer_req->i.size);
 		drbd_remove_peer_req_interval(device, peer_req);
-		spin_unlock_irq(&device->interval_lock);
+		drbd_write_unlock_irq(device, peer_req->i.sector, peer_req->i.size);
 		drbd_al_complete_io(device, &peer_req->i);
 		drbd_may_finish_epoch(connection, peer_req->epoch, EV_PUT | EV_CLEANUP);
 		drbd_free_peer_req(peer_req);
@@ -1820,6 +2590,8 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 		if (rv == FE_STILL_LIVE) {
 			set_bit(DE_BARRIER_IN_NEXT_EPOCH_ISSUED, &connection->current_epoch->flags);
 			conn_wait_active_ee_empty_or_disconnect(connection);
+			if (drbd_flush_epoch_async(connection, connection->current_epoch))
+				break;
 			rv = drbd_flush_after_epoch(connection, connection->current_epoch);
 		}
 		if (rv == FE_RECYCLED)
@@ -1882,6 +2654,102 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
 	d->length = pi->size;
 	d->bi_size = is_trim_or_wsame ? be32_to_cpu(p->size) : pi->size - digest_size;
 	d->digest_size = digest_size;
+	d->compress_alg = DRBD_COMPRESS_NONE;
+	d->dedupe = NULL;
+	d->dedupe_refetch = false;
+	d->resync = false;
+}
+
+/* For DP_COMPRESSED, the uncompressed size follows the p_data header */
+static int recv_compress_hdr(struct drbd_connection *connection,
+			     struct drbd_peer_request_details *d, struct packet_info *pi)
+{
+	struct drbd_compress_hdr hdr;
+	int err;
+
+	if (pi->cmd != P_DATA || d->length < sizeof(hdr) + d->digest_size) {
+		drbd_err(connection, "unexpected compressed %s\n", drbd_packet_name(pi->cmd));
+		return -EIO;
+	}
+	err = drbd_recv_into(connection, &hdr, sizeof(hdr));
+	if (err)
+		return err;
+	pi->size -= sizeof(hdr);
+	d->length -= sizeof(hdr);
+	d->bi_size = be32_to_cpu(hdr.size);
+	d->compress_alg = hdr.alg;
+	if (d->compress_alg == DRBD_COMPRESS_NONE || !drbd_compress_agreed(connection) ||
+	    d->compress_alg != connection->compress.alg) {
+		drbd_err(connection, "peer compresses with %s, set data_compress to match\n",
+			 drbd_compress_alg_name(d->compress_alg));
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Receives the compressed payload, and decompresses it into a page chain */
+static int recv_compressed_pages(struct drbd_connection *connection,
+				 struct drbd_peer_request *peer_req, unsigned int len)
+{
+	struct drbd_compress *cmp = &connection->compress;
+	unsigned int size = peer_req->i.size;
+	unsigned int dlen = size;
+	const char *from = cmp->rx_dst;
+	struct page *page;
+	int err;
+
+	if (len > DRBD_MAX_BIO_SIZE)
+		return -EIO;
+	err = drbd_recv_into(connection, cmp->rx_src, len);
+	if (err)
+		return err;
+	err = crypto_comp_decompress(cmp->rx_tfm, cmp->rx_src, len, cmp->rx_dst, &dlen);
+	if (err || dlen != size) {
+		drbd_err(connection, "decompression failed: %d, %u of %u bytes\n", err, dlen, size);
+		return -EIO;
+	}
+
+	drbd_alloc_page_chain(&connection->transport, &peer_req->page_chain,
+			      DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = peer_req->page_chain.head;
+	if (!page)
+		return -ENOMEM;
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, size, PAGE_SIZE);
+		void *data = kmap_atomic(page);
+
+		memcpy(data, from, l);
+		kunmap_atomic(data);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, l);
+		from += l;
+		size -= l;
+	}
+	cmp->rx_plain += peer_req->i.size;
+	cmp->rx_wire += len;
+	return 0;
+}
+
+/* For DP_RS_DEDUPE, the location of the data follows the p_data header */
+static int recv_rs_dedupe_ref(struct drbd_connection *connection,
+			      struct drbd_peer_request_details *d, struct packet_info *pi)
+{
+	struct drbd_rs_dedupe_ref *ref = &connection->rs_dedupe_rx;
+	int err;
+
+	if (pi->cmd != P_RS_DATA_REPLY || d->length != sizeof(*ref) + d->digest_size ||
+	    !(connection->agreed_features & DRBD_FF_RS_DEDUPE)) {
+		drbd_err(connection, "unexpected deduplicated %s\n", drbd_packet_name(pi->cmd));
+		return -EIO;
+	}
+	err = drbd_recv_into(connection, ref, sizeof(*ref));
+	if (err)
+		return err;
+	pi->size -= sizeof(*ref);
+	d->length -= sizeof(*ref);
+	d->bi_size = be32_to_cpu(ref->size);
+	d->dedupe = ref;
+	return 0;
 }
 
 /* used from receive_RSDataReply (recv_resync_read)
@@ -1899,6 +2767,7 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	struct drbd_device *device = peer_device->device;
 	const uint64_t capacity = drbd_get_capacity(device->this_bdev);
 	struct drbd_peer_request *peer_req;
+	bool deferred_digest = false;
 	int err;
 	void *dig_in = peer_device->connection->int_dig_in;
 	void *dig_vv = peer_device->connection->int_dig_vv;
@@ -1916,7 +2785,7 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	if (d->dp_flags & (DP_WSAME|DP_DISCARD|DP_ZEROES)) {
 		if (!expect(peer_device, d->bi_size <= (DRBD_MAX_BBIO_SECTORS << 9)))
 			return NULL;
-	} else if (!expect(peer_device, d->bi_size <= DRBD_MAX_BIO_SIZE))
+	} else if (!expect(peer_device, d->bi_size <= drbd_max_repl_size()))
 		return NULL;
 
 	/* even though we trust our peer,
@@ -1928,7 +2797,10 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 		return NULL;
 	}
 
-	peer_req = drbd_alloc_peer_req(peer_device, GFP_TRY);
+	if (d->resync)
+		peer_req = drbd_rs_alloc_peer_req(peer_device, 0, GFP_TRY);
+	else
+		peer_req = drbd_alloc_peer_req(peer_device, GFP_TRY);
 	if (!peer_req)
 		return NULL;
 	peer_req->i.size = d->bi_size; /* storage size */
@@ -1939,7 +2811,11 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	if (d->length == 0)
 		return peer_req;
 
-	err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
+	if (d->compress_alg)
+		err = recv_compressed_pages(peer_device->connection, peer_req,
+					    d->length - d->digest_size);
+	else
+		err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
 	if (err)
 		goto fail;
 
@@ -1954,7 +2830,15 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 		kunmap(page);
 	}
 
-	if (d->digest_size) {
+	/* Nothing the peer did not ask a receive ack for gets acked before it is
+	 * written, so the digest check may wait until it gets submitted */
+	if (d->digest_size && !(d->dp_flags & DP_SEND_RECEIVE_ACK) &&
+	    READ_ONCE(drbd_integrity_offload) &&
+	    drbd_defer_digest_check(peer_req, peer_device->connection->peer_integrity,
+				    dig_in, d->digest_size))
+		deferred_digest = true;
+
+	if (d->digest_size && !deferred_digest) {
 		drbd_csum_pages(peer_device->connection->peer_integrity_tfm, peer_req->page_chain.head, dig_vv);
 		if (memcmp(dig_in, dig_vv, d->digest_size)) {
 			drbd_err(device, "Digest integrity check FAILED: %llus +%u\n",
@@ -2034,6 +2918,30 @@ static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_req
 	return 0;
 }
 
+/* Resync writes of a local copy are acked with ID_SYNCER_DEDUPE: the
+ * SyncSource did not account for them as for the data it sent. */
+static int send_resync_ack(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
+			   struct drbd_peer_request *peer_req)
+{
+	if (peer_req->flags & EE_RS_DEDUPE)
+		return drbd_send_ack_ex(peer_device, cmd, peer_req->i.sector,
+					peer_req->i.size, ID_SYNCER_DEDUPE);
+	return drbd_send_ack(peer_device, cmd, peer_req);
+}
+
+/* What we got from one of several parallel resync sources is in sync with
+ * the others as well.  Clear their bits first, so that they do not go and
+ * request it, too.  See make_resync_request().  The sources learn about it
+ * per resync extent, from consider_sending_peers_in_sync(). */
+static void rs_set_in_sync_co_sources(struct drbd_peer_device *peer_device,
+				      sector_t sector, int size)
+{
+	unsigned long mask = drbd_rs_co_source_mask(peer_device);
+
+	if (mask)
+		drbd_set_sync(peer_device->device, sector, size, 0, mask);
+}
+
 /*
  * e_end_resync_block() is called in ack_sender context via
  * drbd_finish_peer_reqs().
@@ -2047,35 +2955,49 @@ static int e_end_resync_block(struct drbd_work *w, int unused)
 	sector_t sector = peer_req->i.sector;
 	int err;
 
+	drbd_rs_unlock_interval(peer_req);
 	D_ASSERT(device, drbd_interval_empty(&peer_req->i));
 
 	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
-		drbd_set_in_sync(peer_device, sector, peer_req->i.size);
-		err = drbd_send_ack(peer_device, P_RS_WRITE_ACK, peer_req);
+		rs_set_in_sync_co_sources(peer_device, sector, peer_req->i.size);
+		drbd_set_in_sync_batched(peer_device, sector, peer_req->i.size);
+		drbd_rs_tl_add(peer_device, DRBD_RS_TL_WRITTEN, peer_req->i.size >> 9);
+		err = send_resync_ack(peer_device, P_RS_WRITE_ACK, peer_req);
 	} else {
 		/* Record failure to sync */
 		drbd_rs_failed_io(peer_device, sector, peer_req->i.size);
 
-		err  = drbd_send_ack(peer_device, P_NEG_ACK, peer_req);
+		err  = send_resync_ack(peer_device, P_NEG_ACK, peer_req);
 	}
 	dec_unacked(peer_device);
 
 	return err;
 }
 
-static int recv_resync_read(struct drbd_peer_device *peer_device,
-			    struct drbd_peer_request_details *d) __releases(local)
+/* The block a DP_RS_DEDUPE reply referred to can not be used, ask for the
+ * data. That is still the same resync request, rs_pending and the resync
+ * extent reference remain. */
+static int rs_dedupe_refetch(struct drbd_peer_device *peer_device,
+			     struct drbd_peer_request_details *d) __releases(local)
 {
+	int err;
+
+	err = drbd_send_drequest(peer_device, P_RS_DATA_REQUEST, d->sector, d->bi_size, ID_SYNCER);
+	if (!err)
+		put_ldev(peer_device->device);
+	return err;
+}
+
+/* Writes a resync block, received from the peer, or read locally for a
+ * DP_RS_DEDUPE reply by w_e_rs_dedupe_read() */
+static int submit_resync_write(struct drbd_peer_request *peer_req) __releases(local)
+{
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
 	struct drbd_connection *connection = peer_device->connection;
 	struct drbd_device *device = peer_device->device;
-	struct drbd_peer_request *peer_req;
 	int err;
 	u64 im;
 
-	peer_req = read_in_block(peer_device, d);
-	if (!peer_req)
-		return -EIO;
-
 	if (test_bit(UNSTABLE_RESYNC, &peer_device->flags))
 		clear_bit(STABLE_RESYNC, &device->flags);
 
@@ -2087,19 +3009,27 @@ static int recv_resync_read(struct drbd_peer_device *peer_device,
 
 	peer_req->w.cb = e_end_resync_block;
 	peer_req->opf = REQ_OP_WRITE;
+	if (READ_ONCE(drbd_resync_idle))
+		peer_req->ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
 	peer_req->submit_jif = jiffies;
 
 	spin_lock_irq(&connection->peer_reqs_lock);
 	list_add_tail(&peer_req->w.list, &connection->sync_ee);
 	spin_unlock_irq(&connection->peer_reqs_lock);
 
-	atomic_add(d->bi_size >> 9, &device->rs_sect_ev);
+	atomic_add(peer_req->i.size >> 9, &device->rs_sect_ev);
 
 	/* Setting all peer out of sync here. Sync source peer will be set
 	   in sync when the write completes. Other peers will be set in
 	   sync by the sync source with a P_PEERS_IN_SYNC packet soon. */
 	drbd_set_all_out_of_sync(device, peer_req->i.sector, peer_req->i.size);
 
+	if (READ_ONCE(drbd_resync_interval_lock)) {
+		err = drbd_rs_lock_interval(peer_req);
+		if (err)
+			goto out;
+	}
+
 	err = drbd_submit_peer_request(peer_req);
 	if (err)
 		goto out;
@@ -2117,11 +3047,149 @@ out:
 	list_del(&peer_req->w.list);
 	spin_unlock_irq(&connection->peer_reqs_lock);
 
-	drbd_free_peer_req(peer_req);
-	return err;
+	drbd_free_peer_req(peer_req);
+	return err;
+}
+
+/* Where the data of a DP_RS_DEDUPE reply goes, while the block it refers to
+ * is read. Freed as peer_req->digest. */
+struct drbd_rs_dedupe_read {
+	struct digest_info di;
+	sector_t sector;
+	u8 digest[DRBD_RS_DEDUPE_DIGEST_SIZE];
+};
+
+/* The block a DP_RS_DEDUPE reply referred to is in. If it still has the
+ * digest the peer saw, write it where the reply said, else ask for the data.
+ * Called in the sender, like the completion of read_for_csum(). */
+static int w_e_rs_dedupe_read(struct drbd_work *w, int cancel)
+{
+	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_device *device = peer_device->device;
+	struct drbd_rs_dedupe_read *dr =
+		container_of(peer_req->digest, struct drbd_rs_dedupe_read, di);
+	sector_t sector = dr->sector;
+	unsigned int size = peer_req->i.size;
+	u8 digest[DRBD_RS_DEDUPE_DIGEST_SIZE];
+	bool match = false;
+	int err;
+
+	if (unlikely(cancel)) {
+		drbd_free_peer_req(peer_req);
+		return 0;
+	}
+
+	if (!(peer_req->flags & EE_WAS_ERROR) && get_ldev(device)) {
+		drbd_csum_pages(peer_device->connection->rs_dedupe_tfm,
+				peer_req->page_chain.head, digest);
+		match = !memcmp(digest, dr->digest, sizeof(digest));
+		if (!match)
+			put_ldev(device);
+	}
+	if (!match) {
+		drbd_free_peer_req(peer_req);
+		return drbd_send_drequest(peer_device, P_RS_DATA_REQUEST, sector, size, ID_SYNCER);
+	}
+
+	/* from here on, this is the resync write of the reply */
+	peer_req->flags &= ~EE_HAS_DIGEST;
+	kfree(dr);
+	peer_req->i.sector = sector;
+	peer_req->block_id = ID_SYNCER;
+	peer_req->flags |= EE_WRITE | EE_RS_DEDUPE;
+	rs_sectors_came_in(peer_device, size);
+	err = submit_resync_write(peer_req);
+	if (err)
+		put_ldev(device);
+	return err;
+}
+
+/* The data of a DP_RS_DEDUPE reply is on our disk already, where an earlier
+ * resync block went. It is read like the blocks of a checksum based resync,
+ * the receiver does not wait for it; w_e_rs_dedupe_read() continues. */
+static int recv_resync_dedupe(struct drbd_peer_device *peer_device,
+			      struct drbd_peer_request_details *d) __releases(local)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_device *device = peer_device->device;
+	const sector_t capacity = drbd_get_capacity(device->this_bdev);
+	sector_t ref_sector = be64_to_cpu(d->dedupe->sector);
+	struct drbd_peer_request *peer_req = NULL;
+	struct drbd_rs_dedupe_read *dr;
+	int err;
+
+	/* The sha256 of the reference covers what we read */
+	if (d->digest_size) {
+		err = drbd_recv_into(connection, connection->int_dig_in, d->digest_size);
+		if (err)
+			return err;
+	}
+	/* rs_sectors_came_in() once the data is there */
+	d->dedupe_refetch = true;
+
+	if (!expect(peer_device, IS_ALIGNED(d->bi_size, 512)) ||
+	    !expect(peer_device, d->bi_size <= drbd_max_repl_size()))
+		return -EIO;
+	if (d->sector + (d->bi_size >> 9) > capacity) {
+		drbd_err(device, "request from peer beyond end of local disk: "
+			"capacity: %llus < sector: %llus + size: %u\n",
+			(unsigned long long)capacity, d->sector, d->bi_size);
+		return -EIO;
+	}
+	if (!connection->rs_dedupe_tfm || ref_sector + (d->bi_size >> 9) > capacity)
+		return rs_dedupe_refetch(peer_device, d);
+
+	/* Without memory right now, the peer might as well send the data */
+	dr = kmalloc(sizeof(*dr), GFP_NOIO | __GFP_NOWARN);
+	if (dr)
+		peer_req = drbd_rs_alloc_peer_req(peer_device, d->bi_size, GFP_TRY);
+	if (!peer_req) {
+		kfree(dr);
+		return rs_dedupe_refetch(peer_device, d);
+	}
+	dr->di.digest = dr->digest;
+	dr->di.digest_size = sizeof(dr->digest);
+	dr->sector = d->sector;
+	memcpy(dr->digest, d->dedupe->digest, sizeof(dr->digest));
+
+	peer_req->i.size = d->bi_size;
+	peer_req->i.sector = ref_sector;
+	peer_req->digest = &dr->di;
+	peer_req->flags |= EE_HAS_DIGEST;
+	peer_req->w.cb = w_e_rs_dedupe_read;
+	peer_req->opf = REQ_OP_READ;
+	spin_lock_irq(&connection->peer_reqs_lock);
+	list_add_tail(&peer_req->w.list, &connection->read_ee);
+	spin_unlock_irq(&connection->peer_reqs_lock);
+
+	/* the read completion puts our ldev reference */
+	if (drbd_submit_peer_request(peer_req) == 0)
+		return 0;
+
+	spin_lock_irq(&connection->peer_reqs_lock);
+	list_del(&peer_req->w.list);
+	spin_unlock_irq(&connection->peer_reqs_lock);
+	drbd_free_peer_req(peer_req);
+	return rs_dedupe_refetch(peer_device, d);
+}
+
+static int recv_resync_read(struct drbd_peer_device *peer_device,
+			    struct drbd_peer_request_details *d) __releases(local)
+{
+	struct drbd_peer_request *peer_req;
+
+	if (d->dedupe)
+		return recv_resync_dedupe(peer_device, d);
+
+	peer_req = read_in_block(peer_device, d);
+	if (!peer_req)
+		return -EIO;
+	return submit_resync_write(peer_req);
 }
 
-/* caller must hold interval_lock */
+/* With @root, caller must hold interval_lock.  Without, @id is looked up among
+ * the write requests and caller must hold drbd_write_lock(device, sector, 0). */
 static struct drbd_request *
 find_request(struct drbd_device *device, struct rb_root *root, u64 id,
 	     sector_t sector, bool missing_ok, const char *func)
@@ -2130,8 +3198,11 @@ find_request(struct drbd_device *device, struct rb_root *root, u64 id,
 
 	/* Request object according to our peer */
 	req = (struct drbd_request *)(unsigned long)id;
-	if (drbd_contains_interval(root, sector, &req->i) && req->i.local)
-		return req;
+	if (root ? drbd_contains_interval(root, sector, &req->i) :
+		   drbd_contains_write_interval(device, sector, &req->i)) {
+		if (req->i.local)
+			return req;
+	}
 	if (!missing_ok) {
 		drbd_err(device, "%s: failed to find request 0x%lx, sector %llus\n", func,
 			(unsigned long)id, (unsigned long long)sector);
@@ -2155,9 +3226,9 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 
 	sector = be64_to_cpu(p->sector);
 
-	spin_lock_irq(&device->interval_lock);
+	drbd_lock_irq(&device->interval_lock, &device->interval_lock_stat);
 	req = find_request(device, &device->read_requests, p->block_id, sector, false, __func__);
-	spin_unlock_irq(&device->interval_lock);
+	drbd_unlock_irq(&device->interval_lock, &device->interval_lock_stat);
 	if (unlikely(!req))
 		return -EIO;
 
@@ -2187,6 +3258,17 @@ static int _drbd_send_ack(struct drbd_peer_device *peer_device, enum drbd_packet
 	if (peer_device->repl_state[NOW] < L_ESTABLISHED)
 		return -EIO;
 
+	if ((cmd == P_WRITE_ACK || cmd == P_RECV_ACK) &&
+	    peer_device->connection->agreed_features & DRBD_FF_BLOCK_ACKS) {
+		struct p_block_ack ack = {
+			.sector = sector,
+			.block_id = block_id,
+			.blksize = blksize,
+		};
+
+		return drbd_send_block_ack(peer_device, cmd, &ack);
+	}
+
 	p = drbd_prepare_command(peer_device, sizeof(*p), CONTROL_STREAM);
 	if (!p)
 		return -EIO;
@@ -2246,7 +3328,13 @@ static int receive_RSDataReply(struct drbd_connection *connection, struct packet
 	int err;
 
 	p_req_detail_from_pi(connection, &d, pi);
+	d.resync = true;
 	pi->data = NULL;
+	if (d.dp_flags & DP_RS_DEDUPE) {
+		err = recv_rs_dedupe_ref(connection, &d, pi);
+		if (err)
+			return err;
+	}
 
 	peer_device = conn_peer_device(connection, pi->vnr);
 	if (!peer_device)
@@ -2265,24 +3353,29 @@ static int receive_RSDataReply(struct drbd_connection *connection, struct packet
 
 		err = ignore_remaining_packet(connection, pi->size);
 
-		drbd_send_ack_dp(peer_device, P_NEG_ACK, &d);
+		if (d.dedupe)
+			drbd_send_ack_ex(peer_device, P_NEG_ACK, d.sector, d.bi_size, ID_SYNCER_DEDUPE);
+		else
+			drbd_send_ack_dp(peer_device, P_NEG_ACK, &d);
 	}
 
-	rs_sectors_came_in(peer_device, d.bi_size);
+	if (!d.dedupe_refetch)
+		rs_sectors_came_in(peer_device, d.bi_size);
 
 	return err;
 }
 
-/* caller must hold interval_lock */
+/* caller must hold drbd_write_lock() for the range of the peer request */
 static void restart_conflicting_writes(struct drbd_peer_request *peer_req)
 {
+	struct drbd_write_overlap o;
 	struct drbd_interval *i;
 	struct drbd_request *req;
 	struct drbd_device *device = peer_req->peer_device->device;
 	const sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
 
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	drbd_for_each_write_overlap(i, &o, device, sector, size) {
 		unsigned int local_rq_state;
 
 		if (!i->local)
@@ -2326,7 +3419,7 @@ static int e_end_block(struct drbd_work *w, int cancel)
 			   peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T &&
 			   peer_req->flags & EE_MAY_SET_IN_SYNC) {
 			pcmd = P_RS_WRITE_ACK;
-			drbd_set_in_sync(peer_device, sector, peer_req->i.size);
+			drbd_set_in_sync_batched(peer_device, sector, peer_req->i.size);
 		} else
 			pcmd = P_WRITE_ACK;
 		err = drbd_send_ack(peer_device, pcmd, peer_req);
@@ -2337,12 +3430,12 @@ static int e_end_block(struct drbd_work *w, int cancel)
 	 * P_WRITE_ACK / P_NEG_ACK, to get the sequence number right.  */
 	if (peer_req->flags & EE_IN_INTERVAL_TREE) {
 		read_lock_irq(&device->resource->state_rwlock);
-		spin_lock(&device->interval_lock);
+		drbd_write_lock(device, sector, peer_req->i.size);
 		D_ASSERT(device, !drbd_interval_empty(&peer_req->i));
 		drbd_remove_peer_req_interval(device, peer_req);
 		if (peer_req->flags & EE_RESTART_REQUESTS)
 			restart_conflicting_writes(peer_req);
-		spin_unlock(&device->interval_lock);
+		drbd_write_unlock(device, sector, peer_req->i.size);
 		read_unlock_irq(&device->resource->state_rwlock);
 	} else
 		D_ASSERT(device, drbd_interval_empty(&peer_req->i));
@@ -2424,21 +3517,36 @@ static void update_peer_seq(struct drbd_peer_device *peer_device, unsigned int p
  * for the 24bit wrap (historical atomic_t guarantee on some archs), and we have
  * 1<<9 == 512 seconds aka ages for the 32bit wrap around...
  *
+ * Only writes that overlap local requests need that ordering, acks can
+ * only change the outcome of those. Other writes (!may_conflict) do not
+ * wait, and do not advance peer_device->peer_seq past acks that have not
+ * arrived yet either. Instead we remember the run of P_DATA sequence
+ * numbers that came in back to back: all of them are accounted for, so a
+ * later conflicting write only waits for the acks sent before that run.
+ *
  * returns 0 if we may process the packet,
  * -ERESTARTSYS if we were interrupted (by disconnect signal). */
-static int wait_for_and_update_peer_seq(struct drbd_peer_device *peer_device, const u32 peer_seq)
+static int wait_for_and_update_peer_seq(struct drbd_peer_device *peer_device, const u32 peer_seq,
+					bool may_conflict)
 {
 	struct drbd_connection *connection = peer_device->connection;
 	DEFINE_WAIT(wait);
 	long timeout;
 	int ret = 0, tp;
+	u32 run;
 
 	if (!test_bit(RESOLVE_CONFLICTS, &connection->transport.flags))
 		return 0;
 
 	spin_lock(&peer_device->peer_seq_lock);
+	run = peer_seq == peer_device->peer_data_seq + 1 ? peer_device->peer_data_run : peer_seq;
+	peer_device->peer_data_seq = peer_seq;
+	peer_device->peer_data_run = run;
 	for (;;) {
-		if (!seq_greater(peer_seq - 1, peer_device->peer_seq)) {
+		if (!may_conflict)
+			break;
+
+		if (!seq_greater(run - 1, peer_device->peer_seq)) {
 			peer_device->peer_seq = seq_max(peer_device->peer_seq, peer_seq);
 			break;
 		}
@@ -2489,8 +3597,12 @@ static unsigned long wire_flags_to_bio_op(u32 dpf)
 /* see also bio_flags_to_wire() */
 static unsigned long wire_flags_to_bio(struct drbd_connection *connection, u32 dpf)
 {
+	if (!(connection->agreed_features & DRBD_FF_IO_HINTS))
+		dpf &= ~DP_IDLE;
+
 	return wire_flags_to_bio_op(dpf) |
 		(dpf & DP_RW_SYNC ? REQ_SYNC : 0) |
+		(dpf & DP_IDLE ? REQ_IDLE : 0) |
 		(dpf & DP_FUA ? REQ_FUA : 0) |
 		(dpf & DP_FLUSH ? REQ_PREFLUSH : 0);
 }
@@ -2498,12 +3610,13 @@ static unsigned long wire_flags_to_bio(struct drbd_connection *connection, u32 d
 static void fail_postponed_requests(struct drbd_peer_request *peer_req)
 {
 	struct drbd_device *device = peer_req->peer_device->device;
+	struct drbd_write_overlap o;
 	struct drbd_interval *i;
 	const sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
 
     repeat:
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	drbd_for_each_write_overlap(i, &o, device, sector, size) {
 		struct drbd_request *req;
 
 		if (!i->local)
@@ -2512,9 +3625,9 @@ static void fail_postponed_requests(struct drbd_peer_request *peer_req)
 		if (!(req->local_rq_state & RQ_POSTPONED))
 			continue;
 		req->local_rq_state &= ~RQ_POSTPONED;
-		spin_unlock_irq(&device->interval_lock);
+		drbd_write_unlock_irq(device, sector, size);
 		req_mod(req, NEG_ACKED, peer_req->peer_device);
-		spin_lock_irq(&device->interval_lock);
+		drbd_write_lock_irq(device, sector, size);
 		goto repeat;
 	}
 }
@@ -2526,8 +3639,10 @@ static void fail_postponed_requests(struct drbd_peer_request *peer_req)
  *		 request when waiting for a peer request
  * @i:		the struct drbd_interval embedded in struct drbd_request or
  *		struct drbd_peer_request
+ * @locked:	the interval whose drbd_write_lock() the caller holds
  */
-static int wait_misc(struct drbd_device *device, struct drbd_peer_device *peer_device, struct drbd_interval *i)
+static int wait_misc(struct drbd_device *device, struct drbd_peer_device *peer_device,
+		     struct drbd_interval *i, struct drbd_interval *locked)
 {
 	DEFINE_WAIT(wait);
 	long timeout;
@@ -2550,10 +3665,10 @@ static int wait_misc(struct drbd_device *device, struct drbd_peer_device *peer_d
 	/* Indicate to wake up device->misc_wait on progress.  */
 	i->waiting = true;
 	prepare_to_wait(&device->misc_wait, &wait, TASK_INTERRUPTIBLE);
-	spin_unlock_irq(&device->interval_lock);
+	drbd_write_unlock_irq(device, locked->sector, locked->size);
 	timeout = schedule_timeout(timeout);
 	finish_wait(&device->misc_wait, &wait);
-	spin_lock_irq(&device->interval_lock);
+	drbd_write_lock_irq(device, locked->sector, locked->size);
 	if (!timeout || (peer_device && peer_device->repl_state[NOW] < L_ESTABLISHED))
 		return -ETIMEDOUT;
 	if (signal_pending(current))
@@ -2561,6 +3676,92 @@ static int wait_misc(struct drbd_device *device, struct drbd_peer_device *peer_d
 	return 0;
 }
 
+/*
+ * With resync_interval_lock, resync IO puts exactly the range it reads or
+ * writes into the write interval trees, as !local interval, instead of
+ * locking application writes out of the whole resync extent.  Application
+ * writes wait for it in complete_conflicting_writes() and
+ * handle_write_conflicts(), like for any conflicting peer write.
+ */
+
+/* Sync target: before writing resync data, wait for the writes to that range
+ * we already have.  Like complete_conflicting_writes(), wait first and then
+ * insert, so that two waiters never wait for each other. */
+static int drbd_rs_lock_interval(struct drbd_peer_request *peer_req)
+{
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_device *device = peer_device->device;
+	sector_t sector = peer_req->i.sector;
+	const unsigned int size = peer_req->i.size;
+	struct drbd_write_overlap o;
+	struct drbd_interval *i;
+	int err = 0;
+
+	drbd_write_lock_irq(device, sector, size);
+    repeat:
+	drbd_for_each_write_overlap(i, &o, device, sector, size) {
+		if (i->completed)
+			continue;
+		err = wait_misc(device, peer_device, i, &peer_req->i);
+		if (err)
+			goto out;
+		goto repeat;
+	}
+	drbd_insert_write_interval(device, &peer_req->i);
+	peer_req->flags |= EE_IN_INTERVAL_TREE | EE_RS_INTERVAL;
+out:
+	drbd_write_unlock_irq(device, sector, size);
+	return err;
+}
+
+/* Sync source: the receiver must not wait for application writes here, the
+ * caller tells the peer to retry if one is in the way.  The range is held
+ * until the reply is sent, and the peer request freed. */
+static bool drbd_rs_try_lock_interval(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+	sector_t sector = peer_req->i.sector;
+	const unsigned int size = peer_req->i.size;
+	struct drbd_write_overlap o;
+	struct drbd_interval *i;
+
+	drbd_write_lock_irq(device, sector, size);
+	drbd_for_each_write_overlap(i, &o, device, sector, size) {
+		if (!i->completed)
+			break;
+	}
+	if (!i) {
+		drbd_insert_write_interval(device, &peer_req->i);
+		peer_req->flags |= EE_IN_INTERVAL_TREE | EE_RS_INTERVAL;
+	}
+	drbd_write_unlock_irq(device, sector, size);
+	return !i;
+}
+
+/* Not final: handle_write_conflicts() looks again, once the peer request is
+ * in the write interval trees. But local requests that come later cannot
+ * have been acked by the peer before this write was sent. */
+static bool overlaps_local_write(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+	sector_t sector = peer_req->i.sector;
+	const unsigned int size = peer_req->i.size;
+	struct drbd_write_overlap o;
+	struct drbd_interval *i;
+	bool overlaps = false;
+
+	drbd_write_lock_irq(device, sector, size);
+	drbd_for_each_write_overlap(i, &o, device, sector, size) {
+		if (i->local && !i->completed) {
+			overlaps = true;
+			break;
+		}
+	}
+	drbd_write_unlock_irq(device, sector, size);
+
+	return overlaps;
+}
+
 static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 {
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
@@ -2569,20 +3770,21 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 	bool resolve_conflicts = test_bit(RESOLVE_CONFLICTS, &connection->transport.flags);
 	sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
+	struct drbd_write_overlap o;
 	struct drbd_interval *i;
 	bool equal;
 	int err;
 
-	spin_lock_irq(&device->interval_lock);
+	drbd_write_lock_irq(device, sector, size);
 	/*
-	 * Inserting the peer request into the write_requests tree will prevent
+	 * Inserting the peer request into the write interval trees will prevent
 	 * new conflicting local requests from being added.
 	 */
-	drbd_insert_interval(&device->write_requests, &peer_req->i);
+	drbd_insert_write_interval(device, &peer_req->i);
 	peer_req->flags |= EE_IN_INTERVAL_TREE;
 
     repeat:
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	drbd_for_each_write_overlap(i, &o, device, sector, size) {
 		if (i == &peer_req->i)
 			continue;
 		if (i->completed)
@@ -2594,7 +3796,7 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 			 * should not happen in a two-node setup.  Wait for the
 			 * earlier peer request to complete.
 			 */
-			err = wait_misc(device, peer_device, i);
+			err = wait_misc(device, peer_device, i, &peer_req->i);
 			if (err)
 				goto out;
 			goto repeat;
@@ -2647,13 +3849,13 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 				 * Wait for the node with the discard flag to
 				 * decide if this request will be discarded or
 				 * retried.  Requests that are discarded will
-				 * disappear from the write_requests tree.
+				 * disappear from the write interval trees.
 				 *
 				 * In addition, wait for the conflicting
 				 * request to finish locally before submitting
 				 * the conflicting peer request.
 				 */
-				err = wait_misc(device, NULL, &req->i);
+				err = wait_misc(device, NULL, &req->i, &peer_req->i);
 				if (err) {
 					fail_postponed_requests(peer_req);
 					goto out;
@@ -2673,7 +3875,7 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 	if (err)
 		drbd_remove_peer_req_interval(device, peer_req);
 
-	spin_unlock_irq(&device->interval_lock);
+	drbd_write_unlock_irq(device, sector, size);
 	return err;
 }
 
@@ -2688,6 +3890,31 @@ static void drbd_queue_peer_request(struct drbd_device *device, struct drbd_peer
 	wake_up(&device->al_wait);
 }
 
+/* Requests to the same volume keep their order, since a work item never runs
+ * concurrently with itself.  Different volumes get submitted in parallel. */
+static void drbd_queue_peer_submit(struct drbd_device *device, struct drbd_peer_request *peer_req)
+{
+	spin_lock(&device->submit.lock);
+	list_add_tail(&peer_req->wait_for_actlog, &device->submit.peer_submits);
+	spin_unlock(&device->submit.lock);
+	queue_work(drbd_peer_submit_wq, &device->submit.peer_submit_work);
+}
+
+void drbd_do_peer_submit(struct work_struct *ws)
+{
+	struct drbd_device *device = container_of(ws, struct drbd_device, submit.peer_submit_work);
+	struct blk_plug plug;
+	LIST_HEAD(peer_reqs);
+
+	spin_lock(&device->submit.lock);
+	list_splice_init(&device->submit.peer_submits, &peer_reqs);
+	spin_unlock(&device->submit.lock);
+
+	blk_start_plug(&plug);
+	drbd_submit_peer_requests(&peer_reqs);
+	blk_finish_plug(&plug);
+}
+
 /* FIXME
  * TODO grab the device->al_lock *once*, and check:
  *     if possible, non-blocking get the reference(s),
@@ -2714,11 +3941,11 @@ prepare_activity_log(struct drbd_peer_request *peer_req)
 	 * See also drbd_request_prepare() for the "request" entry point. */
 	ecnt = atomic_add_return(nr_al_extents, &device->wait_for_actlog_ecnt);
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 	al = device->act_log;
 	nr = al->nr_elements;
 	used = al->used;
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 
 	/* note: due to the slight delay between being accounted in "used" after
 	 * being committed to the activity log with drbd_al_begin_io_commit(),
@@ -2767,10 +3994,16 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	p_req_detail_from_pi(connection, &d, pi);
 	pi->data = NULL;
 
+	if (d.dp_flags & DP_COMPRESSED) {
+		err = recv_compress_hdr(connection, &d, pi);
+		if (err)
+			return err;
+	}
+
 	if (!get_ldev(device)) {
 		int err2;
 
-		err = wait_for_and_update_peer_seq(peer_device, d.peer_seq);
+		err = wait_for_and_update_peer_seq(peer_device, d.peer_seq, true);
 		drbd_send_ack_dp(peer_device, P_NEG_ACK, &d);
 		atomic_inc(&connection->current_epoch->epoch_size);
 		err2 = ignore_remaining_packet(connection, pi->size);
@@ -2805,6 +4038,9 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	peer_req->flags |= EE_APPLICATION;
 
 	peer_req->opf = wire_flags_to_bio(connection, d.dp_flags);
+	if (connection->agreed_features & DRBD_FF_IO_HINTS)
+		peer_req->ioprio = wire_to_ioprio(d.dp_flags);
+	trace_drbd_receive_data(peer_req);
 	if (pi->cmd == P_TRIM) {
 		D_ASSERT(peer_device, peer_req->i.size > 0);
 		D_ASSERT(peer_device, d.dp_flags & DP_DISCARD);
@@ -2894,7 +4130,8 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	if (tp) {
 		/* two primaries implies protocol C */
 		D_ASSERT(device, d.dp_flags & DP_SEND_WRITE_ACK);
-		err = wait_for_and_update_peer_seq(peer_device, d.peer_seq);
+		err = wait_for_and_update_peer_seq(peer_device, d.peer_seq,
+						   overlaps_local_write(peer_req));
 		if (err)
 			goto out_interrupted;
 		err = handle_write_conflicts(peer_req);
@@ -2944,6 +4181,11 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 		return 0;
 	}
 
+	if (drbd_offload_peer_submit) {
+		drbd_queue_peer_submit(device, peer_req);
+		return 0;
+	}
+
 	err = drbd_submit_peer_request(peer_req);
 	if (!err)
 		return 0;
@@ -2957,9 +4199,9 @@ disconnect_during_al_begin_io:
 	list_del(&peer_req->w.list);
 	list_del_init(&peer_req->recv_order);
 	spin_unlock(&connection->peer_reqs_lock);
-	spin_lock(&device->interval_lock);
+	drbd_write_lock(device, peer_req->i.sector, peer_req->i.size);
 	drbd_remove_peer_req_interval(device, peer_req);
-	spin_unlock_irq(&device->interval_lock);
+	drbd_write_unlock_irq(device, peer_req->i.sector, peer_req->i.size);
 
 out_interrupted:
 	drbd_may_finish_epoch(connection, peer_req->epoch, EV_PUT + EV_CLEANUP);
@@ -2988,9 +4230,9 @@ void drbd_cleanup_after_failed_submit_peer_request(struct drbd_peer_request *pee
 	list_del(&peer_req->w.list);
 	list_del_init(&peer_req->recv_order);
 	spin_unlock(&connection->peer_reqs_lock);
-	spin_lock(&device->interval_lock);
+	drbd_write_lock(device, peer_req->i.sector, peer_req->i.size);
 	drbd_remove_peer_req_interval(device, peer_req);
-	spin_unlock_irq(&device->interval_lock);
+	drbd_write_unlock_irq(device, peer_req->i.sector, peer_req->i.size);
 
 	drbd_may_finish_epoch(connection, peer_req->epoch, EV_PUT + EV_CLEANUP);
 	put_ldev(device);
@@ -3068,6 +4310,10 @@ bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *peer_device)
 	if (c_min_rate == 0)
 		return false;
 
+	/* a volume of higher QoS weight misses its latency target */
+	if (drbd_qos_yield_us(device))
+		return true;
+
 	curr_events = drbd_backing_bdev_events(device)
 		    - atomic_read(&device->rs_sect_ev);
 
@@ -3134,7 +4380,8 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 	sector = be64_to_cpu(p->sector);
 	size   = be32_to_cpu(p->blksize);
 
-	if (size <= 0 || !IS_ALIGNED(size, 512) || size > DRBD_MAX_BIO_SIZE) {
+	if (size <= 0 || !IS_ALIGNED(size, 512) ||
+	    size > (pi->cmd == P_DATA_REQUEST ? drbd_max_repl_size() : DRBD_MAX_BIO_SIZE)) {
 		drbd_err(device, "%s:%d: sector: %llus, size: %u\n", __FILE__, __LINE__,
 				(unsigned long long)sector, size);
 		return -EINVAL;
@@ -3176,20 +4423,28 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		return ignore_remaining_packet(connection, pi->size);
 	}
 
-	peer_req = drbd_alloc_peer_req(peer_device, GFP_TRY);
 	err = -ENOMEM;
-	if (!peer_req)
-		goto fail;
-	if (size) {
-		drbd_alloc_page_chain(&peer_device->connection->transport,
-			&peer_req->page_chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
-		if (!peer_req->page_chain.head)
-			goto fail2;
+	if (pi->cmd != P_DATA_REQUEST) {
+		peer_req = drbd_rs_alloc_peer_req(peer_device, size, GFP_TRY);
+		if (!peer_req)
+			goto fail;
+	} else {
+		peer_req = drbd_alloc_peer_req(peer_device, GFP_TRY);
+		if (!peer_req)
+			goto fail;
+		if (size) {
+			drbd_alloc_page_chain(&peer_device->connection->transport,
+				&peer_req->page_chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+			if (!peer_req->page_chain.head)
+				goto fail2;
+		}
 	}
 	peer_req->i.size = size;
 	peer_req->i.sector = sector;
 	peer_req->block_id = p->block_id;
 	peer_req->opf = REQ_OP_READ;
+	if (pi->cmd != P_DATA_REQUEST && READ_ONCE(drbd_resync_idle))
+		peer_req->ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
 	/* no longer valid, about to call drbd_recv again for the digest... */
 	p = pi->data = NULL;
 
@@ -3233,10 +4488,8 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		goto submit;
 
 	case P_RS_THIN_REQ:
-		/* If at some point in the future we have a smart way to
-		   find out if this data block is completely deallocated,
-		   then we would do something smarter here than reading
-		   the block... */
+		/* Known to be deallocated ranges are not read,
+		 * see drbd_unallocated_covers() below */
 		peer_req->flags |= EE_RS_THIN_REQ;
 	/* Fall through */
 	case P_RS_DATA_REQUEST:
@@ -3332,12 +4585,19 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 
 	update_receiver_timing_details(connection, drbd_rs_should_slow_down);
 	if (connection->peer_role[NOW] != R_PRIMARY &&
-	    drbd_rs_should_slow_down(peer_device, sector, false))
+	    drbd_rs_should_slow_down(peer_device, sector, false)) {
+		drbd_rs_tl_add(peer_device, DRBD_RS_TL_THROTTLED, 1);
 		schedule_timeout_uninterruptible(HZ/10);
+	}
 
 	/* We may not sleep here in order to avoid deadlocks.
 	   Instruct the SyncSource to retry */
 	err = drbd_try_rs_begin_io(peer_device, sector, false);
+	if (!err && READ_ONCE(drbd_resync_interval_lock) &&
+	    !drbd_rs_try_lock_interval(peer_req)) {
+		drbd_rs_complete_io(peer_device, sector);
+		err = -EAGAIN;
+	}
 	if (err) {
 		if (pi->cmd == P_OV_REQUEST)
 			verify_skipped_block(peer_device, sector, size);
@@ -3346,6 +4606,20 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		goto fail3;
 	}
 
+	if (peer_req->flags & EE_RS_THIN_REQ &&
+	    drbd_unallocated_covers(device, sector, size)) {
+		peer_req->flags |= EE_RS_UNALLOCATED;
+		inc_unacked(peer_device);
+		drbd_read_sec_skipped(peer_req);
+		return 0;
+	}
+
+	if (peer_req->w.cb == w_e_end_rsdata_req && drbd_rs_cache_lookup(peer_req)) {
+		inc_unacked(peer_device);
+		drbd_read_sec_skipped(peer_req);
+		return 0;
+	}
+
 submit_for_resync:
 	atomic_add(size >> 9, &device->rs_sect_ev);
 
@@ -3595,6 +4869,34 @@ static void drbd_uuid_dump_peer(struct drbd_peer_device *peer_device, u64 bits,
 	     (unsigned long long)flags);
 }
 
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Do my and the peer's history UUIDs have one in common?  Sort a copy of
+ * the peer's, then look up each of mine, instead of comparing all pairs. */
+static bool history_uuids_intersect(struct drbd_peer_device *peer_device) __must_hold(local)
+{
+	struct drbd_device *device = peer_device->device;
+	u64 peer[ARRAY_SIZE(peer_device->history_uuids)];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(peer); i++)
+		peer[i] = peer_device->history_uuids[i] & ~UUID_PRIMARY;
+	sort(peer, ARRAY_SIZE(peer), sizeof(peer[0]), cmp_u64, NULL);
+
+	for (i = 0; i < HISTORY_UUIDS; i++) {
+		u64 self = drbd_history_uuid(device, i) & ~UUID_PRIMARY;
+
+		if (bsearch(&self, peer, ARRAY_SIZE(peer), sizeof(peer[0]), cmp_u64))
+			return true;
+	}
+	return false;
+}
+
 static enum sync_strategy drbd_uuid_compare(struct drbd_peer_device *peer_device,
 			     int *rule_nr, int *peer_node_id) __must_hold(local)
 {
@@ -3603,7 +4905,7 @@ static enum sync_strategy drbd_uuid_compare(struct drbd_peer_device *peer_device
 	const int node_id = device->resource->res_opts.node_id;
 	u64 self, peer;
 	u64 local_uuid_flags;
-	int i, j;
+	int i;
 	bool initial_handshake;
 	bool uuid_matches_initial;
 
@@ -3753,14 +5055,8 @@ static enum sync_strategy drbd_uuid_compare(struct drbd_peer_device *peer_device
 		return SPLIT_BRAIN_AUTO_RECOVER;
 
 	*rule_nr = 100;
-	for (i = 0; i < HISTORY_UUIDS; i++) {
-		self = drbd_history_uuid(device, i) & ~UUID_PRIMARY;
-		for (j = 0; j < ARRAY_SIZE(peer_device->history_uuids); j++) {
-			peer = peer_device->history_uuids[j] & ~UUID_PRIMARY;
-			if (self == peer)
-				return SPLIT_BRAIN_DISCONNECT;
-		}
-	}
+	if (history_uuids_intersect(peer_device))
+		return SPLIT_BRAIN_DISCONNECT;
 
 	return UNRELATED_DATA;
 }
@@ -4130,6 +5426,7 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 	struct net_conf *nc, *old_net_conf, *new_net_conf = NULL;
 	char integrity_alg[SHARED_SECRET_MAX] = "";
 	struct crypto_shash *peer_integrity_tfm = NULL;
+	struct drbd_integrity_tfm *peer_integrity = NULL;
 	void *int_dig_in = NULL, *int_dig_vv = NULL;
 	int err;
 
@@ -4216,10 +5513,13 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 		hash_size = crypto_shash_digestsize(peer_integrity_tfm);
 		int_dig_in = kmalloc(hash_size, GFP_KERNEL);
 		int_dig_vv = kmalloc(hash_size, GFP_KERNEL);
-		if (!(int_dig_in && int_dig_vv)) {
+		peer_integrity = kmalloc(sizeof(*peer_integrity), GFP_KERNEL);
+		if (!(int_dig_in && int_dig_vv && peer_integrity)) {
 			drbd_err(connection, "Allocation of buffers for data integrity checking failed\n");
 			goto disconnect;
 		}
+		kref_init(&peer_integrity->kref);
+		peer_integrity->tfm = peer_integrity_tfm;
 	}
 
 	new_net_conf = kmalloc(sizeof(struct net_conf), GFP_KERNEL);
@@ -4247,9 +5547,12 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 	mutex_unlock(&connection->mutex[DATA_STREAM]);
 	mutex_unlock(&connection->resource->conf_update);
 
-	crypto_free_shash(connection->peer_integrity_tfm);
+	/* peer writes still waiting for their deferred digest check hold
+	 * a reference on the old one */
+	drbd_put_integrity_tfm(connection->peer_integrity);
 	kfree(connection->int_dig_in);
 	kfree(connection->int_dig_vv);
+	connection->peer_integrity = peer_integrity;
 	connection->peer_integrity_tfm = peer_integrity_tfm;
 	connection->int_dig_in = int_dig_in;
 	connection->int_dig_vv = int_dig_vv;
@@ -4266,6 +5569,7 @@ disconnect_rcu_unlock:
 	rcu_read_unlock();
 disconnect:
 	crypto_free_shash(peer_integrity_tfm);
+	kfree(peer_integrity);
 	kfree(int_dig_in);
 	kfree(int_dig_vv);
 	change_cstate(connection, C_DISCONNECTING, CS_HARD);
@@ -4320,6 +5624,7 @@ static int receive_SyncParam(struct drbd_connection *connection, struct packet_i
 	unsigned int header_size, data_size, exp_max_sz;
 	struct crypto_shash *verify_tfm = NULL;
 	struct crypto_shash *csums_tfm = NULL;
+	struct crypto_shash *old_verify_tfm = NULL, *old_csums_tfm = NULL;
 	struct net_conf *old_net_conf, *new_net_conf = NULL;
 	struct peer_device_conf *old_peer_device_conf = NULL, *new_peer_device_conf = NULL;
 	struct fifo_buffer *old_plan = NULL, *new_plan = NULL;
@@ -4435,18 +5740,24 @@ static int receive_SyncParam(struct drbd_connection *connection, struct packet_i
 		if (verify_tfm) {
 			strcpy(new_net_conf->verify_alg, p->verify_alg);
 			new_net_conf->verify_alg_len = strlen(p->verify_alg) + 1;
-			crypto_free_shash(connection->verify_tfm);
-			connection->verify_tfm = verify_tfm;
+			old_verify_tfm = connection->verify_tfm;
+			WRITE_ONCE(connection->verify_tfm, verify_tfm);
 			drbd_info(device, "using verify-alg: \"%s\"\n", p->verify_alg);
 		}
 		if (csums_tfm) {
 			strcpy(new_net_conf->csums_alg, p->csums_alg);
 			new_net_conf->csums_alg_len = strlen(p->csums_alg) + 1;
-			crypto_free_shash(connection->csums_tfm);
-			connection->csums_tfm = csums_tfm;
+			old_csums_tfm = connection->csums_tfm;
+			WRITE_ONCE(connection->csums_tfm, csums_tfm);
 			drbd_info(device, "using csums-alg: \"%s\"\n", p->csums_alg);
 		}
 		rcu_assign_pointer(connection->transport.net_conf, new_net_conf);
+
+		/* new csum jobs see the new ones now; once drbd_csum_wq is
+		 * flushed, no job hashes with the old ones anymore */
+		flush_workqueue(drbd_csum_wq);
+		crypto_free_shash(old_verify_tfm);
+		crypto_free_shash(old_csums_tfm);
 	}
 
 	if (new_peer_device_conf) {
@@ -4613,7 +5924,7 @@ static int receive_sizes(struct drbd_connection *connection, struct packet_info
 		goto disconnect;
 	}
 
-	peer_device->max_bio_size = min(be32_to_cpu(p->max_bio_size), DRBD_MAX_BIO_SIZE);
+	peer_device->max_bio_size = min(be32_to_cpu(p->max_bio_size), drbd_max_repl_size());
 	ddsf = be16_to_cpu(p->dds_flags);
 
 	is_handshake = (peer_device->repl_state[NOW] == L_OFF);
@@ -5947,6 +7258,7 @@ static int process_twopc(struct drbd_connection *connection,
 			  "state change %u.\n",
 			  resource->twopc_reply.tid,
 			  reply->tid);
+		connection->twopc_stats.yielded++;
 		alt_rv = abort_local_transaction(resource, reply->tid);
 		if (alt_rv == ALT_MATCH) {
 			/* abort_local_transaction() comes back unlocked in this case... */
@@ -5957,6 +7269,7 @@ static int process_twopc(struct drbd_connection *connection,
 				  "failed. Rejecting remote state change %u.\n",
 				  resource->twopc_reply.tid,
 				  reply->tid);
+			connection->twopc_stats.rejected++;
 			drbd_send_twopc_reply(connection, P_TWOPC_RETRY, reply);
 			return 0;
 		}
@@ -5997,6 +7310,7 @@ static int process_twopc(struct drbd_connection *connection,
 				  "state change %u\n",
 				  reply->tid,
 				  resource->twopc_reply.tid);
+			connection->twopc_stats.rejected++;
 			drbd_send_twopc_reply(connection, P_TWOPC_RETRY, reply);
 			return 0;
 		}
@@ -6645,6 +7959,15 @@ static int dcbp_get_pad_bits(struct p_compressed_bm *p)
 	return (p->encoding >> 4) & 0x7;
 }
 
+static void bm_runs_add(struct drbd_peer_device *peer_device, struct drbd_bm_runs *runs,
+			unsigned long s, unsigned long e)
+{
+	runs->start[runs->n] = s;
+	runs->end[runs->n] = e;
+	if (++runs->n == DRBD_BM_RUNS)
+		drbd_bm_set_runs(peer_device, runs);
+}
+
 /**
  * recv_bm_rle_bits
  *
@@ -6657,6 +7980,7 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 		 struct bm_xfer_ctx *c,
 		 unsigned int len)
 {
+	struct drbd_bm_runs runs = { .n = 0 };
 	struct bitstream bs;
 	u64 look_ahead;
 	u64 rl;
@@ -6666,6 +7990,7 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 	int toggle = dcbp_get_start(p);
 	int have;
 	int bits;
+	int err = -EIO;
 
 	bitstream_init(&bs, p->code, len, dcbp_get_pad_bits(p));
 
@@ -6675,16 +8000,14 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 
 	for (have = bits; have > 0; s += rl, toggle = !toggle) {
 		bits = vli_decode_bits(&rl, look_ahead);
-		if (bits <= 0)
-			return -EIO;
 
 		if (toggle) {
 			e = s + rl -1;
 			if (e >= c->bm_bits) {
 				drbd_err(peer_device, "bitmap overflow (e:%lu) while decoding bm RLE packet\n", e);
-				return -EIO;
+				goto out;
 			}
-			drbd_bm_set_many_bits(peer_device, s, e);
+			bm_runs_add(peer_device, &runs, s, e);
 		}
 
 		if (have < bits) {
@@ -6692,7 +8015,7 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 				have, bits, look_ahead,
 				(unsigned int)(bs.cur.b - p->code),
 				(unsigned int)bs.buf_len);
-			return -EIO;
+			goto out;
 		}
 		/* if we consumed all 64 bits, assign 0; >> 64 is "undefined"; */
 		if (likely(bits < 64))
@@ -6701,19 +8024,108 @@ recv_bm_rle_bits(struct drbd_peer_device *peer_device,
 			look_ahead = 0;
 		have -= bits;
 
+		/* Most codes are short: refill only once the next one
+		 * is not completely in look_ahead any more. */
+		if (have >= 8 && have >= vli_code_bits(look_ahead))
+			continue;
+
 		bits = bitstream_get_bits(&bs, &tmp, 64 - have);
 		if (bits < 0)
-			return -EIO;
+			goto out;
 		look_ahead |= tmp << have;
 		have += bits;
 	}
 
+	c->bit_offset = s;
+	bm_xfer_ctx_bit_to_word_offset(c);
+	err = (s != c->bm_bits);
+out:
+	drbd_bm_set_runs(peer_device, &runs);
+	return err;
+}
+
+/**
+ * recv_bm_rc_bits
+ *
+ * Same as recv_bm_rle_bits(), for DRBD_BM_CODE_RLE_RC.
+ */
+static int
+recv_bm_rc_bits(struct drbd_peer_device *peer_device,
+		struct p_compressed_bm *p,
+		struct bm_xfer_ctx *c,
+		unsigned int len)
+{
+	struct drbd_bm_runs runs = { .n = 0 };
+	struct drbd_bm_rc_model *model;
+	struct rc_decoder rc;
+	unsigned long s = c->bit_offset;
+	unsigned int runs;
+	int toggle = dcbp_get_start(p);
+	int err = 0;
+	u64 rl;
+
+	if (len < sizeof(__be32))
+		return -EIO;
+	runs = be32_to_cpu(*(__be32 *)p->code);
+
+	model = kmalloc(sizeof(*model), GFP_NOIO);
+	if (!model)
+		return -ENOMEM;
+	rc_model_init(model);
+	rc_dec_init(&rc, p->code + sizeof(__be32), len - sizeof(__be32));
+
+	for (; runs; runs--, s += rl, toggle = !toggle) {
+		rl = rc_decode_runlength(&rc, model, toggle);
+		if (rc.overrun || rl > c->bm_bits - s) {
+			drbd_err(peer_device, "bitmap decoding error: s:%lu rl:%llu l:%u\n",
+				 s, rl, len);
+			err = -EIO;
+			break;
+		}
+		if (toggle)
+			bm_runs_add(peer_device, &runs, s, s + rl - 1);
+	}
+	drbd_bm_set_runs(peer_device, &runs);
+	kfree(model);
+	if (err)
+		return err;
+
 	c->bit_offset = s;
 	bm_xfer_ctx_bit_to_word_offset(c);
 
 	return (s != c->bm_bits);
 }
 
+/* Returns 1 if the bitmap digest of the peer matches ours, 0 if not */
+static int receive_bitmap_digest(struct drbd_peer_device *peer_device,
+				 struct p_compressed_bm *p, unsigned int len)
+{
+	struct drbd_device *device = peer_device->device;
+	__be64 *d = (__be64 *)p->code;
+	bool full_sync = false;
+	u64 digest;
+	int err;
+
+	if (len < sizeof(*p) + 2 * sizeof(*d)) {
+		drbd_err(peer_device, "bitmap digest packet too small (l:%u)\n", len);
+		return -EIO;
+	}
+
+	/* _drbd_send_bitmap() sets all bits first */
+	if (get_ldev(device)) {
+		full_sync = drbd_md_test_peer_flag(peer_device, MDF_PEER_FULL_SYNC);
+		put_ldev(device);
+	}
+	if (full_sync)
+		return 0;
+	err = drbd_bm_digest(peer_device, &digest);
+	if (err)
+		return err;
+
+	return be64_to_cpu(d[0]) == digest &&
+		be64_to_cpu(d[1]) == drbd_bm_total_weight(peer_device);
+}
+
 /**
  * decode_bitmap_c
  *
@@ -6728,6 +8140,9 @@ decode_bitmap_c(struct drbd_peer_device *peer_device,
 {
 	if (dcbp_get_code(p) == RLE_VLI_Bits)
 		return recv_bm_rle_bits(peer_device, p, c, len - sizeof(*p));
+	if (dcbp_get_code(p) == DRBD_BM_CODE_RLE_RC &&
+	    peer_device->connection->agreed_features & DRBD_FF_BM_CODEC)
+		return recv_bm_rc_bits(peer_device, p, c, len - sizeof(*p));
 
 	/* other variants had been implemented for evaluation,
 	 * but have been dropped as this one turned out to be "best"
@@ -6747,7 +8162,7 @@ void INFO_bm_xfer_stats(struct drbd_peer_device *peer_device,
 	unsigned int plain =
 		header_size * (DIV_ROUND_UP(c->bm_words, data_size) + 1) +
 		c->bm_words * sizeof(unsigned long);
-	unsigned int total = c->bytes[0] + c->bytes[1];
+	unsigned int total = c->bytes[0] + c->bytes[1] + c->bytes[2];
 	unsigned int r;
 
 	/* total can not be zero. but just in case: */
@@ -6766,12 +8181,21 @@ void INFO_bm_xfer_stats(struct drbd_peer_device *peer_device,
 		r = 1000;
 
 	r = 1000 - r;
-	drbd_info(peer_device, "%s bitmap stats [Bytes(packets)]: plain %u(%u), RLE %u(%u), "
-	     "total %u; compression: %u.%u%%\n",
-			direction,
-			c->bytes[1], c->packets[1],
-			c->bytes[0], c->packets[0],
-			total, r/10, r % 10);
+	if (c->packets[2])
+		drbd_info(peer_device, "%s bitmap stats [Bytes(packets)]: plain %u(%u), RLE %u(%u), "
+		     "range coded %u(%u), total %u; compression: %u.%u%%\n",
+				direction,
+				c->bytes[1], c->packets[1],
+				c->bytes[0], c->packets[0],
+				c->bytes[2], c->packets[2],
+				total, r/10, r % 10);
+	else
+		drbd_info(peer_device, "%s bitmap stats [Bytes(packets)]: plain %u(%u), RLE %u(%u), "
+		     "total %u; compression: %u.%u%%\n",
+				direction,
+				c->bytes[1], c->packets[1],
+				c->bytes[0], c->packets[0],
+				total, r/10, r % 10);
 }
 
 static enum drbd_disk_state read_disk_state(struct drbd_device *device)
@@ -6799,6 +8223,7 @@ static int receive_bitmap(struct drbd_connection *connection, struct packet_info
 	struct drbd_peer_device *peer_device;
 	struct drbd_device *device;
 	struct bm_xfer_ctx c;
+	int digest_match = -1; /* no digest received */
 	int err;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
@@ -6824,6 +8249,8 @@ static int receive_bitmap(struct drbd_connection *connection, struct packet_info
 	};
 
 	for(;;) {
+		int stats = pi->cmd == P_BITMAP;
+
 		if (pi->cmd == P_BITMAP)
 			err = receive_bitmap_plain(peer_device, pi->size, &c);
 		else if (pi->cmd == P_COMPRESSED_BITMAP) {
@@ -6844,15 +8271,33 @@ static int receive_bitmap(struct drbd_connection *connection, struct packet_info
 			err = drbd_recv_all(connection, (void **)&p, pi->size);
 			if (err)
 			       goto out;
+			if (dcbp_get_code(p) == DRBD_BM_CODE_DIGEST &&
+			    !(connection->agreed_features & DRBD_FF_BM_DIGEST)) {
+				drbd_err(device, "unexpected bitmap digest\n");
+				err = -EIO;
+				goto out;
+			}
+			if (dcbp_get_code(p) == DRBD_BM_CODE_DIGEST && c.packets[0] + c.packets[1] +
+			    c.packets[2] == 0) {
+				/* the digest is all we get */
+				digest_match = receive_bitmap_digest(peer_device, p, pi->size);
+				if (digest_match < 0) {
+					err = digest_match;
+					goto out;
+				}
+				break;
+			}
 			err = decode_bitmap_c(peer_device, p, &c, pi->size);
+			if (dcbp_get_code(p) == DRBD_BM_CODE_RLE_RC)
+				stats = 2;
 		} else {
 			drbd_warn(device, "receive_bitmap: cmd neither ReportBitMap nor ReportCBitMap (is 0x%x)", pi->cmd);
 			err = -EIO;
 			goto out;
 		}
 
-		c.packets[pi->cmd == P_BITMAP]++;
-		c.bytes[pi->cmd == P_BITMAP] += drbd_header_size(connection) + pi->size;
+		c.packets[stats]++;
+		c.bytes[stats] += drbd_header_size(connection) + pi->size;
 
 		if (err <= 0) {
 			if (err < 0)
@@ -6864,17 +8309,42 @@ static int receive_bitmap(struct drbd_connection *connection, struct packet_info
 			goto out;
 	}
 
-	INFO_bm_xfer_stats(peer_device, "receive", &c);
+	if (digest_match < 0)
+		INFO_bm_xfer_stats(peer_device, "receive", &c);
+	else if (digest_match)
+		drbd_info(peer_device, "bitmap digests match, skipping bitmap exchange\n");
 
 	if (peer_device->repl_state[NOW] == L_WF_BITMAP_T) {
-		err = drbd_send_bitmap(device, peer_device);
+		if (digest_match == 1) {
+			err = drbd_send_bitmap_digest(peer_device);
+		} else if (digest_match == 0) {
+			/* The peer merges our bitmap, then sends us its own */
+			err = drbd_send_bitmap(device, peer_device);
+			set_bit(BITMAP_SENT_FIRST, &peer_device->flags);
+			goto out;
+		} else if (!test_and_clear_bit(BITMAP_SENT_FIRST, &peer_device->flags)) {
+			err = drbd_send_bitmap(device, peer_device);
+		}
 		if (err)
 			goto out;
 		/* Omit CS_WAIT_COMPLETE and CS_SERIALIZE with this state
 		 * transition to avoid deadlocks. */
 
 		drbd_start_resync(peer_device, L_SYNC_TARGET);
-	} else if (peer_device->repl_state[NOW] != L_WF_BITMAP_S) {
+	} else if (peer_device->repl_state[NOW] == L_WF_BITMAP_S) {
+		if (digest_match == 0) {
+			/* the peer answers our digest only if it matches */
+			drbd_err(peer_device, "bitmap digest answer does not match\n");
+			err = -EIO;
+			goto out;
+		}
+		/* The peer had a different bitmap, now it expects ours */
+		if (digest_match < 0 && test_bit(BITMAP_DIGEST_SENT, &peer_device->flags))
+			err = drbd_send_bitmap(device, peer_device);
+		clear_bit(BITMAP_DIGEST_SENT, &peer_device->flags);
+		if (err)
+			goto out;
+	} else {
 		/* admin may have requested C_DISCONNECTING,
 		 * other threads may have noticed network errors */
 		drbd_info(peer_device, "unexpected repl_state (%s) in receive_bitmap\n",
@@ -6936,11 +8406,8 @@ static int receive_out_of_sync(struct drbd_connection *connection, struct packet
 
 	mutex_lock(&peer_device->resync_next_bit_mutex);
 
-	if (peer_device->repl_state[NOW] == L_SYNC_TARGET) {
-		unsigned long bit = BM_SECT_TO_BIT(sector);
-		if (bit < peer_device->resync_next_bit)
-			peer_device->resync_next_bit = bit;
-	}
+	if (peer_device->repl_state[NOW] == L_SYNC_TARGET)
+		drbd_rs_rewind(peer_device, BM_SECT_TO_BIT(sector));
 
 	drbd_set_out_of_sync(peer_device, sector, be32_to_cpu(p->blksize));
 
@@ -7167,7 +8634,10 @@ static int receive_rs_deallocated(struct drbd_connection *connection, struct pac
 		spin_unlock_irq(&connection->peer_reqs_lock);
 
 		atomic_add(pi->size >> 9, &device->rs_sect_ev);
-		err = drbd_submit_peer_request(peer_req);
+		if (READ_ONCE(drbd_resync_interval_lock))
+			err = drbd_rs_lock_interval(peer_req);
+		if (!err)
+			err = drbd_submit_peer_request(peer_req);
 
 		if (err) {
 			spin_lock_irq(&connection->peer_reqs_lock);
@@ -7315,6 +8785,9 @@ static void cleanup_resync_leftovers(struct drbd_peer_device *peer_device)
 	del_timer_sync(&peer_device->resync_timer);
 	resync_timer_fn(&peer_device->resync_timer);
 	del_timer_sync(&peer_device->start_resync_timer);
+	del_timer_sync(&peer_device->verify_resume_timer);
+	clear_bit(BITMAP_DIGEST_SENT, &peer_device->flags);
+	clear_bit(BITMAP_SENT_FIRST, &peer_device->flags);
 }
 
 static void drain_resync_activity(struct drbd_connection *connection)
@@ -7446,7 +8919,12 @@ void conn_disconnect(struct drbd_connection *connection)
 	/* ack_receiver does not clean up anything. it must not interfere, either */
 	drbd_thread_stop(&connection->ack_receiver);
 	if (connection->ack_sender) {
-		destroy_workqueue(connection->ack_sender);
+		if (connection->ack_sender == drbd_ack_sender_wq) {
+			flush_work(&connection->send_acks_work);
+			flush_work(&connection->peer_ack_work);
+		} else {
+			destroy_workqueue(connection->ack_sender);
+		}
 		connection->ack_sender = NULL;
 	}
 
@@ -7464,6 +8942,9 @@ void conn_disconnect(struct drbd_connection *connection)
 	 * peer_request queued to the submitter workqueue. */
 	conn_wait_ee_empty(connection, &connection->active_ee);
 
+	/* and for the epochs of those to be finished, drbd_flush_epoch_async() */
+	wait_event(connection->ee_wait, !atomic_read(&connection->epoch_flushes));
+
 	/* wait for all w_e_end_data_req, w_e_end_rsdata_req, w_send_barrier,
 	 * w_make_resync_request etc. which may still be on the worker queue
 	 * to be "canceled" */
@@ -7506,6 +8987,11 @@ void conn_disconnect(struct drbd_connection *connection)
 	cleanup_unacked_peer_requests(connection);
 	cleanup_peer_ack_list(connection);
 
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, peer_device, vnr)
+		drbd_rs_pool_drain(peer_device);
+	rcu_read_unlock();
+
 	i = atomic_read(&connection->pp_in_use);
 	if (i)
 		drbd_info(connection, "pp_in_use = %d, expected 0\n", i);
@@ -7558,7 +9044,11 @@ static int drbd_send_features(struct drbd_connection *connection)
 	p->protocol_max = cpu_to_be32(PRO_VERSION_MAX);
 	p->sender_node_id = cpu_to_be32(connection->resource->res_opts.node_id);
 	p->receiver_node_id = cpu_to_be32(connection->peer_node_id);
-	p->feature_flags = cpu_to_be32(PRO_FEATURES);
+	BUILD_BUG_ON(PRO_FEATURES & DRBD_FF_EXT_MASK);
+	BUILD_BUG_ON((DP_RW_SYNC | DP_MAY_SET_IN_SYNC | DP_FUA | DP_FLUSH | DP_DISCARD |
+		      DP_SEND_RECEIVE_ACK | DP_SEND_WRITE_ACK | DP_WSAME | DP_ZEROES) &
+		     DP_EXT_MASK);
+	p->feature_flags = cpu_to_be32(PRO_FEATURES | drbd_local_features());
 	return __send_command(connection, -1, P_CONNECTION_FEATURES, DATA_STREAM);
 }
 
@@ -7620,7 +9110,8 @@ int drbd_do_features(struct drbd_connection *connection)
 	}
 
 	connection->agreed_pro_version = min_t(int, PRO_VERSION_MAX, p->protocol_max);
-	connection->agreed_features = PRO_FEATURES & be32_to_cpu(p->feature_flags);
+	connection->agreed_features =
+		(PRO_FEATURES | drbd_local_features()) & be32_to_cpu(p->feature_flags);
 
 	if (be32_to_cpu(p->sender_node_id) != connection->peer_node_id) {
 		drbd_err(connection, "Peer presented a node_id of %d instead of %d\n",
@@ -7638,12 +9129,20 @@ int drbd_do_features(struct drbd_connection *connection)
 			connection->peer_node_id,
 			connection->agreed_pro_version);
 
-	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s%s.\n",
+	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s%s%s%s%s%s%s%s%s%s.\n",
 		  connection->agreed_features,
 		  connection->agreed_features & DRBD_FF_TRIM ? " TRIM" : "",
 		  connection->agreed_features & DRBD_FF_THIN_RESYNC ? " THIN_RESYNC" : "",
 		  connection->agreed_features & DRBD_FF_WSAME ? " WRITE_SAME" : "",
-		  connection->agreed_features & DRBD_FF_WZEROES ? " WRITE_ZEROES" :
+		  connection->agreed_features & DRBD_FF_WZEROES ? " WRITE_ZEROES" : "",
+		  connection->agreed_features & DRBD_FF_BM_CODEC ? " BM_CODEC" : "",
+		  connection->agreed_features & DRBD_FF_BM_DIGEST ? " BM_DIGEST" : "",
+		  connection->agreed_features & DRBD_FF_COMPRESS_LZ4 ? " COMPRESS_LZ4" : "",
+		  connection->agreed_features & DRBD_FF_COMPRESS_ZSTD ? " COMPRESS_ZSTD" : "",
+		  connection->agreed_features & DRBD_FF_RS_DEDUPE ? " RS_DEDUPE" : "",
+		  connection->agreed_features & DRBD_FF_IO_HINTS ? " IO_HINTS" : "",
+		  connection->agreed_features & DRBD_FF_OV_TREE ? " OV_TREE" : "",
+		  connection->agreed_features & DRBD_FF_BLOCK_ACKS ? " BLOCK_ACKS" :
 		  connection->agreed_features ? "" : " none");
 
 	return 1;
@@ -7969,12 +9468,17 @@ static int got_twopc_reply(struct drbd_connection *connection, struct packet_inf
 			}
 		}
 
-		if (pi->cmd == P_TWOPC_YES)
+		connection->twopc_stats.reply.bucket[drbd_lat_bucket(connection->twopc_stats.sent_kt)]++;
+		if (pi->cmd == P_TWOPC_YES) {
 			set_bit(TWOPC_YES, &connection->flags);
-		else if (pi->cmd == P_TWOPC_NO)
+			connection->twopc_stats.yes++;
+		} else if (pi->cmd == P_TWOPC_NO) {
 			set_bit(TWOPC_NO, &connection->flags);
-		else if (pi->cmd == P_TWOPC_RETRY)
+			connection->twopc_stats.no++;
+		} else if (pi->cmd == P_TWOPC_RETRY) {
 			set_bit(TWOPC_RETRY, &connection->flags);
+			connection->twopc_stats.retry++;
+		}
 		if (cluster_wide_reply_ready(resource)) {
 			int my_node_id = resource->res_opts.node_id;
 			if (resource->twopc_reply.initiator_node_id == my_node_id) {
@@ -8048,9 +9552,11 @@ static int got_IsInSync(struct drbd_connection *connection, struct packet_info *
 
 	if (get_ldev(device)) {
 		drbd_rs_complete_io(peer_device, sector);
+		rs_set_in_sync_co_sources(peer_device, sector, blksize);
 		drbd_set_in_sync(peer_device, sector, blksize);
 		/* rs_same_csums is supposed to count in units of BM_BLOCK_SIZE */
 		peer_device->rs_same_csum += (blksize >> BM_BLOCK_SHIFT);
+		atomic_add(blksize >> BM_BLOCK_SHIFT, &peer_device->rs_csum_win_same);
 		put_ldev(device);
 	}
 	dec_rs_pending(peer_device);
@@ -8067,9 +9573,15 @@ validate_req_change_req_state(struct drbd_peer_device *peer_device, u64 id, sect
 	struct drbd_device *device = peer_device->device;
 	struct drbd_request *req;
 
-	spin_lock_irq(&device->interval_lock);
-	req = find_request(device, root, id, sector, missing_ok, func);
-	spin_unlock_irq(&device->interval_lock);
+	if (root) {
+		drbd_lock_irq(&device->interval_lock, &device->interval_lock_stat);
+		req = find_request(device, root, id, sector, missing_ok, func);
+		drbd_unlock_irq(&device->interval_lock, &device->interval_lock_stat);
+	} else {
+		drbd_write_lock_irq(device, sector, 0);
+		req = find_request(device, NULL, id, sector, missing_ok, func);
+		drbd_write_unlock_irq(device, sector, 0);
+	}
 	if (unlikely(!req))
 		return -EIO;
 	req_mod(req, what, peer_device);
@@ -8092,6 +9604,7 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 	device = peer_device->device;
 
 	update_peer_seq(peer_device, be32_to_cpu(p->seq_num));
+	trace_drbd_got_block_ack(peer_device, sector, blksize, pi->cmd);
 
 	if (p->block_id == ID_SYNCER) {
 		drbd_set_in_sync(peer_device, sector, blksize);
@@ -8099,6 +9612,10 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 		atomic_sub(blksize >> 9, &connection->rs_in_flight);
 		return 0;
 	}
+	if (p->block_id == cpu_to_be64(ID_SYNCER_DEDUPE)) {
+		drbd_set_in_sync(peer_device, sector, blksize);
+		return 0;
+	}
 	switch (pi->cmd) {
 	case P_RS_WRITE_ACK:
 		what = WRITE_ACKED_BY_PEER_AND_SIS;
@@ -8107,6 +9624,8 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 		what = WRITE_ACKED_BY_PEER;
 		break;
 	case P_RECV_ACK:
+		if (drbd_latency_probe_ack(connection, p->block_id))
+			return 0;
 		what = RECV_ACKED_BY_PEER;
 		break;
 	case P_SUPERSEDED:
@@ -8120,8 +9639,34 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 	}
 
 	return validate_req_change_req_state(peer_device, p->block_id, sector,
-					     &device->write_requests, __func__,
-					     what, false);
+					     NULL, __func__, what, false);
+}
+
+static int got_BlockAcks(struct drbd_connection *connection, struct packet_info *pi)
+{
+	struct p_block_acks *p = pi->data;
+	unsigned int size = pi->size - sizeof(*p);
+	struct packet_info ack_pi = *pi;
+	unsigned int i;
+	int err;
+
+	ack_pi.cmd = be32_to_cpu(p->cmd);
+	ack_pi.size = sizeof(p->acks[0]);
+	if (!(connection->agreed_features & DRBD_FF_BLOCK_ACKS) ||
+	    (ack_pi.cmd != P_WRITE_ACK && ack_pi.cmd != P_RECV_ACK) ||
+	    !size || size % sizeof(p->acks[0])) {
+		drbd_err(connection, "unexpected P_BLOCK_ACKS (cmd: %u, size: %u)\n",
+			 ack_pi.cmd, pi->size);
+		return -EIO;
+	}
+
+	for (i = 0; i < size / sizeof(p->acks[0]); i++) {
+		ack_pi.data = &p->acks[i];
+		err = got_BlockAck(connection, &ack_pi);
+		if (err)
+			return err;
+	}
+	return 0;
 }
 
 static int got_NegAck(struct drbd_connection *connection, struct packet_info *pi)
@@ -8148,10 +9693,13 @@ static int got_NegAck(struct drbd_connection *connection, struct packet_info *pi
 		drbd_rs_failed_io(peer_device, sector, size);
 		return 0;
 	}
+	if (p->block_id == cpu_to_be64(ID_SYNCER_DEDUPE)) {
+		drbd_rs_failed_io(peer_device, sector, size);
+		return 0;
+	}
 
 	err = validate_req_change_req_state(peer_device, p->block_id, sector,
-					    &device->write_requests, __func__,
-					    NEG_ACKED, true);
+					    NULL, __func__, NEG_ACKED, true);
 	if (err) {
 		/* Protocol A has no P_WRITE_ACKs, but has P_NEG_ACKs.
 		   The master bio might already be completed, therefore the
@@ -8221,7 +9769,7 @@ static int got_NegRSDReply(struct drbd_connection *connection, struct packet_inf
 			} else {
 				bit = BM_SECT_TO_BIT(sector);
 				mutex_lock(&peer_device->resync_next_bit_mutex);
-				peer_device->resync_next_bit = min(peer_device->resync_next_bit, bit);
+				drbd_rs_rewind(peer_device, bit);
 				mutex_unlock(&peer_device->resync_next_bit_mutex);
 			}
 
@@ -8261,6 +9809,7 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 	struct drbd_device *device;
 	struct p_block_ack *p = pi->data;
 	sector_t sector;
+	u64 block_id;
 	int size;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
@@ -8270,12 +9819,20 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 
 	sector = be64_to_cpu(p->sector);
 	size = be32_to_cpu(p->blksize);
+	block_id = be64_to_cpu(p->block_id);
+
+	if (block_id == ID_OV_DESCEND && !(connection->agreed_features & DRBD_FF_OV_TREE)) {
+		drbd_err(device, "unexpected ID_OV_DESCEND\n");
+		return -EIO;
+	}
 
 	update_peer_seq(peer_device, be32_to_cpu(p->seq_num));
 
-	if (be64_to_cpu(p->block_id) == ID_OUT_OF_SYNC)
+	/* For ID_OV_DESCEND, the VerifyS node requests the sub-ranges next,
+	 * their results account for the blocks of this range. */
+	if (block_id == ID_OUT_OF_SYNC)
 		drbd_ov_out_of_sync_found(peer_device, sector, size);
-	else
+	else if (block_id != ID_OV_DESCEND)
 		ov_out_of_sync_print(peer_device);
 
 	if (!get_ldev(device))
@@ -8284,7 +9841,8 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 	drbd_rs_complete_io(peer_device, sector);
 	dec_rs_pending(peer_device);
 
-	verify_progress(peer_device, sector, size);
+	if (block_id != ID_OV_DESCEND)
+		verify_progress(peer_device, sector, size);
 
 	put_ldev(device);
 	return 0;
@@ -8467,9 +10025,9 @@ static void cleanup_peer_ack_list(struct drbd_connection *connection)
 {
 	struct drbd_resource *resource = connection->resource;
 	struct drbd_peer_ack *peer_ack, *tmp;
-	struct drbd_request *req;
 	int idx = connection->peer_node_id;
 	u64 node_id_mask = NODE_MASK(idx);
+	int cpu;
 
 	spin_lock_irq(&resource->peer_ack_lock);
 	list_for_each_entry_safe(peer_ack, tmp, &resource->peer_ack_list, list) {
@@ -8478,15 +10036,21 @@ static void cleanup_peer_ack_list(struct drbd_connection *connection)
 		peer_ack->pending_mask &= ~node_id_mask;
 		drbd_destroy_peer_ack_if_done(peer_ack);
 	}
-	req = resource->peer_ack_req;
-	if (req)
-		req->net_rq_state[idx] &= ~RQ_NET_SENT;
+	for_each_possible_cpu(cpu) {
+		struct drbd_peer_ack_cpu *pa = per_cpu_ptr(resource->peer_ack_cpu, cpu);
+
+		spin_lock(&pa->lock);
+		if (pa->req)
+			pa->req->net_rq_state[idx] &= ~RQ_NET_SENT;
+		spin_unlock(&pa->lock);
+	}
 	spin_unlock_irq(&resource->peer_ack_lock);
 }
 
 struct meta_sock_cmd {
 	size_t pkt_size;
 	int (*fn)(struct drbd_connection *connection, struct packet_info *);
+	size_t max_extra;	/* packets of variable size, on top of pkt_size */
 };
 
 static void set_rcvtimeo(struct drbd_connection *connection, bool ping_timeout)
@@ -8542,6 +10106,8 @@ static struct meta_sock_cmd ack_receiver_tbl[] = {
 	[P_TWOPC_YES]       = { sizeof(struct p_twopc_reply), got_twopc_reply },
 	[P_TWOPC_NO]        = { sizeof(struct p_twopc_reply), got_twopc_reply },
 	[P_TWOPC_RETRY]     = { sizeof(struct p_twopc_reply), got_twopc_reply },
+	[P_BLOCK_ACKS]      = { sizeof(struct p_block_acks), got_BlockAcks,
+				DRBD_BLOCK_ACKS_MAX * sizeof(struct p_block_ack) },
 };
 
 int drbd_ack_receiver(struct drbd_thread *thi)
@@ -8639,6 +10205,7 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 		if (received == expect && cmd == NULL) {
 			if (decode_header(connection, buffer, &pi))
 				goto reconnect;
+			connection->packets_received[CONTROL_STREAM]++;
 
 			cmd = &ack_receiver_tbl[pi.cmd];
 			if (pi.cmd >= ARRAY_SIZE(ack_receiver_tbl) || !cmd->fn) {
@@ -8646,8 +10213,8 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 					 drbd_packet_name(pi.cmd), pi.cmd);
 				goto disconnect;
 			}
-			expect = header_size + cmd->pkt_size;
-			if (pi.size != expect - header_size) {
+			expect = header_size + pi.size;
+			if (pi.size < cmd->pkt_size || pi.size > cmd->pkt_size + cmd->max_extra) {
 				drbd_err(connection, "Wrong packet size on meta (c: %d, l: %d)\n",
 					pi.cmd, pi.size);
 				goto reconnect;
@@ -8692,11 +10259,10 @@ disconnect:
 	return 0;
 }
 
-void drbd_send_acks_wf(struct work_struct *ws)
+static void drbd_send_acks(struct drbd_connection *connection)
 {
-	struct drbd_connection *connection =
-		container_of(ws, struct drbd_connection, send_acks_work);
 	struct drbd_transport *transport = &connection->transport;
+	unsigned int ack_coalesce = READ_ONCE(drbd_ack_coalesce);
 	struct net_conf *nc;
 	int tcp_cork, err;
 
@@ -8705,8 +10271,14 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	tcp_cork = nc->tcp_cork;
 	rcu_read_unlock();
 
-	/* TODO: conditionally cork; it may hurt latency if we cork without
-	   much to send */
+	/* Corking costs latency if there is not much to send.  But with a
+	 * backlog of completed peer requests, their acks better share a few
+	 * segments, instead of each P_WRITE_ACK/P_RECV_ACK going out (and
+	 * waking the peer's ack receiver) on its own. */
+	if (!tcp_cork && ack_coalesce &&
+	    atomic_read(&connection->done_ee_cnt) >= ack_coalesce)
+		tcp_cork = true;
+
 	if (tcp_cork)
 		drbd_cork(connection, CONTROL_STREAM);
 	err = drbd_finish_peer_reqs(connection);
@@ -8719,6 +10291,32 @@ void drbd_send_acks_wf(struct work_struct *ws)
 		change_cstate(connection, C_NETWORK_FAILURE, CS_HARD);
 }
 
+/* Only one context finishes peer requests at a time: the acks, and the
+ * barrier acks behind them, leave in the order the writes completed. */
+void drbd_send_acks_wf(struct work_struct *ws)
+{
+	struct drbd_connection *connection =
+		container_of(ws, struct drbd_connection, send_acks_work);
+
+	mutex_lock(&connection->send_acks_mutex);
+	drbd_send_acks(connection);
+	mutex_unlock(&connection->send_acks_mutex);
+}
+
+/* See inline_acks. Called from the completion of a peer write in task
+ * context, with nothing held; anything that would make us wait goes to the
+ * ack sender instead. */
+void drbd_send_acks_inline(struct drbd_connection *connection)
+{
+	if (!mutex_is_locked(&connection->mutex[CONTROL_STREAM]) &&
+	    mutex_trylock(&connection->send_acks_mutex)) {
+		drbd_send_acks(connection);
+		mutex_unlock(&connection->send_acks_mutex);
+	} else {
+		queue_work(connection->ack_sender, &connection->send_acks_work);
+	}
+}
+
 void drbd_send_peer_ack_wf(struct work_struct *ws)
 {
 	struct drbd_connection *connection =
@@ -17,6 +17,7 @@
 #include <linux/drbd.h>
 #include "drbd_int.h"
 #include "drbd_req.h"
+#include "drbd_trace.h"
 
 static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector, int size);
 
@@ -39,7 +40,7 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 {
 	struct drbd_request *req;
 
-	req = mempool_alloc(&drbd_request_mempool, GFP_NOIO);
+	req = drbd_mempool_cache_alloc(&drbd_request_mag, GFP_NOIO);
 	if (!req)
 		return NULL;
 
@@ -80,7 +81,7 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 void drbd_reclaim_req(struct rcu_head *rp)
 {
 	struct drbd_request *req = container_of(rp, struct drbd_request, rcu);
-	mempool_free(req, &drbd_request_mempool);
+	drbd_mempool_cache_free(&drbd_request_mag, req);
 }
 
 static u64 peer_ack_mask(struct drbd_request *req)
@@ -188,24 +189,243 @@ static bool peer_ack_differs(struct drbd_request *req1, struct drbd_request *req
 	return false;
 }
 
-static bool peer_ack_window_full(struct drbd_request *req)
+/* Nodes a request is RQ_NET_OK for; only looks at net_rq_state, so it can be
+ * used with local irq disabled, unlike peer_ack_mask(). */
+static u64 peer_ack_ok_nodes(struct drbd_request *req)
+{
+	unsigned int max_node_id = req->device->resource->max_node_id;
+	unsigned int node_id;
+	u64 nodes = 0;
+
+	for (node_id = 0; node_id <= max_node_id; node_id++)
+		if (req->net_rq_state[node_id] & RQ_NET_OK)
+			nodes |= NODE_MASK(node_id);
+	return nodes;
+}
+
+static bool peer_ack_window_full(struct drbd_request *req, u64 first_dagtag)
 {
 	struct drbd_resource *resource = req->device->resource;
 	u32 peer_ack_window = resource->res_opts.peer_ack_window;
-	u64 last_dagtag = resource->last_peer_acked_dagtag + peer_ack_window;
 
-	return dagtag_newer_eq(req->dagtag_sector, last_dagtag);
+	return dagtag_newer_eq(req->dagtag_sector, first_dagtag + peer_ack_window);
+}
+
+/**
+ * __drbd_flush_peer_acks() - Queue the peer acks accumulated on all CPUs
+ * @resource:	DRBD resource.
+ *
+ * Collects the pending request of each CPU, and queues peer acks for them
+ * in dagtag order.  Of neighbours that ack the same set of nodes, only the
+ * newer one is kept, as a peer ack covers all older writes.
+ *
+ * Caller holds peer_ack_lock, with local irq disabled.
+ */
+void __drbd_flush_peer_acks(struct drbd_resource *resource)
+{
+	struct drbd_request *req, *tmp, *prev = NULL;
+	LIST_HEAD(pending);
+	int cpu;
+
+	lockdep_assert_held(&resource->peer_ack_lock);
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_peer_ack_cpu *pa = per_cpu_ptr(resource->peer_ack_cpu, cpu);
+		struct list_head *pos;
+
+		spin_lock(&pa->lock);
+		req = pa->req;
+		pa->req = NULL;
+		spin_unlock(&pa->lock);
+		if (!req)
+			continue;
+
+		/* few entries, keep them sorted by insertion */
+		list_for_each_prev(pos, &pending) {
+			tmp = list_entry(pos, struct drbd_request, list);
+			if (dagtag_newer_eq(req->dagtag_sector, tmp->dagtag_sector))
+				break;
+		}
+		list_add(&req->list, pos);
+	}
+
+	list_for_each_entry_safe(req, tmp, &pending, list) {
+		if (prev && !peer_ack_differs(prev, req)) {
+			list_del(&prev->list);
+			call_rcu(&prev->rcu, drbd_reclaim_req);
+		}
+		prev = req;
+	}
+
+	list_for_each_entry_safe(req, tmp, &pending, list) {
+		list_del(&req->list);
+		resource->last_peer_acked_dagtag = req->dagtag_sector;
+		drbd_queue_peer_ack(resource, req);
+	}
+}
+
+/* Merge a completed write into the peer ack pending on this CPU.  Only if it
+ * cannot be merged, all CPUs are flushed under peer_ack_lock.
+ *
+ * All requests in the per CPU slots are RQ_NET_OK for the same nodes,
+ * resource->peer_ack_ok_nodes. A write that was acked by a different set of
+ * nodes flushes all slots before it changes that set, so a peer ack never
+ * stands for writes that some of the nodes it names have not got.
+ *
+ * Caller has local irq disabled. */
+static void peer_ack_add(struct drbd_request *req, bool was_last_ref)
+{
+	struct drbd_device *device = req->device;
+	struct drbd_resource *resource = device->resource;
+	struct drbd_peer_ack_cpu *pa = this_cpu_ptr(resource->peer_ack_cpu);
+	u64 ok_nodes = peer_ack_ok_nodes(req);
+	struct drbd_request *peer_ack_req;
+
+	spin_lock(&pa->lock);
+	/* changed under peer_ack_lock, and only before all slots get flushed */
+	if (ok_nodes != READ_ONCE(resource->peer_ack_ok_nodes))
+		goto flush;
+	peer_ack_req = pa->req;
+	if (!peer_ack_req) {
+		pa->req = req;
+		pa->first_dagtag = req->dagtag_sector;
+		spin_unlock(&pa->lock);
+		return;
+	}
+	if (!peer_ack_differs(req, peer_ack_req) &&
+	    !(was_last_ref && atomic_read(&device->ap_actlog_cnt)) &&
+	    !peer_ack_window_full(req, pa->first_dagtag)) {
+		/* keep the newer one, it stands for the older one as well */
+		if (dagtag_newer_eq(req->dagtag_sector, peer_ack_req->dagtag_sector))
+			pa->req = req;
+		else
+			peer_ack_req = req;
+		spin_unlock(&pa->lock);
+		call_rcu(&peer_ack_req->rcu, drbd_reclaim_req);
+		return;
+	}
+flush:
+	spin_unlock(&pa->lock);
+
+	spin_lock(&resource->peer_ack_lock);
+	WRITE_ONCE(resource->peer_ack_ok_nodes, ok_nodes);
+	__drbd_flush_peer_acks(resource);
+
+	/* irq still disabled, so still on the same CPU.  Still under
+	 * peer_ack_lock, so that nobody changes peer_ack_ok_nodes again
+	 * before req is in its slot. */
+	spin_lock(&pa->lock);
+	peer_ack_req = pa->req;
+	pa->req = req;
+	pa->first_dagtag = req->dagtag_sector;
+	spin_unlock(&pa->lock);
+	spin_unlock(&resource->peer_ack_lock);
+	/* nobody but us adds to our slot, it was emptied by the flush */
+	WARN_ON_ONCE(peer_ack_req);
+}
+
+static struct rb_root *drbd_write_root(struct drbd_device *device, struct drbd_interval *i)
+{
+	if (drbd_write_spans(i->sector, i->size))
+		return &device->write_span;
+	return &drbd_write_shard(device, i->sector)->root;
+}
+
+/* caller must hold drbd_write_lock() for the range of the interval */
+void drbd_insert_write_interval(struct drbd_device *device, struct drbd_interval *i)
+{
+	drbd_insert_interval(drbd_write_root(device, i), i);
+}
+
+/* caller must hold drbd_write_lock() for the range of the interval */
+void drbd_remove_write_interval(struct drbd_device *device, struct drbd_interval *i)
+{
+	drbd_remove_interval(drbd_write_root(device, i), i);
+}
+
+/* Whether the write interval @i starting at @sector is known; we do not trust
+ * anything about @i but its address.  Caller must hold
+ * drbd_write_lock(device, sector, 0). */
+bool drbd_contains_write_interval(struct drbd_device *device, sector_t sector,
+				  struct drbd_interval *i)
+{
+	return drbd_contains_interval(&drbd_write_shard(device, sector)->root, sector, i) ||
+		drbd_contains_interval(&device->write_span, sector, i);
+}
+
+static struct rb_root *next_write_root(struct drbd_write_overlap *o)
+{
+	struct rb_root *root;
+
+	if (o->nr_shards) {
+		root = &o->device->write_shards[o->shard].root;
+		o->shard = (o->shard + 1) % DRBD_WRITE_SHARDS;
+		o->nr_shards--;
+		return root;
+	}
+	if (!o->span_done) {
+		o->span_done = true;
+		return &o->device->write_span;
+	}
+	return NULL;
+}
+
+struct drbd_interval *drbd_next_write_overlap(struct drbd_write_overlap *o,
+					      struct drbd_interval *i)
+{
+	struct rb_root *root;
+
+	if (i) {
+		i = drbd_next_overlap(i, o->sector, o->size);
+		if (i)
+			return i;
+	}
+	while ((root = next_write_root(o))) {
+		i = drbd_find_overlap(root, o->sector, o->size);
+		if (i)
+			return i;
+	}
+	return NULL;
+}
+
+/*
+ * drbd_find_write_overlap  -  start a walk over the overlapping write intervals
+ *
+ * Searches the tree of each shard the range touches, each one only once even
+ * if the range covers more than DRBD_WRITE_SHARDS regions, and then the
+ * write_span tree.
+ */
+struct drbd_interval *drbd_find_write_overlap(struct drbd_device *device,
+					      struct drbd_write_overlap *o,
+					      sector_t sector, unsigned int size)
+{
+	sector_t first = sector >> DRBD_WRITE_SHARD_SHIFT;
+	sector_t last = drbd_write_last_sector(sector, size) >> DRBD_WRITE_SHARD_SHIFT;
+
+	o->device = device;
+	o->sector = sector;
+	o->size = size;
+	o->shard = first % DRBD_WRITE_SHARDS;
+	o->nr_shards = min_t(sector_t, last - first + 1, DRBD_WRITE_SHARDS);
+	o->span_done = false;
+	return drbd_next_write_overlap(o, NULL);
 }
 
-static void drbd_remove_request_interval(struct rb_root *root,
-					 struct drbd_request *req)
+static void drbd_remove_request_interval(struct drbd_request *req, bool write)
 {
 	struct drbd_device *device = req->device;
 	struct drbd_interval *i = &req->i;
 
-	spin_lock(&device->interval_lock); /* local irq already disabled */
-	drbd_remove_interval(root, i);
-	spin_unlock(&device->interval_lock);
+	/* local irq already disabled */
+	if (write) {
+		drbd_write_lock(device, i->sector, i->size);
+		drbd_remove_write_interval(device, i);
+		drbd_write_unlock(device, i->sector, i->size);
+	} else {
+		drbd_lock(&device->interval_lock, &device->interval_lock_stat);
+		drbd_remove_interval(&device->read_requests, i);
+		drbd_unlock(&device->interval_lock, &device->interval_lock_stat);
+	}
 
 	/* Wake up any processes waiting for this request to complete.  */
 	if (i->waiting)
@@ -272,23 +492,26 @@ void drbd_req_destroy(struct kref *kref)
 		return;
 	}
 
-	spin_lock(&resource->tl_update_lock); /* local irq already disabled */
+	drbd_lock(&resource->tl_update_lock, &resource->tl_update_lock_stat); /* local irq already disabled */
 	destroy_next = req->destroy_next;
 	list_del_rcu(&req->tl_requests);
 	if (resource->tl_previous_write == req)
 		resource->tl_previous_write = NULL;
-	spin_unlock(&resource->tl_update_lock);
+	drbd_unlock(&resource->tl_update_lock, &resource->tl_update_lock_stat);
+
+	if (req->sbuf.bio) {
+		bio_put(req->sbuf.bio);
+		req->sbuf.bio = NULL;
+	}
+	if (req->payload) {
+		drbd_req_payload_free(req->payload);
+		req->payload = NULL;
+	}
 
 	/* finally remove the request from the conflict detection
 	 * respective block_id verification interval tree. */
 	if (!drbd_interval_empty(&req->i)) {
-		struct rb_root *root;
-
-		if (s & RQ_WRITE)
-			root = &device->write_requests;
-		else
-			root = &device->read_requests;
-		drbd_remove_request_interval(root, req);
+		drbd_remove_request_interval(req, s & RQ_WRITE);
 	} else if (s & (RQ_NET_MASK & ~RQ_NET_DONE) && req->i.size != 0)
 		drbd_err(device, "drbd_req_destroy: Logic BUG: interval empty, but: rq_state=0x%x, sect=%llu, size=%u\n",
 			s, (unsigned long long)req->i.sector, req->i.size);
@@ -351,24 +574,8 @@ void drbd_req_destroy(struct kref *kref)
 
 	if (s & RQ_WRITE && req->i.size) {
 		struct drbd_resource *resource = device->resource;
-		struct drbd_request *peer_ack_req;
-
-		spin_lock(&resource->peer_ack_lock); /* local irq already disabled */
-		peer_ack_req = resource->peer_ack_req;
-		if (peer_ack_req) {
-			if (peer_ack_differs(req, peer_ack_req) ||
-			    (was_last_ref && atomic_read(&device->ap_actlog_cnt)) ||
-			    peer_ack_window_full(req)) {
-				drbd_queue_peer_ack(resource, peer_ack_req);
-				peer_ack_req = NULL;
-			} else
-				call_rcu(&peer_ack_req->rcu, drbd_reclaim_req);
-		}
-		resource->peer_ack_req = req;
 
-		if (!peer_ack_req)
-			resource->last_peer_acked_dagtag = req->dagtag_sector;
-		spin_unlock(&resource->peer_ack_lock);
+		peer_ack_add(req, was_last_ref); /* local irq already disabled */
 
 		mod_timer(&resource->peer_ack_timer,
 			  jiffies + resource->res_opts.peer_ack_delay * HZ / 1000);
@@ -518,6 +725,8 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 
 	/* Update disk stats */
 	_drbd_end_io_acct(device, req);
+	drbd_lat_record(device, bio_data_dir(req->master_bio) == WRITE ?
+			DRBD_LAT_WRITE : DRBD_LAT_READ, req->lat_start_kt);
 
 	/* If READ failed,
 	 * have it be pushed back to the retry work queue,
@@ -549,7 +758,8 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 		m->bio = req->master_bio;
 		req->master_bio = NULL;
 
-		spin_lock_irqsave(&device->interval_lock, flags);
+		local_irq_save(flags);
+		drbd_write_lock(device, req->i.sector, req->i.size);
 		/* We leave it in the tree, to be able to verify later
 		 * write-acks in protocol != C during resync.
 		 * But we mark it as "complete", so it won't be counted as
@@ -557,7 +767,8 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 		req->i.completed = true;
 		if (req->i.waiting)
 			wake_up(&device->misc_wait);
-		spin_unlock_irqrestore(&device->interval_lock, flags);
+		drbd_write_unlock(device, req->i.sector, req->i.size);
+		local_irq_restore(flags);
 	}
 
 	/* Either we are about to complete to upper layers,
@@ -615,6 +826,14 @@ static void advance_conn_req_next(struct drbd_connection *connection, struct drb
 	connection->todo.req_next = req;
 }
 
+/* Arm the connection's request timer for a request that was just sent, unless
+ * it runs already. It follows the oldest request from there on. */
+static void arm_connection_request_timer(struct drbd_connection *connection)
+{
+	if (!timer_pending(&connection->request_timer))
+		mod_timer(&connection->request_timer, jiffies + HZ);
+}
+
 static void set_cache_ptr_if_null(struct drbd_request **cache_ptr, struct drbd_request *req)
 {
 	struct drbd_request *prev_req, *old_req = NULL;
@@ -669,6 +888,122 @@ static unsigned int req_payload_sectors(struct drbd_request *req)
 	return req->i.size >> 9;
 }
 
+/* Exponentially weighted moving average, weight 1/8 for the new sample */
+static void read_lat_ewma_add(u64 *ewma, struct drbd_request *req)
+{
+	u64 sample = ktime_to_ns(ktime_sub(ktime_get(), req->rb_start_kt));
+	u64 old = READ_ONCE(*ewma);
+
+	WRITE_ONCE(*ewma, old ? old - (old >> 3) + (sample >> 3) : sample);
+}
+
+/* Only volumes with a latency target care */
+static void drbd_qos_ack(struct drbd_device *device, struct drbd_request *req)
+{
+	u64 sample, old;
+
+	if (!READ_ONCE(device->qos.latency_target_us))
+		return;
+
+	sample = ktime_to_ns(ktime_sub(ktime_get(), req->lat_start_kt));
+	old = READ_ONCE(device->qos.ack_lat_ewma_ns);
+	WRITE_ONCE(device->qos.ack_lat_ewma_ns, old ? old - (old >> 3) + (sample >> 3) : sample);
+	if (wq_has_sleeper(&device->resource->qos_wait))
+		wake_up(&device->resource->qos_wait);
+}
+
+/* The smallest window of the paths a write of this volume goes to. Called
+ * when a window changes, and from finish_state_change() with @which NEW when
+ * a path comes or goes. */
+void drbd_admit_update_limit(struct drbd_device *device, enum which_state which)
+{
+	struct drbd_peer_device *peer_device;
+	unsigned int limit = 0;
+
+	if (device->disk_state[which] >= D_INCONSISTENT)
+		limit = READ_ONCE(device->admit.window);
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		unsigned int w = READ_ONCE(peer_device->admit.window);
+
+		if (peer_device->repl_state[which] < L_ESTABLISHED || !w)
+			continue;
+		if (!limit || w < limit)
+			limit = w;
+	}
+	rcu_read_unlock();
+	WRITE_ONCE(device->admit_limit, limit);
+}
+
+/*
+ * A write completed on one path, locally or acked by a peer. Once per average
+ * latency, scale the window of that path down in proportion to how far the
+ * latency exceeds the target, by at most half; or, below the target and with
+ * the window in use, open it by an eighth. Runs unlocked in completion
+ * context, a lost update only delays the next adjustment.
+ */
+static void drbd_admit_sample(struct drbd_device *device, struct drbd_admit *admit,
+			      ktime_t start_kt)
+{
+	u64 target_ns = (u64)READ_ONCE(drbd_admit_latency_us) * NSEC_PER_USEC;
+	unsigned int nr_requests = device->resource->res_opts.nr_requests;
+	unsigned int window, in_flight;
+	u64 sample, old, ewma;
+
+	if (!target_ns)
+		return;
+
+	sample = ktime_to_ns(ktime_sub(ktime_get(), start_kt));
+	old = READ_ONCE(admit->lat_ewma_ns);
+	ewma = old ? old - (old >> 3) + (sample >> 3) : sample;
+	WRITE_ONCE(admit->lat_ewma_ns, ewma);
+
+	if (time_before(jiffies, READ_ONCE(admit->next_jif)))
+		return;
+	WRITE_ONCE(admit->next_jif, jiffies + max_t(unsigned long, nsecs_to_jiffies(ewma), 1));
+
+	in_flight = atomic_read(&device->ap_bio_cnt[WRITE]);
+	window = READ_ONCE(admit->window);
+	if (!window)
+		window = max_t(unsigned int, in_flight, DRBD_ADMIT_MIN_WINDOW);
+
+	if (ewma > target_ns)
+		window = max_t(unsigned int, div64_u64((u64)window * target_ns, ewma), window / 2);
+	else if (in_flight + 1 >= window)
+		window += max(window / 8, 1U);
+	window = clamp_t(unsigned int, window, DRBD_ADMIT_MIN_WINDOW, max(nr_requests, 1U));
+
+	if (window != READ_ONCE(admit->window)) {
+		WRITE_ONCE(admit->window, window);
+		drbd_admit_update_limit(device, NOW);
+	}
+}
+
+/* A path that comes (back) starts over, without the window it had before */
+void drbd_admit_reset(struct drbd_admit *admit)
+{
+	WRITE_ONCE(admit->lat_ewma_ns, 0);
+	WRITE_ONCE(admit->window, 0);
+	WRITE_ONCE(admit->next_jif, jiffies);
+}
+
+/* How many application writes the volume admits in flight, 0: no limit */
+unsigned int drbd_admit_window(struct drbd_device *device)
+{
+	if (!READ_ONCE(drbd_admit_latency_us))
+		return 0;
+	return READ_ONCE(device->admit_limit);
+}
+
+/* The local disk is behind its latency target */
+bool drbd_admit_congested(struct drbd_device *device)
+{
+	u64 target_ns = (u64)READ_ONCE(drbd_admit_latency_us) * NSEC_PER_USEC;
+
+	return target_ns && READ_ONCE(device->admit.lat_ewma_ns) > target_ns;
+}
+
 /* I'd like this to be the only place that manipulates
  * req->completion_ref and req->kref. */
 static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
@@ -723,16 +1058,21 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 
 	kref_get(&req->kref);
 
-	if (!(old_local & RQ_LOCAL_PENDING) && (set_local & RQ_LOCAL_PENDING))
+	if (!(old_local & RQ_LOCAL_PENDING) && (set_local & RQ_LOCAL_PENDING)) {
 		atomic_inc(&req->completion_ref);
+		atomic_inc(&req->device->rq_local_pending[drbd_req_is_write(req)]);
+	}
 
 	if (!(old_net & RQ_NET_PENDING) && (set & RQ_NET_PENDING)) {
 		inc_ap_pending(peer_device);
 		atomic_inc(&req->completion_ref);
 	}
 
-	if (!(old_net & RQ_NET_QUEUED) && (set & RQ_NET_QUEUED))
-		atomic_inc(&req->completion_ref);
+	if (!(old_net & RQ_NET_QUEUED) && (set & RQ_NET_QUEUED)) {
+		if (!(set & RQ_NET_BUFFERED))
+			atomic_inc(&req->completion_ref);
+		atomic_inc(&peer_device->rq_queued);
+	}
 
 	if (!(old_net & RQ_EXP_BARR_ACK) && (set & RQ_EXP_BARR_ACK))
 		kref_get(&req->kref); /* wait for the DONE */
@@ -741,19 +1081,25 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 		/* potentially already completed in the ack_receiver thread */
 		if (!(old_net & RQ_NET_DONE)) {
 			atomic_add(req_payload_sectors(req), &peer_device->connection->ap_in_flight);
+			atomic_inc(&peer_device->rq_not_net_done);
 			set_cache_ptr_if_null(&connection->req_not_net_done, req);
+			arm_connection_request_timer(connection);
 		}
 		if (req->net_rq_state[idx] & RQ_NET_PENDING)
 			set_cache_ptr_if_null(&connection->req_ack_pending, req);
 	}
 
-	if (!(old_local & RQ_COMPLETION_SUSP) && (set_local & RQ_COMPLETION_SUSP))
+	if (!(old_local & RQ_COMPLETION_SUSP) && (set_local & RQ_COMPLETION_SUSP)) {
 		atomic_inc(&req->completion_ref);
+		atomic_inc(&req->device->resource->tl_completion_susp);
+	}
 
 	/* progress: put references */
 
-	if ((old_local & RQ_COMPLETION_SUSP) && (clear_local & RQ_COMPLETION_SUSP))
+	if ((old_local & RQ_COMPLETION_SUSP) && (clear_local & RQ_COMPLETION_SUSP)) {
+		atomic_dec(&req->device->resource->tl_completion_susp);
 		++c_put;
+	}
 
 	if (!(old_local & RQ_LOCAL_ABORTED) && (set_local & RQ_LOCAL_ABORTED)) {
 		D_ASSERT(req->device, req->local_rq_state & RQ_LOCAL_PENDING);
@@ -763,6 +1109,7 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	if ((old_local & RQ_LOCAL_PENDING) && (clear_local & RQ_LOCAL_PENDING)) {
 		struct drbd_device *device = req->device;
 
+		atomic_dec(&device->rq_local_pending[drbd_req_is_write(req)]);
 		if (req->local_rq_state & RQ_LOCAL_ABORTED)
 			kref_put(&req->kref, drbd_req_destroy);
 		else
@@ -776,20 +1123,31 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 		dec_ap_pending(peer_device);
 		++c_put;
 		ktime_get_accounting(req->acked_kt[peer_device->node_id]);
+		if ((old_net & RQ_NET_SENT) && drbd_req_is_write(req)) {
+			drbd_lat_record_peer(peer_device, DRBD_LAT_ACK, req->lat_start_kt);
+			drbd_qos_ack(req->device, req);
+			drbd_admit_sample(req->device, &peer_device->admit, req->lat_start_kt);
+		}
 		advance_cache_ptr(connection, &connection->req_ack_pending,
 				  req, RQ_NET_SENT | RQ_NET_PENDING, 0);
 	}
 
 	if ((old_net & RQ_NET_QUEUED) && (clear & RQ_NET_QUEUED)) {
-		++c_put;
+		atomic_dec(&peer_device->rq_queued);
+		if (!(old_net & RQ_NET_BUFFERED))
+			++c_put;
 		advance_conn_req_next(connection, req);
 	}
 
 	if (!(old_net & RQ_NET_DONE) && (set & RQ_NET_DONE)) {
 		atomic_t *ap_in_flight = &peer_device->connection->ap_in_flight;
 
-		if (old_net & RQ_NET_SENT)
+		if (old_net & RQ_NET_SENT) {
 			atomic_sub(req_payload_sectors(req), ap_in_flight);
+			atomic_dec(&peer_device->rq_not_net_done);
+			if (waitqueue_active(&peer_device->connection->cong_wait))
+				wake_up(&peer_device->connection->cong_wait);
+		}
 		if (old_net & RQ_EXP_BARR_ACK)
 			kref_put(&req->kref, drbd_req_destroy);
 		ktime_get_accounting(req->net_done_kt[peer_device->node_id]);
@@ -861,6 +1219,20 @@ static inline bool is_pending_write_protocol_A(struct drbd_request *req, int idx
 		==  RQ_NET_PENDING;
 }
 
+/* With hybrid_protocol, a write without REQ_FUA, REQ_PREFLUSH or REQ_SYNC
+ * goes as protocol A. Ordering holds through the epochs: once such a write
+ * completes, its epoch gets closed, and a later flush reaches the peer only
+ * behind that barrier, which the peer processes after the earlier writes
+ * completed. Two primaries need the write acks for conflict resolution. */
+static bool hybrid_async_write(struct drbd_request *req, struct net_conf *nc)
+{
+	struct bio *bio = req->master_bio;
+
+	return READ_ONCE(drbd_hybrid_protocol) && !nc->two_primaries &&
+		(req->local_rq_state & RQ_WRITE) && bio && bio_op(bio) == REQ_OP_WRITE &&
+		!(bio->bi_opf & (REQ_FUA | REQ_PREFLUSH | REQ_SYNC));
+}
+
 /* obviously this could be coded as many single functions
  * instead of one huge switch,
  * or by putting the code directly in the respective locations
@@ -892,6 +1264,7 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		m->bio = NULL;
 
 	idx = peer_device ? peer_device->node_id : -1;
+	trace_drbd_req_mod(req, what, peer_device);
 
 	switch (what) {
 	default:
@@ -911,6 +1284,8 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		rcu_read_lock();
 		nc = rcu_dereference(peer_device->connection->transport.net_conf);
 		p = nc->wire_protocol;
+		if (p != DRBD_PROT_A && hybrid_async_write(req, nc))
+			p = DRBD_PROT_A;
 		rcu_read_unlock();
 		if (p != DRBD_PROT_A) {
 			spin_lock(&req->rq_lock); /* local irq already disabled */
@@ -930,9 +1305,14 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 
 	case COMPLETED_OK:
 		if (req->local_rq_state & RQ_WRITE)
-			device->writ_cnt += req->i.size >> 9;
+			this_cpu_add(device->io_cnt->writ, req->i.size >> 9);
 		else
-			device->read_cnt += req->i.size >> 9;
+			this_cpu_add(device->io_cnt->read, req->i.size >> 9);
+
+		if (!(req->local_rq_state & RQ_WRITE) && req->rb_start_kt)
+			read_lat_ewma_add(&device->read_lat_ewma_ns, req);
+		else if (req->local_rq_state & RQ_WRITE)
+			drbd_admit_sample(device, &device->admit, req->lat_start_kt);
 
 		mod_rq_state(req, m, peer_device, RQ_LOCAL_PENDING,
 				RQ_LOCAL_COMPLETED|RQ_LOCAL_OK);
@@ -977,9 +1357,9 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		 * Corresponding drbd_remove_request_interval is in
 		 * drbd_req_complete() */
 		D_ASSERT(device, drbd_interval_empty(&req->i));
-		spin_lock_irqsave(&device->interval_lock, flags);
+		drbd_lock_irqsave(&device->interval_lock, &device->interval_lock_stat, flags);
 		drbd_insert_interval(&device->read_requests, &req->i);
-		spin_unlock_irqrestore(&device->interval_lock, flags);
+		drbd_unlock_irqrestore(&device->interval_lock, &device->interval_lock_stat, flags);
 
 		set_bit(UNPLUG_REMOTE, &device->flags);
 
@@ -1013,7 +1393,13 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 
 		/* queue work item to send data */
 		D_ASSERT(device, req->net_rq_state[idx] & RQ_NET_PENDING);
-		mod_rq_state(req, m, peer_device, 0, RQ_NET_QUEUED|RQ_EXP_BARR_ACK);
+		if (req->sbuf.connection == peer_device->connection)
+			/* protocol A, and the data will be in the send buffer:
+			 * pretend it was handed over already, as below */
+			mod_rq_state(req, m, peer_device, RQ_NET_PENDING,
+				     RQ_NET_QUEUED|RQ_EXP_BARR_ACK|RQ_NET_OK|RQ_NET_BUFFERED);
+		else
+			mod_rq_state(req, m, peer_device, 0, RQ_NET_QUEUED|RQ_EXP_BARR_ACK);
 
 		/* Close the epoch, in case it outgrew the limit.
 		 * Or if this is a "batch bio", and some of our peers is "old",
@@ -1187,6 +1573,8 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 
 	case DATA_RECEIVED:
 		D_ASSERT(device, req->net_rq_state[idx] & RQ_NET_PENDING);
+		if (req->rb_start_kt)
+			read_lat_ewma_add(&peer_device->read_lat_ewma_ns, req);
 		mod_rq_state(req, m, peer_device, RQ_NET_PENDING, RQ_NET_OK|RQ_NET_DONE);
 		break;
 
@@ -1246,6 +1634,31 @@ static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector,
 	return true;
 }
 
+/* Prefer the path whose reads completed faster recently.  The latency is
+ * measured from submission, so it already covers the time a read queues
+ * behind the others on that path.  A path without history yet is tried
+ * first. To keep the estimate of the non-preferred path up to date, every
+ * 32nd read is sent there anyways. */
+static bool remote_due_to_read_latency(struct drbd_device *device,
+		struct drbd_peer_device *peer_device)
+{
+	u64 local_lat = READ_ONCE(device->read_lat_ewma_ns);
+	u64 remote_lat = READ_ONCE(peer_device->read_lat_ewma_ns);
+	bool remote;
+
+	if (!remote_lat)
+		return true;
+	if (!local_lat)
+		return false;
+
+	remote = remote_lat < local_lat;
+
+	if ((atomic_inc_return(&device->read_balance_seq) & 31) == 0)
+		remote = !remote;
+
+	return remote;
+}
+
 /* TODO improve for more than one peer.
  * also take into account the drbd protocol. */
 static bool remote_due_to_read_balancing(struct drbd_device *device,
@@ -1257,9 +1670,14 @@ static bool remote_due_to_read_balancing(struct drbd_device *device,
 
 	switch (rbm) {
 	case RB_CONGESTED_REMOTE:
+		/* Recent kernels hardly ever set the bdi congestion bits */
+		if (drbd_admit_congested(device))
+			return true;
 		bdi = bdi_from_device(device);
 		return bdi_read_congested(bdi);
 	case RB_LEAST_PENDING:
+		if (drbd_read_balancing_latency)
+			return remote_due_to_read_latency(device, peer_device);
 		return atomic_read(&device->local_cnt) >
 			atomic_read(&peer_device->ap_pending_cnt) + atomic_read(&peer_device->rs_pending_cnt);
 	case RB_32K_STRIPING:  /* stripe_shift = 15 */
@@ -1283,7 +1701,7 @@ static bool remote_due_to_read_balancing(struct drbd_device *device,
 /*
  * complete_conflicting_writes  -  wait for any conflicting write requests
  *
- * The write_requests tree contains all active write requests which we
+ * The write interval trees contain all active write requests which we
  * currently know about.  Wait for any requests to complete which conflict with
  * the new one.
  *
@@ -1294,12 +1712,13 @@ static void complete_conflicting_writes(struct drbd_request *req)
 	DEFINE_WAIT(wait);
 	struct drbd_device *device = req->device;
 	struct drbd_resource *resource = device->resource;
+	struct drbd_write_overlap o;
 	struct drbd_interval *i;
 	sector_t sector = req->i.sector;
 	int size = req->i.size;
 
 	for (;;) {
-		drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+		drbd_for_each_write_overlap(i, &o, device, sector, size) {
 			/* Ignore, if already completed to upper layers. */
 			if (i->completed)
 				continue;
@@ -1313,11 +1732,11 @@ static void complete_conflicting_writes(struct drbd_request *req)
 		/* Indicate to wake up device->misc_wait on progress.  */
 		prepare_to_wait(&device->misc_wait, &wait, TASK_UNINTERRUPTIBLE);
 		i->waiting = true;
-		spin_unlock_irq(&device->interval_lock);
+		drbd_write_unlock_irq(device, sector, size);
 		read_unlock_irq(&resource->state_rwlock);
 		schedule();
 		read_lock_irq(&resource->state_rwlock);
-		spin_lock_irq(&device->interval_lock);
+		drbd_write_lock_irq(device, sector, size);
 	}
 	finish_wait(&device->misc_wait, &wait);
 }
@@ -1368,6 +1787,17 @@ static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connectio
 		}
 	}
 
+	if (!congested && drbd_latency_probe_cong_us) {
+		u64 avg_ns = READ_ONCE(connection->latency_probe.avg_ns);
+
+		if (avg_ns > (u64)drbd_latency_probe_cong_us * NSEC_PER_USEC) {
+			drbd_info(device, "Latency-probe threshold reached (%llu > %u us)\n",
+				  (unsigned long long)div_u64(avg_ns, NSEC_PER_USEC),
+				  drbd_latency_probe_cong_us);
+			congested = true;
+		}
+	}
+
 	if (!congested && device->act_log->used >= cong_extents) {
 		drbd_info(device, "Congestion-extents threshold reached (%d >= %d)\n",
 			device->act_log->used, cong_extents);
@@ -1384,6 +1814,160 @@ out:
 	put_ldev(device);
 }
 
+/* Same thresholds as __maybe_pull_ahead(), without the verdict.
+ * Caller holds a local disk reference. */
+static bool write_congested(struct drbd_device *device, struct drbd_connection *connection)
+{
+	struct net_conf *nc;
+	bool congested = false;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->transport.net_conf);
+	if (nc && nc->on_congestion != OC_BLOCK) {
+		if (nc->cong_fill &&
+		    atomic_read(&connection->ap_in_flight) +
+		    atomic_read(&connection->rs_in_flight) >= nc->cong_fill)
+			congested = true;
+		if (device->act_log->used >= nc->cong_extents)
+			congested = true;
+	}
+	rcu_read_unlock();
+
+	return congested;
+}
+
+/*
+ * Backpressure before Ahead/Behind: while a connection is congested, hold a
+ * new write back for up to cong_throttle_ms, until the congestion is gone.
+ * A short burst is then absorbed by a few slower writes instead of a resync.
+ * Only if the congestion persists the write goes on, and maybe_pull_ahead()
+ * acts on it as before. Caller must be allowed to sleep.
+ */
+static void drbd_congestion_throttle(struct drbd_device *device)
+{
+	unsigned int throttle_ms = READ_ONCE(drbd_cong_throttle_ms);
+	struct drbd_connection *connection, *congested = NULL;
+	unsigned long deadline;
+	ktime_t start_kt;
+
+	if (!throttle_ms)
+		return;
+	if (!get_ldev_if_state(device, D_UP_TO_DATE))
+		return;
+
+	rcu_read_lock();
+	for_each_connection_rcu(connection, device->resource) {
+		struct drbd_peer_device *peer_device = conn_peer_device(connection, device->vnr);
+
+		if (connection->cstate[NOW] != C_CONNECTED ||
+		    !peer_device || peer_device->repl_state[NOW] != L_ESTABLISHED)
+			continue;
+		if (write_congested(device, connection)) {
+			kref_get(&connection->kref);
+			congested = connection;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	if (!congested)
+		goto out;
+
+	start_kt = ktime_get();
+	deadline = jiffies + msecs_to_jiffies(throttle_ms);
+	/* ap_in_flight going down wakes us, the activity log does not */
+	while (write_congested(device, congested) &&
+	       congested->cstate[NOW] == C_CONNECTED) {
+		long timeout = (long)(deadline - jiffies);
+
+		if (timeout <= 0) {
+			atomic_inc(&congested->cong_throttle_timeouts);
+			break;
+		}
+		wait_event_timeout(congested->cong_wait,
+				   !write_congested(device, congested) ||
+				   congested->cstate[NOW] != C_CONNECTED,
+				   min_t(long, timeout, max(HZ / 100, 1)));
+	}
+	atomic_inc(&congested->cong_throttled);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start_kt)), &congested->cong_throttle_ns);
+	kref_put(&congested->kref, drbd_destroy_connection);
+out:
+	put_ldev(device);
+}
+
+/* After a volume's QoS settings changed */
+void drbd_qos_update(struct drbd_resource *resource)
+{
+	struct drbd_device *device;
+	bool active = false;
+	int vnr;
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (READ_ONCE(device->qos.latency_target_us))
+			active = true;
+	}
+	rcu_read_unlock();
+	WRITE_ONCE(resource->qos_active, active);
+	wake_up(&resource->qos_wait);
+}
+
+/*
+ * Should the traffic of this volume yield to a volume of higher weight?
+ * It does while one that has writes in flight misses its latency target.
+ * Returns that latency target, 0 if there is nothing to yield to.
+ */
+unsigned int drbd_qos_yield_us(struct drbd_device *device)
+{
+	struct drbd_resource *resource = device->resource;
+	unsigned int weight = READ_ONCE(device->qos.weight);
+	unsigned int target_us = 0;
+	struct drbd_device *other;
+	int vnr;
+
+	if (!READ_ONCE(resource->qos_active))
+		return 0;
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, other, vnr) {
+		unsigned int t = READ_ONCE(other->qos.latency_target_us);
+
+		if (other == device || !t || READ_ONCE(other->qos.weight) <= weight)
+			continue;
+		if (atomic_read(&other->ap_bio_cnt[WRITE]) &&
+		    READ_ONCE(other->qos.ack_lat_ewma_ns) > (u64)t * NSEC_PER_USEC) {
+			target_us = t;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return target_us;
+}
+
+/*
+ * The transfer log, and with it the data stream, is in submission order, the
+ * sender cannot let one volume's writes pass another's. So the writes of a
+ * lower weight volume are held back before they get there, while a volume of
+ * higher weight misses its latency target; for at most that latency target.
+ * Caller must be allowed to sleep.
+ */
+static void drbd_qos_throttle(struct drbd_device *device)
+{
+	struct drbd_resource *resource = device->resource;
+	unsigned int target_us = drbd_qos_yield_us(device);
+	ktime_t start_kt;
+
+	if (!target_us)
+		return;
+
+	start_kt = ktime_get();
+	wait_event_timeout(resource->qos_wait, !drbd_qos_yield_us(device),
+			   max_t(long, usecs_to_jiffies(target_us), 1));
+	atomic_inc(&device->qos.throttled);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start_kt)), &device->qos.throttle_ns);
+}
+
 static void maybe_pull_ahead(struct drbd_device *device)
 {
 	struct drbd_connection *connection;
@@ -1444,27 +2028,90 @@ static u64 calc_nodes_to_read_from(struct drbd_device *device)
 	return 0;
 }
 
-/* If this returns NULL, and req->private_bio is still set,
- * the request should be submitted locally.
- *
- * If it returns NULL, but req->private_bio is not set,
- * we do not have access to good data :(
- *
- * Otherwise, this destroys req->private_bio, if any,
- * and returns the peer device which should be asked for data.
- */
-static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *req)
+#define DRBD_READ_STRIPE_SHIFT 20
+
+/* Choose among all peers we may read from, either by the stripe the
+ * sector falls into, or the one with the lowest recent read latency, see
+ * remote_due_to_read_latency(). */
+static struct drbd_peer_device *pick_peer_device_for_read(struct drbd_device *device,
+		sector_t sector, unsigned int mode)
 {
-	struct drbd_peer_device *peer_device;
-	struct drbd_device *device = req->device;
-	enum drbd_read_balancing rbm = RB_PREFER_REMOTE;
+	u64 nodes = calc_nodes_to_read_from(device);
+	struct drbd_peer_device *peer_device, *best = NULL;
+	u64 best_lat = U64_MAX;
 
-	if (req->private_bio) {
-		if (!drbd_may_do_local_read(device,
-					req->i.sector, req->i.size)) {
-			bio_put(req->private_bio);
+	if (!nodes)
+		return NULL;
+
+	if (mode == DRBD_READ_PEERS_STRIPE) {
+		sector_t stripe = sector >> (DRBD_READ_STRIPE_SHIFT - 9);
+		unsigned int n = sector_div(stripe, hweight64(nodes));
+
+		while (n--)
+			nodes &= nodes - 1;
+		peer_device = peer_device_by_node_id(device, __ffs64(nodes));
+		if (peer_device && peer_device->disk_state[NOW] == D_UP_TO_DATE)
+			return peer_device;
+		return NULL;
+	}
+
+	for_each_peer_device(peer_device, device) {
+		u64 lat;
+
+		if (!(nodes & NODE_MASK(peer_device->node_id)) ||
+		    peer_device->disk_state[NOW] != D_UP_TO_DATE)
+			continue;
+
+		lat = READ_ONCE(peer_device->read_lat_ewma_ns);
+		if (lat < best_lat) {
+			best_lat = lat;
+			best = peer_device;
+		}
+	}
+	return best;
+}
+
+/* Ask the resync to fetch what this read needs next */
+static void resync_hot_first(struct drbd_request *req)
+{
+	struct drbd_device *device = req->device;
+	sector_t last = req->i.sector + (req->i.size >> 9) - 1;
+	struct drbd_peer_device *peer_device;
+
+	for_each_peer_device(peer_device, device) {
+		if (peer_device->repl_state[NOW] != L_SYNC_TARGET)
+			continue;
+		drbd_rs_hot_chunk(peer_device, req->i.sector);
+		if (BM_SECT_TO_BIT(last) / DRBD_RS_HOT_BITS !=
+		    BM_SECT_TO_BIT(req->i.sector) / DRBD_RS_HOT_BITS)
+			drbd_rs_hot_chunk(peer_device, last);
+	}
+}
+
+/* If this returns NULL, and req->private_bio is still set,
+ * the request should be submitted locally.
+ *
+ * If it returns NULL, but req->private_bio is not set,
+ * we do not have access to good data :(
+ *
+ * Otherwise, this destroys req->private_bio, if any,
+ * and returns the peer device which should be asked for data.
+ */
+static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *req)
+{
+	struct drbd_peer_device *peer_device;
+	struct drbd_device *device = req->device;
+	enum drbd_read_balancing rbm = RB_PREFER_REMOTE;
+	unsigned int mode;
+
+	if (req->private_bio) {
+		if (!drbd_may_do_local_read(device,
+					req->i.sector, req->i.size)) {
+			bio_put(req->private_bio);
 			req->private_bio = NULL;
 			put_ldev(device);
+			if (READ_ONCE(drbd_resync_hot_first))
+				resync_hot_first(req);
 		}
 	}
 
@@ -1477,6 +2124,23 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		}
 	}
 
+	mode = READ_ONCE(drbd_read_peer_balancing);
+	if (mode == DRBD_READ_PEERS_LATENCY ||
+	    (rbm == RB_LEAST_PENDING && drbd_read_balancing_latency))
+		req->rb_start_kt = ktime_get();
+
+	/* The latency based choice still does round robin every 32nd read,
+	 * to keep the estimates of all peers up to date */
+	if (mode == DRBD_READ_PEERS_STRIPE ||
+	    (mode == DRBD_READ_PEERS_LATENCY &&
+	     (atomic_inc_return(&device->read_balance_seq) & 31))) {
+		peer_device = pick_peer_device_for_read(device, req->i.sector, mode);
+		if (peer_device && req->private_bio &&
+		    !remote_due_to_read_balancing(device, peer_device, req->i.sector, rbm))
+			peer_device = NULL;
+		goto out;
+	}
+
 	/* TODO: improve read balancing decisions, allow user to configure node weights */
 	while (true) {
 		if (!device->read_nodes)
@@ -1498,6 +2162,7 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		break;
 	}
 
+out:
 	if (peer_device && req->private_bio) {
 		bio_put(req->private_bio);
 		req->private_bio = NULL;
@@ -1506,6 +2171,96 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 	return peer_device;
 }
 
+/*
+ * Protocol A completes a write once it is handed over to the network. When
+ * the data socket is full, that waits for the sender, and eventually
+ * congestion makes us go Ahead. With a send buffer (async_buffer_mb), the
+ * data of a protocol A write is copied there instead, and the write completes
+ * as if it was sent already. The sender drains the buffer at link speed.
+ *
+ * Space is reserved here, under the tl_update_lock, so that the ring is
+ * filled in transfer log order, which is also the order in which the sender
+ * sends and releases it. The copy is made by drbd_sbuf_fill() once the locks
+ * are dropped; the sender waits for it, if need be. Only one connection per
+ * request is buffered, the others send from the master bio as before.
+ * Writes larger than DRBD_MAX_BIO_SIZE are not buffered either, so that the
+ * copy always fits into a single bio.
+ */
+static void drbd_sbuf_reserve(struct drbd_peer_device *peer_device, struct drbd_request *req)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_async_sbuf *sbuf = &connection->sbuf;
+	unsigned int nr = DIV_ROUND_UP(req->i.size, PAGE_SIZE);
+
+	if (!sbuf->nr_pages || req->sbuf.connection ||
+	    bio_op(req->master_bio) != REQ_OP_WRITE ||
+	    req->i.size > DRBD_MAX_BIO_SIZE ||
+	    req->net_rq_state[peer_device->node_id] & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK))
+		return;
+
+	if (sbuf->tail + nr - smp_load_acquire(&sbuf->head) > sbuf->nr_pages) {
+		sbuf->full++;
+		return;
+	}
+	sbuf->tail += nr;
+	sbuf->reqs++;
+	sbuf->bytes += req->i.size;
+
+	kref_get(&connection->kref);
+	kref_debug_get(&connection->kref_debug, 17);
+	req->sbuf.connection = connection;
+	req->sbuf.end = sbuf->tail;
+}
+
+/* Copy the data of the master bio into the pages reserved for it. The caller
+ * holds a completion_ref, so the master bio is still there. */
+static void drbd_sbuf_fill(struct drbd_request *req)
+{
+	struct drbd_connection *connection = req->sbuf.connection;
+	struct drbd_async_sbuf *sbuf = &connection->sbuf;
+	unsigned int nr = DIV_ROUND_UP(req->i.size, PAGE_SIZE);
+	u64 pos = req->sbuf.end - nr;
+	unsigned int off = 0;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	struct bio *bio;
+
+	/* nr <= BIO_MAX_PAGES, see drbd_sbuf_reserve(); cannot fail */
+	bio = bio_alloc(GFP_NOIO, nr);
+	bio->bi_iter.bi_sector = req->i.sector;
+	bio->bi_opf = req->master_bio->bi_opf;
+	bio->bi_ioprio = req->master_bio->bi_ioprio;
+
+	bio_for_each_segment(bvec, req->master_bio, iter) {
+		void *src = kmap_atomic(bvec.bv_page);
+		unsigned int done = 0;
+
+		while (done < bvec.bv_len) {
+			struct page *page = sbuf->pages[(pos + (off >> PAGE_SHIFT)) % sbuf->nr_pages];
+			unsigned int poff = off & ~PAGE_MASK;
+			unsigned int len = min(bvec.bv_len - done, (unsigned int)PAGE_SIZE - poff);
+			void *dst = kmap_atomic(page);
+
+			memcpy(dst + poff, src + bvec.bv_offset + done, len);
+			kunmap_atomic(dst);
+			done += len;
+			off += len;
+		}
+		kunmap_atomic(src);
+	}
+
+	for (off = 0; off < req->i.size; off += PAGE_SIZE)
+		bio_add_page(bio, sbuf->pages[(pos + (off >> PAGE_SHIFT)) % sbuf->nr_pages],
+			     min(req->i.size - off, (unsigned int)PAGE_SIZE), 0);
+
+	req->sbuf.bio = bio;
+	smp_store_release(&req->sbuf.ready, true);
+	wake_up(&sbuf->wait);
+
+	kref_debug_put(&connection->kref_debug, 17);
+	kref_put(&connection->kref, drbd_destroy_connection);
+}
+
 /* returns the number of connections expected to actually write this data,
  * which does NOT include those that we are L_AHEAD for. */
 static int drbd_process_write_request(struct drbd_request *req)
@@ -1527,6 +2282,7 @@ static int drbd_process_write_request(struct drbd_request *req)
 		if (remote) {
 			++count;
 			_req_mod(req, TO_BE_SENT, peer_device);
+			drbd_sbuf_reserve(peer_device, req);
 			_req_mod(req, QUEUE_FOR_NET_WRITE, peer_device);
 		} else
 			_req_mod(req, QUEUE_FOR_SEND_OOS, peer_device);
@@ -1565,6 +2321,10 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 	 * stable storage, and this is a WRITE, we may not even submit
 	 * this bio. */
 	if (get_ldev(device)) {
+		if (bio_op(bio) != REQ_OP_READ) {
+			drbd_unallocated_clear(device, req->i.sector, req->i.size);
+			drbd_rs_cache_invalidate(device, req->i.sector, req->i.size);
+		}
 		if (drbd_insert_fault(device, type)) {
 			bio->bi_status = BLK_STS_IOERR;
 			bio_endio(bio);
@@ -1573,7 +2333,7 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 			    ((bio->bi_opf & REQ_NOUNMAP) ? 0 : EE_TRIM));
 		} else if (bio_op(bio) == REQ_OP_DISCARD) {
 			drbd_process_discard_or_zeroes_req(req, EE_TRIM);
-		} else {
+		} else if (!drbd_fault_delay_bio(device, bio)) {
 			generic_make_request(bio);
 		}
 		put_ldev(device);
@@ -1585,11 +2345,15 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 
 static void drbd_queue_write(struct drbd_device *device, struct drbd_request *req)
 {
+	struct drbd_submit_cpu *q;
+
 	if (req->private_bio)
 		atomic_inc(&device->ap_actlog_cnt);
-	spin_lock(&device->submit.lock);
-	list_add_tail(&req->list, &device->submit.writes);
-	spin_unlock(&device->submit.lock);
+	q = get_cpu_ptr(device->submit.cpu);
+	spin_lock(&q->lock);
+	list_add_tail(&req->list, &q->writes);
+	spin_unlock(&q->lock);
+	put_cpu_ptr(device->submit.cpu);
 	spin_lock_irq(&device->pending_completion_lock);
 	list_add_tail(&req->req_pending_master_completion,
 			&device->pending_master_completion[1 /* WRITE */]);
@@ -1615,6 +2379,8 @@ static void drbd_req_in_actlog(struct drbd_request *req)
 {
 	req->local_rq_state |= RQ_IN_ACT_LOG;
 	ktime_get_accounting(req->in_actlog_kt);
+	drbd_lat_record(req->device, DRBD_LAT_AL_WAIT, req->lat_start_kt);
+	drbd_al_heat_sample(req->device, &req->i);
 	atomic_sub(interval_to_al_extents(&req->i), &req->device->wait_for_actlog_ecnt);
 }
 
@@ -1650,6 +2416,7 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio,
 
 	req->start_jif = start_jif;
 	ktime_get_accounting_assign(req->start_kt, start_kt);
+	req->lat_start_kt = ktime_get();
 
 	/* Update disk stats */
 	_drbd_start_io_acct(device, req);
@@ -1664,15 +2431,21 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio,
 	 * See also how peer_requests are handled
 	 * in receive_Data() { ... prepare_activity_log(); ... }
 	 */
-	if (req->private_bio)
-		atomic_add(interval_to_al_extents(&req->i), &device->wait_for_actlog_ecnt);
+	if (!req->private_bio) {
+		/* Diskless: no activity log, no bitmap, nothing the submitter
+		 * thread could do for us that we can not do right here.
+		 * Send discards and zeroout requests directly as well. */
+		return req;
+	}
+
+	atomic_add(interval_to_al_extents(&req->i), &device->wait_for_actlog_ecnt);
 
 	/* process discards always from our submitter thread */
 	if ((bio_op(bio) == REQ_OP_WRITE_ZEROES) ||
 	    (bio_op(bio) == REQ_OP_DISCARD))
 		goto queue_for_submitter_thread;
 
-	if (req->private_bio && !test_bit(AL_SUSPENDED, &device->flags)) {
+	if (!test_bit(AL_SUSPENDED, &device->flags)) {
 		if (!drbd_al_begin_io_fastpath(device, &req->i))
 			goto queue_for_submitter_thread;
 		drbd_req_in_actlog(req);
@@ -1763,7 +2536,7 @@ static void drbd_update_plug(struct drbd_plug_cb *plug, struct drbd_request *req
 		kref_put(&tmp->kref, drbd_req_destroy);
 }
 
-/* caller must hold interval_lock */
+/* caller must hold drbd_write_lock() for the range of the request */
 static void put_req_interval_into_tree(struct drbd_device *device, struct drbd_request *req)
 {
 	struct drbd_peer_device *peer_device;
@@ -1773,7 +2546,7 @@ static void put_req_interval_into_tree(struct drbd_device *device, struct drbd_r
 		remote = drbd_should_do_remote(peer_device, NOW);
 		if (!remote)
 			continue;
-		drbd_insert_interval(&device->write_requests, &req->i);
+		drbd_insert_write_interval(device, &req->i);
 
 		/* Corresponding drbd_remove_request_interval is in
 		 * drbd_req_complete() */
@@ -1789,22 +2562,30 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 	struct bio_and_error m = { NULL, };
 	bool no_remote = false;
 	bool submit_private_bio = false;
+	bool fill_sbuf = false;
+
+	if (rw == WRITE) {
+		drbd_congestion_throttle(device);
+		drbd_qos_throttle(device);
+	}
 
 	read_lock_irq(&resource->state_rwlock);
 
 	if (rw == WRITE) {
-		spin_lock(&device->interval_lock);
-		/* This may temporarily give up the state_rwlock and interval_lock,
+		drbd_write_lock(device, req->i.sector, req->i.size);
+		/* This may temporarily give up the state_rwlock and write lock,
 		 * but will re-acquire them before it returns here.
 		 * Needs to be before the check on drbd_suspended() */
 		complete_conflicting_writes(req);
 		/* no more giving up state_rwlock from now on! */
 		put_req_interval_into_tree(device, req);
-		spin_unlock(&device->interval_lock);
+		drbd_write_unlock(device, req->i.sector, req->i.size);
 
 		/* check for congestion, and potentially stop sending
-		 * full data updates, but start sending "dirty bits" only. */
-		maybe_pull_ahead(device);
+		 * full data updates, but start sending "dirty bits" only.
+		 * Without local data there is nothing to pull ahead with. */
+		if (req->private_bio)
+			maybe_pull_ahead(device);
 	}
 
 	if (drbd_suspended(device)) {
@@ -1836,7 +2617,7 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 			goto nodata;
 	}
 
-	spin_lock(&resource->tl_update_lock); /* local irq already disabled */
+	drbd_lock(&resource->tl_update_lock, &resource->tl_update_lock_stat); /* local irq already disabled */
 
 	spin_lock(&resource->current_tle_lock);
 	/* which transfer log epoch does this belong to? */
@@ -1878,7 +2659,7 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 		 * "immutable" fields after this point */
 		list_add_tail_rcu(&req->tl_requests, &resource->transfer_log);
 	}
-	spin_unlock(&resource->tl_update_lock);
+	drbd_unlock(&resource->tl_update_lock, &resource->tl_update_lock_stat);
 
 	if (rw == WRITE)
 		drbd_wake_all_senders(resource);
@@ -1901,6 +2682,7 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 		/* pre_submit_jif is used in request_timer_fn() */
 		req->pre_submit_jif = jiffies;
 		ktime_get_accounting(req->pre_submit_kt);
+		req->lat_submit_kt = ktime_get();
 		list_add_tail(&req->req_pending_local,
 			&device->pending_completion[rw == WRITE]);
 		_req_mod(req, TO_BE_SUBMITTED, NULL);
@@ -1920,6 +2702,12 @@ nodata:
 		}
 	}
 
+	if (req->sbuf.connection) {
+		/* keeps the master bio for drbd_sbuf_fill() */
+		atomic_inc(&req->completion_ref);
+		fill_sbuf = true;
+	}
+
 out:
 	drbd_req_put_completion_ref(req, &m, 1);
 	read_unlock_irq(&resource->state_rwlock);
@@ -1933,6 +2721,13 @@ out:
 	if (submit_private_bio)
 		drbd_submit_req_private_bio(req);
 
+	if (fill_sbuf) {
+		drbd_sbuf_fill(req);
+		read_lock_irq(&resource->state_rwlock);
+		drbd_req_put_completion_ref(req, &m, 1);
+		read_unlock_irq(&resource->state_rwlock);
+	}
+
 	if (m.bio)
 		complete_master_bio(device, &m);
 }
@@ -1954,10 +2749,18 @@ static bool inc_ap_bio_cond(struct drbd_device *device, int rw)
 
 	if (rv) {
 		unsigned int nr_requests = device->resource->res_opts.nr_requests;
+		unsigned int limit = nr_requests;
 		int ap_bio_cnt;
+
+		if (rw == WRITE) {
+			unsigned int window = drbd_admit_window(device);
+
+			if (window && window < limit)
+				limit = window;
+		}
 		do {
 			ap_bio_cnt = atomic_read(&device->ap_bio_cnt[rw]);
-			if (ap_bio_cnt >= nr_requests)
+			if (ap_bio_cnt >= limit)
 				rv = false;
 		} while (
 			rv &&
@@ -1970,15 +2773,26 @@ static bool inc_ap_bio_cond(struct drbd_device *device, int rw)
 
 static void inc_ap_bio(struct drbd_device *device, int rw)
 {
+	ktime_t start_kt;
+
 	/* we wait here
 	 *    as long as the device is suspended
 	 *    until the bitmap is no longer on the fly during connection
 	 *    handshake as long as we would exceed the max_buffer limit.
+	 *    for writes, as long as the volume is at its admission window.
 	 *
 	 * to avoid races with the reconnect code,
 	 * we need to atomic_inc within the spinlock. */
 
+	if (inc_ap_bio_cond(device, rw))
+		return;
+
+	start_kt = ktime_get();
 	wait_event(device->misc_wait, inc_ap_bio_cond(device, rw));
+	if (rw == WRITE) {
+		atomic_inc(&device->ap_bio_waits);
+		atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start_kt)), &device->ap_bio_wait_ns);
+	}
 }
 
 void __drbd_make_request(struct drbd_device *device, struct bio *bio,
@@ -2040,15 +2854,20 @@ static void wfa_init(struct waiting_for_act_log *wfa)
 	list_splice_tail_init(&(_wfa)->peer_requests.from, &(_wfa)->peer_requests.to); \
 	} while (0)
 
-static void __drbd_submit_peer_request(struct drbd_peer_request *peer_req)
+static void peer_req_in_actlog(struct drbd_peer_request *peer_req)
 {
-	struct drbd_peer_device *peer_device = peer_req->peer_device;
-	struct drbd_device *device = peer_device->device;
-	int err;
+	struct drbd_device *device = peer_req->peer_device->device;
 
 	peer_req->flags |= EE_IN_ACTLOG;
 	atomic_sub(interval_to_al_extents(&peer_req->i), &device->wait_for_actlog_ecnt);
 	atomic_dec(&device->wait_for_actlog);
+}
+
+static void __drbd_submit_peer_request(struct drbd_peer_request *peer_req)
+{
+	int err;
+
+	peer_req_in_actlog(peer_req);
 	list_del_init(&peer_req->wait_for_actlog);
 
 	err = drbd_submit_peer_request(peer_req);
@@ -2088,6 +2907,85 @@ static void submit_fast_path(struct drbd_device *device, struct waiting_for_act_
 	blk_finish_plug(&plug);
 }
 
+static void send_and_submit_pending(struct drbd_device *device, struct waiting_for_act_log *wfa)
+{
+	send_and_submit_list(device, &wfa->requests.pending, &wfa->peer_requests.pending);
+}
+
+static void al_pipeline_fail_peer_requests(struct list_head *peer_requests)
+{
+	struct drbd_peer_request *peer_req, *tmp;
+
+	list_for_each_entry_safe(peer_req, tmp, peer_requests, wait_for_actlog) {
+		peer_req_in_actlog(peer_req);
+		list_del_init(&peer_req->wait_for_actlog);
+		drbd_cleanup_after_failed_submit_peer_request(peer_req);
+	}
+}
+
+/* Submit the requests of pipelined AL transactions that are on disk, in order */
+static void al_pipeline_retire(struct drbd_device *device)
+{
+	struct drbd_al_pipeline *pipe = &device->al_pipe;
+
+	while (pipe->retired != pipe->issued) {
+		struct drbd_al_pipeline_slot *slot = &pipe->slot[pipe->retired % AL_PIPELINE_MAX];
+
+		if (!smp_load_acquire(&slot->done))
+			break;
+		if (slot->error) {
+			drbd_err(device, "activity log transaction %u failed with error %d\n",
+				 slot->tr_number, slot->error);
+			drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
+			/* Their extents are not on disk.  The disk is D_FAILED
+			 * now, drbd_submit_req_private_bio() fails the local
+			 * part of the requests, they are still sent to the
+			 * peers.  The peer requests fail like a failed submit. */
+			al_pipeline_fail_peer_requests(&slot->peer_requests);
+		}
+		send_and_submit_list(device, &slot->requests, &slot->peer_requests);
+		/* pairs with al_extent_on_disk() */
+		WRITE_ONCE(pipe->retired, pipe->retired + 1);
+	}
+}
+
+/*
+ * With al_queue_depth > 1, do not wait for the transaction to reach the disk:
+ * its requests wait in a pipeline slot, and we go on preparing the next one.
+ * Requests that did not need a new transaction may still depend on one in
+ * flight, they wait for the latest one.
+ */
+static void al_commit_and_submit(struct drbd_device *device, struct waiting_for_act_log *wfa)
+{
+	unsigned int depth = min_t(unsigned int, READ_ONCE(drbd_al_queue_depth), AL_PIPELINE_MAX);
+	struct drbd_al_pipeline *pipe = &device->al_pipe;
+	struct drbd_al_pipeline_slot *slot;
+
+	al_pipeline_retire(device);
+	if (depth > 1 && !drbd_md_dax_active(device->ldev)) {
+		while (pipe->issued - pipe->retired >= depth) {
+			slot = &pipe->slot[pipe->retired % AL_PIPELINE_MAX];
+			wait_event(device->al_wait, smp_load_acquire(&slot->done));
+			al_pipeline_retire(device);
+		}
+		slot = &pipe->slot[pipe->issued % AL_PIPELINE_MAX];
+		slot->seq = pipe->issued;
+		if (drbd_al_begin_io_commit_pipelined(device, slot))
+			pipe->issued++;
+	} else {
+		drbd_al_begin_io_commit(device);
+	}
+
+	al_pipeline_retire(device);
+	if (pipe->retired != pipe->issued) {
+		slot = &pipe->slot[(pipe->issued - 1) % AL_PIPELINE_MAX];
+		list_splice_tail_init(&wfa->requests.pending, &slot->requests);
+		list_splice_tail_init(&wfa->peer_requests.pending, &slot->peer_requests);
+		return;
+	}
+	send_and_submit_pending(device, wfa);
+}
+
 static struct drbd_request *wfa_next_request(struct waiting_for_act_log *wfa)
 {
 	struct list_head *lh = !list_empty(&wfa->requests.more_incoming) ?
@@ -2111,7 +3009,7 @@ static bool prepare_al_transaction_nonblock(struct drbd_device *device,
 	bool wake = false;
 	int err;
 
-	spin_lock_irq(&device->al_lock);
+	drbd_lock_irq(&device->al_lock, &device->al_lock_stat);
 
 	/* Don't even try, if someone has it locked right now. */
 	if (test_bit(__LC_LOCKED, &device->act_log->flags))
@@ -2150,23 +3048,109 @@ static bool prepare_al_transaction_nonblock(struct drbd_device *device,
 		}
 	}
  out:
-	spin_unlock_irq(&device->al_lock);
+	drbd_unlock_irq(&device->al_lock, &device->al_lock_stat);
 	if (wake)
 		wake_up(&device->al_wait);
 	return made_progress;
 }
 
-static void send_and_submit_pending(struct drbd_device *device, struct waiting_for_act_log *wfa)
+void drbd_do_submit_dispatch(struct work_struct *ws)
 {
-	struct blk_plug plug;
+	struct drbd_submit_dispatcher *d = container_of(ws, struct drbd_submit_dispatcher, work);
+	struct drbd_device *device = d->device;
 	struct drbd_request *req, *tmp;
-	struct drbd_peer_request *pr, *pr_tmp;
+	struct blk_plug plug;
+	ktime_t start_kt;
+	LIST_HEAD(requests);
+
+	spin_lock(&d->lock);
+	list_splice_init(&d->requests, &requests);
+	spin_unlock(&d->lock);
 
+	start_kt = ktime_get();
 	blk_start_plug(&plug);
-	list_for_each_entry_safe(pr, pr_tmp, &wfa->peer_requests.pending, wait_for_actlog) {
-		__drbd_submit_peer_request(pr);
+	list_for_each_entry_safe(req, tmp, &requests, list) {
+		list_del_init(&req->list);
+		drbd_send_and_submit(device, req);
+		d->writes++;
 	}
-	list_for_each_entry_safe(req, tmp, &wfa->requests.pending, list) {
+	blk_finish_plug(&plug);
+	d->chunks++;
+	d->busy_ns += ktime_to_ns(ktime_sub(ktime_get(), start_kt));
+}
+
+/* Wait until everything handed to the submitter is sent and submitted */
+void drbd_flush_submit(struct drbd_device *device)
+{
+	int i;
+
+	flush_workqueue(device->submit.wq);
+	for (i = 0; i < DRBD_SUBMIT_WORKERS_MAX; i++)
+		flush_work(&device->submit.dispatch[i].work);
+}
+
+/*
+ * Hand all but the first @batch of @requests, in chunks of @batch, to the
+ * first @workers submit workers of the device in turn.  Each chunk keeps its
+ * order; there is no order between chunks, just as there is none between
+ * writes submitted concurrently on several CPUs.  Overlapping writes are still
+ * serialized by conflict detection in drbd_send_and_submit().
+ */
+static void submit_fanout(struct drbd_device *device, struct list_head *requests,
+			  unsigned int batch, unsigned int workers)
+{
+	struct list_head *pos;
+	unsigned int n = 0;
+	LIST_HEAD(first);
+
+	list_for_each(pos, requests) {
+		if (++n == batch)
+			break;
+	}
+	if (pos == requests || list_is_last(pos, requests))
+		return;
+	list_cut_position(&first, requests, pos);
+
+	while (!list_empty(requests)) {
+		struct drbd_request *req, *tmp;
+		struct drbd_submit_dispatcher *d;
+		LIST_HEAD(chunk);
+
+		n = 0;
+		list_for_each_entry_safe(req, tmp, requests, list) {
+			drbd_req_in_actlog(req);
+			atomic_dec(&device->ap_actlog_cnt);
+			list_move_tail(&req->list, &chunk);
+			if (++n == batch)
+				break;
+		}
+
+		d = &device->submit.dispatch[device->submit.next_dispatch++ % workers];
+		spin_lock(&d->lock);
+		list_splice_tail_init(&chunk, &d->requests);
+		spin_unlock(&d->lock);
+		queue_work(drbd_submit_dispatch_wq, &d->work);
+	}
+	list_splice(&first, requests);
+}
+
+static void send_and_submit_list(struct drbd_device *device,
+		struct list_head *requests, struct list_head *peer_requests)
+{
+	unsigned int workers = min_t(unsigned int, READ_ONCE(drbd_submit_workers),
+				     DRBD_SUBMIT_WORKERS_MAX);
+	unsigned int batch = READ_ONCE(drbd_submit_fanout);
+	struct blk_plug plug;
+	struct drbd_request *req, *tmp;
+	struct drbd_peer_request *pr;
+
+	blk_start_plug(&plug);
+	list_for_each_entry(pr, peer_requests, wait_for_actlog)
+		peer_req_in_actlog(pr);
+	drbd_submit_peer_requests(peer_requests);
+	if (batch && workers)
+		submit_fanout(device, requests, batch, workers);
+	list_for_each_entry_safe(req, tmp, requests, list) {
 		drbd_req_in_actlog(req);
 		atomic_dec(&device->ap_actlog_cnt);
 		list_del_init(&req->list);
@@ -2175,6 +3159,20 @@ static void send_and_submit_pending(struct drbd_device *device, struct waiting_f
 	blk_finish_plug(&plug);
 }
 
+/* It is ok to look outside the locks, it's only an optimization anyways */
+static bool submit_queued(struct drbd_device *device)
+{
+	int cpu;
+
+	if (!list_empty(&device->submit.peer_writes))
+		return true;
+	for_each_possible_cpu(cpu) {
+		if (!list_empty(&per_cpu_ptr(device->submit.cpu, cpu)->writes))
+			return true;
+	}
+	return false;
+}
+
 /* more: for non-blocking fill-up # of updates in the transaction */
 static bool grab_new_incoming_requests(struct drbd_device *device, struct waiting_for_act_log *wfa, bool more)
 {
@@ -2182,10 +3180,20 @@ static bool grab_new_incoming_requests(struct drbd_device *device, struct waitin
 	struct list_head *reqs = more ? &wfa->requests.more_incoming : &wfa->requests.incoming;
 	struct list_head *peer_reqs = more ? &wfa->peer_requests.more_incoming : &wfa->peer_requests.incoming;
 	bool found_new = false;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_submit_cpu *q = per_cpu_ptr(device->submit.cpu, cpu);
+
+		if (list_empty(&q->writes))
+			continue;
+		spin_lock(&q->lock);
+		found_new |= !list_empty(&q->writes);
+		list_splice_tail_init(&q->writes, reqs);
+		spin_unlock(&q->lock);
+	}
 
 	spin_lock(&device->submit.lock);
-	found_new = !list_empty(&device->submit.writes);
-	list_splice_tail_init(&device->submit.writes, reqs);
 	found_new |= !list_empty(&device->submit.peer_writes);
 	list_splice_tail_init(&device->submit.peer_writes, peer_reqs);
 	spin_unlock(&device->submit.lock);
@@ -2193,6 +3201,50 @@ static bool grab_new_incoming_requests(struct drbd_device *device, struct waitin
 	return found_new;
 }
 
+/*
+ * Group commit: we have activity log updates to commit, and room for more in
+ * the transaction.  Wait up to al_group_commit_usec for further requests
+ * missing the activity log, to write one transaction for all of them.
+ */
+static void al_group_commit_gather(struct drbd_device *device, struct waiting_for_act_log *wfa)
+{
+	unsigned int usec = READ_ONCE(drbd_al_group_commit_usec);
+	struct lru_cache *al = device->act_log;
+	unsigned int pending_before;
+	ktime_t start_kt, deadline;
+
+	if (!usec || !al->pending_changes || !wfa_lists_empty(wfa, incoming) ||
+	    drbd_md_dax_active(device->ldev))
+		return;
+
+	pending_before = al->pending_changes;
+	start_kt = ktime_get();
+	deadline = ktime_add_us(start_kt, usec);
+	while (al->pending_changes < al->max_pending_changes) {
+		ktime_t remaining = ktime_sub(deadline, ktime_get());
+		bool made_progress;
+
+		if (ktime_to_ns(remaining) <= 0)
+			break;
+		/* drbd_queue_write() and drbd_queue_peer_request() wake al_wait */
+		if (wait_event_hrtimeout(device->al_wait, submit_queued(device),
+				remaining))
+			break;
+		if (!grab_new_incoming_requests(device, wfa, true))
+			continue;
+
+		made_progress = prepare_al_transaction_nonblock(device, wfa);
+
+		wfa_splice_tail_init(wfa, more_incoming, incoming);
+		if (!made_progress || !wfa_lists_empty(wfa, incoming))
+			break;
+	}
+
+	device->al_gc.windows++;
+	device->al_gc.updates += al->pending_changes - pending_before;
+	device->al_gc.wait_ns += ktime_to_ns(ktime_sub(ktime_get(), start_kt));
+}
+
 void do_submit(struct work_struct *ws)
 {
 	struct drbd_device *device = container_of(ws, struct drbd_device, submit.worker);
@@ -2201,6 +3253,9 @@ void do_submit(struct work_struct *ws)
 
 	wfa_init(&wfa);
 
+	/* woken by drbd_al_write_endio()? */
+	al_pipeline_retire(device);
+
 	grab_new_incoming_requests(device, &wfa, false);
 
 	for (;;) {
@@ -2285,10 +3340,7 @@ void do_submit(struct work_struct *ws)
 		 */
 
 		while (wfa_lists_empty(&wfa, incoming)) {
-			/* It is ok to look outside the lock,
-			 * it's only an optimization anyways */
-			if (list_empty(&device->submit.writes) &&
-			    list_empty(&device->submit.peer_writes))
+			if (!submit_queued(device))
 				break;
 
 			if (!grab_new_incoming_requests(device, &wfa, true))
@@ -2300,13 +3352,349 @@ void do_submit(struct work_struct *ws)
 			if (!made_progress)
 				break;
 		}
+		al_group_commit_gather(device, &wfa);
+
 		if (!list_empty(&wfa.peer_requests.cleanup))
 			drbd_cleanup_peer_requests_wfa(device, &wfa.peer_requests.cleanup);
 
-		drbd_al_begin_io_commit(device);
+		al_commit_and_submit(device, &wfa);
+	}
+}
+
+/* Read ahead for a diskless Primary.
+ *
+ * Without a local disk every read is a round trip to a peer, and a
+ * sequential reader waits for each of them in turn. Once three reads in a
+ * row started where the one before ended, read ahead of the reader into a
+ * few DRBD_RA_ENTRIES, and answer the reads that fall into them without
+ * asking the peer again. The window starts at DRBD_RA_MIN_WINDOW and
+ * doubles each time it is refilled, up to remote_readahead_kb; a read
+ * elsewhere starts over.
+ *
+ * Only while this node is the only Primary: writes from here invalidate the
+ * entries they overlap, and any change of the roles invalidates them all,
+ * see finish_state_change(). */
+
+static bool ra_applies(struct drbd_device *device)
+{
+	struct drbd_resource *resource = device->resource;
+	struct drbd_connection *connection;
+	bool ok;
+
+	if (device->disk_state[NOW] != D_DISKLESS || resource->role[NOW] != R_PRIMARY)
+		return false;
+
+	ok = true;
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		if (connection->peer_role[NOW] == R_PRIMARY)
+			ok = false;
+	}
+	rcu_read_unlock();
+	return ok;
+}
+
+static void ra_bio_free(struct bio *bio)
+{
+	int i;
+
+	for (i = 0; i < bio->bi_vcnt; i++)
+		__free_page(bio->bi_io_vec[i].bv_page);
+	bio_put(bio);
+}
+
+/* Frees entries that were read to their end, are invalid, or too old; all
+ * with @all. Process context. */
+static void ra_expire(struct drbd_readahead *ra, bool all)
+{
+	struct bio *bios[DRBD_RA_ENTRIES];
+	int i, n = 0;
+
+	spin_lock_irq(&ra->lock);
+	for (i = 0; i < DRBD_RA_ENTRIES; i++) {
+		struct drbd_ra_entry *e = &ra->e[i];
+
+		if (!e->size || !e->done || e->users)
+			continue;
+		if (!all && e->valid && !e->consumed &&
+		    !time_after(jiffies, e->start + DRBD_RA_EXPIRE))
+			continue;
+		if (!e->consumed)
+			ra->dropped += e->size;
+		bios[n++] = e->bio;
+		memset(e, 0, sizeof(*e));
+	}
+	spin_unlock_irq(&ra->lock);
+
+	while (n--)
+		ra_bio_free(bios[n]);
+}
+
+/* Once no request is left; its bios are done. */
+void drbd_ra_free(struct drbd_device *device)
+{
+	if (!device->readahead)
+		return;
+	ra_expire(device->readahead, true);
+	kfree(device->readahead);
+	device->readahead = NULL;
+}
+
+/* Before any write is sent to a peer, or submitted locally */
+void drbd_ra_invalidate(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	struct drbd_readahead *ra = READ_ONCE(device->readahead);
+	unsigned long flags;
+	int i;
+
+	if (!ra || !size)
+		return;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	for (i = 0; i < DRBD_RA_ENTRIES; i++) {
+		struct drbd_ra_entry *e = &ra->e[i];
+
+		if (e->size && sector < e->sector + (e->size >> 9) &&
+		    e->sector < sector + (size >> 9))
+			e->valid = false;
+	}
+	spin_unlock_irqrestore(&ra->lock, flags);
+}
+
+/* Roles changed, someone else may write. Any context. */
+void drbd_ra_drop(struct drbd_device *device)
+{
+	struct drbd_readahead *ra = READ_ONCE(device->readahead);
+	unsigned long flags;
+	int i;
+
+	if (!ra)
+		return;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	for (i = 0; i < DRBD_RA_ENTRIES; i++)
+		ra->e[i].valid = false;
+	ra->seq = 0;
+	ra->window = 0;
+	ra->ra_end = 0;
+	spin_unlock_irqrestore(&ra->lock, flags);
+}
+
+static void drbd_ra_endio(struct bio *bio)
+{
+	struct drbd_device *device = bio->bi_private;
+	struct drbd_readahead *ra = device->readahead;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	for (i = 0; i < DRBD_RA_ENTRIES; i++) {
+		struct drbd_ra_entry *e = &ra->e[i];
 
-		send_and_submit_pending(device, &wfa);
+		if (e->bio != bio)
+			continue;
+		e->done = true;
+		if (bio->bi_status)
+			e->valid = false;
+		break;
 	}
+	spin_unlock_irqrestore(&ra->lock, flags);
+}
+
+static void ra_copy(struct bio *bio, struct drbd_ra_entry *e)
+{
+	unsigned int offset = (bio->bi_iter.bi_sector - e->sector) << 9;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		unsigned int done = 0;
+
+		while (done < bvec.bv_len) {
+			struct page *page = e->bio->bi_io_vec[offset >> PAGE_SHIFT].bv_page;
+			unsigned int o = offset & (PAGE_SIZE - 1);
+			unsigned int l = min_t(unsigned int, bvec.bv_len - done, PAGE_SIZE - o);
+			void *src = kmap_atomic(page);
+			void *dst = kmap_atomic(bvec.bv_page);
+
+			memcpy(dst + bvec.bv_offset + done, src + o, l);
+			kunmap_atomic(dst);
+			kunmap_atomic(src);
+			done += l;
+			offset += l;
+		}
+	}
+}
+
+/* Reads [sector, end) ahead, in pieces as large as the peers take them, as
+ * long as there are free entries. Process context. */
+static void ra_issue(struct drbd_device *device, sector_t sector, sector_t end)
+{
+	struct drbd_readahead *ra = device->readahead;
+	unsigned int max_size = min3(queue_max_hw_sectors(device->rq_queue) << 9,
+				     (unsigned int)DRBD_MAX_BIO_SIZE,
+				     (unsigned int)BIO_MAX_PAGES << PAGE_SHIFT);
+	sector_t ra_end = end;
+
+	end = min_t(sector_t, end, get_capacity(device->vdisk));
+	while (sector < end) {
+		unsigned int size = min_t(sector_t, max_size >> 9, end - sector) << 9;
+		unsigned int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE), left = size;
+		struct drbd_ra_entry *e = NULL;
+		struct bio *bio;
+#ifdef CONFIG_DRBD_TIMING_STATS
+		ktime_t start_kt;
+#endif
+		int i;
+
+		spin_lock_irq(&ra->lock);
+		for (i = 0; i < DRBD_RA_ENTRIES; i++) {
+			if (!ra->e[i].size) {
+				e = &ra->e[i];
+				e->sector = sector;
+				e->size = size;
+				e->start = jiffies;
+				e->valid = true;
+				break;
+			}
+		}
+		spin_unlock_irq(&ra->lock);
+		if (!e)
+			break;
+
+		bio = bio_alloc(GFP_NOIO, nr_pages);
+		for (i = 0; i < nr_pages; i++) {
+			struct page *page = alloc_page(GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY);
+			unsigned int l = min_t(unsigned int, left, PAGE_SIZE);
+
+			if (!page)
+				break;
+			bio_add_page(bio, page, l, 0);
+			left -= l;
+		}
+		if (left) {
+			ra_bio_free(bio);
+			spin_lock_irq(&ra->lock);
+			memset(e, 0, sizeof(*e));
+			spin_unlock_irq(&ra->lock);
+			break;
+		}
+		bio_set_dev(bio, device->this_bdev);
+		bio->bi_iter.bi_sector = sector;
+		bio->bi_opf = REQ_OP_READ | REQ_RAHEAD;
+		bio->bi_end_io = drbd_ra_endio;
+		bio->bi_private = device;
+
+		spin_lock_irq(&ra->lock);
+		e->bio = bio;
+		ra->bytes_issued += size;
+		spin_unlock_irq(&ra->lock);
+
+		ktime_get_accounting(start_kt);
+		__drbd_make_request(device, bio, start_kt, jiffies);
+		sector += size >> 9;
+	}
+
+	if (sector < end) {
+		/* try the rest again with the next read */
+		spin_lock_irq(&ra->lock);
+		if (ra->ra_end == ra_end)
+			ra->ra_end = sector;
+		spin_unlock_irq(&ra->lock);
+	}
+}
+
+/**
+ * drbd_ra_read() - Answer a read of a diskless Primary from data read ahead
+ * @device:	DRBD device.
+ * @bio:	The application's read.
+ * @from:	Set to where to read ahead from, if to be done.
+ * @to:		Set to where to read ahead to, 0 if nothing to do.
+ *
+ * Returns true if @bio is completed.
+ */
+static bool drbd_ra_read(struct drbd_device *device, struct bio *bio,
+			 sector_t *from, sector_t *to)
+{
+	unsigned int limit = READ_ONCE(drbd_remote_readahead_kb) << 10;
+	sector_t sector = bio->bi_iter.bi_sector;
+	unsigned int size = bio->bi_iter.bi_size;
+	struct drbd_readahead *ra = device->readahead;
+	struct drbd_ra_entry *hit = NULL;
+	int i;
+
+	*to = 0;
+	if (!limit || !size || !ra_applies(device))
+		return false;
+
+	if (!ra) {
+		ra = kzalloc(sizeof(*ra), GFP_NOIO | __GFP_NOWARN);
+		if (!ra)
+			return false;
+		spin_lock_init(&ra->lock);
+		smp_store_release(&device->readahead, ra);
+	}
+	ra_expire(ra, false);
+
+	spin_lock_irq(&ra->lock);
+	for (i = 0; i < DRBD_RA_ENTRIES; i++) {
+		struct drbd_ra_entry *e = &ra->e[i];
+
+		if (e->size && e->done && e->valid && sector >= e->sector &&
+		    sector + (size >> 9) <= e->sector + (e->size >> 9)) {
+			e->users++;
+			hit = e;
+			break;
+		}
+	}
+
+	if (sector == ra->next_sector || hit) {
+		ra->seq++;
+	} else {
+		/* a new stream, what is read ahead for the last one goes */
+		for (i = 0; i < DRBD_RA_ENTRIES; i++)
+			ra->e[i].valid = false;
+		ra->seq = 0;
+		ra->window = 0;
+		ra->ra_end = 0;
+	}
+	ra->next_sector = sector + (size >> 9);
+
+	if (hit) {
+		ra->hits++;
+		ra->bytes_hit += size;
+	} else if (ra->seq >= 2) {
+		ra->misses++;
+	}
+
+	if (ra->seq >= 2) {
+		sector_t start = max(ra->ra_end, ra->next_sector);
+
+		if (!ra->window)
+			ra->window = min_t(unsigned int, DRBD_RA_MIN_WINDOW, limit);
+		/* refill once less than half the window is left ahead */
+		if ((start - ra->next_sector) << 9 < ra->window / 2) {
+			*from = start;
+			*to = ra->next_sector + (ra->window >> 9);
+			ra->ra_end = *to;
+			ra->window = min(ra->window * 2, limit);
+		}
+	}
+	spin_unlock_irq(&ra->lock);
+
+	if (!hit)
+		return false;
+
+	ra_copy(bio, hit);
+	spin_lock_irq(&ra->lock);
+	hit->users--;
+	if (ra->next_sector >= hit->sector + (hit->size >> 9))
+		hit->consumed = true;
+	spin_unlock_irq(&ra->lock);
+
+	bio->bi_status = BLK_STS_OK;
+	bio_endio(bio);
+	return true;
 }
 
 blk_qc_t drbd_make_request(struct request_queue *q, struct bio *bio)
@@ -2316,6 +3704,7 @@ blk_qc_t drbd_make_request(struct request_queue *q, struct bio *bio)
 	ktime_t start_kt;
 #endif
 	unsigned long start_jif;
+	sector_t ra_from, ra_to = 0;
 
 	blk_queue_split(q, &bio);
 
@@ -2325,20 +3714,23 @@ blk_qc_t drbd_make_request(struct request_queue *q, struct bio *bio)
 		return BLK_QC_T_NONE;
 	}
 
+	if (bio_op(bio) == REQ_OP_READ) {
+		if (drbd_ra_read(device, bio, &ra_from, &ra_to))
+			goto read_ahead;
+	} else {
+		drbd_ra_invalidate(device, bio->bi_iter.bi_sector, bio->bi_iter.bi_size);
+	}
+
 	ktime_get_accounting(start_kt);
 	start_jif = jiffies;
 
 	__drbd_make_request(device, bio, start_kt, start_jif);
 
-	return BLK_QC_T_NONE;
-}
+read_ahead:
+	if (ra_to)
+		ra_issue(device, ra_from, ra_to);
 
-static unsigned long time_min_in_future(unsigned long now,
-		unsigned long t1, unsigned long t2)
-{
-	t1 = time_after(now, t1) ? now : t1;
-	t2 = time_after(now, t2) ? now : t2;
-	return time_after(t1, t2) ? t2 : t1;
+	return BLK_QC_T_NONE;
 }
 
 static bool net_timeout_reached(struct drbd_request *net_req,
@@ -2418,14 +3810,11 @@ static bool net_timeout_reached(struct drbd_request *net_req,
 void request_timer_fn(struct timer_list *t)
 {
 	struct drbd_device *device = from_timer(device, t, request_timer);
-	struct drbd_connection *connection;
 	struct drbd_request *req_read, *req_write;
+	unsigned long write_pre_submit_jif, read_pre_submit_jif;
 	unsigned long oldest_submit_jif;
 	unsigned long dt = 0;
-	unsigned long et = 0;
 	unsigned long now = jiffies;
-	unsigned long next_trigger_time = now;
-	bool restart_timer = false;
 
 	rcu_read_lock();
 	if (get_ldev(device)) { /* implicit state.disk >= D_INCONSISTENT */
@@ -2434,105 +3823,111 @@ void request_timer_fn(struct timer_list *t)
 	}
 	rcu_read_unlock();
 
-	/* FIXME right now, this basically does a full transfer log walk *every time* */
-	read_lock_irq(&device->resource->state_rwlock);
-	if (dt) {
-		unsigned long write_pre_submit_jif, read_pre_submit_jif;
+	/* Requests waiting for the network are watched by
+	 * connection_request_timer_fn(), once per connection. */
+	if (!dt)
+		return;
 
-		spin_lock(&device->pending_completion_lock); /* local irq already disabled */
-		req_read = list_first_entry_or_null(&device->pending_completion[0], struct drbd_request, req_pending_local);
-		req_write = list_first_entry_or_null(&device->pending_completion[1], struct drbd_request, req_pending_local);
-		spin_unlock(&device->pending_completion_lock);
+	/* The oldest requests are the first on the pending lists */
+	spin_lock_irq(&device->pending_completion_lock);
+	req_read = list_first_entry_or_null(&device->pending_completion[0], struct drbd_request, req_pending_local);
+	req_write = list_first_entry_or_null(&device->pending_completion[1], struct drbd_request, req_pending_local);
+	if (req_write)
+		write_pre_submit_jif = req_write->pre_submit_jif;
+	if (req_read)
+		read_pre_submit_jif = req_read->pre_submit_jif;
+	spin_unlock_irq(&device->pending_completion_lock);
 
-		if (req_write)
-			write_pre_submit_jif = req_write->pre_submit_jif;
-		if (req_read)
-			read_pre_submit_jif = req_read->pre_submit_jif;
-		oldest_submit_jif =
-			(req_write && req_read)
-			? ( time_before(write_pre_submit_jif, read_pre_submit_jif)
-			  ? write_pre_submit_jif : read_pre_submit_jif )
-			: req_write ? write_pre_submit_jif
-			: req_read ? read_pre_submit_jif : now;
-
-		if (device->disk_state[NOW] > D_FAILED) {
-			et = min_not_zero(et, dt);
-			next_trigger_time = time_min_in_future(now,
-					next_trigger_time, oldest_submit_jif + dt);
-			restart_timer = true;
-		}
+	oldest_submit_jif =
+		(req_write && req_read)
+		? ( time_before(write_pre_submit_jif, read_pre_submit_jif)
+		  ? write_pre_submit_jif : read_pre_submit_jif )
+		: req_write ? write_pre_submit_jif
+		: req_read ? read_pre_submit_jif : now;
 
-		if (time_after(now, oldest_submit_jif + dt) &&
-		    !time_in_range(now, device->last_reattach_jif, device->last_reattach_jif + dt)) {
-			drbd_warn(device, "Local backing device failed to meet the disk-timeout\n");
-			__drbd_chk_io_error(device, DRBD_FORCE_DETACH);
-		}
+	if (time_after(now, oldest_submit_jif + dt) &&
+	    !time_in_range(now, device->last_reattach_jif, device->last_reattach_jif + dt)) {
+		read_lock_irq(&device->resource->state_rwlock);
+		drbd_warn(device, "Local backing device failed to meet the disk-timeout\n");
+		__drbd_chk_io_error(device, DRBD_FORCE_DETACH);
+		read_unlock_irq(&device->resource->state_rwlock);
 	}
-	for_each_connection(connection, device->resource) {
-		struct drbd_peer_device *peer_device = conn_peer_device(connection, device->vnr);
-		struct net_conf *nc;
-		struct drbd_request *req;
-		unsigned long ent = 0;
-		unsigned long pre_send_jif = 0;
-		unsigned int ko_count = 0, timeout = 0;
-
-		/* maybe the oldest request waiting for the peer is in fact still
-		 * blocking in tcp sendmsg.  That's ok, though, that's handled via the
-		 * socket send timeout, requesting a ping, and bumping ko-count in
-		 * we_should_drop_the_connection().
-		 */
 
-		/* check the oldest request we did successfully sent,
-		 * but which is still waiting for an ACK. */
-		req = connection->req_ack_pending;
-
-		/* if we don't have such request (e.g. protocol A)
-		 * check the oldest requests which is still waiting on its epoch
-		 * closing barrier ack. */
-		if (!req)
-			req = connection->req_not_net_done;
+	if (device->disk_state[NOW] > D_FAILED)
+		mod_timer(&device->request_timer, time_after(oldest_submit_jif + dt, now) ?
+			  oldest_submit_jif + dt : now + dt);
+}
 
-		/* evaluate the oldest peer request only in one timer! */
-		if (req && req->device != device)
-			req = NULL;
-		if (!req)
-			continue;
+/* The oldest request this connection waits for is always at one of the two
+ * cache pointers, and as ko-count * timeout is the same for all of them, it
+ * is also the one with the earliest deadline. So this only needs to look at
+ * that one request, and to fire when it expires; it stops when there is
+ * nothing to wait for, until the next request is sent. */
+void connection_request_timer_fn(struct timer_list *t)
+{
+	struct drbd_connection *connection = from_timer(connection, t, request_timer);
+	struct drbd_resource *resource = connection->resource;
+	struct drbd_peer_device *peer_device;
+	struct drbd_request *req;
+	struct net_conf *nc;
+	unsigned int ko_count = 0, timeout = 0;
+	unsigned long now = jiffies;
+	unsigned long ent, deadline;
+	bool timed_out;
 
-		rcu_read_lock();
-		nc = rcu_dereference(connection->transport.net_conf);
-		if (nc) {
-			/* effective timeout = ko_count * timeout */
-			if (connection->cstate[NOW] == C_CONNECTED) {
-				ko_count = nc->ko_count;
-				timeout = nc->timeout;
-			}
-		}
+	rcu_read_lock();
+	nc = rcu_dereference(connection->transport.net_conf);
+	/* effective timeout = ko_count * timeout */
+	if (nc && connection->cstate[NOW] == C_CONNECTED) {
+		ko_count = nc->ko_count;
+		timeout = nc->timeout;
+	}
+	ent = timeout * HZ/10 * ko_count;
+	if (!ent) {
 		rcu_read_unlock();
+		return;
+	}
 
-		if (!timeout)
-			continue;
+	/* maybe the oldest request waiting for the peer is in fact still
+	 * blocking in tcp sendmsg.  That's ok, though, that's handled via the
+	 * socket send timeout, requesting a ping, and bumping ko-count in
+	 * we_should_drop_the_connection().
+	 */
 
-		pre_send_jif = req->pre_send_jif[connection->peer_node_id];
-
-		ent = timeout * HZ/10 * ko_count;
-		et = min_not_zero(et, ent);
-		next_trigger_time = time_min_in_future(now,
-				next_trigger_time, pre_send_jif + ent);
-		restart_timer = true;
-
-		if (net_timeout_reached(req, peer_device, now, ent, ko_count, timeout)) {
-			dynamic_drbd_dbg(peer_device, "Request at %llus+%u timed out\n",
-					(unsigned long long) req->i.sector,
-					req->i.size);
-			begin_state_change_locked(device->resource, CS_VERBOSE | CS_HARD);
-			__change_cstate(connection, C_TIMEOUT);
-			end_state_change_locked(device->resource);
-		}
+	/* check the oldest request we did successfully sent,
+	 * but which is still waiting for an ACK. */
+	req = READ_ONCE(connection->req_ack_pending);
+
+	/* if we don't have such request (e.g. protocol A)
+	 * check the oldest requests which is still waiting on its epoch
+	 * closing barrier ack. */
+	if (!req)
+		req = READ_ONCE(connection->req_not_net_done);
+	if (!req) {
+		rcu_read_unlock();
+		return;
 	}
-	read_unlock_irq(&device->resource->state_rwlock);
 
-	if (restart_timer) {
-		next_trigger_time = time_min_in_future(now, next_trigger_time, now + et);
-		mod_timer(&device->request_timer, next_trigger_time);
+	peer_device = conn_peer_device(connection, req->device->vnr);
+	deadline = req->pre_send_jif[connection->peer_node_id] + ent;
+	timed_out = net_timeout_reached(req, peer_device, now, ent, ko_count, timeout);
+	if (timed_out)
+		dynamic_drbd_dbg(peer_device, "Request at %llus+%u timed out\n",
+				(unsigned long long) req->i.sector,
+				req->i.size);
+	rcu_read_unlock();
+
+	if (timed_out) {
+		read_lock_irq(&resource->state_rwlock);
+		begin_state_change_locked(resource, CS_VERBOSE | CS_HARD);
+		__change_cstate(connection, C_TIMEOUT);
+		end_state_change_locked(resource);
+		read_unlock_irq(&resource->state_rwlock);
+		return;
 	}
+
+	/* Not expired yet, or deferred (reconnect, barrier not sent yet):
+	 * look again at the deadline, respectively one timeout later. */
+	mod_timer(&connection->request_timer, time_after(deadline, now) ?
+		  deadline : now + timeout * HZ/10);
 }
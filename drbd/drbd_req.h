@@ -174,6 +174,11 @@ enum drbd_req_state_bits {
 	/* peer called drbd_set_in_sync() for this write */
 	__RQ_NET_SIS,
 
+	/* protocol A write, copied into the send buffer of the connection,
+	 * see drbd_sbuf_reserve(). Already OK and no longer PENDING, and
+	 * QUEUED does not hold a completion_ref. */
+	__RQ_NET_BUFFERED,
+
 	/* keep this last, its for the RQ_NET_MASK */
 	__RQ_NET_MAX,
 
@@ -228,6 +233,7 @@ enum drbd_req_state_bits {
 #define RQ_NET_DONE        (1UL << __RQ_NET_DONE)
 #define RQ_NET_OK          (1UL << __RQ_NET_OK)
 #define RQ_NET_SIS         (1UL << __RQ_NET_SIS)
+#define RQ_NET_BUFFERED    (1UL << __RQ_NET_BUFFERED)
 
 #define RQ_NET_MASK        (((1UL << __RQ_NET_MAX)-1) & ~RQ_LOCAL_MASK)
 
@@ -282,6 +288,89 @@ struct bio_and_error {
 	int error;
 };
 
+/* Last sector covered by an interval; zero sized intervals cover their start. */
+static inline sector_t drbd_write_last_sector(sector_t sector, unsigned int size)
+{
+	return size ? sector + (size >> 9) - 1 : sector;
+}
+
+static inline bool drbd_write_spans(sector_t sector, unsigned int size)
+{
+	return (sector >> DRBD_WRITE_SHARD_SHIFT) !=
+		(drbd_write_last_sector(sector, size) >> DRBD_WRITE_SHARD_SHIFT);
+}
+
+static inline struct drbd_write_shard *
+drbd_write_shard(struct drbd_device *device, sector_t sector)
+{
+	return &device->write_shards[(sector >> DRBD_WRITE_SHARD_SHIFT) % DRBD_WRITE_SHARDS];
+}
+
+/*
+ * drbd_write_lock  -  lock the write conflict detection state of a range
+ *
+ * A range within one region takes write_span_lock shared and its shard
+ * exclusively; it may then look at its shard tree and at the (stable)
+ * write_span tree.  A range crossing a region boundary takes write_span_lock
+ * exclusively, which stabilizes every tree.  Interrupts must be disabled.
+ */
+static inline void drbd_write_lock(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	if (drbd_write_spans(sector, size)) {
+		write_lock(&device->write_span_lock);
+	} else {
+		read_lock(&device->write_span_lock);
+		spin_lock(&drbd_write_shard(device, sector)->lock);
+	}
+}
+
+static inline void drbd_write_unlock(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	if (drbd_write_spans(sector, size)) {
+		write_unlock(&device->write_span_lock);
+	} else {
+		spin_unlock(&drbd_write_shard(device, sector)->lock);
+		read_unlock(&device->write_span_lock);
+	}
+}
+
+static inline void drbd_write_lock_irq(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	local_irq_disable();
+	drbd_write_lock(device, sector, size);
+}
+
+static inline void drbd_write_unlock_irq(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	drbd_write_unlock(device, sector, size);
+	local_irq_enable();
+}
+
+/* State of a walk over all write intervals overlapping a range, which may
+ * need to visit several shard trees and the write_span tree. */
+struct drbd_write_overlap {
+	struct drbd_device *device;
+	sector_t sector;
+	unsigned int size;
+	unsigned int shard;	/* next shard tree to search */
+	unsigned int nr_shards;	/* shard trees left to search */
+	bool span_done;
+};
+
+extern void drbd_insert_write_interval(struct drbd_device *, struct drbd_interval *);
+extern void drbd_remove_write_interval(struct drbd_device *, struct drbd_interval *);
+extern bool drbd_contains_write_interval(struct drbd_device *, sector_t, struct drbd_interval *);
+extern struct drbd_interval *drbd_find_write_overlap(struct drbd_device *,
+		struct drbd_write_overlap *, sector_t, unsigned int);
+extern struct drbd_interval *drbd_next_write_overlap(struct drbd_write_overlap *,
+		struct drbd_interval *);
+
+/* Caller must hold drbd_write_lock() for the range [sector, sector + size) */
+#define drbd_for_each_write_overlap(i, o, device, sector, size)	\
+	for (i = drbd_find_write_overlap(device, o, sector, size);	\
+	     i;								\
+	     i = drbd_next_write_overlap(o, i))
+
 extern bool start_new_tl_epoch(struct drbd_resource *resource);
 extern void drbd_req_destroy(struct kref *kref);
 extern void __req_mod(struct drbd_request *req, enum drbd_req_event what,
@@ -290,6 +379,7 @@ extern void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 extern void complete_master_bio(struct drbd_device *device,
 		struct bio_and_error *m);
 extern void request_timer_fn(struct timer_list *t);
+extern void connection_request_timer_fn(struct timer_list *t);
 extern void tl_walk(struct drbd_connection *connection, enum drbd_req_event what);
 extern void _tl_walk(struct drbd_connection *connection, enum drbd_req_event what);
 extern void __tl_walk(struct drbd_resource *const resource,
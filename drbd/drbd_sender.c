@@ -22,6 +22,7 @@
 #include <linux/slab.h>
 #include <linux/random.h>
 #include <linux/scatterlist.h>
+#include <linux/hash.h>
 
 #include "drbd_int.h"
 #include "drbd_protocol.h"
@@ -83,10 +84,12 @@ void drbd_md_endio(struct bio *bio)
 	wake_up(&device->misc_wait);
 }
 
+static bool drbd_queue_csum_job(struct drbd_peer_request *peer_req);
+
 /* reads on behalf of the partner,
  * "submitted" by the receiver
  */
-static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __releases(local)
+static void drbd_read_sec_done(struct drbd_peer_request *peer_req)
 {
 	unsigned long flags = 0;
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
@@ -94,7 +97,7 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 	struct drbd_connection *connection = peer_device->connection;
 
 	spin_lock_irqsave(&connection->peer_reqs_lock, flags);
-	device->read_cnt += peer_req->i.size >> 9;
+	this_cpu_add(device->io_cnt->read, peer_req->i.size >> 9);
 	list_del(&peer_req->w.list);
 	if (list_empty(&connection->read_ee))
 		wake_up(&connection->ee_wait);
@@ -103,6 +106,33 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 	spin_unlock_irqrestore(&connection->peer_reqs_lock, flags);
 
 	drbd_queue_work(&connection->sender_work, &peer_req->w);
+}
+
+/* The result of the read is known without it: w_e_end_rsdata_req() for an
+ * EE_RS_UNALLOCATED request, or one drbd_rs_cache_lookup() answered. */
+void drbd_read_sec_skipped(struct drbd_peer_request *peer_req) __releases(local)
+{
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_connection *connection = peer_device->connection;
+
+	spin_lock_irq(&connection->peer_reqs_lock);
+	list_del(&peer_req->w.list);
+	if (list_empty(&connection->read_ee))
+		wake_up(&connection->ee_wait);
+	spin_unlock_irq(&connection->peer_reqs_lock);
+
+	drbd_queue_work(&connection->sender_work, &peer_req->w);
+	put_ldev(peer_device->device);
+}
+
+/* Resync and verify reads go via drbd_csum_wq, and stay on read_ee until
+ * they are hashed */
+static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __releases(local)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+
+	if (test_bit(__EE_WAS_ERROR, &peer_req->flags) || !drbd_queue_csum_job(peer_req))
+		drbd_read_sec_done(peer_req);
 	put_ldev(device);
 }
 
@@ -116,6 +146,11 @@ static int is_failed_barrier(int ee_flags)
  * "submitted" by the receiver, final stage.  */
 void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(local)
 {
+	/* see inline_acks; decided before we take any lock.  Without
+	 * CONFIG_PREEMPT_COUNT we cannot tell whether the caller holds a
+	 * spinlock, so never send from here then. */
+	bool send_inline = IS_ENABLED(CONFIG_PREEMPT_COUNT) && READ_ONCE(drbd_inline_acks) &&
+		in_task() && preemptible();
 	unsigned long flags = 0;
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
 	struct drbd_device *device = peer_device->device;
@@ -157,12 +192,12 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
         }
 
 	spin_lock_irqsave(&connection->peer_reqs_lock, flags);
-	device->writ_cnt += peer_req->i.size >> 9;
+	this_cpu_add(device->io_cnt->writ, peer_req->i.size >> 9);
 	atomic_inc(&connection->done_ee_cnt);
 	list_move_tail(&peer_req->w.list, &connection->done_ee);
 
 	/*
-	 * Do not remove from the write_requests tree here: we did not send the
+	 * Do not remove from the write interval trees here: we did not send the
 	 * Ack yet and did not wake possibly waiting conflicting requests.
 	 * Removed from the tree from "drbd_process_done_ee" within the
 	 * appropriate callback (e_end_block/e_end_resync_block) or from
@@ -179,7 +214,9 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 	if (peer_req->flags & EE_WAS_ERROR)
 		__drbd_chk_io_error(device, DRBD_WRITE_ERROR);
 
-	if (connection->cstate[NOW] == C_CONNECTED)
+	if (connection->cstate[NOW] != C_CONNECTED)
+		send_inline = false;
+	else if (!send_inline)
 		queue_work(connection->ack_sender, &connection->send_acks_work);
 	spin_unlock_irqrestore(&connection->peer_reqs_lock, flags);
 
@@ -189,6 +226,9 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 	if (do_wake)
 		wake_up(&connection->ee_wait);
 
+	if (send_inline)
+		drbd_send_acks_inline(connection);
+
 	put_ldev(device);
 }
 
@@ -223,6 +263,28 @@ void drbd_peer_request_endio(struct bio *bio)
 	}
 }
 
+/* peer writes submitted as one bio, linked by ->merged_next */
+void drbd_peer_request_merged_endio(struct bio *bio)
+{
+	struct drbd_peer_request *peer_req = bio->bi_private, *next;
+	struct drbd_device *device = peer_req->peer_device->device;
+	blk_status_t status = bio->bi_status;
+
+	if (status && drbd_ratelimit())
+		drbd_warn(device, "write: error=%d s=%llus+%u\n", status,
+			  (unsigned long long)bio->bi_iter.bi_sector, bio->bi_iter.bi_size);
+
+	bio_put(bio);
+	for (; peer_req; peer_req = next) {
+		next = peer_req->merged_next;
+		peer_req->merged_next = NULL;
+		if (status)
+			set_bit(__EE_WAS_ERROR, &peer_req->flags);
+		if (atomic_dec_and_test(&peer_req->pending_bios))
+			drbd_endio_write_sec_final(peer_req);
+	}
+}
+
 /* Not static to increase the likelyhood that it will show up in a stack trace */
 void drbd_panic_after_delayed_completion_of_aborted_request(struct drbd_device *device)
 {
@@ -299,6 +361,9 @@ void drbd_request_endio(struct bio *bio)
 		what = COMPLETED_OK;
 	}
 
+	drbd_lat_record(device, bio_data_dir(bio) == WRITE ?
+			DRBD_LAT_LOCAL_WRITE : DRBD_LAT_LOCAL_READ, req->lat_submit_kt);
+
 	bio_put(req->private_bio);
 	req->private_bio = ERR_PTR(blk_status_to_errno(status));
 
@@ -318,6 +383,18 @@ void drbd_csum_pages(struct crypto_shash *tfm, struct page *page, void *digest)
 
 	desc->tfm = tfm;
 
+	/* A single page, as for every block of online verify: one call
+	 * instead of init, update and final */
+	if (page && !page_chain_next(page)) {
+		u8 *src = kmap_atomic(page);
+
+		crypto_shash_digest(desc, src + page_chain_offset(page),
+				    page_chain_size(page), digest);
+		kunmap_atomic(src);
+		shash_desc_zero(desc);
+		return;
+	}
+
 	crypto_shash_init(desc);
 
 	page_chain_for_each(page) {
@@ -356,6 +433,99 @@ void drbd_csum_bio(struct crypto_shash *tfm, struct bio *bio, void *digest)
 	shash_desc_zero(desc);
 }
 
+static struct crypto_shash *csum_job_tfm(struct drbd_peer_request *peer_req);
+
+static void drbd_csum_batch_fn(struct work_struct *ws)
+{
+	struct drbd_csum_batch *batch = container_of(ws, struct drbd_csum_batch, work);
+	struct drbd_connection *connection = batch->connection;
+	struct drbd_csum_job *job, *tmp;
+
+	/* closed for new jobs from now on */
+	spin_lock_irq(&connection->csum_batch_lock);
+	if (connection->csum_batch == batch)
+		connection->csum_batch = NULL;
+	spin_unlock_irq(&connection->csum_batch_lock);
+
+	list_for_each_entry_safe(job, tmp, &batch->jobs, list) {
+		struct drbd_peer_request *peer_req = job->peer_req;
+		struct crypto_shash *tfm = csum_job_tfm(peer_req);
+
+		list_del(&job->list);
+		if (tfm && crypto_shash_digestsize(tfm) <= sizeof(job->digest)) {
+			drbd_csum_pages(tfm, peer_req->page_chain.head, job->digest);
+			job->tfm = tfm;
+			peer_req->csum_job = job;
+		} else {
+			kfree(job);
+		}
+		/* the connection may go away once the last one is done */
+		drbd_read_sec_done(peer_req);
+	}
+	kfree(batch);
+}
+
+/* Hash a completed resync or verify read on drbd_csum_wq, so that the sender
+ * only has to send the digest.  Returns false if it is not such a read, or
+ * if it should be hashed by the sender after all.
+ *
+ * Jobs are batched: as long as the last batch queued for the connection has
+ * not started, further reads join it, so under load one work item hashes
+ * many blocks, while several batches still run on different CPUs. */
+static bool drbd_queue_csum_job(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	struct drbd_csum_batch *batch, *new_batch = NULL;
+	struct drbd_csum_job *job;
+	unsigned long flags;
+
+	if (!READ_ONCE(drbd_csum_offload) || !csum_job_tfm(peer_req))
+		return false;
+
+	job = kmalloc(sizeof(*job), GFP_ATOMIC);
+	if (!job)
+		return false;
+	job->peer_req = peer_req;
+	job->tfm = NULL;
+	job->integrity = NULL;
+
+	spin_lock_irqsave(&connection->csum_batch_lock, flags);
+	batch = connection->csum_batch;
+	if (!batch || batch->nr_jobs >= DRBD_CSUM_BATCH_MAX) {
+		new_batch = kmalloc(sizeof(*new_batch), GFP_ATOMIC);
+		if (!new_batch) {
+			spin_unlock_irqrestore(&connection->csum_batch_lock, flags);
+			kfree(job);
+			return false;
+		}
+		INIT_WORK(&new_batch->work, drbd_csum_batch_fn);
+		new_batch->connection = connection;
+		INIT_LIST_HEAD(&new_batch->jobs);
+		new_batch->nr_jobs = 0;
+		batch = new_batch;
+		connection->csum_batch = batch;
+	}
+	list_add_tail(&job->list, &batch->jobs);
+	batch->nr_jobs++;
+	spin_unlock_irqrestore(&connection->csum_batch_lock, flags);
+
+	if (new_batch)
+		queue_work(drbd_csum_wq, &new_batch->work);
+	return true;
+}
+
+/* The digest of the data of peer_req, hashed ahead if possible */
+static void drbd_csum_peer_req(struct crypto_shash *tfm, struct drbd_peer_request *peer_req,
+			       void *digest)
+{
+	struct drbd_csum_job *job = peer_req->csum_job;
+
+	if (job && job->tfm == tfm)
+		memcpy(digest, job->digest, crypto_shash_digestsize(tfm));
+	else
+		drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+}
+
 /* MAYBE merge common code with w_e_end_ov_req */
 static int w_e_send_csum(struct drbd_work *w, int cancel)
 {
@@ -374,7 +544,7 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 	digest_size = crypto_shash_digestsize(peer_device->connection->csums_tfm);
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (digest) {
-		drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+		drbd_csum_peer_req(peer_device->connection->csums_tfm, peer_req, digest);
 		/* Free peer_req and pages before send.
 		 * In case we block on congestion, we could otherwise run into
 		 * some distributed deadlock, if the other side blocks on
@@ -398,6 +568,18 @@ out:
 	return err;
 }
 
+/* The digest the sender will need for a completed read, if any */
+static struct crypto_shash *csum_job_tfm(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+
+	if (peer_req->w.cb == w_e_send_csum || peer_req->w.cb == w_e_end_csum_rs_req)
+		return READ_ONCE(connection->csums_tfm);
+	if (peer_req->w.cb == w_e_end_ov_req || peer_req->w.cb == w_e_end_ov_reply)
+		return READ_ONCE(connection->verify_tfm);
+	return NULL;
+}
+
 static int read_for_csum(struct drbd_peer_device *peer_device, sector_t sector, int size)
 {
 	struct drbd_connection *connection = peer_device->connection;
@@ -408,15 +590,9 @@ static int read_for_csum(struct drbd_peer_device *peer_device, sector_t sector,
 		return -EIO;
 
 	/* Do not wait if no memory is immediately available.  */
-	peer_req = drbd_alloc_peer_req(peer_device, GFP_TRY & ~__GFP_RECLAIM);
+	peer_req = drbd_rs_alloc_peer_req(peer_device, size, GFP_TRY & ~__GFP_RECLAIM);
 	if (!peer_req)
 		goto defer;
-	if (size) {
-		drbd_alloc_page_chain(&connection->transport,
-			&peer_req->page_chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
-		if (!peer_req->page_chain.head)
-			goto defer2;
-	}
 	peer_req->i.size = size;
 	peer_req->i.sector = sector;
 	peer_req->block_id = ID_SYNCER; /* unused */
@@ -609,6 +785,243 @@ static int drbd_rs_controller(struct drbd_peer_device *peer_device, u64 sect_in,
 	return req_sect;
 }
 
+/* Pacing gains of the BBR style controller, in 1/8 */
+#define RS_BBR_STARTUP_GAIN	23	/* ~2/ln(2), doubles the rate per turn */
+#define RS_BBR_DRAIN_GAIN	3	/* ~1/startup gain */
+#define RS_BBR_CWND_GAIN	16
+#define RS_BBR_MIN_CWND		(4 * BM_SECT_PER_BIT)
+#define RS_BBR_MIN_RTT_WIN	(10 * HZ)
+#define RS_BBR_PROBE_RTT_TIME	(HZ / 5)
+
+static const unsigned int rs_bbr_cycle_gain[] = { 10, 6, 8, 8, 8, 8, 8, 8 };
+
+static const char * const rs_bbr_mode_names[] = {
+	[RS_BBR_STARTUP] = "startup",
+	[RS_BBR_DRAIN] = "drain",
+	[RS_BBR_PROBE_BW] = "probe_bw",
+	[RS_BBR_PROBE_RTT] = "probe_rtt",
+};
+
+const char *drbd_rs_bbr_mode_name(enum drbd_rs_bbr_mode mode)
+{
+	return mode < ARRAY_SIZE(rs_bbr_mode_names) ? rs_bbr_mode_names[mode] : "?";
+}
+
+static void rs_bbr_reset(struct drbd_peer_device *peer_device)
+{
+	struct drbd_rs_bbr *bbr = &peer_device->rs_bbr;
+
+	bbr->mode = RS_BBR_STARTUP;
+	memset(bbr->bw, 0, sizeof(bbr->bw));
+	bbr->bw_idx = 0;
+	bbr->btl_bw = 0;
+	bbr->full_bw = 0;
+	bbr->full_bw_cnt = 0;
+	bbr->min_rtt_ns = 0;
+	bbr->min_rtt_stamp = jiffies;
+	bbr->probe_rtt_min_ns = 0;
+	bbr->last_rtt_ns = 0;
+	bbr->cycle_idx = 0;
+	bbr->gain = RS_BBR_STARTUP_GAIN;
+	bbr->cwnd = 0;
+	bbr->app_limited = false;
+	atomic_set(&bbr->probe_armed, 0);
+	atomic64_set(&bbr->rtt_sample_ns, 0);
+}
+
+/* Time the reply to the first request we are about to send.  Replies come
+ * in roughly in request order, so it is answered once everything in flight
+ * before it came in. */
+static void rs_bbr_arm_probe(struct drbd_peer_device *peer_device)
+{
+	struct drbd_rs_bbr *bbr = &peer_device->rs_bbr;
+	int outstanding = peer_device->rs_in_flight - atomic_read(&peer_device->rs_sect_in);
+
+	if (atomic_read(&bbr->probe_armed))
+		return;
+	bbr->probe_mark = atomic_read(&bbr->sect_received) + max(outstanding, 0) + BM_SECT_PER_BIT;
+	bbr->probe_kt = ktime_get();
+	smp_wmb(); /* see rs_sectors_came_in() */
+	atomic_set(&bbr->probe_armed, 1);
+}
+
+/* A resync controller in the spirit of TCP BBR: the bottleneck bandwidth is
+ * the max delivery rate of the last RS_BBR_BW_WIN turns, the propagation
+ * delay the min RTT of the last RS_BBR_MIN_RTT_WIN.  Resync requests are
+ * paced at a gain times the bandwidth, and what is in flight is kept at a
+ * small multiple of their product, so the link is kept busy without
+ * building a queue, and without tuning c_fill_target to the link.
+ * BBR's per RTT rounds are turns of the controller here.
+ *
+ * While drbd_rs_c_min_rate_throttle() sees application IO, the controller
+ * yields to it: it paces at c_min_rate, and those turns do not lower the
+ * bandwidth estimate.
+ */
+static int drbd_rs_bbr_controller(struct drbd_peer_device *peer_device, u64 sect_in, u64 duration_ns)
+{
+	struct drbd_rs_bbr *bbr = &peer_device->rs_bbr;
+	struct peer_device_conf *pdc = rcu_dereference(peer_device->conf);
+	int in_flight = max(peer_device->rs_in_flight, 0);
+	u64 rate, rtt_ns, pace_bw, bdp, req_sect, max_sect;
+	int i;
+
+	if (duration_ns == 0)
+		duration_ns = 1;
+
+	/* A turn in which we yielded only tells about the bottleneck,
+	 * if it was faster than what we know. */
+	rate = div64_u64(sect_in * NSEC_PER_SEC, duration_ns);
+	if (!bbr->app_limited || rate > bbr->btl_bw) {
+		bbr->bw[bbr->bw_idx] = rate;
+		bbr->bw_idx = (bbr->bw_idx + 1) % RS_BBR_BW_WIN;
+	}
+	bbr->btl_bw = 0;
+	for (i = 0; i < RS_BBR_BW_WIN; i++)
+		bbr->btl_bw = max(bbr->btl_bw, bbr->bw[i]);
+
+	rtt_ns = atomic64_xchg(&bbr->rtt_sample_ns, 0);
+	if (rtt_ns) {
+		bbr->last_rtt_ns = rtt_ns;
+		if (bbr->mode == RS_BBR_PROBE_RTT &&
+		    (!bbr->probe_rtt_min_ns || rtt_ns < bbr->probe_rtt_min_ns))
+			bbr->probe_rtt_min_ns = rtt_ns;
+		if (!bbr->min_rtt_ns || rtt_ns <= bbr->min_rtt_ns) {
+			bbr->min_rtt_ns = rtt_ns;
+			bbr->min_rtt_stamp = jiffies;
+		}
+	}
+
+	switch (bbr->mode) {
+	case RS_BBR_STARTUP:
+		if (bbr->btl_bw >= bbr->full_bw + bbr->full_bw / 4) {
+			bbr->full_bw = bbr->btl_bw;
+			bbr->full_bw_cnt = 0;
+		} else if (!bbr->app_limited && ++bbr->full_bw_cnt >= 3) {
+			bbr->mode = RS_BBR_DRAIN;
+		}
+		break;
+	case RS_BBR_DRAIN:
+		break;
+	case RS_BBR_PROBE_BW:
+		bbr->cycle_idx = (bbr->cycle_idx + 1) % ARRAY_SIZE(rs_bbr_cycle_gain);
+		break;
+	case RS_BBR_PROBE_RTT:
+		if (time_after(jiffies, bbr->probe_rtt_done)) {
+			if (bbr->probe_rtt_min_ns)
+				bbr->min_rtt_ns = bbr->probe_rtt_min_ns;
+			bbr->min_rtt_stamp = jiffies;
+			bbr->mode = bbr->full_bw_cnt >= 3 ? RS_BBR_PROBE_BW : RS_BBR_STARTUP;
+		}
+		break;
+	}
+
+	if (bbr->mode != RS_BBR_PROBE_RTT && bbr->min_rtt_ns &&
+	    time_after(jiffies, bbr->min_rtt_stamp + RS_BBR_MIN_RTT_WIN)) {
+		bbr->mode = RS_BBR_PROBE_RTT;
+		bbr->probe_rtt_min_ns = 0;
+		bbr->probe_rtt_done = jiffies + RS_BBR_PROBE_RTT_TIME;
+	}
+
+	/* Until the first replies are in, start at the configured resync rate */
+	pace_bw = bbr->btl_bw ?: (u64)pdc->resync_rate * 2;
+	/* No RTT sample yet: assume one turn */
+	bdp = div_u64(pace_bw * div_u64(bbr->min_rtt_ns ?: RS_MAKE_REQS_INTV_NS, NSEC_PER_USEC),
+		      USEC_PER_SEC);
+
+	if (bbr->mode == RS_BBR_DRAIN && in_flight <= bdp) {
+		bbr->mode = RS_BBR_PROBE_BW;
+		bbr->cycle_idx = 0;
+	}
+
+	switch (bbr->mode) {
+	case RS_BBR_STARTUP:
+		bbr->gain = RS_BBR_STARTUP_GAIN;
+		bbr->cwnd = bdp * RS_BBR_STARTUP_GAIN / 8;
+		break;
+	case RS_BBR_DRAIN:
+		bbr->gain = RS_BBR_DRAIN_GAIN;
+		bbr->cwnd = bdp * RS_BBR_STARTUP_GAIN / 8;
+		break;
+	case RS_BBR_PROBE_BW:
+		bbr->gain = rs_bbr_cycle_gain[bbr->cycle_idx];
+		bbr->cwnd = bdp * RS_BBR_CWND_GAIN / 8;
+		break;
+	case RS_BBR_PROBE_RTT:
+		bbr->gain = 8;
+		bbr->cwnd = RS_BBR_MIN_CWND;
+		break;
+	}
+	bbr->cwnd = max_t(u64, bbr->cwnd, RS_BBR_MIN_CWND);
+
+	bbr->app_limited = drbd_rs_c_min_rate_throttle(peer_device);
+	if (bbr->app_limited)
+		pace_bw = min_t(u64, pace_bw, (u64)pdc->c_min_rate * 2);
+
+	req_sect = div_u64(pace_bw * bbr->gain * (RS_MAKE_REQS_INTV_NS / NSEC_PER_USEC),
+			   8 * USEC_PER_SEC);
+	if (in_flight + req_sect > bbr->cwnd)
+		req_sect = bbr->cwnd > in_flight ? bbr->cwnd - in_flight : 0;
+
+	max_sect = (u64)pdc->c_max_rate * 2 * RS_MAKE_REQS_INTV / HZ;
+	if (req_sect > max_sect)
+		req_sect = max_sect;
+
+	dynamic_drbd_dbg(peer_device, "bbr %s dur=%lluns sect_in=%llu in_flight=%d bw=%llu rtt=%lluns cwnd=%llu gain=%u/8 ap=%d rs=%llu\n",
+		 drbd_rs_bbr_mode_name(bbr->mode), duration_ns, sect_in, in_flight,
+		 bbr->btl_bw, bbr->min_rtt_ns, bbr->cwnd, bbr->gain, bbr->app_limited, req_sect);
+
+	if (req_sect)
+		rs_bbr_arm_probe(peer_device);
+
+	return req_sect;
+}
+
+struct drbd_rs_budget drbd_rs_budget = {
+	.lock = __SPIN_LOCK_UNLOCKED(drbd_rs_budget.lock),
+};
+
+/* Take up to @number BM_BLOCK_SIZE blocks from the node wide budget. It
+ * refills at resync_rate_total_kb, holds up to two turns worth, and no
+ * caller gets more than its share of one turn: each running resync asks
+ * once per turn, so the number of callers during the previous turn is
+ * the number to share between. */
+static int drbd_rs_budget_take(int number)
+{
+	struct drbd_rs_budget *b = &drbd_rs_budget;
+	unsigned int kb = READ_ONCE(drbd_resync_rate_total_kb);
+	u64 per_sec, turn, ns;
+	ktime_t now;
+	int got;
+
+	if (!kb || number <= 0)
+		return number;
+
+	per_sec = max(kb / (BM_BLOCK_SIZE / 1024), 1U);
+	turn = max_t(u64, div_u64(per_sec * RS_MAKE_REQS_INTV_NS, NSEC_PER_SEC), 1);
+
+	spin_lock(&b->lock);
+	now = ktime_get();
+	ns = min_t(u64, ktime_to_ns(ktime_sub(now, b->last)), NSEC_PER_SEC);
+	b->last = now;
+	b->credit = min(b->credit + per_sec * ns, 2 * turn * NSEC_PER_SEC);
+	if (ktime_to_ns(ktime_sub(now, b->window)) >= RS_MAKE_REQS_INTV_NS) {
+		b->window = now;
+		b->prev_takers = b->takers;
+		b->takers = 0;
+	}
+	b->takers++;
+
+	got = min3((u64)number, div_u64(b->credit, NSEC_PER_SEC),
+		   max_t(u64, div_u64(turn, max(b->prev_takers, 1U)), 1));
+	b->credit -= (u64)got * NSEC_PER_SEC;
+	b->granted += got;
+	if (got < number)
+		b->throttled++;
+	spin_unlock(&b->lock);
+
+	return got;
+}
+
 static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 {
 	struct net_conf *nc;
@@ -626,7 +1039,10 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	rcu_read_lock();
 	nc = rcu_dereference(peer_device->connection->transport.net_conf);
 	mxb = nc ? nc->max_buffers : 0;
-	if (rcu_dereference(peer_device->rs_plan_s)->size) {
+	if (READ_ONCE(drbd_resync_controller) == DRBD_RS_CONTROLLER_BBR) {
+		number = drbd_rs_bbr_controller(peer_device, sect_in, ktime_to_ns(duration)) >> (BM_BLOCK_SHIFT - 9);
+		peer_device->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / RS_MAKE_REQS_INTV;
+	} else if (rcu_dereference(peer_device->rs_plan_s)->size) {
 		number = drbd_rs_controller(peer_device, sect_in, ktime_to_ns(duration)) >> (BM_BLOCK_SHIFT - 9);
 		peer_device->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / RS_MAKE_REQS_INTV;
 	} else {
@@ -647,13 +1063,277 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	if (mxb - peer_device->rs_in_flight/8 < number)
 		number = mxb - peer_device->rs_in_flight/8;
 
-	return number;
+	return drbd_rs_budget_take(number);
+}
+
+/*
+ * With resync_refill, the controller runs once per RS_MAKE_REQS_INTV as
+ * before, and its plan for the turn is released in proportion to the time
+ * that passed, a quarter ahead: the replies coming in wake us up to send
+ * more, the resync_timer is only the fallback. A continuous stream instead
+ * of one burst per turn keeps the link busy with small fill targets.
+ * The sectors that came in during the turn are handed on to the next
+ * controller turn as if they had all come in at once.
+ */
+static int rs_turn_requests(struct drbd_peer_device *peer_device)
+{
+	const s64 turn_ns = RS_MAKE_REQS_INTV_NS;
+	struct net_conf *nc;
+	unsigned int sect_in;
+	s64 elapsed;
+	int number, mxb;
+
+	if (!READ_ONCE(drbd_resync_refill))
+		return drbd_rs_number_requests(peer_device);
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), peer_device->rs_turn.start_kt));
+	if (elapsed >= turn_ns || elapsed < 0) {
+		atomic_add(peer_device->rs_turn.sect_in, &peer_device->rs_sect_in);
+		peer_device->rs_in_flight += peer_device->rs_turn.sect_in;
+		peer_device->rs_turn.sect_in = 0;
+		peer_device->rs_turn.start_kt = ktime_get();
+		peer_device->rs_turn.budget = drbd_rs_number_requests(peer_device);
+		peer_device->rs_turn.sent = 0;
+		elapsed = 0;
+	} else {
+		sect_in = atomic_xchg(&peer_device->rs_sect_in, 0);
+		peer_device->rs_in_flight -= sect_in;
+		peer_device->rs_turn.sect_in += sect_in;
+	}
+
+	number = div64_s64((s64)peer_device->rs_turn.budget *
+			   min(elapsed + turn_ns / 4, turn_ns), turn_ns) - peer_device->rs_turn.sent;
+
+	/* max-buffers, as in drbd_rs_number_requests() */
+	rcu_read_lock();
+	nc = rcu_dereference(peer_device->connection->transport.net_conf);
+	mxb = nc ? nc->max_buffers : 0;
+	rcu_read_unlock();
+	number = min(number, mxb - peer_device->rs_in_flight / 8);
+
+	return max(number, 0);
+}
+
+/* The fallback for waking up the request generation */
+static unsigned long rs_turn_interval(void)
+{
+	return READ_ONCE(drbd_resync_refill) ? max(RS_MAKE_REQS_INTV / 4, 1) : RS_MAKE_REQS_INTV;
+}
+
+/* Our queue limits are the minimum of all nodes' backing devices, so by
+ * default a single node with a small max_hw_sectors makes every resync
+ * request small, and a full sync costs a round trip per few pages.
+ * But a peer takes a P_RS_DATA_REQUEST up to DRBD_MAX_BIO_SIZE, whatever its
+ * backing device: it reads, and we write, such a peer request in as many
+ * bios as needed, and the reply comes back as one stream of pages. */
+static int rs_max_request_size(struct drbd_peer_device *peer_device)
+{
+	if (READ_ONCE(drbd_resync_stream) &&
+	    peer_device->connection->agreed_pro_version >= 100)
+		return DRBD_MAX_BIO_SIZE;
+
+	return queue_max_hw_sectors(peer_device->device->rq_queue) << 9;
+}
+
+/* Close the current sample of the resync timeline, if a second has passed.
+ * Called from the resync/verify request paths, which run several times a
+ * second while either is active; longer gaps end up in one longer sample. */
+static void drbd_rs_tl_tick(struct drbd_peer_device *peer_device)
+{
+	struct drbd_rs_timeline *tl = &peer_device->rs_tl;
+	unsigned long now = jiffies;
+	struct drbd_rs_tl_sample *s;
+	int i;
+
+	if (tl->last_jif && time_before(now, tl->last_jif + HZ))
+		return;
+
+	s = &tl->sample[tl->head];
+	s->jif = now;
+	s->ms = tl->last_jif ? jiffies_to_msecs(now - tl->last_jif) : 0;
+	for (i = 0; i < DRBD_RS_TL_COUNTERS; i++) {
+		u64 total = atomic64_read(&tl->total[i]);
+
+		s->v[i] = tl->last_jif ? total - tl->last[i] : 0;
+		tl->last[i] = total;
+	}
+	tl->last_jif = now;
+	tl->head = (tl->head + 1) % DRBD_RS_TL_SAMPLES;
+	if (tl->nr < DRBD_RS_TL_SAMPLES)
+		tl->nr++;
+}
+
+/* Bitmap indexes of the peers we are sync target of in parallel to
+ * peer_device, not including peer_device itself. */
+unsigned long drbd_rs_co_source_mask(struct drbd_peer_device *peer_device)
+{
+	struct drbd_peer_device *p;
+	unsigned long mask = 0;
+
+	if (!READ_ONCE(drbd_resync_multi_source))
+		return 0;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(p, peer_device->device) {
+		if (p->repl_state[NOW] == L_SYNC_TARGET &&
+		    drbd_rs_co_source(peer_device, p, NOW))
+			mask |= 1UL << p->bitmap_index;
+	}
+	rcu_read_unlock();
+
+	return mask;
+}
+
+/* With parallel resync sources, each resync extent belongs to one of them,
+ * round robin by bitmap index.  A bit is left to its owner, as long as the
+ * owner still has it set; whatever the owner lacks, any source serves. */
+static bool rs_bit_for_co_source(struct drbd_peer_device *peer_device,
+				 unsigned long co_mask, unsigned long bit)
+{
+	unsigned long mask = co_mask | 1UL << peer_device->bitmap_index;
+	int k = BM_BIT_TO_EXT(bit) % hweight_long(mask);
+	int owner;
+
+	for_each_set_bit(owner, &mask, BITS_PER_LONG) {
+		if (k-- == 0)
+			break;
+	}
+	if (owner == peer_device->bitmap_index)
+		return false;
+
+	return drbd_bm_count_bits(peer_device->device, owner, bit, bit) > 0;
+}
+
+/* An application read on this sync target had to go to a peer, because the
+ * local data is not in sync yet.  Queue its chunk; make_resync_request()
+ * fetches it before it continues in bitmap order, so that the working set
+ * of the application becomes local first.  Any context. */
+void drbd_rs_hot_chunk(struct drbd_peer_device *peer_device, sector_t sector)
+{
+	unsigned long chunk = BM_SECT_TO_BIT(sector) / DRBD_RS_HOT_BITS;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&peer_device->rs_hot_lock, flags);
+	for (i = peer_device->rs_hot_tail; i != peer_device->rs_hot_head; i++) {
+		if (peer_device->rs_hot_ring[i % DRBD_RS_HOT_CHUNKS] == chunk)
+			goto out;
+	}
+	if (peer_device->rs_hot_head - peer_device->rs_hot_tail < DRBD_RS_HOT_CHUNKS)
+		peer_device->rs_hot_ring[peer_device->rs_hot_head++ % DRBD_RS_HOT_CHUNKS] = chunk;
+out:
+	spin_unlock_irqrestore(&peer_device->rs_hot_lock, flags);
+}
+
+static bool rs_hot_pop(struct drbd_peer_device *peer_device, unsigned long *chunk)
+{
+	bool found = false;
+
+	if (READ_ONCE(peer_device->rs_hot_tail) == READ_ONCE(peer_device->rs_hot_head))
+		return false;
+
+	spin_lock_irq(&peer_device->rs_hot_lock);
+	if (peer_device->rs_hot_tail != peer_device->rs_hot_head) {
+		*chunk = peer_device->rs_hot_ring[peer_device->rs_hot_tail++ % DRBD_RS_HOT_CHUNKS];
+		found = true;
+	}
+	spin_unlock_irq(&peer_device->rs_hot_lock);
+
+	return found;
+}
+
+/* Point resync_next_bit into a hot chunk that still has bits set, if there
+ * is one.  Otherwise back to where the scan in bitmap order was. */
+static void rs_hot_next(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	const unsigned long bm_bits = drbd_bm_bits(device);
+	unsigned long chunk, start;
+
+	for (;;) {
+		if (peer_device->rs_hot) {
+			if (peer_device->resync_next_bit < peer_device->rs_hot_end &&
+			    drbd_bm_count_bits(device, peer_device->bitmap_index,
+					       peer_device->resync_next_bit,
+					       peer_device->rs_hot_end - 1))
+				return;
+			peer_device->resync_next_bit = peer_device->rs_hot_resume;
+			peer_device->rs_hot = false;
+		}
+
+		if (!rs_hot_pop(peer_device, &chunk))
+			return;
+		start = chunk * DRBD_RS_HOT_BITS;
+		if (start >= bm_bits)
+			continue;
+		peer_device->rs_hot_resume = peer_device->resync_next_bit;
+		peer_device->rs_hot_end = min(start + DRBD_RS_HOT_BITS, bm_bits);
+		peer_device->resync_next_bit = start;
+		peer_device->rs_hot = true;
+	}
+}
+
+/* csums_adaptive: the match rate is updated once digests for this many
+ * bits were requested. Some replies of the previous window still arrive in
+ * the next one, which evens out. */
+#define DRBD_CSUM_WINDOW_BITS	2048
+/* Below these match rates [1/256], extents get requested without digests */
+#define DRBD_CSUM_MATCH_DENSE	64
+#define DRBD_CSUM_MATCH_SPARSE	16
+/* Every so many extents go by digest regardless, to keep the rate current */
+#define DRBD_CSUM_PROBE_EVERY	8
+
+static void rs_csum_update_match(struct drbd_peer_device *peer_device)
+{
+	int sent = atomic_read(&peer_device->rs_csum_win_sent);
+	int same;
+
+	if (sent < DRBD_CSUM_WINDOW_BITS)
+		return;
+	same = min(atomic_read(&peer_device->rs_csum_win_same), sent);
+	atomic_sub(sent, &peer_device->rs_csum_win_sent);
+	atomic_sub(same, &peer_device->rs_csum_win_same);
+	/* exponentially weighted, the newest window counts half */
+	peer_device->rs_csum_match = (peer_device->rs_csum_match +
+				      (unsigned int)(((u64)same << 8) / sent)) / 2;
+}
+
+/* Whether to request the extent of bit by digest. Comparing digests first
+ * costs a local read and a round trip, and only pays when they match. */
+static bool rs_csum_for_extent(struct drbd_peer_device *peer_device, unsigned long bit)
+{
+	struct drbd_device *device = peer_device->device;
+	unsigned long enr = BM_BIT_TO_EXT(bit);
+	unsigned long s, e, weight;
+	unsigned int threshold;
+
+	if (!READ_ONCE(drbd_csums_adaptive))
+		return true;
+	if (enr == peer_device->rs_csum_enr)
+		return peer_device->rs_csum_enr_digest;
+
+	rs_csum_update_match(peer_device);
+	peer_device->rs_csum_enr = enr;
+	if (peer_device->rs_csum_nr++ % DRBD_CSUM_PROBE_EVERY == 0) {
+		peer_device->rs_csum_enr_digest = true;
+		return true;
+	}
+
+	s = enr * BM_BITS_PER_EXT;
+	e = min(s + BM_BITS_PER_EXT, drbd_bm_bits(device)) - 1;
+	weight = drbd_bm_count_bits(device, peer_device->bitmap_index, s, e);
+	/* a wholly dirty extent was most likely rewritten as a whole */
+	threshold = weight * 8 >= (e - s + 1) * 7 ?
+		DRBD_CSUM_MATCH_DENSE : DRBD_CSUM_MATCH_SPARSE;
+	peer_device->rs_csum_enr_digest = peer_device->rs_csum_match >= threshold;
+	return peer_device->rs_csum_enr_digest;
 }
 
 static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_transport *transport = &peer_device->connection->transport;
+	unsigned long co_mask;
 	unsigned long bit;
 	sector_t sector;
 	const sector_t capacity = drbd_get_capacity(device->this_bdev);
@@ -666,6 +1346,8 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	if (unlikely(cancel))
 		return 0;
 
+	drbd_rs_tl_tick(peer_device);
+
 	if (peer_device->rs_total == 0) {
 		/* empty resync? */
 		drbd_resync_finished(peer_device, D_MASK);
@@ -696,8 +1378,9 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 		rcu_read_unlock();
 	}
 
-	max_bio_size = queue_max_hw_sectors(device->rq_queue) << 9;
-	number = drbd_rs_number_requests(peer_device);
+	max_bio_size = rs_max_request_size(peer_device);
+	number = rs_turn_requests(peer_device);
+	co_mask = drbd_rs_co_source_mask(peer_device);
 	/* don't let rs_sectors_came_in() re-schedule us "early"
 	 * just because the first reply came "fast", ... */
 	peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
@@ -725,6 +1408,7 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 
 next_sector:
 		size = BM_BLOCK_SIZE;
+		rs_hot_next(peer_device);
 		bit  = drbd_bm_find_next(peer_device, peer_device->resync_next_bit);
 
 		if (bit == DRBD_END_OF_BITMAP) {
@@ -732,6 +1416,12 @@ next_sector:
 			goto request_done;
 		}
 
+		if (co_mask && rs_bit_for_co_source(peer_device, co_mask, bit)) {
+			peer_device->resync_next_bit = bit + 1;
+			peer_device->resync_skipped = true;
+			goto next_sector;
+		}
+
 		sector = BM_BIT_TO_SECT(bit);
 
 		if (drbd_try_rs_begin_io(peer_device, sector, true)) {
@@ -774,6 +1464,8 @@ next_sector:
 			 * adjustment below */
 			if (drbd_bm_test_bit(peer_device, bit + 1) != 1)
 				break;
+			if (co_mask && rs_bit_for_co_source(peer_device, co_mask, bit + 1))
+				break;
 			bit++;
 			size += BM_BLOCK_SIZE;
 			if ((BM_BLOCK_SIZE << align) <= size)
@@ -787,7 +1479,8 @@ next_sector:
 		if (sector + (size>>9) > capacity)
 			size = (capacity-sector)<<9;
 
-		if (peer_device->use_csums) {
+		if (peer_device->use_csums &&
+		    rs_csum_for_extent(peer_device, BM_SECT_TO_BIT(sector))) {
 			switch (read_for_csum(peer_device, sector, size)) {
 			case -EIO: /* Disk failure */
 				put_ldev(device);
@@ -799,6 +1492,8 @@ next_sector:
 				goto request_done;
 			case 0:
 				/* everything ok */
+				atomic_add(DIV_ROUND_UP(size, BM_BLOCK_SIZE),
+					   &peer_device->rs_csum_win_sent);
 				break;
 			default:
 				BUG();
@@ -806,6 +1501,8 @@ next_sector:
 		} else {
 			int err;
 
+			if (peer_device->use_csums)
+				peer_device->rs_csum_direct += DIV_ROUND_UP(size, BM_BLOCK_SIZE);
 			inc_rs_pending(peer_device);
 			err = drbd_send_drequest(peer_device,
 						 size == discard_granularity ? P_RS_THIN_REQ : P_RS_DATA_REQUEST,
@@ -822,6 +1519,21 @@ next_sector:
 request_done:
 	/* ... but do a correction, in case we had to break/goto request_done; */
 	peer_device->rs_in_flight -= (number - i) * BM_SECT_PER_BIT;
+	peer_device->rs_turn.sent += i;
+	drbd_rs_tl_add(peer_device, DRBD_RS_TL_REQUESTED, i * BM_SECT_PER_BIT);
+	/* not done while a hot chunk was last */
+	rs_hot_next(peer_device);
+
+	if (peer_device->resync_next_bit >= drbd_bm_bits(device) &&
+	    peer_device->resync_skipped) {
+		/* Bits left to parallel sources. Look again later, in
+		 * case one of them goes away before it got to them. */
+		peer_device->resync_next_bit = 0;
+		peer_device->resync_skipped = false;
+		mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
+		put_ldev(device);
+		return 0;
+	}
 
 	if (peer_device->resync_next_bit >= drbd_bm_bits(device)) {
 		/* last syncer _request_ was sent,
@@ -840,11 +1552,66 @@ request_done:
 			&peer_device->connection->sender_work,
 			&peer_device->resync_work);
 	else
-		mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
+		mod_timer(&peer_device->resync_timer, jiffies + rs_turn_interval());
 	put_ldev(device);
 	return 0;
 }
 
+/* Size of the next top level online verify request at sector. It does not
+ * cross a DRBD_MAX_BIO_SIZE boundary, so it stays within one resync extent,
+ * and it covers at most blocks bitmap blocks. A peer without DRBD_FF_OV_TREE
+ * could not tell which of the blocks of a larger range differ. */
+static int ov_request_size(struct drbd_peer_device *peer_device, sector_t sector, int blocks)
+{
+	const sector_t stop_sector = peer_device->ov_stop_sector;
+	sector_t end;
+
+	if (!drbd_verify_tree || blocks <= 1 ||
+	    !(peer_device->connection->agreed_features & DRBD_FF_OV_TREE))
+		return BM_BLOCK_SIZE;
+
+	end = round_up(sector + 1, DRBD_MAX_BIO_SIZE >> 9);
+	end = min_t(sector_t, end, sector + (sector_t)blocks * BM_SECT_PER_BIT);
+	if (stop_sector > sector && stop_sector < end)
+		end = round_up(stop_sector, BM_SECT_PER_BIT);
+
+	return (end - sector) << 9;
+}
+
+/* Each extent has a fixed pseudo random slot out of 100. A run samples a
+ * window of ov_sample_pct slots, and the window moves on by that much with
+ * every run, so consecutive runs cover all the extents in turn. */
+static bool ov_extent_sampled(struct drbd_peer_device *peer_device, unsigned long enr)
+{
+	const unsigned int pct = peer_device->ov_sample_pct;
+	unsigned int slot, first;
+
+	if (!pct)
+		return true;
+	slot = hash_long(enr, 32) % 100;
+	first = (peer_device->ov_sample_run * pct) % 100;
+	return (slot + 100 - first) % 100 < pct;
+}
+
+/* The rest of the extent at sector is not sampled in this run; account it
+ * as verified. Returns true if that was the last of the device. */
+static bool ov_skip_extent(struct drbd_peer_device *peer_device,
+			   sector_t *sector, sector_t capacity)
+{
+	sector_t end = min_t(sector_t, BM_EXT_TO_SECT(BM_SECT_TO_EXT(*sector) + 1), capacity);
+	unsigned long bits = DIV_ROUND_UP(end - *sector, BM_SECT_PER_BIT);
+	unsigned long left;
+
+	*sector = end;
+	left = verify_left_sub(peer_device, bits);
+	peer_device->ov_sample_skipped += bits;
+	drbd_advance_rs_marks(peer_device, left);
+	if (left)
+		return false;
+	drbd_peer_device_post_work(peer_device, RS_DONE);
+	return true;
+}
+
 static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 {
 	struct drbd_device *device = peer_device->device;
@@ -856,13 +1623,15 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 	if (unlikely(cancel))
 		return 1;
 
-	number = drbd_rs_number_requests(peer_device);
+	drbd_rs_tl_tick(peer_device);
+
+	number = rs_turn_requests(peer_device);
 	sector = peer_device->ov_position;
 
 	/* don't let rs_sectors_came_in() re-schedule us "early"
 	 * just because the first reply came "fast", ... */
 	peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
-	for (i = 0; i < number; i++) {
+	for (i = 0; i < number; ) {
 		if (sector >= capacity)
 			break;
 
@@ -874,7 +1643,13 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 		if (stop_sector_reached)
 			break;
 
-		size = BM_BLOCK_SIZE;
+		if (!ov_extent_sampled(peer_device, BM_SECT_TO_EXT(sector))) {
+			if (ov_skip_extent(peer_device, &sector, capacity))
+				break;
+			continue;
+		}
+
+		size = ov_request_size(peer_device, sector, number - i);
 
 		if (drbd_try_rs_begin_io(peer_device, sector, true))
 			break;
@@ -887,10 +1662,13 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 			dec_rs_pending(peer_device);
 			return 0;
 		}
-		sector += BM_SECT_PER_BIT;
+		sector += round_up(size >> 9, BM_SECT_PER_BIT);
+		i += DIV_ROUND_UP(size, BM_BLOCK_SIZE);
 	}
 	/* ... but do a correction, in case we had to break; ... */
 	peer_device->rs_in_flight -= (number-i) * BM_SECT_PER_BIT;
+	peer_device->rs_turn.sent += i;
+	drbd_rs_tl_add(peer_device, DRBD_RS_TL_REQUESTED, i * BM_SECT_PER_BIT);
 	peer_device->ov_position = sector;
 	if (stop_sector_reached)
 		return 1;
@@ -901,7 +1679,7 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 			&peer_device->connection->sender_work,
 			&peer_device->resync_work);
 	if (i == 0)
-		mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
+		mod_timer(&peer_device->resync_timer, jiffies + rs_turn_interval());
 	return 1;
 }
 
@@ -1080,6 +1858,8 @@ int drbd_resync_finished(struct drbd_peer_device *peer_device,
 		drbd_err(peer_device, "Warn failed to kmalloc(dw).\n");
 	}
 
+	drbd_rs_pool_drain(peer_device);
+
 	dt = (jiffies - peer_device->rs_start - peer_device->rs_paused) / HZ;
 	if (dt <= 0)
 		dt = 1;
@@ -1119,6 +1899,10 @@ int drbd_resync_finished(struct drbd_peer_device *peer_device,
 		  aborted ? "aborted" : "done", tmp,
 		  dt + peer_device->rs_paused, peer_device->rs_paused, dbdt);
 	}
+	if (verify_done && peer_device->ov_sample_skipped)
+		drbd_info(peer_device, "Online verify sample run %u checked %u%% of the extents, %lu of %lu %dk blocks not sampled\n",
+			  peer_device->ov_sample_run, peer_device->ov_sample_pct,
+			  peer_device->ov_sample_skipped, peer_device->rs_total, Bit2KB(1));
 
 	n_oos = drbd_bm_total_weight(peer_device);
 
@@ -1149,6 +1933,29 @@ int drbd_resync_finished(struct drbd_peer_device *peer_device,
 			     Bit2KB(peer_device->rs_same_csum),
 			     Bit2KB(peer_device->rs_total - peer_device->rs_same_csum),
 			     Bit2KB(peer_device->rs_total));
+			if (peer_device->rs_csum_direct)
+				drbd_info(peer_device, "%luK requested without checksums\n",
+					  Bit2KB(peer_device->rs_csum_direct));
+		}
+
+		if (peer_device->rs_dedupe && peer_device->rs_dedupe->refs_sent) {
+			struct drbd_rs_dedupe *dd = peer_device->rs_dedupe;
+
+			drbd_info(peer_device, "%llu blocks (%lluK) sent as references to data the peer had\n",
+				  (unsigned long long)dd->refs_sent,
+				  (unsigned long long)dd->bytes_saved >> 10);
+			dd->refs_sent = 0;
+			dd->bytes_saved = 0;
+		}
+
+		if (device->rs_cache && device->rs_cache->hits) {
+			struct drbd_rs_cache *rc = device->rs_cache;
+
+			drbd_info(device, "%llu resync blocks (%lluK) sent without reading them again\n",
+				  (unsigned long long)rc->hits,
+				  (unsigned long long)rc->bytes_saved >> 10);
+			rc->hits = 0;
+			rc->bytes_saved = 0;
 		}
 	}
 
@@ -1253,83 +2060,354 @@ out:
 			drbd_maybe_khelper(NULL, connection, "unfence-peer");
 	}
 
-	return 1;
+	return 1;
+}
+
+/* helper */
+static void move_to_net_ee_or_free(struct drbd_connection *connection, struct drbd_peer_request *peer_req)
+{
+	if (drbd_peer_req_has_active_page(peer_req)) {
+		/* This might happen if sendpage() has not finished */
+		int i = DIV_ROUND_UP(peer_req->i.size, PAGE_SIZE);
+		atomic_add(i, &connection->pp_in_use_by_net);
+		atomic_sub(i, &connection->pp_in_use);
+		spin_lock_irq(&connection->peer_reqs_lock);
+		list_add_tail(&peer_req->w.list, &peer_req->peer_device->connection->net_ee);
+		spin_unlock_irq(&connection->peer_reqs_lock);
+		wake_up(&drbd_pp_wait);
+	} else
+		drbd_free_peer_req(peer_req);
+}
+
+/**
+ * w_e_end_data_req() - Worker callback, to send a P_DATA_REPLY packet in response to a P_DATA_REQUEST
+ * @w:		work object.
+ * @cancel:	The connection will be closed anyways
+ */
+int w_e_end_data_req(struct drbd_work *w, int cancel)
+{
+	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	int err;
+
+	if (unlikely(cancel)) {
+		drbd_free_peer_req(peer_req);
+		dec_unacked(peer_device);
+		return 0;
+	}
+
+	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
+		err = drbd_send_block(peer_device, P_DATA_REPLY, peer_req);
+	} else {
+		if (drbd_ratelimit())
+			drbd_err(peer_device, "Sending NegDReply. sector=%llus.\n",
+			    (unsigned long long)peer_req->i.sector);
+
+		err = drbd_send_ack(peer_device, P_NEG_DREPLY, peer_req);
+	}
+
+	dec_unacked(peer_device);
+
+	move_to_net_ee_or_free(peer_device->connection, peer_req);
+
+	if (unlikely(err))
+		drbd_err(peer_device, "drbd_send_block() failed\n");
+	return err;
+}
+
+static bool all_zero(struct drbd_peer_request *peer_req)
+{
+	struct page *page = peer_req->page_chain.head;
+	unsigned int len = peer_req->i.size;
+
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
+		void *d = kmap_atomic(page);
+		bool zero = drbd_mem_is_zero(d, l);
+
+		kunmap_atomic(d);
+		if (!zero)
+			return false;
+		len -= l;
+	}
+
+	return true;
+}
+
+/* Finds an earlier block of this resync with the same content as @peer_req,
+ * which the peer has acknowledged: its bits are clear again. The slot then
+ * points to @peer_req; should the peer find the referenced block changed,
+ * its request for the data does not get the same reference again. */
+static bool rs_dedupe_lookup(struct drbd_peer_device *peer_device,
+			     struct drbd_peer_request *peer_req,
+			     sector_t *ref_sector, u8 *digest)
+{
+	struct crypto_shash *tfm = peer_device->connection->rs_dedupe_tfm;
+	struct drbd_device *device = peer_device->device;
+	struct drbd_rs_dedupe *dd = peer_device->rs_dedupe;
+	struct drbd_rs_dedupe_slot *slot;
+	sector_t sector = peer_req->i.sector;
+	unsigned int size = peer_req->i.size;
+	bool found = false;
+	u64 tag;
+
+	if (!READ_ONCE(drbd_resync_dedupe) || !tfm ||
+	    !(peer_device->connection->agreed_features & DRBD_FF_RS_DEDUPE))
+		return false;
+	if (!dd) {
+		dd = kzalloc(sizeof(*dd), GFP_NOIO | __GFP_NOWARN);
+		if (!dd)
+			return false;
+		peer_device->rs_dedupe = dd;
+	}
+
+	drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+	memcpy(&tag, digest, sizeof(tag));
+	slot = &dd->slot[tag & (ARRAY_SIZE(dd->slot) - 1)];
+	if (slot->tag == tag && slot->size == size && slot->sector != sector &&
+	    get_ldev(device)) {
+		unsigned long s = BM_SECT_TO_BIT(slot->sector);
+		unsigned long e = BM_SECT_TO_BIT(slot->sector + (size >> 9) - 1);
+
+		found = drbd_bm_count_bits(device, peer_device->bitmap_index, s, e) == 0;
+		put_ldev(device);
+	}
+	if (found) {
+		*ref_sector = slot->sector;
+		dd->refs_sent++;
+		dd->bytes_saved += size;
+	}
+	slot->tag = tag;
+	slot->sector = sector;
+	slot->size = size;
+	return found;
+}
+
+static bool rs_cache_reclaimable(struct drbd_rs_cache_entry *e, bool all)
+{
+	return e->size && !e->users &&
+		(all || !e->valid || !e->wanted ||
+		 time_after(jiffies, e->start + DRBD_RS_CACHE_WINDOW));
+}
+
+/* Frees entries that are invalid, served to all SyncTargets, or too old;
+ * all unused ones with @all. Process context. */
+void drbd_rs_cache_expire(struct drbd_device *device, bool all)
+{
+	struct drbd_rs_cache *rc = device->rs_cache;
+	void *data[DRBD_RS_CACHE_ENTRIES];
+	int i, n = 0;
+
+	if (!rc)
+		return;
+
+	spin_lock_irq(&rc->lock);
+	for (i = 0; i < DRBD_RS_CACHE_ENTRIES; i++) {
+		struct drbd_rs_cache_entry *e = &rc->e[i];
+
+		if (!rs_cache_reclaimable(e, all))
+			continue;
+		if (e->data)
+			data[n++] = e->data;
+		rc->bytes -= e->size;
+		rc->used--;
+		memset(e, 0, sizeof(*e));
+	}
+	spin_unlock_irq(&rc->lock);
+
+	while (n--)
+		kvfree(data[n]);
+}
+
+void drbd_rs_cache_free(struct drbd_device *device)
+{
+	drbd_rs_cache_expire(device, true);
+	kfree(device->rs_cache);
+	device->rs_cache = NULL;
+}
+
+/* Before any write reaches the backing device */
+void drbd_rs_cache_invalidate(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	struct drbd_rs_cache *rc = READ_ONCE(device->rs_cache);
+	unsigned long flags;
+	int i;
+
+	if (!rc || !READ_ONCE(rc->used) || !size)
+		return;
+
+	spin_lock_irqsave(&rc->lock, flags);
+	for (i = 0; i < DRBD_RS_CACHE_ENTRIES; i++) {
+		struct drbd_rs_cache_entry *e = &rc->e[i];
+
+		if (e->size && sector < e->sector + (e->size >> 9) &&
+		    e->sector < sector + (size >> 9))
+			e->valid = false;
+	}
+	spin_unlock_irqrestore(&rc->lock, flags);
+}
+
+static void rs_cache_copy(struct drbd_peer_request *peer_req, void *data, bool to_pages)
+{
+	struct page *page = peer_req->page_chain.head;
+	unsigned int len = peer_req->i.size;
+
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
+		void *d = kmap_atomic(page);
+
+		if (to_pages)
+			memcpy(d, data, l);
+		else
+			memcpy(data, d, l);
+		kunmap_atomic(d);
+		data += l;
+		len -= l;
+	}
 }
 
-/* helper */
-static void move_to_net_ee_or_free(struct drbd_connection *connection, struct drbd_peer_request *peer_req)
+static u64 rs_cache_wanted(struct drbd_peer_request *peer_req) __must_hold(local)
 {
-	if (drbd_peer_req_has_active_page(peer_req)) {
-		/* This might happen if sendpage() has not finished */
-		int i = DIV_ROUND_UP(peer_req->i.size, PAGE_SIZE);
-		atomic_add(i, &connection->pp_in_use_by_net);
-		atomic_sub(i, &connection->pp_in_use);
-		spin_lock_irq(&connection->peer_reqs_lock);
-		list_add_tail(&peer_req->w.list, &peer_req->peer_device->connection->net_ee);
-		spin_unlock_irq(&connection->peer_reqs_lock);
-		wake_up(&drbd_pp_wait);
-	} else
-		drbd_free_peer_req(peer_req);
+	struct drbd_peer_device *peer_device = peer_req->peer_device, *other;
+	struct drbd_device *device = peer_device->device;
+	unsigned long s = BM_SECT_TO_BIT(peer_req->i.sector);
+	unsigned long e = BM_SECT_TO_BIT(peer_req->i.sector + (peer_req->i.size >> 9) - 1);
+	u64 wanted = 0;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(other, device) {
+		if (other == peer_device || other->repl_state[NOW] != L_SYNC_SOURCE)
+			continue;
+		if (drbd_bm_count_bits(device, other->bitmap_index, s, e))
+			wanted |= NODE_MASK(other->node_id);
+	}
+	rcu_read_unlock();
+	return wanted;
 }
 
 /**
- * w_e_end_data_req() - Worker callback, to send a P_DATA_REPLY packet in response to a P_DATA_REQUEST
- * @w:		work object.
- * @cancel:	The connection will be closed anyways
+ * drbd_rs_cache_lookup() - Answer a resync request from data read for another peer
+ * @peer_req:	P_RS_DATA_REQUEST or P_RS_THIN_REQ, holding its resync extent
+ *
+ * When several SyncTargets resync the same blocks from this node at about
+ * the same time, read them once: copy them into @peer_req if they were read
+ * for another peer within DRBD_RS_CACHE_WINDOW and not written since.
+ * Otherwise, if other SyncTargets still need the range, reserve an entry
+ * that w_e_end_rsdata_req() fills once the read is done.
+ *
+ * Returns true if @peer_req has its data and needs no read.
  */
-int w_e_end_data_req(struct drbd_work *w, int cancel)
+bool drbd_rs_cache_lookup(struct drbd_peer_request *peer_req) __must_hold(local)
 {
-	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
-	int err;
-
-	if (unlikely(cancel)) {
-		drbd_free_peer_req(peer_req);
-		dec_unacked(peer_device);
-		return 0;
-	}
+	struct drbd_device *device = peer_device->device;
+	unsigned int limit = READ_ONCE(drbd_resync_read_cache_kb) << 10;
+	u64 mask = NODE_MASK(peer_device->node_id);
+	struct drbd_rs_cache_entry *e, *free = NULL, *hit = NULL;
+	sector_t sector = peer_req->i.sector;
+	unsigned int size = peer_req->i.size;
+	struct drbd_rs_cache *rc;
+	u64 wanted;
+	int i;
 
-	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
-		err = drbd_send_block(peer_device, P_DATA_REPLY, peer_req);
-	} else {
-		if (drbd_ratelimit())
-			drbd_err(peer_device, "Sending NegDReply. sector=%llus.\n",
-			    (unsigned long long)peer_req->i.sector);
+	if (!limit || size > limit)
+		return false;
 
-		err = drbd_send_ack(peer_device, P_NEG_DREPLY, peer_req);
+	rc = device->rs_cache;
+	if (!rc) {
+		rc = kzalloc(sizeof(*rc), GFP_NOIO | __GFP_NOWARN);
+		if (!rc)
+			return false;
+		spin_lock_init(&rc->lock);
+		smp_store_release(&device->rs_cache, rc);
 	}
+	drbd_rs_cache_expire(device, false);
 
-	dec_unacked(peer_device);
+	spin_lock_irq(&rc->lock);
+	for (i = 0; i < DRBD_RS_CACHE_ENTRIES; i++) {
+		e = &rc->e[i];
+		if (!e->size) {
+			free = free ?: e;
+			continue;
+		}
+		if (e->sector != sector || e->size != size)
+			continue;
+		if (e->valid && e->data && e->wanted & mask) {
+			e->wanted &= ~mask;
+			e->users++;
+			hit = e;
+		}
+		/* and no second entry while its read is in flight */
+		break;
+	}
+	spin_unlock_irq(&rc->lock);
+
+	if (hit) {
+		rs_cache_copy(peer_req, hit->data, true);
+		spin_lock_irq(&rc->lock);
+		hit->users--;
+		rc->hits++;
+		rc->bytes_saved += size;
+		spin_unlock_irq(&rc->lock);
+		return true;
+	}
+	if (!free || i < DRBD_RS_CACHE_ENTRIES)
+		return false;
 
-	move_to_net_ee_or_free(peer_device->connection, peer_req);
+	wanted = rs_cache_wanted(peer_req);
+	if (!wanted)
+		return false;
 
-	if (unlikely(err))
-		drbd_err(peer_device, "drbd_send_block() failed\n");
-	return err;
+	spin_lock_irq(&rc->lock);
+	if (!free->size && rc->bytes + size <= limit) {
+		free->sector = sector;
+		free->size = size;
+		free->start = jiffies;
+		free->wanted = wanted;
+		free->valid = true;
+		rc->bytes += size;
+		rc->used++;
+		peer_req->flags |= EE_RS_CACHE;
+	}
+	spin_unlock_irq(&rc->lock);
+	return false;
 }
 
-static bool all_zero(struct drbd_peer_request *peer_req)
+/* The read for a reserved entry is done, before the resync extent is released */
+static void rs_cache_store(struct drbd_peer_request *peer_req)
 {
-	struct page *page = peer_req->page_chain.head;
-	unsigned int len = peer_req->i.size;
+	struct drbd_rs_cache *rc = peer_req->peer_device->device->rs_cache;
+	sector_t sector = peer_req->i.sector;
+	unsigned int size = peer_req->i.size;
+	void *data;
+	int i;
 
-	page_chain_for_each(page) {
-		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
-		unsigned int i, words = l / sizeof(long);
-		unsigned long *d;
-
-		d = kmap_atomic(page);
-		for (i = 0; i < words; i++) {
-			if (d[i]) {
-				kunmap_atomic(d);
-				return false;
-			}
+	peer_req->flags &= ~EE_RS_CACHE;
+	if (peer_req->flags & EE_WAS_ERROR)
+		return;
+
+	data = kvmalloc(size, GFP_NOIO | __GFP_NOWARN);
+	if (data)
+		rs_cache_copy(peer_req, data, false);
+
+	spin_lock_irq(&rc->lock);
+	for (i = 0; i < DRBD_RS_CACHE_ENTRIES; i++) {
+		struct drbd_rs_cache_entry *e = &rc->e[i];
+
+		if (e->sector != sector || e->size != size || e->data)
+			continue;
+		if (data && e->valid) {
+			e->data = data;
+			e->start = jiffies;
+			data = NULL;
+		} else {
+			e->valid = false;
 		}
-		kunmap_atomic(d);
-		len -= l;
+		break;
 	}
+	spin_unlock_irq(&rc->lock);
 
-	return true;
+	kvfree(data);
 }
 
 /**
@@ -1352,6 +2430,8 @@ int w_e_end_rsdata_req(struct drbd_work *w, int cancel)
 	}
 
 	if (get_ldev_if_state(device, D_DETACHING)) {
+		if (peer_req->flags & EE_RS_CACHE)
+			rs_cache_store(peer_req);
 		drbd_rs_complete_io(peer_device, peer_req->i.sector);
 		put_ldev(device);
 	}
@@ -1360,17 +2440,27 @@ int w_e_end_rsdata_req(struct drbd_work *w, int cancel)
 		err = drbd_send_ack(peer_device, P_RS_CANCEL, peer_req);
 	} else if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
 		if (likely(peer_device->disk_state[NOW] >= D_INCONSISTENT)) {
-			inc_rs_pending(peer_device);
-			/* If we send back as P_RS_DATA_REPLY,
-			 * this is overestimating "in-flight" accounting.
-			 * But needed to be properly balanced with
-			 * the atomic_sub() in got_BlockAck.
-			 * TODO: to fix that, we'd need a protocol bump. */
-			atomic_add(peer_req->i.size >> 9, &connection->rs_in_flight);
-			if (peer_req->flags & EE_RS_THIN_REQ && all_zero(peer_req)) {
-				err = drbd_send_rs_deallocated(peer_device, peer_req);
+			bool zero = peer_req->flags & EE_RS_UNALLOCATED ||
+				(peer_req->flags & EE_RS_THIN_REQ && all_zero(peer_req));
+			u8 digest[DRBD_RS_DEDUPE_DIGEST_SIZE];
+			sector_t ref_sector;
+
+			if (!zero && rs_dedupe_lookup(peer_device, peer_req, &ref_sector, digest)) {
+				/* Acked with ID_SYNCER_DEDUPE, which does not
+				 * take part in the accounting below. */
+				err = drbd_send_rs_dedupe(peer_device, peer_req, ref_sector, digest);
 			} else {
-				err = drbd_send_block(peer_device, P_RS_DATA_REPLY, peer_req);
+				inc_rs_pending(peer_device);
+				/* If we send back as P_RS_DATA_REPLY,
+				 * this is overestimating "in-flight" accounting.
+				 * But needed to be properly balanced with
+				 * the atomic_sub() in got_BlockAck.
+				 * TODO: to fix that, we'd need a protocol bump. */
+				atomic_add(peer_req->i.size >> 9, &connection->rs_in_flight);
+				if (zero)
+					err = drbd_send_rs_deallocated(peer_device, peer_req);
+				else
+					err = drbd_send_block(peer_device, P_RS_DATA_REPLY, peer_req);
 			}
 		} else {
 			if (drbd_ratelimit())
@@ -1430,7 +2520,7 @@ int w_e_end_csum_rs_req(struct drbd_work *w, int cancel)
 			D_ASSERT(device, digest_size == di->digest_size);
 			digest = kmalloc(digest_size, GFP_NOIO);
 			if (digest) {
-				drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+				drbd_csum_peer_req(peer_device->connection->csums_tfm, peer_req, digest);
 				eq = !memcmp(digest, di->digest, digest_size);
 				kfree(digest);
 			}
@@ -1483,7 +2573,7 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 	}
 
 	if (!(peer_req->flags & EE_WAS_ERROR))
-		drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+		drbd_csum_peer_req(peer_device->connection->verify_tfm, peer_req, digest);
 	else
 		memset(digest, 0, digest_size);
 
@@ -1519,23 +2609,96 @@ void drbd_ov_out_of_sync_found(struct drbd_peer_device *peer_device, sector_t se
 	drbd_set_out_of_sync(peer_device, sector, size);
 }
 
+/* The sender accounts unsampled extents while the replies come in on the
+ * ack receiver, so ov_left is updated with cmpxchg. Returns the new value. */
+unsigned long verify_left_sub(struct drbd_peer_device *peer_device, unsigned long bits)
+{
+	unsigned long old_left, new_left;
+
+	do {
+		old_left = READ_ONCE(peer_device->ov_left);
+		new_left = old_left - min(old_left, bits);
+	} while (cmpxchg(&peer_device->ov_left, old_left, new_left) != old_left);
+
+	return new_left;
+}
+
 void verify_progress(struct drbd_peer_device *peer_device,
 		const sector_t sector, const unsigned int size)
 {
 	bool stop_sector_reached =
 		(peer_device->repl_state[NOW] == L_VERIFY_S) &&
 		(sector + (size>>9)) >= peer_device->ov_stop_sector;
-
-	--peer_device->ov_left;
+	/* a request covers more than one bitmap block with verify_tree */
+	unsigned long bits = max(DIV_ROUND_UP(size, BM_BLOCK_SIZE), 1U);
+	unsigned long left = verify_left_sub(peer_device, bits);
 
 	/* let's advance progress step marks only for every other megabyte */
-	if ((peer_device->ov_left & 0x1ff) == 0)
-		drbd_advance_rs_marks(peer_device, peer_device->ov_left);
+	if ((left >> 9) != ((left + bits) >> 9))
+		drbd_advance_rs_marks(peer_device, left);
 
-	if (peer_device->ov_left == 0 || stop_sector_reached)
+	if (left == 0 || stop_sector_reached)
 		drbd_peer_device_post_work(peer_device, RS_DONE);
 }
 
+/* With verify_tree, a range whose digests differ is split into this many
+ * sub-ranges, until they are single bitmap blocks: 1MiB, 64KiB, 4KiB. */
+#define DRBD_OV_TREE_FANOUT 16
+
+static unsigned int ov_descend_step(unsigned int size)
+{
+	return max_t(unsigned int, round_up(size / DRBD_OV_TREE_FANOUT, BM_BLOCK_SIZE),
+		     BM_BLOCK_SIZE);
+}
+
+/* Takes a resync extent reference for each sub-range of the range at sector.
+ * The range lies within one extent, which is locked as long as the caller
+ * holds the reference of the range itself, so this does not fail but for
+ * a detached disk. */
+static bool ov_descend_begin_io(struct drbd_peer_device *peer_device,
+				sector_t sector, unsigned int size)
+{
+	const unsigned int step = ov_descend_step(size);
+	sector_t s = sector;
+	unsigned int done;
+
+	for (done = 0; done < size; done += step, s += step >> 9) {
+		if (drbd_try_rs_begin_io(peer_device, s, false))
+			goto undo;
+	}
+	return true;
+
+undo:
+	while (s > sector) {
+		s -= step >> 9;
+		drbd_rs_complete_io(peer_device, s);
+	}
+	return false;
+}
+
+/* Sends the requests for the sub-ranges prepared by ov_descend_begin_io().
+ * They bypass the resync controller, but count towards rs_in_flight so that
+ * their replies do not look like additional bandwidth. */
+static int ov_descend_send(struct drbd_peer_device *peer_device,
+			   sector_t sector, unsigned int size)
+{
+	const unsigned int step = ov_descend_step(size);
+	unsigned int len;
+
+	peer_device->rs_in_flight += size >> 9;
+	for (; size; size -= len, sector += len >> 9) {
+		len = min(step, size);
+		inc_rs_pending(peer_device);
+		if (drbd_send_ov_request(peer_device, sector, len)) {
+			/* the connection is lost, drbd_rs_cancel_all()
+			 * drops the extent references of what remains */
+			dec_rs_pending(peer_device);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
 int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 {
 	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
@@ -1547,6 +2710,7 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 	unsigned int size = peer_req->i.size;
 	int digest_size;
 	int err, eq = 0;
+	bool descend = false;
 
 	if (unlikely(cancel)) {
 		drbd_free_peer_req(peer_req);
@@ -1554,33 +2718,47 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 		return 0;
 	}
 
-	/* after "cancel", because after drbd_disconnect/drbd_rs_cancel_all
-	 * the resync lru has been cleaned up already */
-	if (get_ldev(device)) {
-		drbd_rs_complete_io(peer_device, peer_req->i.sector);
-		put_ldev(device);
-	}
-
 	di = peer_req->digest;
 
 	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
 		digest_size = crypto_shash_digestsize(peer_device->connection->verify_tfm);
 		digest = kmalloc(digest_size, GFP_NOIO);
 		if (digest) {
-			drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+			drbd_csum_peer_req(peer_device->connection->verify_tfm, peer_req, digest);
 
 			D_ASSERT(device, digest_size == di->digest_size);
 			eq = !memcmp(digest, di->digest, digest_size);
+			descend = !eq && size > BM_BLOCK_SIZE &&
+				peer_device->connection->agreed_features & DRBD_FF_OV_TREE;
 			kfree(digest);
 		}
 	}
 
+	/* after "cancel", because after drbd_disconnect/drbd_rs_cancel_all
+	 * the resync lru has been cleaned up already */
+	if (get_ldev(device)) {
+		/* the sub-ranges get their references while we still hold ours */
+		if (descend)
+			descend = ov_descend_begin_io(peer_device, sector, size);
+		drbd_rs_complete_io(peer_device, peer_req->i.sector);
+		put_ldev(device);
+	} else {
+		descend = false;
+	}
+
 	/* Free peer_req and pages before send.
 	 * In case we block on congestion, we could otherwise run into
 	 * some distributed deadlock, if the other side blocks on
 	 * congestion as well, because our receiver blocks in
 	 * drbd_alloc_pages due to pp_in_use > max_buffers. */
 	drbd_free_peer_req(peer_req);
+
+	if (descend) {
+		err = drbd_send_ack_ex(peer_device, P_OV_RESULT, sector, size, ID_OV_DESCEND);
+		dec_unacked(peer_device);
+		return err ?: ov_descend_send(peer_device, sector, size);
+	}
+
 	if (!eq)
 		drbd_ov_out_of_sync_found(peer_device, sector, size);
 	else
@@ -1632,19 +2810,29 @@ static bool need_unplug(struct drbd_connection *connection)
 			connection->todo.unplug_dagtag_sector[i]);
 }
 
+static bool consume_unplug(struct drbd_connection *connection)
+{
+	if (!need_unplug(connection))
+		return false;
+
+	/* Yes, this is non-atomic wrt. its use in drbd_unplug_fn.
+	 * We save a spin_lock_irq, and worst case
+	 * we occasionally miss an unplug event. */
+
+	/* Paranoia: to avoid a continuous stream of unplug-hints,
+	 * in case we never get any unplug events */
+	connection->todo.unplug_dagtag_sector[connection->todo.unplug_slot] =
+		connection->send.current_dagtag_sector + (1ULL << 63);
+	/* advance the current unplug slot */
+	connection->todo.unplug_slot ^= 1;
+	return true;
+}
+
 static void maybe_send_unplug_remote(struct drbd_connection *connection, bool send_anyways)
 {
-	if (need_unplug(connection)) {
-		/* Yes, this is non-atomic wrt. its use in drbd_unplug_fn.
-		 * We save a spin_lock_irq, and worst case
-		 * we occasionally miss an unplug event. */
-
-		/* Paranoia: to avoid a continuous stream of unplug-hints,
-		 * in case we never get any unplug events */
-		connection->todo.unplug_dagtag_sector[connection->todo.unplug_slot] =
-			connection->send.current_dagtag_sector + (1ULL << 63);
-		/* advance the current unplug slot */
-		connection->todo.unplug_slot ^= 1;
+	if (consume_unplug(connection)) {
+		/* If we are past the next slot as well, one hint covers both */
+		consume_unplug(connection);
 	} else if (!send_anyways)
 		return;
 
@@ -1657,7 +2845,7 @@ static void maybe_send_unplug_remote(struct drbd_connection *connection, bool se
 	send_command(connection, -1, P_UNPLUG_REMOTE, DATA_STREAM);
 }
 
-static bool __drbd_may_sync_now(struct drbd_peer_device *peer_device)
+static bool resync_after_done(struct drbd_peer_device *peer_device)
 {
 	struct drbd_device *other_device = peer_device->device;
 	int ret = true;
@@ -1692,6 +2880,105 @@ break_unlock:
 	return ret;
 }
 
+static bool rs_sched_running(struct drbd_peer_device *peer_device)
+{
+	enum drbd_repl_state repl_state = peer_device->repl_state[NOW];
+
+	return repl_state == L_SYNC_SOURCE || repl_state == L_SYNC_TARGET;
+}
+
+/* Paused only by resync-after or by us, would run otherwise */
+static bool rs_sched_waiting(struct drbd_peer_device *peer_device)
+{
+	enum drbd_repl_state repl_state = peer_device->repl_state[NOW];
+
+	return (repl_state == L_PAUSED_SYNC_S || repl_state == L_PAUSED_SYNC_T) &&
+		!peer_device->resync_susp_user[NOW] &&
+		!peer_device->resync_susp_peer[NOW] &&
+		!peer_device->resync_susp_other_c[NOW] &&
+		resync_after_done(peer_device);
+}
+
+/* Order of the resyncs: least left to do first, then by minor and peer */
+static bool rs_sched_before(struct drbd_peer_device *a, unsigned long a_left,
+			    struct drbd_peer_device *b, unsigned long b_left)
+{
+	if (a_left != b_left)
+		return a_left < b_left;
+	if (a->device->minor != b->device->minor)
+		return a->device->minor < b->device->minor;
+	return a->node_id < b->node_id;
+}
+
+/**
+ * rs_sched_may_sync() - May this resync run, within resync_max_concurrent?
+ * @peer_device: DRBD peer device, resyncing or about to.
+ *
+ * A running resync keeps its slot, unless the limit was lowered below the
+ * number running: then the ones of the lowest minors stay. One that waits
+ * gets a slot if fewer than the limit run, and fewer than that minus the
+ * running ones wait that come before it. Evaluated whenever resyncs start,
+ * finish, pause or resume, by drbd_pause_after() and drbd_resume_next().
+ */
+static bool rs_sched_may_sync(struct drbd_peer_device *peer_device)
+{
+	unsigned int max = READ_ONCE(drbd_resync_max_concurrent);
+	bool running = rs_sched_running(peer_device);
+	struct drbd_device *other_device;
+	unsigned long left = 0;
+	unsigned int ahead = 0;
+	int vnr;
+
+	if (!max) {
+		peer_device->rs_sched_wait = false;
+		return true;
+	}
+
+	if (!running)
+		left = drbd_bm_total_weight(peer_device);
+
+	rcu_read_lock();
+	idr_for_each_entry(&drbd_devices, other_device, vnr) {
+		struct drbd_peer_device *other_peer_device;
+
+		for_each_peer_device_rcu(other_peer_device, other_device) {
+			if (other_peer_device == peer_device)
+				continue;
+			if (rs_sched_running(other_peer_device)) {
+				if (!running || rs_sched_before(other_peer_device, 0, peer_device, 0))
+					ahead++;
+			} else if (!running && rs_sched_waiting(other_peer_device) &&
+				   rs_sched_before(other_peer_device,
+						   drbd_bm_total_weight(other_peer_device),
+						   peer_device, left)) {
+				ahead++;
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	peer_device->rs_sched_wait = ahead >= max;
+	return ahead < max;
+}
+
+static bool rs_sched_applies(struct drbd_peer_device *peer_device)
+{
+	enum drbd_repl_state repl_state = peer_device->repl_state[NOW];
+
+	return repl_state == L_SYNC_SOURCE || repl_state == L_SYNC_TARGET ||
+		repl_state == L_PAUSED_SYNC_S || repl_state == L_PAUSED_SYNC_T;
+}
+
+static bool __drbd_may_sync_now(struct drbd_peer_device *peer_device)
+{
+	if (!resync_after_done(peer_device)) {
+		peer_device->rs_sched_wait = false;
+		return false;
+	}
+
+	return !rs_sched_applies(peer_device) || rs_sched_may_sync(peer_device);
+}
+
 /**
  * drbd_pause_after() - Pause resync on all devices that may not resync now
  * @device:	DRBD device.
@@ -1776,6 +3063,9 @@ void suspend_other_sg(struct drbd_device *device)
 {
 	lock_all_resources();
 	drbd_pause_after(device);
+	/* a resync paused for another reason frees its slot */
+	if (READ_ONCE(drbd_resync_max_concurrent))
+		drbd_resume_next(device);
 	unlock_all_resources();
 }
 
@@ -1843,8 +3133,13 @@ void drbd_rs_controller_reset(struct drbd_peer_device *peer_device)
 	atomic_set(&peer_device->device->rs_sect_ev, 0);  /* FIXME: ??? */
 	peer_device->rs_last_mk_req_kt = ktime_get();
 	peer_device->rs_in_flight = 0;
+	peer_device->rs_turn.start_kt = 0;
+	peer_device->rs_turn.budget = 0;
+	peer_device->rs_turn.sent = 0;
+	peer_device->rs_turn.sect_in = 0;
 	peer_device->rs_last_events =
 		drbd_backing_bdev_events(peer_device->device);
+	rs_bbr_reset(peer_device);
 
 	/* Updating the RCU protected object in place is necessary since
 	   this function gets called from atomic context.
@@ -1863,6 +3158,12 @@ void start_resync_timer_fn(struct timer_list *t)
 	drbd_peer_device_post_work(peer_device, RS_START);
 }
 
+void verify_resume_timer_fn(struct timer_list *t)
+{
+	struct drbd_peer_device *peer_device = from_timer(peer_device, t, verify_resume_timer);
+	drbd_peer_device_post_work(peer_device, VERIFY_RESUME);
+}
+
 bool drbd_stable_sync_source_present(struct drbd_peer_device *except_peer_device, enum which_state which)
 {
 	struct drbd_device *device = except_peer_device->device;
@@ -1929,6 +3230,29 @@ static void do_start_resync(struct drbd_peer_device *peer_device)
 	clear_bit(AHEAD_TO_SYNC_SOURCE, &peer_device->flags);
 }
 
+/* Restarts the online verify aborted by the last connection loss at the
+ * position it had reached, ov_start_sector, up to the same ov_stop_sector. */
+static void resume_verify(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+
+	if (!test_bit(VERIFY_INTERRUPTED, &peer_device->flags) ||
+	    peer_device->repl_state[NOW] != L_ESTABLISHED)
+		return;
+
+	/* bitmap IO of the handshake is queued behind us on this worker */
+	if (atomic_read(&device->pending_bitmap_work.n) ||
+	    atomic_read(&peer_device->unacked_cnt) ||
+	    atomic_read(&peer_device->rs_pending_cnt)) {
+		mod_timer(&peer_device->verify_resume_timer, jiffies + HZ/10);
+		return;
+	}
+
+	drbd_info(peer_device, "Resuming Online Verify at sector %llu\n",
+		  (unsigned long long)peer_device->ov_start_sector);
+	stable_change_repl_state(peer_device, L_VERIFY_S, CS_VERBOSE);
+}
+
 static void handle_congestion(struct drbd_peer_device *peer_device)
 {
 	struct drbd_resource *resource = peer_device->device->resource;
@@ -2047,7 +3371,8 @@ skip_helper:
 	}
 
 	begin_state_change_locked(device->resource, CS_VERBOSE);
-	__change_resync_susp_dependency(peer_device, !__drbd_may_sync_now(peer_device));
+	__change_resync_susp_dependency(peer_device, !__drbd_may_sync_now(peer_device) ||
+					!rs_sched_may_sync(peer_device));
 	__change_repl_state(peer_device, side);
 	if (side == L_SYNC_TARGET) {
 		__change_disk_state(device, D_INCONSISTENT);
@@ -2067,11 +3392,11 @@ skip_helper:
 		/* Forget potentially stale cached per resync extent bit-counts.
 		 * Open coded drbd_rs_cancel_all(device), we already have IRQs
 		 * disabled, and know the disk state is ok. */
-		spin_lock(&device->al_lock);
+		drbd_lock(&device->al_lock, &device->al_lock_stat);
 		lc_reset(peer_device->resync_lru);
 		peer_device->resync_locked = 0;
 		peer_device->resync_wenr = LC_FREE;
-		spin_unlock(&device->al_lock);
+		drbd_unlock(&device->al_lock, &device->al_lock_stat);
 	}
 
 	unlock_all_resources();
@@ -2083,6 +3408,7 @@ skip_helper:
 		     (unsigned long) peer_device->rs_total);
 		if (side == L_SYNC_TARGET) {
 			peer_device->resync_next_bit = 0;
+			peer_device->rs_hot = false;
 			peer_device->use_csums = use_checksum_based_resync(connection, device);
 		} else {
 			peer_device->use_csums = false;
@@ -2120,6 +3446,8 @@ static void update_on_disk_bitmap(struct drbd_peer_device *peer_device, bool res
 		return;
 
 	drbd_bm_write_lazy(device, 0);
+	drbd_bm_compact(device);
+	drbd_rs_cache_expire(device, false);
 
 	if (resync_done) {
 		if (is_verify_state(peer_device, NOW)) {
@@ -2148,6 +3476,7 @@ static void drbd_ldev_destroy(struct drbd_device *device)
         rcu_read_unlock();
         lc_destroy(device->act_log);
         device->act_log = NULL;
+	drbd_rs_cache_free(device);
 	__acquire(local);
 	drbd_backing_dev_free(device, device->ldev);
 	device->ldev = NULL;
@@ -2343,6 +3672,8 @@ static void do_peer_device_work(struct drbd_peer_device *peer_device, const unsi
 		do_start_resync(peer_device);
 	if (test_bit(HANDLE_CONGESTION, &todo))
 		handle_congestion(peer_device);
+	if (test_bit(VERIFY_RESUME, &todo))
+		resume_verify(peer_device);
 }
 
 #define DRBD_RESOURCE_WORK_MASK	\
@@ -2361,6 +3692,7 @@ static void do_peer_device_work(struct drbd_peer_device *peer_device, const unsi
 	|(1UL << RS_PROGRESS)		\
 	|(1UL << RS_DONE)		\
 	|(1UL << HANDLE_CONGESTION)     \
+	|(1UL << VERIFY_RESUME)		\
 	)
 
 static unsigned long get_work_bits(const unsigned long mask, unsigned long *flags)
@@ -2715,6 +4047,7 @@ static bool is_write_in_flight(struct drbd_peer_device *peer_device, struct drbd
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_request *req;
+	struct drbd_write_overlap o;
 	struct drbd_interval *i;
 	sector_t sector = in->sector;
 	int size = in->size;
@@ -2728,8 +4061,8 @@ static bool is_write_in_flight(struct drbd_peer_device *peer_device, struct drbd
 	}
 
 	read_lock_irq(&device->resource->state_rwlock);
-	spin_lock(&device->interval_lock);
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	drbd_write_lock(device, sector, size);
+	drbd_for_each_write_overlap(i, &o, device, sector, size) {
 		if (i == in)
 			continue;
 		if (!i->local)
@@ -2745,11 +4078,56 @@ static bool is_write_in_flight(struct drbd_peer_device *peer_device, struct drbd
 		in_flight = true;
 		break;
 	}
-	spin_unlock(&device->interval_lock);
+	drbd_write_unlock(device, sector, size);
 	read_unlock_irq(&device->resource->state_rwlock);
 	return in_flight;
 }
 
+/* In Ahead mode, writes are only announced to the peer with P_OUT_OF_SYNC,
+ * and those tend to come in runs of adjacent or overlapping sectors.  Instead
+ * of one packet per write, keep extending a pending range, and send it once
+ * the next range does not fit, or before anything else goes out on the data
+ * stream.  The receiver applies each P_OUT_OF_SYNC with one bitmap range
+ * operation already, and accepts up to DRBD_MAX_BATCH_BIO_SIZE per packet. */
+static int flush_out_of_sync(struct drbd_connection *connection)
+{
+	struct drbd_peer_device *peer_device = connection->send.oos_peer_device;
+	struct drbd_interval i = {
+		.sector = connection->send.oos_sector,
+		.size = connection->send.oos_size,
+	};
+
+	if (!peer_device)
+		return 0;
+	connection->send.oos_peer_device = NULL;
+	return drbd_send_out_of_sync(peer_device, &i);
+}
+
+static int queue_out_of_sync(struct drbd_peer_device *peer_device, struct drbd_interval *i)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	sector_t start = connection->send.oos_sector;
+	sector_t end = start + (connection->send.oos_size >> 9);
+	int err;
+
+	if (connection->send.oos_peer_device == peer_device &&
+	    i->sector <= end && start <= i->sector + (i->size >> 9)) {
+		start = min(start, i->sector);
+		end = max_t(sector_t, end, i->sector + (i->size >> 9));
+		if (end - start <= DRBD_MAX_BATCH_BIO_SIZE >> 9) {
+			connection->send.oos_sector = start;
+			connection->send.oos_size = (end - start) << 9;
+			return 0;
+		}
+	}
+
+	err = flush_out_of_sync(connection);
+	connection->send.oos_peer_device = peer_device;
+	connection->send.oos_sector = i->sector;
+	connection->send.oos_size = i->size;
+	return err;
+}
+
 static int process_one_request(struct drbd_connection *connection)
 {
 	struct bio_and_error m;
@@ -2759,6 +4137,7 @@ static int process_one_request(struct drbd_connection *connection)
 			conn_peer_device(connection, device->vnr);
 	unsigned s = req->net_rq_state[peer_device->node_id];
 	bool do_send_unplug = req->local_rq_state & RQ_UNPLUG;
+	ktime_t send_kt;
 	int err = 0;
 	enum drbd_req_event what;
 
@@ -2772,6 +4151,7 @@ static int process_one_request(struct drbd_connection *connection)
 			u64 current_dagtag_sector =
 				req->dagtag_sector - (req->i.size >> 9);
 
+			flush_out_of_sync(connection);
 			re_init_if_first_write(connection, req->epoch);
 			maybe_send_barrier(connection, req->epoch);
 			if (current_dagtag_sector != connection->send.current_dagtag_sector)
@@ -2786,18 +4166,24 @@ static int process_one_request(struct drbd_connection *connection)
 				drbd_send_current_state(peer_device);
 			}
 
+			send_kt = ktime_get();
 			err = drbd_send_dblock(peer_device, req);
+			drbd_lat_record_peer(peer_device, DRBD_LAT_SEND, send_kt);
 			what = err ? SEND_FAILED : HANDED_OVER_TO_NETWORK;
 		} else {
 			/* this time, no connection->send.current_epoch_writes++;
 			 * If it was sent, it was the closing barrier for the last
 			 * replicated epoch, before we went into AHEAD mode.
 			 * No more barriers will be sent, until we leave AHEAD mode again. */
+			if (should_send_barrier(connection, req->epoch) &&
+			    connection->send.current_epoch_writes)
+				flush_out_of_sync(connection);
 			maybe_send_barrier(connection, req->epoch);
 
 			/* make sure the state change to L_AHEAD/L_BEHIND
 			 * arrives before the first set-out-of-sync information */
 			if (!peer_device->todo.was_ahead) {
+				flush_out_of_sync(connection);
 				peer_device->todo.was_ahead = true;
 				drbd_send_current_state(peer_device);
 			}
@@ -2834,10 +4220,11 @@ static int process_one_request(struct drbd_connection *connection)
 			 */
 			if (drbd_set_out_of_sync(peer_device, req->i.sector, req->i.size) ||
 			    is_write_in_flight(peer_device, &req->i))
-				err = drbd_send_out_of_sync(peer_device, &req->i);
+				err = queue_out_of_sync(peer_device, &req->i);
 			what = OOS_HANDED_TO_NETWORK; /* Well, most of the time, anyways. */
 		}
 	} else {
+		flush_out_of_sync(connection);
 		maybe_send_barrier(connection, req->epoch);
 		err = drbd_send_drequest(peer_device, P_DATA_REQUEST,
 				req->i.sector, req->i.size, (unsigned long)req);
@@ -2853,8 +4240,69 @@ static int process_one_request(struct drbd_connection *connection)
 	if (m.bio)
 		complete_master_bio(device, &m);
 
-	do_send_unplug = do_send_unplug && what == HANDED_OVER_TO_NETWORK;
-	maybe_send_unplug_remote(connection, do_send_unplug);
+	if (do_send_unplug && what == HANDED_OVER_TO_NETWORK)
+		connection->send.unplug_pending = true;
+
+	return err;
+}
+
+/* The unplug hints of all volumes of a batch go out as one P_UNPLUG_REMOTE
+ * behind its last request.  The receiver unplugs all its backing devices on
+ * each of them anyways, so a hint per volume, or per request that happened
+ * to be the most recent one of some plug, only splits the peer's batches. */
+static void flush_unplug_remote(struct drbd_connection *connection)
+{
+	bool pending = connection->send.unplug_pending;
+
+	connection->send.unplug_pending = false;
+	maybe_send_unplug_remote(connection, pending);
+}
+
+/* Send the current request, and as long as more requests are ready right
+ * behind it, up to drbd_sender_batch of them in one go.  For the batch, the
+ * data stream is corked: the headers (and copied payloads) pile up in the send
+ * buffer and leave in as few transport calls as possible, instead of one send
+ * (and one TCP push) per request.  A single ready request is sent as before.
+ * Queued work items end the batch, they are not to wait behind it.
+ * Out-of-sync ranges coalesced during the batch, and the unplug hint, are
+ * sent at its end. */
+static int process_request_batch(struct drbd_connection *connection)
+{
+	unsigned int batch = READ_ONCE(drbd_sender_batch);
+	bool cork;
+	int err;
+
+	update_sender_timing_details(connection, process_one_request);
+	err = process_one_request(connection);
+	if (err)
+		return err;
+	if (batch <= 1 || !connection->todo.req ||
+	    !list_empty(&connection->todo.work_list)) {
+		err = flush_out_of_sync(connection);
+		if (!err)
+			flush_unplug_remote(connection);
+		return err;
+	}
+
+	/* with tcp_cork in net_conf, wait_for_sender_todo() corked already */
+	cork = !test_bit(CORKED + DATA_STREAM, &connection->flags);
+	if (cork)
+		drbd_cork(connection, DATA_STREAM);
+
+	while (--batch && connection->todo.req &&
+	       list_empty(&connection->todo.work_list)) {
+		update_sender_timing_details(connection, process_one_request);
+		err = process_one_request(connection);
+		if (err)
+			break;
+	}
+
+	if (!err)
+		err = flush_out_of_sync(connection);
+	if (!err)
+		flush_unplug_remote(connection);
+	if (cork)
+		drbd_uncork(connection, DATA_STREAM);
 
 	return err;
 }
@@ -2862,6 +4310,7 @@ static int process_one_request(struct drbd_connection *connection)
 static int process_sender_todo(struct drbd_connection *connection)
 {
 	struct drbd_work *w = NULL;
+	int err;
 
 	/* Process all currently pending work items,
 	 * or requests from the transfer log.
@@ -2876,13 +4325,13 @@ static int process_sender_todo(struct drbd_connection *connection)
 		maybe_send_unplug_remote(connection, false);
 	}
 	else if (list_empty(&connection->todo.work_list)) {
-		update_sender_timing_details(connection, process_one_request);
-		return process_one_request(connection);
+		return process_request_batch(connection);
 	}
 
 	while (!list_empty(&connection->todo.work_list)) {
-		int err;
-
+		err = flush_out_of_sync(connection);
+		if (err)
+			return err;
 		w = list_first_entry(&connection->todo.work_list, struct drbd_work, list);
 		list_del_init(&w->list);
 		update_sender_timing_details(connection, w->cb);
@@ -2902,7 +4351,10 @@ static int process_sender_todo(struct drbd_connection *connection)
 			return err;
 	}
 
-	return 0;
+	err = flush_out_of_sync(connection);
+	if (!err)
+		flush_unplug_remote(connection);
+	return err;
 }
 
 int drbd_sender(struct drbd_thread *thi)
@@ -2920,6 +4372,7 @@ int drbd_sender(struct drbd_thread *thi)
 		peer_device->recv_cnt = 0;
 	}
 	rcu_read_unlock();
+	connection->send.oos_peer_device = NULL;
 
 	while (get_t_state(thi) == RUNNING) {
 		drbd_thread_current_set_cpu(thi);
@@ -462,11 +462,11 @@ void forget_state_change(struct drbd_state_change *state_change)
 	kfree(state_change);
 }
 
-static bool state_has_changed(struct drbd_resource *resource)
+/* Changes to the resource or to any connection are global: they affect the
+ * validation and the side effects of every volume. */
+static bool resource_state_has_changed(struct drbd_resource *resource)
 {
 	struct drbd_connection *connection;
-	struct drbd_device *device;
-	int vnr;
 
 	if (resource->state_change_flags & CS_FORCE_RECALC)
 		return true;
@@ -482,32 +482,69 @@ static bool state_has_changed(struct drbd_resource *resource)
 		    connection->susp_fen[OLD] != connection->susp_fen[NEW])
 			return true;
 	}
+	return false;
+}
 
-	idr_for_each_entry(&resource->devices, device, vnr) {
-		struct drbd_peer_device *peer_device;
+static bool device_state_has_changed(struct drbd_device *device)
+{
+	struct drbd_peer_device *peer_device;
+
+	if (device->disk_state[OLD] != device->disk_state[NEW] ||
+	    device->have_quorum[OLD] != device->have_quorum[NEW])
+		return true;
 
-		if (device->disk_state[OLD] != device->disk_state[NEW] ||
-		    device->have_quorum[OLD] != device->have_quorum[NEW])
+	for_each_peer_device(peer_device, device) {
+		if (peer_device->disk_state[OLD] != peer_device->disk_state[NEW] ||
+		    peer_device->repl_state[OLD] != peer_device->repl_state[NEW] ||
+		    peer_device->resync_susp_user[OLD] !=
+			peer_device->resync_susp_user[NEW] ||
+		    peer_device->resync_susp_peer[OLD] !=
+			peer_device->resync_susp_peer[NEW] ||
+		    peer_device->resync_susp_dependency[OLD] !=
+			peer_device->resync_susp_dependency[NEW] ||
+		    peer_device->resync_susp_other_c[OLD] !=
+			peer_device->resync_susp_other_c[NEW] ||
+		    peer_device->uuid_flags & UUID_FLAG_GOT_STABLE)
 			return true;
+	}
+	return false;
+}
 
-		for_each_peer_device(peer_device, device) {
-			if (peer_device->disk_state[OLD] != peer_device->disk_state[NEW] ||
-			    peer_device->repl_state[OLD] != peer_device->repl_state[NEW] ||
-			    peer_device->resync_susp_user[OLD] !=
-				peer_device->resync_susp_user[NEW] ||
-			    peer_device->resync_susp_peer[OLD] !=
-				peer_device->resync_susp_peer[NEW] ||
-			    peer_device->resync_susp_dependency[OLD] !=
-				peer_device->resync_susp_dependency[NEW] ||
-			    peer_device->resync_susp_other_c[OLD] !=
-				peer_device->resync_susp_other_c[NEW] ||
-			    peer_device->uuid_flags & UUID_FLAG_GOT_STABLE)
-				return true;
-		}
+static bool state_has_changed(struct drbd_resource *resource)
+{
+	struct drbd_device *device;
+	int vnr;
+
+	if (resource_state_has_changed(resource))
+		return true;
+
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (device_state_has_changed(device))
+			return true;
 	}
 	return false;
 }
 
+/**
+ * mark_touched_devices() - Remember which volumes a state change touches
+ *
+ * With many volumes, most state changes (a resync finishing, a single volume
+ * attaching) only concern one of them.  The checks in is_valid_transition(),
+ * __is_valid_soft_transition() and finish_state_change() trigger on a change
+ * between [OLD] and [NEW] of the volume's own state, so they can skip volumes
+ * that are not touched.  A change of the resource or of a connection touches
+ * all volumes.  Must be called after sanitize_state().
+ */
+static void mark_touched_devices(struct drbd_resource *resource)
+{
+	bool all = resource_state_has_changed(resource);
+	struct drbd_device *device;
+	int vnr;
+
+	idr_for_each_entry(&resource->devices, device, vnr)
+		device->state_touched = all || device_state_has_changed(device);
+}
+
 static void ___begin_state_change(struct drbd_resource *resource)
 {
 	struct drbd_connection *connection;
@@ -558,6 +595,7 @@ static enum drbd_state_rv try_state_change(struct drbd_resource *resource)
 	if (!state_has_changed(resource))
 		return SS_NOTHING_TO_DO;
 	sanitize_state(resource);
+	mark_touched_devices(resource);
 	rv = is_valid_transition(resource);
 	if (rv >= SS_SUCCESS && !(resource->state_change_flags & CS_HARD))
 		rv = is_valid_soft_transition(resource);
@@ -1031,6 +1069,16 @@ static void set_resync_susp_other_c(struct drbd_peer_device *peer_device, bool v
 				continue;
 
 			r = p->repl_state[NEW];
+			if (!start && drbd_rs_co_source(peer_device, p, NEW)) {
+				/* We now sync from peer_device, resync from p in
+				 * parallel. See make_resync_request(). */
+				if (r == L_PAUSED_SYNC_T) {
+					p->resync_susp_other_c[NEW] = false;
+					if (!resync_suspended(p, NEW))
+						p->repl_state[NEW] = L_SYNC_TARGET;
+				}
+				continue;
+			}
 			p->resync_susp_other_c[NEW] = true;
 
 			if (start && p->disk_state[NEW] >= D_INCONSISTENT && r == L_ESTABLISHED)
@@ -1040,6 +1088,13 @@ static void set_resync_susp_other_c(struct drbd_peer_device *peer_device, bool v
 				p->repl_state[NEW] = L_PAUSED_SYNC_S;
 		}
 	} else {
+		/* The last one of parallel resyncs resumes the others */
+		for_each_peer_device(p, device) {
+			if (drbd_rs_co_source(peer_device, p, NEW) &&
+			    p->repl_state[NEW] == L_SYNC_TARGET)
+				return;
+		}
+
 		for_each_peer_device(p, device) {
 			if (p == peer_device)
 				continue;
@@ -1555,6 +1610,9 @@ static enum drbd_state_rv __is_valid_soft_transition(struct drbd_resource *resou
 		enum which_state which;
 		int nr_negotiating = 0;
 
+		if (!device->state_touched)
+			continue;
+
 		if (role[OLD] != R_SECONDARY && role[NEW] == R_SECONDARY && device->open_rw_cnt)
 			return SS_DEVICE_IN_USE;
 
@@ -1747,17 +1805,22 @@ static enum drbd_state_rv is_valid_transition(struct drbd_resource *resource)
 		if (rv < SS_SUCCESS)
 			return rv;
 
+		/* When establishing a connection we need to go through C_CONNECTED!
+		   Necessary to do the right thing upon invalidate-remote on a disconnected
+		   resource */
+		if (connection->cstate[OLD] >= C_CONNECTED)
+			continue;
+
 		idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
-			/* When establishing a connection we need to go through C_CONNECTED!
-			   Necessary to do the right thing upon invalidate-remote on a disconnected
-			   resource */
-			if (connection->cstate[OLD] < C_CONNECTED &&
-			    peer_device->repl_state[NEW] >= L_ESTABLISHED)
+			if (peer_device->repl_state[NEW] >= L_ESTABLISHED)
 				return SS_NEED_CONNECTION;
 		}
 	}
 
 	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (!device->state_touched)
+			continue;
+
 		/* we cannot fail (again) if we already detached */
 		if ((device->disk_state[NEW] == D_FAILED || device->disk_state[NEW] == D_DETACHING) &&
 		    device->disk_state[OLD] == D_DISKLESS) {
@@ -2102,6 +2165,17 @@ static void set_ov_position(struct drbd_peer_device *peer_device,
 		peer_device->ov_start_sector = ~(sector_t)0;
 	} else {
 		unsigned long bit = BM_SECT_TO_BIT(peer_device->ov_start_sector);
+
+		/* A resumed run keeps sampling the extents it started with */
+		if (!test_and_clear_bit(VERIFY_INTERRUPTED, &peer_device->flags)) {
+			peer_device->ov_sample_pct = READ_ONCE(drbd_verify_sample_pct);
+			if (peer_device->ov_sample_pct >= 100 ||
+			    peer_device->ov_stop_sector != ULLONG_MAX)
+				peer_device->ov_sample_pct = 0;
+			if (peer_device->ov_sample_pct)
+				peer_device->ov_sample_run++;
+		}
+		peer_device->ov_sample_skipped = 0;
 		if (bit >= peer_device->rs_total) {
 			peer_device->ov_start_sector =
 				BM_BIT_TO_SECT(peer_device->rs_total - 1);
@@ -2157,6 +2231,12 @@ static void initialize_resync(struct drbd_peer_device *peer_device)
 	peer_device->rs_failed = 0;
 	peer_device->rs_paused = 0;
 	peer_device->rs_same_csum = 0;
+	atomic_set(&peer_device->rs_csum_win_sent, 0);
+	atomic_set(&peer_device->rs_csum_win_same, 0);
+	peer_device->rs_csum_match = 256;
+	peer_device->rs_csum_enr = ULONG_MAX;
+	peer_device->rs_csum_nr = 0;
+	peer_device->rs_csum_direct = 0;
 	peer_device->rs_last_sect_ev = 0;
 	peer_device->rs_total = tw;
 	peer_device->rs_start = now;
@@ -2183,6 +2263,112 @@ static bool primary_and_data_present(struct drbd_device *device)
 	return primary && up_to_date_data;
 }
 
+/* Caller holds a reference on the ldev */
+static void update_peer_md_flags(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	enum drbd_disk_state pdsk = peer_device->disk_state[NEW];
+	u32 mdf;
+
+	if (peer_device->bitmap_index == -1)
+		return;
+
+	mdf = device->ldev->md.peers[peer_device->node_id].flags;
+	/* Do NOT clear MDF_PEER_DEVICE_SEEN.
+	 * We want to be able to refuse a resize beyond "last agreed" size,
+	 * even if the peer is currently detached.
+	 */
+	mdf &= ~(MDF_PEER_CONNECTED | MDF_PEER_OUTDATED | MDF_PEER_FENCING);
+	if (peer_device->repl_state[NEW] > L_OFF)
+		mdf |= MDF_PEER_CONNECTED;
+	if (pdsk >= D_INCONSISTENT) {
+		if (pdsk <= D_OUTDATED)
+			mdf |= MDF_PEER_OUTDATED;
+		if (pdsk != D_UNKNOWN)
+			mdf |= MDF_PEER_DEVICE_SEEN;
+	}
+	if (peer_device->connection->fencing_policy != FP_DONT_CARE)
+		mdf |= MDF_PEER_FENCING;
+	if (mdf != device->ldev->md.peers[peer_device->node_id].flags) {
+		device->ldev->md.peers[peer_device->node_id].flags = mdf;
+		drbd_md_mark_dirty(device);
+	}
+}
+
+static void update_device_md_flags(struct drbd_device *device, bool some_peer_is_primary,
+				   bool some_peer_request_in_flight)
+{
+	enum drbd_disk_state *disk_state = device->disk_state;
+	enum drbd_role *role = device->resource->role;
+
+	if (disk_state[NEW] != D_NEGOTIATING && get_ldev_if_state(device, D_DETACHING)) {
+		u32 mdf = device->ldev->md.flags;
+		/* For now, always require a drbdmeta apply-al run,
+		 * even if that ends up only re-initializing the AL */
+		mdf &= ~MDF_AL_CLEAN;
+		/* reset some flags to what we know now */
+		mdf &= ~MDF_CRASHED_PRIMARY;
+		if (test_bit(CRASHED_PRIMARY, &device->flags))
+			mdf |= MDF_CRASHED_PRIMARY;
+		if (test_bit(PRIMARY_LOST_QUORUM, &device->flags))
+			mdf |= MDF_PRIMARY_LOST_QUORUM;
+		/* Do not touch MDF_CONSISTENT if we are D_FAILED */
+		if (disk_state[NEW] >= D_INCONSISTENT) {
+			mdf &= ~(MDF_CONSISTENT | MDF_WAS_UP_TO_DATE);
+
+			if (disk_state[NEW] > D_INCONSISTENT)
+				mdf |= MDF_CONSISTENT;
+			if (disk_state[NEW] > D_OUTDATED)
+				mdf |= MDF_WAS_UP_TO_DATE;
+		} else if ((disk_state[NEW] == D_FAILED || disk_state[NEW] == D_DETACHING) &&
+			   mdf & MDF_WAS_UP_TO_DATE &&
+			   primary_and_data_present(device)) {
+			/* There are cases when we still can update meta-data even if disk
+			   state is failed.... Clear MDF_WAS_UP_TO_DATE if appropriate */
+			mdf &= ~MDF_WAS_UP_TO_DATE;
+		}
+
+/*
+ * MDF_PRIMARY_IND  IS set: apply activity log after crash
+ * MDF_PRIMARY_IND NOT set: do not apply, forget and re-initialize activity log after crash.
+ * We want the MDF_PRIMARY_IND set *always* before our backend could possibly
+ * be target of write requests, whether we are Secondary or Primary ourselves.
+ *
+ * We want to avoid to clear that flag just because we lost the connection to a
+ * detached Primary, but before all in-flight IO was drained, because we may
+ * have some dirty bits not yet persisted.
+ *
+ * We want it cleared only once we are *certain* that we no longer see any Primary,
+ * are not Primary ourselves, AND all previously received WRITE (peer-) requests
+ * have been processed, NOTHING is in flight against our backend anymore,
+ * AND we have successfully written out any dirty bitmap pages.
+ */
+		/* set, if someone is/becomes primary */
+		if (role[NEW] == R_PRIMARY || some_peer_is_primary)
+			mdf |= MDF_PRIMARY_IND;
+		/* clear, if */
+		else if (/* NO peer requests in flight, AND */
+		    !some_peer_request_in_flight &&
+		    (   /* clean detach, */
+		     (disk_state[NEW] == D_DETACHING && !test_bit(FORCE_DETACH, &device->flags))
+		     || /* or everyone secondary ... */
+		     (role[NEW] == R_SECONDARY && !some_peer_is_primary &&
+		        /* ... and not detaching because of IO error. */
+		      disk_state[NEW] >= D_INCONSISTENT)))
+			mdf &= ~MDF_PRIMARY_IND;
+
+		/* apply changed flags to md.flags,
+		 * and "schedule" for write-out */
+		if (mdf != device->ldev->md.flags) {
+			device->ldev->md.flags = mdf;
+			drbd_md_mark_dirty(device);
+		}
+		if (disk_state[OLD] < D_CONSISTENT && disk_state[NEW] >= D_CONSISTENT)
+			drbd_set_exposed_data_uuid(device, device->ldev->md.current_uuid);
+		put_ldev(device);
+	}
+}
+
 /**
  * finish_state_change  -  carry out actions triggered by a state change
  */
@@ -2204,6 +2390,12 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 		bool *have_quorum = device->have_quorum;
 		struct drbd_peer_device *peer_device;
 
+		if (role[NEW] == R_PRIMARY && !have_quorum[NEW])
+			set_bit(PRIMARY_LOST_QUORUM, &device->flags);
+
+		if (!device->state_touched)
+			continue;
+
 		for_each_peer_device(peer_device, device) {
 			bool did, should;
 
@@ -2220,17 +2412,40 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 				clear_bit(SYNC_TARGET_TO_BEHIND, &peer_device->flags);
 			}
 		}
-
-		if (role[NEW] == R_PRIMARY && !have_quorum[NEW])
-			set_bit(PRIMARY_LOST_QUORUM, &device->flags);
 	}
 	if (start_new_epoch)
 		start_new_tl_epoch(resource);
 
-	if (role[OLD] == R_PRIMARY && role[NEW] == R_SECONDARY && resource->peer_ack_req) {
-		resource->last_peer_acked_dagtag = resource->peer_ack_req->dagtag_sector;
-		drbd_queue_peer_ack(resource, resource->peer_ack_req);
-		resource->peer_ack_req = NULL;
+	if (role[OLD] == R_PRIMARY && role[NEW] == R_SECONDARY) {
+		spin_lock(&resource->peer_ack_lock); /* local irq already disabled */
+		__drbd_flush_peer_acks(resource);
+		spin_unlock(&resource->peer_ack_lock);
+	}
+
+	/* Independent of the volume, for MDF_PRIMARY_IND below */
+	for_each_connection(connection, resource) {
+		enum drbd_role *peer_role = connection->peer_role;
+		enum drbd_conn_state *cstate = connection->cstate;
+		if (peer_role[NEW] == R_PRIMARY)
+			some_peer_is_primary = true;
+		switch (cstate[NEW]) {
+		case C_CONNECTED:
+			if (atomic_read(&connection->active_ee_cnt)
+			 || atomic_read(&connection->done_ee_cnt))
+				some_peer_request_in_flight = true;
+			break;
+		case C_STANDALONE:
+		case C_UNCONNECTED:
+		case C_CONNECTING:
+			/* maybe others are safe as well? which ones? */
+			break;
+		default:
+			/* if we are connected, or just now disconnected,
+			 * there may still be some request in flight. */
+			some_peer_request_in_flight = true;
+		}
+		if (some_peer_is_primary && some_peer_request_in_flight)
+			break;
 	}
 
 	idr_for_each_entry(&resource->devices, device, vnr) {
@@ -2238,6 +2453,20 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 		struct drbd_peer_device *peer_device;
 		bool one_peer_disk_up_to_date[2] = { };
 		bool create_new_uuid = false;
+		bool admit_paths_changed;
+
+		if (!device->state_touched) {
+			/* The persistent flags also depend on the fencing policy
+			 * and on peer requests in flight; keep them current. */
+			if (disk_state[NEW] != D_NEGOTIATING && get_ldev(device)) {
+				for_each_peer_device(peer_device, device)
+					update_peer_md_flags(peer_device);
+				put_ldev(device);
+			}
+			update_device_md_flags(device, some_peer_is_primary,
+					       some_peer_request_in_flight);
+			continue;
+		}
 
 		if (disk_state[OLD] != D_NEGOTIATING && disk_state[NEW] == D_NEGOTIATING) {
 			for_each_peer_device(peer_device, device)
@@ -2266,6 +2495,26 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 		if (disk_state[OLD] == D_ATTACHING && disk_state[NEW] >= D_NEGOTIATING)
 			drbd_info(device, "attached to current UUID: %016llX\n", device->ldev->md.current_uuid);
 
+		/* Admission control counts the local disk while writes go there */
+		admit_paths_changed =
+			(disk_state[OLD] >= D_INCONSISTENT) != (disk_state[NEW] >= D_INCONSISTENT);
+		if (disk_state[OLD] < D_INCONSISTENT && disk_state[NEW] >= D_INCONSISTENT)
+			drbd_admit_reset(&device->admit);
+
+		/* Data read ahead is current only as long as the roles stay */
+		if (device->readahead) {
+			bool drop = role[OLD] != role[NEW];
+
+			for_each_peer_device(peer_device, device) {
+				enum drbd_role *peer_role = peer_device->connection->peer_role;
+
+				if (peer_role[OLD] != peer_role[NEW])
+					drop = true;
+			}
+			if (drop)
+				drbd_ra_drop(device);
+		}
+
 		for_each_peer_device(peer_device, device) {
 			enum drbd_repl_state *repl_state = peer_device->repl_state;
 			struct drbd_connection *connection = peer_device->connection;
@@ -2301,8 +2550,22 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 				if (peer_device->ov_left)
 					drbd_info(peer_device, "Online Verify reached sector %llu\n",
 						  (unsigned long long)peer_device->ov_start_sector);
+				if (repl_state[OLD] == L_VERIFY_S && repl_state[NEW] < L_ESTABLISHED &&
+				    peer_device->ov_left && drbd_verify_resume)
+					set_bit(VERIFY_INTERRUPTED, &peer_device->flags);
 			}
 
+			/* Connected again, possibly after a resync */
+			if (repl_state[OLD] != L_ESTABLISHED && repl_state[NEW] == L_ESTABLISHED &&
+			    test_bit(VERIFY_INTERRUPTED, &peer_device->flags))
+				drbd_peer_device_post_work(peer_device, VERIFY_RESUME);
+
+			/* ... and the peers while they are connected */
+			if ((repl_state[OLD] >= L_ESTABLISHED) != (repl_state[NEW] >= L_ESTABLISHED))
+				admit_paths_changed = true;
+			if (repl_state[OLD] < L_ESTABLISHED && repl_state[NEW] >= L_ESTABLISHED)
+				drbd_admit_reset(&peer_device->admit);
+
 			if ((repl_state[OLD] == L_PAUSED_SYNC_T || repl_state[OLD] == L_PAUSED_SYNC_S) &&
 			    (repl_state[NEW] == L_SYNC_TARGET  || repl_state[NEW] == L_SYNC_SOURCE)) {
 				drbd_info(peer_device, "Syncer continues.\n");
@@ -2310,6 +2573,7 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 						  -(long)peer_device->rs_mark_time[peer_device->rs_last_mark];
 				initialize_resync_progress_marks(peer_device);
 				peer_device->resync_next_bit = 0;
+				peer_device->rs_hot = false;
 				if (repl_state[NEW] == L_SYNC_TARGET)
 					mod_timer(&peer_device->resync_timer, jiffies);
 			}
@@ -2352,29 +2616,7 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 			}
 
 			if (disk_state[NEW] != D_NEGOTIATING && get_ldev(device)) {
-				if (peer_device->bitmap_index != -1) {
-					enum drbd_disk_state pdsk = peer_device->disk_state[NEW];
-					u32 mdf = device->ldev->md.peers[peer_device->node_id].flags;
-					/* Do NOT clear MDF_PEER_DEVICE_SEEN.
-					 * We want to be able to refuse a resize beyond "last agreed" size,
-					 * even if the peer is currently detached.
-					 */
-					mdf &= ~(MDF_PEER_CONNECTED | MDF_PEER_OUTDATED | MDF_PEER_FENCING);
-					if (repl_state[NEW] > L_OFF)
-						mdf |= MDF_PEER_CONNECTED;
-					if (pdsk >= D_INCONSISTENT) {
-						if (pdsk <= D_OUTDATED)
-							mdf |= MDF_PEER_OUTDATED;
-						if (pdsk != D_UNKNOWN)
-							mdf |= MDF_PEER_DEVICE_SEEN;
-					}
-					if (peer_device->connection->fencing_policy != FP_DONT_CARE)
-						mdf |= MDF_PEER_FENCING;
-					if (mdf != device->ldev->md.peers[peer_device->node_id].flags) {
-						device->ldev->md.peers[peer_device->node_id].flags = mdf;
-						drbd_md_mark_dirty(device);
-					}
-				}
+				update_peer_md_flags(peer_device);
 
 				/* Peer was forced D_UP_TO_DATE & R_PRIMARY, consider to resync */
 				if (disk_state[OLD] == D_INCONSISTENT &&
@@ -2416,31 +2658,6 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 				clear_bit(GOT_NEG_ACK, &peer_device->flags);
 		}
 
-		for_each_connection(connection, resource) {
-			enum drbd_role *peer_role = connection->peer_role;
-			enum drbd_conn_state *cstate = connection->cstate;
-			if (peer_role[NEW] == R_PRIMARY)
-				some_peer_is_primary = true;
-			switch (cstate[NEW]) {
-			case C_CONNECTED:
-				if (atomic_read(&connection->active_ee_cnt)
-				 || atomic_read(&connection->done_ee_cnt))
-					some_peer_request_in_flight = true;
-				break;
-			case C_STANDALONE:
-			case C_UNCONNECTED:
-			case C_CONNECTING:
-				/* maybe others are safe as well? which ones? */
-				break;
-			default:
-				/* if we are connected, or just now disconnected,
-				 * there may still be some request in flight. */
-				some_peer_request_in_flight = true;
-			}
-			if (some_peer_is_primary && some_peer_request_in_flight)
-				break;
-		}
-
 		if (disk_state[OLD] >= D_INCONSISTENT && disk_state[NEW] < D_INCONSISTENT &&
 		    role[NEW] == R_PRIMARY && one_peer_disk_up_to_date[NEW])
 			create_new_uuid = true;
@@ -2451,73 +2668,13 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 		if (create_new_uuid)
 			set_bit(__NEW_CUR_UUID, &device->flags);
 
-		if (disk_state[NEW] != D_NEGOTIATING && get_ldev_if_state(device, D_DETACHING)) {
-			u32 mdf = device->ldev->md.flags;
-			/* For now, always require a drbdmeta apply-al run,
-			 * even if that ends up only re-initializing the AL */
-			mdf &= ~MDF_AL_CLEAN;
-			/* reset some flags to what we know now */
-			mdf &= ~MDF_CRASHED_PRIMARY;
-			if (test_bit(CRASHED_PRIMARY, &device->flags))
-				mdf |= MDF_CRASHED_PRIMARY;
-			if (test_bit(PRIMARY_LOST_QUORUM, &device->flags))
-				mdf |= MDF_PRIMARY_LOST_QUORUM;
-			/* Do not touch MDF_CONSISTENT if we are D_FAILED */
-			if (disk_state[NEW] >= D_INCONSISTENT) {
-				mdf &= ~(MDF_CONSISTENT | MDF_WAS_UP_TO_DATE);
-
-				if (disk_state[NEW] > D_INCONSISTENT)
-					mdf |= MDF_CONSISTENT;
-				if (disk_state[NEW] > D_OUTDATED)
-					mdf |= MDF_WAS_UP_TO_DATE;
-			} else if ((disk_state[NEW] == D_FAILED || disk_state[NEW] == D_DETACHING) &&
-				   mdf & MDF_WAS_UP_TO_DATE &&
-				   primary_and_data_present(device)) {
-				/* There are cases when we still can update meta-data even if disk
-				   state is failed.... Clear MDF_WAS_UP_TO_DATE if appropriate */
-				mdf &= ~MDF_WAS_UP_TO_DATE;
-			}
-
-/*
- * MDF_PRIMARY_IND  IS set: apply activity log after crash
- * MDF_PRIMARY_IND NOT set: do not apply, forget and re-initialize activity log after crash.
- * We want the MDF_PRIMARY_IND set *always* before our backend could possibly
- * be target of write requests, whether we are Secondary or Primary ourselves.
- *
- * We want to avoid to clear that flag just because we lost the connection to a
- * detached Primary, but before all in-flight IO was drained, because we may
- * have some dirty bits not yet persisted.
- *
- * We want it cleared only once we are *certain* that we no longer see any Primary,
- * are not Primary ourselves, AND all previously received WRITE (peer-) requests
- * have been processed, NOTHING is in flight against our backend anymore,
- * AND we have successfully written out any dirty bitmap pages.
- */
-			/* set, if someone is/becomes primary */
-			if (role[NEW] == R_PRIMARY || some_peer_is_primary)
-				mdf |= MDF_PRIMARY_IND;
-			/* clear, if */
-			else if (/* NO peer requests in flight, AND */
-			    !some_peer_request_in_flight &&
-			    (   /* clean detach, */
-			     (disk_state[NEW] == D_DETACHING && !test_bit(FORCE_DETACH, &device->flags))
-			     || /* or everyone secondary ... */
-			     (role[NEW] == R_SECONDARY && !some_peer_is_primary &&
-			        /* ... and not detaching because of IO error. */
-			      disk_state[NEW] >= D_INCONSISTENT)))
-				mdf &= ~MDF_PRIMARY_IND;
-
-			/* apply changed flags to md.flags,
-			 * and "schedule" for write-out */
-			if (mdf != device->ldev->md.flags) {
-				device->ldev->md.flags = mdf;
-				drbd_md_mark_dirty(device);
-			}
-			if (disk_state[OLD] < D_CONSISTENT && disk_state[NEW] >= D_CONSISTENT)
-				drbd_set_exposed_data_uuid(device, device->ldev->md.current_uuid);
-			put_ldev(device);
+		if (admit_paths_changed) {
+			drbd_admit_update_limit(device, NEW);
+			wake_up(&device->misc_wait); /* the window may have opened */
 		}
 
+		update_device_md_flags(device, some_peer_is_primary, some_peer_request_in_flight);
+
 		/* remember last attach time so request_timer_fn() won't
 		 * kill newly established sessions while we are still trying to thaw
 		 * previously frozen IO */
@@ -2734,10 +2891,10 @@ static union drbd_state state_change_word(struct drbd_state_change *state_change
 	return state;
 }
 
-void notify_resource_state_change(struct sk_buff *skb,
-				  unsigned int seq,
-				  struct drbd_state_change *state_change,
-				  enum drbd_notification_type type)
+int notify_resource_state_change(struct sk_buff *skb,
+				 unsigned int seq,
+				 struct drbd_state_change *state_change,
+				 enum drbd_notification_type type)
 {
 	struct drbd_resource_state_change *resource_state_change = state_change->resource;
 	struct drbd_resource *resource = resource_state_change->resource;
@@ -2749,13 +2906,13 @@ void notify_resource_state_change(struct sk_buff *skb,
 		.res_susp_quorum = state_change_is_susp_quorum(state_change, NEW),
 	};
 
-	notify_resource_state(skb, seq, resource, &resource_info, type);
+	return notify_resource_state(skb, seq, resource, &resource_info, type);
 }
 
-void notify_connection_state_change(struct sk_buff *skb,
-				    unsigned int seq,
-				    struct drbd_connection_state_change *connection_state_change,
-				    enum drbd_notification_type type)
+int notify_connection_state_change(struct sk_buff *skb,
+				   unsigned int seq,
+				   struct drbd_connection_state_change *connection_state_change,
+				   enum drbd_notification_type type)
 {
 	struct drbd_connection *connection = connection_state_change->connection;
 	struct connection_info connection_info = {
@@ -2763,26 +2920,26 @@ void notify_connection_state_change(struct sk_buff *skb,
 		.conn_role = connection_state_change->peer_role[NEW],
 	};
 
-	notify_connection_state(skb, seq, connection, &connection_info, type);
+	return notify_connection_state(skb, seq, connection, &connection_info, type);
 }
 
-void notify_device_state_change(struct sk_buff *skb,
-				unsigned int seq,
-				struct drbd_device_state_change *device_state_change,
-				enum drbd_notification_type type)
+int notify_device_state_change(struct sk_buff *skb,
+			unsigned int seq,
+			struct drbd_device_state_change *device_state_change,
+			enum drbd_notification_type type)
 {
 	struct drbd_device *device = device_state_change->device;
 	struct device_info device_info;
 
 	device_to_info(&device_info, device);
 
-	notify_device_state(skb, seq, device, &device_info, type);
+	return notify_device_state(skb, seq, device, &device_info, type);
 }
 
-void notify_peer_device_state_change(struct sk_buff *skb,
-				     unsigned int seq,
-				     struct drbd_peer_device_state_change *p,
-				     enum drbd_notification_type type)
+int notify_peer_device_state_change(struct sk_buff *skb,
+				    unsigned int seq,
+				    struct drbd_peer_device_state_change *p,
+				    enum drbd_notification_type type)
 {
 	struct drbd_peer_device *peer_device = p->peer_device;
 	/* THINK maybe unify with peer_device_to_info */
@@ -2795,7 +2952,7 @@ void notify_peer_device_state_change(struct sk_buff *skb,
 		.peer_is_intentional_diskless = !want_bitmap(peer_device),
 	};
 
-	notify_peer_device_state(skb, seq, peer_device, &peer_device_info, type);
+	return notify_peer_device_state(skb, seq, peer_device, &peer_device_info, type);
 }
 
 static void notify_state_change(struct drbd_state_change *state_change)
@@ -2803,14 +2960,15 @@ static void notify_state_change(struct drbd_state_change *state_change)
 	struct drbd_resource_state_change *resource_state_change = &state_change->resource[0];
 	bool resource_state_has_changed;
 	unsigned int n_device, n_connection, n_peer_device, n_peer_devices;
-	void (*last_func)(struct sk_buff *, unsigned int, void *,
-			  enum drbd_notification_type) = NULL;
+	drbd_notify_fn last_func = NULL;
 	void *last_arg = NULL;
+	struct sk_buff *skb = NULL;
 
+	/* All events of one state change go out in as few skbs as possible */
 #define HAS_CHANGED(state) ((state)[OLD] != (state)[NEW])
 #define FINAL_STATE_CHANGE(type) \
 	({ if (last_func) \
-		last_func(NULL, 0, last_arg, type); \
+		notify_batch_add(&skb, last_func, last_arg, type); \
 	})
 #define REMEMBER_STATE_CHANGE(func, arg, type) \
 	({ FINAL_STATE_CHANGE(type | NOTIFY_CONTINUES); \
@@ -2869,6 +3027,7 @@ static void notify_state_change(struct drbd_state_change *state_change)
 	}
 
 	FINAL_STATE_CHANGE(NOTIFY_CHANGE);
+	notify_batch_flush(&skb);
 	mutex_unlock(&notification_mutex);
 
 #undef HAS_CHANGED
@@ -3636,6 +3795,7 @@ __cluster_wide_request(struct drbd_resource *resource, int vnr, enum drbd_packet
 		clear_bit(TWOPC_NO, &connection->flags);
 		clear_bit(TWOPC_RETRY, &connection->flags);
 
+		connection->twopc_stats.sent_kt = ktime_get();
 		if (!conn_send_twopc_request(connection, vnr, cmd, request)) {
 			rv = SS_CW_SUCCESS;
 		} else {
@@ -3646,6 +3806,30 @@ __cluster_wide_request(struct drbd_resource *resource, int vnr, enum drbd_packet
 	return rv;
 }
 
+/* For the debugfs "twopc_stats" file, see struct drbd_twopc_stats */
+static void twopc_stats_replies(struct drbd_resource *resource, ktime_t prepare_kt,
+				enum drbd_state_rv rv)
+{
+	struct drbd_twopc_stats *s = &resource->twopc_stats;
+
+	s->prepare.bucket[drbd_lat_bucket(prepare_kt)]++;
+	if (rv == SS_TIMEOUT)
+		s->timeouts++;
+	else if (rv == SS_CONCURRENT_ST_CHG)
+		s->concurrent++;
+}
+
+static void twopc_stats_end(struct drbd_resource *resource, ktime_t first_kt, bool committed)
+{
+	struct drbd_twopc_stats *s = &resource->twopc_stats;
+
+	s->total.bucket[drbd_lat_bucket(first_kt)]++;
+	if (committed)
+		s->committed++;
+	else
+		s->aborted++;
+}
+
 bool cluster_wide_reply_ready(struct drbd_resource *resource)
 {
 	struct drbd_connection *connection;
@@ -3875,6 +4059,12 @@ static void twopc_phase2(struct drbd_resource *resource, int vnr,
  * A configurable timeout determines how long a coordinator or participant will
  * wait for a transaction to finish.  A transaction that times out is assumed
  * to have aborted.
+ *
+ * Transactions are per resource, and nothing here serializes the transactions
+ * of different resources: the genl family has parallel_ops, the locks taken
+ * are per resource, and each resource has its own connections.  Changing many
+ * resources at once, as in a failover, takes about one round trip as long as
+ * the requests are issued concurrently.
  */
 static enum drbd_state_rv
 change_cluster_wide_state(bool (*change)(struct change_context *, enum change_phase),
@@ -3889,6 +4079,7 @@ change_cluster_wide_state(bool (*change)(struct change_context *, enum change_ph
 	u64 reach_immediately;
 	int retries = 1;
 	unsigned long start_time;
+	ktime_t first_kt = 0, prepare_kt;
 	bool have_peers;
 
 	begin_state_change(resource, &irq_flags, context->flags | CS_LOCAL_ONLY);
@@ -3935,6 +4126,8 @@ change_cluster_wide_state(bool (*change)(struct change_context *, enum change_ph
 
 	complete_remote_state_change(resource, &irq_flags);
 	start_time = jiffies;
+	if (!first_kt)
+		first_kt = ktime_get();
 	resource->state_change_err_str = context->err_str;
 
 	reach_immediately = directly_connected_nodes(resource, NOW);
@@ -4006,6 +4199,7 @@ change_cluster_wide_state(bool (*change)(struct change_context *, enum change_ph
 
 	D_ASSERT(resource, resource->twopc_work.cb == NULL);
 	begin_remote_state_change(resource, &irq_flags);
+	prepare_kt = ktime_get();
 	rv = __cluster_wide_request(resource, context->vnr, P_TWOPC_PREPARE,
 				    &request, reach_immediately);
 	have_peers = rv == SS_CW_SUCCESS;
@@ -4016,6 +4210,7 @@ change_cluster_wide_state(bool (*change)(struct change_context *, enum change_ph
 			rv = get_cluster_wide_reply(resource, context);
 		else
 			rv = SS_TIMEOUT;
+		twopc_stats_replies(resource, prepare_kt, rv);
 
 		if (rv == SS_CW_SUCCESS) {
 			u64 directly_reachable =
@@ -4081,6 +4276,7 @@ change_cluster_wide_state(bool (*change)(struct change_context *, enum change_ph
 		long timeout = twopc_retry_timeout(resource, retries++);
 		drbd_info(resource, "Retrying cluster-wide state change after %ums\n",
 			  jiffies_to_msecs(timeout));
+		resource->twopc_stats.retries++;
 		if (have_peers)
 			twopc_phase2(resource, context->vnr, 0, &request, reach_immediately);
 		if (target_connection) {
@@ -4103,6 +4299,7 @@ change_cluster_wide_state(bool (*change)(struct change_context *, enum change_ph
 			  be32_to_cpu(request.tid),
 			  jiffies_to_msecs(jiffies - start_time),
 			  rv);
+	twopc_stats_end(resource, first_kt, rv >= SS_SUCCESS);
 
 	if (have_peers && context->change_local_state_last)
 		twopc_phase2(resource, context->vnr, rv >= SS_SUCCESS, &request, reach_immediately);
@@ -4165,6 +4362,7 @@ change_cluster_wide_device_size(struct drbd_device *device,
 	bool have_peers, commit_it;
 	sector_t new_size = 0;
 	int retries = 1;
+	ktime_t first_kt = 0, prepare_kt;
 
 retry:
 	rv = drbd_support_2pc_resize(resource);
@@ -4174,6 +4372,8 @@ retry:
 	state_change_lock(resource, &irq_flags, CS_VERBOSE | CS_LOCAL_ONLY);
 	complete_remote_state_change(resource, &irq_flags);
 	start_time = jiffies;
+	if (!first_kt)
+		first_kt = ktime_get();
 	reach_immediately = directly_connected_nodes(resource, NOW);
 
 	do
@@ -4205,6 +4405,7 @@ retry:
 		  (unsigned long long)local_max_size >> 1,
 		  (unsigned long long)new_user_size >> 1);
 
+	prepare_kt = ktime_get();
 	rv = __cluster_wide_request(resource, device->vnr, P_TWOPC_PREP_RSZ,
 				    &request, reach_immediately);
 
@@ -4216,12 +4417,14 @@ retry:
 			rv = get_cluster_wide_reply(resource, NULL);
 		else
 			rv = SS_TIMEOUT;
+		twopc_stats_replies(resource, prepare_kt, rv);
 
 		if (rv == SS_TIMEOUT || rv == SS_CONCURRENT_ST_CHG) {
 			long timeout = twopc_retry_timeout(resource, retries++);
 
 			drbd_info(resource, "Retrying cluster-wide state change after %ums\n",
 				  jiffies_to_msecs(timeout));
+			resource->twopc_stats.retries++;
 
 			twopc_phase2(resource, device->vnr, 0, &request, reach_immediately);
 
@@ -4253,6 +4456,7 @@ retry:
 			  jiffies_to_msecs(jiffies - start_time),
 			  rv);
 	}
+	twopc_stats_end(resource, first_kt, commit_it);
 
 	if (have_peers)
 		twopc_phase2(resource, device->vnr, commit_it, &request, reach_immediately);
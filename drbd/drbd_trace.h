@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Tracepoints along the life of requests and peer requests.
+ *
+ * All events carry the minor, the peer node id (-1 if none),
+ * and sector/size of the affected range.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM drbd
+
+#if !defined(_DRBD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DRBD_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "drbd_int.h"
+
+TRACE_EVENT(drbd_req_mod,
+	TP_PROTO(struct drbd_request *req, enum drbd_req_event what,
+		 struct drbd_peer_device *peer_device),
+	TP_ARGS(req, what, peer_device),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, peer)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(int, what)
+		__field(unsigned int, local_rq_state)
+		__field(unsigned int, net_rq_state)
+	),
+	TP_fast_assign(
+		__entry->minor = req->device->minor;
+		__entry->peer = peer_device ? peer_device->node_id : -1;
+		__entry->sector = req->i.sector;
+		__entry->size = req->i.size;
+		__entry->what = what;
+		__entry->local_rq_state = req->local_rq_state;
+		__entry->net_rq_state = peer_device ?
+			req->net_rq_state[peer_device->node_id] : 0;
+	),
+	TP_printk("minor=%u peer=%d sector=%llu size=%u what=%d local=0x%x net=0x%x",
+		  __entry->minor, __entry->peer,
+		  (unsigned long long)__entry->sector, __entry->size,
+		  __entry->what, __entry->local_rq_state, __entry->net_rq_state)
+);
+
+TRACE_EVENT(drbd_al_commit,
+	TP_PROTO(struct drbd_device *device, unsigned int updates, u64 ns, bool pipelined),
+	TP_ARGS(device, updates, ns, pipelined),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, updates)
+		__field(u64, ns)
+		__field(bool, pipelined)
+	),
+	TP_fast_assign(
+		__entry->minor = device->minor;
+		__entry->updates = updates;
+		__entry->ns = ns;
+		__entry->pipelined = pipelined;
+	),
+	TP_printk("minor=%u updates=%u ns=%llu pipelined=%d",
+		  __entry->minor, __entry->updates,
+		  (unsigned long long)__entry->ns, __entry->pipelined)
+);
+
+DECLARE_EVENT_CLASS(drbd_peer_req_class,
+	TP_PROTO(struct drbd_peer_request *peer_req),
+	TP_ARGS(peer_req),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, peer)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(unsigned int, opf)
+		__field(unsigned long, flags)
+	),
+	TP_fast_assign(
+		__entry->minor = peer_req->peer_device->device->minor;
+		__entry->peer = peer_req->peer_device->node_id;
+		__entry->sector = peer_req->i.sector;
+		__entry->size = peer_req->i.size;
+		__entry->opf = peer_req->opf;
+		__entry->flags = peer_req->flags;
+	),
+	TP_printk("minor=%u peer=%d sector=%llu size=%u opf=0x%x flags=0x%lx",
+		  __entry->minor, __entry->peer,
+		  (unsigned long long)__entry->sector, __entry->size,
+		  __entry->opf, __entry->flags)
+);
+
+DEFINE_EVENT(drbd_peer_req_class, drbd_receive_data,
+	TP_PROTO(struct drbd_peer_request *peer_req),
+	TP_ARGS(peer_req)
+);
+
+DEFINE_EVENT(drbd_peer_req_class, drbd_submit_peer_request,
+	TP_PROTO(struct drbd_peer_request *peer_req),
+	TP_ARGS(peer_req)
+);
+
+DECLARE_EVENT_CLASS(drbd_peer_io_class,
+	TP_PROTO(struct drbd_peer_device *peer_device, sector_t sector,
+		 unsigned int size, unsigned int arg),
+	TP_ARGS(peer_device, sector, size, arg),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, peer)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(unsigned int, arg)
+	),
+	TP_fast_assign(
+		__entry->minor = peer_device->device->minor;
+		__entry->peer = peer_device->node_id;
+		__entry->sector = sector;
+		__entry->size = size;
+		__entry->arg = arg;
+	),
+	TP_printk("minor=%u peer=%d sector=%llu size=%u arg=0x%x",
+		  __entry->minor, __entry->peer,
+		  (unsigned long long)__entry->sector, __entry->size, __entry->arg)
+);
+
+/* arg: the packet type */
+DEFINE_EVENT(drbd_peer_io_class, drbd_got_block_ack,
+	TP_PROTO(struct drbd_peer_device *peer_device, sector_t sector,
+		 unsigned int size, unsigned int arg),
+	TP_ARGS(peer_device, sector, size, arg)
+);
+
+/* arg: the dp_flags sent */
+DEFINE_EVENT(drbd_peer_io_class, drbd_send_dblock,
+	TP_PROTO(struct drbd_peer_device *peer_device, sector_t sector,
+		 unsigned int size, unsigned int arg),
+	TP_ARGS(peer_device, sector, size, arg)
+);
+
+#endif /* _DRBD_TRACE_H */
+
+/* out of tree: drbd_trace.h lives next to the sources, see -I$(src) in Kbuild */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE drbd_trace
+#include <trace/define_trace.h>
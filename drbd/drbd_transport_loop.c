@@ -0,0 +1,779 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_transport_loop.c
+
+   This file is part of DRBD.
+
+   In kernel loopback transport: connects two DRBD connections on the same
+   host, for measuring the replication pipeline without a network.
+
+   A connection pairs up with the one whose first path has the reversed
+   address pair, the addresses are only used as labels. Sent pages are passed
+   by reference, the receiver copies out of them into its own buffers, the
+   same as a socket would. There is no wire, nothing is ever lost or
+   reordered, and each stream has a bounded queue for flow control. Latency
+   and a throughput limit of a wire can be emulated per stream.
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/sched/signal.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include <drbd_protocol.h>
+#include <drbd_transport.h>
+#include "drbd_wrappers.h"
+
+
+MODULE_DESCRIPTION("In kernel loopback transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+/* Bytes a sender may have queued per stream before it has to wait for the
+ * receiver, the equivalent of the socket send buffer. */
+static unsigned int dtl_queue_kb = 4096;
+MODULE_PARM_DESC(queue_kb, "Queue size per stream in KiB");
+module_param_named(queue_kb, dtl_queue_kb, uint, 0644);
+
+/* Emulated wire, per stream: each chunk arrives delay_us after it was sent,
+ * and no faster than kbps allows. The queue size above bounds the bytes in
+ * flight, like the socket buffers bound them on a real link. */
+static unsigned int dtl_delay_us[2];
+static unsigned int dtl_kbps[2];
+MODULE_PARM_DESC(data_delay_us, "Added one way latency of the data stream in us");
+module_param_named(data_delay_us, dtl_delay_us[DATA_STREAM], uint, 0644);
+MODULE_PARM_DESC(control_delay_us, "Added one way latency of the control stream in us");
+module_param_named(control_delay_us, dtl_delay_us[CONTROL_STREAM], uint, 0644);
+MODULE_PARM_DESC(data_kbps, "Throughput limit of the data stream in KiB/s (0: none)");
+module_param_named(data_kbps, dtl_kbps[DATA_STREAM], uint, 0644);
+MODULE_PARM_DESC(control_kbps, "Throughput limit of the control stream in KiB/s (0: none)");
+module_param_named(control_kbps, dtl_kbps[CONTROL_STREAM], uint, 0644);
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+/* One send_page() call, holding a reference on the page */
+struct dtl_chunk {
+	struct list_head list;
+	struct page *page;
+	unsigned int offset;
+	unsigned int size;	/* not yet received */
+	ktime_t queued_kt;
+	ktime_t due_kt;		/* may not be received before */
+};
+
+/* One direction of one stream; sent to by one side, received by the other */
+struct dtl_queue {
+	spinlock_t lock;
+	struct list_head chunks;
+	unsigned int queued;		/* bytes not yet received */
+	wait_queue_head_t recv_wait;	/* the receiver, for data */
+	wait_queue_head_t send_wait;	/* the sender, for space */
+	u64 next_ns;			/* the wire is busy until, for kbps */
+
+	/* receiver only */
+	u64 bytes;
+	u64 nr_chunks;
+	u64 queue_ns;			/* time chunks spent queued */
+};
+
+/* Shared by the two connected transports; gone when both let go */
+struct dtl_pair {
+	struct kref kref;
+	bool broken;			/* one side is gone */
+	struct dtl_queue q[2][2];	/* [receiving side][stream] */
+};
+
+struct drbd_loop_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	struct dtl_pair *pair;
+	int side;			/* 0 or 1, index into pair->q */
+	struct buffer rbuf[2];
+	long rcvtimeo[2];
+	long sndtimeo;
+
+	/* while in dtl_connect() */
+	struct list_head connecting;
+	struct drbd_path *connect_path;
+	wait_queue_head_t connect_wait;
+};
+
+struct dtl_path {
+	struct drbd_path path;
+};
+
+/* Not used, there is nothing to listen on */
+struct dtl_listener {
+	struct drbd_listener listener;
+};
+
+static LIST_HEAD(dtl_connecting);
+static DEFINE_MUTEX(dtl_connecting_mutex);
+static struct kmem_cache *dtl_chunk_cache;
+
+static int dtl_init(struct drbd_transport *transport);
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtl_connect(struct drbd_transport *transport);
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtl_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtl_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtl_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class loop_transport_class = {
+	.name = "loop",
+	.instance_size = sizeof(struct drbd_loop_transport),
+	.path_instance_size = sizeof(struct dtl_path),
+	.listener_instance_size = sizeof(struct dtl_listener),
+	.module = THIS_MODULE,
+	.init = dtl_init,
+	.list = LIST_HEAD_INIT(loop_transport_class.list),
+};
+
+static struct drbd_transport_ops dtl_ops = {
+	.free = dtl_free,
+	.connect = dtl_connect,
+	.recv = dtl_recv,
+	.recv_pages = dtl_recv_pages,
+	.stats = dtl_stats,
+	.set_rcvtimeo = dtl_set_rcvtimeo,
+	.get_rcvtimeo = dtl_get_rcvtimeo,
+	.send_page = dtl_send_page,
+	.send_zc_bio = dtl_send_zc_bio,
+	.stream_ok = dtl_stream_ok,
+	.hint = dtl_hint,
+	.debugfs_show = dtl_debugfs_show,
+	.add_path = dtl_add_path,
+	.remove_path = dtl_remove_path,
+};
+
+static int dtl_init(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	enum drbd_stream i;
+
+	spin_lock_init(&loop_transport->paths_lock);
+	INIT_LIST_HEAD(&loop_transport->connecting);
+	init_waitqueue_head(&loop_transport->connect_wait);
+	loop_transport->transport.ops = &dtl_ops;
+	loop_transport->transport.class = &loop_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		loop_transport->rbuf[i].base = buffer;
+		loop_transport->rbuf[i].pos = buffer;
+		loop_transport->rcvtimeo[i] = MAX_SCHEDULE_TIMEOUT;
+	}
+	loop_transport->sndtimeo = MAX_SCHEDULE_TIMEOUT;
+
+	return 0;
+fail:
+	free_page((unsigned long)loop_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static void dtl_flush_queue(struct dtl_queue *q)
+{
+	struct dtl_chunk *chunk, *tmp;
+	LIST_HEAD(chunks);
+
+	spin_lock(&q->lock);
+	list_splice_init(&q->chunks, &chunks);
+	q->queued = 0;
+	spin_unlock(&q->lock);
+	wake_up(&q->send_wait);
+
+	list_for_each_entry_safe(chunk, tmp, &chunks, list) {
+		put_page(chunk->page);
+		kmem_cache_free(dtl_chunk_cache, chunk);
+	}
+}
+
+static struct dtl_pair *dtl_pair_create(void)
+{
+	struct dtl_pair *pair;
+	int side, stream;
+
+	pair = kzalloc(sizeof(*pair), GFP_KERNEL);
+	if (!pair)
+		return NULL;
+
+	kref_init(&pair->kref);
+	kref_get(&pair->kref); /* one for each side */
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_queue *q = &pair->q[side][stream];
+
+			spin_lock_init(&q->lock);
+			INIT_LIST_HEAD(&q->chunks);
+			init_waitqueue_head(&q->recv_wait);
+			init_waitqueue_head(&q->send_wait);
+		}
+	}
+	return pair;
+}
+
+static void dtl_pair_destroy(struct kref *kref)
+{
+	struct dtl_pair *pair = container_of(kref, struct dtl_pair, kref);
+	int side, stream;
+
+	for (side = 0; side < 2; side++)
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++)
+			dtl_flush_queue(&pair->q[side][stream]);
+	kfree(pair);
+}
+
+/* Tell the other side, wake everyone waiting on the pair */
+static void dtl_pair_break(struct dtl_pair *pair)
+{
+	int side, stream;
+
+	WRITE_ONCE(pair->broken, true);
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_queue *q = &pair->q[side][stream];
+
+			/* senders and receivers check broken under the lock */
+			spin_lock(&q->lock);
+			spin_unlock(&q->lock);
+			wake_up(&q->recv_wait);
+			wake_up(&q->send_wait);
+		}
+	}
+}
+
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair = loop_transport->pair;
+	struct drbd_path *drbd_path;
+	enum drbd_stream i;
+
+	if (pair) {
+		WRITE_ONCE(loop_transport->pair, NULL);
+		synchronize_rcu(); /* dtl_stats(), dtl_debugfs_show() */
+		dtl_pair_break(pair);
+		/* what was sent to us will not be received anymore */
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++)
+			dtl_flush_queue(&pair->q[loop_transport->side][i]);
+		kref_put(&pair->kref, dtl_pair_destroy);
+	}
+
+	spin_lock(&loop_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		bool was_established = drbd_path->established;
+		drbd_path->established = false;
+		if (was_established)
+			drbd_path_event(transport, drbd_path);
+	}
+	spin_unlock(&loop_transport->paths_lock);
+
+	if (free_op == DESTROY_TRANSPORT) {
+		struct drbd_path *tmp;
+
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)loop_transport->rbuf[i].base);
+			loop_transport->rbuf[i].base = NULL;
+		}
+		spin_lock(&loop_transport->paths_lock);
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+		spin_unlock(&loop_transport->paths_lock);
+	}
+}
+
+static bool dtl_addr_equal(const struct sockaddr_storage *a, int a_len,
+			   const struct sockaddr_storage *b, int b_len)
+{
+	return a_len == b_len && !memcmp(a, b, a_len);
+}
+
+/* Are we what the other is waiting for, and the other way round? */
+static bool dtl_paths_match(struct drbd_path *a, struct drbd_path *b)
+{
+	return dtl_addr_equal(&a->my_addr, a->my_addr_len, &b->peer_addr, b->peer_addr_len) &&
+		dtl_addr_equal(&a->peer_addr, a->peer_addr_len, &b->my_addr, b->my_addr_len);
+}
+
+static int dtl_connect(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct drbd_loop_transport *other = NULL, *o;
+	struct drbd_path *drbd_path;
+	struct dtl_pair *pair;
+	struct net_conf *nc;
+	unsigned long deadline;
+	int connect_int;
+
+	spin_lock(&loop_transport->paths_lock);
+	drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	if (drbd_path)
+		kref_get(&drbd_path->kref);
+	spin_unlock(&loop_transport->paths_lock);
+	if (!drbd_path)
+		return -EDESTADDRREQ;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	connect_int = nc->connect_int;
+	loop_transport->sndtimeo = nc->timeout * HZ / 10;
+	rcu_read_unlock();
+
+	pair = dtl_pair_create();
+	if (!pair) {
+		kref_put(&drbd_path->kref, drbd_destroy_path);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&dtl_connecting_mutex);
+	list_for_each_entry(o, &dtl_connecting, connecting) {
+		if (dtl_paths_match(o->connect_path, drbd_path)) {
+			other = o;
+			break;
+		}
+	}
+	if (other) {
+		list_del_init(&other->connecting);
+		other->side = 0;
+		loop_transport->side = 1;
+		/* exactly one side of a connection resolves conflicts */
+		clear_bit(RESOLVE_CONFLICTS, &other->transport.flags);
+		set_bit(RESOLVE_CONFLICTS, &transport->flags);
+		loop_transport->pair = pair;
+		WRITE_ONCE(other->pair, pair);
+		wake_up(&other->connect_wait);
+		pair = NULL;
+	} else {
+		loop_transport->connect_path = drbd_path;
+		list_add_tail(&loop_transport->connecting, &dtl_connecting);
+	}
+	mutex_unlock(&dtl_connecting_mutex);
+
+	if (!other) {
+		/* the one connecting to us brings the pair */
+		kfree(pair);
+		deadline = jiffies + connect_int * HZ;
+		while (!READ_ONCE(loop_transport->pair) &&
+		       time_before(jiffies, deadline) &&
+		       !drbd_should_abort_listening(transport))
+			wait_event_interruptible_timeout(loop_transport->connect_wait,
+							 READ_ONCE(loop_transport->pair), HZ / 10);
+
+		mutex_lock(&dtl_connecting_mutex);
+		list_del_init(&loop_transport->connecting);
+		loop_transport->connect_path = NULL;
+		mutex_unlock(&dtl_connecting_mutex);
+
+		if (!loop_transport->pair) {
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+			return -EAGAIN;
+		}
+	}
+
+	drbd_path->established = true;
+	drbd_path_event(transport, drbd_path);
+	kref_put(&drbd_path->kref, drbd_destroy_path);
+
+	return 0;
+}
+
+static int dtl_recv_stream(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+			   void *buf, size_t size, int flags)
+{
+	struct dtl_pair *pair = loop_transport->pair;
+	struct dtl_queue *q;
+	size_t copied = 0;
+
+	if (!pair)
+		return -ENOTCONN;
+	q = &pair->q[loop_transport->side][stream];
+
+	while (copied < size) {
+		struct dtl_chunk *chunk;
+		unsigned int len;
+		bool done;
+		void *src;
+
+		spin_lock(&q->lock);
+		chunk = list_first_entry_or_null(&q->chunks, struct dtl_chunk, list);
+		if (chunk && !READ_ONCE(pair->broken) && ktime_after(chunk->due_kt, ktime_get())) {
+			ktime_t wait = ktime_sub(chunk->due_kt, ktime_get());
+			long timeout = loop_transport->rcvtimeo[stream];
+			bool timed_out = false;
+			long t;
+
+			spin_unlock(&q->lock);
+			if (copied || (flags & MSG_DONTWAIT))
+				return copied ?: -EAGAIN;
+
+			if (timeout != MAX_SCHEDULE_TIMEOUT &&
+			    ktime_to_ns(wait) > jiffies_to_nsecs(timeout)) {
+				wait = ns_to_ktime(jiffies_to_nsecs(timeout));
+				timed_out = true;
+			}
+			/* still on the wire */
+			t = wait_event_interruptible_hrtimeout(q->recv_wait,
+					READ_ONCE(pair->broken), wait);
+			if (t == -ERESTARTSYS)
+				return timeout == MAX_SCHEDULE_TIMEOUT ? -ERESTARTSYS : -EINTR;
+			if (t == -ETIME && timed_out)
+				return -EAGAIN;
+			continue;
+		}
+		if (!chunk) {
+			bool broken = READ_ONCE(pair->broken);
+			long timeout = loop_transport->rcvtimeo[stream];
+			long t;
+
+			spin_unlock(&q->lock);
+			if (broken || copied || (flags & MSG_DONTWAIT))
+				return copied ?: (broken ? 0 : -EAGAIN);
+
+			t = wait_event_interruptible_timeout(q->recv_wait,
+					!list_empty_careful(&q->chunks) || READ_ONCE(pair->broken),
+					timeout);
+			if (t == 0)
+				return -EAGAIN;
+			if (t < 0)
+				/* like sock_intr_errno() */
+				return timeout == MAX_SCHEDULE_TIMEOUT ? -ERESTARTSYS : -EINTR;
+			continue;
+		}
+		spin_unlock(&q->lock);
+
+		/* only we take chunks off this queue, the sender only appends */
+		len = min_t(size_t, chunk->size, size - copied);
+		src = kmap_atomic(chunk->page);
+		memcpy(buf + copied, src + chunk->offset, len);
+		kunmap_atomic(src);
+		chunk->offset += len;
+		chunk->size -= len;
+		copied += len;
+		q->bytes += len;
+
+		spin_lock(&q->lock);
+		q->queued -= len;
+		done = chunk->size == 0;
+		if (done)
+			list_del(&chunk->list);
+		spin_unlock(&q->lock);
+		wake_up(&q->send_wait);
+
+		if (done) {
+			q->nr_chunks++;
+			q->queue_ns += ktime_to_ns(ktime_sub(ktime_get(), chunk->queued_kt));
+			put_page(chunk->page);
+			kmem_cache_free(dtl_chunk_cache, chunk);
+		}
+	}
+
+	return copied;
+}
+
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	void *buffer;
+	int rv;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtl_recv_stream(loop_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == loop_transport->rbuf[stream].base);
+		buffer = loop_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtl_recv_stream(loop_transport, stream, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = loop_transport->rbuf[stream].base;
+
+		rv = dtl_recv_stream(loop_transport, stream, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		loop_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+/* The sender's pages are not ours to keep, the peer request needs pages of
+ * the local pool: copy, once. */
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct page *page;
+	int err;
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(int, size, PAGE_SIZE);
+		void *data = kmap(page);
+		err = dtl_recv_stream(loop_transport, DATA_STREAM, data, len, 0);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err < 0)
+			goto fail;
+		size -= len;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair;
+
+	rcu_read_lock();
+	pair = READ_ONCE(loop_transport->pair);
+	if (pair) {
+		int side = loop_transport->side;
+
+		stats->unread_received = READ_ONCE(pair->q[side][DATA_STREAM].queued);
+		stats->unacked_send = READ_ONCE(pair->q[!side][DATA_STREAM].queued);
+		stats->send_buffer_size = READ_ONCE(dtl_queue_kb) * 1024;
+		stats->send_buffer_used = stats->unacked_send;
+	}
+	rcu_read_unlock();
+}
+
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	loop_transport->rcvtimeo[stream] = timeout;
+}
+
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+
+	return loop_transport->rcvtimeo[stream];
+}
+
+static bool dtl_may_send(struct dtl_queue *q, struct dtl_pair *pair)
+{
+	return READ_ONCE(q->queued) < READ_ONCE(dtl_queue_kb) * 1024 || READ_ONCE(pair->broken);
+}
+
+/* When a chunk sent now arrives at the other side. Called with q->lock */
+static ktime_t dtl_chunk_due(struct dtl_queue *q, enum drbd_stream stream, size_t size, ktime_t now)
+{
+	const unsigned int kbps = READ_ONCE(dtl_kbps[stream]);
+	u64 due = ktime_to_ns(now);
+
+	if (kbps) {
+		due = max(due, q->next_ns) + div_u64((u64)size * NSEC_PER_SEC, kbps * 1024ULL);
+		q->next_ns = due;
+	}
+	return ns_to_ktime(due + (u64)READ_ONCE(dtl_delay_us[stream]) * NSEC_PER_USEC);
+}
+
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair = loop_transport->pair;
+	struct dtl_chunk *chunk;
+	struct dtl_queue *q;
+
+	if (!pair)
+		return -ENOTCONN;
+	q = &pair->q[!loop_transport->side][stream];
+
+	while (!wait_event_timeout(q->send_wait, dtl_may_send(q, pair), loop_transport->sndtimeo)) {
+		if (drbd_stream_send_timed_out(transport, stream))
+			return -EAGAIN;
+	}
+
+	chunk = kmem_cache_alloc(dtl_chunk_cache, GFP_NOIO);
+	if (!chunk)
+		return -ENOMEM;
+	get_page(page);
+	chunk->page = page;
+	chunk->offset = offset;
+	chunk->size = size;
+	chunk->queued_kt = ktime_get();
+
+	spin_lock(&q->lock);
+	if (READ_ONCE(pair->broken)) {
+		spin_unlock(&q->lock);
+		put_page(page);
+		kmem_cache_free(dtl_chunk_cache, chunk);
+		return -ECONNRESET;
+	}
+	chunk->due_kt = dtl_chunk_due(q, stream, size, chunk->queued_kt);
+	list_add_tail(&chunk->list, &q->chunks);
+	q->queued += size;
+	spin_unlock(&q->lock);
+	wake_up(&q->recv_wait);
+
+	return 0;
+}
+
+static int dtl_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dtl_send_page(transport, DATA_STREAM, bvec.bv_page,
+				    bvec.bv_offset, bvec.bv_len,
+				    bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+		if (err)
+			return err;
+
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	return 0;
+}
+
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair = loop_transport->pair;
+
+	return pair && !READ_ONCE(pair->broken);
+}
+
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	/* nothing to cork, nothing to delay */
+	return true;
+}
+
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_pair *pair;
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	rcu_read_lock();
+	pair = READ_ONCE(loop_transport->pair);
+	if (!pair) {
+		rcu_read_unlock();
+		return;
+	}
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+		struct dtl_queue *rq = &pair->q[loop_transport->side][i];
+		struct dtl_queue *sq = &pair->q[!loop_transport->side][i];
+		u64 nr = READ_ONCE(rq->nr_chunks);
+
+		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+		seq_printf(m, "  unread: %u Byte\n", READ_ONCE(rq->queued));
+		seq_printf(m, "  unsent: %u Byte\n", READ_ONCE(sq->queued));
+		seq_printf(m, "  received: %llu Byte in %llu chunks\n",
+			   (unsigned long long)READ_ONCE(rq->bytes), (unsigned long long)nr);
+		seq_printf(m, "  avg queued: %llu ns\n",
+			   (unsigned long long)(nr ? div64_u64(READ_ONCE(rq->queue_ns), nr) : 0));
+		if (READ_ONCE(dtl_delay_us[i]) || READ_ONCE(dtl_kbps[i]))
+			seq_printf(m, "  shaped: %u us, %u KiB/s\n",
+				   READ_ONCE(dtl_delay_us[i]), READ_ONCE(dtl_kbps[i]));
+	}
+	rcu_read_unlock();
+}
+
+static int dtl_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	drbd_path->established = false;
+	spin_lock(&loop_transport->paths_lock);
+	list_add(&drbd_path->list, &transport->paths);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int dtl_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (drbd_path->established)
+		return -EBUSY;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int __init dtl_initialize(void)
+{
+	int err;
+
+	dtl_chunk_cache = kmem_cache_create("drbd_loop_chunk", sizeof(struct dtl_chunk),
+					    0, 0, NULL);
+	if (!dtl_chunk_cache)
+		return -ENOMEM;
+
+	err = drbd_register_transport_class(&loop_transport_class,
+					    DRBD_TRANSPORT_API_VERSION,
+					    sizeof(struct drbd_transport));
+	if (err)
+		kmem_cache_destroy(dtl_chunk_cache);
+	return err;
+}
+
+static void __exit dtl_cleanup(void)
+{
+	drbd_unregister_transport_class(&loop_transport_class);
+	kmem_cache_destroy(dtl_chunk_cache);
+}
+
+module_init(dtl_initialize)
+module_exit(dtl_cleanup)
@@ -0,0 +1,1468 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_transport_rdma.c
+
+   This file is part of DRBD.
+
+   RDMA (InfiniBand, RoCE, iWARP) transport layer for DRBD.
+
+   Each stream is one reliable connected queue pair, set up through the
+   rdma connection manager; the first path of the connection is used.
+   Messages are SENDs into receive buffers the peer posted in advance, the
+   sender's pages are handed to the HCA without copying. On the receiving
+   side the buffers form a byte stream, the same as a socket would.
+
+   Flow control is credit based: a sender only SENDs if the peer has a
+   receive buffer posted for it. Buffers reposted by the receiver are
+   returned as credits in the immediate data of the next message going the
+   other way, or in a message of its own if there is no traffic.
+
+   Of the two nodes of a connection, the one with the "bigger" address
+   initiates both queue pairs, the other one listens.
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/sched/signal.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include <rdma/ib_verbs.h>
+#include <rdma/rdma_cm.h>
+#include <drbd_protocol.h>
+#include <drbd_transport.h>
+#include "drbd_wrappers.h"
+
+
+MODULE_DESCRIPTION("RDMA transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+/* Receive buffers posted per stream, that many messages the peer may have
+ * in flight towards us */
+static unsigned int dtr_rx_descs = 256;
+MODULE_PARM_DESC(rx_descs, "Receive buffers per stream");
+module_param_named(rx_descs, dtr_rx_descs, uint, 0444);
+
+/* Send work requests per stream in flight at once */
+static unsigned int dtr_tx_descs = 256;
+MODULE_PARM_DESC(tx_descs, "Send queue depth per stream");
+module_param_named(tx_descs, dtr_tx_descs, uint, 0444);
+
+/* A header and a full data page fit into one receive buffer, so the
+ * common message is one SEND */
+#define DTR_RX_ORDER		1
+#define DTR_RX_BUF_SIZE		(PAGE_SIZE << DTR_RX_ORDER)
+#define DTR_MAX_SGE		4
+#define DTR_MAGIC		0x44524d41 /* "DRMA" */
+#define DTR_RESOLVE_TIMEOUT_MS	2000
+#define DTR_LISTEN_BACKLOG	16
+
+/* In the private data of connect request and reply */
+struct dtr_cm_private_data {
+	__be32 magic;
+	__be32 stream;
+	__be32 rx_descs;	/* initial credits of the other side */
+} __packed;
+
+enum dtr_cm_ctx_type {
+	DTR_CM_LISTENER,
+	DTR_CM_STREAM,
+};
+
+/* What cm_id->context points to */
+struct dtr_cm_ctx {
+	enum dtr_cm_ctx_type type;
+};
+
+enum dtr_cm_state {
+	DTR_CM_IDLE,
+	DTR_CM_ROUTE_RESOLVED,
+	DTR_CM_CONNECTED,
+	DTR_CM_ERROR,
+	DTR_CM_DISCONNECTED,
+};
+
+struct dtr_rx_desc {
+	struct list_head list;		/* on rx_ready, once received */
+	struct page *page;
+	u64 dma_addr;
+	unsigned int size;		/* received */
+	unsigned int pos;		/* consumed */
+};
+
+struct dtr_tx_desc {
+	unsigned int nr_sge;
+	unsigned int len;
+	struct page *pages[DTR_MAX_SGE];
+	struct ib_sge sge[DTR_MAX_SGE];
+};
+
+struct drbd_rdma_transport;
+
+struct dtr_stream {
+	struct dtr_cm_ctx ctx;
+	struct drbd_rdma_transport *rdma_transport;
+	enum drbd_stream nr;
+
+	struct rdma_cm_id *cm_id;
+	struct ib_pd *pd;
+	struct ib_cq *cq;
+	enum dtr_cm_state cm_state;
+	bool broken;
+	wait_queue_head_t cm_wait;
+
+	/* receive side */
+	struct dtr_rx_desc *rx_descs;
+	unsigned int nr_rx_descs;
+	spinlock_t rx_lock;
+	struct list_head rx_ready;
+	struct dtr_rx_desc *rx_cur;	/* the receiver consumes this one */
+	unsigned int rx_unread;		/* bytes */
+	atomic_t rx_posted;
+	atomic_t credits_to_return;
+	wait_queue_head_t recv_wait;
+	long rcvtimeo;
+
+	/* send side */
+	spinlock_t tx_lock;
+	int peer_credits;
+	int tx_posted;
+	unsigned int tx_unacked;	/* bytes */
+	struct dtr_tx_desc *tx_batch;	/* collects MSG_MORE pieces */
+	wait_queue_head_t send_wait;
+	long sndtimeo;
+
+	/* statistics */
+	u64 rx_msgs, rx_bytes, tx_msgs, tx_bytes, credit_msgs;
+	u64 credit_waits;
+};
+
+struct drbd_rdma_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	struct dtr_stream stream[2];
+	struct buffer {
+		void *base;
+		void *pos;
+	} rbuf[2];
+	bool active;
+};
+
+/* A connect request that came in on a listener, not yet accepted */
+struct dtr_accept {
+	struct list_head list;
+	struct rdma_cm_id *cm_id;
+	enum drbd_stream stream;
+	unsigned int peer_rx_descs;
+};
+
+struct dtr_path {
+	struct drbd_path path;
+	struct list_head accepts;	/* protected by listener->waiters_lock */
+};
+
+struct dtr_listener {
+	struct drbd_listener listener;
+	struct dtr_cm_ctx ctx;
+	struct rdma_cm_id *cm_id;
+	wait_queue_head_t wait;		/* woken if a connect request came in */
+};
+
+static struct kmem_cache *dtr_tx_desc_cache;
+
+static int dtr_init(struct drbd_transport *transport);
+static void dtr_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtr_connect(struct drbd_transport *transport);
+static int dtr_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtr_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtr_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtr_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtr_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtr_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtr_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtr_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtr_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtr_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtr_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtr_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class rdma_transport_class = {
+	.name = "rdma",
+	.instance_size = sizeof(struct drbd_rdma_transport),
+	.path_instance_size = sizeof(struct dtr_path),
+	.listener_instance_size = sizeof(struct dtr_listener),
+	.module = THIS_MODULE,
+	.init = dtr_init,
+	.list = LIST_HEAD_INIT(rdma_transport_class.list),
+};
+
+static struct drbd_transport_ops dtr_ops = {
+	.free = dtr_free,
+	.connect = dtr_connect,
+	.recv = dtr_recv,
+	.recv_pages = dtr_recv_pages,
+	.stats = dtr_stats,
+	.set_rcvtimeo = dtr_set_rcvtimeo,
+	.get_rcvtimeo = dtr_get_rcvtimeo,
+	.send_page = dtr_send_page,
+	.send_zc_bio = dtr_send_zc_bio,
+	.stream_ok = dtr_stream_ok,
+	.hint = dtr_hint,
+	.debugfs_show = dtr_debugfs_show,
+	.add_path = dtr_add_path,
+	.remove_path = dtr_remove_path,
+};
+
+static int dtr_init(struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	enum drbd_stream i;
+
+	spin_lock_init(&rdma_transport->paths_lock);
+	rdma_transport->transport.ops = &dtr_ops;
+	rdma_transport->transport.class = &rdma_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		struct dtr_stream *stream = &rdma_transport->stream[i];
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		rdma_transport->rbuf[i].base = buffer;
+		rdma_transport->rbuf[i].pos = buffer;
+
+		stream->ctx.type = DTR_CM_STREAM;
+		stream->rdma_transport = rdma_transport;
+		stream->nr = i;
+		spin_lock_init(&stream->rx_lock);
+		spin_lock_init(&stream->tx_lock);
+		INIT_LIST_HEAD(&stream->rx_ready);
+		init_waitqueue_head(&stream->cm_wait);
+		init_waitqueue_head(&stream->recv_wait);
+		init_waitqueue_head(&stream->send_wait);
+		stream->rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+		stream->sndtimeo = MAX_SCHEDULE_TIMEOUT;
+	}
+
+	return 0;
+fail:
+	free_page((unsigned long)rdma_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static void dtr_stream_break(struct dtr_stream *stream)
+{
+	unsigned long flags;
+
+	/* senders and receivers check broken under their lock */
+	spin_lock_irqsave(&stream->rx_lock, flags);
+	WRITE_ONCE(stream->broken, true);
+	spin_unlock_irqrestore(&stream->rx_lock, flags);
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+	wake_up(&stream->recv_wait);
+	wake_up(&stream->send_wait);
+	wake_up(&stream->cm_wait);
+}
+
+/* Also used for the flushed work requests of a queue pair in error state */
+static void dtr_free_tx_desc(struct dtr_stream *stream, struct dtr_tx_desc *tx_desc)
+{
+	struct ib_device *device = stream->cm_id->device;
+	unsigned int i;
+
+	for (i = 0; i < tx_desc->nr_sge; i++) {
+		ib_dma_unmap_page(device, tx_desc->sge[i].addr, tx_desc->sge[i].length,
+				  DMA_TO_DEVICE);
+		put_page(tx_desc->pages[i]);
+	}
+	kmem_cache_free(dtr_tx_desc_cache, tx_desc);
+}
+
+static int dtr_post_rx_desc(struct dtr_stream *stream, struct dtr_rx_desc *rx_desc)
+{
+	struct ib_sge sge = {
+		.addr = rx_desc->dma_addr,
+		.length = DTR_RX_BUF_SIZE,
+		.lkey = stream->pd->local_dma_lkey,
+	};
+	struct ib_recv_wr wr = {
+		.wr_id = (unsigned long)rx_desc,
+		.sg_list = &sge,
+		.num_sge = 1,
+	};
+	const struct ib_recv_wr *bad_wr;
+	int err;
+
+	ib_dma_sync_single_for_device(stream->cm_id->device, rx_desc->dma_addr,
+				      DTR_RX_BUF_SIZE, DMA_FROM_DEVICE);
+	atomic_inc(&stream->rx_posted);
+	err = ib_post_recv(stream->cm_id->qp, &wr, &bad_wr);
+	if (err) {
+		atomic_dec(&stream->rx_posted);
+		dtr_stream_break(stream);
+	}
+	return err;
+}
+
+static void dtr_handle_rx(struct dtr_stream *stream, struct ib_wc *wc)
+{
+	struct dtr_rx_desc *rx_desc = (struct dtr_rx_desc *)(unsigned long)wc->wr_id;
+	unsigned long flags;
+
+	atomic_dec(&stream->rx_posted);
+	if (wc->status != IB_WC_SUCCESS) {
+		/* flushed, when the queue pair went into error state */
+		dtr_stream_break(stream);
+		return;
+	}
+
+	if (wc->wc_flags & IB_WC_WITH_IMM) {
+		unsigned int credits = be32_to_cpu(wc->ex.imm_data);
+
+		if (credits) {
+			spin_lock_irqsave(&stream->tx_lock, flags);
+			stream->peer_credits += credits;
+			spin_unlock_irqrestore(&stream->tx_lock, flags);
+			wake_up(&stream->send_wait);
+		}
+	}
+
+	if (wc->byte_len == 0) {
+		/* credits only, the buffer is ours again right away */
+		if (!dtr_post_rx_desc(stream, rx_desc))
+			atomic_inc(&stream->credits_to_return);
+		return;
+	}
+
+	ib_dma_sync_single_for_cpu(stream->cm_id->device, rx_desc->dma_addr,
+				   DTR_RX_BUF_SIZE, DMA_FROM_DEVICE);
+	rx_desc->size = wc->byte_len;
+	rx_desc->pos = 0;
+
+	spin_lock_irqsave(&stream->rx_lock, flags);
+	list_add_tail(&rx_desc->list, &stream->rx_ready);
+	stream->rx_unread += wc->byte_len;
+	stream->rx_msgs++;
+	stream->rx_bytes += wc->byte_len;
+	spin_unlock_irqrestore(&stream->rx_lock, flags);
+	wake_up(&stream->recv_wait);
+}
+
+static void dtr_handle_tx(struct dtr_stream *stream, struct ib_wc *wc)
+{
+	struct dtr_tx_desc *tx_desc = (struct dtr_tx_desc *)(unsigned long)wc->wr_id;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	stream->tx_posted--;
+	stream->tx_unacked -= tx_desc->len;
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+
+	if (wc->status != IB_WC_SUCCESS)
+		dtr_stream_break(stream);
+
+	dtr_free_tx_desc(stream, tx_desc);
+	wake_up(&stream->send_wait);
+}
+
+static void dtr_cq_handler(struct ib_cq *cq, void *ctx)
+{
+	struct dtr_stream *stream = ctx;
+	struct ib_wc wc;
+
+	do {
+		while (ib_poll_cq(cq, 1, &wc) == 1) {
+			if (wc.opcode & IB_WC_RECV)
+				dtr_handle_rx(stream, &wc);
+			else
+				dtr_handle_tx(stream, &wc);
+		}
+	} while (ib_req_notify_cq(cq, IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS) > 0);
+}
+
+static void dtr_cq_event_handler(struct ib_event *event, void *ctx)
+{
+	struct dtr_stream *stream = ctx;
+
+	tr_err(&stream->rdma_transport->transport, "completion queue event %d\n", event->event);
+	dtr_stream_break(stream);
+}
+
+static void dtr_qp_event_handler(struct ib_event *event, void *ctx)
+{
+	struct dtr_stream *stream = ctx;
+
+	switch (event->event) {
+	case IB_EVENT_COMM_EST:
+	case IB_EVENT_SQ_DRAINED:
+	case IB_EVENT_QP_LAST_WQE_REACHED:
+		break;
+	default:
+		tr_err(&stream->rdma_transport->transport, "queue pair event %d\n", event->event);
+		dtr_stream_break(stream);
+	}
+}
+
+/* Protection domain, completion queue, queue pair and receive buffers */
+static int dtr_stream_create_qp(struct dtr_stream *stream)
+{
+	struct rdma_cm_id *cm_id = stream->cm_id;
+	struct ib_device *device = cm_id->device;
+	struct ib_cq_init_attr cq_attr = {};
+	struct ib_qp_init_attr qp_attr = {};
+	unsigned int i;
+	int err;
+
+	stream->pd = ib_alloc_pd(device, 0);
+	if (IS_ERR(stream->pd)) {
+		err = PTR_ERR(stream->pd);
+		stream->pd = NULL;
+		return err;
+	}
+
+	cq_attr.cqe = dtr_rx_descs + dtr_tx_descs;
+	stream->cq = ib_create_cq(device, dtr_cq_handler, dtr_cq_event_handler, stream, &cq_attr);
+	if (IS_ERR(stream->cq)) {
+		err = PTR_ERR(stream->cq);
+		stream->cq = NULL;
+		return err;
+	}
+
+	qp_attr.event_handler = dtr_qp_event_handler;
+	qp_attr.qp_context = stream;
+	qp_attr.send_cq = stream->cq;
+	qp_attr.recv_cq = stream->cq;
+	qp_attr.cap.max_send_wr = dtr_tx_descs;
+	qp_attr.cap.max_recv_wr = dtr_rx_descs;
+	qp_attr.cap.max_send_sge = DTR_MAX_SGE;
+	qp_attr.cap.max_recv_sge = 1;
+	qp_attr.sq_sig_type = IB_SIGNAL_ALL_WR;
+	qp_attr.qp_type = IB_QPT_RC;
+	err = rdma_create_qp(cm_id, stream->pd, &qp_attr);
+	if (err)
+		return err;
+
+	stream->rx_descs = kcalloc(dtr_rx_descs, sizeof(*stream->rx_descs), GFP_KERNEL);
+	if (!stream->rx_descs)
+		return -ENOMEM;
+	for (i = 0; i < dtr_rx_descs; i++) {
+		struct dtr_rx_desc *rx_desc = &stream->rx_descs[i];
+
+		rx_desc->page = alloc_pages(GFP_KERNEL, DTR_RX_ORDER);
+		if (!rx_desc->page)
+			return -ENOMEM;
+		rx_desc->dma_addr = ib_dma_map_page(device, rx_desc->page, 0,
+						    DTR_RX_BUF_SIZE, DMA_FROM_DEVICE);
+		if (ib_dma_mapping_error(device, rx_desc->dma_addr)) {
+			__free_pages(rx_desc->page, DTR_RX_ORDER);
+			rx_desc->page = NULL;
+			return -ENOMEM;
+		}
+		stream->nr_rx_descs++;
+	}
+
+	ib_req_notify_cq(stream->cq, IB_CQ_NEXT_COMP);
+	for (i = 0; i < stream->nr_rx_descs; i++) {
+		err = dtr_post_rx_desc(stream, &stream->rx_descs[i]);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/* Everything posted completes, flushed, once the queue pair is in error state */
+static bool dtr_stream_drained(struct dtr_stream *stream)
+{
+	unsigned long flags;
+	bool drained;
+
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	drained = stream->tx_posted == 0;
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+
+	return drained && atomic_read(&stream->rx_posted) == 0;
+}
+
+static void dtr_stream_destroy(struct dtr_stream *stream)
+{
+	struct drbd_transport *transport = &stream->rdma_transport->transport;
+	struct rdma_cm_id *cm_id = stream->cm_id;
+	unsigned int i;
+
+	if (!cm_id)
+		return;
+
+	dtr_stream_break(stream);
+	if (cm_id->qp) {
+		struct ib_qp_attr attr = { .qp_state = IB_QPS_ERR };
+
+		rdma_disconnect(cm_id);
+		ib_modify_qp(cm_id->qp, &attr, IB_QP_STATE);
+		if (!wait_event_timeout(stream->send_wait, dtr_stream_drained(stream), 10 * HZ))
+			tr_warn(transport, "%s stream: work requests not flushed\n",
+				stream->nr == DATA_STREAM ? "data" : "control");
+		rdma_destroy_qp(cm_id);
+	}
+	if (stream->tx_batch) {
+		dtr_free_tx_desc(stream, stream->tx_batch);
+		stream->tx_batch = NULL;
+	}
+	if (stream->cq) {
+		ib_destroy_cq(stream->cq);
+		stream->cq = NULL;
+	}
+	for (i = 0; i < stream->nr_rx_descs; i++) {
+		struct dtr_rx_desc *rx_desc = &stream->rx_descs[i];
+
+		ib_dma_unmap_page(cm_id->device, rx_desc->dma_addr, DTR_RX_BUF_SIZE,
+				  DMA_FROM_DEVICE);
+		__free_pages(rx_desc->page, DTR_RX_ORDER);
+	}
+	kfree(stream->rx_descs);
+	stream->rx_descs = NULL;
+	stream->nr_rx_descs = 0;
+	if (stream->pd) {
+		ib_dealloc_pd(stream->pd);
+		stream->pd = NULL;
+	}
+
+	stream->cm_id = NULL;
+	rdma_destroy_id(cm_id);
+
+	INIT_LIST_HEAD(&stream->rx_ready);
+	stream->rx_cur = NULL;
+	stream->rx_unread = 0;
+	atomic_set(&stream->rx_posted, 0);
+	atomic_set(&stream->credits_to_return, 0);
+	stream->peer_credits = 0;
+	stream->tx_posted = 0;
+	stream->tx_unacked = 0;
+	stream->cm_state = DTR_CM_IDLE;
+	stream->broken = false;
+}
+
+static void dtr_cleanup_accepts(struct dtr_path *path)
+{
+	struct drbd_listener *listener = path->path.listener;
+	struct dtr_accept *accept, *tmp;
+	LIST_HEAD(accepts);
+
+	if (listener) {
+		spin_lock_bh(&listener->waiters_lock);
+		list_splice_init(&path->accepts, &accepts);
+		spin_unlock_bh(&listener->waiters_lock);
+	} else {
+		list_splice_init(&path->accepts, &accepts);
+	}
+
+	list_for_each_entry_safe(accept, tmp, &accepts, list) {
+		list_del(&accept->list);
+		rdma_destroy_id(accept->cm_id);
+		kfree(accept);
+	}
+}
+
+static void dtr_put_listeners(struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct drbd_path *drbd_path;
+
+	spin_lock(&rdma_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+		kref_get(&drbd_path->kref);
+		spin_unlock(&rdma_transport->paths_lock);
+		dtr_cleanup_accepts(path);
+		drbd_put_listener(drbd_path);
+		spin_lock(&rdma_transport->paths_lock);
+		kref_put(&drbd_path->kref, drbd_destroy_path);
+	}
+	spin_unlock(&rdma_transport->paths_lock);
+}
+
+static void dtr_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct drbd_path *drbd_path;
+	enum drbd_stream i;
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++)
+		dtr_stream_destroy(&rdma_transport->stream[i]);
+
+	spin_lock(&rdma_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		bool was_established = drbd_path->established;
+		drbd_path->established = false;
+		if (was_established)
+			drbd_path_event(transport, drbd_path);
+	}
+	spin_unlock(&rdma_transport->paths_lock);
+
+	if (free_op == DESTROY_TRANSPORT) {
+		struct drbd_path *tmp;
+
+		dtr_put_listeners(transport);
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)rdma_transport->rbuf[i].base);
+			rdma_transport->rbuf[i].base = NULL;
+		}
+		spin_lock(&rdma_transport->paths_lock);
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+		spin_unlock(&rdma_transport->paths_lock);
+	}
+}
+
+static bool dtr_private_data_ok(const void *data, u8 len, struct dtr_cm_private_data *pd)
+{
+	if (!data || len < sizeof(*pd))
+		return false;
+	memcpy(pd, data, sizeof(*pd));
+	return be32_to_cpu(pd->magic) == DTR_MAGIC &&
+		be32_to_cpu(pd->stream) <= CONTROL_STREAM &&
+		be32_to_cpu(pd->rx_descs) > 0;
+}
+
+static int dtr_listener_cm_event(struct dtr_listener *listener, struct rdma_cm_id *cm_id,
+				 struct rdma_cm_event *event)
+{
+	struct dtr_cm_private_data pd;
+	struct drbd_path *drbd_path;
+	struct dtr_accept *accept, *a;
+	struct dtr_path *path;
+	enum drbd_stream nr;
+
+	/* Connect requests not yet accepted have the listener's context too */
+	if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST)
+		return 0;
+
+	if (!dtr_private_data_ok(event->param.conn.private_data,
+				 event->param.conn.private_data_len, &pd))
+		return -EPROTO; /* the cm destroys the new id, rejecting the request */
+	nr = be32_to_cpu(pd.stream);
+
+	accept = kmalloc(sizeof(*accept), GFP_KERNEL);
+	if (!accept)
+		return -ENOMEM;
+	accept->cm_id = cm_id;
+	accept->stream = nr;
+	accept->peer_rx_descs = be32_to_cpu(pd.rx_descs);
+
+	spin_lock_bh(&listener->listener.waiters_lock);
+	drbd_path = drbd_find_path_by_addr(&listener->listener,
+					   (struct sockaddr_storage *)&cm_id->route.addr.dst_addr);
+	if (!drbd_path)
+		goto reject;
+	path = container_of(drbd_path, struct dtr_path, path);
+	/* One pending request per stream, the peer retries anyways */
+	list_for_each_entry(a, &path->accepts, list) {
+		if (a->stream == nr)
+			goto reject;
+	}
+	list_add_tail(&accept->list, &path->accepts);
+	spin_unlock_bh(&listener->listener.waiters_lock);
+	wake_up(&listener->wait);
+	return 0;
+
+reject:
+	spin_unlock_bh(&listener->listener.waiters_lock);
+	kfree(accept);
+	return -ECONNREFUSED;
+}
+
+static int dtr_stream_cm_event(struct dtr_stream *stream, struct rdma_cm_id *cm_id,
+			       struct rdma_cm_event *event)
+{
+	struct drbd_transport *transport = &stream->rdma_transport->transport;
+	struct dtr_cm_private_data pd;
+	int err;
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		err = rdma_resolve_route(cm_id, DTR_RESOLVE_TIMEOUT_MS);
+		if (err) {
+			WRITE_ONCE(stream->cm_state, DTR_CM_ERROR);
+			wake_up(&stream->cm_wait);
+		}
+		break;
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		WRITE_ONCE(stream->cm_state, DTR_CM_ROUTE_RESOLVED);
+		wake_up(&stream->cm_wait);
+		break;
+	case RDMA_CM_EVENT_ESTABLISHED:
+		/* The active side learns the credits from the reply */
+		if (stream->rdma_transport->active) {
+			if (!dtr_private_data_ok(event->param.conn.private_data,
+						 event->param.conn.private_data_len, &pd)) {
+				tr_err(transport, "unexpected connect reply\n");
+				WRITE_ONCE(stream->cm_state, DTR_CM_ERROR);
+				wake_up(&stream->cm_wait);
+				break;
+			}
+			stream->peer_credits = be32_to_cpu(pd.rx_descs);
+		}
+		WRITE_ONCE(stream->cm_state, DTR_CM_CONNECTED);
+		wake_up(&stream->cm_wait);
+		break;
+	case RDMA_CM_EVENT_ADDR_ERROR:
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+		WRITE_ONCE(stream->cm_state, DTR_CM_ERROR);
+		wake_up(&stream->cm_wait);
+		break;
+	case RDMA_CM_EVENT_DISCONNECTED:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+		WRITE_ONCE(stream->cm_state, DTR_CM_DISCONNECTED);
+		dtr_stream_break(stream);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int dtr_cm_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event *event)
+{
+	struct dtr_cm_ctx *ctx = cm_id->context;
+
+	if (ctx->type == DTR_CM_LISTENER)
+		return dtr_listener_cm_event(container_of(ctx, struct dtr_listener, ctx),
+					     cm_id, event);
+	return dtr_stream_cm_event(container_of(ctx, struct dtr_stream, ctx), cm_id, event);
+}
+
+static void dtr_destroy_listener(struct drbd_listener *generic_listener)
+{
+	struct dtr_listener *listener =
+		container_of(generic_listener, struct dtr_listener, listener);
+
+	rdma_destroy_id(listener->cm_id);
+	kfree(listener);
+}
+
+static int dtr_init_listener(struct drbd_transport *transport, const struct sockaddr *addr,
+			     struct drbd_listener *drbd_listener)
+{
+	struct dtr_listener *listener = container_of(drbd_listener, struct dtr_listener, listener);
+	struct rdma_cm_id *cm_id;
+	int err;
+
+	listener->ctx.type = DTR_CM_LISTENER;
+	init_waitqueue_head(&listener->wait);
+
+	cm_id = rdma_create_id(&init_net, dtr_cm_event_handler, &listener->ctx,
+			       RDMA_PS_TCP, IB_QPT_RC);
+	if (IS_ERR(cm_id))
+		return PTR_ERR(cm_id);
+
+	err = rdma_bind_addr(cm_id, (struct sockaddr *)addr);
+	if (err) {
+		tr_err(transport, "rdma_bind_addr failed, err = %d\n", err);
+		goto out;
+	}
+
+	err = rdma_listen(cm_id, DTR_LISTEN_BACKLOG);
+	if (err) {
+		tr_err(transport, "rdma_listen failed, err = %d\n", err);
+		goto out;
+	}
+
+	listener->cm_id = cm_id;
+	memcpy(&listener->listener.listen_addr, addr, sizeof(struct sockaddr_storage));
+	listener->listener.destroy = dtr_destroy_listener;
+	return 0;
+out:
+	rdma_destroy_id(cm_id);
+	return err;
+}
+
+static bool dtr_path_cmp_addr(struct drbd_path *drbd_path)
+{
+	int addr_size;
+
+	addr_size = min(drbd_path->my_addr_len, drbd_path->peer_addr_len);
+	return memcmp(&drbd_path->my_addr, &drbd_path->peer_addr, addr_size) > 0;
+}
+
+static struct rdma_conn_param dtr_conn_param(struct dtr_cm_private_data *pd, enum drbd_stream nr)
+{
+	pd->magic = cpu_to_be32(DTR_MAGIC);
+	pd->stream = cpu_to_be32(nr);
+	pd->rx_descs = cpu_to_be32(dtr_rx_descs);
+
+	return (struct rdma_conn_param) {
+		.private_data = pd,
+		.private_data_len = sizeof(*pd),
+		.retry_count = 7,
+		/* credits ensure a posted buffer, we should never see RNR */
+		.rnr_retry_count = 7,
+	};
+}
+
+static int dtr_wait_cm_state(struct dtr_stream *stream, enum dtr_cm_state state, long timeout)
+{
+	long t;
+
+	t = wait_event_interruptible_timeout(stream->cm_wait,
+			READ_ONCE(stream->cm_state) != DTR_CM_IDLE &&
+			READ_ONCE(stream->cm_state) != (state == DTR_CM_CONNECTED ?
+							DTR_CM_ROUTE_RESOLVED : DTR_CM_IDLE),
+			timeout);
+	if (t == 0)
+		return -EAGAIN;
+	if (t < 0)
+		return t;
+	return READ_ONCE(stream->cm_state) == state ? 0 : -ECONNREFUSED;
+}
+
+static int dtr_connect_stream(struct dtr_stream *stream, struct drbd_path *drbd_path, long timeout)
+{
+	struct drbd_transport *transport = &stream->rdma_transport->transport;
+	struct sockaddr_storage my_addr = drbd_path->my_addr;
+	struct dtr_cm_private_data pd;
+	struct rdma_conn_param param;
+	struct rdma_cm_id *cm_id;
+	int err;
+
+	/* any local port */
+	if (my_addr.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&my_addr)->sin6_port = 0;
+	else
+		((struct sockaddr_in *)&my_addr)->sin_port = 0;
+
+	cm_id = rdma_create_id(&init_net, dtr_cm_event_handler, &stream->ctx,
+			       RDMA_PS_TCP, IB_QPT_RC);
+	if (IS_ERR(cm_id))
+		return PTR_ERR(cm_id);
+	stream->cm_id = cm_id;
+	stream->cm_state = DTR_CM_IDLE;
+
+	err = rdma_resolve_addr(cm_id, (struct sockaddr *)&my_addr,
+				(struct sockaddr *)&drbd_path->peer_addr, DTR_RESOLVE_TIMEOUT_MS);
+	if (err) {
+		tr_err(transport, "rdma_resolve_addr failed, err = %d\n", err);
+		return err;
+	}
+	err = dtr_wait_cm_state(stream, DTR_CM_ROUTE_RESOLVED, timeout);
+	if (err)
+		return err;
+
+	err = dtr_stream_create_qp(stream);
+	if (err)
+		return err;
+
+	param = dtr_conn_param(&pd, stream->nr);
+	err = rdma_connect(cm_id, &param);
+	if (err)
+		return err;
+
+	return dtr_wait_cm_state(stream, DTR_CM_CONNECTED, timeout);
+}
+
+static struct dtr_accept *dtr_take_accept(struct dtr_path *path, enum drbd_stream nr)
+{
+	struct drbd_listener *listener = path->path.listener;
+	struct dtr_accept *accept, *found = NULL;
+
+	spin_lock_bh(&listener->waiters_lock);
+	list_for_each_entry(accept, &path->accepts, list) {
+		if (accept->stream == nr) {
+			list_del(&accept->list);
+			found = accept;
+			break;
+		}
+	}
+	spin_unlock_bh(&listener->waiters_lock);
+
+	return found;
+}
+
+static int dtr_accept_stream(struct dtr_stream *stream, struct drbd_path *drbd_path, long timeout)
+{
+	struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+	struct dtr_listener *listener =
+		container_of(drbd_path->listener, struct dtr_listener, listener);
+	struct dtr_cm_private_data pd;
+	struct rdma_conn_param param;
+	struct dtr_accept *accept;
+	long t;
+	int err;
+
+	t = wait_event_interruptible_timeout(listener->wait,
+			(accept = dtr_take_accept(path, stream->nr)), timeout);
+	if (t == 0)
+		return -EAGAIN;
+	if (t < 0)
+		return t;
+
+	stream->cm_id = accept->cm_id;
+	stream->peer_credits = accept->peer_rx_descs;
+	stream->cm_state = DTR_CM_ROUTE_RESOLVED;
+	kfree(accept);
+	/* from now on, events of this id are about the stream */
+	stream->cm_id->context = &stream->ctx;
+
+	err = dtr_stream_create_qp(stream);
+	if (err)
+		return err;
+
+	param = dtr_conn_param(&pd, stream->nr);
+	err = rdma_accept(stream->cm_id, &param);
+	if (err)
+		return err;
+
+	return dtr_wait_cm_state(stream, DTR_CM_CONNECTED, timeout);
+}
+
+static int dtr_connect(struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct drbd_path *drbd_path;
+	struct net_conf *nc;
+	enum drbd_stream i;
+	long timeout;
+	int err;
+
+	spin_lock(&rdma_transport->paths_lock);
+	drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	if (drbd_path)
+		kref_get(&drbd_path->kref);
+	spin_unlock(&rdma_transport->paths_lock);
+	if (!drbd_path)
+		return -EDESTADDRREQ;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	timeout = nc->connect_int * HZ;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++)
+		rdma_transport->stream[i].sndtimeo = nc->timeout * HZ / 10;
+	rcu_read_unlock();
+
+	rdma_transport->active = dtr_path_cmp_addr(drbd_path);
+	if (!rdma_transport->active && !drbd_path->listener) {
+		err = drbd_get_listener(transport, drbd_path, dtr_init_listener);
+		if (err)
+			goto out;
+	}
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+		struct dtr_stream *stream = &rdma_transport->stream[i];
+
+		if (rdma_transport->active)
+			err = dtr_connect_stream(stream, drbd_path, timeout);
+		else
+			err = dtr_accept_stream(stream, drbd_path, timeout);
+		if (err)
+			goto out_streams;
+		if (drbd_should_abort_listening(transport)) {
+			err = -EAGAIN;
+			goto out_streams;
+		}
+	}
+
+	/* like tcp: the side that accepted the control stream */
+	if (rdma_transport->active)
+		clear_bit(RESOLVE_CONFLICTS, &transport->flags);
+	else
+		set_bit(RESOLVE_CONFLICTS, &transport->flags);
+
+	dtr_put_listeners(transport);
+	drbd_path->established = true;
+	drbd_path_event(transport, drbd_path);
+	kref_put(&drbd_path->kref, drbd_destroy_path);
+	return 0;
+
+out_streams:
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++)
+		dtr_stream_destroy(&rdma_transport->stream[i]);
+	if (err != -EAGAIN && err != -ERESTARTSYS && err != -EINTR)
+		tr_warn(transport, "connect failed, err = %d\n", err);
+	/* Peer not there (yet), cannot be resolved, or rejected: try again */
+	err = -EAGAIN;
+out:
+	dtr_put_listeners(transport);
+	kref_put(&drbd_path->kref, drbd_destroy_path);
+	return err;
+}
+
+static bool dtr_may_return_credits(struct dtr_stream *stream)
+{
+	return stream->peer_credits >= 1 && stream->tx_posted < dtr_tx_descs;
+}
+
+/* tx_lock held. Consumes one peer credit, returns ours */
+static int dtr_post_send_locked(struct dtr_stream *stream, struct dtr_tx_desc *tx_desc)
+{
+	struct ib_send_wr wr = {
+		.wr_id = (unsigned long)tx_desc,
+		.sg_list = tx_desc->sge,
+		.num_sge = tx_desc->nr_sge,
+		.opcode = IB_WR_SEND_WITH_IMM,
+		.send_flags = IB_SEND_SIGNALED,
+	};
+	const struct ib_send_wr *bad_wr;
+	int credits = atomic_xchg(&stream->credits_to_return, 0);
+	int err;
+
+	wr.ex.imm_data = cpu_to_be32(credits);
+	err = ib_post_send(stream->cm_id->qp, &wr, &bad_wr);
+	if (err) {
+		atomic_add(credits, &stream->credits_to_return);
+		return err;
+	}
+	stream->peer_credits--;
+	stream->tx_posted++;
+	stream->tx_unacked += tx_desc->len;
+	stream->tx_msgs++;
+	stream->tx_bytes += tx_desc->len;
+	return 0;
+}
+
+/* After reposting receive buffers: without traffic the other way, tell the
+ * peer about them once half of them are waiting to be returned */
+static void dtr_maybe_return_credits(struct dtr_stream *stream)
+{
+	struct dtr_tx_desc *tx_desc;
+	unsigned long flags;
+
+	if (atomic_read(&stream->credits_to_return) < stream->nr_rx_descs / 2)
+		return;
+
+	tx_desc = kmem_cache_zalloc(dtr_tx_desc_cache, GFP_NOIO);
+	if (!tx_desc)
+		return;
+
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	if (!stream->broken && dtr_may_return_credits(stream) &&
+	    atomic_read(&stream->credits_to_return) >= stream->nr_rx_descs / 2 &&
+	    !dtr_post_send_locked(stream, tx_desc)) {
+		stream->credit_msgs++;
+		tx_desc = NULL;
+	}
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+
+	if (tx_desc)
+		kmem_cache_free(dtr_tx_desc_cache, tx_desc);
+}
+
+/* The receiver is done with an rx buffer */
+static void dtr_rx_desc_consumed(struct dtr_stream *stream, struct dtr_rx_desc *rx_desc)
+{
+	if (!dtr_post_rx_desc(stream, rx_desc)) {
+		atomic_inc(&stream->credits_to_return);
+		dtr_maybe_return_credits(stream);
+	}
+}
+
+static int dtr_recv_stream(struct dtr_stream *stream, void *buf, size_t size, int flags)
+{
+	size_t copied = 0;
+
+	if (!stream->cm_id)
+		return -ENOTCONN;
+
+	while (copied < size) {
+		struct dtr_rx_desc *rx_desc = stream->rx_cur;
+		unsigned long irq_flags;
+		unsigned int len;
+
+		if (!rx_desc) {
+			spin_lock_irqsave(&stream->rx_lock, irq_flags);
+			rx_desc = list_first_entry_or_null(&stream->rx_ready,
+							   struct dtr_rx_desc, list);
+			if (rx_desc)
+				list_del(&rx_desc->list);
+			spin_unlock_irqrestore(&stream->rx_lock, irq_flags);
+		}
+		if (!rx_desc) {
+			bool broken = READ_ONCE(stream->broken);
+			long timeout = stream->rcvtimeo;
+			long t;
+
+			if (broken || copied || (flags & MSG_DONTWAIT))
+				return copied ?: (broken ? 0 : -EAGAIN);
+
+			t = wait_event_interruptible_timeout(stream->recv_wait,
+					!list_empty_careful(&stream->rx_ready) ||
+					READ_ONCE(stream->broken),
+					timeout);
+			if (t == 0)
+				return -EAGAIN;
+			if (t < 0)
+				/* like sock_intr_errno() */
+				return timeout == MAX_SCHEDULE_TIMEOUT ? -ERESTARTSYS : -EINTR;
+			continue;
+		}
+
+		len = min_t(size_t, rx_desc->size - rx_desc->pos, size - copied);
+		memcpy(buf + copied, page_address(rx_desc->page) + rx_desc->pos, len);
+		rx_desc->pos += len;
+		copied += len;
+
+		spin_lock_irqsave(&stream->rx_lock, irq_flags);
+		stream->rx_unread -= len;
+		spin_unlock_irqrestore(&stream->rx_lock, irq_flags);
+
+		if (rx_desc->pos == rx_desc->size) {
+			stream->rx_cur = NULL;
+			dtr_rx_desc_consumed(stream, rx_desc);
+		} else {
+			stream->rx_cur = rx_desc;
+		}
+	}
+
+	return copied;
+}
+
+static int dtr_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *s = &rdma_transport->stream[stream];
+	void *buffer;
+	int rv;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtr_recv_stream(s, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == rdma_transport->rbuf[stream].base);
+		buffer = rdma_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtr_recv_stream(s, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = rdma_transport->rbuf[stream].base;
+
+		rv = dtr_recv_stream(s, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		rdma_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+/* Receive buffers are reposted right away, the peer request needs pages of
+ * the local pool: copy, once. */
+static int dtr_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *stream = &rdma_transport->stream[DATA_STREAM];
+	struct page *page;
+	int err;
+
+	if (!stream->cm_id)
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(int, size, PAGE_SIZE);
+		void *data = kmap(page);
+		err = dtr_recv_stream(stream, data, len, CALLER_BUFFER);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err < 0)
+			goto fail;
+		if (err != len) {
+			err = -EIO;
+			goto fail;
+		}
+		size -= len;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtr_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *stream = &rdma_transport->stream[DATA_STREAM];
+
+	stats->unread_received = READ_ONCE(stream->rx_unread);
+	stats->unacked_send = READ_ONCE(stream->tx_unacked);
+	stats->send_buffer_size = dtr_tx_descs * DTR_RX_BUF_SIZE;
+	stats->send_buffer_used = stats->unacked_send;
+}
+
+static void dtr_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	rdma_transport->stream[stream].rcvtimeo = timeout;
+}
+
+static long dtr_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	if (!rdma_transport->stream[stream].cm_id)
+		return -ENOTCONN;
+
+	return rdma_transport->stream[stream].rcvtimeo;
+}
+
+/* One credit and one send queue slot are kept for returning credits */
+static bool dtr_may_send(struct dtr_stream *stream)
+{
+	unsigned long flags;
+	bool rv;
+
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	rv = stream->broken ||
+		(stream->peer_credits > 1 && stream->tx_posted < dtr_tx_descs - 1);
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+
+	return rv;
+}
+
+static int dtr_flush_tx_batch(struct dtr_stream *stream)
+{
+	struct drbd_transport *transport = &stream->rdma_transport->transport;
+	struct dtr_tx_desc *tx_desc = stream->tx_batch;
+	unsigned long flags;
+	int err;
+
+	if (!tx_desc)
+		return 0;
+
+	if (!dtr_may_send(stream))
+		stream->credit_waits++;
+	while (!wait_event_timeout(stream->send_wait, dtr_may_send(stream), stream->sndtimeo)) {
+		if (drbd_stream_send_timed_out(transport, stream->nr))
+			return -EAGAIN;
+	}
+
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	err = stream->broken ? -ECONNRESET : dtr_post_send_locked(stream, tx_desc);
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+	if (err)
+		return err;
+
+	stream->tx_batch = NULL;
+	return 0;
+}
+
+static int dtr_send_page(struct drbd_transport *transport, enum drbd_stream nr,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *stream = &rdma_transport->stream[nr];
+	struct ib_device *device;
+	int err;
+
+	if (!stream->cm_id || READ_ONCE(stream->broken))
+		return -ENOTCONN;
+	device = stream->cm_id->device;
+
+	while (size) {
+		struct dtr_tx_desc *tx_desc = stream->tx_batch;
+		unsigned int len;
+		u64 dma_addr;
+
+		if (tx_desc && (tx_desc->nr_sge == DTR_MAX_SGE ||
+				tx_desc->len == DTR_RX_BUF_SIZE)) {
+			err = dtr_flush_tx_batch(stream);
+			if (err)
+				return err;
+			tx_desc = NULL;
+		}
+		if (!tx_desc) {
+			tx_desc = kmem_cache_zalloc(dtr_tx_desc_cache, GFP_NOIO);
+			if (!tx_desc)
+				return -ENOMEM;
+			stream->tx_batch = tx_desc;
+		}
+
+		len = min_t(size_t, size, DTR_RX_BUF_SIZE - tx_desc->len);
+		dma_addr = ib_dma_map_page(device, page, offset, len, DMA_TO_DEVICE);
+		if (ib_dma_mapping_error(device, dma_addr))
+			return -ENOMEM;
+		/* Sent from the page itself, keep it until the send completed */
+		get_page(page);
+		tx_desc->pages[tx_desc->nr_sge] = page;
+		tx_desc->sge[tx_desc->nr_sge] = (struct ib_sge) {
+			.addr = dma_addr,
+			.length = len,
+			.lkey = stream->pd->local_dma_lkey,
+		};
+		tx_desc->nr_sge++;
+		tx_desc->len += len;
+		offset += len;
+		size -= len;
+	}
+
+	if (msg_flags & MSG_MORE)
+		return 0;
+	return dtr_flush_tx_batch(stream);
+}
+
+static int dtr_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dtr_send_page(transport, DATA_STREAM, bvec.bv_page,
+				    bvec.bv_offset, bvec.bv_len,
+				    bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+		if (err)
+			return err;
+
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	return 0;
+}
+
+static bool dtr_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *s = &rdma_transport->stream[stream];
+
+	return s->cm_id && READ_ONCE(s->cm_state) == DTR_CM_CONNECTED && !READ_ONCE(s->broken);
+}
+
+static bool dtr_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	/* Messages go out when the MSG_MORE sequence ends; nothing to cork,
+	 * and no delayed acks to avoid */
+	return true;
+}
+
+static const char *dtr_cm_state_name(enum dtr_cm_state state)
+{
+	switch (state) {
+	case DTR_CM_IDLE: return "idle";
+	case DTR_CM_ROUTE_RESOLVED: return "route-resolved";
+	case DTR_CM_CONNECTED: return "connected";
+	case DTR_CM_ERROR: return "error";
+	case DTR_CM_DISCONNECTED: return "disconnected";
+	}
+	return "?";
+}
+
+static void dtr_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "role: %s\n", rdma_transport->active ? "active" : "passive");
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+		struct dtr_stream *stream = &rdma_transport->stream[i];
+
+		seq_printf(m, "%s stream: %s%s\n", i == DATA_STREAM ? "data" : "control",
+			   dtr_cm_state_name(READ_ONCE(stream->cm_state)),
+			   READ_ONCE(stream->broken) ? " broken" : "");
+		seq_printf(m, "  peer credits: %d  credits to return: %d\n",
+			   READ_ONCE(stream->peer_credits), atomic_read(&stream->credits_to_return));
+		seq_printf(m, "  rx posted: %d  unread: %u Byte\n",
+			   atomic_read(&stream->rx_posted), READ_ONCE(stream->rx_unread));
+		seq_printf(m, "  tx posted: %d  unacked: %u Byte\n",
+			   READ_ONCE(stream->tx_posted), READ_ONCE(stream->tx_unacked));
+		seq_printf(m, "  received: %llu Byte in %llu msgs\n",
+			   (unsigned long long)READ_ONCE(stream->rx_bytes),
+			   (unsigned long long)READ_ONCE(stream->rx_msgs));
+		seq_printf(m, "  sent: %llu Byte in %llu msgs, %llu credit msgs, %llu credit waits\n",
+			   (unsigned long long)READ_ONCE(stream->tx_bytes),
+			   (unsigned long long)READ_ONCE(stream->tx_msgs),
+			   (unsigned long long)READ_ONCE(stream->credit_msgs),
+			   (unsigned long long)READ_ONCE(stream->credit_waits));
+	}
+}
+
+static int dtr_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+	INIT_LIST_HEAD(&path->accepts);
+	drbd_path->established = false;
+	spin_lock(&rdma_transport->paths_lock);
+	list_add(&drbd_path->list, &transport->paths);
+	spin_unlock(&rdma_transport->paths_lock);
+
+	return 0;
+}
+
+static int dtr_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+	if (drbd_path->established)
+		return -EBUSY;
+
+	spin_lock(&rdma_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&rdma_transport->paths_lock);
+	dtr_cleanup_accepts(path);
+	drbd_put_listener(drbd_path);
+
+	return 0;
+}
+
+static int __init dtr_initialize(void)
+{
+	int err;
+
+	if (dtr_rx_descs < 4 || dtr_tx_descs < 4)
+		return -EINVAL;
+
+	dtr_tx_desc_cache = kmem_cache_create("drbd_rdma_tx_desc", sizeof(struct dtr_tx_desc),
+					      0, 0, NULL);
+	if (!dtr_tx_desc_cache)
+		return -ENOMEM;
+
+	err = drbd_register_transport_class(&rdma_transport_class,
+					    DRBD_TRANSPORT_API_VERSION,
+					    sizeof(struct drbd_transport));
+	if (err)
+		kmem_cache_destroy(dtr_tx_desc_cache);
+	return err;
+}
+
+static void __exit dtr_cleanup(void)
+{
+	drbd_unregister_transport_class(&rdma_transport_class);
+	kmem_cache_destroy(dtr_tx_desc_cache);
+}
+
+module_init(dtr_initialize)
+module_exit(dtr_cleanup)
@@ -17,6 +17,12 @@
 #include <linux/net.h>
 #include <linux/tcp.h>
 #include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/file.h>
+#include <linux/completion.h>
+#include <net/busy_poll.h>
+#include <net/tcp.h>
+#include <net/handshake.h>
 #include <linux/drbd_genl_api.h>
 #include <linux/drbd_config.h>
 #include <drbd_protocol.h>
@@ -38,12 +44,164 @@ struct buffer {
 
 #define DTT_CONNECTING 1
 
+/* Data stream striping over all established paths.
+ * Must be set to the same value on all nodes, so it is only a load time
+ * option; a mismatch fails the connect, see dtt_mp_recv_hdr(). */
+static bool dtt_multipath;
+MODULE_PARM_DESC(multipath, "Stripe the data stream over all configured paths");
+module_param_named(multipath, dtt_multipath, bool, 0444);
+
+/* Spin for up to this many microseconds waiting for the next packet on the
+ * control stream, before going to sleep in recvmsg(). Trades CPU time of
+ * the ack receiver for the wakeup latency of every P_WRITE_ACK. 0 disables. */
+static unsigned int dtt_ack_busy_poll;
+MODULE_PARM_DESC(ack_busy_poll, "Busy poll budget in usec for the control stream (0 = off)");
+module_param_named(ack_busy_poll, dtt_ack_busy_poll, uint, 0644);
+
+/* Read the data stream into a buffer of this many KiB, as much as the socket
+ * has each time, and parse packet headers and small payloads out of it: for a
+ * stream of small writes that is one recvmsg() for many packets instead of at
+ * least two per packet.  0 disables.  Takes effect for new connections. */
+static unsigned int dtt_recv_batch = 64;
+MODULE_PARM_DESC(recv_batch, "Data stream receive buffer in KiB (0 = off)");
+module_param_named(recv_batch, dtt_recv_batch, uint, 0644);
+
+#define DTT_RECV_BATCH_MAX 1024	/* KiB */
+
+/* Where net_conf leaves sndbuf-size or rcvbuf-size at 0, size the data
+ * stream socket buffers from the measured bandwidth-delay product, up to
+ * this many KiB, instead of relying on the kernel's autotuning, which stops
+ * at tcp_wmem[2] and tcp_rmem[2].  0 leaves it to the kernel. */
+static unsigned int dtt_bufsize_auto;
+MODULE_PARM_DESC(bufsize_auto, "Size unset socket buffers from the bandwidth-delay product, max KiB (0 = off)");
+module_param_named(bufsize_auto, dtt_bufsize_auto, uint, 0644);
+
+#define DTT_BUFSIZE_AUTO_MIN	(128 << 10)
+
+/* Latency mode: let no more than this many KiB of the data stream wait
+ * unsent in the socket (TCP_NOTSENT_LOWAT). Beyond that the sender blocks,
+ * and the requests wait in DRBD's own queues instead of behind a full send
+ * buffer, where a new write would be stuck behind all of it. 0 disables.
+ * Takes effect for new connections. */
+static unsigned int dtt_notsent_lowat;
+MODULE_PARM_DESC(notsent_lowat, "Unsent data stream bytes kept in the socket, in KiB (0 = off)");
+module_param_named(notsent_lowat, dtt_notsent_lowat, uint, 0644);
+
+/* TCP congestion control algorithm for DRBD's sockets, e.g. "bbr" for
+ * lossy long distance links, instead of the system default. Empty: the
+ * system default. Takes effect for new connections. */
+static char dtt_congestion_control[TCP_CA_NAME_MAX];
+MODULE_PARM_DESC(congestion_control, "TCP congestion control algorithm (empty = system default)");
+module_param_string(congestion_control, dtt_congestion_control, TCP_CA_NAME_MAX, 0644);
+
+/* Upper bound for the rate the stack paces each socket to (SO_MAX_PACING_RATE),
+ * in KiB/s; combined with bbr or fq qdiscs. 0: unlimited. */
+static unsigned int dtt_max_pacing_rate;
+MODULE_PARM_DESC(max_pacing_rate, "Per socket pacing rate limit in KiB/s (0 = unlimited)");
+module_param_named(max_pacing_rate, dtt_max_pacing_rate, uint, 0644);
+
+#define DTT_MP_MAX_SOCKS 8
+
+/* Encrypt all streams with kernel TLS. The handshake is done by tlshd in
+ * userspace, through the kernel's handshake upcall; it configures TLS_TX
+ * and TLS_RX on the socket, offloaded to the NIC where the device supports
+ * it. The node with the "bigger" address is the TLS client.
+ * Must be set to the same value on all nodes.
+ * The key serials select keyring, certificate, private key or a pre-shared
+ * key (preferred if set); 0 leaves it to tlshd's configuration. */
+static bool dtt_tls;
+MODULE_PARM_DESC(tls, "Encrypt the connection with kernel TLS (needs tlshd)");
+module_param_named(tls, dtt_tls, bool, 0644);
+
+static int dtt_tls_keyring;
+MODULE_PARM_DESC(tls_keyring, "Key serial of the keyring for the TLS handshake");
+module_param_named(tls_keyring, dtt_tls_keyring, int, 0644);
+
+static int dtt_tls_certificate;
+MODULE_PARM_DESC(tls_certificate, "Key serial of the x.509 certificate");
+module_param_named(tls_certificate, dtt_tls_certificate, int, 0644);
+
+static int dtt_tls_privkey;
+MODULE_PARM_DESC(tls_privkey, "Key serial of the certificate's private key");
+module_param_named(tls_privkey, dtt_tls_privkey, int, 0644);
+
+static int dtt_tls_psk;
+MODULE_PARM_DESC(tls_psk, "Key serial of a TLS pre-shared key");
+module_param_named(tls_psk, dtt_tls_psk, int, 0644);
+
+/* With multipath striping, each chunk of the data stream (one call to
+ * dtt_send_page()) is prefixed with this header. Chunks are distributed
+ * round robin, chunk seq goes to socks[seq % nr_socks], so the receiver
+ * knows where to look for the next one. */
+struct dtt_mp_header {
+	__be32 seq;
+	__be32 length;
+} __packed;
+
+struct dtt_multipath {
+	struct socket *socks[DTT_MP_MAX_SOCKS]; /* socks[0] == stream[DATA_STREAM] */
+	unsigned int nr_socks;	/* 0 or 1: not striping */
+	u32 send_seq;		/* protected by connection->mutex[DATA_STREAM] */
+	u32 recv_seq;		/* only accessed by the receiver thread */
+	unsigned int recv_left;	/* bytes left in the current receive chunk */
+	struct dtt_mp_header recv_hdr;	/* of the next chunk, while incomplete */
+	unsigned int recv_hdr_len;	/* bytes of recv_hdr received so far */
+};
+
+/* Only accessed by the receiver thread */
+struct dtt_recv_batch {
+	void *buf;
+	unsigned int size;	/* 0: off */
+	unsigned int head;	/* first byte not yet consumed */
+	unsigned int tail;	/* end of the received bytes */
+	u64 recvmsgs;		/* calls that filled the buffer */
+	u64 bytes;		/* received into the buffer */
+	u64 direct;		/* reads that bypassed the buffer */
+};
+
+/* Pages of a payload handed to one recvmsg, see dtt_recv_page_vec() */
+#define DTT_RECV_BVECS 256
+
+/* Only accessed by the ack receiver thread */
+struct dtt_busy_poll {
+	u64 ns;			/* time spent spinning */
+	u32 hits;		/* data arrived while spinning */
+	u32 misses;		/* budget exhausted, went to sleep */
+};
+
+/* Socket buffer sizes as last applied to the sockets of one stream,
+ * protected by connection->mutex[stream], see dtt_update_bufsize() */
+struct dtt_bufsize {
+	unsigned int sndbuf;	/* 0: left to the kernel */
+	unsigned int rcvbuf;
+	unsigned int auto_size;	/* from the bandwidth-delay product, only grows */
+	unsigned long next_auto; /* jiffies */
+};
+
+/* Per stream counters, for the "transport" debugfs file */
+struct dtt_stream_stats {
+	u64 bytes_sent;
+	u64 sends;		/* successful send_page calls */
+	u64 bytes_received;
+	u64 stall_ns;		/* in sends started with a full send buffer */
+	u32 congested;		/* times NET_CONGESTED got set */
+};
+
 struct drbd_tcp_transport {
 	struct drbd_transport transport; /* Must be first! */
 	spinlock_t paths_lock;
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+	struct dtt_multipath mp;
+	struct dtt_busy_poll bp;
+	struct dtt_recv_batch rb;
+	struct dtt_stream_stats st[2];
+	struct dtt_bufsize bs[2];
+	unsigned int notsent_lowat; /* of the data stream sockets, 0: off */
+	bool tls;		/* the streams of this connection are TLS */
+	/* only used by the receiver */
+	struct bio_vec rx_bvec[DTT_RECV_BVECS];
 };
 
 struct dtt_listener {
@@ -158,11 +316,49 @@ static void dtt_nodelay(struct socket *socket)
 	(void) kernel_setsockopt(socket, SOL_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
 }
 
+/* Both ends of a connection, each for what it sends: on sockets we connect
+ * before the SYN goes out, on accepted ones right after accept(). */
+static void dtt_set_cc_pacing(struct drbd_transport *transport, struct socket *socket)
+{
+	char name[TCP_CA_NAME_MAX];
+	int err;
+
+	strscpy(name, dtt_congestion_control, sizeof(name));
+	strim(name);
+	if (name[0]) {
+		err = kernel_setsockopt(socket, SOL_TCP, TCP_CONGESTION, name, strlen(name));
+		if (err)
+			tr_warn(transport, "Failed to set congestion control %s: %d\n", name, err);
+	}
+
+	if (dtt_max_pacing_rate) {
+		u32 rate = min_t(u64, (u64)dtt_max_pacing_rate << 10, ~0U);
+
+		err = kernel_setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE,
+					(char *)&rate, sizeof(rate));
+		if (err)
+			tr_warn(transport, "Failed to set SO_MAX_PACING_RATE %d\n", err);
+	}
+}
+
+static void dtt_set_notsent_lowat(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+{
+	int val = tcp_transport->notsent_lowat;
+	int err;
+
+	err = kernel_setsockopt(socket, SOL_TCP, TCP_NOTSENT_LOWAT, (char *)&val, sizeof(val));
+	if (err) {
+		tr_warn(&tcp_transport->transport, "Failed to set TCP_NOTSENT_LOWAT %d\n", err);
+		tcp_transport->notsent_lowat = 0;
+	}
+}
+
 static int dtt_init(struct drbd_transport *transport)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	enum drbd_stream i;
+	unsigned int size;
 
 	spin_lock_init(&tcp_transport->paths_lock);
 	tcp_transport->transport.ops = &dtt_ops;
@@ -175,19 +371,53 @@ static int dtt_init(struct drbd_transport *transport)
 		tcp_transport->rbuf[i].pos = buffer;
 	}
 
+	size = min_t(unsigned int, READ_ONCE(dtt_recv_batch), DTT_RECV_BATCH_MAX) * 1024;
+	if (size) {
+		/* Not fatal, we just receive packet by packet then */
+		tcp_transport->rb.buf = kvmalloc(size, GFP_KERNEL);
+		if (tcp_transport->rb.buf)
+			tcp_transport->rb.size = size;
+	}
+
 	return 0;
 fail:
 	free_page((unsigned long)tcp_transport->rbuf[0].base);
 	return -ENOMEM;
 }
 
+static void dtt_sock_release(struct socket *socket)
+{
+	/* After the TLS handshake, the socket belongs to its file */
+	if (socket->file)
+		fput(socket->file);
+	else
+		sock_release(socket);
+}
+
 static void dtt_free_one_sock(struct socket *socket)
 {
 	if (socket) {
 		synchronize_rcu();
 		kernel_sock_shutdown(socket, SHUT_RDWR);
-		sock_release(socket);
+		dtt_sock_release(socket);
+	}
+}
+
+static void dtt_mp_free_socks(struct dtt_multipath *mp)
+{
+	unsigned int i;
+
+	/* socks[0] is the regular data stream socket, freed by the caller */
+	for (i = 1; i < mp->nr_socks; i++) {
+		dtt_free_one_sock(mp->socks[i]);
+		mp->socks[i] = NULL;
 	}
+	mp->socks[0] = NULL;
+	mp->nr_socks = 0;
+	mp->send_seq = 0;
+	mp->recv_seq = 0;
+	mp->recv_left = 0;
+	mp->recv_hdr_len = 0;
 }
 
 static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
@@ -205,6 +435,10 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 			tcp_transport->stream[i] = NULL;
 		}
 	}
+	dtt_mp_free_socks(&tcp_transport->mp);
+	/* what was left of the old connection's data stream is gone */
+	tcp_transport->rb.head = 0;
+	tcp_transport->rb.tail = 0;
 
 	for_each_path_ref(drbd_path, transport) {
 		bool was_established = drbd_path->established;
@@ -220,6 +454,9 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 			free_page((unsigned long)tcp_transport->rbuf[i].base);
 			tcp_transport->rbuf[i].base = NULL;
 		}
+		kvfree(tcp_transport->rb.buf);
+		tcp_transport->rb.buf = NULL;
+		tcp_transport->rb.size = 0;
 		spin_lock(&tcp_transport->paths_lock);
 		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
 			list_del_init(&drbd_path->list);
@@ -252,8 +489,8 @@ static int _dtt_send(struct drbd_tcp_transport *tcp_transport, struct socket *so
 		if (rv == -EAGAIN) {
 			struct drbd_transport *transport = &tcp_transport->transport;
 			enum drbd_stream stream =
-				tcp_transport->stream[DATA_STREAM] == socket ?
-					DATA_STREAM : CONTROL_STREAM;
+				tcp_transport->stream[CONTROL_STREAM] == socket ?
+					CONTROL_STREAM : DATA_STREAM;
 
 			if (drbd_stream_send_timed_out(transport, stream))
 				break;
@@ -290,6 +527,188 @@ static int dtt_recv_short(struct socket *socket, void *buf, size_t size, int fla
 	return kernel_recvmsg(socket, &msg, &iov, 1, size, msg.msg_flags);
 }
 
+static bool dtt_mp_striping(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream)
+{
+	return stream == DATA_STREAM && tcp_transport->mp.nr_socks > 1;
+}
+
+/* A header cut short by a signal or a receive timeout is kept in mp, and
+ * completed by the next call, so the stream stays in sync. */
+static int dtt_mp_recv_header(struct dtt_multipath *mp, int flags)
+{
+	struct socket *socket = mp->socks[mp->recv_seq % mp->nr_socks];
+	struct dtt_mp_header *h = &mp->recv_hdr;
+	int rv;
+
+	if (flags & MSG_DONTWAIT) {
+		struct tcp_sock *tp = tcp_sk(socket->sk);
+
+		/* never wait for the rest of a header */
+		if (tp->rcv_nxt - tp->copied_seq < sizeof(*h) - mp->recv_hdr_len)
+			return -EAGAIN;
+	}
+
+	while (mp->recv_hdr_len < sizeof(*h)) {
+		rv = dtt_recv_short(socket, (u8 *)h + mp->recv_hdr_len,
+				    sizeof(*h) - mp->recv_hdr_len, 0);
+		if (rv <= 0)
+			return rv;
+		mp->recv_hdr_len += rv;
+	}
+	mp->recv_hdr_len = 0;
+	if (be32_to_cpu(h->seq) != mp->recv_seq || h->length == 0)
+		return -EPROTO;
+
+	mp->recv_left = be32_to_cpu(h->length);
+	return sizeof(*h);
+}
+
+/* Reassemble the data stream from the striped sockets.
+ * Same return value conventions as dtt_recv_short(). */
+static int dtt_mp_recv(struct drbd_tcp_transport *tcp_transport, void *buf, size_t size, int flags)
+{
+	struct dtt_multipath *mp = &tcp_transport->mp;
+	int received = 0;
+
+	while (received < size) {
+		struct socket *socket;
+		size_t len;
+		int rv;
+
+		if (!mp->recv_left) {
+			rv = dtt_mp_recv_header(mp, flags);
+			if (rv <= 0)
+				return received ?: rv;
+		}
+
+		socket = mp->socks[mp->recv_seq % mp->nr_socks];
+		len = min_t(size_t, size - received, mp->recv_left);
+		rv = dtt_recv_short(socket, buf + received, len, flags);
+		if (rv <= 0)
+			return received ?: rv;
+
+		received += rv;
+		mp->recv_left -= rv;
+		if (!mp->recv_left)
+			mp->recv_seq++;
+		if (rv < len) /* interrupted, or MSG_DONTWAIT */
+			break;
+	}
+
+	return received;
+}
+
+/* Receive as much as the data socket has, at least one byte unless
+ * MSG_DONTWAIT, into the free end of the receive batch buffer */
+static int dtt_recv_batch_fill(struct drbd_tcp_transport *tcp_transport, int flags)
+{
+	struct dtt_recv_batch *rb = &tcp_transport->rb;
+	int rv;
+
+	if (rb->head) {
+		memmove(rb->buf, rb->buf + rb->head, rb->tail - rb->head);
+		rb->tail -= rb->head;
+		rb->head = 0;
+	}
+
+	rv = dtt_recv_short(tcp_transport->stream[DATA_STREAM], rb->buf + rb->tail,
+			    rb->size - rb->tail, flags | MSG_NOSIGNAL);
+	if (rv > 0) {
+		rb->tail += rv;
+		rb->recvmsgs++;
+		rb->bytes += rv;
+	}
+	return rv;
+}
+
+/*
+ * Same return value conventions as dtt_recv_short().  Reads that the buffer
+ * already holds are served from it.  Payloads of a page or more that it does
+ * not hold yet are received into the caller's memory directly, after what is
+ * buffered, instead of being copied twice.  When a blocking read fails, what
+ * was buffered stays, the caller tears down the connection in that case.
+ */
+static int dtt_recv_batch_recv(struct drbd_tcp_transport *tcp_transport, void *buf,
+			       size_t size, int flags)
+{
+	struct dtt_recv_batch *rb = &tcp_transport->rb;
+	bool dontwait = flags & MSG_DONTWAIT;
+	size_t have = rb->tail - rb->head;
+	int rv;
+
+	if (have < size && (size >= PAGE_SIZE || size > rb->size)) {
+		memcpy(buf, rb->buf + rb->head, have);
+		rb->head += have;
+		rb->direct++;
+		rv = dtt_recv_short(tcp_transport->stream[DATA_STREAM], buf + have, size - have, flags);
+		if (rv <= 0)
+			return have ?: rv;
+		return have + rv;
+	}
+
+	while (have < size) {
+		rv = dtt_recv_batch_fill(tcp_transport, dontwait ? MSG_DONTWAIT : 0);
+		if (rv <= 0) {
+			if (dontwait && have)
+				break;
+			return rv;
+		}
+		have = rb->tail - rb->head;
+	}
+
+	size = min(size, have);
+	memcpy(buf, rb->buf + rb->head, size);
+	rb->head += size;
+	return size;
+}
+
+static int dtt_recv_stream(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream,
+			   void *buf, size_t size, int flags)
+{
+	int rv;
+
+	if (dtt_mp_striping(tcp_transport, stream))
+		rv = dtt_mp_recv(tcp_transport, buf, size, flags);
+	/* Not with striping: dtt_mp_recv() would block for the next chunk
+	 * once it has filled one, even if the peer has nothing more to send. */
+	else if (stream == DATA_STREAM && tcp_transport->rb.size)
+		rv = dtt_recv_batch_recv(tcp_transport, buf, size, flags);
+	else
+		rv = dtt_recv_short(tcp_transport->stream[stream], buf, size, flags);
+
+	if (rv > 0)
+		tcp_transport->st[stream].bytes_received += rv;
+	return rv;
+}
+
+static void dtt_busy_poll(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+			  unsigned int budget_us)
+{
+	struct sock *sk = socket->sk;
+	ktime_t start = ktime_get();
+	ktime_t end = ktime_add_us(start, budget_us);
+	ktime_t now;
+	bool arrived;
+
+	do {
+		arrived = !skb_queue_empty(&sk->sk_receive_queue);
+		if (arrived)
+			break;
+		if (sk_can_busy_loop(sk))
+			sk_busy_loop(sk, true);
+		else
+			cpu_relax();
+		now = ktime_get();
+	} while (ktime_before(now, end) && !need_resched() && !signal_pending(current));
+
+	now = ktime_get();
+	tcp_transport->bp.ns += ktime_to_ns(ktime_sub(now, start));
+	if (arrived)
+		tcp_transport->bp.hits++;
+	else
+		tcp_transport->bp.misses++;
+}
+
 static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -301,19 +720,26 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	if (!socket)
 		return -ENOTCONN;
 
+	if (stream == CONTROL_STREAM && !(flags & MSG_DONTWAIT)) {
+		unsigned int budget_us = READ_ONCE(dtt_ack_busy_poll);
+
+		if (budget_us && skb_queue_empty(&socket->sk->sk_receive_queue))
+			dtt_busy_poll(tcp_transport, socket, budget_us);
+	}
+
 	if (flags & CALLER_BUFFER) {
 		buffer = *buf;
-		rv = dtt_recv_short(socket, buffer, size, flags & ~CALLER_BUFFER);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
 	} else if (flags & GROW_BUFFER) {
 		TR_ASSERT(transport, *buf == tcp_transport->rbuf[stream].base);
 		buffer = tcp_transport->rbuf[stream].pos;
 		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
 
-		rv = dtt_recv_short(socket, buffer, size, flags & ~GROW_BUFFER);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags & ~GROW_BUFFER);
 	} else {
 		buffer = tcp_transport->rbuf[stream].base;
 
-		rv = dtt_recv_short(socket, buffer, size, flags);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags);
 		if (rv > 0)
 			*buf = buffer;
 	}
@@ -324,6 +750,52 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	return rv;
 }
 
+/* Receives a payload into the pages of a chain with one recvmsg for up to
+ * DTT_RECV_BVECS pages, instead of one per page. Whatever the receive batch
+ * buffer holds already goes into the first of them. */
+static int dtt_recv_page_vec(struct drbd_tcp_transport *tcp_transport, struct page *page, size_t size)
+{
+	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	struct dtt_recv_batch *rb = &tcp_transport->rb;
+	struct bio_vec *bvec = tcp_transport->rx_bvec;
+
+	while (size) {
+		struct msghdr msg = { .msg_flags = MSG_WAITALL | MSG_NOSIGNAL };
+		size_t len = 0;
+		int n = 0, rv;
+
+		for (; page && n < DTT_RECV_BVECS; page = page_chain_next(page)) {
+			unsigned int l = min_t(size_t, size - len, PAGE_SIZE);
+
+			set_page_chain_offset(page, 0);
+			set_page_chain_size(page, l);
+			bvec[n++] = (struct bio_vec) { .bv_page = page, .bv_offset = 0, .bv_len = l };
+			len += l;
+		}
+		iov_iter_bvec(&msg.msg_iter, READ, bvec, n, len);
+
+		if (rb->tail > rb->head) {
+			size_t have = min_t(size_t, rb->tail - rb->head, len);
+
+			if (copy_to_iter(rb->buf + rb->head, have, &msg.msg_iter) != have)
+				return -EIO;
+			rb->head += have;
+			rb->direct++;
+		}
+		if (msg_data_left(&msg)) {
+			rv = sock_recvmsg(socket, &msg, msg.msg_flags);
+			if (rv < 0)
+				return rv;
+			if (msg_data_left(&msg))
+				return -ECONNRESET;
+		}
+
+		tcp_transport->st[DATA_STREAM].bytes_received += len;
+		size -= len;
+	}
+	return 0;
+}
+
 static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -340,10 +812,18 @@ static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_cha
 	if (!page)
 		return -ENOMEM;
 
+	/* Striped, dtt_mp_recv() reassembles the payload from several sockets */
+	if (!dtt_mp_striping(tcp_transport, DATA_STREAM)) {
+		err = dtt_recv_page_vec(tcp_transport, page, size);
+		if (err)
+			goto fail;
+		return 0;
+	}
+
 	page_chain_for_each(page) {
 		size_t len = min_t(int, size, PAGE_SIZE);
 		void *data = kmap(page);
-		err = dtt_recv_short(socket, data, len, 0);
+		err = dtt_recv_stream(tcp_transport, DATA_STREAM, data, len, 0);
 		kunmap(page);
 		set_page_chain_offset(page, 0);
 		set_page_chain_size(page, len);
@@ -368,7 +848,8 @@ static void dtt_stats(struct drbd_transport *transport, struct drbd_transport_st
 		struct sock *sk = socket->sk;
 		struct tcp_sock *tp = tcp_sk(sk);
 
-		stats->unread_received = tp->rcv_nxt - tp->copied_seq;
+		stats->unread_received = tp->rcv_nxt - tp->copied_seq +
+			tcp_transport->rb.tail - tcp_transport->rb.head;
 		stats->unacked_send = tp->write_seq - tp->snd_una;
 		stats->send_buffer_size = sk->sk_sndbuf;
 		stats->send_buffer_used = sk->sk_wmem_queued;
@@ -378,14 +859,89 @@ static void dtt_stats(struct drbd_transport *transport, struct drbd_transport_st
 static void dtt_setbufsize(struct socket *socket, unsigned int snd,
 			   unsigned int rcv)
 {
-	/* open coded SO_SNDBUF, SO_RCVBUF */
+	/* open coded SO_SNDBUF, SO_RCVBUF; 0 hands it back to autotuning */
 	if (snd) {
 		socket->sk->sk_sndbuf = snd;
 		socket->sk->sk_userlocks |= SOCK_SNDBUF_LOCK;
+	} else {
+		socket->sk->sk_userlocks &= ~SOCK_SNDBUF_LOCK;
 	}
 	if (rcv) {
 		socket->sk->sk_rcvbuf = rcv;
 		socket->sk->sk_userlocks |= SOCK_RCVBUF_LOCK;
+	} else {
+		socket->sk->sk_userlocks &= ~SOCK_RCVBUF_LOCK;
+	}
+}
+
+static void dtt_resize_socket(struct socket *socket, unsigned int snd, unsigned int rcv)
+{
+	struct sock *sk = socket->sk;
+
+	lock_sock(sk);
+	dtt_setbufsize(socket, snd, rcv);
+	/* senders may be waiting for room in the old send buffer */
+	sk->sk_write_space(sk);
+	release_sock(sk);
+}
+
+/* Bytes in flight for one round trip on this socket, in either direction:
+ * the send side from the delivery rate of the last ACK sample, the receive
+ * side from the kernel's own per-RTT estimate. */
+static unsigned int dtt_bdp(struct socket *socket)
+{
+	struct tcp_sock *tp = tcp_sk(socket->sk);
+	u32 interval_us = READ_ONCE(tp->rate_interval_us);
+	u64 snd = 0;
+
+	if (interval_us)
+		snd = div_u64((u64)READ_ONCE(tp->rate_delivered) * READ_ONCE(tp->mss_cache) *
+			      (READ_ONCE(tp->srtt_us) >> 3), interval_us);
+
+	return min_t(u64, max_t(u64, snd, READ_ONCE(tp->rcvq_space.space)), INT_MAX / 2);
+}
+
+/* Apply changed sndbuf-size and rcvbuf-size to the established sockets of
+ * a stream, and the auto sized ones where these are 0. Called with
+ * connection->mutex[stream] held, after each batch of sends. */
+static void dtt_update_bufsize(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream)
+{
+	struct dtt_bufsize *bs = &tcp_transport->bs[stream];
+	struct socket *socket = tcp_transport->stream[stream];
+	unsigned int auto_max = READ_ONCE(dtt_bufsize_auto) << 10;
+	unsigned int snd, rcv, i;
+	struct net_conf *nc;
+
+	rcu_read_lock();
+	nc = rcu_dereference(tcp_transport->transport.net_conf);
+	snd = nc->sndbuf_size;
+	rcv = nc->rcvbuf_size;
+	rcu_read_unlock();
+
+	if (stream == DATA_STREAM && auto_max && (!snd || !rcv)) {
+		if (time_after_eq(jiffies, bs->next_auto)) {
+			unsigned int size = clamp_t(unsigned int, 2 * dtt_bdp(socket),
+						    DTT_BUFSIZE_AUTO_MIN,
+						    max_t(unsigned int, auto_max, DTT_BUFSIZE_AUTO_MIN));
+
+			bs->auto_size = max(bs->auto_size, size);
+			bs->next_auto = jiffies + HZ;
+		}
+		snd = snd ?: bs->auto_size;
+		rcv = rcv ?: bs->auto_size;
+	} else {
+		bs->auto_size = 0;
+	}
+
+	if (snd == bs->sndbuf && rcv == bs->rcvbuf)
+		return;
+
+	bs->sndbuf = snd;
+	bs->rcvbuf = rcv;
+	dtt_resize_socket(socket, snd, rcv);
+	if (stream == DATA_STREAM) {
+		for (i = 1; i < tcp_transport->mp.nr_socks; i++)
+			dtt_resize_socket(tcp_transport->mp.socks[i], snd, rcv);
 	}
 }
 
@@ -438,6 +994,7 @@ static int dtt_try_connect(struct drbd_transport *transport, struct dtt_path *pa
 	socket->sk->sk_rcvtimeo =
 	socket->sk->sk_sndtimeo = connect_int * HZ;
 	dtt_setbufsize(socket, sndbuf_size, rcvbuf_size);
+	dtt_set_cc_pacing(transport, socket);
 
 	/* explicitly bind to the configured IP as source IP
 	*  for the outgoing connections.
@@ -681,6 +1238,7 @@ retry:
 			goto retry_locked;
 	}
 	spin_unlock_bh(&listener->listener.waiters_lock);
+	dtt_set_cc_pacing(transport, s_estab);
 	*socket = s_estab;
 	*ret_path = path;
 	return 0;
@@ -868,6 +1426,214 @@ static struct dtt_path *dtt_next_path(struct drbd_tcp_transport *tcp_transport,
 	return container_of(drbd_path, struct dtt_path, path);
 }
 
+static int dtt_mp_send_hdr(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+			   unsigned int value)
+{
+	struct p_header80 h = {
+		.magic = cpu_to_be32(DRBD_MAGIC),
+		.command = cpu_to_be16(P_INITIAL_DATA),
+		.length = cpu_to_be16(value),
+	};
+	int err;
+
+	err = _dtt_send(tcp_transport, socket, &h, sizeof(h), 0);
+	return err == sizeof(h) ? 0 : (err < 0 ? err : -EIO);
+}
+
+static int dtt_mp_recv_hdr(struct drbd_transport *transport, struct socket *socket,
+			   long timeo, unsigned int *value)
+{
+	struct p_header80 h;
+	int err;
+
+	socket->sk->sk_rcvtimeo = timeo;
+	err = dtt_recv_short(socket, &h, sizeof(h), 0);
+	if (err != sizeof(h))
+		return err < 0 ? err : -EIO;
+	if (h.magic != cpu_to_be32(DRBD_MAGIC) || h.command != cpu_to_be16(P_INITIAL_DATA)) {
+		tr_err(transport, "Peer does not stripe the data stream; "
+		       "multipath must be set identically on both nodes\n");
+		return -EPROTO;
+	}
+	*value = be16_to_cpu(h.length);
+	return 0;
+}
+
+/* Establish one additional data stream socket for each path besides
+ * first_path. The node that actively opened the meta socket connects,
+ * tagging each new socket with its index, and finally reports the number
+ * of sockets on the main data socket.  Paths that cannot be connected
+ * right now are simply not used until the next reconnect. */
+static int dtt_mp_connect(struct drbd_tcp_transport *tcp_transport, struct dtt_path *first_path,
+			  struct socket *dsocket)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct dtt_multipath *mp = &tcp_transport->mp;
+	struct dtt_path *used_paths[DTT_MP_MAX_SOCKS];
+	struct drbd_path *drbd_path;
+	struct net_conf *nc;
+	unsigned int i, nr;
+	long timeo;
+	int err;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EIO;
+	}
+	timeo = nc->connect_int * HZ;
+	rcu_read_unlock();
+
+	mp->socks[0] = dsocket;
+	mp->nr_socks = 1;
+
+	if (!test_bit(RESOLVE_CONFLICTS, &transport->flags)) {
+		for_each_path_ref(drbd_path, transport) {
+			struct dtt_path *path = container_of(drbd_path, struct dtt_path, path);
+			struct socket *s = NULL;
+
+			if (path == first_path || mp->nr_socks == DTT_MP_MAX_SOCKS)
+				continue;
+
+			if (dtt_try_connect(transport, path, &s) < 0)
+				continue;
+			if (dtt_mp_send_hdr(tcp_transport, s, mp->nr_socks)) {
+				kernel_sock_shutdown(s, SHUT_RDWR);
+				sock_release(s);
+				continue;
+			}
+			used_paths[mp->nr_socks] = path;
+			mp->socks[mp->nr_socks++] = s;
+		}
+
+		err = dtt_mp_send_hdr(tcp_transport, dsocket, mp->nr_socks);
+		if (err)
+			return err;
+	} else {
+		/* The peer may spend up to connect-int on each path */
+		err = dtt_mp_recv_hdr(transport, dsocket, timeo * DTT_MP_MAX_SOCKS, &nr);
+		if (err)
+			return err;
+		if (nr < 1 || nr > DTT_MP_MAX_SOCKS)
+			return -EPROTO;
+
+		for_each_path_ref(drbd_path, transport) {
+			struct dtt_path *path = container_of(drbd_path, struct dtt_path, path);
+			struct socket *s = NULL;
+			unsigned int idx;
+
+			if (path == first_path || mp->nr_socks == nr)
+				continue;
+
+			err = dtt_wait_for_connect(transport, drbd_path->listener, &s, &path);
+			if (err < 0)
+				continue;
+			if (dtt_mp_recv_hdr(transport, s, timeo, &idx) ||
+			    idx < 1 || idx >= nr || mp->socks[idx]) {
+				kernel_sock_shutdown(s, SHUT_RDWR);
+				sock_release(s);
+				continue;
+			}
+			used_paths[idx] = path;
+			mp->socks[idx] = s;
+			mp->nr_socks++;
+		}
+
+		if (mp->nr_socks != nr) {
+			tr_warn(transport, "Only %u of %u data stream paths connected\n",
+				mp->nr_socks, nr);
+			/* socks[] may have holes, close them in order */
+			for (i = 1; i < DTT_MP_MAX_SOCKS; i++) {
+				if (mp->socks[i]) {
+					dtt_free_one_sock(mp->socks[i]);
+					mp->socks[i] = NULL;
+				}
+			}
+			mp->nr_socks = 0;
+			return -EAGAIN;
+		}
+	}
+
+	for (i = 1; i < mp->nr_socks; i++) {
+		used_paths[i]->path.established = true;
+		drbd_path_event(transport, &used_paths[i]->path);
+	}
+	if (mp->nr_socks > 1)
+		tr_info(transport, "Striping data stream over %u paths\n", mp->nr_socks);
+
+	return 0;
+}
+
+struct dtt_tls_handshake {
+	struct completion done;
+	int status;
+};
+
+static void dtt_tls_done(void *data, int status, key_serial_t peerid)
+{
+	struct dtt_tls_handshake *hs = data;
+
+	hs->status = status;
+	complete(&hs->done);
+}
+
+/* On return the socket has a file, or is released and *socket is NULL */
+static int dtt_tls_handshake(struct drbd_tcp_transport *tcp_transport, struct socket **socket,
+			     bool client)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct dtt_tls_handshake hs;
+	struct tls_handshake_args args = {
+		.ta_sock = *socket,
+		.ta_done = dtt_tls_done,
+		.ta_data = &hs,
+		.ta_keyring = dtt_tls_keyring,
+		.ta_my_cert = dtt_tls_certificate,
+		.ta_my_privkey = dtt_tls_privkey,
+	};
+	struct net_conf *nc;
+	struct file *file;
+	long timeout, t;
+	int err;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	timeout = nc->connect_int * HZ;
+	rcu_read_unlock();
+	args.ta_timeout_ms = jiffies_to_msecs(timeout);
+
+	/* tlshd gets the socket passed as file descriptor */
+	file = sock_alloc_file(*socket, 0, NULL);
+	if (IS_ERR(file)) {
+		*socket = NULL; /* released by sock_alloc_file() */
+		return PTR_ERR(file);
+	}
+
+	init_completion(&hs.done);
+	if (dtt_tls_psk) {
+		args.ta_num_peerids = 1;
+		args.ta_my_peerids[0] = dtt_tls_psk;
+		err = client ? tls_client_hello_psk(&args, GFP_KERNEL) :
+			tls_server_hello_psk(&args, GFP_KERNEL);
+	} else {
+		err = client ? tls_client_hello_x509(&args, GFP_KERNEL) :
+			tls_server_hello_x509(&args, GFP_KERNEL);
+	}
+	if (err)
+		return err;
+
+	t = wait_for_completion_interruptible_timeout(&hs.done, timeout);
+	if (t <= 0) {
+		if (tls_handshake_cancel((*socket)->sk))
+			return t ?: -ETIMEDOUT;
+		/* too late, done is being called */
+		wait_for_completion(&hs.done);
+	}
+
+	return hs.status;
+}
+
 static int dtt_connect(struct drbd_transport *transport)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -878,6 +1644,7 @@ static int dtt_connect(struct drbd_transport *transport)
 	struct net_conf *nc;
 	int timeout, err;
 	int one = 1;
+	unsigned int i;
 	bool ok;
 
 	dsocket = NULL;
@@ -1026,6 +1793,30 @@ randomize:
 	} while (!ok);
 
 	TR_ASSERT(transport, first_path == connect_to_path);
+	if (dtt_multipath) {
+		err = dtt_mp_connect(tcp_transport, first_path, dsocket);
+		if (err)
+			goto out;
+	}
+
+	/* Plain TCP up to here, the first packets told the streams apart */
+	if (dtt_tls) {
+		bool client = dtt_path_cmp_addr(first_path);
+
+		err = dtt_tls_handshake(tcp_transport, &dsocket, client);
+		if (!err)
+			err = dtt_tls_handshake(tcp_transport, &csocket, client);
+		for (i = 1; !err && i < tcp_transport->mp.nr_socks; i++)
+			err = dtt_tls_handshake(tcp_transport, &tcp_transport->mp.socks[i], client);
+		if (err) {
+			if (err != -ERESTARTSYS && err != -EINTR) {
+				tr_warn(transport, "TLS handshake failed, err = %d\n", err);
+				err = -EAGAIN;
+			}
+			goto out;
+		}
+	}
+
 	connect_to_path->path.established = true;
 	drbd_path_event(transport, &connect_to_path->path);
 	dtt_put_listeners(transport);
@@ -1059,6 +1850,15 @@ randomize:
 	timeout = nc->timeout * HZ / 10;
 	rcu_read_unlock();
 
+	/* Accepted sockets got their buffer sizes from the listener, maybe
+	 * under an older net_conf; have the first uncork apply the current. */
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+		tcp_transport->bs[i] = (struct dtt_bufsize) {
+			.sndbuf = UINT_MAX,
+			.next_auto = jiffies,
+		};
+	}
+
 	dsocket->sk->sk_sndtimeo = timeout;
 	csocket->sk->sk_sndtimeo = timeout;
 
@@ -1066,6 +1866,26 @@ randomize:
 	if (err)
 		tr_warn(transport, "Failed to enable SO_KEEPALIVE %d\n", err);
 
+	memset(&tcp_transport->bp, 0, sizeof(tcp_transport->bp));
+	tcp_transport->tls = dtt_tls;
+	tcp_transport->notsent_lowat = min_t(unsigned int, READ_ONCE(dtt_notsent_lowat), INT_MAX >> 10) << 10;
+	if (tcp_transport->notsent_lowat)
+		dtt_set_notsent_lowat(tcp_transport, dsocket);
+
+	for (i = 1; i < tcp_transport->mp.nr_socks; i++) {
+		struct socket *s = tcp_transport->mp.socks[i];
+
+		s->sk->sk_reuse = SK_CAN_REUSE;
+		s->sk->sk_allocation = GFP_NOIO;
+		s->sk->sk_priority = TC_PRIO_INTERACTIVE_BULK;
+		dtt_nodelay(s);
+		s->sk->sk_sndtimeo = timeout;
+		s->sk->sk_rcvtimeo = dsocket->sk->sk_rcvtimeo;
+		kernel_setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (char *)&one, sizeof(one));
+		if (tcp_transport->notsent_lowat)
+			dtt_set_notsent_lowat(tcp_transport, s);
+	}
+
 	return 0;
 
 out_eagain:
@@ -1073,14 +1893,15 @@ out_eagain:
 
 out:
 	dtt_put_listeners(transport);
+	dtt_mp_free_socks(&tcp_transport->mp);
 
 	if (dsocket) {
 		kernel_sock_shutdown(dsocket, SHUT_RDWR);
-		sock_release(dsocket);
+		dtt_sock_release(dsocket);
 	}
 	if (csocket) {
 		kernel_sock_shutdown(csocket, SHUT_RDWR);
-		sock_release(csocket);
+		dtt_sock_release(csocket);
 	}
 
 	return err;
@@ -1091,11 +1912,17 @@ static void dtt_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[stream];
+	unsigned int i;
 
 	if (!socket)
 		return;
 
 	socket->sk->sk_rcvtimeo = timeout;
+
+	if (dtt_mp_striping(tcp_transport, stream)) {
+		for (i = 1; i < tcp_transport->mp.nr_socks; i++)
+			tcp_transport->mp.socks[i]->sk->sk_rcvtimeo = timeout;
+	}
 }
 
 static long dtt_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
@@ -1128,22 +1955,27 @@ static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
 		return;
 
 	sock = socket->sk;
-	if (sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5)
-		set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+	/* In latency mode the send buffer never fills up; the sender
+	 * blocking on the low watermark is what congestion looks like. */
+	if ((sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5 ||
+	     (tcp_transport->notsent_lowat && !sk_stream_memory_free(sock))) &&
+	    !test_and_set_bit(NET_CONGESTED, &tcp_transport->transport.flags))
+		tcp_transport->st[DATA_STREAM].congested++;
 }
 
-static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
-			 struct page *page, int offset, size_t size, unsigned msg_flags)
+static int _dtt_send_page(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+			  enum drbd_stream stream, struct page *page, int offset, size_t size,
+			  unsigned msg_flags)
 {
-	struct drbd_tcp_transport *tcp_transport =
-		container_of(transport, struct drbd_tcp_transport, transport);
-	struct socket *socket = tcp_transport->stream[stream];
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct dtt_stream_stats *st = &tcp_transport->st[stream];
 	mm_segment_t oldfs = get_fs();
+	ktime_t stall_kt = 0;
 	int len = size;
 	int err = -EIO;
 
-	if (!socket)
-		return -ENOTCONN;
+	if (!sk_stream_memory_free(socket->sk))
+		stall_kt = ktime_get();
 
 	msg_flags |= MSG_NOSIGNAL;
 	dtt_update_congested(tcp_transport);
@@ -1176,12 +2008,52 @@ static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stre
 	set_fs(oldfs);
 	clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
 
-	if (len == 0)
+	if (stall_kt)
+		st->stall_ns += ktime_to_ns(ktime_sub(ktime_get(), stall_kt));
+	if (len == 0) {
+		st->bytes_sent += size;
+		st->sends++;
 		err = 0;
+	}
 
 	return err;
 }
 
+static int dtt_mp_send_page(struct drbd_tcp_transport *tcp_transport, struct page *page,
+			    int offset, size_t size, unsigned msg_flags)
+{
+	struct dtt_multipath *mp = &tcp_transport->mp;
+	struct socket *socket = mp->socks[mp->send_seq % mp->nr_socks];
+	struct dtt_mp_header h = {
+		.seq = cpu_to_be32(mp->send_seq),
+		.length = cpu_to_be32(size),
+	};
+	int err;
+
+	err = _dtt_send(tcp_transport, socket, &h, sizeof(h), MSG_MORE);
+	if (err != sizeof(h))
+		return err < 0 ? err : -EIO;
+	mp->send_seq++;
+
+	return _dtt_send_page(tcp_transport, socket, DATA_STREAM, page, offset, size, msg_flags);
+}
+
+static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[stream];
+
+	if (!socket)
+		return -ENOTCONN;
+
+	if (dtt_mp_striping(tcp_transport, stream))
+		return dtt_mp_send_page(tcp_transport, page, offset, size, msg_flags);
+
+	return _dtt_send_page(tcp_transport, socket, stream, page, offset, size, msg_flags);
+}
+
 static int dtt_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
 {
 	struct bio_vec bvec;
@@ -1220,6 +2092,26 @@ static void dtt_quickack(struct socket *socket)
 	(void) kernel_setsockopt(socket, SOL_TCP, TCP_QUICKACK, (char *)&val, sizeof(val));
 }
 
+static void dtt_socket_hint(struct socket *socket, enum drbd_tr_hints hint)
+{
+	switch (hint) {
+	case CORK:
+		dtt_cork(socket);
+		break;
+	case UNCORK:
+		dtt_uncork(socket);
+		break;
+	case NODELAY:
+		dtt_nodelay(socket);
+		break;
+	case QUICKACK:
+		dtt_quickack(socket);
+		break;
+	default:
+		break;
+	}
+}
+
 static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
 		enum drbd_tr_hints hint)
 {
@@ -1227,27 +2119,29 @@ static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
 		container_of(transport, struct drbd_tcp_transport, transport);
 	bool rv = true;
 	struct socket *socket = tcp_transport->stream[stream];
+	unsigned int i;
 
 	if (!socket)
 		return false;
 
+	if (dtt_mp_striping(tcp_transport, stream) && hint != NOSPACE) {
+		for (i = 1; i < tcp_transport->mp.nr_socks; i++)
+			dtt_socket_hint(tcp_transport->mp.socks[i], hint);
+	}
+
 	switch (hint) {
 	case CORK:
-		dtt_cork(socket);
-		break;
 	case UNCORK:
-		dtt_uncork(socket);
-		break;
 	case NODELAY:
-		dtt_nodelay(socket);
+	case QUICKACK:
+		dtt_socket_hint(socket, hint);
+		if (hint == UNCORK)
+			dtt_update_bufsize(tcp_transport, stream);
 		break;
 	case NOSPACE:
 		if (socket->sk->sk_socket)
 			set_bit(SOCK_NOSPACE, &socket->sk->sk_socket->flags);
 		break;
-	case QUICKACK:
-		dtt_quickack(socket);
-		break;
 	default: /* not implemented, but should not trigger error handling */
 		return true;
 	}
@@ -1266,6 +2160,23 @@ static void dtt_debugfs_show_stream(struct seq_file *m, struct socket *socket)
 		   tp->write_seq - tp->snd_una);
 	seq_printf(m, "send buffer size: %u Byte\n", sk->sk_sndbuf);
 	seq_printf(m, "send buffer used: %u Byte\n", sk->sk_wmem_queued);
+	seq_printf(m, "not yet sent: %u Byte\n", tp->write_seq - tp->snd_nxt);
+	seq_printf(m, "retransmits: %u\n", tp->total_retrans);
+	seq_printf(m, "srtt: %u us\n", tp->srtt_us >> 3);
+	seq_printf(m, "cwnd: %u\n", tp->snd_cwnd);
+}
+
+/* One line per stream, "key=value" pairs, for exporters */
+static void dtt_debugfs_show_stats(struct seq_file *m, const char *name,
+				   struct dtt_stream_stats *st)
+{
+	seq_printf(m, "%s stats: bytes_sent=%llu sends=%llu bytes_received=%llu stall_ns=%llu congested=%u\n",
+		   name,
+		   (unsigned long long)st->bytes_sent,
+		   (unsigned long long)st->sends,
+		   (unsigned long long)st->bytes_received,
+		   (unsigned long long)st->stall_ns,
+		   st->congested);
 }
 
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
@@ -1275,17 +2186,41 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 	enum drbd_stream i;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 6);
+
+	seq_printf(m, "tls: %s\n", tcp_transport->tls ? "yes" : "no");
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
 		struct socket *socket = tcp_transport->stream[i];
+		const char *name = i == DATA_STREAM ? "data" : "control";
 
+		dtt_debugfs_show_stats(m, name, &tcp_transport->st[i]);
 		if (socket) {
-			seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+			seq_printf(m, "%s stream\n", name);
 			dtt_debugfs_show_stream(m, socket);
 		}
 	}
 
+	if (dtt_mp_striping(tcp_transport, DATA_STREAM)) {
+		unsigned int j;
+
+		for (j = 1; j < tcp_transport->mp.nr_socks; j++) {
+			seq_printf(m, "data stream path %u\n", j);
+			dtt_debugfs_show_stream(m, tcp_transport->mp.socks[j]);
+		}
+	}
+
+	if (tcp_transport->rb.recvmsgs)
+		seq_printf(m, "data stream receive batch: %u KiB recvmsgs: %llu bytes: %llu direct: %llu\n",
+			   tcp_transport->rb.size / 1024,
+			   (unsigned long long)tcp_transport->rb.recvmsgs,
+			   (unsigned long long)tcp_transport->rb.bytes,
+			   (unsigned long long)tcp_transport->rb.direct);
+
+	if (tcp_transport->bp.hits || tcp_transport->bp.misses)
+		seq_printf(m, "control stream busy poll: %llu usec hits: %u misses: %u\n",
+			   (unsigned long long)div_u64(tcp_transport->bp.ns, NSEC_PER_USEC),
+			   tcp_transport->bp.hits, tcp_transport->bp.misses);
 }
 
 static int dtt_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
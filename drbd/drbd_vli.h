@@ -127,28 +127,40 @@ prefix    data bits                                    max val  Nº data bits
 	LEVEL(64, 8, 0xff); \
 	} while (0)
 
-/* finds a suitable level to decode the least significant part of in.
- * returns number of bits consumed.
- *
- * BUG() for bad input, as that would mean a buggy code table. */
-static inline int vli_decode_bits(u64 *out, const u64 in)
+/* The same code table by level, for decoding: total bits, prefix bits, and
+ * the smallest value of each level ("max val" of the level before, plus 1) */
+static const u8 vli_dec_total[10] = { 2, 3, 5, 7, 10, 14, 21, 29, 42, 64 };
+static const u8 vli_dec_prefix[10] = { 1, 2, 3, 4, 5, 6, 8, 8, 8, 8 };
+static const u64 vli_dec_adj[10] = {
+	0x1, 0x3, 0x5, 0x9, 0x11, 0x31, 0x131, 0x2131, 0x202131, 0x400202131
+};
+
+/* The level of the code in the least significant bits of in: the prefix is
+ * the number of trailing ones, up to five; with six or more, bits 6 and 7
+ * tell the four 8 bit prefixes apart.  No search through the levels. */
+static inline unsigned int vli_level(const u64 in)
 {
-	u64 adj = 1;
+	unsigned int ones = __ffs((~in & 0xff) | 0x100);
 
-#define LEVEL(t,b,v)					\
-	do {						\
-		if ((in & ((1 << b) -1)) == v) {	\
-			*out = ((in & ((~0ULL) >> (64-t))) >> b) + adj;	\
-			return t;			\
-		}					\
-		adj += 1ULL << (t - b);			\
-	} while (0)
+	return ones < 6 ? ones : 6 + ((in >> 6) & 3);
+}
 
-	VLI_L_1_1();
+/* number of bits of the code in the least significant bits of in */
+static inline int vli_code_bits(const u64 in)
+{
+	return vli_dec_total[vli_level(in)];
+}
 
-	/* NOT REACHED, if VLI_LEVELS code table is defined properly */
-	BUG();
-#undef LEVEL
+/* decodes the least significant part of in.
+ * returns number of bits consumed.
+ * Every bit pattern is a valid code. */
+static inline int vli_decode_bits(u64 *out, const u64 in)
+{
+	unsigned int l = vli_level(in);
+	unsigned int t = vli_dec_total[l];
+
+	*out = ((in & ((~0ULL) >> (64 - t))) >> vli_dec_prefix[l]) + vli_dec_adj[l];
+	return t;
 }
 
 /* return number of code bits needed,
@@ -336,4 +348,255 @@ static inline int vli_encode_bits(struct bitstream *bs, u64 in)
 	return bitstream_put_bits(bs, code, bits);
 }
 
+/*
+ * Runlength coding with an adaptive binary range coder, DRBD_BM_CODE_RLE_RC.
+ *
+ * The fixed VLI code above cannot adapt to the statistics of a particular
+ * bitmap. For fragmented bitmaps, where the runlengths of set and of clear
+ * bits follow rather different distributions, an adaptive code gets much
+ * closer to their entropy.
+ *
+ * A runlength rl is coded as its number of significant bits n = fls64(rl),
+ * with a 6 bit tree of adaptive probabilities per polarity, followed by the
+ * bits below the leading one: the three highest with adaptive probabilities
+ * depending on polarity and n, the rest as direct bits.
+ *
+ * The range coder is the one known from LZMA: 11 bit probabilities, a
+ * 32 bit range, carry propagation through a cached byte. The models start
+ * over with every packet, so each packet can be decoded on its own.
+ *
+ * Packet layout, behind p_compressed_bm.encoding:
+ *   be32 number of runlengths, then the range coder output.
+ */
+
+#define DRBD_BM_CODE_RLE_RC	3	/* next to RLE_VLI_Bits */
+
+/* No bits at all, but be64 xxh64 digest and be64 weight of the bitmap of
+ * the sender, see drbd_bm_digest() */
+#define DRBD_BM_CODE_DIGEST	4
+
+#define RC_PROB_BITS	11
+#define RC_PROB_INIT	(1U << (RC_PROB_BITS - 1))
+#define RC_MOVE_BITS	5
+#define RC_TOP		(1U << 24)
+
+/* upper bound of the coder output for a single runlength, in bytes */
+#define RC_MAX_RUN_BYTES	20
+
+#define RC_MID_BITS	3
+#define RC_MID_CTX	16
+
+struct drbd_bm_rc_model {
+	u16 n_tree[2][64];
+	u16 mid_tree[2][RC_MID_CTX + 1][1 << RC_MID_BITS];
+};
+
+static inline void rc_model_init(struct drbd_bm_rc_model *m)
+{
+	u16 *p = (u16 *)m;
+	int i;
+
+	for (i = 0; i < sizeof(*m) / sizeof(*p); i++)
+		p[i] = RC_PROB_INIT;
+}
+
+struct rc_encoder {
+	u64 low;
+	u32 range;
+	u8 cache;
+	size_t cache_size;
+	unsigned char *buf, *pos, *end;
+};
+
+static inline void rc_enc_init(struct rc_encoder *rc, void *s, size_t len)
+{
+	rc->low = 0;
+	rc->range = 0xFFFFFFFF;
+	rc->cache = 0;
+	rc->cache_size = 1;
+	rc->buf = rc->pos = s;
+	rc->end = rc->buf + len;
+}
+
+/* Is there room for another runlength, and for flushing the coder? */
+static inline bool rc_enc_room(struct rc_encoder *rc)
+{
+	return rc->pos + rc->cache_size + 4 + RC_MAX_RUN_BYTES <= rc->end;
+}
+
+static inline void rc_shift_low(struct rc_encoder *rc)
+{
+	if ((u32)rc->low < 0xFF000000U || (rc->low >> 32) != 0) {
+		u8 temp = rc->cache;
+
+		do {
+			*rc->pos++ = temp + (u8)(rc->low >> 32);
+			temp = 0xFF;
+		} while (--rc->cache_size != 0);
+		rc->cache = (u8)(rc->low >> 24);
+	}
+	rc->cache_size++;
+	rc->low = (rc->low & 0x00FFFFFF) << 8;
+}
+
+static inline void rc_enc_bit(struct rc_encoder *rc, u16 *prob, int bit)
+{
+	u32 bound = (rc->range >> RC_PROB_BITS) * *prob;
+
+	if (!bit) {
+		rc->range = bound;
+		*prob += ((1U << RC_PROB_BITS) - *prob) >> RC_MOVE_BITS;
+	} else {
+		rc->low += bound;
+		rc->range -= bound;
+		*prob -= *prob >> RC_MOVE_BITS;
+	}
+	while (rc->range < RC_TOP) {
+		rc->range <<= 8;
+		rc_shift_low(rc);
+	}
+}
+
+static inline void rc_enc_direct_bits(struct rc_encoder *rc, u64 val, int bits)
+{
+	while (bits--) {
+		rc->range >>= 1;
+		if ((val >> bits) & 1)
+			rc->low += rc->range;
+		while (rc->range < RC_TOP) {
+			rc->range <<= 8;
+			rc_shift_low(rc);
+		}
+	}
+}
+
+static inline void rc_enc_tree(struct rc_encoder *rc, u16 *probs, u32 sym, int bits)
+{
+	u32 m = 1;
+
+	while (bits--) {
+		int bit = (sym >> bits) & 1;
+
+		rc_enc_bit(rc, &probs[m], bit);
+		m = (m << 1) | bit;
+	}
+}
+
+/* Returns the number of bytes in the buffer */
+static inline size_t rc_enc_flush(struct rc_encoder *rc)
+{
+	int i;
+
+	for (i = 0; i < 5; i++)
+		rc_shift_low(rc);
+	return rc->pos - rc->buf;
+}
+
+static inline void rc_encode_runlength(struct rc_encoder *rc, struct drbd_bm_rc_model *m,
+				       int toggle, u64 rl)
+{
+	int n = fls64(rl);
+	int low_bits = n - 1;
+	int mid = min(low_bits, RC_MID_BITS);
+
+	rc_enc_tree(rc, m->n_tree[toggle], n - 1, 6);
+	if (mid)
+		rc_enc_tree(rc, m->mid_tree[toggle][min(n, RC_MID_CTX)],
+			    (rl >> (low_bits - mid)) & ((1U << mid) - 1), mid);
+	rc_enc_direct_bits(rc, rl, low_bits - mid);
+}
+
+struct rc_decoder {
+	u32 range;
+	u32 code;
+	const unsigned char *pos, *end;
+	bool overrun;
+};
+
+static inline u8 rc_in_byte(struct rc_decoder *rc)
+{
+	if (rc->pos < rc->end)
+		return *rc->pos++;
+	rc->overrun = true;
+	return 0;
+}
+
+static inline void rc_dec_init(struct rc_decoder *rc, const void *s, size_t len)
+{
+	int i;
+
+	rc->pos = s;
+	rc->end = rc->pos + len;
+	rc->overrun = false;
+	rc->range = 0xFFFFFFFF;
+	rc->code = 0;
+	for (i = 0; i < 5; i++)
+		rc->code = (rc->code << 8) | rc_in_byte(rc);
+}
+
+static inline int rc_dec_bit(struct rc_decoder *rc, u16 *prob)
+{
+	u32 bound = (rc->range >> RC_PROB_BITS) * *prob;
+	int bit;
+
+	if (rc->code < bound) {
+		rc->range = bound;
+		*prob += ((1U << RC_PROB_BITS) - *prob) >> RC_MOVE_BITS;
+		bit = 0;
+	} else {
+		rc->range -= bound;
+		rc->code -= bound;
+		*prob -= *prob >> RC_MOVE_BITS;
+		bit = 1;
+	}
+	while (rc->range < RC_TOP) {
+		rc->range <<= 8;
+		rc->code = (rc->code << 8) | rc_in_byte(rc);
+	}
+	return bit;
+}
+
+static inline u64 rc_dec_direct_bits(struct rc_decoder *rc, int bits)
+{
+	u64 val = 0;
+
+	while (bits--) {
+		rc->range >>= 1;
+		val <<= 1;
+		if (rc->code >= rc->range) {
+			rc->code -= rc->range;
+			val |= 1;
+		}
+		while (rc->range < RC_TOP) {
+			rc->range <<= 8;
+			rc->code = (rc->code << 8) | rc_in_byte(rc);
+		}
+	}
+	return val;
+}
+
+static inline u32 rc_dec_tree(struct rc_decoder *rc, u16 *probs, int bits)
+{
+	u32 m = 1;
+	int i;
+
+	for (i = 0; i < bits; i++)
+		m = (m << 1) | rc_dec_bit(rc, &probs[m]);
+	return m - (1U << bits);
+}
+
+static inline u64 rc_decode_runlength(struct rc_decoder *rc, struct drbd_bm_rc_model *m,
+				      int toggle)
+{
+	int n = rc_dec_tree(rc, m->n_tree[toggle], 6) + 1;
+	int low_bits = n - 1;
+	int mid = min(low_bits, RC_MID_BITS);
+	u64 rl = 1;
+
+	if (mid)
+		rl = (rl << mid) | rc_dec_tree(rc, m->mid_tree[toggle][min(n, RC_MID_CTX)], mid);
+	rl = (rl << (low_bits - mid)) | rc_dec_direct_bits(rc, low_bits - mid);
+	return rl;
+}
+
 #endif
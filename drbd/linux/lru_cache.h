@@ -19,6 +19,7 @@
 #include <linux/bitops.h>
 #include <linux/string.h> /* for memset */
 #include <linux/seq_file.h>
+#include <linux/atomic.h>
 
 /*
 This header file (and its .c file; kernel-doc of functions see there)
@@ -147,7 +148,9 @@ write intent log information, three of which are mentioned here.
 struct lc_element {
 	struct hlist_node colision;
 	struct list_head list;		 /* LRU list or free list */
-	unsigned refcnt;
+	/* changes from and to zero only under the users lock,
+	 * see lc_try_get_fast() for the other changes */
+	atomic_t refcnt;
 	/* back "pointer" into lc_cache->element[index],
 	 * for paranoia, and for "lc_element_to_index" */
 	unsigned lc_index;
@@ -159,11 +162,24 @@ struct lc_element {
 
 	/* for pending changes */
 	unsigned lc_new_number;
+
+	/* LC_POLICY_2Q: referenced again after it had been evicted from the
+	 * "seen once" queue; kept on the lru list instead of lru_once */
+	bool lc_frequent;
+};
+
+/* Replacement policy, see lc_set_policy() */
+enum lc_policy {
+	LC_POLICY_LRU,
+	LC_POLICY_2Q,
 };
 
 struct lru_cache {
 	/* the least recently used item is kept at lru->prev */
 	struct list_head lru;
+	/* LC_POLICY_2Q: unused elements only referenced in one stretch
+	 * since they came in, evicted before those on lru */
+	struct list_head lru_once;
 	struct list_head free;
 	struct list_head in_use;
 	struct list_head to_be_changed;
@@ -194,6 +210,26 @@ struct lru_cache {
 	/* statistics */
 	unsigned used; /* number of elements currently on in_use list */
 	unsigned long hits, misses, starving, locked, changed;
+	unsigned long evicted;	/* labels replaced, not counting free elements */
+	unsigned long promoted;	/* LC_POLICY_2Q: misses found in the ghost filter */
+	unsigned long retired;	/* labels dropped by lc_retire_unused() */
+
+	/* soft limit on labelled elements, see lc_set_max_active() */
+	unsigned int max_active;
+	unsigned int nr_free;	  /* elements on the free list */
+	unsigned int nr_retiring; /* on to_be_changed, becoming free */
+
+	enum lc_policy policy;
+	/* LC_POLICY_2Q */
+	unsigned int nr_once;	 /* elements not lc_frequent, in use or on lru_once */
+	unsigned int max_once;	 /* up to that many, evict from lru only */
+	/* "ghost" filter of labels recently evicted from lru_once: two
+	 * generations of ghost_bits bits, the older one is dropped once the
+	 * current has seen nr_elements/2 insertions */
+	unsigned long *ghost[2];
+	unsigned int ghost_bits;
+	unsigned int ghost_cur;
+	unsigned int ghost_inserted;
 
 	/* see below: flag-bits for lru_cache */
 	unsigned long flags;
@@ -202,8 +238,11 @@ struct lru_cache {
 	void  *lc_private;
 	const char *name;
 
-	/* nr_elements there */
+	/* 1 << hash_shift there, at least twice nr_elements */
 	struct hlist_head *lc_slot;
+	unsigned int hash_shift;
+	/* hash chain walks under the lock, and elements looked at */
+	unsigned long lookups, probes;
 	struct lc_element **lc_element;
 };
 
@@ -240,6 +279,9 @@ extern struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 		unsigned max_pending_changes,
 		unsigned e_count, size_t e_size, size_t e_off);
 extern void lc_reset(struct lru_cache *lc);
+extern int lc_set_policy(struct lru_cache *lc, enum lc_policy policy);
+extern void lc_set_max_active(struct lru_cache *lc, unsigned int max_active);
+extern unsigned int lc_retire_unused(struct lru_cache *lc);
 extern void lc_destroy(struct lru_cache *lc);
 extern void lc_set(struct lru_cache *lc, unsigned int enr, int index);
 extern void lc_del(struct lru_cache *lc, struct lc_element *element);
@@ -251,6 +293,12 @@ extern struct lc_element *lc_get(struct lru_cache *lc, unsigned int enr);
 extern unsigned int lc_put(struct lru_cache *lc, struct lc_element *e);
 extern void lc_committed(struct lru_cache *lc);
 
+/* labelled elements: in use, unused on the lru lists, or about to be changed */
+static inline unsigned int lc_nr_active(struct lru_cache *lc)
+{
+	return lc->nr_elements - lc->nr_free - lc->nr_retiring;
+}
+
 struct seq_file;
 extern void lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc);
 
@@ -293,6 +341,21 @@ static inline void lc_unlock(struct lru_cache *lc)
 
 extern bool lc_is_used(struct lru_cache *lc, unsigned int enr);
 
+extern struct lc_element *lc_try_get_fast(struct lru_cache *lc, unsigned int enr);
+extern struct lc_element *lc_find_fast(struct lru_cache *lc, unsigned int enr);
+
+/**
+ * lc_put_fast - give up a reference on @e, unless it is the last one
+ * @e: the element to put
+ *
+ * Does not need the lock serializing the other lc_* calls.  Returns false
+ * if this would drop the last reference, the caller then needs to lc_put().
+ */
+static inline bool lc_put_fast(struct lc_element *e)
+{
+	return atomic_add_unless(&e->refcnt, -1, 1);
+}
+
 #define lc_entry(ptr, type, member) \
 	container_of(ptr, type, member)
 
@@ -12,6 +12,9 @@
 #include <linux/slab.h>
 #include <linux/string.h> /* for memset */
 #include <linux/seq_file.h> /* for seq_printf */
+#include <linux/rculist.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 #include <linux/lru_cache.h>
 #include "drbd_wrappers.h"
 
@@ -74,6 +77,7 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	struct lru_cache *lc;
 	struct lc_element *e;
 	unsigned cache_obj_size = kmem_cache_size(cache);
+	unsigned int hash_shift;
 	unsigned i;
 
 	WARN_ON(cache_obj_size < e_size);
@@ -85,7 +89,10 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	if (e_count > LC_MAX_ACTIVE)
 		return NULL;
 
-	slot = kcalloc(e_count, sizeof(struct hlist_head), GFP_KERNEL);
+	/* A load factor of at most one half keeps the chains at about one
+	 * element, however large e_count gets */
+	hash_shift = ilog2(roundup_pow_of_two(max(e_count * 2, 64U)));
+	slot = kvzalloc(sizeof(struct hlist_head) << hash_shift, GFP_KERNEL);
 	if (!slot)
 		goto out_fail;
 	element = kzalloc(e_count * sizeof(struct lc_element *), GFP_KERNEL);
@@ -98,6 +105,7 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 
 	INIT_LIST_HEAD(&lc->in_use);
 	INIT_LIST_HEAD(&lc->lru);
+	INIT_LIST_HEAD(&lc->lru_once);
 	INIT_LIST_HEAD(&lc->free);
 	INIT_LIST_HEAD(&lc->to_be_changed);
 
@@ -105,10 +113,13 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	lc->element_size = e_size;
 	lc->element_off = e_off;
 	lc->nr_elements = e_count;
+	lc->max_active = e_count;
+	lc->nr_free = e_count;
 	lc->max_pending_changes = max_pending_changes;
 	lc->lc_cache = cache;
 	lc->lc_element = element;
 	lc->lc_slot = slot;
+	lc->hash_shift = hash_shift;
 
 	/* preallocate all objects */
 	for (i = 0; i < e_count; i++) {
@@ -134,7 +145,7 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	kfree(lc);
 out_fail:
 	kfree(element);
-	kfree(slot);
+	kvfree(slot);
 	return NULL;
 }
 
@@ -159,8 +170,10 @@ void lc_destroy(struct lru_cache *lc)
 		return;
 	for (i = 0; i < lc->nr_elements; i++)
 		lc_free_by_index(lc, i);
+	bitmap_free(lc->ghost[0]);
+	bitmap_free(lc->ghost[1]);
 	kfree(lc->lc_element);
-	kfree(lc->lc_slot);
+	kvfree(lc->lc_slot);
 	kfree(lc);
 }
 
@@ -177,6 +190,7 @@ void lc_reset(struct lru_cache *lc)
 
 	INIT_LIST_HEAD(&lc->in_use);
 	INIT_LIST_HEAD(&lc->lru);
+	INIT_LIST_HEAD(&lc->lru_once);
 	INIT_LIST_HEAD(&lc->free);
 	INIT_LIST_HEAD(&lc->to_be_changed);
 	lc->used = 0;
@@ -185,9 +199,23 @@ void lc_reset(struct lru_cache *lc)
 	lc->starving = 0;
 	lc->locked = 0;
 	lc->changed = 0;
+	lc->evicted = 0;
+	lc->promoted = 0;
+	lc->retired = 0;
+	lc->lookups = 0;
+	lc->probes = 0;
+	lc->max_active = lc->nr_elements;
+	lc->nr_free = lc->nr_elements;
+	lc->nr_retiring = 0;
 	lc->pending_changes = 0;
 	lc->flags = 0;
-	memset(lc->lc_slot, 0, sizeof(struct hlist_head) * lc->nr_elements);
+	lc->nr_once = 0;
+	if (lc->ghost[0]) {
+		bitmap_zero(lc->ghost[0], lc->ghost_bits);
+		bitmap_zero(lc->ghost[1], lc->ghost_bits);
+		lc->ghost_inserted = 0;
+	}
+	memset(lc->lc_slot, 0, sizeof(struct hlist_head) << lc->hash_shift);
 
 	for (i = 0; i < lc->nr_elements; i++) {
 		struct lc_element *e = lc->lc_element[i];
@@ -202,6 +230,150 @@ void lc_reset(struct lru_cache *lc)
 	}
 }
 
+/**
+ * lc_set_policy - choose the replacement policy of @lc
+ * @lc: the lru cache to operate on, freshly created or reset
+ * @policy: %LC_POLICY_LRU (the default), or %LC_POLICY_2Q
+ *
+ * %LC_POLICY_2Q is scan resistant: a newly pulled in label goes to the
+ * "seen once" queue (lru_once once unused), which is evicted first as long as
+ * it holds more than a quarter of the elements.  Only labels that are
+ * referenced again within a while after their eviction from there (found in
+ * a compact "ghost" filter of recently evicted labels) come back as
+ * "frequent", and are kept on the lru list.  A single sequential pass thus
+ * does not push out the working set.
+ *
+ * Returns 0, or -ENOMEM.
+ */
+int lc_set_policy(struct lru_cache *lc, enum lc_policy policy)
+{
+	if (policy == LC_POLICY_2Q && !lc->ghost[0]) {
+		/* about four bits per remembered label */
+		unsigned int bits = roundup_pow_of_two(max(lc->nr_elements * 2, 64U));
+
+		lc->ghost[0] = bitmap_zalloc(bits, GFP_KERNEL);
+		lc->ghost[1] = bitmap_zalloc(bits, GFP_KERNEL);
+		if (!lc->ghost[0] || !lc->ghost[1]) {
+			bitmap_free(lc->ghost[0]);
+			bitmap_free(lc->ghost[1]);
+			lc->ghost[0] = lc->ghost[1] = NULL;
+			return -ENOMEM;
+		}
+		lc->ghost_bits = bits;
+		lc->ghost_cur = 0;
+		lc->ghost_inserted = 0;
+	}
+	lc->max_once = lc->nr_elements / 4;
+	lc->policy = policy;
+	return 0;
+}
+
+/**
+ * lc_set_max_active - set a soft limit on the number of labelled elements
+ * @lc: the lru cache to operate on
+ * @max_active: the limit, clamped to 1 .. @lc->nr_elements
+ *
+ * Below the limit, a new label uses a free element, at or above it an unused
+ * one is recycled instead; only if there is none, the limit is exceeded.  A
+ * lowered limit is reached by lc_retire_unused().
+ */
+void lc_set_max_active(struct lru_cache *lc, unsigned int max_active)
+{
+	lc->max_active = clamp(max_active, 1U, lc->nr_elements);
+}
+
+/**
+ * lc_retire_unused - drop unused labels above the soft limit
+ * @lc: the lru cache to operate on, locked for a transaction
+ *
+ * Above lc_set_max_active(), puts unused elements on the to_be_changed list
+ * with %LC_FREE as their new label, as long as there is room in the pending
+ * transaction.  Like any other change, they become free with lc_committed().
+ * Other than lc_del(), this lets the user record the removal, and write out
+ * whatever it tracks for the old label, before that is gone from its log.
+ *
+ * Returns the number of elements retired.
+ */
+unsigned int lc_retire_unused(struct lru_cache *lc)
+{
+	unsigned int n = 0;
+	struct lc_element *e;
+
+	while (lc_nr_active(lc) > lc->max_active &&
+	       lc->pending_changes < lc->max_pending_changes) {
+		e = lc_evict_candidate(lc);
+		if (!e)
+			break;
+		PARANOIA_LC_ELEMENT(lc, e);
+		lc_account_eviction(lc, e);
+		/* not on lru_once, nor counted in nr_once, anymore */
+		e->lc_frequent = true;
+		WRITE_ONCE(e->lc_new_number, LC_FREE);
+		hlist_del_init_rcu(&e->colision);
+		list_move(&e->list, &lc->to_be_changed);
+		lc->nr_retiring++;
+		lc->pending_changes++;
+		lc->retired++;
+		n++;
+	}
+	return n;
+}
+
+static unsigned int lc_ghost_bit(struct lru_cache *lc, unsigned int enr)
+{
+	return hash_32(enr, ilog2(lc->ghost_bits));
+}
+
+static void lc_ghost_add(struct lru_cache *lc, unsigned int enr)
+{
+	if (++lc->ghost_inserted > lc->nr_elements / 2) {
+		lc->ghost_cur ^= 1;
+		bitmap_zero(lc->ghost[lc->ghost_cur], lc->ghost_bits);
+		lc->ghost_inserted = 1;
+	}
+	__set_bit(lc_ghost_bit(lc, enr), lc->ghost[lc->ghost_cur]);
+}
+
+static bool lc_ghost_test(struct lru_cache *lc, unsigned int enr)
+{
+	unsigned int bit = lc_ghost_bit(lc, enr);
+
+	return test_bit(bit, lc->ghost[0]) || test_bit(bit, lc->ghost[1]);
+}
+
+/* unused elements go to lru_once, or lru */
+static struct list_head *lc_unused_list(struct lru_cache *lc, struct lc_element *e)
+{
+	if (lc->policy == LC_POLICY_2Q && !e->lc_frequent)
+		return &lc->lru_once;
+	return &lc->lru;
+}
+
+/* Chain lengths: the longest one now, and the average number of elements
+ * looked at per lookup under the lock so far, in hundredths */
+static void lc_seq_printf_hash_stats(struct seq_file *seq, struct lru_cache *lc)
+{
+	unsigned int i, n, longest = 0, chains = 0;
+	unsigned long probes_x100;
+	struct lc_element *e;
+
+	/* not necessarily under the lock, see __lc_find() */
+	rcu_read_lock();
+	for (i = 0; i < 1U << lc->hash_shift; i++) {
+		n = 0;
+		hlist_for_each_entry_rcu(e, lc->lc_slot + i, colision)
+			n++;
+		if (n)
+			chains++;
+		longest = max(longest, n);
+	}
+	rcu_read_unlock();
+	probes_x100 = lc->lookups ? lc->probes * 100 / lc->lookups : 0;
+	seq_printf(seq, " hash slots:%u chains:%u longest:%u probes/lookup:%lu.%02lu",
+		   1U << lc->hash_shift, chains, longest,
+		   probes_x100 / 100, probes_x100 % 100);
+}
+
 /**
  * lc_seq_printf_stats - print stats about @lc into @seq
  * @seq: the seq_file to print into
@@ -216,17 +388,31 @@ void lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc)
 	 * progress) and "changed", when this in fact lead to an successful
 	 * update of the cache.
 	 */
-	seq_printf(seq, "\t%s: used:%u/%u hits:%lu misses:%lu starving:%lu locked:%lu changed:%lu\n",
+	seq_printf(seq, "\t%s: used:%u/%u hits:%lu misses:%lu starving:%lu locked:%lu changed:%lu evicted:%lu",
 		   lc->name, lc->used, lc->nr_elements,
-		   lc->hits, lc->misses, lc->starving, lc->locked, lc->changed);
+		   lc->hits, lc->misses, lc->starving, lc->locked, lc->changed, lc->evicted);
+	if (lc->policy == LC_POLICY_2Q)
+		seq_printf(seq, " 2q once:%u/%u promoted:%lu",
+			   lc->nr_once, lc->max_once, lc->promoted);
+	if (lc->max_active < lc->nr_elements || lc->retired)
+		seq_printf(seq, " active:%u/%u retired:%lu",
+			   lc_nr_active(lc), lc->max_active, lc->retired);
+	lc_seq_printf_hash_stats(seq, lc);
+	seq_putc(seq, '\n');
 }
 
 static struct hlist_head *lc_hash_slot(struct lru_cache *lc, unsigned int enr)
 {
-	return  lc->lc_slot + (enr % lc->nr_elements);
+	return  lc->lc_slot + hash_32(enr, lc->hash_shift);
 }
 
 
+/*
+ * Hash chains are changed with the rcu list primitives, so that
+ * lc_try_get_fast() can walk them without the users lock.  The elements
+ * themselves live as long as the lru_cache; whoever lc_destroy()s it while
+ * there may be such lockless walkers needs a synchronize_rcu() first.
+ */
 static struct lc_element *__lc_find(struct lru_cache *lc, unsigned int enr,
 		bool include_changing)
 {
@@ -234,7 +420,9 @@ static struct lc_element *__lc_find(struct lru_cache *lc, unsigned int enr,
 
 	BUG_ON(!lc);
 	BUG_ON(!lc->nr_elements);
+	lc->lookups++;
 	hlist_for_each_entry(e, lc_hash_slot(lc, enr), colision) {
+		lc->probes++;
 		/* "about to be changed" elements, pending transaction commit,
 		 * are hashed by their "new number". "Normal" elements have
 		 * lc_number == lc_new_number. */
@@ -276,7 +464,69 @@ struct lc_element *lc_find(struct lru_cache *lc, unsigned int enr)
 bool lc_is_used(struct lru_cache *lc, unsigned int enr)
 {
 	struct lc_element *e = __lc_find(lc, enr, 1);
-	return e && e->refcnt;
+	return e && atomic_read(&e->refcnt);
+}
+
+/**
+ * lc_try_get_fast - take one more reference on an element already in use
+ * @lc: The lru_cache object
+ * @enr: element number
+ *
+ * Lockless variant of lc_try_get() for frequent hits: only succeeds for
+ * committed elements which already have a non-zero refcnt.  Those are on the
+ * in_use list, and cannot change their label, so no list or statistics update
+ * is needed.  Everything else has to go through lc_get() and friends, under
+ * the users lock.
+ *
+ * Returns NULL, or the element for @enr with its refcnt increased.
+ * In the rare case that the element changed its label before we got our
+ * reference, and ours became the last one, that element is returned; the
+ * caller recognizes it by its lc_number, and lc_put()s it under the lock.
+ */
+struct lc_element *lc_try_get_fast(struct lru_cache *lc, unsigned int enr)
+{
+	struct lc_element *e;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(e, lc_hash_slot(lc, enr), colision) {
+		if (READ_ONCE(e->lc_new_number) != enr)
+			continue;
+		/* implies a full memory barrier on success */
+		if (!atomic_inc_not_zero(&e->refcnt))
+			break;
+		if (READ_ONCE(e->lc_number) == enr && READ_ONCE(e->lc_new_number) == enr)
+			goto out;
+		/* Recycled meanwhile.  Others hold references until that is
+		 * committed, so if this is the last one, it is committed now. */
+		if (!lc_put_fast(e))
+			goto out;
+		break;
+	}
+	e = NULL;
+ out:
+	rcu_read_unlock();
+	return e;
+}
+
+/**
+ * lc_find_fast - lockless lc_find() for an element the caller holds a reference on
+ * @lc: The lru_cache object
+ * @enr: element number
+ *
+ * May miss the element because of concurrent hash chain changes;
+ * the caller then has to fall back to lc_find() under the lock.
+ */
+struct lc_element *lc_find_fast(struct lru_cache *lc, unsigned int enr)
+{
+	struct lc_element *e;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(e, lc_hash_slot(lc, enr), colision) {
+		if (READ_ONCE(e->lc_new_number) == enr && READ_ONCE(e->lc_number) == enr)
+			break;
+	}
+	rcu_read_unlock();
+	return e;
 }
 
 /**
@@ -291,33 +541,81 @@ void lc_del(struct lru_cache *lc, struct lc_element *e)
 {
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
-	BUG_ON(e->refcnt);
-
+	BUG_ON(atomic_read(&e->refcnt));
+
+	if (e->lc_number != LC_FREE && !e->lc_frequent && lc->policy == LC_POLICY_2Q)
+		lc->nr_once--;
+	if (e->lc_new_number != LC_FREE)
+		lc->nr_free++;
+	else if (e->lc_number != LC_FREE) {
+		lc->nr_retiring--;
+		lc->nr_free++;
+	}
 	e->lc_number = e->lc_new_number = LC_FREE;
-	hlist_del_init(&e->colision);
+	hlist_del_init_rcu(&e->colision);
 	list_move(&e->list, &lc->free);
 	RETURN();
 }
 
-static struct lc_element *lc_prepare_for_change(struct lru_cache *lc, unsigned new_number)
+/* the unused element to recycle next, ignoring the free list */
+static struct lc_element *lc_evict_candidate(struct lru_cache *lc)
 {
 	struct list_head *n;
-	struct lc_element *e;
 
-	if (!list_empty(&lc->free))
-		n = lc->free.next;
+	if (!list_empty(&lc->lru_once) &&
+	    (lc->nr_once > lc->max_once || list_empty(&lc->lru)))
+		n = lc->lru_once.prev;
 	else if (!list_empty(&lc->lru))
 		n = lc->lru.prev;
+	else if (!list_empty(&lc->lru_once))
+		n = lc->lru_once.prev;
 	else
 		return NULL;
 
-	e = list_entry(n, struct lc_element, list);
+	return list_entry(n, struct lc_element, list);
+}
+
+static void lc_account_eviction(struct lru_cache *lc, struct lc_element *e)
+{
+	lc->evicted++;
+	if (lc->policy == LC_POLICY_2Q && !e->lc_frequent) {
+		lc->nr_once--;
+		lc_ghost_add(lc, e->lc_number);
+	}
+}
+
+static struct lc_element *lc_prepare_for_change(struct lru_cache *lc, unsigned new_number)
+{
+	struct lc_element *e = NULL;
+
+	/* Below the soft limit, or nothing to evict: take a free element */
+	if (!list_empty(&lc->free) && lc_nr_active(lc) < lc->max_active)
+		e = list_first_entry(&lc->free, struct lc_element, list);
+	if (!e)
+		e = lc_evict_candidate(lc);
+	if (!e && !list_empty(&lc->free))
+		e = list_first_entry(&lc->free, struct lc_element, list);
+	if (!e)
+		return NULL;
+
 	PARANOIA_LC_ELEMENT(lc, e);
 
-	e->lc_new_number = new_number;
+	if (e->lc_number == LC_FREE)
+		lc->nr_free--;
+	else
+		lc_account_eviction(lc, e);
+	if (lc->policy == LC_POLICY_2Q) {
+		e->lc_frequent = lc_ghost_test(lc, new_number);
+		if (e->lc_frequent)
+			lc->promoted++;
+		else
+			lc->nr_once++;
+	}
+
+	WRITE_ONCE(e->lc_new_number, new_number);
 	if (!hlist_unhashed(&e->colision))
-		__hlist_del(&e->colision);
-	hlist_add_head(&e->colision, lc_hash_slot(lc, new_number));
+		hlist_del_rcu(&e->colision);
+	hlist_add_head_rcu(&e->colision, lc_hash_slot(lc, new_number));
 	list_move(&e->list, &lc->to_be_changed);
 
 	return e;
@@ -327,7 +625,7 @@ static int lc_unused_element_available(struct lru_cache *lc)
 {
 	if (!list_empty(&lc->free))
 		return 1; /* something on the free list */
-	if (!list_empty(&lc->lru))
+	if (!list_empty(&lc->lru) || !list_empty(&lc->lru_once))
 		return 1;  /* something to evict */
 
 	return 0;
@@ -364,13 +662,13 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 				RETURN(NULL);
 			/* ... unless the caller is aware of the implications,
 			 * probably preparing a cumulative transaction. */
-			++e->refcnt;
+			atomic_inc(&e->refcnt);
 			++lc->hits;
 			RETURN(e);
 		}
 		/* else: lc_new_number == lc_number; a real hit. */
 		++lc->hits;
-		if (e->refcnt++ == 0)
+		if (atomic_inc_return(&e->refcnt) == 1)
 			lc->used++;
 		list_move(&e->list, &lc->in_use); /* Not evictable... */
 		RETURN(e);
@@ -411,7 +709,7 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 	BUG_ON(!e);
 
 	clear_bit(__LC_STARVING, &lc->flags);
-	BUG_ON(++e->refcnt != 1);
+	BUG_ON(atomic_inc_return(&e->refcnt) != 1);
 	lc->used++;
 	lc->pending_changes++;
 
@@ -520,7 +818,14 @@ void lc_committed(struct lru_cache *lc)
 	list_for_each_entry_safe(e, tmp, &lc->to_be_changed, list) {
 		/* count number of changes, not number of transactions */
 		++lc->changed;
-		e->lc_number = e->lc_new_number;
+		WRITE_ONCE(e->lc_number, e->lc_new_number);
+		if (e->lc_number == LC_FREE) {
+			/* retired by lc_retire_unused() */
+			lc->nr_retiring--;
+			lc->nr_free++;
+			list_move(&e->list, &lc->free);
+			continue;
+		}
 		list_move(&e->list, &lc->in_use);
 	}
 	lc->pending_changes = 0;
@@ -539,17 +844,20 @@ void lc_committed(struct lru_cache *lc)
  */
 unsigned int lc_put(struct lru_cache *lc, struct lc_element *e)
 {
+	unsigned int refcnt;
+
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
-	BUG_ON(e->refcnt == 0);
+	BUG_ON(atomic_read(&e->refcnt) == 0);
 	BUG_ON(e->lc_number != e->lc_new_number);
-	if (--e->refcnt == 0) {
+	refcnt = atomic_dec_return(&e->refcnt);
+	if (refcnt == 0) {
 		/* move it to the front of LRU. */
-		list_move(&e->list, &lc->lru);
+		list_move(&e->list, lc_unused_list(lc, e));
 		lc->used--;
 		clear_bit_unlock(__LC_STARVING, &lc->flags);
 	}
-	RETURN(e->refcnt);
+	RETURN(refcnt);
 }
 
 /**
@@ -594,14 +902,22 @@ void lc_set(struct lru_cache *lc, unsigned int enr, int index)
 
 	e = lc_element_by_index(lc, index);
 	BUG_ON(e->lc_number != e->lc_new_number);
-	BUG_ON(e->refcnt != 0);
-
+	BUG_ON(atomic_read(&e->refcnt) != 0);
+
+	if (e->lc_number != LC_FREE && !e->lc_frequent && lc->policy == LC_POLICY_2Q)
+		lc->nr_once--;
+	if (e->lc_number == LC_FREE && enr != LC_FREE)
+		lc->nr_free--;
+	else if (e->lc_number != LC_FREE && enr == LC_FREE)
+		lc->nr_free++;
 	e->lc_number = e->lc_new_number = enr;
-	hlist_del_init(&e->colision);
+	/* it has been in the active set before, treat it as frequent */
+	e->lc_frequent = true;
+	hlist_del_init_rcu(&e->colision);
 	if (enr == LC_FREE)
 		lh = &lc->free;
 	else {
-		hlist_add_head(&e->colision, lc_hash_slot(lc, enr));
+		hlist_add_head_rcu(&e->colision, lc_hash_slot(lc, enr));
 		lh = &lc->lru;
 	}
 	list_move(&e->list, lh);
@@ -628,10 +944,10 @@ void lc_seq_dump_details(struct seq_file *seq, struct lru_cache *lc, char *utext
 		e = lc_element_by_index(lc, i);
 		if (e->lc_number != e->lc_new_number)
 			seq_printf(seq, "\t%5d: %6d %8d %6d ",
-				i, e->lc_number, e->lc_new_number, e->refcnt);
+				i, e->lc_number, e->lc_new_number, atomic_read(&e->refcnt));
 		else
 			seq_printf(seq, "\t%5d: %6d %-8s %6d ",
-				i, e->lc_number, "-\"-", e->refcnt);
+				i, e->lc_number, "-\"-", atomic_read(&e->refcnt));
 		if (detail)
 			detail(seq, e);
 		seq_putc(seq, '\n');